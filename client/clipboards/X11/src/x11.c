@@ -19,9 +19,26 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "interface/clipboard.h"
 #include "common/debug.h"
+#include "common/locking.h"
 
 #include <X11/extensions/Xfixes.h>
 
+// the largest property written at once, bigger replies are sent INCR
+#define INCR_CHUNK_MAX (1024 * 1024)
+
+// a reply being sent INCR, a chunk is written each time the requestor
+// deletes the property until a zero length chunk ends it
+struct incrOut
+{
+  bool      active;
+  Window    requestor;
+  Atom      property;
+  Atom      target;
+  uint8_t * data;
+  size_t    size;
+  size_t    pos;
+};
+
 struct state
 {
   Display             * display;
@@ -39,8 +56,14 @@ struct state
   LG_ClipboardData      type;
 
   bool         incrStart;
+  bool         incrActive;
   unsigned int lowerBound;
 
+  // replies are made on the spice thread, the chunks on the event thread
+  LG_Lock        incrLock;
+  struct incrOut incrOut;
+  size_t         incrChunk;
+
   // XFixes vars
   int eventBase;
   int errorBase;
@@ -116,19 +139,138 @@ static bool x11_cb_init(
   XFixesSelectSelectionInput(this->display, this->window, XA_PRIMARY      , XFixesSetSelectionOwnerNotifyMask);
   XFixesSelectSelectionInput(this->display, this->window, this->aSelection, XFixesSetSelectionOwnerNotifyMask);
 
+  // leave room for the request header in the largest request the server takes
+  long maxRequest = XExtendedMaxRequestSize(this->display);
+  if (!maxRequest)
+    maxRequest = XMaxRequestSize(this->display);
+
+  this->incrChunk = (size_t)maxRequest * 4 - 1024;
+  if (this->incrChunk > INCR_CHUNK_MAX)
+    this->incrChunk = INCR_CHUNK_MAX;
+
+  LG_LOCK_INIT(this->incrLock);
   return true;
 }
 
+static void x11_cb_incr_out_end(struct incrOut * t, bool destroyed)
+{
+  if (!t->active)
+    return;
+
+  if (!destroyed)
+    XSelectInput(this->display, t->requestor, NoEventMask);
+  free(t->data);
+  memset(t, 0, sizeof(*t));
+}
+
 static void x11_cb_free()
 {
+  LG_LOCK(this->incrLock);
+  x11_cb_incr_out_end(&this->incrOut, false);
+  LG_UNLOCK(this->incrLock);
+  LG_LOCK_FREE(this->incrLock);
+
   free(this);
   this = NULL;
 }
 
+static bool x11_cb_reply_incr(XEvent * s, uint8_t * data, uint32_t size)
+{
+  uint8_t * copy = (uint8_t *)malloc(size);
+  if (!copy)
+  {
+    DEBUG_ERROR("Failed to allocate %u bytes for the INCR transfer", size);
+    return false;
+  }
+  memcpy(copy, data, size);
+
+  LG_LOCK(this->incrLock);
+
+  // only one transfer at a time, a new request replaces an unfinished one
+  if (this->incrOut.active)
+  {
+    DEBUG_WARN("Abandoning an unfinished INCR transfer");
+    x11_cb_incr_out_end(&this->incrOut, false);
+  }
+
+  this->incrOut = (struct incrOut)
+  {
+    .active    = true,
+    .requestor = s->xselection.requestor,
+    .property  = s->xselection.property,
+    .target    = s->xselection.target,
+    .data      = copy,
+    .size      = size,
+    .pos       = 0
+  };
+
+  // the requestor deleting the property asks for the next chunk, and if it
+  // goes away the transfer has to be dropped
+  XSelectInput(this->display, s->xselection.requestor,
+      PropertyChangeMask | StructureNotifyMask);
+
+  const long incrSize = size;
+  XChangeProperty(
+      this->display          ,
+      s->xselection.requestor,
+      s->xselection.property ,
+      this->aIncr            ,
+      32,
+      PropModeReplace,
+      (const unsigned char *)&incrSize,
+      1);
+
+  LG_UNLOCK(this->incrLock);
+  return true;
+}
+
+static void x11_cb_incr_out_next(const XPropertyEvent e)
+{
+  LG_LOCK(this->incrLock);
+  struct incrOut * t = &this->incrOut;
+  if (!t->active || e.window != t->requestor || e.atom != t->property)
+  {
+    LG_UNLOCK(this->incrLock);
+    return;
+  }
+
+  size_t len = t->size - t->pos;
+  if (len > this->incrChunk)
+    len = this->incrChunk;
+
+  XChangeProperty(
+      this->display,
+      t->requestor ,
+      t->property  ,
+      t->target    ,
+      8,
+      PropModeReplace,
+      t->data + t->pos,
+      len);
+
+  // the zero length chunk has gone, the transfer is complete
+  if (len == 0)
+    x11_cb_incr_out_end(t, false);
+  else
+    t->pos += len;
+
+  LG_UNLOCK(this->incrLock);
+  XFlush(this->display);
+}
+
 static void x11_cb_reply_fn(void * opaque, LG_ClipboardData type, uint8_t * data, uint32_t size)
 {
   XEvent *s = (XEvent *)opaque;
 
+  // too large for one request, the requestor pulls it a chunk at a time
+  if (size > this->incrChunk && x11_cb_reply_incr(s, data, size))
+  {
+    XSendEvent(this->display, s->xselection.requestor, 0, 0, s);
+    XFlush(this->display);
+    free(s);
+    return;
+  }
+
   XChangeProperty(
       this->display          ,
       s->xselection.requestor,
@@ -235,13 +377,15 @@ static void x11_cb_selection_incr(const XPropertyEvent e)
   unsigned long itemCount, after;
   unsigned char *data;
 
+  // each chunk is forwarded as it arrives, deleting the property asks the
+  // owner for the next one
   if (XGetWindowProperty(
       e.display,
       e.window,
       e.atom,
       0, ~0L, // start and length
       True,   // delete the property
-      this->aIncr,
+      AnyPropertyType,
       &type,
       &format,
       &itemCount,
@@ -249,8 +393,9 @@ static void x11_cb_selection_incr(const XPropertyEvent e)
       &data) != Success)
   {
     DEBUG_INFO("GetProp Failed");
+    this->incrActive = false;
     this->notifyFn(LG_CLIPBOARD_DATA_NONE, 0);
-    goto out;
+    return;
   }
 
   LG_ClipboardData dataType;
@@ -263,6 +408,7 @@ static void x11_cb_selection_incr(const XPropertyEvent e)
     DEBUG_WARN("clipboard data (%s) not in a supported format",
         XGetAtomName(this->display, type));
 
+    this->incrActive = false;
     this->lowerBound = 0;
     this->notifyFn(LG_CLIPBOARD_DATA_NONE, 0);
     goto out;
@@ -274,29 +420,38 @@ static void x11_cb_selection_incr(const XPropertyEvent e)
     this->incrStart = false;
   }
 
-  XFree(data);
-  data = NULL;
+  // the INCR size is only a lower bound but spice was told it up front
+  if (itemCount > this->lowerBound)
+  {
+    if (this->lowerBound)
+      DEBUG_WARN("INCR transfer larger than announced, truncating");
+    itemCount = this->lowerBound;
+  }
 
-  if (XGetWindowProperty(
-      e.display,
-      e.window,
-      e.atom,
-      0, ~0L, // start and length
-      True,   // delete the property
-      type,
-      &type,
-      &format,
-      &itemCount,
-      &after,
-      &data) != Success)
+  if (itemCount)
   {
-    DEBUG_ERROR("XGetWindowProperty Failed");
-    this->notifyFn(LG_CLIPBOARD_DATA_NONE, 0);
-    goto out;
+    this->dataFn(dataType, data, itemCount);
+    this->lowerBound -= itemCount;
   }
 
-  this->dataFn(dataType, data, itemCount);
-  this->lowerBound -= itemCount;
+  // a zero length chunk ends the transfer, pad out a short one so the
+  // guest is not left waiting for the rest
+  if (data && format && !after && itemCount == 0)
+  {
+    if (this->lowerBound)
+    {
+      DEBUG_WARN("INCR transfer ended %u bytes short", this->lowerBound);
+      uint8_t pad[4096] = { 0 };
+      while(this->lowerBound)
+      {
+        const unsigned int len = this->lowerBound < sizeof(pad) ?
+          this->lowerBound : sizeof(pad);
+        this->dataFn(dataType, pad, len);
+        this->lowerBound -= len;
+      }
+    }
+    this->incrActive = false;
+  }
 
 out:
   if (data)
@@ -333,7 +488,8 @@ static void x11_cb_selection_notify(const XSelectionEvent e)
   if (type == this->aIncr)
   {
     this->incrStart  = true;
-    this->lowerBound = *(unsigned int *)data;
+    this->incrActive = true;
+    this->lowerBound = *(unsigned long *)data;
     goto out;
   }
 
@@ -405,12 +561,28 @@ static void x11_cb_wmevent(SDL_SysWMmsg * msg)
       x11_cb_selection_notify(e.xselection);
       break;
 
+    case DestroyNotify:
+      LG_LOCK(this->incrLock);
+      if (this->incrOut.active &&
+          e.xdestroywindow.window == this->incrOut.requestor)
+        x11_cb_incr_out_end(&this->incrOut, true);
+      LG_UNLOCK(this->incrLock);
+      break;
+
     case PropertyNotify:
-      if (e.xproperty.display != this->display    ||
-          e.xproperty.window  != this->window     ||
-          e.xproperty.atom    != this->aSelData   ||
-          e.xproperty.state   != PropertyNewValue ||
-          this->lowerBound    == 0)
+      if (e.xproperty.display != this->display)
+        break;
+
+      if (e.xproperty.window != this->window)
+      {
+        if (e.xproperty.state == PropertyDelete)
+          x11_cb_incr_out_next(e.xproperty);
+        break;
+      }
+
+      if (e.xproperty.atom  != this->aSelData   ||
+          e.xproperty.state != PropertyNewValue ||
+          !this->incrActive)
         break;
 
       x11_cb_selection_incr(e.xproperty);
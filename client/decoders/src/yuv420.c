@@ -20,7 +20,6 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "interface/decoder.h"
 
 #include "common/debug.h"
-#include "common/memcpySSE.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -28,16 +27,10 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include <GL/gl.h>
 
-struct Pixel
-{
-  uint8_t b, g, r, a;
-};
-
 struct Inst
 {
   LG_RendererFormat  format;
-  struct Pixel     * pixels;
-  unsigned int       yBytes;
+  const uint8_t    * frame;
 };
 
 static bool            lgd_yuv420_create          (void ** opaque);
@@ -72,67 +65,46 @@ static bool lgd_yuv420_initialize(void * opaque, const LG_RendererFormat format,
 {
   struct Inst * this = (struct Inst *)opaque;
   memcpy(&this->format, &format, sizeof(LG_RendererFormat));
-
-  this->yBytes  = format.width * format.height;
-  this->pixels = malloc(sizeof(struct Pixel) * (format.width * format.height));
   return true;
 }
 
 static void lgd_yuv420_deinitialize(void * opaque)
 {
   struct Inst * this = (struct Inst *)opaque;
-  free(this->pixels);
+  this->frame = NULL;
 }
 
 static LG_OutFormat lgd_yuv420_get_out_format(void * opaque)
 {
-  return LG_OUTPUT_BGRA;
+  return LG_OUTPUT_YUV420;
 }
 
 static unsigned int lgd_yuv420_get_frame_pitch(void * opaque)
 {
   struct Inst * this = (struct Inst *)opaque;
-  return this->format.width * 4;
+  return this->format.pitch;
 }
 
 static unsigned int lgd_yuv420_get_frame_stride(void * opaque)
 {
   struct Inst * this = (struct Inst *)opaque;
-  return this->format.width;
+  return this->format.pitch;
 }
 
 static bool lgd_yuv420_decode(void * opaque, const uint8_t * src, size_t srcSize)
 {
-  //FIXME: implement this properly using GLSL
-
   struct Inst * this = (struct Inst *)opaque;
-  const unsigned int hw = this->format.width / 2;
-  const unsigned int hp = this->yBytes / 4;
-
-  for(size_t y = 0; y < this->format.height; ++y)
-    for(size_t x = 0; x < this->format.width; ++x)
-    {
-      const unsigned int yoff = y * this->format.width + x;
-      const unsigned int uoff = this->yBytes + ((y / 2) * hw + x / 2);
-      const unsigned int voff = uoff + hp;
-
-      float b = 1.164f * ((float)src[yoff] - 16.0f) + 2.018f * ((float)src[uoff] - 128.0f);
-      float g = 1.164f * ((float)src[yoff] - 16.0f) - 0.813f * ((float)src[voff] - 128.0f) - 0.391f * ((float)src[uoff] - 128.0f);
-      float r = 1.164f * ((float)src[yoff] - 16.0f) + 1.596f * ((float)src[voff] - 128.0f);
-
-      #define CLAMP(x) (x < 0 ? 0 : (x > 255 ? 255 : x))
-      this->pixels[yoff].b = CLAMP(b);
-      this->pixels[yoff].g = CLAMP(g);
-      this->pixels[yoff].r = CLAMP(r);
-    }
 
+  // the planes are passed through as they are for the renderer to convert on
+  // the GPU, the frame stays valid until the next decode
+  this->frame = src;
   return true;
 }
 
 static const uint8_t * lgd_yuv420_get_buffer(void * opaque)
 {
   struct Inst * this = (struct Inst *)opaque;
-  return (uint8_t *)this->pixels;
+  return this->frame;
 }
 
 bool lgd_yuv420_init_gl_texture(void * opaque, GLenum target, GLuint texture, void ** ref)
@@ -18,6 +18,7 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 
 #include "interface/font.h"
@@ -113,7 +114,13 @@ static LG_FontBitmap * lgf_sdl_render(LG_FontObj opaque, unsigned int fg_color,
   color.b = (fg_color & 0x0000ff00) >>  8;
   color.a = (fg_color & 0x000000ff) >>  0;
 
-  if (!(surface = TTF_RenderText_Blended(this->font, text, color)))
+  // the wrapped variant is only needed to break the text at new lines
+  if (strchr(text, '\n'))
+    surface = TTF_RenderText_Blended_Wrapped(this->font, text, color, 4096);
+  else
+    surface = TTF_RenderText_Blended(this->font, text, color);
+
+  if (!surface)
   {
     DEBUG_ERROR("Failed to render text: %s", TTF_GetError());
     return NULL;
@@ -143,11 +150,128 @@ static void lgf_sdl_release(LG_FontObj opaque, LG_FontBitmap * font)
   free(bitmap);
 }
 
+#define ATLAS_WIDTH 512
+
+static LG_FontAtlas * lgf_sdl_get_atlas(LG_FontObj opaque)
+{
+  struct Inst * this = (struct Inst *)opaque;
+  const SDL_Color white = { 0xff, 0xff, 0xff, 0xff };
+
+  LG_FontAtlas * out = calloc(1, sizeof(LG_FontAtlas));
+  if (!out)
+  {
+    DEBUG_ERROR("Failed to allocate memory for the font atlas");
+    return NULL;
+  }
+
+  // render each glyph on its own and lay them out in rows, a pixel apart so
+  // filtering never picks up the neighbouring glyph
+  SDL_Surface * glyphs[LG_FONT_ATLAS_COUNT] = { 0 };
+  unsigned int x = 1, y = 1, rowHeight = 0;
+  bool ok = true;
+
+  for(int i = 0; i < LG_FONT_ATLAS_COUNT; ++i)
+  {
+    const char    str[2] = { LG_FONT_ATLAS_FIRST + i, '\0' };
+    LG_FontGlyph * g     = &out->glyphs[i];
+
+    int advance;
+    if (TTF_GlyphMetrics(this->font, str[0], NULL, NULL, NULL, NULL,
+          &advance) == 0 && advance > 0)
+      g->advance = advance;
+
+    // a space has nothing to draw
+    if (str[0] == ' ')
+      continue;
+
+    if (!(glyphs[i] = TTF_RenderText_Blended(this->font, str, white)))
+    {
+      DEBUG_ERROR("Failed to render glyph '%c': %s", str[0], TTF_GetError());
+      ok = false;
+      goto out;
+    }
+
+    const unsigned int w = glyphs[i]->w;
+    const unsigned int h = glyphs[i]->h;
+    if (x + w + 1 > ATLAS_WIDTH)
+    {
+      x         = 1;
+      y        += rowHeight + 1;
+      rowHeight = 0;
+    }
+
+    g->x      = x;
+    g->y      = y;
+    g->width  = w;
+    g->height = h;
+
+    x += w + 1;
+    if (h > rowHeight)
+      rowHeight = h;
+  }
+
+  SDL_Surface * atlas = SDL_CreateRGBSurfaceWithFormat(0, ATLAS_WIDTH,
+      y + rowHeight + 1, 32, SDL_PIXELFORMAT_ARGB8888);
+  if (!atlas)
+  {
+    DEBUG_ERROR("Failed to create the atlas surface: %s", SDL_GetError());
+    ok = false;
+    goto out;
+  }
+
+  SDL_FillRect(atlas, NULL, 0);
+  for(int i = 0; i < LG_FONT_ATLAS_COUNT; ++i)
+  {
+    if (!glyphs[i])
+      continue;
+
+    SDL_Rect dst =
+    {
+      .x = out->glyphs[i].x,
+      .y = out->glyphs[i].y,
+      .w = out->glyphs[i].width,
+      .h = out->glyphs[i].height
+    };
+
+    // copy the coverage as it is rather than blending it onto nothing
+    SDL_SetSurfaceBlendMode(glyphs[i], SDL_BLENDMODE_NONE);
+    SDL_BlitSurface(glyphs[i], NULL, atlas, &dst);
+  }
+
+  out->reserved   = atlas;
+  out->width      = atlas->w;
+  out->height     = atlas->h;
+  out->bpp        = atlas->format->BytesPerPixel;
+  out->pixels     = atlas->pixels;
+  out->lineHeight = TTF_FontLineSkip(this->font);
+
+out:
+  for(int i = 0; i < LG_FONT_ATLAS_COUNT; ++i)
+    if (glyphs[i])
+      SDL_FreeSurface(glyphs[i]);
+
+  if (!ok)
+  {
+    free(out);
+    return NULL;
+  }
+
+  return out;
+}
+
+static void lgf_sdl_release_atlas(LG_FontObj opaque, LG_FontAtlas * atlas)
+{
+  SDL_FreeSurface(atlas->reserved);
+  free(atlas);
+}
+
 struct LG_Font LGF_SDL =
 {
-  .name         = "SDL",
-  .create       = lgf_sdl_create,
-  .destroy      = lgf_sdl_destroy,
-  .render       = lgf_sdl_render,
-  .release      = lgf_sdl_release
+  .name          = "SDL",
+  .create        = lgf_sdl_create,
+  .destroy       = lgf_sdl_destroy,
+  .render        = lgf_sdl_render,
+  .release       = lgf_sdl_release,
+  .get_atlas     = lgf_sdl_get_atlas,
+  .release_atlas = lgf_sdl_release_atlas
 };
\ No newline at end of file
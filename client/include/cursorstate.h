@@ -0,0 +1,68 @@
+/*
+KVMGFX Client - A KVM Client for VGA Passthrough
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "interface/renderer.h"
+
+/* The cursor as the host last described it, handed from the cursor thread to
+ * the render thread without locks. There must only be one thread setting it
+ * and one thread reading it. */
+typedef struct CursorState CursorState;
+
+typedef struct CursorInfo
+{
+  uint32_t serial;   // changes whenever anything below does
+  bool     visible;
+  int      x, y;
+  int      width, height;
+  int      shape;    // the cache ID of the current shape, -1 if there is none
+}
+CursorInfo;
+
+typedef struct CursorImage
+{
+  LG_RendererCursor type;
+  int               width;
+  int               height;
+  int               stride;
+  const uint8_t   * data;
+}
+CursorImage;
+
+bool cursorstate_new (CursorState ** cs);
+void cursorstate_free(CursorState ** cs);
+
+// called by the cursor thread, data is NULL if the shape is already cached
+bool cursorstate_set_shape(CursorState * cs, const LG_RendererCursor type,
+    const int width, const int height, const int stride, const uint8_t * data,
+    const unsigned int cacheID);
+void cursorstate_set_pos(CursorState * cs, const bool visible, const int x,
+    const int y);
+
+// called by the render thread
+void cursorstate_get(CursorState * cs, CursorInfo * info);
+
+// returns the image in the cache slot if it has been replaced since it was last
+// taken, otherwise NULL. It stays valid until the slot is taken again.
+const CursorImage * cursorstate_take_shape(CursorState * cs,
+    const unsigned int cacheID);
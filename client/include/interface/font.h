@@ -33,10 +33,39 @@ typedef struct LG_FontBitmap
 }
 LG_FontBitmap;
 
+// the characters an atlas holds, anything else is drawn as '?'
+#define LG_FONT_ATLAS_FIRST ' '
+#define LG_FONT_ATLAS_LAST  '~'
+#define LG_FONT_ATLAS_COUNT (LG_FONT_ATLAS_LAST - LG_FONT_ATLAS_FIRST + 1)
+
+typedef struct LG_FontGlyph
+{
+  unsigned int x, y, width, height; // the glyph's cell in the atlas
+  unsigned int advance;
+}
+LG_FontGlyph;
+
+// every glyph rendered once in white, so text can be built from quads of it
+// and tinted when drawn instead of rasterised again when it changes
+typedef struct LG_FontAtlas
+{
+  void * reserved;
+
+  unsigned int width, height;
+  unsigned int bpp; // bytes per pixel
+  uint8_t      * pixels;
+
+  unsigned int lineHeight;
+  LG_FontGlyph glyphs[LG_FONT_ATLAS_COUNT];
+}
+LG_FontAtlas;
+
 typedef bool            (* LG_FontCreate      )(LG_FontObj * opaque, const char * font_name, unsigned int size);
 typedef void            (* LG_FontDestroy     )(LG_FontObj opaque);
 typedef LG_FontBitmap * (* LG_FontRender      )(LG_FontObj opaque, unsigned int fg_color, const char * text);
 typedef void            (* LG_FontRelease     )(LG_FontObj opaque, LG_FontBitmap * bitmap);
+typedef LG_FontAtlas *  (* LG_FontGetAtlas    )(LG_FontObj opaque);
+typedef void            (* LG_FontReleaseAtlas)(LG_FontObj opaque, LG_FontAtlas * atlas);
 
 typedef struct LG_Font
 {
@@ -46,5 +75,7 @@ typedef struct LG_Font
   LG_FontDestroy      destroy;
   LG_FontRender       render;
   LG_FontRelease      release;
+  LG_FontGetAtlas     get_atlas;
+  LG_FontReleaseAtlas release_atlas;
 }
 LG_Font;
\ No newline at end of file
@@ -20,6 +20,7 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
@@ -42,18 +43,38 @@ Place, Suite 330, Boston, MA 02111-1307 USA
    (x)->render         && \
    (x)->update_fps)
 
+// a frame held by the renderer after on_frame_acquire
+typedef uint32_t LG_RendererFrameHandle;
+
+// the milliseconds a renderer may hold a frame before it is released for it,
+// so a stalled renderer can not hold the host up
+#define LG_FRAME_HOLD_TIMEOUT 100
+
 typedef struct LG_RendererParams
 {
 //  TTF_Font * font;
 //  TTF_Font * alertFont;
   bool       showFPS;
   bool       quickSplash;
+  bool       headless; // draw offscreen, there is no display and no vsync
+
+  // optional, reads the newest cursor position as the cursor is drawn
+  bool (*latchCursor)(bool * visible, int * x, int * y);
+
+  // the other VMs shown alongside the desktop, see on_tile_format
+  unsigned int tiles;
+
+  // release a frame given to on_frame_acquire, may be called from any thread.
+  // The host can not reuse the buffer and no further frame is given until the
+  // frame is released
+  void (*releaseFrame)(LG_RendererFrameHandle handle);
 }
 LG_RendererParams;
 
 typedef enum LG_RendererSupport
 {
-  LG_SUPPORTS_DMABUF
+  LG_SUPPORTS_DMABUF,
+  LG_SUPPORTS_PRESENT_FEEDBACK // get_presented reports when frames reach the screen
 }
 LG_RendererSupport;
 
@@ -62,6 +83,8 @@ typedef struct LG_RendererFormat
   FrameType    type;    // frame type
   unsigned int width;   // image width
   unsigned int height;  // image height
+  unsigned int screenWidth;  // desktop width, larger than width if the host scaled the frame
+  unsigned int screenHeight; // desktop height, larger than height if the host scaled the frame
   unsigned int stride;  // scanline width (zero if compresed)
   unsigned int pitch;   // scanline bytes (or compressed size)
   unsigned int bpp;     // bits per pixel (zero if compressed)
@@ -78,6 +101,35 @@ typedef struct LG_RendererRect
 }
 LG_RendererRect;
 
+// the distribution of a per frame time in milliseconds, negative if there
+// were no samples
+typedef struct LG_RendererTiming
+{
+  float p50, p99, max;
+}
+LG_RendererTiming;
+
+// the average latency of each stage of the pipeline in milliseconds, negative
+// if the stage could not be measured
+typedef struct LG_RendererLatency
+{
+  float capture;  // guest present to the host capture completing
+  float post;     // host capture completing to the frame being posted
+  float transfer; // host post to the client receiving the frame
+  float upload;   // client receiving the frame to the upload completing
+  float present;  // upload completing to the frame being presented
+
+  // averages hide stutter, these show the spread over the same period
+  LG_RendererTiming uploadTime; // as upload above
+  LG_RendererTiming frameAge;   // host capture to the frame being presented
+  LG_RendererTiming interval;   // between new frames being presented
+  LG_RendererTiming draw;       // the renderer drawing and presenting a frame
+  unsigned int      dropped;    // frames replaced before they were presented
+  unsigned int      skipped;    // frames passed over without being uploaded
+  unsigned int      repeated;   // presents without a new frame
+}
+LG_RendererLatency;
+
 typedef enum LG_RendererCursor
 {
   LG_CURSOR_COLOR       ,
@@ -96,15 +148,30 @@ typedef bool         (* LG_RendererCreate       )(void ** opaque, const LG_Rende
 typedef bool         (* LG_RendererInitialize   )(void * opaque, Uint32 * sdlFlags);
 typedef void         (* LG_RendererDeInitialize )(void * opaque);
 typedef bool         (* LG_RendererSupports     )(void * opaque, LG_RendererSupport support);
+typedef uint32_t     (* LG_RendererFrameTypes   )(void * opaque, FrameType * preferred);
 typedef void         (* LG_RendererOnRestart    )(void * opaque);
 typedef void         (* LG_RendererOnResize     )(void * opaque, const int width, const int height, const LG_RendererRect destRect);
-typedef bool         (* LG_RendererOnMouseShape )(void * opaque, const LG_RendererCursor cursor, const int width, const int height, const int pitch, const uint8_t * data);
+// data is NULL if the shape was already given for cacheID
+typedef bool         (* LG_RendererOnMouseShape )(void * opaque, const LG_RendererCursor cursor, const int width, const int height, const int pitch, const uint8_t * data, const unsigned int cacheID);
 typedef bool         (* LG_RendererOnMouseEvent )(void * opaque, const bool visible , const int x, const int y);
 typedef bool         (* LG_RendererOnFrameFormat)(void * opaque, const LG_RendererFormat format, bool useDMA);
-typedef bool         (* LG_RendererOnFrame      )(void * opaque, const FrameBuffer * frame, int dmaFD);
+typedef bool         (* LG_RendererOnFrame      )(void * opaque, const FrameBuffer * frame, int dmaFD, const FrameDamageRect * damageRects, int damageRectsCount);
+// as on_frame but the frame may be read until it is released with
+// LG_RendererParams.releaseFrame, so it can be sampled in place instead of
+// copied before returning
+typedef bool         (* LG_RendererOnFrameAcquire)(void * opaque, const LG_RendererFrameHandle handle, const FrameBuffer * frame, int dmaFD, const FrameDamageRect * damageRects, int damageRectsCount);
 typedef void         (* LG_RendererOnAlert      )(void * opaque, const LG_MsgAlert alert, const char * message, bool ** closeFlag);
 typedef bool         (* LG_RendererRender       )(void * opaque, SDL_Window *window);
-typedef void         (* LG_RendererUpdateFPS    )(void * opaque, const float avgUPS, const float avgFPS);
+typedef bool         (* LG_RendererNeedsRender  )(void * opaque);
+// returns the oldest present feedback not yet returned: the number of the
+// render it is for counting from one, when it reached the screen in microtime
+// (zero if it never did) and the refresh period in microseconds (zero if unknown)
+typedef bool         (* LG_RendererGetPresented )(void * opaque, uint64_t * render, uint64_t * presentTime, uint64_t * refresh);
+typedef void         (* LG_RendererUpdateFPS    )(void * opaque, const float avgUPS, const float avgFPS, const LG_RendererLatency * latency);
+// the mosaic tiles are called from a thread of their own for each tile and
+// are always given the whole frame
+typedef bool         (* LG_RendererOnTileFormat )(void * opaque, const unsigned int tile, const LG_RendererFormat format);
+typedef bool         (* LG_RendererOnTileFrame  )(void * opaque, const unsigned int tile, const FrameBuffer * frame);
 
 typedef struct LG_Renderer
 {
@@ -115,15 +182,130 @@ typedef struct LG_Renderer
   LG_RendererInitialize     initialize;
   LG_RendererDeInitialize   deinitialize;
   LG_RendererSupports       supports;
+  LG_RendererFrameTypes     frame_types; // optional, returns a mask of 1 << FrameType that can be shown natively
   LG_RendererOnRestart      on_restart;
   LG_RendererOnResize       on_resize;
   LG_RendererOnMouseShape   on_mouse_shape;
   LG_RendererOnMouseEvent   on_mouse_event;
   LG_RendererOnFrameFormat  on_frame_format;
   LG_RendererOnFrame        on_frame;
+  LG_RendererOnFrameAcquire on_frame_acquire; // optional, used over on_frame
   LG_RendererOnAlert        on_alert;
   LG_RendererRender         render_startup;
   LG_RendererRender         render;
+  LG_RendererNeedsRender    needs_render; // optional, false if the last render is still current
+  LG_RendererGetPresented   get_presented; // optional, see LG_SUPPORTS_PRESENT_FEEDBACK
   LG_RendererUpdateFPS      update_fps;
+  LG_RendererOnTileFormat   on_tile_format; // optional, see LG_RendererParams.tiles
+  LG_RendererOnTileFrame    on_tile_frame;  // optional, with on_tile_format
 }
 LG_Renderer;
+
+/**
+ * The window area of a cell of the mosaic, the desktop is cell zero and the
+ * tiles follow it in rows as near to square as the count allows
+ */
+static inline LG_RendererRect LG_RendererMosaicCell(const unsigned int cells,
+    const unsigned int index, const int width, const int height)
+{
+  unsigned int cols = 1;
+  while(cols * cols < cells)
+    ++cols;
+  const unsigned int rows = (cells + cols - 1) / cols;
+
+  const int col = index % cols;
+  const int row = index / cols;
+
+  LG_RendererRect rect;
+  rect.valid = true;
+  rect.x     = width  * col / (int)cols;
+  rect.y     = height * row / (int)rows;
+  rect.w     = width  * (col + 1) / (int)cols - rect.x;
+  rect.h     = height * (row + 1) / (int)rows - rect.y;
+  return rect;
+}
+
+/**
+ * Fit the source into the rect keeping its aspect
+ */
+static inline LG_RendererRect LG_RendererFitRect(const LG_RendererRect rect,
+    const unsigned int srcW, const unsigned int srcH)
+{
+  LG_RendererRect fit = rect;
+  if (!srcW || !srcH)
+    return fit;
+
+  if ((uint64_t)rect.w * srcH > (uint64_t)rect.h * srcW)
+  {
+    fit.w = (int)((uint64_t)rect.h * srcW / srcH);
+    fit.x = rect.x + (rect.w - fit.w) / 2;
+  }
+  else
+  {
+    fit.h = (int)((uint64_t)rect.w * srcH / srcW);
+    fit.y = rect.y + (rect.h - fit.h) / 2;
+  }
+  return fit;
+}
+
+/**
+ * Format the FPS and latency text shown by the renderers
+ */
+static inline void LG_RendererFormatFPS(char * str, size_t size,
+    const float avgUPS, const float avgFPS, const LG_RendererLatency * latency)
+{
+  int len = snprintf(str, size, "UPS: %8.4f, FPS: %8.4f", avgUPS, avgFPS);
+  if (!latency || len < 0 || (size_t)len >= size)
+    return;
+
+  const float values[] =
+  {
+    latency->capture,
+    latency->post,
+    latency->transfer,
+    latency->upload,
+    latency->present
+  };
+  const char * names[] = { "Cap", "Post", "Xfer", "Upl", "Pres" };
+
+  for(int i = 0; i < sizeof(values) / sizeof(*values); ++i)
+  {
+    int ret;
+    if (values[i] < 0.0f)
+      ret = snprintf(str + len, size - len, ", %s: -", names[i]);
+    else
+      ret = snprintf(str + len, size - len, ", %s: %.2fms", names[i], values[i]);
+
+    if (ret < 0 || (size_t)(len + ret) >= size)
+      return;
+    len += ret;
+  }
+
+  const LG_RendererTiming * timings[] =
+  {
+    &latency->uploadTime,
+    &latency->frameAge,
+    &latency->interval,
+    &latency->draw
+  };
+  const char * timingNames[] = { "Upl", "Age", "Int", "Draw" };
+
+  for(int i = 0; i < sizeof(timings) / sizeof(*timings); ++i)
+  {
+    const char * sep = i == 0 ? "\n" : ", ";
+    const LG_RendererTiming * t = timings[i];
+    int ret;
+    if (t->p50 < 0.0f)
+      ret = snprintf(str + len, size - len, "%s%s: -", sep, timingNames[i]);
+    else
+      ret = snprintf(str + len, size - len, "%s%s: %.2f/%.2f/%.2fms", sep,
+          timingNames[i], t->p50, t->p99, t->max);
+
+    if (ret < 0 || (size_t)(len + ret) >= size)
+      return;
+    len += ret;
+  }
+
+  snprintf(str + len, size - len, " (p50/p99/max), Drop: %u, Skip: %u, Rep: %u",
+      latency->dropped, latency->skipped, latency->repeated);
+}
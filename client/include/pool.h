@@ -0,0 +1,58 @@
+/*
+KVMGFX Client - A KVM Client for VGA Passthrough
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// a thread safe pool of fixed size objects, freed objects are kept for reuse
+// so once a pool is large enough getting an object does not touch the heap
+struct pool;
+
+struct pool * pool_new (size_t size, unsigned int count);
+void          pool_free(struct pool * pool);
+void *        pool_get (struct pool * pool);
+void          pool_put (struct pool * pool, void * obj);
+
+// the pool blocks and list items allocated on the calling thread
+unsigned int pool_thread_pool_allocs();
+void         pool_count_pool_alloc();
+
+// the calls to malloc, calloc and realloc made by the calling thread. This is
+// only counted in builds that define COUNT_ALLOCS and wrap the allocator when
+// linking, elsewhere it is always zero
+unsigned int pool_thread_heap_allocs();
+
+// the frames a thread runs after a reset before it must stop allocating
+#define POOL_STEADY_FRAMES 120
+
+// asserts in debug builds that a thread does not allocate in a frame once it
+// has run POOL_STEADY_FRAMES frames since the last reset. Where the heap is
+// counted this covers every allocation the client's own code makes, otherwise
+// only the growth of the pools and lists is seen
+struct PoolSteady
+{
+  unsigned int frames;
+  unsigned int poolAllocs;
+  unsigned int heapAllocs;
+};
+
+void pool_steady_reset(struct PoolSteady * steady);
+void pool_steady_frame(struct PoolSteady * steady);
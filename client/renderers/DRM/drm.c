@@ -0,0 +1,1220 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "interface/renderer.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "common/debug.h"
+#include "common/option.h"
+#include "common/framebuffer.h"
+#include "common/locking.h"
+
+// imported frames for the current and last format plus the staging buffers
+#define FB_MAX (LGMP_Q_FRAME_LEN * 2 + STAGING_COUNT)
+
+// one on screen, one queued to flip and one being written
+#define STAGING_COUNT 3
+
+// how long to wait for a flip before giving up on it
+#define FLIP_TIMEOUT 100
+
+static struct Option drm_options[] =
+{
+  {
+    .module         = "drm",
+    .name           = "device",
+    .description    = "The DRM device to take over",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "/dev/dri/card0"
+  },
+  {
+    .module         = "drm",
+    .name           = "connector",
+    .description    = "The connector to use, eg HDMI-A-1 (blank for the first connected)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = ""
+  },
+  {0}
+};
+
+struct FB
+{
+  bool         used;
+  unsigned int gen;
+  const void * key;    // the frame data for imports, NULL for staging buffers
+  uint32_t     fbId;
+  uint32_t     handle;
+  bool         dumb;
+  uint8_t    * map;
+  size_t       size;
+  uint32_t     pitch;
+};
+
+struct Props
+{
+  uint32_t fbId, crtcId;
+  uint32_t srcX, srcY, srcW, srcH;
+  uint32_t crtcX, crtcY, crtcW, crtcH;
+};
+
+struct Cursor
+{
+  uint32_t   fbId;
+  uint32_t   handle;
+  uint32_t * map;
+  size_t     size;
+  uint32_t   pitch;
+};
+
+struct Inst
+{
+  LG_RendererParams params;
+
+  int               fd;
+  uint32_t          connectorId;
+  uint32_t          crtcId;
+  drmModeModeInfo   mode;
+  uint32_t          modeBlob;
+  drmModeCrtc     * savedCrtc;
+  bool              modeSet;
+
+  uint32_t          connCrtcId, crtcModeId, crtcActive;
+  uint32_t          primaryPlane, cursorPlane;
+  struct Props      primaryProps, cursorProps;
+
+  // not every primary plane takes XBGR8888, RGBA frames are then swizzled
+  // into XRGB8888 as they are copied
+  bool              primaryXBGR;
+
+  // the plane may not scale, the frame is then shown 1:1 in the middle
+  bool              scale;
+  LG_RendererRect   dest;
+
+  // shared with the frame thread, guarded by lock
+  LG_Lock           lock;
+  LG_RendererFormat format;
+  unsigned int      gen;
+  bool              formatChanged;
+  bool              swizzle;
+  struct FB         fbs[FB_MAX];
+  int               pending, queued, displayed;
+  atomic_bool       dmaFailed;
+
+  bool              flipPending;
+
+  // the cursor plane is double buffered so a new shape doesn't tear
+  uint64_t          cursorW, cursorH;
+  struct Cursor     cursors[2];
+  int               cursorIndex;
+
+  LG_Lock           cursorLock;
+  uint32_t        * cursorData;
+  size_t            cursorDataSize;
+  int               cursorWidth, cursorHeight;
+  bool              cursorUpdate;
+  bool              cursorVisible;
+  int               cursorX, cursorY;
+  atomic_bool       cursorMoved;
+};
+
+const char * drm_get_name()
+{
+  return "DRM";
+}
+
+void drm_setup()
+{
+  option_register(drm_options);
+}
+
+bool drm_create(void ** opaque, const LG_RendererParams params)
+{
+  // create our local storage
+  *opaque = malloc(sizeof(struct Inst));
+  if (!*opaque)
+  {
+    DEBUG_INFO("Failed to allocate %lu bytes", sizeof(struct Inst));
+    return false;
+  }
+  memset(*opaque, 0, sizeof(struct Inst));
+
+  struct Inst * this = (struct Inst *)*opaque;
+  memcpy(&this->params, &params, sizeof(LG_RendererParams));
+
+  this->fd        = -1;
+  this->pending   = -1;
+  this->queued    = -1;
+  this->displayed = -1;
+
+  LG_LOCK_INIT(this->lock);
+  LG_LOCK_INIT(this->cursorLock);
+  return true;
+}
+
+bool drm_initialize(void * opaque, Uint32 * sdlFlags)
+{
+  // the window is only used for input, nothing is drawn to it
+  *sdlFlags = 0;
+  return true;
+}
+
+static bool drm_create_dumb(struct Inst * this, uint32_t width, uint32_t height,
+    uint32_t bpp, uint32_t * handle, uint32_t * pitch, size_t * size,
+    void ** map)
+{
+  struct drm_mode_create_dumb create =
+  {
+    .width  = width,
+    .height = height,
+    .bpp    = bpp
+  };
+
+  if (drmIoctl(this->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0)
+  {
+    DEBUG_ERROR("Failed to create a dumb buffer: %s", strerror(errno));
+    return false;
+  }
+
+  struct drm_mode_map_dumb mapReq = { .handle = create.handle };
+  if (drmIoctl(this->fd, DRM_IOCTL_MODE_MAP_DUMB, &mapReq) < 0)
+  {
+    DEBUG_ERROR("Failed to map a dumb buffer: %s", strerror(errno));
+    goto fail;
+  }
+
+  *map = mmap(NULL, create.size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd,
+      mapReq.offset);
+  if (*map == MAP_FAILED)
+  {
+    DEBUG_ERROR("Failed to mmap a dumb buffer: %s", strerror(errno));
+    goto fail;
+  }
+
+  *handle = create.handle;
+  *pitch  = create.pitch;
+  *size   = create.size;
+  return true;
+
+fail:
+  {
+    struct drm_mode_destroy_dumb destroy = { .handle = create.handle };
+    drmIoctl(this->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+  }
+  return false;
+}
+
+static void drm_free_fb(struct Inst * this, struct FB * fb)
+{
+  if (fb->fbId)
+    drmModeRmFB(this->fd, fb->fbId);
+
+  if (fb->map)
+    munmap(fb->map, fb->size);
+
+  if (fb->handle)
+  {
+    if (fb->dumb)
+    {
+      struct drm_mode_destroy_dumb destroy = { .handle = fb->handle };
+      drmIoctl(this->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    }
+    else
+    {
+      struct drm_gem_close close = { .handle = fb->handle };
+      drmIoctl(this->fd, DRM_IOCTL_GEM_CLOSE, &close);
+    }
+  }
+
+  memset(fb, 0, sizeof(*fb));
+}
+
+static void drm_free_cursor(struct Inst * this, struct Cursor * cursor)
+{
+  if (cursor->fbId)
+    drmModeRmFB(this->fd, cursor->fbId);
+
+  if (cursor->map)
+    munmap(cursor->map, cursor->size);
+
+  if (cursor->handle)
+  {
+    struct drm_mode_destroy_dumb destroy = { .handle = cursor->handle };
+    drmIoctl(this->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+  }
+
+  memset(cursor, 0, sizeof(*cursor));
+}
+
+void drm_deinitialize(void * opaque)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  if (this->fd >= 0)
+  {
+    // put back what was on the screen before us
+    if (this->savedCrtc)
+    {
+      drmModeSetCrtc(this->fd, this->savedCrtc->crtc_id,
+          this->savedCrtc->buffer_id, this->savedCrtc->x, this->savedCrtc->y,
+          &this->connectorId, 1, &this->savedCrtc->mode);
+      drmModeFreeCrtc(this->savedCrtc);
+    }
+
+    for(int i = 0; i < FB_MAX; ++i)
+      if (this->fbs[i].used)
+        drm_free_fb(this, &this->fbs[i]);
+
+    for(int i = 0; i < 2; ++i)
+      drm_free_cursor(this, &this->cursors[i]);
+
+    if (this->modeBlob)
+      drmModeDestroyPropertyBlob(this->fd, this->modeBlob);
+
+    drmDropMaster(this->fd);
+    close(this->fd);
+  }
+
+  free(this->cursorData);
+  LG_LOCK_FREE(this->lock);
+  LG_LOCK_FREE(this->cursorLock);
+  free(this);
+}
+
+bool drm_supports(void * opaque, LG_RendererSupport flag)
+{
+  switch(flag)
+  {
+    case LG_SUPPORTS_DMABUF:
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+static uint32_t drm_fourcc(FrameType type)
+{
+  switch(type)
+  {
+    case FRAME_TYPE_BGRA   : return DRM_FORMAT_XRGB8888;
+    case FRAME_TYPE_RGBA   : return DRM_FORMAT_XBGR8888;
+    case FRAME_TYPE_RGBA10 : return DRM_FORMAT_XBGR2101010;
+#ifdef DRM_FORMAT_XBGR16161616F
+    case FRAME_TYPE_RGBA16F: return DRM_FORMAT_XBGR16161616F;
+#endif
+    default:
+      return 0;
+  }
+}
+
+uint32_t drm_frame_types(void * opaque, FrameType * preferred)
+{
+  // the frames are scanned out as is, there is nothing to convert YUV or to
+  // map linear scRGB so HDR frames are packed to RGBA10 by the host
+  *preferred = FRAME_TYPE_BGRA;
+  return
+    (1U << FRAME_TYPE_BGRA   ) |
+    (1U << FRAME_TYPE_RGBA   ) |
+    (1U << FRAME_TYPE_RGBA10 );
+}
+
+void drm_on_restart(void * opaque)
+{
+}
+
+void drm_on_resize(void * opaque, const int width, const int height, const LG_RendererRect destRect)
+{
+  // the output is the size of the mode, not of the window
+}
+
+bool drm_on_mouse_shape(void * opaque, const LG_RendererCursor cursor, const int width, const int height, const int pitch, const uint8_t * data, const unsigned int cacheID)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  // we don't keep a cache of shapes, a repeat of the last one needs nothing
+  if (!data)
+    return true;
+
+  const int h = cursor == LG_CURSOR_MONOCHROME ? height / 2 : height;
+  const size_t size = (size_t)width * h * sizeof(uint32_t);
+
+  LG_LOCK(this->cursorLock);
+  if (size > this->cursorDataSize)
+  {
+    free(this->cursorData);
+    this->cursorData = (uint32_t *)malloc(size);
+    if (!this->cursorData)
+    {
+      this->cursorDataSize = 0;
+      LG_UNLOCK(this->cursorLock);
+      DEBUG_ERROR("Failed to malloc buffer for cursor shape");
+      return false;
+    }
+    this->cursorDataSize = size;
+  }
+
+  // the cursor plane can't invert what is under it, inverted pixels are
+  // drawn in black so they are still seen
+  uint32_t * dst = this->cursorData;
+  for(int y = 0; y < h; ++y)
+    for(int x = 0; x < width; ++x, ++dst)
+    {
+      switch(cursor)
+      {
+        case LG_CURSOR_COLOR:
+          *dst = ((const uint32_t *)(data + pitch * y))[x];
+          break;
+
+        case LG_CURSOR_MASKED_COLOR:
+        {
+          const uint32_t c = ((const uint32_t *)(data + pitch * y))[x];
+          if (!(c & 0xFF000000))
+            *dst = c | 0xFF000000;
+          else
+            *dst = (c & 0x00FFFFFF) ? 0xFF000000 : 0x00000000;
+          break;
+        }
+
+        case LG_CURSOR_MONOCHROME:
+        {
+          const uint8_t * srcAnd = data + pitch * y + (x / 8);
+          const uint8_t * srcXor = srcAnd + pitch * h;
+          const uint8_t   mask   = 0x80 >> (x % 8);
+          const bool      and    = *srcAnd & mask;
+          const bool      xor    = *srcXor & mask;
+
+          if (!and)
+            *dst = xor ? 0xFFFFFFFF : 0xFF000000;
+          else
+            *dst = xor ? 0xFF000000 : 0x00000000;
+          break;
+        }
+      }
+    }
+
+  this->cursorWidth  = width;
+  this->cursorHeight = h;
+  this->cursorUpdate = true;
+  LG_UNLOCK(this->cursorLock);
+
+  atomic_store(&this->cursorMoved, true);
+  return true;
+}
+
+bool drm_on_mouse_event(void * opaque, const bool visible, const int x, const int y)
+{
+  struct Inst * this = (struct Inst *)opaque;
+  this->cursorVisible = visible;
+  this->cursorX       = x;
+  this->cursorY       = y;
+  atomic_store(&this->cursorMoved, true);
+  return true;
+}
+
+bool drm_on_frame_format(void * opaque, const LG_RendererFormat format, bool useDMA)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  if (!drm_fourcc(format.type))
+  {
+    DEBUG_ERROR("Unsupported frame type: %s", FrameTypeStr[format.type]);
+    return false;
+  }
+
+  // the buffers of the last format are freed once they are off the screen
+  LG_LOCK(this->lock);
+  memcpy(&this->format, &format, sizeof(LG_RendererFormat));
+  this->swizzle       = format.type == FRAME_TYPE_RGBA && !this->primaryXBGR;
+  this->pending       = -1;
+  this->formatChanged = true;
+  ++this->gen;
+  LG_UNLOCK(this->lock);
+  return true;
+}
+
+// called with the lock held
+static int drm_alloc_fb(struct Inst * this)
+{
+  for(int i = 0; i < FB_MAX; ++i)
+    if (!this->fbs[i].used)
+    {
+      this->fbs[i].used = true;
+      this->fbs[i].gen  = this->gen;
+      return i;
+    }
+  return -1;
+}
+
+static bool drm_add_fb(struct Inst * this, struct FB * fb, uint32_t pitch)
+{
+  const uint32_t handles[4] = { fb->handle };
+  const uint32_t pitches[4] = { pitch      };
+  const uint32_t offsets[4] = { 0          };
+
+  const uint32_t fourcc = this->swizzle ?
+    DRM_FORMAT_XRGB8888 : drm_fourcc(this->format.type);
+
+  if (drmModeAddFB2(this->fd, this->format.width, this->format.height,
+        fourcc, handles, pitches, offsets, &fb->fbId, 0) != 0)
+  {
+    DEBUG_ERROR("drmModeAddFB2 failed: %s", strerror(errno));
+    fb->fbId = 0;
+    return false;
+  }
+
+  fb->pitch = pitch;
+  return true;
+}
+
+static void drm_publish(struct Inst * this, int index)
+{
+  LG_LOCK(this->lock);
+  this->pending = index;
+  LG_UNLOCK(this->lock);
+}
+
+// use the DMA-BUF as the scanout buffer directly
+static bool drm_on_dma_frame(struct Inst * this, const FrameBuffer * frame,
+    int dmaFd)
+{
+  const void * key = framebuffer_get_data(frame);
+
+  LG_LOCK(this->lock);
+  int index = -1;
+  for(int i = 0; i < FB_MAX; ++i)
+  {
+    struct FB * fb = &this->fbs[i];
+    if (fb->used && fb->gen == this->gen && fb->key == key)
+    {
+      index = i;
+      break;
+    }
+  }
+
+  bool import = false;
+  if (index < 0)
+  {
+    if ((index = drm_alloc_fb(this)) < 0)
+    {
+      LG_UNLOCK(this->lock);
+      DEBUG_ERROR("Out of frame buffers");
+      return false;
+    }
+    this->fbs[index].key = key;
+    import = true;
+  }
+  LG_UNLOCK(this->lock);
+
+  if (import)
+  {
+    struct FB * fb = &this->fbs[index];
+    if (drmPrimeFDToHandle(this->fd, dmaFd, &fb->handle) != 0 ||
+        !drm_add_fb(this, fb, this->format.pitch))
+    {
+      DEBUG_WARN("Failed to import the DMA-BUF, falling back to a copy");
+      atomic_store(&this->dmaFailed, true);
+
+      LG_LOCK(this->lock);
+      drm_free_fb(this, fb);
+      LG_UNLOCK(this->lock);
+      return false;
+    }
+  }
+
+  // the buffer is scanned out as is, it must be complete
+  if (!framebuffer_wait(frame, (size_t)this->format.height * this->format.pitch))
+  {
+    DEBUG_ERROR("Failed to wait for the framebuffer");
+    return false;
+  }
+
+  drm_publish(this, index);
+  return true;
+}
+
+// copy the frame into a buffer that is not on, or about to be on, the screen
+static bool drm_on_copy_frame(struct Inst * this, const FrameBuffer * frame)
+{
+  LG_LOCK(this->lock);
+  int index = -1;
+  int count = 0;
+  for(int i = 0; i < FB_MAX; ++i)
+  {
+    struct FB * fb = &this->fbs[i];
+    if (!fb->used || fb->gen != this->gen || !fb->dumb)
+      continue;
+
+    ++count;
+    if (i != this->displayed && i != this->queued && i != this->pending)
+    {
+      index = i;
+      break;
+    }
+  }
+
+  bool create = false;
+  if (index < 0 && count < STAGING_COUNT)
+  {
+    if ((index = drm_alloc_fb(this)) < 0)
+    {
+      LG_UNLOCK(this->lock);
+      DEBUG_ERROR("Out of frame buffers");
+      return false;
+    }
+    this->fbs[index].dumb = true;
+    create = true;
+  }
+  LG_UNLOCK(this->lock);
+
+  if (index < 0)
+  {
+    DEBUG_ERROR("No free staging buffer");
+    return false;
+  }
+
+  struct FB * fb = &this->fbs[index];
+  if (create)
+  {
+    uint32_t pitch;
+    void   * map;
+    if (!drm_create_dumb(this, this->format.width, this->format.height,
+          this->format.bpp, &fb->handle, &pitch, &fb->size, &map))
+    {
+      LG_LOCK(this->lock);
+      drm_free_fb(this, fb);
+      LG_UNLOCK(this->lock);
+      return false;
+    }
+
+    fb->map  = (uint8_t *)map;
+    fb->dumb = true;
+    if (!drm_add_fb(this, fb, pitch))
+    {
+      LG_LOCK(this->lock);
+      drm_free_fb(this, fb);
+      LG_UNLOCK(this->lock);
+      return false;
+    }
+  }
+
+  bool ok;
+  if (this->swizzle)
+    ok = framebuffer_read_convert(frame, fb->map, fb->pitch,
+        this->format.height, this->format.width, this->format.pitch,
+        COPY_CONVERT_SWIZZLE);
+  else
+    ok = framebuffer_read(frame, fb->map, fb->pitch, this->format.height,
+        this->format.width, this->format.bpp / 8, this->format.pitch);
+
+  if (!ok)
+  {
+    DEBUG_ERROR("Failed to read the framebuffer");
+    return false;
+  }
+
+  drm_publish(this, index);
+  return true;
+}
+
+bool drm_on_frame(void * opaque, const FrameBuffer * frame, int dmaFd,
+    const FrameDamageRect * damageRects, int damageRectsCount)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  // a swizzled frame can't be scanned out from the DMA-BUF as is
+  if (dmaFd >= 0 && !this->swizzle && !atomic_load(&this->dmaFailed) &&
+      drm_on_dma_frame(this, frame, dmaFd))
+    return true;
+
+  return drm_on_copy_frame(this, frame);
+}
+
+void drm_on_alert(void * opaque, const LG_MsgAlert alert, const char * message, bool ** closeFlag)
+{
+  // there is no overlay to show alerts on
+  DEBUG_INFO("%s", message);
+}
+
+static uint32_t drm_get_prop(int fd, uint32_t obj, uint32_t type,
+    const char * name, uint64_t * value)
+{
+  drmModeObjectProperties * props = drmModeObjectGetProperties(fd, obj, type);
+  if (!props)
+    return 0;
+
+  uint32_t id = 0;
+  for(uint32_t i = 0; i < props->count_props && !id; ++i)
+  {
+    drmModePropertyRes * prop = drmModeGetProperty(fd, props->props[i]);
+    if (!prop)
+      continue;
+
+    if (strcmp(prop->name, name) == 0)
+    {
+      id = prop->prop_id;
+      if (value)
+        *value = props->prop_values[i];
+    }
+    drmModeFreeProperty(prop);
+  }
+
+  drmModeFreeObjectProperties(props);
+  return id;
+}
+
+static bool drm_get_plane_props(struct Inst * this, uint32_t plane,
+    struct Props * p)
+{
+  const uint32_t t = DRM_MODE_OBJECT_PLANE;
+  p->fbId   = drm_get_prop(this->fd, plane, t, "FB_ID"  , NULL);
+  p->crtcId = drm_get_prop(this->fd, plane, t, "CRTC_ID", NULL);
+  p->srcX   = drm_get_prop(this->fd, plane, t, "SRC_X"  , NULL);
+  p->srcY   = drm_get_prop(this->fd, plane, t, "SRC_Y"  , NULL);
+  p->srcW   = drm_get_prop(this->fd, plane, t, "SRC_W"  , NULL);
+  p->srcH   = drm_get_prop(this->fd, plane, t, "SRC_H"  , NULL);
+  p->crtcX  = drm_get_prop(this->fd, plane, t, "CRTC_X" , NULL);
+  p->crtcY  = drm_get_prop(this->fd, plane, t, "CRTC_Y" , NULL);
+  p->crtcW  = drm_get_prop(this->fd, plane, t, "CRTC_W" , NULL);
+  p->crtcH  = drm_get_prop(this->fd, plane, t, "CRTC_H" , NULL);
+
+  return p->fbId && p->crtcId && p->srcX && p->srcY && p->srcW && p->srcH &&
+    p->crtcX && p->crtcY && p->crtcW && p->crtcH;
+}
+
+static bool drm_pick_output(struct Inst * this, drmModeRes * res)
+{
+  const char * want = option_get_string("drm", "connector");
+  drmModeConnector * conn = NULL;
+
+  for(int i = 0; i < res->count_connectors; ++i)
+  {
+    conn = drmModeGetConnector(this->fd, res->connectors[i]);
+    if (!conn)
+      continue;
+
+    char name[32];
+    snprintf(name, sizeof(name), "%s-%u",
+        drmModeGetConnectorTypeName(conn->connector_type),
+        conn->connector_type_id);
+
+    if (conn->connection == DRM_MODE_CONNECTED && conn->count_modes > 0 &&
+        (!want || !*want || strcmp(want, name) == 0))
+    {
+      DEBUG_INFO("Connector   : %s", name);
+      break;
+    }
+
+    drmModeFreeConnector(conn);
+    conn = NULL;
+  }
+
+  if (!conn)
+  {
+    DEBUG_ERROR("No usable connector found");
+    return false;
+  }
+
+  this->connectorId = conn->connector_id;
+  this->mode        = conn->modes[0];
+  for(int i = 0; i < conn->count_modes; ++i)
+    if (conn->modes[i].type & DRM_MODE_TYPE_PREFERRED)
+    {
+      this->mode = conn->modes[i];
+      break;
+    }
+
+  // keep the CRTC already driving the connector if there is one
+  for(int i = 0; i < conn->count_encoders && !this->crtcId; ++i)
+  {
+    drmModeEncoder * enc = drmModeGetEncoder(this->fd, conn->encoders[i]);
+    if (!enc)
+      continue;
+
+    if (enc->encoder_id == conn->encoder_id && enc->crtc_id)
+      this->crtcId = enc->crtc_id;
+    else
+      for(int c = 0; c < res->count_crtcs; ++c)
+        if (enc->possible_crtcs & (1U << c))
+        {
+          this->crtcId = res->crtcs[c];
+          break;
+        }
+
+    drmModeFreeEncoder(enc);
+  }
+  drmModeFreeConnector(conn);
+
+  if (!this->crtcId)
+  {
+    DEBUG_ERROR("No CRTC can drive the connector");
+    return false;
+  }
+
+  DEBUG_INFO("Mode        : %s@%u", this->mode.name, this->mode.vrefresh);
+  return true;
+}
+
+static bool drm_pick_planes(struct Inst * this, drmModeRes * res)
+{
+  int crtcIndex = -1;
+  for(int i = 0; i < res->count_crtcs; ++i)
+    if (res->crtcs[i] == this->crtcId)
+      crtcIndex = i;
+
+  drmModePlaneRes * planes = drmModeGetPlaneResources(this->fd);
+  if (!planes)
+  {
+    DEBUG_ERROR("drmModeGetPlaneResources failed");
+    return false;
+  }
+
+  for(uint32_t i = 0; i < planes->count_planes; ++i)
+  {
+    drmModePlane * plane = drmModeGetPlane(this->fd, planes->planes[i]);
+    if (!plane)
+      continue;
+
+    uint64_t type;
+    if ((plane->possible_crtcs & (1U << crtcIndex)) &&
+        drm_get_prop(this->fd, plane->plane_id, DRM_MODE_OBJECT_PLANE, "type",
+          &type))
+    {
+      if (type == DRM_PLANE_TYPE_PRIMARY && !this->primaryPlane)
+      {
+        this->primaryPlane = plane->plane_id;
+        for(uint32_t f = 0; f < plane->count_formats; ++f)
+          if (plane->formats[f] == DRM_FORMAT_XBGR8888)
+            this->primaryXBGR = true;
+      }
+      else if (type == DRM_PLANE_TYPE_CURSOR && !this->cursorPlane)
+        this->cursorPlane = plane->plane_id;
+    }
+
+    drmModeFreePlane(plane);
+  }
+  drmModeFreePlaneResources(planes);
+
+  if (!this->primaryPlane ||
+      !drm_get_plane_props(this, this->primaryPlane, &this->primaryProps))
+  {
+    DEBUG_ERROR("No usable primary plane");
+    return false;
+  }
+
+  if (this->cursorPlane &&
+      !drm_get_plane_props(this, this->cursorPlane, &this->cursorProps))
+    this->cursorPlane = 0;
+
+  if (!this->cursorPlane)
+    DEBUG_WARN("No cursor plane, the cursor will not be shown");
+
+  if (!this->primaryXBGR)
+    DEBUG_INFO("The primary plane lacks XBGR8888, RGBA frames are swizzled");
+
+  return true;
+}
+
+static bool drm_create_cursors(struct Inst * this)
+{
+  if (drmGetCap(this->fd, DRM_CAP_CURSOR_WIDTH , &this->cursorW) != 0)
+    this->cursorW = 64;
+  if (drmGetCap(this->fd, DRM_CAP_CURSOR_HEIGHT, &this->cursorH) != 0)
+    this->cursorH = 64;
+
+  for(int i = 0; i < 2; ++i)
+  {
+    struct Cursor * c = &this->cursors[i];
+    void * map;
+    if (!drm_create_dumb(this, this->cursorW, this->cursorH, 32, &c->handle,
+          &c->pitch, &c->size, &map))
+      return false;
+    c->map = (uint32_t *)map;
+
+    const uint32_t handles[4] = { c->handle };
+    const uint32_t pitches[4] = { c->pitch  };
+    const uint32_t offsets[4] = { 0         };
+    if (drmModeAddFB2(this->fd, this->cursorW, this->cursorH,
+          DRM_FORMAT_ARGB8888, handles, pitches, offsets, &c->fbId, 0) != 0)
+    {
+      DEBUG_ERROR("drmModeAddFB2 failed for the cursor: %s", strerror(errno));
+      c->fbId = 0;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool drm_render_startup(void * opaque, SDL_Window * window)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  const char * device = option_get_string("drm", "device");
+  this->fd = open(device, O_RDWR | O_CLOEXEC);
+  if (this->fd < 0)
+  {
+    DEBUG_ERROR("Failed to open %s: %s", device, strerror(errno));
+    return false;
+  }
+
+  // nothing else may be driving the display
+  if (drmSetMaster(this->fd) != 0)
+  {
+    DEBUG_ERROR("Failed to become the DRM master, is a display server running?");
+    return false;
+  }
+
+  if (drmSetClientCap(this->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) != 0 ||
+      drmSetClientCap(this->fd, DRM_CLIENT_CAP_ATOMIC, 1) != 0)
+  {
+    DEBUG_ERROR("The device does not support atomic modesetting");
+    return false;
+  }
+
+  drmModeRes * res = drmModeGetResources(this->fd);
+  if (!res)
+  {
+    DEBUG_ERROR("drmModeGetResources failed");
+    return false;
+  }
+
+  const bool ok = drm_pick_output(this, res) && drm_pick_planes(this, res);
+  drmModeFreeResources(res);
+  if (!ok)
+    return false;
+
+  this->connCrtcId = drm_get_prop(this->fd, this->connectorId,
+      DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", NULL);
+  this->crtcModeId = drm_get_prop(this->fd, this->crtcId,
+      DRM_MODE_OBJECT_CRTC, "MODE_ID", NULL);
+  this->crtcActive = drm_get_prop(this->fd, this->crtcId,
+      DRM_MODE_OBJECT_CRTC, "ACTIVE", NULL);
+
+  if (!this->connCrtcId || !this->crtcModeId || !this->crtcActive)
+  {
+    DEBUG_ERROR("Missing modesetting properties");
+    return false;
+  }
+
+  if (drmModeCreatePropertyBlob(this->fd, &this->mode, sizeof(this->mode),
+        &this->modeBlob) != 0)
+  {
+    DEBUG_ERROR("Failed to create the mode blob");
+    return false;
+  }
+
+  if (this->cursorPlane && !drm_create_cursors(this))
+    this->cursorPlane = 0;
+
+  this->savedCrtc = drmModeGetCrtc(this->fd, this->crtcId);
+  return true;
+}
+
+// called with the lock held, free the buffers of old formats that are no
+// longer on the screen
+static void drm_free_old(struct Inst * this)
+{
+  for(int i = 0; i < FB_MAX; ++i)
+  {
+    struct FB * fb = &this->fbs[i];
+    if (fb->used && fb->gen != this->gen &&
+        i != this->displayed && i != this->queued)
+      drm_free_fb(this, fb);
+  }
+}
+
+static void drm_page_flip(int fd, unsigned int sequence, unsigned int sec,
+    unsigned int usec, void * data)
+{
+  struct Inst * this = (struct Inst *)data;
+  this->flipPending = false;
+
+  LG_LOCK(this->lock);
+  if (this->queued >= 0)
+  {
+    this->displayed = this->queued;
+    this->queued    = -1;
+  }
+  drm_free_old(this);
+  LG_UNLOCK(this->lock);
+}
+
+static bool drm_wait_flip(struct Inst * this)
+{
+  drmEventContext ev =
+  {
+    .version           = 2,
+    .page_flip_handler = drm_page_flip
+  };
+
+  while(this->flipPending)
+  {
+    struct pollfd pfd = { .fd = this->fd, .events = POLLIN };
+    const int ret = poll(&pfd, 1, FLIP_TIMEOUT);
+    if (ret < 0 && errno != EINTR)
+    {
+      DEBUG_ERROR("poll failed: %s", strerror(errno));
+      return false;
+    }
+
+    if (ret == 0)
+    {
+      DEBUG_WARN("Timed out waiting for the flip");
+      drm_page_flip(this->fd, 0, 0, 0, this);
+      return true;
+    }
+
+    if (ret > 0 && drmHandleEvent(this->fd, &ev) != 0)
+    {
+      DEBUG_ERROR("drmHandleEvent failed");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static void drm_add_plane(drmModeAtomicReq * req, uint32_t plane,
+    const struct Props * p, uint32_t crtc, uint32_t fb, uint32_t sw,
+    uint32_t sh, int x, int y, uint32_t w, uint32_t h)
+{
+  drmModeAtomicAddProperty(req, plane, p->fbId  , fb);
+  drmModeAtomicAddProperty(req, plane, p->crtcId, fb ? crtc : 0);
+  drmModeAtomicAddProperty(req, plane, p->srcX  , 0);
+  drmModeAtomicAddProperty(req, plane, p->srcY  , 0);
+  drmModeAtomicAddProperty(req, plane, p->srcW  , (uint64_t)sw << 16);
+  drmModeAtomicAddProperty(req, plane, p->srcH  , (uint64_t)sh << 16);
+  drmModeAtomicAddProperty(req, plane, p->crtcX , (uint64_t)(int64_t)x);
+  drmModeAtomicAddProperty(req, plane, p->crtcY , (uint64_t)(int64_t)y);
+  drmModeAtomicAddProperty(req, plane, p->crtcW , w);
+  drmModeAtomicAddProperty(req, plane, p->crtcH , h);
+}
+
+static void drm_add_primary(struct Inst * this, drmModeAtomicReq * req,
+    uint32_t fbId)
+{
+  const unsigned int w = this->format.width;
+  const unsigned int h = this->format.height;
+
+  if (this->scale)
+    drm_add_plane(req, this->primaryPlane, &this->primaryProps, this->crtcId,
+        fbId, w, h, this->dest.x, this->dest.y, this->dest.w, this->dest.h);
+  else
+    drm_add_plane(req, this->primaryPlane, &this->primaryProps, this->crtcId,
+        fbId, w, h, this->dest.x, this->dest.y, w, h);
+}
+
+// fit the frame to the mode keeping the aspect, fall back to 1:1 if the
+// primary plane can't scale
+static void drm_update_dest(struct Inst * this, uint32_t fbId)
+{
+  const float modeW = this->mode.hdisplay;
+  const float modeH = this->mode.vdisplay;
+  const float scale =
+    modeW / this->format.screenWidth < modeH / this->format.screenHeight ?
+    modeW / this->format.screenWidth : modeH / this->format.screenHeight;
+
+  this->dest.w = this->format.screenWidth  * scale;
+  this->dest.h = this->format.screenHeight * scale;
+  this->dest.x = (this->mode.hdisplay - this->dest.w) / 2;
+  this->dest.y = (this->mode.vdisplay - this->dest.h) / 2;
+  this->scale  = true;
+
+  drmModeAtomicReq * req = drmModeAtomicAlloc();
+  if (!this->modeSet)
+  {
+    drmModeAtomicAddProperty(req, this->connectorId, this->connCrtcId, this->crtcId);
+    drmModeAtomicAddProperty(req, this->crtcId, this->crtcModeId, this->modeBlob);
+    drmModeAtomicAddProperty(req, this->crtcId, this->crtcActive, 1);
+  }
+  drm_add_primary(this, req, fbId);
+
+  if (drmModeAtomicCommit(this->fd, req,
+        DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL) != 0)
+  {
+    DEBUG_WARN("The primary plane can't scale, showing the frame 1:1");
+    this->scale  = false;
+    this->dest.w = this->format.width;
+    this->dest.h = this->format.height;
+    this->dest.x = ((int)this->mode.hdisplay - this->dest.w) / 2;
+    this->dest.y = ((int)this->mode.vdisplay - this->dest.h) / 2;
+  }
+  drmModeAtomicFree(req);
+}
+
+static void drm_update_cursor(struct Inst * this)
+{
+  LG_LOCK(this->cursorLock);
+  if (!this->cursorUpdate)
+  {
+    LG_UNLOCK(this->cursorLock);
+    return;
+  }
+  this->cursorUpdate = false;
+
+  // write to the buffer that is not on the screen
+  this->cursorIndex = !this->cursorIndex;
+  struct Cursor * c = &this->cursors[this->cursorIndex];
+  memset(c->map, 0, c->size);
+
+  const int w = this->cursorWidth  < (int)this->cursorW ? this->cursorWidth  : (int)this->cursorW;
+  const int h = this->cursorHeight < (int)this->cursorH ? this->cursorHeight : (int)this->cursorH;
+  for(int y = 0; y < h; ++y)
+    memcpy((uint8_t *)c->map + c->pitch * y,
+        this->cursorData + this->cursorWidth * y, w * sizeof(uint32_t));
+
+  LG_UNLOCK(this->cursorLock);
+}
+
+bool drm_needs_render(void * opaque)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  LG_LOCK(this->lock);
+  const bool pending = this->pending >= 0 || this->formatChanged;
+  LG_UNLOCK(this->lock);
+
+  return pending || atomic_load(&this->cursorMoved);
+}
+
+bool drm_render(void * opaque, SDL_Window * window)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  // only one commit may be in flight at a time
+  if (!drm_wait_flip(this))
+    return false;
+
+  LG_LOCK(this->lock);
+  const int  index   = this->pending;
+  const bool changed = this->formatChanged;
+  if (index >= 0)
+    this->queued = index;
+  this->pending       = -1;
+  this->formatChanged = false;
+  const uint32_t fbId = index >= 0 ? this->fbs[index].fbId : 0;
+  LG_UNLOCK(this->lock);
+
+  if (changed && fbId)
+    drm_update_dest(this, fbId);
+  else if (changed)
+  {
+    // wait for a frame of the new format to size the output
+    LG_LOCK(this->lock);
+    this->formatChanged = true;
+    LG_UNLOCK(this->lock);
+  }
+
+  const bool cursorMoved = atomic_exchange(&this->cursorMoved, false);
+  if (!fbId && (!cursorMoved || !this->modeSet))
+    return true;
+
+  drmModeAtomicReq * req = drmModeAtomicAlloc();
+  uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+  if (!this->modeSet)
+  {
+    drmModeAtomicAddProperty(req, this->connectorId, this->connCrtcId, this->crtcId);
+    drmModeAtomicAddProperty(req, this->crtcId, this->crtcModeId, this->modeBlob);
+    drmModeAtomicAddProperty(req, this->crtcId, this->crtcActive, 1);
+    flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_ALLOW_MODESET;
+  }
+
+  if (fbId)
+    drm_add_primary(this, req, fbId);
+
+  if (this->cursorPlane)
+  {
+    drm_update_cursor(this);
+
+    bool visible = this->cursorVisible;
+    int  x       = this->cursorX;
+    int  y       = this->cursorY;
+    if (this->params.latchCursor)
+      this->params.latchCursor(&visible, &x, &y);
+
+    // the cursor is in desktop coordinates
+    x = this->dest.x + x * this->dest.w / (int)this->format.screenWidth;
+    y = this->dest.y + y * this->dest.h / (int)this->format.screenHeight;
+
+    drm_add_plane(req, this->cursorPlane, &this->cursorProps, this->crtcId,
+        visible ? this->cursors[this->cursorIndex].fbId : 0,
+        this->cursorW, this->cursorH, x, y, this->cursorW, this->cursorH);
+  }
+
+  const int ret = drmModeAtomicCommit(this->fd, req, flags, this);
+  const int err = errno;
+  drmModeAtomicFree(req);
+
+  if (ret != 0)
+  {
+    DEBUG_ERROR("drmModeAtomicCommit failed: %s", strerror(err));
+    LG_LOCK(this->lock);
+    this->queued = -1;
+    LG_UNLOCK(this->lock);
+
+    // we lose the master while switched to another VT
+    return err == EBUSY || err == EACCES || err == EINVAL;
+  }
+
+  this->modeSet     = true;
+  this->flipPending = true;
+  return true;
+}
+
+void drm_update_fps(void * opaque, const float avgUPS, const float avgFPS,
+    const LG_RendererLatency * latency)
+{
+  // there is no overlay to show the FPS on
+}
+
+struct LG_Renderer LGR_DRM =
+{
+  .get_name        = drm_get_name,
+  .setup           = drm_setup,
+  .create          = drm_create,
+  .initialize      = drm_initialize,
+  .deinitialize    = drm_deinitialize,
+  .supports        = drm_supports,
+  .frame_types     = drm_frame_types,
+  .on_restart      = drm_on_restart,
+  .on_resize       = drm_on_resize,
+  .on_mouse_shape  = drm_on_mouse_shape,
+  .on_mouse_event  = drm_on_mouse_event,
+  .on_frame_format = drm_on_frame_format,
+  .on_frame        = drm_on_frame,
+  .on_alert        = drm_on_alert,
+  .render_startup  = drm_render_startup,
+  .render          = drm_render,
+  .needs_render    = drm_needs_render,
+  .update_fps      = drm_update_fps
+};
@@ -21,31 +21,27 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "common/debug.h"
 #include "common/locking.h"
 
-#include "texture.h"
 #include "shader.h"
 #include "model.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 // these headers are auto generated by cmake
 #include "alert.vert.h"
-#include "alert.frag.h"
 #include "alert_bg.frag.h"
 
 struct EGL_Alert
 {
-  const LG_Font * font;
-  LG_FontObj      fontObj;
-
-  EGL_Texture * texture;
-  EGL_Shader  * shader;
+  EGL_Text    * text;
   EGL_Shader  * shaderBG;
   EGL_Model   * model;
 
-  LG_Lock         lock;
-  bool            update;
-  LG_FontBitmap * bmp;
+  // the text is set from other threads and laid out when next rendered
+  LG_Lock       lock;
+  bool          update;
+  char        * str;
 
   bool     ready;
   float    width  , height  ;
@@ -53,11 +49,10 @@ struct EGL_Alert
   float    r, g, b, a;
 
   // uniforms
-  GLint uScreen  , uSize;
   GLint uScreenBG, uSizeBG, uColorBG;
 };
 
-bool egl_alert_init(EGL_Alert ** alert, const LG_Font * font, LG_FontObj fontObj)
+bool egl_alert_init(EGL_Alert ** alert, EGL_TextAtlas * atlas)
 {
   *alert = (EGL_Alert *)malloc(sizeof(EGL_Alert));
   if (!*alert)
@@ -68,19 +63,11 @@ bool egl_alert_init(EGL_Alert ** alert, const LG_Font * font, LG_FontObj fontObj
 
   memset(*alert, 0, sizeof(EGL_Alert));
 
-  (*alert)->font    = font;
-  (*alert)->fontObj = fontObj;
   LG_LOCK_INIT((*alert)->lock);
 
-  if (!egl_texture_init(&(*alert)->texture, NULL))
-  {
-    DEBUG_ERROR("Failed to initialize the alert texture");
-    return false;
-  }
-
-  if (!egl_shader_init(&(*alert)->shader))
+  if (!egl_text_init(&(*alert)->text, atlas))
   {
-    DEBUG_ERROR("Failed to initialize the alert shader");
+    DEBUG_ERROR("Failed to initialize the alert text");
     return false;
   }
 
@@ -90,15 +77,6 @@ bool egl_alert_init(EGL_Alert ** alert, const LG_Font * font, LG_FontObj fontObj
     return false;
   }
 
-
-  if (!egl_shader_compile((*alert)->shader,
-        b_shader_alert_vert, b_shader_alert_vert_size,
-        b_shader_alert_frag, b_shader_alert_frag_size))
-  {
-    DEBUG_ERROR("Failed to compile the alert shader");
-    return false;
-  }
-
   if (!egl_shader_compile((*alert)->shaderBG,
         b_shader_alert_vert   , b_shader_alert_vert_size,
         b_shader_alert_bg_frag, b_shader_alert_bg_frag_size))
@@ -107,9 +85,6 @@ bool egl_alert_init(EGL_Alert ** alert, const LG_Font * font, LG_FontObj fontObj
     return false;
   }
 
-
-  (*alert)->uSize     = egl_shader_get_uniform_location((*alert)->shader  , "size"  );
-  (*alert)->uScreen   = egl_shader_get_uniform_location((*alert)->shader  , "screen");
   (*alert)->uSizeBG   = egl_shader_get_uniform_location((*alert)->shaderBG, "size"  );
   (*alert)->uScreenBG = egl_shader_get_uniform_location((*alert)->shaderBG, "screen");
   (*alert)->uColorBG  = egl_shader_get_uniform_location((*alert)->shaderBG, "color" );
@@ -121,7 +96,6 @@ bool egl_alert_init(EGL_Alert ** alert, const LG_Font * font, LG_FontObj fontObj
   }
 
   egl_model_set_default((*alert)->model);
-  egl_model_set_texture((*alert)->model, (*alert)->texture);
 
   return true;
 }
@@ -131,10 +105,12 @@ void egl_alert_free(EGL_Alert ** alert)
   if (!*alert)
     return;
 
-  egl_texture_free(&(*alert)->texture );
-  egl_shader_free (&(*alert)->shader  );
-  egl_shader_free (&(*alert)->shaderBG);
-  egl_model_free  (&(*alert)->model   );
+  egl_text_free  (&(*alert)->text    );
+  egl_shader_free(&(*alert)->shaderBG);
+  egl_model_free (&(*alert)->model   );
+
+  LG_LOCK_FREE((*alert)->lock);
+  free((*alert)->str);
 
   free(*alert);
   *alert = NULL;
@@ -150,16 +126,16 @@ void egl_alert_set_color(EGL_Alert * alert, const uint32_t color)
 
 void egl_alert_set_text (EGL_Alert * alert, const char * str)
 {
-  LG_LOCK(alert->lock);
-  alert->bmp = alert->font->render(alert->fontObj, 0xffffff00, str);
-  if (!alert->bmp)
+  char * copy = strdup(str);
+  if (!copy)
   {
-    alert->update = false;
-    LG_UNLOCK(alert->lock);
-    DEBUG_ERROR("Failed to render alert text");
+    DEBUG_ERROR("Failed to copy the alert text");
     return;
   }
 
+  LG_LOCK(alert->lock);
+  free(alert->str);
+  alert->str    = copy;
   alert->update = true;
   LG_UNLOCK(alert->lock);
 }
@@ -169,30 +145,18 @@ void egl_alert_render(EGL_Alert * alert, const float scaleX, const float scaleY)
   if (alert->update)
   {
     LG_LOCK(alert->lock);
-    egl_texture_setup(
-      alert->texture,
-      EGL_PF_BGRA,
-      alert->bmp->width ,
-      alert->bmp->height,
-      alert->bmp->width * alert->bmp->bpp,
-      false,
-      false
-    );
-
-    egl_texture_update(alert->texture, alert->bmp->pixels);
+    egl_text_set(alert->text, alert->str);
+    egl_text_get_size(alert->text, &alert->width, &alert->height);
 
-    alert->width  = alert->bgWidth  = alert->bmp->width;
-    alert->height = alert->bgHeight = alert->bmp->height;
+    alert->bgWidth  = alert->width;
+    alert->bgHeight = alert->height;
 
     if (alert->bgWidth < 200)
       alert->bgWidth = 200;
     alert->bgHeight += 4;
 
     alert->ready  = true;
-
-    alert->font->release(alert->fontObj, alert->bmp);
     alert->update = false;
-    alert->bmp    = NULL;
     LG_UNLOCK(alert->lock);
   }
 
@@ -209,11 +173,11 @@ void egl_alert_render(EGL_Alert * alert, const float scaleX, const float scaleY)
   glUniform4f(alert->uColorBG , alert->r, alert->g, alert->b, alert->a);
   egl_model_render(alert->model);
 
-  // render the texture over the background
-  egl_shader_use(alert->shader);
-  glUniform2f(alert->uScreen, scaleX      , scaleY       );
-  glUniform2i(alert->uSize  , alert->width, alert->height);
-  egl_model_render(alert->model);
+  // centre the text over the background on whole pixels
+  egl_text_render(alert->text,
+      floorf(0.5f / scaleX - alert->width  / 2.0f),
+      floorf(0.5f / scaleY - alert->height / 2.0f),
+      scaleX, scaleY);
 
   glDisable(GL_BLEND);
 }
@@ -21,11 +21,11 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include <stdbool.h>
 
-#include "interface/font.h"
+#include "text.h"
 
 typedef struct EGL_Alert EGL_Alert;
 
-bool egl_alert_init(EGL_Alert ** alert, const LG_Font * font, LG_FontObj fontObj);
+bool egl_alert_init(EGL_Alert ** alert, EGL_TextAtlas * atlas);
 void egl_alert_free(EGL_Alert ** alert);
 
 void egl_alert_set_color(EGL_Alert * alert, const uint32_t color);
@@ -19,7 +19,6 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "cursor.h"
 #include "common/debug.h"
-#include "common/locking.h"
 #include "common/option.h"
 
 #include "texture.h"
@@ -36,27 +35,35 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 struct CursorTex
 {
-  struct EGL_Texture * texture;
   struct EGL_Shader  * shader;
   GLuint uMousePos;
   GLuint uCBMode;
+  GLuint uSDRWhite;
+};
+
+// a shape in the cursor cache, the textures are kept so switching between
+// shapes the host has sent before does not upload them again
+struct CursorShape
+{
+  LG_RendererCursor    type;
+  int                  width;
+  int                  height;
+  bool                 valid;
+
+  struct EGL_Texture * norm;
+  struct EGL_Texture * mono;
 };
 
 struct EGL_Cursor
 {
-  LG_Lock           lock;
-  LG_RendererCursor type;
-  int               width;
-  int               height;
-  int               stride;
-  uint8_t *         data;
-  size_t            dataSize;
-  bool              update;
+  struct CursorShape shapes[KVMFR_CURSOR_CACHE];
+  int                active;
 
   // cursor state
   bool              visible;
   float             x, y, w, h;
   int               cbMode;
+  float             sdrWhite;
 
   struct CursorTex norm;
   struct CursorTex mono;
@@ -67,12 +74,6 @@ static bool egl_cursor_tex_init(struct CursorTex * t,
     const char * vertex_code  , size_t vertex_size,
     const char * fragment_code, size_t fragment_size)
 {
-  if (!egl_texture_init(&t->texture, NULL))
-  {
-    DEBUG_ERROR("Failed to initialize the cursor texture");
-    return false;
-  }
-
   if (!egl_shader_init(&t->shader))
   {
     DEBUG_ERROR("Failed to initialize the cursor shader");
@@ -88,17 +89,17 @@ static bool egl_cursor_tex_init(struct CursorTex * t,
 
   t->uMousePos = egl_shader_get_uniform_location(t->shader, "mouse" );
   t->uCBMode   = egl_shader_get_uniform_location(t->shader, "cbMode");
+  t->uSDRWhite = egl_shader_get_uniform_location(t->shader, "sdrWhite");
 
   return true;
 }
 
 static void egl_cursor_tex_free(struct CursorTex * t)
 {
-  egl_texture_free(&t->texture);
-  egl_shader_free (&t->shader );
+  egl_shader_free(&t->shader);
 };
 
-bool egl_cursor_init(EGL_Cursor ** cursor)
+bool egl_cursor_init(EGL_Cursor ** cursor, float sdrWhite)
 {
   *cursor = (EGL_Cursor *)malloc(sizeof(EGL_Cursor));
   if (!*cursor)
@@ -108,7 +109,18 @@ bool egl_cursor_init(EGL_Cursor ** cursor)
   }
 
   memset(*cursor, 0, sizeof(EGL_Cursor));
-  LG_LOCK_INIT((*cursor)->lock);
+  (*cursor)->active = -1;
+
+  for(int i = 0; i < KVMFR_CURSOR_CACHE; ++i)
+  {
+    struct CursorShape * shape = &(*cursor)->shapes[i];
+    if (!egl_texture_init(&shape->norm, NULL) ||
+        !egl_texture_init(&shape->mono, NULL))
+    {
+      DEBUG_ERROR("Failed to initialize the cursor texture");
+      return false;
+    }
+  }
 
   if (!egl_cursor_tex_init(&(*cursor)->norm,
       b_shader_cursor_vert    , b_shader_cursor_vert_size,
@@ -128,7 +140,8 @@ bool egl_cursor_init(EGL_Cursor ** cursor)
 
   egl_model_set_default((*cursor)->model);
 
-  (*cursor)->cbMode = option_get_int("egl", "cbMode");
+  (*cursor)->cbMode   = option_get_int("egl", "cbMode");
+  (*cursor)->sdrWhite = sdrWhite;
 
   return true;
 }
@@ -138,9 +151,12 @@ void egl_cursor_free(EGL_Cursor ** cursor)
   if (!*cursor)
     return;
 
-  LG_LOCK_FREE((*cursor)->lock);
-  if ((*cursor)->data)
-    free((*cursor)->data);
+  for(int i = 0; i < KVMFR_CURSOR_CACHE; ++i)
+  {
+    struct CursorShape * shape = &(*cursor)->shapes[i];
+    egl_texture_free(&shape->norm);
+    egl_texture_free(&shape->mono);
+  }
 
   egl_cursor_tex_free(&(*cursor)->norm);
   egl_cursor_tex_free(&(*cursor)->mono);
@@ -150,38 +166,68 @@ void egl_cursor_free(EGL_Cursor ** cursor)
   *cursor = NULL;
 }
 
-bool egl_cursor_set_shape(EGL_Cursor * cursor, const LG_RendererCursor type, const int width, const int height, const int stride, const uint8_t * data)
+bool egl_cursor_set_shape(EGL_Cursor * cursor, const CursorImage * image,
+    const unsigned int cacheID)
 {
-  LG_LOCK(cursor->lock);
+  if (cacheID >= KVMFR_CURSOR_CACHE)
+    return false;
 
-  cursor->type   = type;
-  cursor->width  = width;
-  cursor->height = (type == LG_CURSOR_MONOCHROME ? height / 2 : height);
-  cursor->stride  = stride;
+  struct CursorShape * shape = &cursor->shapes[cacheID];
+  const uint8_t      * data  = image->data;
+  const int            stride = image->stride;
 
-  const size_t size = height * stride;
-  if (size > cursor->dataSize)
+  shape->type   = image->type;
+  shape->width  = image->width;
+  shape->height = (image->type == LG_CURSOR_MONOCHROME ?
+      image->height / 2 : image->height);
+  shape->valid  = true;
+
+  switch(shape->type)
   {
-    if (cursor->data)
-      free(cursor->data);
+    case LG_CURSOR_MASKED_COLOR:
+      // fall through
 
-    cursor->data = (uint8_t *)malloc(size);
-    if (!cursor->data)
+    case LG_CURSOR_COLOR:
     {
-      DEBUG_ERROR("Failed to malloc buffer for cursor shape");
-      return false;
+      egl_texture_setup(shape->norm, EGL_PF_BGRA, shape->width, shape->height, stride, false, false);
+      egl_texture_update(shape->norm, data);
+      break;
     }
 
-    cursor->dataSize = size;
+    case LG_CURSOR_MONOCHROME:
+    {
+      uint32_t and[shape->width * shape->height];
+      uint32_t xor[shape->width * shape->height];
+
+      for(int y = 0; y < shape->height; ++y)
+        for(int x = 0; x < shape->width; ++x)
+        {
+          const uint8_t  * srcAnd  = data + (stride * y) + (x / 8);
+          const uint8_t  * srcXor  = srcAnd + stride * shape->height;
+          const uint8_t    mask    = 0x80 >> (x % 8);
+          const uint32_t   andMask = (*srcAnd & mask) ? 0xFFFFFFFF : 0xFF000000;
+          const uint32_t   xorMask = (*srcXor & mask) ? 0x00FFFFFF : 0x00000000;
+
+          and[y * shape->width + x] = andMask;
+          xor[y * shape->width + x] = xorMask;
+        }
+
+      egl_texture_setup (shape->norm, EGL_PF_BGRA, shape->width, shape->height, shape->width * 4, false, false);
+      egl_texture_setup (shape->mono, EGL_PF_BGRA, shape->width, shape->height, shape->width * 4, false, false);
+      egl_texture_update(shape->norm, (uint8_t *)and);
+      egl_texture_update(shape->mono, (uint8_t *)xor);
+      break;
+    }
   }
 
-  memcpy(cursor->data, data, size);
-  cursor->update = true;
-
-  LG_UNLOCK(cursor->lock);
   return true;
 }
 
+void egl_cursor_set_active(EGL_Cursor * cursor, const int cacheID)
+{
+  cursor->active = cacheID;
+}
+
 void egl_cursor_set_size(EGL_Cursor * cursor, const float w, const float h)
 {
   cursor->w = w;
@@ -200,70 +246,31 @@ void egl_cursor_render(EGL_Cursor * cursor)
   if (!cursor->visible)
     return;
 
-  if (cursor->update)
-  {
-    LG_LOCK(cursor->lock);
-    cursor->update = false;
-
-    uint8_t * data = cursor->data;
+  if (cursor->active < 0)
+    return;
 
-    switch(cursor->type)
-    {
-      case LG_CURSOR_MASKED_COLOR:
-        // fall through
-
-      case LG_CURSOR_COLOR:
-      {
-        egl_texture_setup(cursor->norm.texture, EGL_PF_BGRA, cursor->width, cursor->height, cursor->stride, false, false);
-        egl_texture_update(cursor->norm.texture, data);
-        egl_model_set_texture(cursor->model, cursor->norm.texture);
-        break;
-      }
-
-      case LG_CURSOR_MONOCHROME:
-      {
-        uint32_t and[cursor->width * cursor->height];
-        uint32_t xor[cursor->width * cursor->height];
-
-        for(int y = 0; y < cursor->height; ++y)
-          for(int x = 0; x < cursor->width; ++x)
-          {
-            const uint8_t  * srcAnd  = data + (cursor->stride * y) + (x / 8);
-            const uint8_t  * srcXor  = srcAnd + cursor->stride * cursor->height;
-            const uint8_t    mask    = 0x80 >> (x % 8);
-            const uint32_t   andMask = (*srcAnd & mask) ? 0xFFFFFFFF : 0xFF000000;
-            const uint32_t   xorMask = (*srcXor & mask) ? 0x00FFFFFF : 0x00000000;
-
-            and[y * cursor->width + x] = andMask;
-            xor[y * cursor->width + x] = xorMask;
-          }
-
-        egl_texture_setup (cursor->norm.texture    , EGL_PF_BGRA, cursor->width, cursor->height, cursor->width * 4, false, false);
-        egl_texture_setup (cursor->mono.texture, EGL_PF_BGRA, cursor->width, cursor->height, cursor->width * 4, false, false);
-        egl_texture_update(cursor->norm.texture    , (uint8_t *)and);
-        egl_texture_update(cursor->mono.texture, (uint8_t *)xor);
-        break;
-      }
-    }
-    LG_UNLOCK(cursor->lock);
-  }
+  const struct CursorShape * shape = &cursor->shapes[cursor->active];
+  if (!shape->valid)
+    return;
 
   glEnable(GL_BLEND);
-  switch(cursor->type)
+  switch(shape->type)
   {
     case LG_CURSOR_MONOCHROME:
     {
       egl_shader_use(cursor->norm.shader);
       glUniform4f(cursor->norm.uMousePos, cursor->x, cursor->y, cursor->w, cursor->h / 2);
       glUniform1i(cursor->norm.uCBMode  , cursor->cbMode);
+      glUniform1f(cursor->norm.uSDRWhite, 0.0f); // the AND mask must stay 0 or 1
       glBlendFunc(GL_ZERO, GL_SRC_COLOR);
-      egl_model_set_texture(cursor->model, cursor->norm.texture);
+      egl_model_set_texture(cursor->model, shape->norm);
       egl_model_render(cursor->model);
 
       egl_shader_use(cursor->mono.shader);
       glUniform4f(cursor->mono.uMousePos, cursor->x, cursor->y, cursor->w, cursor->h / 2);
+      glUniform1f(cursor->mono.uSDRWhite, cursor->sdrWhite);
       glBlendFunc(GL_ONE_MINUS_DST_COLOR, GL_ZERO);
-      egl_model_set_texture(cursor->model, cursor->mono.texture);
+      egl_model_set_texture(cursor->model, shape->mono);
       egl_model_render(cursor->model);
       break;
     }
@@ -273,7 +280,9 @@ void egl_cursor_render(EGL_Cursor * cursor)
       egl_shader_use(cursor->norm.shader);
       glUniform4f(cursor->norm.uMousePos, cursor->x, cursor->y, cursor->w, cursor->h);
       glUniform1i(cursor->norm.uCBMode  , cursor->cbMode);
+      glUniform1f(cursor->norm.uSDRWhite, cursor->sdrWhite);
       glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+      egl_model_set_texture(cursor->model, shape->norm);
       egl_model_render(cursor->model);
       break;
     }
@@ -282,7 +291,9 @@ void egl_cursor_render(EGL_Cursor * cursor)
     {
       egl_shader_use(cursor->mono.shader);
       glUniform4f(cursor->mono.uMousePos, cursor->x, cursor->y, cursor->w, cursor->h);
+      glUniform1f(cursor->mono.uSDRWhite, cursor->sdrWhite);
       glBlendFunc(GL_ONE_MINUS_DST_COLOR, GL_ZERO);
+      egl_model_set_texture(cursor->model, shape->norm);
       egl_model_render(cursor->model);
       break;
     }
@@ -22,13 +22,19 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <stdbool.h>
 
 #include "interface/renderer.h"
+#include "cursorstate.h"
 
 typedef struct EGL_Cursor EGL_Cursor;
 
-bool egl_cursor_init(EGL_Cursor ** cursor);
+// sdrWhite is the brightness in nits of white on a BT.2020 PQ surface, or zero
+// if the surface is SDR
+bool egl_cursor_init(EGL_Cursor ** cursor, float sdrWhite);
 void egl_cursor_free(EGL_Cursor ** cursor);
 
-bool egl_cursor_set_shape(EGL_Cursor * cursor, const LG_RendererCursor type, const int width, const int height, const int stride, const uint8_t * data);
+// these are all called from the render thread, the shapes are uploaded as
+// they are set
+bool egl_cursor_set_shape(EGL_Cursor * cursor, const CursorImage * image, const unsigned int cacheID);
+void egl_cursor_set_active(EGL_Cursor * cursor, const int cacheID);
 void egl_cursor_set_size (EGL_Cursor * cursor, const float x, const float y);
 void egl_cursor_set_state(EGL_Cursor * cursor, const bool visible, const float x, const float y);
 void egl_cursor_render   (EGL_Cursor * cursor);
\ No newline at end of file
@@ -44,6 +44,8 @@ struct DesktopShader
   GLint uNearest;
   GLint uNV, uNVGain;
   GLint uCBMode;
+  GLint uLinear, uSDRWhite;
+  GLint uUpscale;
 };
 
 struct EGL_Desktop
@@ -68,10 +70,19 @@ struct EGL_Desktop
 
   // colorblind mode
   int   cbMode;
+
+  // the edge adaptive upscale
+  KeybindHandle kbUpscale;
+  bool  upscale;
+
+  // the frame is linear scRGB, and the output's SDR white if it is HDR10
+  bool  linear;
+  float sdrWhite;
 };
 
 // forwards
 void egl_desktop_toggle_nv(SDL_Scancode key, void * opaque);
+void egl_desktop_toggle_upscale(SDL_Scancode key, void * opaque);
 
 static bool egl_init_desktop_shader(
   struct DesktopShader * shader,
@@ -95,11 +106,14 @@ static bool egl_init_desktop_shader(
   shader->uNV          = egl_shader_get_uniform_location(shader->shader, "nv"      );
   shader->uNVGain      = egl_shader_get_uniform_location(shader->shader, "nvGain"  );
   shader->uCBMode      = egl_shader_get_uniform_location(shader->shader, "cbMode"  );
+  shader->uLinear      = egl_shader_get_uniform_location(shader->shader, "linear"  );
+  shader->uSDRWhite    = egl_shader_get_uniform_location(shader->shader, "sdrWhite");
+  shader->uUpscale     = egl_shader_get_uniform_location(shader->shader, "upscale" );
 
   return true;
 }
 
-bool egl_desktop_init(EGL_Desktop ** desktop, EGLDisplay * display)
+bool egl_desktop_init(EGL_Desktop ** desktop, EGLDisplay * display, float sdrWhite)
 {
   *desktop = (EGL_Desktop *)malloc(sizeof(EGL_Desktop));
   if (!*desktop)
@@ -109,7 +123,8 @@ bool egl_desktop_init(EGL_Desktop ** desktop, EGLDisplay * display)
   }
 
   memset(*desktop, 0, sizeof(EGL_Desktop));
-  (*desktop)->display = display;
+  (*desktop)->display  = display;
+  (*desktop)->sdrWhite = sdrWhite;
 
   if (!egl_texture_init(&(*desktop)->texture, display))
   {
@@ -144,12 +159,15 @@ bool egl_desktop_init(EGL_Desktop ** desktop, EGLDisplay * display)
   egl_model_set_default((*desktop)->model);
   egl_model_set_texture((*desktop)->model, (*desktop)->texture);
 
-  (*desktop)->kbNV = app_register_keybind(SDL_SCANCODE_N, egl_desktop_toggle_nv, *desktop);
+  (*desktop)->kbNV      = app_register_keybind(SDL_SCANCODE_N, egl_desktop_toggle_nv     , *desktop);
+  (*desktop)->kbUpscale = app_register_keybind(SDL_SCANCODE_U, egl_desktop_toggle_upscale, *desktop);
 
   (*desktop)->nvMax  = option_get_int("egl", "nvGainMax");
   (*desktop)->nvGain = option_get_int("egl", "nvGain"   );
   (*desktop)->cbMode = option_get_int("egl", "cbMode"   );
 
+  (*desktop)->upscale = option_get_bool("egl", "upscale");
+
   return true;
 }
 
@@ -165,6 +183,13 @@ void egl_desktop_toggle_nv(SDL_Scancode key, void * opaque)
   else app_alert(LG_ALERT_INFO, "NV Gain + %d", desktop->nvGain - 1);
 }
 
+void egl_desktop_toggle_upscale(SDL_Scancode key, void * opaque)
+{
+  EGL_Desktop * desktop = (EGL_Desktop *)opaque;
+  desktop->upscale = !desktop->upscale;
+  app_alert(LG_ALERT_INFO, desktop->upscale ? "Upscale Enabled" : "Upscale Disabled");
+}
+
 void egl_desktop_free(EGL_Desktop ** desktop)
 {
   if (!*desktop)
@@ -176,6 +201,7 @@ void egl_desktop_free(EGL_Desktop ** desktop)
   egl_model_free  (&(*desktop)->model                );
 
   app_release_keybind(&(*desktop)->kbNV);
+  app_release_keybind(&(*desktop)->kbUpscale);
 
   free(*desktop);
   *desktop = NULL;
@@ -184,6 +210,7 @@ void egl_desktop_free(EGL_Desktop ** desktop)
 bool egl_desktop_setup(EGL_Desktop * desktop, const LG_RendererFormat format, bool useDMA)
 {
   enum EGL_PixelFormat pixFmt;
+  desktop->linear = false;
   switch(format.type)
   {
     case FRAME_TYPE_BGRA:
@@ -204,6 +231,7 @@ bool egl_desktop_setup(EGL_Desktop * desktop, const LG_RendererFormat format, bo
     case FRAME_TYPE_RGBA16F:
       pixFmt = EGL_PF_RGBA16F;
       desktop->shader = &desktop->shader_generic;
+      desktop->linear = true;
       break;
 
     case FRAME_TYPE_YUV420:
@@ -236,7 +264,8 @@ bool egl_desktop_setup(EGL_Desktop * desktop, const LG_RendererFormat format, bo
   return true;
 }
 
-bool egl_desktop_update(EGL_Desktop * desktop, const FrameBuffer * frame, int dmaFd)
+bool egl_desktop_update(EGL_Desktop * desktop, const FrameBuffer * frame, int dmaFd,
+    const FrameDamageRect * damageRects, int damageRectsCount)
 {
   if (dmaFd >= 0)
   {
@@ -245,7 +274,8 @@ bool egl_desktop_update(EGL_Desktop * desktop, const FrameBuffer * frame, int dm
   }
   else
   {
-    if (!egl_texture_update_from_frame(desktop->texture, frame))
+    if (!egl_texture_update_from_frame(desktop->texture, frame, damageRects,
+          damageRectsCount))
       return false;
   }
 
@@ -278,7 +308,10 @@ bool egl_desktop_render(EGL_Desktop * desktop, const float x, const float y, con
   else
     glUniform1i(shader->uNV, 0);
 
-  glUniform1i(shader->uCBMode, desktop->cbMode);
+  glUniform1i(shader->uCBMode  , desktop->cbMode);
+  glUniform1i(shader->uLinear  , desktop->linear ? 1 : 0);
+  glUniform1f(shader->uSDRWhite, desktop->sdrWhite);
+  glUniform1i(shader->uUpscale , desktop->upscale ? 1 : 0);
   egl_model_render(desktop->model);
   return true;
 }
@@ -26,9 +26,12 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 typedef struct EGL_Desktop EGL_Desktop;
 
-bool egl_desktop_init(EGL_Desktop ** desktop, EGLDisplay * display);
+// sdrWhite is the brightness in nits to show SDR white at on a BT.2020 PQ
+// surface, or zero if the surface is SDR
+bool egl_desktop_init(EGL_Desktop ** desktop, EGLDisplay * display, float sdrWhite);
 void egl_desktop_free(EGL_Desktop ** desktop);
 
 bool egl_desktop_setup (EGL_Desktop * desktop, const LG_RendererFormat format, bool useDMA);
-bool egl_desktop_update(EGL_Desktop * desktop, const FrameBuffer * frame, int dmaFd);
+bool egl_desktop_update(EGL_Desktop * desktop, const FrameBuffer * frame, int dmaFd,
+    const FrameDamageRect * damageRects, int damageRectsCount);
 bool egl_desktop_render(EGL_Desktop * desktop, const float x, const float y, const float scaleX, const float scaleY, const bool nearest);
@@ -23,15 +23,21 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "common/option.h"
 #include "common/sysinfo.h"
 #include "common/time.h"
+#include "common/trace.h"
 #include "common/locking.h"
 #include "utils.h"
 #include "dynamic/fonts.h"
 
 #include <SDL2/SDL_syswm.h>
 #include <SDL2/SDL_egl.h>
+#include <stdatomic.h>
 
 #if defined(SDL_VIDEO_DRIVER_WAYLAND)
 #include <wayland-egl.h>
+#if defined(ENABLE_WAYLAND_PRESENTATION)
+#define EGL_PRESENTATION
+#include "presentation.h"
+#endif
 #endif
 
 #include "model.h"
@@ -41,13 +47,54 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "fps.h"
 #include "splash.h"
 #include "alert.h"
+#include "text.h"
+#include "gputimer.h"
 
 #define SPLASH_FADE_TIME 1000000
 #define ALERT_TIMEOUT    2000000
 
+#ifndef EGL_GL_COLORSPACE_KHR
+#define EGL_GL_COLORSPACE_KHR 0x309D
+#endif
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+#ifndef EGL_GL_COLORSPACE_BT2020_PQ_EXT
+#define EGL_GL_COLORSPACE_BT2020_PQ_EXT 0x3340
+#endif
+
+#ifndef EGL_BUFFER_AGE_EXT
+#define EGL_BUFFER_AGE_EXT 0x313D
+#endif
+
+// the oldest back buffer a cursor only render can bring up to date
+#define MAX_BUFFER_AGE 4
+
 struct Options
 {
   bool vsync;
+  bool hdr;
+  int  sdrWhite;
+  bool gpuTimers;
+  bool partialUpdate;
+};
+
+// the window area a render changed with the origin at the bottom left
+struct Damage
+{
+  bool   full;
+  EGLint rect[4];
+};
+
+// another VM of the mosaic, uploaded by its own thread on a context of its own
+struct Tile
+{
+  EGL_Desktop       * desktop;
+  EGLContext          context;
+  LG_RendererFormat   format;
+  atomic_bool         ready; // a frame of the format has been uploaded
 };
 
 struct Inst
@@ -62,14 +109,44 @@ struct Inst
   EGLSurface           surface;
   EGLContext           context, frameContext;
 
+  PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC swapWithDamage;
+  bool                 bufferAge; // EGL_EXT_buffer_age
+
+  bool                 wayland;
+  bool                 hdr; // the surface is BT.2020 PQ
+#if defined(EGL_PRESENTATION)
+  EGL_Presentation   * presentation;
+#endif
+  uint64_t             renderCount;
+
   EGL_Desktop     * desktop; // the desktop
+  struct Tile     * tiles;   // params.tiles of the mosaic
   EGL_Cursor      * cursor;  // the mouse cursor
+  CursorState     * cursorState; // the cursor as set by the cursor thread
   EGL_FPS         * fps;     // the fps display
   EGL_Splash      * splash;  // the splash screen
   EGL_Alert       * alert;   // the alert display
+  EGL_TextAtlas   * atlas;   // the glyphs the fps and alert text use
+
+  EGL_GPUTimer    * renderTimer; // GPU time of the render, on the context
+  EGL_GPUTimer    * frameTimer;  // GPU time of the upload, on the frameContext
 
   LG_RendererFormat    format;
   bool                 start;
+
+  // a frame imported from a DMA buffer that the next render draws from, it is
+  // released once the GPU is done with that render
+  atomic_uint          heldFrame;
+
+  // what has changed since the last render
+  atomic_bool          redraw;
+  atomic_bool          cursorMoved;
+  EGLint               cursorRect[4]; // as last presented, for the damage
+
+  // the damage of the last renders by renderCount, a back buffer from one of
+  // them only needs the areas changed since redrawing
+  struct Damage        damage[MAX_BUFFER_AGE];
+
   uint64_t             waitFadeTime;
   bool                 waitDone;
 
@@ -87,9 +164,7 @@ struct Inst
   float screenScaleX, screenScaleY;
   bool  useNearest;
 
-  bool         cursorVisible;
-  int          cursorX    , cursorY;
-  float        mouseWidth , mouseHeight;
+  CursorInfo   cursorInfo; // as last rendered
   float        mouseScaleX, mouseScaleY;
 
   const LG_Font     * font;
@@ -141,6 +216,69 @@ static struct Option egl_options[] =
     .type         = OPTION_TYPE_INT,
     .value.x_int  = 0
   },
+  {
+    .module       = "egl",
+    .name         = "upscale",
+    .description  = "Upscale smaller RGB frames with an edge adaptive filter instead of the nearest texel",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = false
+  },
+  {
+    .module       = "egl",
+    .name         = "pboRing",
+    .description  = "The number of frame textures and PBOs to stream through (2, 4 or 8)",
+    .type         = OPTION_TYPE_INT,
+    .value.x_int  = 2
+  },
+  {
+    .module       = "egl",
+    .name         = "pboPersistent",
+    .description  = "Keep the frame PBOs persistently mapped instead of mapping them every frame",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = true
+  },
+  {
+    .module       = "egl",
+    .name         = "texturePool",
+    .description  = "The number of recent frame formats to keep the textures and PBOs of so a mode flip back to one does not reallocate them (0 to 4)",
+    .type         = OPTION_TYPE_INT,
+    .value.x_int  = 2
+  },
+  {
+    .module       = "egl",
+    .name         = "hdr",
+    .description  = "Output HDR10 (BT.2020 PQ) if EGL supports it, otherwise the host packs HDR frames to SDR",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = false
+  },
+  {
+    .module       = "egl",
+    .name         = "sdrWhite",
+    .description  = "The brightness in nits SDR white is shown at when outputting HDR10",
+    .type         = OPTION_TYPE_INT,
+    .value.x_int  = 203
+  },
+  {
+    .module       = "egl",
+    .name         = "shaderCache",
+    .description  = "Keep the linked shader programs in the user cache directory to skip compiling them at startup",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = true
+  },
+  {
+    .module       = "egl",
+    .name         = "partialUpdate",
+    .description  = "Only redraw the areas of the cursor when it is all that has moved (EGL_EXT_buffer_age)",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = true
+  },
+  {
+    .module       = "egl",
+    .name         = "gpuTimers",
+    .description  = "Time the upload and draw on the GPU for the FPS display and trace (GL_EXT_disjoint_timer_query)",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = false
+  },
   {0}
 };
 
@@ -175,7 +313,13 @@ bool egl_create(void ** opaque, const LG_RendererParams params)
   struct Inst * this = (struct Inst *)*opaque;
   memcpy(&this->params, &params, sizeof(LG_RendererParams));
 
-  this->opt.vsync = option_get_bool("egl", "vsync");
+  this->opt.vsync     = option_get_bool("egl", "vsync"    );
+  this->opt.hdr       = option_get_bool("egl", "hdr"      );
+  this->opt.sdrWhite  = option_get_int ("egl", "sdrWhite" );
+  this->opt.gpuTimers = option_get_bool("egl", "gpuTimers");
+  this->opt.partialUpdate = option_get_bool("egl", "partialUpdate");
+  if (this->opt.sdrWhite < 1)
+    this->opt.sdrWhite = 203;
 
   this->translateX   = 0;
   this->translateY   = 0;
@@ -184,6 +328,17 @@ bool egl_create(void ** opaque, const LG_RendererParams params)
   this->screenScaleX = 1.0f;
   this->screenScaleY = 1.0f;
 
+  if (this->params.tiles &&
+      !(this->tiles = calloc(this->params.tiles, sizeof(struct Tile))))
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+
+  if (!cursorstate_new(&this->cursorState))
+    return false;
+  this->cursorInfo.shape = -1;
+
   this->font = LG_Fonts[0];
   if (!this->font->create(&this->fontObj, NULL, 16))
   {
@@ -228,10 +383,28 @@ void egl_deinitialize(void * opaque)
     this->font->destroy(this->fontObj);
 
   egl_desktop_free(&this->desktop);
+  for(unsigned int i = 0; this->tiles && i < this->params.tiles; ++i)
+  {
+    egl_desktop_free(&this->tiles[i].desktop);
+    if (this->tiles[i].context)
+      eglDestroyContext(this->display, this->tiles[i].context);
+  }
+  free(this->tiles);
+
   egl_cursor_free (&this->cursor);
+  cursorstate_free(&this->cursorState);
   egl_fps_free    (&this->fps   );
   egl_splash_free (&this->splash);
   egl_alert_free  (&this->alert );
+  egl_text_atlas_free(&this->atlas);
+
+  // the frame context is not current on this thread, its queries go with it
+  egl_gputimer_free(&this->renderTimer, true );
+  egl_gputimer_free(&this->frameTimer , false);
+
+#if defined(EGL_PRESENTATION)
+  egl_presentation_free(&this->presentation);
+#endif
 
   LG_LOCK_FREE(this->lock);
 
@@ -247,11 +420,32 @@ bool egl_supports(void * opaque, LG_RendererSupport flag)
     case LG_SUPPORTS_DMABUF:
       return this->dmaSupport;
 
+#if defined(EGL_PRESENTATION)
+    case LG_SUPPORTS_PRESENT_FEEDBACK:
+      return this->presentation != NULL;
+#endif
+
     default:
       return false;
   }
 }
 
+uint32_t egl_frame_types(void * opaque, FrameType * preferred)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  // BGRA is the native texture layout, RGBA needs a swizzle on upload. HDR
+  // frames are only worth their 64bpp if we can show them, otherwise the
+  // host packs them to RGBA10 for us
+  *preferred = FRAME_TYPE_BGRA;
+  return
+    (1U << FRAME_TYPE_BGRA   ) |
+    (1U << FRAME_TYPE_RGBA   ) |
+    (1U << FRAME_TYPE_RGBA10 ) |
+    (this->hdr ? (1U << FRAME_TYPE_RGBA16F) : 0) |
+    (1U << FRAME_TYPE_YUV420 );
+}
+
 void egl_on_restart(void * opaque)
 {
   struct Inst * this = (struct Inst *)opaque;
@@ -259,6 +453,11 @@ void egl_on_restart(void * opaque)
   eglDestroyContext(this->display, this->frameContext);
   this->frameContext = NULL;
   this->start        = false;
+  egl_gputimer_lost(this->frameTimer);
+
+  const LG_RendererFrameHandle held = atomic_exchange(&this->heldFrame, 0);
+  if (held)
+    this->params.releaseFrame(held);
 }
 
 void egl_on_resize(void * opaque, const int width, const int height, const LG_RendererRect destRect)
@@ -270,6 +469,20 @@ void egl_on_resize(void * opaque, const int width, const int height, const LG_Re
   memcpy(&this->destRect, &destRect, sizeof(LG_RendererRect));
 
   glViewport(0, 0, width, height);
+  atomic_store(&this->redraw, true);
+
+#if defined(SDL_VIDEO_DRIVER_WAYLAND)
+  // the buffers must match the surface for the compositor to scan them out
+  if (this->wayland)
+  {
+    wl_egl_window_resize((struct wl_egl_window *)this->nativeWind, width,
+        height, 0, 0);
+#if defined(EGL_PRESENTATION)
+    if (this->presentation)
+      egl_presentation_set_size(this->presentation, width, height);
+#endif
+  }
+#endif
 
   if (destRect.valid)
   {
@@ -279,59 +492,71 @@ void egl_on_resize(void * opaque, const int width, const int height, const LG_Re
     this->scaleY     = (float)destRect.h / (float)height;
   }
 
-  this->mouseScaleX = 2.0f / this->format.width ;
-  this->mouseScaleY = 2.0f / this->format.height;
-  egl_cursor_set_size(this->cursor,
-    (this->mouseWidth  * (1.0f / this->format.width )) * this->scaleX,
-    (this->mouseHeight * (1.0f / this->format.height)) * this->scaleY
-  );
+  // the cursor is in desktop coordinates which may differ from the frame
+  this->mouseScaleX = 2.0f / this->format.screenWidth ;
+  this->mouseScaleY = 2.0f / this->format.screenHeight;
 
   this->splashRatio  = (float)width / (float)height;
   this->screenScaleX = 1.0f / width;
   this->screenScaleY = 1.0f / height;
-
-  egl_cursor_set_state(
-    this->cursor,
-    this->cursorVisible,
-    (((float)this->cursorX * this->mouseScaleX) - 1.0f) * this->scaleX,
-    (((float)this->cursorY * this->mouseScaleY) - 1.0f) * this->scaleY
-  );
 }
 
-bool egl_on_mouse_shape(void * opaque, const LG_RendererCursor cursor, const int width, const int height, const int pitch, const uint8_t * data)
+bool egl_on_mouse_shape(void * opaque, const LG_RendererCursor cursor, const int width, const int height, const int pitch, const uint8_t * data, const unsigned int cacheID)
 {
   struct Inst * this = (struct Inst *)opaque;
-  if (!egl_cursor_set_shape(this->cursor, cursor, width, height, pitch, data))
+  if (!cursorstate_set_shape(this->cursorState, cursor, width, height, pitch,
+        data, cacheID))
   {
     DEBUG_ERROR("Failed to update the cursor shape");
     return false;
   }
 
-  this->mouseWidth  = width;
-  this->mouseHeight = height;
-  egl_cursor_set_size(this->cursor,
-    (this->mouseWidth  * (1.0f / this->format.width )) * this->scaleX,
-    (this->mouseHeight * (1.0f / this->format.height)) * this->scaleY
-  );
-
+  atomic_store(&this->cursorMoved, true);
   return true;
 }
 
 bool egl_on_mouse_event(void * opaque, const bool visible, const int x, const int y)
 {
   struct Inst * this = (struct Inst *)opaque;
-  this->cursorVisible = visible;
-  this->cursorX       = x;
-  this->cursorY       = y;
+  cursorstate_set_pos(this->cursorState, visible, x, y);
+  atomic_store(&this->cursorMoved, true);
+  return true;
+}
+
+// take the newest cursor from the cursor thread, this only uploads the shapes
+// that have been replaced since the last render
+static void egl_update_cursor(struct Inst * this)
+{
+  CursorInfo * info = &this->cursorInfo;
+  cursorstate_get(this->cursorState, info);
 
+  for(int i = 0; i < KVMFR_CURSOR_CACHE; ++i)
+  {
+    const CursorImage * image = cursorstate_take_shape(this->cursorState, i);
+    if (image)
+      egl_cursor_set_shape(this->cursor, image, i);
+  }
+
+  bool visible;
+  int  x, y;
+  if (this->params.latchCursor && this->params.latchCursor(&visible, &x, &y))
+  {
+    info->visible = visible;
+    info->x       = x;
+    info->y       = y;
+  }
+
+  egl_cursor_set_active(this->cursor, info->shape);
+  egl_cursor_set_size(this->cursor,
+    (info->width  * (1.0f / this->format.screenWidth )) * this->scaleX,
+    (info->height * (1.0f / this->format.screenHeight)) * this->scaleY
+  );
   egl_cursor_set_state(
     this->cursor,
-    this->cursorVisible,
-    (((float)this->cursorX * this->mouseScaleX) - 1.0f) * this->scaleX,
-    (((float)this->cursorY * this->mouseScaleY) - 1.0f) * this->scaleY
+    info->visible,
+    (((float)info->x * this->mouseScaleX) - 1.0f) * this->scaleX,
+    (((float)info->y * this->mouseScaleY) - 1.0f) * this->scaleY
   );
-
-  return true;
 }
 
 bool egl_on_frame_format(void * opaque, const LG_RendererFormat format, bool useDMA)
@@ -361,20 +586,96 @@ bool egl_on_frame_format(void * opaque, const LG_RendererFormat format, bool use
   }
 
   this->useNearest = this->width < format.width || this->height < format.height;
+  atomic_store(&this->redraw, true);
   return egl_desktop_setup(this->desktop, format, useDMA);
 }
 
-bool egl_on_frame(void * opaque, const FrameBuffer * frame, int dmaFd)
+bool egl_on_frame(void * opaque, const FrameBuffer * frame, int dmaFd,
+    const FrameDamageRect * damageRects, int damageRectsCount)
 {
   struct Inst * this = (struct Inst *)opaque;
 
-  if (!egl_desktop_update(this->desktop, frame, dmaFd))
+  egl_gputimer_begin(this->frameTimer, EGL_GPU_UPLOAD);
+  const bool updated = egl_desktop_update(this->desktop, frame, dmaFd,
+      damageRects, damageRectsCount);
+  egl_gputimer_end (this->frameTimer, EGL_GPU_UPLOAD);
+  egl_gputimer_next(this->frameTimer);
+
+  if (!updated)
   {
     DEBUG_INFO("Failed to to update the desktop");
     return false;
   }
 
   this->start = true;
+  atomic_store(&this->redraw, true);
+  return true;
+}
+
+bool egl_on_frame_acquire(void * opaque, const LG_RendererFrameHandle handle,
+    const FrameBuffer * frame, int dmaFd, const FrameDamageRect * damageRects,
+    int damageRectsCount)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  // an upload is copied before it returns, only an imported buffer is still
+  // read from by the render
+  const bool updated = egl_on_frame(opaque, frame, dmaFd, damageRects,
+      damageRectsCount);
+  if (!updated || dmaFd < 0)
+  {
+    this->params.releaseFrame(handle);
+    return updated;
+  }
+
+  // set after the update so a render that takes it draws from this frame
+  atomic_store(&this->heldFrame, handle);
+  return true;
+}
+
+bool egl_on_tile_format(void * opaque, const unsigned int index,
+    const LG_RendererFormat format)
+{
+  struct Inst * this = (struct Inst *)opaque;
+  struct Tile * tile = &this->tiles[index];
+
+  // each tile has a thread of its own which keeps its context current
+  if (!tile->context)
+  {
+    static EGLint attrs[] = {
+      EGL_CONTEXT_CLIENT_VERSION, 2,
+      EGL_NONE
+    };
+
+    if (!(tile->context = eglCreateContext(this->display, this->configs, this->context, attrs)))
+    {
+      DEBUG_ERROR("Failed to create the context of tile %u", index);
+      return false;
+    }
+
+    if (!eglMakeCurrent(this->display, EGL_NO_SURFACE, EGL_NO_SURFACE, tile->context))
+    {
+      DEBUG_ERROR("Failed to make the context of tile %u current", index);
+      return false;
+    }
+  }
+
+  atomic_store(&tile->ready, false);
+  memcpy(&tile->format, &format, sizeof(LG_RendererFormat));
+  return egl_desktop_setup(tile->desktop, format, false);
+}
+
+bool egl_on_tile_frame(void * opaque, const unsigned int index,
+    const FrameBuffer * frame)
+{
+  struct Inst * this = (struct Inst *)opaque;
+  struct Tile * tile = &this->tiles[index];
+
+  if (!egl_desktop_update(tile->desktop, frame, -1, NULL, 0))
+    return false;
+
+  atomic_store_explicit(&tile->ready, true, memory_order_release);
+  atomic_store(&this->redraw, true);
   return true;
 }
 
@@ -411,15 +712,19 @@ void egl_on_alert(void * opaque, const LG_MsgAlert alert, const char * message,
   }
 
   this->showAlert = true;
+  atomic_store(&this->redraw, true);
 }
 
 bool egl_render_startup(void * opaque, SDL_Window * window)
 {
   struct Inst * this = (struct Inst *)opaque;
 
+  // headless there is no window system, see SDL_SYSWM_UNKNOWN below
   SDL_SysWMinfo wminfo;
   SDL_VERSION(&wminfo.version);
-  if (!SDL_GetWindowWMInfo(window, &wminfo))
+  if (this->params.headless)
+    wminfo.subsystem = SDL_SYSWM_UNKNOWN;
+  else if (!SDL_GetWindowWMInfo(window, &wminfo))
   {
     DEBUG_ERROR("SDL_GetWindowWMInfo failed");
     return false;
@@ -462,10 +767,37 @@ bool egl_render_startup(void * opaque, SDL_Window * window)
         this->display = eglGetDisplay(native);
       }
       this->nativeWind = (EGLNativeWindowType)wl_egl_window_create(wminfo.info.wl.surface, width, height);
+      this->wayland    = true;
+
+#if defined(EGL_PRESENTATION)
+      if (egl_presentation_init(&this->presentation, wminfo.info.wl.display,
+            wminfo.info.wl.surface))
+        egl_presentation_set_size(this->presentation, width, height);
+#endif
       break;
     }
 #endif
 
+    case SDL_SYSWM_UNKNOWN:
+    {
+      if (!this->params.headless)
+      {
+        DEBUG_ERROR("Unsupported subsystem");
+        return false;
+      }
+
+      const char * exts = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+      if (!exts || !strstr(exts, "EGL_MESA_platform_surfaceless"))
+      {
+        DEBUG_ERROR("Headless rendering needs EGL_MESA_platform_surfaceless");
+        return false;
+      }
+
+      this->display = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+          EGL_DEFAULT_DISPLAY, NULL);
+      break;
+    }
+
     default:
       DEBUG_ERROR("Unsupported subsystem");
       return false;
@@ -484,27 +816,87 @@ bool egl_render_startup(void * opaque, SDL_Window * window)
     return false;
   }
 
-  EGLint attr[] =
+  // HDR10 needs a 10-bit surface the compositor treats as BT.2020 PQ
+  if (this->opt.hdr && !this->params.headless)
   {
-    EGL_BUFFER_SIZE    , 32,
-    EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
-    EGL_SAMPLE_BUFFERS , 1,
-    EGL_SAMPLES        , 4,
-    EGL_NONE
-  };
+    const char * exts = eglQueryString(this->display, EGL_EXTENSIONS);
+    if (strstr(exts, "EGL_EXT_gl_colorspace_bt2020_pq") != NULL)
+    {
+      EGLint hdrAttr[] =
+      {
+        EGL_RED_SIZE       , 10,
+        EGL_GREEN_SIZE     , 10,
+        EGL_BLUE_SIZE      , 10,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+        EGL_SAMPLE_BUFFERS , 1,
+        EGL_SAMPLES        , 4,
+        EGL_NONE
+      };
+
+      const EGLint surfAttr[] =
+      {
+        EGL_GL_COLORSPACE_KHR, EGL_GL_COLORSPACE_BT2020_PQ_EXT,
+        EGL_NONE
+      };
 
-  EGLint num_config;
-  if (!eglChooseConfig(this->display, attr, &this->configs, 1, &num_config))
-  {
-    DEBUG_ERROR("Failed to choose config (eglError: 0x%x)", eglGetError());
-    return false;
+      EGLint num_config;
+      if (eglChooseConfig(this->display, hdrAttr, &this->configs, 1, &num_config) &&
+          num_config == 1)
+      {
+        this->surface = eglCreateWindowSurface(this->display, this->configs,
+            this->nativeWind, surfAttr);
+        this->hdr = this->surface != EGL_NO_SURFACE;
+      }
+    }
+
+    if (this->hdr)
+      DEBUG_INFO("HDR10 output enabled, SDR white at %d nits", this->opt.sdrWhite);
+    else
+      DEBUG_WARN("HDR10 output is not supported, using SDR");
   }
 
-  this->surface = eglCreateWindowSurface(this->display, this->configs, this->nativeWind, NULL);
-  if (this->surface == EGL_NO_SURFACE)
+  if (!this->hdr)
   {
-    DEBUG_ERROR("Failed to create EGL surface (eglError: 0x%x)", eglGetError());
-    return false;
+    EGLint attr[] =
+    {
+      EGL_BUFFER_SIZE    , 32,
+      EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+      EGL_SURFACE_TYPE   , this->params.headless ? EGL_PBUFFER_BIT : EGL_WINDOW_BIT,
+      EGL_SAMPLE_BUFFERS , 1,
+      EGL_SAMPLES        , 4,
+      EGL_NONE
+    };
+
+    EGLint num_config;
+    if (!eglChooseConfig(this->display, attr, &this->configs, 1, &num_config))
+    {
+      DEBUG_ERROR("Failed to choose config (eglError: 0x%x)", eglGetError());
+      return false;
+    }
+
+    if (this->params.headless)
+    {
+      // the drawing is thrown away, it is only here to be timed
+      int width, height;
+      SDL_GetWindowSize(window, &width, &height);
+      const EGLint pbufAttr[] =
+      {
+        EGL_WIDTH , width,
+        EGL_HEIGHT, height,
+        EGL_NONE
+      };
+      this->surface = eglCreatePbufferSurface(this->display, this->configs,
+          pbufAttr);
+    }
+    else
+      this->surface = eglCreateWindowSurface(this->display, this->configs,
+          this->nativeWind, NULL);
+
+    if (this->surface == EGL_NO_SURFACE)
+    {
+      DEBUG_ERROR("Failed to create EGL surface (eglError: 0x%x)", eglGetError());
+      return false;
+    }
   }
 
   EGLint ctxattr[] =
@@ -533,21 +925,51 @@ bool egl_render_startup(void * opaque, SDL_Window * window)
   if (strstr(client_exts, "EGL_EXT_image_dma_buf_import") != NULL)
     this->dmaSupport = true;
 
-  eglSwapInterval(this->display, this->opt.vsync ? 1 : 0);
+  if (strstr(client_exts, "EGL_KHR_swap_buffers_with_damage") != NULL)
+    this->swapWithDamage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)
+      eglGetProcAddress("eglSwapBuffersWithDamageKHR");
+  else if (strstr(client_exts, "EGL_EXT_swap_buffers_with_damage") != NULL)
+    this->swapWithDamage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)
+      eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+
+  // a pbuffer has no back buffers to keep
+  if (this->opt.partialUpdate && !this->params.headless &&
+      strstr(client_exts, "EGL_EXT_buffer_age") != NULL)
+  {
+    this->bufferAge = true;
+    DEBUG_INFO("Using EGL_EXT_buffer_age for cursor only updates");
+  }
+
+  eglSwapInterval(this->display,
+      this->opt.vsync && !this->params.headless ? 1 : 0);
 
-  if (!egl_desktop_init(&this->desktop, this->display))
+  const float sdrWhite = this->hdr ? this->opt.sdrWhite : 0.0f;
+  if (!egl_desktop_init(&this->desktop, this->display, sdrWhite))
   {
     DEBUG_ERROR("Failed to initialize the desktop");
     return false;
   }
 
-  if (!egl_cursor_init(&this->cursor))
+  for(unsigned int i = 0; i < this->params.tiles; ++i)
+    if (!egl_desktop_init(&this->tiles[i].desktop, this->display, sdrWhite))
+    {
+      DEBUG_ERROR("Failed to initialize the desktop of tile %u", i);
+      return false;
+    }
+
+  if (!egl_cursor_init(&this->cursor, sdrWhite))
   {
     DEBUG_ERROR("Failed to initialize the cursor");
     return false;
   }
 
-  if (!egl_fps_init(&this->fps, this->font, this->fontObj))
+  if (!egl_text_atlas_init(&this->atlas, this->font, this->fontObj))
+  {
+    DEBUG_ERROR("Failed to initialize the font atlas");
+    return false;
+  }
+
+  if (!egl_fps_init(&this->fps, this->atlas))
   {
     DEBUG_ERROR("Failed to initialize the FPS display");
     return false;
@@ -559,37 +981,201 @@ bool egl_render_startup(void * opaque, SDL_Window * window)
     return false;
   }
 
-  if (!egl_alert_init(&this->alert, this->font, this->fontObj))
+  if (!egl_alert_init(&this->alert, this->atlas))
   {
     DEBUG_ERROR("Failed to initialize the alert display");
     return false;
   }
 
+  // both contexts share the display so support on one is support on both,
+  // the frame timer makes its queries on the frameContext when first used
+  if (this->opt.gpuTimers)
+  {
+    if (egl_gputimer_init(&this->renderTimer))
+    {
+      if (!egl_gputimer_init(&this->frameTimer))
+        egl_gputimer_free(&this->renderTimer, true);
+    }
+
+    if (this->renderTimer)
+      DEBUG_INFO("GPU timers enabled");
+    else
+      DEBUG_WARN("GPU timers are not available");
+  }
+
+  return true;
+}
+
+bool egl_needs_render(void * opaque)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  // the splash fade, alert timeout and fps display change with time alone
+  if (!this->start || !this->waitDone || this->showAlert ||
+      this->params.showFPS)
+    return true;
+
+  return
+    atomic_load(&this->redraw) ||
+    atomic_load(&this->cursorMoved) ||
+    atomic_load(&this->heldFrame);
+}
+
+// the window area covered by the cursor with the origin at the bottom left
+static void egl_cursor_rect(struct Inst * this, EGLint rect[4])
+{
+  const CursorInfo * info = &this->cursorInfo;
+  if (!info->visible || !this->format.screenWidth ||
+      !this->format.screenHeight)
+  {
+    memset(rect, 0, sizeof(EGLint) * 4);
+    return;
+  }
+
+  const float sx = (float)this->destRect.w / this->format.screenWidth;
+  const float sy = (float)this->destRect.h / this->format.screenHeight;
+
+  // pad by a pixel for the filtering at the edges
+  const int x = this->destRect.x + (int)(info->x * sx) - 1;
+  const int y = this->destRect.y + (int)(info->y * sy) - 1;
+  const int w = (int)(info->width  * sx) + 2;
+  const int h = (int)(info->height * sy) + 2;
+
+  rect[0] = x;
+  rect[1] = this->height - (y + h);
+  rect[2] = w;
+  rect[3] = h;
+}
+
+static void egl_rect_union(EGLint dst[4], const EGLint src[4])
+{
+  if (src[2] <= 0 || src[3] <= 0)
+    return;
+
+  if (dst[2] <= 0 || dst[3] <= 0)
+  {
+    memcpy(dst, src, sizeof(EGLint) * 4);
+    return;
+  }
+
+  const EGLint x1 = dst[0] < src[0] ? dst[0] : src[0];
+  const EGLint y1 = dst[1] < src[1] ? dst[1] : src[1];
+  const EGLint x2 = dst[0] + dst[2] > src[0] + src[2] ?
+    dst[0] + dst[2] : src[0] + src[2];
+  const EGLint y2 = dst[1] + dst[3] > src[1] + src[3] ?
+    dst[1] + dst[3] : src[1] + src[3];
+  dst[0] = x1;
+  dst[1] = y1;
+  dst[2] = x2 - x1;
+  dst[3] = y2 - y1;
+}
+
+// the area of the back buffer that is out of date when the render only
+// changes the damage given, false if the whole buffer must be drawn
+static bool egl_partial_rect(struct Inst * this, const EGLint damage[4],
+    EGLint rect[4])
+{
+  EGLint age = 0;
+  if (!eglQuerySurface(this->display, this->surface, EGL_BUFFER_AGE_EXT,
+        &age) || age <= 0 || age > MAX_BUFFER_AGE ||
+      this->renderCount < (uint64_t)age)
+    return false;
+
+  // the buffer has the contents of age renders ago, it misses what the
+  // renders after it changed
+  memcpy(rect, damage, sizeof(EGLint) * 4);
+  for(EGLint i = 1; i < age; ++i)
+  {
+    const struct Damage * d =
+      &this->damage[(this->renderCount + 1 - i) % MAX_BUFFER_AGE];
+    if (d->full)
+      return false;
+    egl_rect_union(rect, d->rect);
+  }
+
   return true;
 }
 
+// the tiles are fit into the cells of the mosaic after the desktop
+static void egl_render_tiles(struct Inst * this)
+{
+  for(unsigned int i = 0; i < this->params.tiles; ++i)
+  {
+    struct Tile * tile = &this->tiles[i];
+    if (!atomic_load_explicit(&tile->ready, memory_order_acquire))
+      continue;
+
+    const LG_RendererRect cell = LG_RendererMosaicCell(this->params.tiles + 1,
+        i + 1, this->width, this->height);
+    const LG_RendererRect rect = LG_RendererFitRect(cell,
+        tile->format.screenWidth, tile->format.screenHeight);
+
+    egl_desktop_render(tile->desktop,
+        1.0f - (((rect.w / 2) + rect.x) * 2) / (float)this->width,
+        1.0f - (((rect.h / 2) + rect.y) * 2) / (float)this->height,
+        (float)rect.w / (float)this->width,
+        (float)rect.h / (float)this->height,
+        false);
+  }
+}
+
 bool egl_render(void * opaque, SDL_Window * window)
 {
   struct Inst * this = (struct Inst *)opaque;
 
+  // taken before the desktop is bound so it is the frame drawn
+  const LG_RendererFrameHandle held = atomic_exchange(&this->heldFrame, 0);
+
+  // a full redraw unless the cursor is all that has moved
+  const bool full =
+    atomic_exchange(&this->redraw, false) ||
+    !this->start || !this->waitDone || this->showAlert ||
+    this->params.showFPS;
+  atomic_store(&this->cursorMoved, false);
+
+  // when only the cursor has moved and the back buffer is recent enough just
+  // its old and new areas are drawn, the cursor is taken first to know where
+  // it went
+  EGLint damage[8];
+  EGLint scissor[4];
+  bool   partial = false;
+  memcpy(damage, this->cursorRect, sizeof(this->cursorRect));
+  if (!full && this->bufferAge)
+  {
+    egl_update_cursor(this);
+    egl_cursor_rect(this, damage + 4);
+    EGLint changed[4] = { 0 };
+    egl_rect_union(changed, damage    );
+    egl_rect_union(changed, damage + 4);
+    partial = egl_partial_rect(this, changed, scissor);
+  }
+
+  if (partial)
+  {
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(scissor[0], scissor[1], scissor[2], scissor[3]);
+  }
+
   glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
   glClear(GL_COLOR_BUFFER_BIT);
 
-  if (this->start && egl_desktop_render(this->desktop,
+  egl_gputimer_begin(this->renderTimer, EGL_GPU_DESKTOP);
+  const bool desktop = this->start && egl_desktop_render(this->desktop,
         this->translateX, this->translateY,
         this->scaleX    , this->scaleY    ,
-        this->useNearest))
+        this->useNearest);
+  egl_render_tiles(this);
+  egl_gputimer_end(this->renderTimer, EGL_GPU_DESKTOP);
+
+  if (desktop && !this->waitFadeTime)
   {
-    if (!this->waitFadeTime)
-    {
-      if (!this->params.quickSplash)
-        this->waitFadeTime = microtime() + SPLASH_FADE_TIME;
-      else
-        this->waitDone = true;
-    }
-    egl_cursor_render(this->cursor);
+    if (!this->params.quickSplash)
+      this->waitFadeTime = microtime() + SPLASH_FADE_TIME;
+    else
+      this->waitDone = true;
   }
 
+  egl_gputimer_begin(this->renderTimer, EGL_GPU_OVERLAY);
   if (!this->waitDone)
   {
     float a = 1.0f;
@@ -631,17 +1217,126 @@ bool egl_render(void * opaque, SDL_Window * window)
   }
 
   egl_fps_render(this->fps, this->screenScaleX, this->screenScaleY);
-  eglSwapBuffers(this->display, this->surface);
+  egl_gputimer_end(this->renderTimer, EGL_GPU_OVERLAY);
+
+  // the cursor is drawn last at the newest position the host has given, the
+  // partial render has already taken it for the scissor
+  if (!partial)
+    egl_update_cursor(this);
+  if (desktop)
+  {
+    egl_gputimer_begin(this->renderTimer, EGL_GPU_CURSOR);
+    egl_cursor_render(this->cursor);
+    egl_gputimer_end(this->renderTimer, EGL_GPU_CURSOR);
+  }
+
+  if (partial)
+  {
+    glDisable(GL_SCISSOR_TEST);
+    memcpy(this->cursorRect, damage + 4, sizeof(this->cursorRect));
+  }
+  else
+  {
+    egl_cursor_rect(this, this->cursorRect);
+    memcpy(damage + 4, this->cursorRect, sizeof(this->cursorRect));
+  }
+
+  ++this->renderCount;
+
+  // remember what this render changed for the next buffer that is older
+  struct Damage * history = &this->damage[this->renderCount % MAX_BUFFER_AGE];
+  history->full = full;
+  memset(history->rect, 0, sizeof(history->rect));
+  egl_rect_union(history->rect, damage    );
+  egl_rect_union(history->rect, damage + 4);
+#if defined(EGL_PRESENTATION)
+  if (this->presentation)
+    egl_presentation_request(this->presentation, this->renderCount);
+#endif
+
+  // the damage lets the compositor skip the rest of the window, with the
+  // buffer age only the damage was drawn
+  const LGTraceScope trace = lgTraceBegin("eglSwapBuffers");
+  if (!full && this->swapWithDamage)
+    this->swapWithDamage(this->display, this->surface, damage, 2);
+  else
+    eglSwapBuffers(this->display, this->surface);
+
+  // a pbuffer swap does nothing, wait for the GPU so the draw can be timed
+  if (this->params.headless)
+    glFinish();
+  lgTraceEnd(trace);
+
+  // the host can write over the frame once the GPU has drawn from it
+  if (held)
+  {
+    GLsync sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    if (sync)
+    {
+      glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT,
+          LG_FRAME_HOLD_TIMEOUT * 1000000ULL);
+      glDeleteSync(sync);
+    }
+    this->params.releaseFrame(held);
+  }
+
+  egl_gputimer_next(this->renderTimer);
   return true;
 }
 
-void egl_update_fps(void * opaque, const float avgUPS, const float avgFPS)
+void egl_update_fps(void * opaque, const float avgUPS, const float avgFPS,
+    const LG_RendererLatency * latency)
 {
   struct Inst * this = (struct Inst *)opaque;
   if (!this->params.showFPS)
     return;
 
-  egl_fps_update(this->fps, avgUPS, avgFPS);
+  char gpu[160];
+  const char * extra = NULL;
+  if (this->renderTimer)
+  {
+    const LG_RendererTiming timings[] =
+    {
+      egl_gputimer_take(this->frameTimer , EGL_GPU_UPLOAD ),
+      egl_gputimer_take(this->renderTimer, EGL_GPU_DESKTOP),
+      egl_gputimer_take(this->renderTimer, EGL_GPU_CURSOR ),
+      egl_gputimer_take(this->renderTimer, EGL_GPU_OVERLAY)
+    };
+    const char * names[] = { "Upl", "Desk", "Cur", "Ovl" };
+
+    int len = snprintf(gpu, sizeof(gpu), "GPU");
+    for(int i = 0; i < sizeof(timings) / sizeof(*timings); ++i)
+    {
+      const LG_RendererTiming * t = &timings[i];
+      int ret;
+      if (t->p50 < 0.0f)
+        ret = snprintf(gpu + len, sizeof(gpu) - len, "%s %s: -",
+            i == 0 ? "" : ",", names[i]);
+      else
+        ret = snprintf(gpu + len, sizeof(gpu) - len, "%s %s: %.2f/%.2f/%.2fms",
+            i == 0 ? "" : ",", names[i], t->p50, t->p99, t->max);
+
+      if (ret < 0 || (size_t)(len + ret) >= sizeof(gpu))
+        break;
+      len += ret;
+    }
+    extra = gpu;
+  }
+
+  egl_fps_update(this->fps, avgUPS, avgFPS, latency, extra);
+  atomic_store(&this->redraw, true);
+}
+
+bool egl_get_presented(void * opaque, uint64_t * render, uint64_t * presentTime,
+    uint64_t * refresh)
+{
+#if defined(EGL_PRESENTATION)
+  struct Inst * this = (struct Inst *)opaque;
+  if (this->presentation)
+    return egl_presentation_get(this->presentation, render, presentTime,
+        refresh);
+#endif
+  return false;
 }
 
 struct LG_Renderer LGR_EGL =
@@ -652,14 +1347,20 @@ struct LG_Renderer LGR_EGL =
   .initialize      = egl_initialize,
   .deinitialize    = egl_deinitialize,
   .supports        = egl_supports,
+  .frame_types     = egl_frame_types,
   .on_restart      = egl_on_restart,
   .on_resize       = egl_on_resize,
   .on_mouse_shape  = egl_on_mouse_shape,
   .on_mouse_event  = egl_on_mouse_event,
   .on_frame_format = egl_on_frame_format,
   .on_frame        = egl_on_frame,
+  .on_frame_acquire = egl_on_frame_acquire,
   .on_alert        = egl_on_alert,
   .render_startup  = egl_render_startup,
   .render          = egl_render,
-  .update_fps      = egl_update_fps
+  .needs_render    = egl_needs_render,
+  .get_presented   = egl_get_presented,
+  .update_fps      = egl_update_fps,
+  .on_tile_format  = egl_on_tile_format,
+  .on_tile_frame   = egl_on_tile_frame
 };
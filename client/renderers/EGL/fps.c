@@ -21,7 +21,6 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "common/debug.h"
 #include "utils.h"
 
-#include "texture.h"
 #include "shader.h"
 #include "model.h"
 
@@ -30,29 +29,22 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 // these headers are auto generated by cmake
 #include "fps.vert.h"
-#include "fps.frag.h"
 #include "fps_bg.frag.h"
 
 struct EGL_FPS
 {
-  const LG_Font * font;
-  LG_FontObj      fontObj;
-
-  EGL_Texture * texture;
-  EGL_Shader  * shader;
+  EGL_Text    * text;
   EGL_Shader  * shaderBG;
   EGL_Model   * model;
 
   bool  ready;
-  int   iwidth, iheight;
   float width, height;
 
   // uniforms
-  GLint uScreen  , uSize;
   GLint uScreenBG, uSizeBG;
 };
 
-bool egl_fps_init(EGL_FPS ** fps, const LG_Font * font, LG_FontObj fontObj)
+bool egl_fps_init(EGL_FPS ** fps, EGL_TextAtlas * atlas)
 {
   *fps = (EGL_FPS *)malloc(sizeof(EGL_FPS));
   if (!*fps)
@@ -63,18 +55,9 @@ bool egl_fps_init(EGL_FPS ** fps, const LG_Font * font, LG_FontObj fontObj)
 
   memset(*fps, 0, sizeof(EGL_FPS));
 
-  (*fps)->font    = font;
-  (*fps)->fontObj = fontObj;
-
-  if (!egl_texture_init(&(*fps)->texture, NULL))
-  {
-    DEBUG_ERROR("Failed to initialize the fps texture");
-    return false;
-  }
-
-  if (!egl_shader_init(&(*fps)->shader))
+  if (!egl_text_init(&(*fps)->text, atlas))
   {
-    DEBUG_ERROR("Failed to initialize the fps shader");
+    DEBUG_ERROR("Failed to initialize the fps text");
     return false;
   }
 
@@ -84,15 +67,6 @@ bool egl_fps_init(EGL_FPS ** fps, const LG_Font * font, LG_FontObj fontObj)
     return false;
   }
 
-
-  if (!egl_shader_compile((*fps)->shader,
-        b_shader_fps_vert, b_shader_fps_vert_size,
-        b_shader_fps_frag, b_shader_fps_frag_size))
-  {
-    DEBUG_ERROR("Failed to compile the fps shader");
-    return false;
-  }
-
   if (!egl_shader_compile((*fps)->shaderBG,
         b_shader_fps_vert   , b_shader_fps_vert_size,
         b_shader_fps_bg_frag, b_shader_fps_bg_frag_size))
@@ -101,9 +75,6 @@ bool egl_fps_init(EGL_FPS ** fps, const LG_Font * font, LG_FontObj fontObj)
     return false;
   }
 
-
-  (*fps)->uSize     = egl_shader_get_uniform_location((*fps)->shader  , "size"  );
-  (*fps)->uScreen   = egl_shader_get_uniform_location((*fps)->shader  , "screen");
   (*fps)->uSizeBG   = egl_shader_get_uniform_location((*fps)->shaderBG, "size"  );
   (*fps)->uScreenBG = egl_shader_get_uniform_location((*fps)->shaderBG, "screen");
 
@@ -114,7 +85,6 @@ bool egl_fps_init(EGL_FPS ** fps, const LG_Font * font, LG_FontObj fontObj)
   }
 
   egl_model_set_default((*fps)->model);
-  egl_model_set_texture((*fps)->model, (*fps)->texture);
 
   return true;
 }
@@ -124,53 +94,28 @@ void egl_fps_free(EGL_FPS ** fps)
   if (!*fps)
     return;
 
-  egl_texture_free(&(*fps)->texture );
-  egl_shader_free (&(*fps)->shader  );
-  egl_shader_free (&(*fps)->shaderBG);
-  egl_model_free  (&(*fps)->model   );
+  egl_text_free  (&(*fps)->text    );
+  egl_shader_free(&(*fps)->shaderBG);
+  egl_model_free (&(*fps)->model   );
 
   free(*fps);
   *fps = NULL;
 }
 
-void egl_fps_update(EGL_FPS * fps, const float avgFPS, const float renderFPS)
+void egl_fps_update(EGL_FPS * fps, const float avgFPS, const float renderFPS,
+    const LG_RendererLatency * latency, const char * extra)
 {
-  char str[128];
-  snprintf(str, sizeof(str), "UPS: %8.4f, FPS: %8.4f", avgFPS, renderFPS);
-
-  LG_FontBitmap * bmp = fps->font->render(fps->fontObj, 0xffffff00, str);
-  if (!bmp)
-  {
-    DEBUG_ERROR("Failed to render fps text");
-    return;
-  }
-
-  if (fps->iwidth != bmp->width || fps->iheight != bmp->height)
+  char str[768];
+  LG_RendererFormatFPS(str, sizeof(str), avgFPS, renderFPS, latency);
+  if (extra)
   {
-    fps->iwidth  = bmp->width;
-    fps->iheight = bmp->height;
-    fps->width   = (float)bmp->width;
-    fps->height  = (float)bmp->height;
-
-    egl_texture_setup(
-      fps->texture,
-      EGL_PF_BGRA,
-      bmp->width ,
-      bmp->height,
-      bmp->width * bmp->bpp,
-      false,
-      false
-    );
+    const size_t len = strlen(str);
+    snprintf(str + len, sizeof(str) - len, "\n%s", extra);
   }
 
-  egl_texture_update
-  (
-    fps->texture,
-    bmp->pixels
-  );
-
-  fps->ready  = true;
-  fps->font->release(fps->fontObj, bmp);
+  egl_text_set(fps->text, str);
+  egl_text_get_size(fps->text, &fps->width, &fps->height);
+  fps->ready = true;
 }
 
 void egl_fps_render(EGL_FPS * fps, const float scaleX, const float scaleY)
@@ -187,11 +132,8 @@ void egl_fps_render(EGL_FPS * fps, const float scaleX, const float scaleY)
   glUniform2f(fps->uSizeBG  , fps->width, fps->height);
   egl_model_render(fps->model);
 
-  // render the texture over the background
-  egl_shader_use(fps->shader);
-  glUniform2f(fps->uScreen, scaleX    , scaleY     );
-  glUniform2f(fps->uSize  , fps->width, fps->height);
-  egl_model_render(fps->model);
+  // draw the text over the background, it is 5 pixels in from the corner
+  egl_text_render(fps->text, 5.0f, 5.0f, scaleX, scaleY);
 
   glDisable(GL_BLEND);
 }
@@ -21,12 +21,15 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include <stdbool.h>
 
-#include "interface/font.h"
+#include "interface/renderer.h"
+#include "text.h"
 
 typedef struct EGL_FPS EGL_FPS;
 
-bool egl_fps_init(EGL_FPS ** fps, const LG_Font * font, LG_FontObj fontObj);
+bool egl_fps_init(EGL_FPS ** fps, EGL_TextAtlas * atlas);
 void egl_fps_free(EGL_FPS ** fps);
 
-void egl_fps_update(EGL_FPS * fps, const float avgUPS, const float avgFPS);
+// extra is shown on a line of its own under the latency if it is not NULL
+void egl_fps_update(EGL_FPS * fps, const float avgUPS, const float avgFPS,
+    const LG_RendererLatency * latency, const char * extra);
 void egl_fps_render(EGL_FPS * fps, const float scaleX, const float scaleY);
\ No newline at end of file
@@ -0,0 +1,312 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+cahe terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "gputimer.h"
+#include "common/debug.h"
+#include "common/histogram.h"
+#include "common/locking.h"
+#include "common/time.h"
+#include "common/trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL_egl.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+
+// the frames that may be in flight before the oldest must be read back
+#define GPU_TIMER_FRAMES 4
+
+// how often the GPU clock is matched to ours for the trace, in microseconds
+#define GPU_CALIBRATE_INTERVAL 1000000
+
+struct GPUFrame
+{
+  bool     pending;
+  unsigned used; // mask of 1 << EGL_GPUScope with both queries made
+  unsigned open; // mask of the scopes begun but not ended
+  GLuint   queries[EGL_GPU_SCOPE_MAX][2];
+};
+
+struct EGL_GPUTimer
+{
+  PFNGLGENQUERIESEXTPROC          glGenQueriesEXT;
+  PFNGLDELETEQUERIESEXTPROC       glDeleteQueriesEXT;
+  PFNGLQUERYCOUNTEREXTPROC        glQueryCounterEXT;
+  PFNGLGETQUERYOBJECTIVEXTPROC    glGetQueryObjectivEXT;
+  PFNGLGETQUERYOBJECTUI64VEXTPROC glGetQueryObjectui64vEXT;
+  PFNGLGETINTEGER64VEXTPROC       glGetInteger64vEXT;
+
+  bool            ready; // the queries exist on the current context
+  struct GPUFrame frames[GPU_TIMER_FRAMES];
+  unsigned int    head;  // the frame being recorded
+  unsigned int    tail;  // the oldest frame in flight
+  bool            skip;  // the ring was full when this frame began
+
+  // our microtime minus the GPU time in microseconds
+  int64_t         clockOffset;
+  uint64_t        nextCalibrate;
+
+  LG_Lock         lock;
+  Histogram       hist[EGL_GPU_SCOPE_MAX];
+};
+
+static const char * scopeNames[EGL_GPU_SCOPE_MAX] =
+{
+  "gpu upload",
+  "gpu desktop",
+  "gpu cursor",
+  "gpu overlay"
+};
+
+static void calibrate(EGL_GPUTimer * this)
+{
+  GLint64 gpu;
+  this->glGetInteger64vEXT(GL_TIMESTAMP_EXT, &gpu);
+  this->clockOffset   = (int64_t)microtime() - gpu / 1000;
+  this->nextCalibrate = microtime() + GPU_CALIBRATE_INTERVAL;
+}
+
+bool egl_gputimer_init(EGL_GPUTimer ** timer)
+{
+  const char * exts = (const char *)glGetString(GL_EXTENSIONS);
+  if (!exts || !strstr(exts, "GL_EXT_disjoint_timer_query"))
+  {
+    DEBUG_WARN("GL_EXT_disjoint_timer_query is not supported");
+    return false;
+  }
+
+  EGL_GPUTimer * this = (EGL_GPUTimer *)calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("Failed to malloc EGL_GPUTimer");
+    return false;
+  }
+
+  this->glGenQueriesEXT          = (PFNGLGENQUERIESEXTPROC         )eglGetProcAddress("glGenQueriesEXT"         );
+  this->glDeleteQueriesEXT       = (PFNGLDELETEQUERIESEXTPROC      )eglGetProcAddress("glDeleteQueriesEXT"      );
+  this->glQueryCounterEXT        = (PFNGLQUERYCOUNTEREXTPROC       )eglGetProcAddress("glQueryCounterEXT"       );
+  this->glGetQueryObjectivEXT    = (PFNGLGETQUERYOBJECTIVEXTPROC   )eglGetProcAddress("glGetQueryObjectivEXT"   );
+  this->glGetQueryObjectui64vEXT = (PFNGLGETQUERYOBJECTUI64VEXTPROC)eglGetProcAddress("glGetQueryObjectui64vEXT");
+  this->glGetInteger64vEXT       = (PFNGLGETINTEGER64VEXTPROC      )eglGetProcAddress("glGetInteger64vEXT"      );
+
+  if (!this->glGenQueriesEXT || !this->glDeleteQueriesEXT ||
+      !this->glQueryCounterEXT || !this->glGetQueryObjectivEXT ||
+      !this->glGetQueryObjectui64vEXT || !this->glGetInteger64vEXT)
+  {
+    DEBUG_WARN("The timer query functions are missing");
+    free(this);
+    return false;
+  }
+
+  // some implementations expose the extension without timestamps
+  GLint bits = 0;
+  PFNGLGETQUERYIVEXTPROC getQueryiv =
+    (PFNGLGETQUERYIVEXTPROC)eglGetProcAddress("glGetQueryivEXT");
+  if (getQueryiv)
+    getQueryiv(GL_TIMESTAMP_EXT, GL_QUERY_COUNTER_BITS_EXT, &bits);
+
+  if (!bits)
+  {
+    DEBUG_WARN("Timestamp queries are not supported");
+    free(this);
+    return false;
+  }
+
+  LG_LOCK_INIT(this->lock);
+  *timer = this;
+  return true;
+}
+
+void egl_gputimer_free(EGL_GPUTimer ** timer, bool current)
+{
+  EGL_GPUTimer * this = *timer;
+  if (!this)
+    return;
+
+  if (current && this->ready)
+    for(int i = 0; i < GPU_TIMER_FRAMES; ++i)
+      this->glDeleteQueriesEXT(EGL_GPU_SCOPE_MAX * 2,
+          &this->frames[i].queries[0][0]);
+
+  LG_LOCK_FREE(this->lock);
+  free(this);
+  *timer = NULL;
+}
+
+void egl_gputimer_lost(EGL_GPUTimer * this)
+{
+  if (!this)
+    return;
+
+  memset(this->frames, 0, sizeof(this->frames));
+  this->head  = 0;
+  this->tail  = 0;
+  this->skip  = false;
+  this->ready = false;
+}
+
+static void setup(EGL_GPUTimer * this)
+{
+  for(int i = 0; i < GPU_TIMER_FRAMES; ++i)
+    this->glGenQueriesEXT(EGL_GPU_SCOPE_MAX * 2,
+        &this->frames[i].queries[0][0]);
+
+  // clear any disjoint event from before we started
+  GLint disjoint;
+  glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+  calibrate(this);
+  this->ready = true;
+}
+
+void egl_gputimer_begin(EGL_GPUTimer * this, EGL_GPUScope scope)
+{
+  if (!this || this->skip)
+    return;
+
+  if (!this->ready)
+    setup(this);
+
+  struct GPUFrame * f = &this->frames[this->head];
+  if (f->pending)
+  {
+    // the oldest frame has not been read back yet, drop this one
+    this->skip = true;
+    return;
+  }
+
+  this->glQueryCounterEXT(f->queries[scope][0], GL_TIMESTAMP_EXT);
+  f->open |= 1U << scope;
+}
+
+void egl_gputimer_end(EGL_GPUTimer * this, EGL_GPUScope scope)
+{
+  if (!this || this->skip)
+    return;
+
+  struct GPUFrame * f = &this->frames[this->head];
+  if (!(f->open & (1U << scope)))
+    return;
+
+  this->glQueryCounterEXT(f->queries[scope][1], GL_TIMESTAMP_EXT);
+  f->open &= ~(1U << scope);
+  f->used |=   1U << scope;
+}
+
+static bool frameReady(EGL_GPUTimer * this, const struct GPUFrame * f)
+{
+  for(int s = 0; s < EGL_GPU_SCOPE_MAX; ++s)
+  {
+    if (!(f->used & (1U << s)))
+      continue;
+
+    GLint available = 0;
+    this->glGetQueryObjectivEXT(f->queries[s][1], GL_QUERY_RESULT_AVAILABLE_EXT,
+        &available);
+    if (!available)
+      return false;
+  }
+  return true;
+}
+
+static void collect(EGL_GPUTimer * this, const struct GPUFrame * f)
+{
+  const bool trace = lgTraceActive();
+  for(int s = 0; s < EGL_GPU_SCOPE_MAX; ++s)
+  {
+    if (!(f->used & (1U << s)))
+      continue;
+
+    GLuint64 start, end;
+    this->glGetQueryObjectui64vEXT(f->queries[s][0], GL_QUERY_RESULT_EXT, &start);
+    this->glGetQueryObjectui64vEXT(f->queries[s][1], GL_QUERY_RESULT_EXT, &end  );
+    if (end < start)
+      continue;
+
+    LG_LOCK(this->lock);
+    histogram_add(&this->hist[s], (end - start) / 1000);
+    LG_UNLOCK(this->lock);
+
+    if (trace)
+      lgTraceRecord(scopeNames[s],
+          (int64_t)(start / 1000) + this->clockOffset,
+          (int64_t)(end   / 1000) + this->clockOffset);
+  }
+}
+
+void egl_gputimer_next(EGL_GPUTimer * this)
+{
+  if (!this || !this->ready)
+    return;
+
+  if (this->skip)
+    this->skip = false;
+  else
+  {
+    struct GPUFrame * f = &this->frames[this->head];
+    f->open = 0;
+    if (f->used)
+    {
+      f->pending = true;
+      this->head = (this->head + 1) % GPU_TIMER_FRAMES;
+    }
+  }
+
+  // the results of frames that span a disjoint event are meaningless
+  GLint disjoint = 0;
+  glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+
+  while(this->frames[this->tail].pending)
+  {
+    struct GPUFrame * f = &this->frames[this->tail];
+    if (!disjoint)
+    {
+      if (!frameReady(this, f))
+        break;
+      collect(this, f);
+    }
+
+    f->pending = false;
+    f->used    = 0;
+    this->tail = (this->tail + 1) % GPU_TIMER_FRAMES;
+  }
+
+  if (disjoint || microtime() >= this->nextCalibrate)
+    calibrate(this);
+}
+
+LG_RendererTiming egl_gputimer_take(EGL_GPUTimer * this, EGL_GPUScope scope)
+{
+  LG_RendererTiming t = { -1.0f, -1.0f, -1.0f };
+  if (!this)
+    return t;
+
+  LG_LOCK(this->lock);
+  const Histogram * hist = &this->hist[scope];
+  if (hist->count)
+  {
+    t.p50 = histogram_percentile(hist, 50.0) / 1000.0f;
+    t.p99 = histogram_percentile(hist, 99.0) / 1000.0f;
+    t.max = hist->max / 1000.0f;
+  }
+  histogram_reset(&this->hist[scope]);
+  LG_UNLOCK(this->lock);
+  return t;
+}
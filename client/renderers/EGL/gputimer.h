@@ -0,0 +1,68 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "interface/renderer.h"
+
+/*
+ * GPU time of the render stages from GL_EXT_disjoint_timer_query. Queries
+ * belong to the context they were made on so each context needs its own
+ * timer, they are made on the first begin and every later call must be made
+ * with that context current.
+ *
+ * The results are read back a few frames later without waiting on the GPU,
+ * frames are skipped rather than stalling if the ring is still in flight.
+ */
+
+typedef enum EGL_GPUScope
+{
+  EGL_GPU_UPLOAD , // the frame upload into the desktop texture
+  EGL_GPU_DESKTOP, // drawing the desktop
+  EGL_GPU_CURSOR , // drawing the cursor
+  EGL_GPU_OVERLAY, // the splash, alert and fps displays
+
+  EGL_GPU_SCOPE_MAX
+}
+EGL_GPUScope;
+
+typedef struct EGL_GPUTimer EGL_GPUTimer;
+
+// false if the current context does not support timestamp queries
+bool egl_gputimer_init(EGL_GPUTimer ** timer);
+
+// the queries are only deleted if the context they were made on is current,
+// otherwise they go with the context
+void egl_gputimer_free(EGL_GPUTimer ** timer, bool current);
+
+// the context the queries were made on has been destroyed, new ones will be
+// made on the next begin
+void egl_gputimer_lost(EGL_GPUTimer * timer);
+
+void egl_gputimer_begin(EGL_GPUTimer * timer, EGL_GPUScope scope);
+void egl_gputimer_end  (EGL_GPUTimer * timer, EGL_GPUScope scope);
+
+// end the frame and collect the results of earlier frames that are ready
+void egl_gputimer_next(EGL_GPUTimer * timer);
+
+// the timings of the scope collected since the last call, which resets them,
+// this may be called from any thread
+LG_RendererTiming egl_gputimer_take(EGL_GPUTimer * timer, EGL_GPUScope scope);
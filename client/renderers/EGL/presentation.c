@@ -0,0 +1,297 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "presentation.h"
+#include "common/debug.h"
+#include "common/time.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+
+#include <wayland-client.h>
+#include "presentation-time-client-protocol.h"
+
+// the most feedback requests and results that are kept
+#define FEEDBACK_MAX 16
+
+struct Feedback
+{
+  EGL_Presentation               * p;
+  struct wp_presentation_feedback * feedback;
+  uint64_t                          render;
+};
+
+struct Result
+{
+  uint64_t render, presentTime, refresh;
+};
+
+struct EGL_Presentation
+{
+  struct wl_display      * display;
+  struct wl_surface      * surface;
+  struct wl_event_queue  * queue;
+  struct wl_registry     * registry;
+  struct wl_compositor   * compositor;
+  struct wp_presentation * presentation;
+  clockid_t                clock;
+
+  struct Feedback pending[FEEDBACK_MAX];
+  struct Result   results[FEEDBACK_MAX];
+  unsigned int    head, count;
+};
+
+static void registry_global(void * data, struct wl_registry * registry,
+    uint32_t name, const char * interface, uint32_t version)
+{
+  EGL_Presentation * p = (EGL_Presentation *)data;
+
+  if (strcmp(interface, wp_presentation_interface.name) == 0)
+    p->presentation = wl_registry_bind(registry, name,
+        &wp_presentation_interface, 1);
+  else if (strcmp(interface, wl_compositor_interface.name) == 0)
+    p->compositor = wl_registry_bind(registry, name,
+        &wl_compositor_interface, 1);
+}
+
+static void registry_global_remove(void * data, struct wl_registry * registry,
+    uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener =
+{
+  .global        = registry_global,
+  .global_remove = registry_global_remove
+};
+
+static void presentation_clock_id(void * data,
+    struct wp_presentation * presentation, uint32_t clk_id)
+{
+  EGL_Presentation * p = (EGL_Presentation *)data;
+  p->clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener =
+{
+  .clock_id = presentation_clock_id
+};
+
+static void add_result(EGL_Presentation * p, uint64_t render,
+    uint64_t presentTime, uint64_t refresh)
+{
+  // drop the oldest result if nobody is reading them
+  if (p->count == FEEDBACK_MAX)
+  {
+    p->head = (p->head + 1) % FEEDBACK_MAX;
+    --p->count;
+  }
+
+  p->results[(p->head + p->count++) % FEEDBACK_MAX] = (struct Result)
+  {
+    .render      = render,
+    .presentTime = presentTime,
+    .refresh     = refresh
+  };
+}
+
+static void free_feedback(struct Feedback * fb)
+{
+  wp_presentation_feedback_destroy(fb->feedback);
+  fb->feedback = NULL;
+}
+
+static void feedback_sync_output(void * data,
+    struct wp_presentation_feedback * feedback, struct wl_output * output)
+{
+}
+
+static void feedback_presented(void * data,
+    struct wp_presentation_feedback * feedback, uint32_t tv_sec_hi,
+    uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh, uint32_t seq_hi,
+    uint32_t seq_lo, uint32_t flags)
+{
+  struct Feedback  * fb = (struct Feedback *)data;
+  EGL_Presentation * p  = fb->p;
+
+  const uint64_t sec = ((uint64_t)tv_sec_hi << 32) | tv_sec_lo;
+  uint64_t t = sec * 1000000ULL + tv_nsec / 1000;
+
+  // move the timestamp onto the clock of microtime
+  if (p->clock != CLOCK_MONOTONIC)
+  {
+    struct timespec now;
+    clock_gettime(p->clock, &now);
+    const uint64_t clk = (uint64_t)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+    t = t - clk + microtime();
+  }
+
+  add_result(p, fb->render, t, refresh / 1000);
+  free_feedback(fb);
+}
+
+static void feedback_discarded(void * data,
+    struct wp_presentation_feedback * feedback)
+{
+  struct Feedback * fb = (struct Feedback *)data;
+  add_result(fb->p, fb->render, 0, 0);
+  free_feedback(fb);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener =
+{
+  .sync_output = feedback_sync_output,
+  .presented   = feedback_presented,
+  .discarded   = feedback_discarded
+};
+
+bool egl_presentation_init(EGL_Presentation ** p, struct wl_display * display,
+    struct wl_surface * surface)
+{
+  *p = (EGL_Presentation *)calloc(1, sizeof(EGL_Presentation));
+  if (!*p)
+  {
+    DEBUG_ERROR("Failed to malloc EGL_Presentation");
+    return false;
+  }
+
+  EGL_Presentation * this = *p;
+  this->display = display;
+  this->surface = surface;
+  this->clock   = CLOCK_MONOTONIC;
+
+  // our events go to a queue of our own so SDL never dispatches them
+  this->queue = wl_display_create_queue(display);
+  if (!this->queue)
+  {
+    DEBUG_ERROR("Failed to create the Wayland event queue");
+    egl_presentation_free(p);
+    return false;
+  }
+
+  struct wl_display * wrapper = wl_proxy_create_wrapper(display);
+  wl_proxy_set_queue((struct wl_proxy *)wrapper, this->queue);
+  this->registry = wl_display_get_registry(wrapper);
+  wl_proxy_wrapper_destroy(wrapper);
+
+  wl_registry_add_listener(this->registry, &registry_listener, this);
+  wl_display_roundtrip_queue(display, this->queue);
+
+  if (!this->presentation)
+  {
+    DEBUG_INFO("The compositor does not support wp_presentation");
+    egl_presentation_free(p);
+    return false;
+  }
+
+  wp_presentation_add_listener(this->presentation, &presentation_listener, this);
+  wl_display_roundtrip_queue(display, this->queue);
+  return true;
+}
+
+void egl_presentation_free(EGL_Presentation ** p)
+{
+  EGL_Presentation * this = *p;
+  if (!this)
+    return;
+
+  for(int i = 0; i < FEEDBACK_MAX; ++i)
+    if (this->pending[i].feedback)
+      free_feedback(&this->pending[i]);
+
+  if (this->presentation)
+    wp_presentation_destroy(this->presentation);
+  if (this->compositor)
+    wl_compositor_destroy(this->compositor);
+  if (this->registry)
+    wl_registry_destroy(this->registry);
+  if (this->queue)
+    wl_event_queue_destroy(this->queue);
+
+  free(this);
+  *p = NULL;
+}
+
+void egl_presentation_set_size(EGL_Presentation * p, int width, int height)
+{
+  if (!p->compositor)
+    return;
+
+  struct wl_region * region = wl_compositor_create_region(p->compositor);
+  wl_region_add(region, 0, 0, width, height);
+  wl_surface_set_opaque_region(p->surface, region);
+  wl_region_destroy(region);
+}
+
+void egl_presentation_request(EGL_Presentation * p, uint64_t render)
+{
+  struct Feedback * fb = NULL;
+  for(int i = 0; i < FEEDBACK_MAX; ++i)
+    if (!p->pending[i].feedback)
+    {
+      fb = &p->pending[i];
+      break;
+    }
+
+  // the compositor is holding on to all of them, skip this one
+  if (!fb)
+    return;
+
+  fb->p        = p;
+  fb->render   = render;
+  fb->feedback = wp_presentation_feedback(p->presentation, p->surface);
+  wp_presentation_feedback_add_listener(fb->feedback, &feedback_listener, fb);
+}
+
+// read what has arrived without blocking, SDL may be reading on another thread
+static void dispatch(EGL_Presentation * p)
+{
+  while(wl_display_prepare_read_queue(p->display, p->queue) != 0)
+    wl_display_dispatch_queue_pending(p->display, p->queue);
+  wl_display_flush(p->display);
+
+  struct pollfd pfd = { .fd = wl_display_get_fd(p->display), .events = POLLIN };
+  if (poll(&pfd, 1, 0) > 0)
+    wl_display_read_events(p->display);
+  else
+    wl_display_cancel_read(p->display);
+
+  wl_display_dispatch_queue_pending(p->display, p->queue);
+}
+
+bool egl_presentation_get(EGL_Presentation * p, uint64_t * render,
+    uint64_t * presentTime, uint64_t * refresh)
+{
+  if (!p->count)
+    dispatch(p);
+
+  if (!p->count)
+    return false;
+
+  const struct Result * r = &p->results[p->head];
+  *render      = r->render;
+  *presentTime = r->presentTime;
+  *refresh     = r->refresh;
+
+  p->head = (p->head + 1) % FEEDBACK_MAX;
+  --p->count;
+  return true;
+}
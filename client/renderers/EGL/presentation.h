@@ -0,0 +1,43 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct wl_display;
+struct wl_surface;
+
+typedef struct EGL_Presentation EGL_Presentation;
+
+// false if the compositor does not support wp_presentation
+bool egl_presentation_init(EGL_Presentation ** p, struct wl_display * display,
+    struct wl_surface * surface);
+void egl_presentation_free(EGL_Presentation ** p);
+
+// mark the whole surface opaque so the compositor may scan it out directly
+void egl_presentation_set_size(EGL_Presentation * p, int width, int height);
+
+// ask for feedback on the next commit of the surface
+void egl_presentation_request(EGL_Presentation * p, uint64_t render);
+
+// as LG_RendererGetPresented
+bool egl_presentation_get(EGL_Presentation * p, uint64_t * render,
+    uint64_t * presentTime, uint64_t * refresh);
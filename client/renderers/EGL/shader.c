@@ -19,11 +19,17 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "shader.h"
 #include "common/debug.h"
+#include "common/option.h"
 #include "utils.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 #include <SDL2/SDL_egl.h>
 
@@ -86,6 +92,199 @@ bool egl_shader_load(EGL_Shader * this, const char * vertex_file, const char * f
   return ret;
 }
 
+#define SHADER_CACHE_MAGIC 0x4253474c // LGSB
+#define SHADER_CACHE_MAX   (16 * 1024 * 1024)
+
+struct ShaderCacheHeader
+{
+  uint32_t magic;
+  uint32_t format;
+  uint32_t length;
+};
+
+static uint64_t fnv1a(uint64_t hash, const void * data, size_t size)
+{
+  const uint8_t * p = (const uint8_t *)data;
+  for(size_t i = 0; i < size; ++i)
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+static uint64_t hash_string(uint64_t hash, const char * str)
+{
+  if (!str)
+    str = "";
+
+  // the length keeps adjacent strings from running into each other
+  const size_t len = strlen(str);
+  hash = fnv1a(hash, &len, sizeof(len));
+  return fnv1a(hash, str, len);
+}
+
+// mkdir -p
+static bool make_dir(char * path)
+{
+  for(char * p = path + 1; ; ++p)
+  {
+    if (*p != '/' && *p != '\0')
+      continue;
+
+    const char c = *p;
+    *p = '\0';
+    const bool ok = mkdir(path, 0700) == 0 || errno == EEXIST;
+    *p = c;
+
+    if (!ok)
+      return false;
+
+    if (c == '\0')
+      return true;
+  }
+}
+
+/* the binary is only valid for the driver that made it, so the driver and
+ * its version are part of the key along with the sources */
+static bool shader_cache_path(char * path, size_t size,
+    const char * vertex_code  , size_t vertex_size,
+    const char * fragment_code, size_t fragment_size)
+{
+  static int enabled = -1;
+  if (enabled < 0)
+  {
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    enabled = option_get_bool("egl", "shaderCache") && formats > 0;
+    if (!enabled)
+      DEBUG_INFO("The shader cache is disabled");
+  }
+
+  if (!enabled)
+    return false;
+
+  char dir[PATH_MAX];
+  const char * base = getenv("XDG_CACHE_HOME");
+  if (base && *base)
+    snprintf(dir, sizeof(dir), "%s/looking-glass/shaders", base);
+  else
+  {
+    const char * home = getenv("HOME");
+    if (!home || !*home)
+      return false;
+    snprintf(dir, sizeof(dir), "%s/.cache/looking-glass/shaders", home);
+  }
+
+  if (!make_dir(dir))
+  {
+    DEBUG_WARN("Failed to create the shader cache directory: %s", dir);
+    enabled = 0;
+    return false;
+  }
+
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  hash = hash_string(hash, (const char *)glGetString(GL_VENDOR  ));
+  hash = hash_string(hash, (const char *)glGetString(GL_RENDERER));
+  hash = hash_string(hash, (const char *)glGetString(GL_VERSION ));
+  hash = fnv1a(hash, &vertex_size  , sizeof(vertex_size  ));
+  hash = fnv1a(hash, vertex_code   , vertex_size          );
+  hash = fnv1a(hash, &fragment_size, sizeof(fragment_size));
+  hash = fnv1a(hash, fragment_code , fragment_size        );
+
+  const int len = snprintf(path, size, "%s/%016" PRIx64 ".bin", dir, hash);
+  return len > 0 && (size_t)len < size;
+}
+
+static bool shader_cache_load(EGL_Shader * this, const char * path)
+{
+  FILE * fp = fopen(path, "rb");
+  if (!fp)
+    return false;
+
+  struct ShaderCacheHeader header;
+  void * data = NULL;
+  bool   ret  = false;
+
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      header.magic != SHADER_CACHE_MAGIC ||
+      header.length == 0 || header.length > SHADER_CACHE_MAX)
+    goto out;
+
+  data = malloc(header.length);
+  if (!data || fread(data, header.length, 1, fp) != 1)
+    goto out;
+
+  GLuint program = glCreateProgram();
+  glProgramBinary(program, header.format, data, header.length);
+
+  GLint result = GL_FALSE;
+  glGetProgramiv(program, GL_LINK_STATUS, &result);
+  if (result == GL_FALSE)
+  {
+    // most likely the driver changed in a way its version doesn't show
+    DEBUG_WARN("Discarding the stale shader binary: %s", path);
+    glDeleteProgram(program);
+    goto out;
+  }
+
+  this->shader    = program;
+  this->hasShader = true;
+  ret = true;
+
+out:
+  free(data);
+  fclose(fp);
+  return ret;
+}
+
+static void shader_cache_save(GLuint program, const char * path)
+{
+  GLint length = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0 || length > SHADER_CACHE_MAX)
+    return;
+
+  void * data = malloc(length);
+  if (!data)
+    return;
+
+  GLenum  format;
+  GLsizei written = 0;
+  glGetProgramBinary(program, length, &written, &format, data);
+  if (written <= 0)
+  {
+    free(data);
+    return;
+  }
+
+  const struct ShaderCacheHeader header =
+  {
+    .magic  = SHADER_CACHE_MAGIC,
+    .format = format,
+    .length = written
+  };
+
+  // write beside it and rename so another instance never reads half a file
+  char tmp[PATH_MAX];
+  const int len = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+  FILE * fp = len > 0 && len < sizeof(tmp) ? fopen(tmp, "wb") : NULL;
+  if (!fp)
+  {
+    free(data);
+    return;
+  }
+
+  const bool ok =
+    fwrite(&header, sizeof(header), 1, fp) == 1 &&
+    fwrite(data, written, 1, fp) == 1;
+
+  free(data);
+  if (fclose(fp) != 0 || !ok || rename(tmp, path) != 0)
+  {
+    DEBUG_WARN("Failed to write the shader binary: %s", path);
+    remove(tmp);
+  }
+}
+
 bool egl_shader_compile(EGL_Shader * this, const char * vertex_code, size_t vertex_size, const char * fragment_code, size_t fragment_size)
 {
   if (this->hasShader)
@@ -94,6 +293,13 @@ bool egl_shader_compile(EGL_Shader * this, const char * vertex_code, size_t vert
     this->hasShader = false;
   }
 
+  char cachePath[PATH_MAX];
+  const bool cache = shader_cache_path(cachePath, sizeof(cachePath),
+    vertex_code, vertex_size, fragment_code, fragment_size);
+
+  if (cache && shader_cache_load(this, cachePath))
+    return true;
+
   GLint  length;
   GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
 
@@ -152,6 +358,8 @@ bool egl_shader_compile(EGL_Shader * this, const char * vertex_code, size_t vert
   this->shader = glCreateProgram();
   glAttachShader(this->shader, vertexShader  );
   glAttachShader(this->shader, fragmentShader);
+  if (cache)
+    glProgramParameteri(this->shader, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
   glLinkProgram(this->shader);
 
   glGetProgramiv(this->shader, GL_LINK_STATUS, &result);
@@ -183,6 +391,9 @@ bool egl_shader_compile(EGL_Shader * this, const char * vertex_code, size_t vert
   glDeleteShader(fragmentShader);
   glDeleteShader(vertexShader  );
 
+  if (cache)
+    shader_cache_save(this->shader, cachePath);
+
   this->hasShader = true;
   return true;
 }
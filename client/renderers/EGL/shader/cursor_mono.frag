@@ -5,10 +5,30 @@ out highp vec4 color;
 
 uniform sampler2D sampler1;
 
+uniform highp float sdrWhite;
+
+// BT.709 linear light in nits to BT.2020 PQ
+highp vec3 toPQ(highp vec3 nits)
+{
+  const highp mat3 bt709to2020 = mat3(
+    0.6274, 0.0691, 0.0164,
+    0.3293, 0.9195, 0.0880,
+    0.0433, 0.0114, 0.8956
+  );
+
+  highp vec3 y = clamp(bt709to2020 * nits / 10000.0, 0.0, 1.0);
+  highp vec3 p = pow(y, vec3(0.1593017578125));
+  return pow((0.8359375 + 18.8515625 * p) / (1.0 + 18.6875 * p), vec3(78.84375));
+}
+
 void main()
 {
   highp vec4 tmp = texture(sampler1, uv);
   if (tmp.rgb == vec3(0.0, 0.0, 0.0))
     discard;
   color = tmp;
+
+  // this inverts what is below it so only the strength needs limiting
+  if (sdrWhite > 0.0)
+    color.rgb = toPQ(color.rgb * sdrWhite);
 }
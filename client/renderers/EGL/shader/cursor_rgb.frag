@@ -6,6 +6,26 @@ out highp vec4 color;
 uniform sampler2D sampler1;
 
 uniform int cbMode;
+uniform highp float sdrWhite;
+
+// BT.709 linear light in nits to BT.2020 PQ
+highp vec3 toPQ(highp vec3 nits)
+{
+  const highp mat3 bt709to2020 = mat3(
+    0.6274, 0.0691, 0.0164,
+    0.3293, 0.9195, 0.0880,
+    0.0433, 0.0114, 0.8956
+  );
+
+  highp vec3 y = clamp(bt709to2020 * nits / 10000.0, 0.0, 1.0);
+  highp vec3 p = pow(y, vec3(0.1593017578125));
+  return pow((0.8359375 + 18.8515625 * p) / (1.0 + 18.6875 * p), vec3(78.84375));
+}
+
+highp vec3 srgbToLinear(highp vec3 c)
+{
+  return mix(c / 12.92, pow((c + 0.055) / 1.055, vec3(2.4)), step(0.04045, c));
+}
 
 void main()
 {
@@ -47,4 +67,7 @@ void main()
     color.g += (error.r * 0.7) + (error.g * 1.0);
     color.b += (error.r * 0.7) + (error.b * 1.0);
   }
+
+  if (sdrWhite > 0.0)
+    color.rgb = toPQ(srgbToLinear(clamp(color.rgb, 0.0, 1.0)) * sdrWhite);
 }
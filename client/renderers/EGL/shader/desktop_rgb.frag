@@ -11,10 +11,117 @@ uniform highp vec2  size;
 uniform       int   nv;
 uniform highp float nvGain;
 uniform       int   cbMode;
+uniform       int   linear;
+uniform highp float sdrWhite;
+uniform       int   upscale;
+
+// BT.709 linear light in nits to BT.2020 PQ
+highp vec3 toPQ(highp vec3 nits)
+{
+  const highp mat3 bt709to2020 = mat3(
+    0.6274, 0.0691, 0.0164,
+    0.3293, 0.9195, 0.0880,
+    0.0433, 0.0114, 0.8956
+  );
+
+  highp vec3 y = clamp(bt709to2020 * nits / 10000.0, 0.0, 1.0);
+  highp vec3 p = pow(y, vec3(0.1593017578125));
+  return pow((0.8359375 + 18.8515625 * p) / (1.0 + 18.6875 * p), vec3(78.84375));
+}
+
+highp vec3 srgbToLinear(highp vec3 c)
+{
+  return mix(c / 12.92, pow((c + 0.055) / 1.055, vec3(2.4)), step(0.04045, c));
+}
+
+// the direction and strength of the edge at a texel from its neighbours
+void edge(inout highp vec2 dir, inout highp float len, highp float w,
+    highp float c, highp float l, highp float r, highp float u, highp float d)
+{
+  highp float lenX = max(abs(r - c), abs(c - l));
+  highp float lenY = max(abs(d - c), abs(c - u));
+  lenX = lenX > 0.0 ? clamp(abs(r - l) / lenX, 0.0, 1.0) : 0.0;
+  lenY = lenY > 0.0 ? clamp(abs(d - u) / lenY, 0.0, 1.0) : 0.0;
+
+  dir += vec2(r - l, d - u) * w;
+  len += (lenX * lenX + lenY * lenY) * w;
+}
+
+// an edge adaptive Lanczos2 after AMD FSR EASU, the kernel is stretched along
+// the edge and the result clamped to the nearest texels so it does not ring
+highp vec4 upscaleEdge(highp vec2 pos)
+{
+  highp vec2 pp = pos * size - 0.5;
+  highp vec2 fp = floor(pp);
+  pp -= fp;
+
+  const highp vec3 luma = vec3(0.2126, 0.7152, 0.0722);
+  ivec2 base = ivec2(fp) - 1;
+  ivec2 maxp = ivec2(size) - 1;
+
+  // the 4x4 texels about the position, the corners are not used
+  highp vec4  t[16];
+  highp float l[16];
+  for(int y = 0; y < 4; ++y)
+    for(int x = 0; x < 4; ++x)
+    {
+      int i = y * 4 + x;
+      t[i] = texelFetch(sampler1, clamp(base + ivec2(x, y), ivec2(0), maxp), 0);
+      l[i] = dot(t[i].rgb, luma);
+    }
+
+  // the edge of the nearest four texels weighted as a bilinear sample
+  highp vec2  dir = vec2(0.0);
+  highp float len = 0.0;
+  edge(dir, len, (1.0 - pp.x) * (1.0 - pp.y), l[ 5], l[ 4], l[ 6], l[1], l[ 9]);
+  edge(dir, len,        pp.x  * (1.0 - pp.y), l[ 6], l[ 5], l[ 7], l[2], l[10]);
+  edge(dir, len, (1.0 - pp.x) *        pp.y , l[ 9], l[ 8], l[10], l[5], l[13]);
+  edge(dir, len,        pp.x  *        pp.y , l[10], l[ 9], l[11], l[6], l[14]);
+
+  highp float dirLen = dot(dir, dir);
+  dir  = dirLen < 1.0 / 32768.0 ? vec2(1.0, 0.0) : dir * inversesqrt(dirLen);
+  len *= 0.5;
+  len *= len;
+
+  // stretch the kernel along the edge, more so as the edge gets stronger
+  highp float stretch = 1.0 / max(abs(dir.x), abs(dir.y));
+  highp vec2  len2    = vec2(1.0 + (stretch - 1.0) * len, 1.0 - 0.5 * len);
+  highp float lob     = 0.5 - 0.29 * len;
+  highp float clp     = 1.0 / lob;
+
+  highp vec4  sum  = vec4(0.0);
+  highp float wsum = 0.0;
+  for(int y = 0; y < 4; ++y)
+    for(int x = 0; x < 4; ++x)
+    {
+      if ((x == 0 || x == 3) && (y == 0 || y == 3))
+        continue;
+
+      highp vec2 v  = vec2(float(x - 1), float(y - 1)) - pp;
+      highp vec2 vr = vec2(dot(v, dir), dot(v, vec2(-dir.y, dir.x))) * len2;
+      highp float d2 = min(dot(vr, vr), clp);
+
+      highp float wb = 0.4 * d2 - 1.0;
+      highp float wa = lob * d2 - 1.0;
+      highp float w  = (1.5625 * wb * wb - 0.5625) * (wa * wa);
+
+      sum  += t[y * 4 + x] * w;
+      wsum += w;
+    }
+
+  highp vec4 lo = min(min(t[5], t[6]), min(t[9], t[10]));
+  highp vec4 hi = max(max(t[5], t[6]), max(t[9], t[10]));
+  return clamp(sum / wsum, lo, hi);
+}
 
 void main()
 {
-  if(nearest == 1)
+  // the texels under this pixel, under one when the frame is being upscaled
+  highp vec2 texels = fwidth(uv) * size;
+
+  if (upscale == 1 && max(texels.x, texels.y) < 1.0)
+    color = upscaleEdge(uv);
+  else if(nearest == 1)
     color = texture(sampler1, uv);
   else
     color = texelFetch(sampler1, ivec2(uv * size), 0);
@@ -62,4 +169,15 @@ void main()
     color *= 1.0 + lumi;
     color *= nvGain;
   }
+
+  // linear frames are scRGB where 1.0 is 80 nits
+  if (sdrWhite > 0.0)
+    color.rgb = toPQ(linear == 1 ?
+      color.rgb * 80.0 : srgbToLinear(clamp(color.rgb, 0.0, 1.0)) * sdrWhite);
+  else if (linear == 1)
+  {
+    highp vec3 c = clamp(color.rgb, 0.0, 1.0);
+    color.rgb = mix(c * 12.92, 1.055 * pow(c, vec3(1.0 / 2.4)) - 0.055,
+      step(0.0031308, c));
+  }
 }
@@ -9,32 +9,45 @@ uniform highp vec2  size;
 uniform       int   nv;
 uniform highp float nvGain;
 
+uniform highp float sdrWhite;
+
 uniform sampler2D sampler1;
-uniform sampler2D sampler2;
-uniform sampler2D sampler3;
+
+// BT.709 linear light in nits to BT.2020 PQ
+highp vec3 toPQ(highp vec3 nits)
+{
+  const highp mat3 bt709to2020 = mat3(
+    0.6274, 0.0691, 0.0164,
+    0.3293, 0.9195, 0.0880,
+    0.0433, 0.0114, 0.8956
+  );
+
+  highp vec3 y = clamp(bt709to2020 * nits / 10000.0, 0.0, 1.0);
+  highp vec3 p = pow(y, vec3(0.1593017578125));
+  return pow((0.8359375 + 18.8515625 * p) / (1.0 + 18.6875 * p), vec3(78.84375));
+}
+
+highp vec3 srgbToLinear(highp vec3 c)
+{
+  return mix(c / 12.92, pow((c + 0.055) / 1.055, vec3(2.4)), step(0.04045, c));
+}
 
 void main()
 {
-  highp vec4 yuv;
-  if(nearest == 1)
-  {
-    yuv = vec4(
-      texture(sampler1, uv).r,
-      texture(sampler2, uv).r,
-      texture(sampler3, uv).r,
-      1.0
-    );
-  }
-  else
-  {
-    highp ivec2 px = ivec2(uv * size);
-    yuv = vec4(
-      texelFetch(sampler1, px, 0).r,
-      texelFetch(sampler2, px, 0).r,
-      texelFetch(sampler3, px, 0).r,
-      1.0
-    );
-  }
+  // the frame is YUV420 in one R8 texture as the host wrote it, the U and
+  // V planes follow the luma with two of their rows to each texture row
+  highp ivec2 px    = ivec2(uv * size);
+  highp int   pitch = textureSize(sampler1, 0).x;
+  highp int   h     = int(size.y);
+  highp int   c     = (px.y / 2) * (pitch / 2) + px.x / 2;
+  highp int   u     = h * pitch + c;
+  highp int   v     = u + (pitch * h) / 4;
+  highp vec4  yuv   = vec4(
+    texelFetch(sampler1, px                         , 0).r,
+    texelFetch(sampler1, ivec2(u % pitch, u / pitch), 0).r,
+    texelFetch(sampler1, ivec2(v % pitch, v / pitch), 0).r,
+    1.0
+  );
   
   highp mat4 yuv_to_rgb = mat4(
     1.0,  0.0  ,  1.402, -0.701,
@@ -50,4 +63,7 @@ void main()
     color *= 1.0 + lumi;
     color *= nvGain;
   }
+
+  if (sdrWhite > 0.0)
+    color.rgb = toPQ(srgbToLinear(clamp(color.rgb, 0.0, 1.0)) * sdrWhite);
 }
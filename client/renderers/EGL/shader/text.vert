@@ -0,0 +1,26 @@
+#version 300 es
+
+layout(location = 0) in vec2 corner;
+
+// per glyph, where it goes relative to the text and its cell in the atlas
+layout(location = 1) in vec2 offset;
+layout(location = 2) in vec4 cell;
+
+uniform vec2 screen;
+uniform vec2 position;
+uniform vec2 atlas;
+
+out highp vec2 uv;
+
+void main()
+{
+  vec2 px = position + offset + corner * cell.zw;
+  gl_Position = vec4(
+    px.x * screen.x * 2.0 - 1.0,
+    1.0 - px.y * screen.y * 2.0,
+    0.0,
+    1.0
+  );
+
+  uv = (cell.xy + corner * cell.zw) * atlas;
+}
@@ -0,0 +1,311 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+cahe terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "text.h"
+#include "common/debug.h"
+
+#include "texture.h"
+#include "shader.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// these headers are auto generated by cmake
+#include "text.vert.h"
+#include "text.frag.h"
+
+// the offset and atlas cell of each glyph
+#define FLOATS_PER_GLYPH 6
+
+struct EGL_TextAtlas
+{
+  EGL_Texture  * texture;
+  EGL_Shader   * shader;
+  GLuint         quad;
+  bool           hasQuad;
+
+  float          width, height;
+  unsigned int   lineHeight;
+  LG_FontGlyph   glyphs[LG_FONT_ATLAS_COUNT];
+
+  // uniforms
+  GLint uScreen, uPosition, uAtlas;
+};
+
+struct EGL_Text
+{
+  EGL_TextAtlas * atlas;
+
+  GLuint    buffer;
+  bool      hasBuffer;
+  size_t    capacity;
+  size_t    count;
+  GLfloat * data;
+
+  float width, height;
+};
+
+bool egl_text_atlas_init(EGL_TextAtlas ** atlas, const LG_Font * font,
+    LG_FontObj fontObj)
+{
+  *atlas = (EGL_TextAtlas *)malloc(sizeof(EGL_TextAtlas));
+  if (!*atlas)
+  {
+    DEBUG_ERROR("Failed to malloc EGL_TextAtlas");
+    return false;
+  }
+
+  memset(*atlas, 0, sizeof(EGL_TextAtlas));
+
+  LG_FontAtlas * fa = font->get_atlas(fontObj);
+  if (!fa)
+  {
+    DEBUG_ERROR("Failed to build the font atlas");
+    return false;
+  }
+
+  (*atlas)->width      = fa->width;
+  (*atlas)->height     = fa->height;
+  (*atlas)->lineHeight = fa->lineHeight;
+  memcpy((*atlas)->glyphs, fa->glyphs, sizeof(fa->glyphs));
+
+  if (!egl_texture_init(&(*atlas)->texture, NULL))
+  {
+    font->release_atlas(fontObj, fa);
+    DEBUG_ERROR("Failed to initialize the atlas texture");
+    return false;
+  }
+
+  const bool ok =
+    egl_texture_setup((*atlas)->texture, EGL_PF_BGRA, fa->width, fa->height,
+      fa->width * fa->bpp, false, false) &&
+    egl_texture_update((*atlas)->texture, fa->pixels);
+
+  font->release_atlas(fontObj, fa);
+  if (!ok)
+  {
+    DEBUG_ERROR("Failed to upload the atlas texture");
+    return false;
+  }
+
+  if (!egl_shader_init(&(*atlas)->shader))
+  {
+    DEBUG_ERROR("Failed to initialize the text shader");
+    return false;
+  }
+
+  if (!egl_shader_compile((*atlas)->shader,
+        b_shader_text_vert, b_shader_text_vert_size,
+        b_shader_text_frag, b_shader_text_frag_size))
+  {
+    DEBUG_ERROR("Failed to compile the text shader");
+    return false;
+  }
+
+  (*atlas)->uScreen   = egl_shader_get_uniform_location((*atlas)->shader, "screen"  );
+  (*atlas)->uPosition = egl_shader_get_uniform_location((*atlas)->shader, "position");
+  (*atlas)->uAtlas    = egl_shader_get_uniform_location((*atlas)->shader, "atlas"   );
+  egl_shader_associate_textures((*atlas)->shader, 1);
+
+  static const GLfloat corners[] =
+  {
+    0.0f, 0.0f,
+    1.0f, 0.0f,
+    0.0f, 1.0f,
+    1.0f, 1.0f
+  };
+
+  glGenBuffers(1, &(*atlas)->quad);
+  glBindBuffer(GL_ARRAY_BUFFER, (*atlas)->quad);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  (*atlas)->hasQuad = true;
+
+  return true;
+}
+
+void egl_text_atlas_free(EGL_TextAtlas ** atlas)
+{
+  if (!*atlas)
+    return;
+
+  egl_texture_free(&(*atlas)->texture);
+  egl_shader_free (&(*atlas)->shader );
+
+  if ((*atlas)->hasQuad)
+    glDeleteBuffers(1, &(*atlas)->quad);
+
+  free(*atlas);
+  *atlas = NULL;
+}
+
+bool egl_text_init(EGL_Text ** text, EGL_TextAtlas * atlas)
+{
+  *text = (EGL_Text *)malloc(sizeof(EGL_Text));
+  if (!*text)
+  {
+    DEBUG_ERROR("Failed to malloc EGL_Text");
+    return false;
+  }
+
+  memset(*text, 0, sizeof(EGL_Text));
+  (*text)->atlas = atlas;
+  return true;
+}
+
+void egl_text_free(EGL_Text ** text)
+{
+  if (!*text)
+    return;
+
+  if ((*text)->hasBuffer)
+    glDeleteBuffers(1, &(*text)->buffer);
+
+  free((*text)->data);
+  free(*text);
+  *text = NULL;
+}
+
+void egl_text_set(EGL_Text * text, const char * str)
+{
+  const EGL_TextAtlas * atlas = text->atlas;
+
+  const size_t len = strlen(str);
+  if (len > text->capacity)
+  {
+    // grow in steps so a text that changes length doesn't reallocate often
+    const size_t capacity = (len + 63) & ~(size_t)63;
+    GLfloat * data = realloc(text->data,
+        capacity * FLOATS_PER_GLYPH * sizeof(GLfloat));
+    if (!data)
+    {
+      DEBUG_ERROR("Failed to allocate the text vertices");
+      return;
+    }
+
+    if (!text->hasBuffer)
+    {
+      glGenBuffers(1, &text->buffer);
+      text->hasBuffer = true;
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, text->buffer);
+    glBufferData(GL_ARRAY_BUFFER, capacity * FLOATS_PER_GLYPH * sizeof(GLfloat),
+        NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    text->data     = data;
+    text->capacity = capacity;
+  }
+
+  unsigned int x = 0, y = 0, width = 0;
+  GLfloat * v = text->data;
+  text->count = 0;
+
+  for(const char * c = str; *c; ++c)
+  {
+    if (*c == '\n')
+    {
+      x  = 0;
+      y += atlas->lineHeight;
+      continue;
+    }
+
+    const int index =
+      (*c >= LG_FONT_ATLAS_FIRST && *c <= LG_FONT_ATLAS_LAST) ?
+      *c - LG_FONT_ATLAS_FIRST : '?' - LG_FONT_ATLAS_FIRST;
+    const LG_FontGlyph * g = &atlas->glyphs[index];
+
+    if (g->width)
+    {
+      *v++ = x;
+      *v++ = y;
+      *v++ = g->x;
+      *v++ = g->y;
+      *v++ = g->width;
+      *v++ = g->height;
+      ++text->count;
+
+      if (x + g->width > width)
+        width = x + g->width;
+    }
+
+    x += g->advance;
+    if (x > width)
+      width = x;
+  }
+
+  text->width  = width;
+  text->height = y + atlas->lineHeight;
+
+  if (!text->count)
+    return;
+
+  glBindBuffer(GL_ARRAY_BUFFER, text->buffer);
+  glBufferSubData(GL_ARRAY_BUFFER, 0,
+      text->count * FLOATS_PER_GLYPH * sizeof(GLfloat), text->data);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void egl_text_get_size(EGL_Text * text, float * width, float * height)
+{
+  *width  = text->width;
+  *height = text->height;
+}
+
+void egl_text_render(EGL_Text * text, const float x, const float y,
+    const float scaleX, const float scaleY)
+{
+  if (!text->count)
+    return;
+
+  const EGL_TextAtlas * atlas = text->atlas;
+  egl_shader_use(atlas->shader);
+  glUniform2f(atlas->uScreen  , scaleX, scaleY);
+  glUniform2f(atlas->uPosition, x, y);
+  glUniform2f(atlas->uAtlas   , 1.0f / atlas->width, 1.0f / atlas->height);
+  egl_texture_bind(atlas->texture);
+
+  glBindBuffer(GL_ARRAY_BUFFER, atlas->quad);
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void *)0);
+
+  const GLsizei stride = FLOATS_PER_GLYPH * sizeof(GLfloat);
+  glBindBuffer(GL_ARRAY_BUFFER, text->buffer);
+  glEnableVertexAttribArray(1);
+  glEnableVertexAttribArray(2);
+  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, (void *)0);
+  glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, stride,
+      (void *)(2 * sizeof(GLfloat)));
+  glVertexAttribDivisor(1, 1);
+  glVertexAttribDivisor(2, 1);
+
+  // every glyph in a single draw
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, text->count);
+
+  // the models share these attributes without a divisor
+  glVertexAttribDivisor(1, 0);
+  glVertexAttribDivisor(2, 0);
+  glDisableVertexAttribArray(0);
+  glDisableVertexAttribArray(1);
+  glDisableVertexAttribArray(2);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glUseProgram(0);
+}
@@ -0,0 +1,44 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "interface/font.h"
+
+typedef struct EGL_TextAtlas EGL_TextAtlas;
+typedef struct EGL_Text      EGL_Text;
+
+// rasterise the font's glyphs into a texture once, every text shares it
+bool egl_text_atlas_init(EGL_TextAtlas ** atlas, const LG_Font * font,
+    LG_FontObj fontObj);
+void egl_text_atlas_free(EGL_TextAtlas ** atlas);
+
+bool egl_text_init(EGL_Text ** text, EGL_TextAtlas * atlas);
+void egl_text_free(EGL_Text ** text);
+
+// lay the string out as a quad per glyph, changing the text only updates a
+// vertex buffer, this must be called with the context current
+void egl_text_set     (EGL_Text * text, const char * str);
+void egl_text_get_size(EGL_Text * text, float * width, float * height);
+
+// draw the text with its top left x, y pixels from the top left of the screen
+void egl_text_render(EGL_Text * text, const float x, const float y,
+    const float scaleX, const float scaleY);
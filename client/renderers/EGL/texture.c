@@ -19,7 +19,10 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "texture.h"
 #include "common/debug.h"
+#include "common/option.h"
 #include "common/framebuffer.h"
+#include "common/damage.h"
+#include "common/KVMFR.h"
 #include "debug.h"
 #include "utils.h"
 
@@ -31,16 +34,36 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include <SDL2/SDL_egl.h>
 
-/* this must be a multiple of 2 */
-#define TEXTURE_COUNT 2
+/* the deepest streaming ring, the ring depth must divide 256 as the state
+ * counters below wrap at 8 bits */
+#define TEXTURE_MAX 8
+
+/* full frame updates are uploaded in bands as they arrive */
+#define TEXTURE_STREAM_BANDS 8
+
+/* the most formats egl:texturePool may keep the textures of */
+#define TEXTURE_POOL_MAX 4
 
 struct Tex
 {
   GLuint   t;
+  GLuint   dmaTex; // the cached DMA texture holding this frame
   bool     hasPBO;
   GLuint   pbo;
   void *   map;
   GLsync   sync;
+
+  FrameDamage damage; // areas of the texture that are out of date
+  FrameDamage upload; // areas of the PBO to upload into the texture
+};
+
+/* the host never uses more than LGMP_Q_FRAME_LEN buffers so an import is kept
+ * for each until the format changes */
+struct DMAImage
+{
+  int      fd;
+  EGLImage image;
+  GLuint   tex;
 };
 
 struct TexState
@@ -48,6 +71,19 @@ struct TexState
   _Atomic(uint8_t) w, u, s, d;
 };
 
+/* the textures and PBOs of a format the texture was set up for before, they
+ * are taken back as they were left when it is set up for the format again */
+struct TexPoolEntry
+{
+  GLenum     intFormat;
+  size_t     width, height;
+  size_t     pboBufferSize;
+  bool       streaming;
+  bool       swizzle;
+  int        textureCount;
+  struct Tex tex[TEXTURE_MAX];
+};
+
 struct EGL_Texture
 {
   EGLDisplay * display;
@@ -58,17 +94,30 @@ struct EGL_Texture
   bool   dma;
   bool   ready;
 
+  int    ringDepth;
+  bool   persistent;
+
   GLuint       sampler;
   size_t       width, height, stride, pitch;
   GLenum       intFormat;
   GLenum       format;
   GLenum       dataType;
+  bool         swizzle; // red and blue are swapped by the texture unit
   unsigned int fourcc;
   size_t       pboBufferSize;
 
   struct TexState state;
   int             textureCount;
-  struct Tex      tex[TEXTURE_COUNT];
+  struct Tex      tex[TEXTURE_MAX];
+
+  struct DMAImage dmaImages[LGMP_Q_FRAME_LEN];
+  int             dmaImageCount;
+
+  /* most recently used first, with room for the format being replaced as it
+   * may be the one set up again */
+  int                 poolSize;
+  int                 poolCount;
+  struct TexPoolEntry pool[TEXTURE_POOL_MAX + 1];
 };
 
 bool egl_texture_init(EGL_Texture ** texture, EGLDisplay * display)
@@ -82,35 +131,84 @@ bool egl_texture_init(EGL_Texture ** texture, EGLDisplay * display)
 
   memset(*texture, 0, sizeof(EGL_Texture));
   (*texture)->display = display;
+
+  int depth = option_get_int("egl", "pboRing");
+  if (depth < 2 || depth > TEXTURE_MAX || (depth & (depth - 1)))
+  {
+    DEBUG_WARN("egl:pboRing must be 2, 4 or 8, using 2");
+    depth = 2;
+  }
+
+  int poolSize = option_get_int("egl", "texturePool");
+  if (poolSize < 0 || poolSize > TEXTURE_POOL_MAX)
+  {
+    DEBUG_WARN("egl:texturePool must be 0 to %d, using 2", TEXTURE_POOL_MAX);
+    poolSize = 2;
+  }
+
+  (*texture)->ringDepth  = depth;
+  (*texture)->persistent = option_get_bool("egl", "pboPersistent");
+  (*texture)->poolSize   = poolSize;
   return true;
 }
 
-void egl_texture_free(EGL_Texture ** texture)
+static void egl_texture_free_dma(EGL_Texture * texture)
 {
-  if (!*texture)
-    return;
+  for(int i = 0; i < texture->dmaImageCount; ++i)
+  {
+    struct DMAImage * dma = &texture->dmaImages[i];
+    glDeleteTextures(1, &dma->tex);
+    eglDestroyImage(texture->display, dma->image);
+  }
+  texture->dmaImageCount = 0;
 
-  glDeleteSamplers(1, &(*texture)->sampler);
+  for(int i = 0; i < TEXTURE_MAX; ++i)
+    texture->tex[i].dmaTex = 0;
+}
 
-  for(int i = 0; i < (*texture)->textureCount; ++i)
+static void egl_texture_delete(struct Tex * tex, int count)
+{
+  for(int i = 0; i < count; ++i)
   {
-    struct Tex * t = &(*texture)->tex[i];
+    struct Tex * t = &tex[i];
     if (t->hasPBO)
     {
       glBindBuffer(GL_PIXEL_UNPACK_BUFFER, t->pbo);
-      if ((*texture)->tex[i].map)
+      if (t->map)
       {
         glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-        (*texture)->tex[i].map = NULL;
+        t->map = NULL;
       }
       glDeleteBuffers(1, &t->pbo);
+      t->hasPBO = false;
       if (t->sync)
+      {
         glDeleteSync(t->sync);
+        t->sync = 0;
+      }
     }
 
-    glDeleteTextures(1, &t->t);
+    if (t->t)
+    {
+      glDeleteTextures(1, &t->t);
+      t->t = 0;
+    }
   }
   glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void egl_texture_free(EGL_Texture ** texture)
+{
+  if (!*texture)
+    return;
+
+  egl_texture_free_dma(*texture);
+
+  glDeleteSamplers(1, &(*texture)->sampler);
+  egl_texture_delete((*texture)->tex, (*texture)->textureCount);
+
+  for(int i = 0; i < (*texture)->poolCount; ++i)
+    egl_texture_delete((*texture)->pool[i].tex, (*texture)->pool[i].textureCount);
 
   free(*texture);
   *texture = NULL;
@@ -118,6 +216,10 @@ void egl_texture_free(EGL_Texture ** texture)
 
 static bool egl_texture_map(EGL_Texture * texture, uint8_t i)
 {
+  /* persistent buffers stay mapped from setup until they are deleted */
+  if (texture->persistent)
+    return texture->tex[i].map != NULL;
+
   glBindBuffer(GL_PIXEL_UNPACK_BUFFER, texture->tex[i].pbo);
   texture->tex[i].map = glMapBufferRange(
     GL_PIXEL_UNPACK_BUFFER,
@@ -140,7 +242,7 @@ static bool egl_texture_map(EGL_Texture * texture, uint8_t i)
 
 static void egl_texture_unmap(EGL_Texture * texture, uint8_t i)
 {
-  if (!texture->tex[i].map)
+  if (texture->persistent || !texture->tex[i].map)
     return;
 
   glBindBuffer(GL_PIXEL_UNPACK_BUFFER, texture->tex[i].pbo);
@@ -149,15 +251,117 @@ static void egl_texture_unmap(EGL_Texture * texture, uint8_t i)
   texture->tex[i].map = NULL;
 }
 
+/* GLES only takes BGRA data with GL_EXT_texture_format_BGRA8888, without it
+ * the bytes are uploaded as they are into an RGBA texture and swizzled back
+ * when sampled so the driver never converts the frame on the CPU */
+static bool egl_texture_has_bgra(void)
+{
+  static int hasBGRA = -1;
+  if (hasBGRA < 0)
+  {
+    const char * exts = (const char *)glGetString(GL_EXTENSIONS);
+    hasBGRA = exts && strstr(exts, "GL_EXT_texture_format_BGRA8888") ? 1 : 0;
+    if (!hasBGRA)
+      DEBUG_INFO("GL_EXT_texture_format_BGRA8888 is not supported, swizzling BGRA in the texture unit");
+  }
+  return hasBGRA;
+}
+
+/* keep the textures and PBOs of the current format in the pool */
+static void egl_texture_pool_put(EGL_Texture * texture)
+{
+  memmove(&texture->pool[1], &texture->pool[0],
+      texture->poolCount * sizeof(*texture->pool));
+
+  struct TexPoolEntry * entry = &texture->pool[0];
+  entry->intFormat     = texture->intFormat;
+  entry->width         = texture->width;
+  entry->height        = texture->height;
+  entry->pboBufferSize = texture->pboBufferSize;
+  entry->streaming     = texture->streaming;
+  entry->swizzle       = texture->swizzle;
+  entry->textureCount  = texture->textureCount;
+
+  for(int i = 0; i < texture->textureCount; ++i)
+  {
+    /* a persistent mapping is kept, the upload it fenced is long done by the
+     * time the set is used again */
+    egl_texture_unmap(texture, i);
+    if (texture->tex[i].sync)
+    {
+      glDeleteSync(texture->tex[i].sync);
+      texture->tex[i].sync = 0;
+    }
+    entry->tex[i] = texture->tex[i];
+  }
+  ++texture->poolCount;
+
+  memset(texture->tex, 0, sizeof(texture->tex));
+}
+
+/* take back the textures and PBOs of the format just set up if it is in the
+ * pool */
+static bool egl_texture_pool_take(EGL_Texture * texture)
+{
+  for(int i = 0; i < texture->poolCount; ++i)
+  {
+    struct TexPoolEntry * entry = &texture->pool[i];
+    if (entry->intFormat     != texture->intFormat     ||
+        entry->width         != texture->width         ||
+        entry->height        != texture->height        ||
+        entry->pboBufferSize != texture->pboBufferSize ||
+        entry->streaming     != texture->streaming     ||
+        entry->swizzle       != texture->swizzle       ||
+        entry->textureCount  != texture->textureCount)
+      continue;
+
+    /* the names of a DMA setup are not pooled */
+    egl_texture_delete(texture->tex, TEXTURE_MAX);
+
+    for(int j = 0; j < entry->textureCount; ++j)
+    {
+      texture->tex[j].t      = entry->tex[j].t;
+      texture->tex[j].pbo    = entry->tex[j].pbo;
+      texture->tex[j].hasPBO = entry->tex[j].hasPBO;
+      texture->tex[j].map    = entry->tex[j].map;
+    }
+
+    --texture->poolCount;
+    memmove(&texture->pool[i], &texture->pool[i + 1],
+        (texture->poolCount - i) * sizeof(*texture->pool));
+    return true;
+  }
+
+  return false;
+}
+
+/* drop the least recently used formats the pool has no room for */
+static void egl_texture_pool_trim(EGL_Texture * texture)
+{
+  while(texture->poolCount > texture->poolSize)
+  {
+    struct TexPoolEntry * last = &texture->pool[--texture->poolCount];
+    egl_texture_delete(last->tex, last->textureCount);
+  }
+}
+
 bool egl_texture_setup(EGL_Texture * texture, enum EGL_PixelFormat pixFmt, size_t width, size_t height, size_t stride, bool streaming, bool useDMA)
 {
-  if (texture->streaming)
+  /* the imports are only valid for the format they were made with */
+  egl_texture_free_dma(texture);
+
+  /* a mode flip back to this format can use what it allocated again */
+  if (texture->poolSize && !texture->dma && texture->tex[0].t)
+    egl_texture_pool_put(texture);
+  else if (texture->streaming)
   {
     for(int i = 0; i < texture->textureCount; ++i)
     {
       if (!useDMA)
       {
+        /* deleting the buffer also releases a persistent mapping */
         egl_texture_unmap(texture, i);
+        texture->tex[i].map = NULL;
         if (texture->tex[i].hasPBO)
         {
           glDeleteBuffers(1, &texture->tex[i].pbo);
@@ -172,20 +376,37 @@ bool egl_texture_setup(EGL_Texture * texture, enum EGL_PixelFormat pixFmt, size_
   texture->height       = height;
   texture->stride       = stride;
   texture->streaming    = streaming;
-  texture->textureCount = streaming ? TEXTURE_COUNT : 1;
+  texture->dma          = useDMA;
+  texture->textureCount = streaming ? texture->ringDepth : 1;
   texture->ready        = false;
+  texture->swizzle      = false;
 
   atomic_store_explicit(&texture->state.w, 0, memory_order_relaxed);
   atomic_store_explicit(&texture->state.u, 0, memory_order_relaxed);
   atomic_store_explicit(&texture->state.s, 0, memory_order_relaxed);
   atomic_store_explicit(&texture->state.d, 0, memory_order_relaxed);
 
+  for(int i = 0; i < texture->textureCount; ++i)
+  {
+    damage_set_full(&texture->tex[i].damage);
+    damage_set_full(&texture->tex[i].upload);
+  }
+
   switch(pixFmt)
   {
     case EGL_PF_BGRA:
       texture->bpp           = 4;
-      texture->format        = GL_BGRA;
-      texture->intFormat     = GL_BGRA;
+      if (useDMA || egl_texture_has_bgra())
+      {
+        texture->format      = GL_BGRA;
+        texture->intFormat   = GL_BGRA;
+      }
+      else
+      {
+        texture->format      = GL_RGBA;
+        texture->intFormat   = GL_RGBA8;
+        texture->swizzle     = true;
+      }
       texture->dataType      = GL_UNSIGNED_BYTE;
       texture->fourcc        = DRM_FORMAT_ARGB8888;
       texture->pboBufferSize = height * stride;
@@ -194,7 +415,7 @@ bool egl_texture_setup(EGL_Texture * texture, enum EGL_PixelFormat pixFmt, size_
     case EGL_PF_RGBA:
       texture->bpp           = 4;
       texture->format        = GL_RGBA;
-      texture->intFormat     = GL_BGRA;
+      texture->intFormat     = GL_RGBA8;
       texture->dataType      = GL_UNSIGNED_BYTE;
       texture->fourcc        = DRM_FORMAT_ABGR8888;
       texture->pboBufferSize = height * stride;
@@ -218,6 +439,19 @@ bool egl_texture_setup(EGL_Texture * texture, enum EGL_PixelFormat pixFmt, size_
       texture->pboBufferSize = height * stride;
       break;
 
+    case EGL_PF_YUV420:
+      /* the planes are uploaded as one R8 texture the shader samples with
+       * offsets, the chroma planes have two of their rows to each row */
+      texture->bpp           = 1;
+      texture->format        = GL_RED;
+      texture->intFormat     = GL_R8;
+      texture->dataType      = GL_UNSIGNED_BYTE;
+      texture->fourcc        = DRM_FORMAT_R8;
+      texture->width         = stride;
+      texture->height        = height * 3 / 2;
+      texture->pboBufferSize = texture->height * stride;
+      break;
+
     default:
       DEBUG_ERROR("Unsupported pixel format");
       return false;
@@ -225,6 +459,11 @@ bool egl_texture_setup(EGL_Texture * texture, enum EGL_PixelFormat pixFmt, size_
 
   texture->pitch = stride / texture->bpp;
 
+  const bool pooled = !useDMA && egl_texture_pool_take(texture);
+  egl_texture_pool_trim(texture);
+  if (pooled)
+    return true;
+
   for(int i = 0; i < texture->textureCount; ++i)
   {
     if (texture->tex[0].t)
@@ -249,6 +488,12 @@ bool egl_texture_setup(EGL_Texture * texture, enum EGL_PixelFormat pixFmt, size_
     glBindTexture(GL_TEXTURE_2D, texture->tex[i].t);
     glTexImage2D(GL_TEXTURE_2D, 0, texture->intFormat, texture->width,
       texture->height, 0, texture->format, texture->dataType, NULL);
+
+    if (texture->swizzle)
+    {
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_R, GL_BLUE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_RED );
+    }
   }
   glBindTexture(GL_TEXTURE_2D, 0);
 
@@ -261,17 +506,138 @@ bool egl_texture_setup(EGL_Texture * texture, enum EGL_PixelFormat pixFmt, size_
     texture->tex[i].hasPBO = true;
 
     glBindBuffer(GL_PIXEL_UNPACK_BUFFER, texture->tex[i].pbo);
-    glBufferStorage(
-      GL_PIXEL_UNPACK_BUFFER,
-      texture->pboBufferSize,
-      NULL,
-      GL_MAP_WRITE_BIT
-    );
+    if (!texture->persistent)
+    {
+      glBufferStorage(
+        GL_PIXEL_UNPACK_BUFFER,
+        texture->pboBufferSize,
+        NULL,
+        GL_MAP_WRITE_BIT
+      );
+      continue;
+    }
+
+    /* map once and write into the mapping for the life of the buffer, the
+     * ring state keeps the writer off buffers the GPU is still reading */
+    const GLbitfield flags =
+      GL_MAP_WRITE_BIT      |
+      GL_MAP_PERSISTENT_BIT |
+      GL_MAP_COHERENT_BIT;
+
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, texture->pboBufferSize, NULL, flags);
+    texture->tex[i].map = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+        texture->pboBufferSize, flags);
+
+    if (!texture->tex[i].map)
+    {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      EGL_ERROR("glMapBufferRange failed for %d of %lu bytes", i, texture->pboBufferSize);
+      return false;
+    }
   }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
   return true;
 }
 
+/* wait in the frame thread for the upload into t to complete, this keeps the
+ * render thread from ever blocking on a texture that isn't finished */
+static bool egl_texture_wait(EGL_Texture * texture, uint8_t t)
+{
+  struct Tex * tex = &texture->tex[t];
+  const GLenum result = glClientWaitSync(tex->sync, 0, 1000000000); // 1s
+  glDeleteSync(tex->sync);
+  tex->sync = 0;
+
+  switch(result)
+  {
+    case GL_ALREADY_SIGNALED:
+    case GL_CONDITION_SATISFIED:
+      return true;
+
+    case GL_TIMEOUT_EXPIRED:
+      DEBUG_ERROR("Timed out waiting for the texture upload");
+      return false;
+
+    default:
+      EGL_ERROR("glClientWaitSync failed");
+      return false;
+  }
+}
+
+/* upload the frame directly into the texture band by band as the host copies
+ * it in, this can only be done if the texture is not in use */
+static enum EGL_TexStatus egl_texture_stream(EGL_Texture * texture, uint8_t t,
+    const FrameBuffer * frame)
+{
+  const uint8_t su   = atomic_load_explicit(&texture->state.u, memory_order_acquire);
+  const uint8_t sw   = atomic_load_explicit(&texture->state.w, memory_order_acquire);
+  const uint8_t next = su + 1;
+  if (su != sw ||
+      next == atomic_load_explicit(&texture->state.s, memory_order_acquire) ||
+      next == atomic_load_explicit(&texture->state.d, memory_order_acquire))
+    return EGL_TEX_STATUS_NOTREADY;
+
+  struct Tex    * tex  = &texture->tex[t];
+  const uint8_t * data = framebuffer_get_data(frame);
+  const size_t    band =
+    (texture->height + TEXTURE_STREAM_BANDS - 1) / TEXTURE_STREAM_BANDS;
+
+  bool complete = true;
+  glBindTexture(GL_TEXTURE_2D, tex->t);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, texture->pitch);
+  for(size_t y = 0; y < texture->height; y += band)
+  {
+    const size_t rows = y + band > texture->height ? texture->height - y : band;
+    if (!framebuffer_wait(frame, (y + rows) * texture->stride))
+    {
+      complete = false;
+      break;
+    }
+
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, texture->width, rows,
+        texture->format, texture->dataType, data + y * texture->stride);
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  /* the host didn't finish the frame in time, drop it without presenting.
+   * The texture holds part of it so leave the damage full for the next */
+  if (!complete)
+  {
+    damage_set_full(&tex->damage);
+    damage_set_full(&tex->upload);
+    return EGL_TEX_STATUS_OK;
+  }
+
+  /* create a fence to prevent usage before the update is complete */
+  tex->sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  glFlush();
+
+  if (!egl_texture_wait(texture, t))
+    return EGL_TEX_STATUS_ERROR;
+
+  damage_reset(&tex->damage);
+  damage_reset(&tex->upload);
+
+  texture->ready = true;
+  atomic_fetch_add_explicit(&texture->state.w, 1, memory_order_release);
+  atomic_fetch_add_explicit(&texture->state.u, 1, memory_order_release);
+  atomic_fetch_add_explicit(&texture->state.s, 1, memory_order_release);
+  return EGL_TEX_STATUS_OK;
+}
+
+/* a persistent buffer is written while mapped, it can't be reused until its
+ * last upload has completed */
+static bool egl_texture_pbo_busy(EGL_Texture * texture, uint8_t sw)
+{
+  if (!texture->persistent)
+    return false;
+
+  const uint8_t ss =
+    atomic_load_explicit(&texture->state.s, memory_order_acquire);
+  return (uint8_t)(sw - ss) >= texture->textureCount;
+}
+
 static void egl_warn_slow()
 {
   static bool warnDone = false;
@@ -298,7 +664,13 @@ bool egl_texture_update(EGL_Texture * texture, const uint8_t * buffer)
       return true;
     }
 
-    const uint8_t t = sw % TEXTURE_COUNT;
+    if (egl_texture_pbo_busy(texture, sw))
+    {
+      egl_warn_slow();
+      return true;
+    }
+
+    const uint8_t t = sw % texture->textureCount;
     if (!egl_texture_map(texture, t))
       return EGL_TEX_STATUS_ERROR;
 
@@ -317,11 +689,32 @@ bool egl_texture_update(EGL_Texture * texture, const uint8_t * buffer)
   return true;
 }
 
-bool egl_texture_update_from_frame(EGL_Texture * texture, const FrameBuffer * frame)
+bool egl_texture_update_from_frame(EGL_Texture * texture, const FrameBuffer * frame,
+    const FrameDamageRect * damageRects, int damageRectsCount)
 {
   if (!texture->streaming)
     return false;
 
+  // the rects only cover the luma, the chroma planes are always read whole
+  if (texture->pixFmt == EGL_PF_YUV420)
+    damageRectsCount = 0;
+
+  // don't trust rects that fall outside of the frame
+  for(int i = 0; i < damageRectsCount; ++i)
+  {
+    const FrameDamageRect * r = damageRects + i;
+    if (r->x + r->width > texture->width || r->y + r->height > texture->height)
+    {
+      damageRectsCount = 0;
+      break;
+    }
+  }
+
+  // every texture in the ring needs these changes, even if this frame is
+  // skipped below
+  for(int i = 0; i < texture->textureCount; ++i)
+    damage_add(&texture->tex[i].damage, damageRects, damageRectsCount);
+
   const uint8_t sw =
     atomic_load_explicit(&texture->state.w, memory_order_acquire);
 
@@ -331,19 +724,58 @@ bool egl_texture_update_from_frame(EGL_Texture * texture, const FrameBuffer * fr
     return true;
   }
 
-  const uint8_t t = sw % TEXTURE_COUNT;
+  const uint8_t t = sw % texture->textureCount;
+  struct Tex * tex = &texture->tex[t];
+  // fall back to the PBO only when the slot can't be streamed into now, a
+  // frame that timed out is dropped rather than read again there
+  if (tex->damage.full)
+  {
+    const enum EGL_TexStatus status = egl_texture_stream(texture, t, frame);
+    if (status != EGL_TEX_STATUS_NOTREADY)
+      return status == EGL_TEX_STATUS_OK;
+  }
+
+  if (egl_texture_pbo_busy(texture, sw))
+  {
+    egl_warn_slow();
+    return true;
+  }
+
   if (!egl_texture_map(texture, t))
     return EGL_TEX_STATUS_ERROR;
 
-  framebuffer_read(
-    frame,
-    texture->tex[t].map,
-    texture->stride,
-    texture->height,
-    texture->width,
-    texture->bpp,
-    texture->stride
-  );
+  bool complete;
+  if (tex->damage.full)
+    complete = framebuffer_read(
+      frame,
+      tex->map,
+      texture->stride,
+      texture->height,
+      texture->width,
+      texture->bpp,
+      texture->stride
+    );
+  else
+    complete = framebuffer_read_rects(
+      frame,
+      tex->map,
+      texture->stride,
+      texture->bpp,
+      texture->stride,
+      tex->damage.rects,
+      tex->damage.count
+    );
+
+  // drop a frame the host didn't finish in time, the damage is kept so the
+  // next frame reads all of it again
+  if (!complete)
+  {
+    egl_texture_unmap(texture, t);
+    return true;
+  }
+
+  tex->upload = tex->damage;
+  damage_reset(&tex->damage);
 
   atomic_fetch_add_explicit(&texture->state.w, 1, memory_order_release);
   egl_texture_unmap(texture, t);
@@ -351,21 +783,19 @@ bool egl_texture_update_from_frame(EGL_Texture * texture, const FrameBuffer * fr
   return true;
 }
 
-bool egl_texture_update_from_dma(EGL_Texture * texture, const FrameBuffer * frame, const int dmaFd)
+/* find or make the texture imported from the dma buffer fd */
+static GLuint egl_texture_get_dma(EGL_Texture * texture, const int dmaFd)
 {
-  if (!texture->streaming)
-    return false;
+  for(int i = 0; i < texture->dmaImageCount; ++i)
+    if (texture->dmaImages[i].fd == dmaFd)
+      return texture->dmaImages[i].tex;
 
-  const uint8_t sw =
-    atomic_load_explicit(&texture->state.w, memory_order_acquire);
-
-  if (atomic_load_explicit(&texture->state.u, memory_order_acquire) == (uint8_t)(sw + 1))
+  if (texture->dmaImageCount == LGMP_Q_FRAME_LEN)
   {
-    egl_warn_slow();
-    return true;
+    DEBUG_ERROR("Too many dma buffers");
+    return 0;
   }
 
-  const uint8_t t = sw % TEXTURE_COUNT;
   EGLAttrib const attribs[] =
   {
     EGL_WIDTH                    , texture->width,
@@ -386,16 +816,46 @@ bool egl_texture_update_from_dma(EGL_Texture * texture, const FrameBuffer * fram
     attribs
   );
 
-  /* bind the texture and initiate the transfer */
-  glBindTexture(GL_TEXTURE_2D, texture->tex[t].t);
+  if (image == EGL_NO_IMAGE)
+  {
+    DEBUG_ERROR("Failed to import the dma buffer");
+    return 0;
+  }
+
+  struct DMAImage * dma = &texture->dmaImages[texture->dmaImageCount++];
+  dma->fd    = dmaFd;
+  dma->image = image;
+
+  glGenTextures(1, &dma->tex);
+  glBindTexture(GL_TEXTURE_2D, dma->tex);
   glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+  glBindTexture(GL_TEXTURE_2D, 0);
 
-  /* wait for completion */
-  framebuffer_wait(frame, texture->height * texture->stride);
+  return dma->tex;
+}
+
+bool egl_texture_update_from_dma(EGL_Texture * texture, const FrameBuffer * frame, const int dmaFd)
+{
+  if (!texture->streaming)
+    return false;
+
+  const uint8_t sw =
+    atomic_load_explicit(&texture->state.w, memory_order_acquire);
 
-  /* destroy the image to prevent future writes corrupting the display image */
-  eglDestroyImage(texture->display, image);
+  if (atomic_load_explicit(&texture->state.u, memory_order_acquire) == (uint8_t)(sw + 1))
+  {
+    egl_warn_slow();
+    return true;
+  }
+
+  const GLuint tex = egl_texture_get_dma(texture, dmaFd);
+  if (!tex)
+    return false;
 
+  /* the image is of the live buffer, wait for the host to finish writing it */
+  framebuffer_wait(frame, texture->height * texture->stride);
+
+  texture->tex[sw % texture->textureCount].dmaTex = tex;
   atomic_fetch_add_explicit(&texture->state.w, 1, memory_order_release);
   return true;
 }
@@ -415,16 +875,27 @@ enum EGL_TexStatus egl_texture_process(EGL_Texture * texture)
       nextu == atomic_load_explicit(&texture->state.d, memory_order_acquire))
     return texture->ready ? EGL_TEX_STATUS_OK : EGL_TEX_STATUS_NOTREADY;
 
-  const uint8_t t = su % TEXTURE_COUNT;
+  const uint8_t t = su % texture->textureCount;
 
   /* update the texture */
   if (!texture->dma)
   {
+    const FrameDamage * upload = &texture->tex[t].upload;
+
     glBindBuffer(GL_PIXEL_UNPACK_BUFFER, texture->tex[t].pbo);
     glBindTexture(GL_TEXTURE_2D, texture->tex[t].t);
     glPixelStorei(GL_UNPACK_ROW_LENGTH, texture->pitch);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, texture->width, texture->height,
-        texture->format, texture->dataType, (const void *)0);
+    if (upload->full)
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, texture->width, texture->height,
+          texture->format, texture->dataType, (const void *)0);
+    else
+      for(unsigned int i = 0; i < upload->count; ++i)
+      {
+        const FrameDamageRect * r = &upload->rects[i];
+        glTexSubImage2D(GL_TEXTURE_2D, 0, r->x, r->y, r->width, r->height,
+            texture->format, texture->dataType,
+            (const void *)(r->y * texture->stride + r->x * texture->bpp));
+      }
     glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
     /* create a fence to prevent usage before the update is complete */
@@ -432,17 +903,20 @@ enum EGL_TexStatus egl_texture_process(EGL_Texture * texture)
 
     /* we must flush to ensure the sync is in the command buffer */
     glFlush();
+
+    if (!egl_texture_wait(texture, t))
+      return EGL_TEX_STATUS_ERROR;
   }
 
   texture->ready = true;
   atomic_fetch_add_explicit(&texture->state.u, 1, memory_order_release);
+  atomic_fetch_add_explicit(&texture->state.s, 1, memory_order_release);
 
   return EGL_TEX_STATUS_OK;
 }
 
 enum EGL_TexStatus egl_texture_bind(EGL_Texture * texture)
 {
-  uint8_t ss = atomic_load_explicit(&texture->state.s, memory_order_acquire);
   uint8_t sd = atomic_load_explicit(&texture->state.d, memory_order_acquire);
 
   if (texture->streaming)
@@ -450,45 +924,20 @@ enum EGL_TexStatus egl_texture_bind(EGL_Texture * texture)
     if (!texture->ready)
       return EGL_TEX_STATUS_NOTREADY;
 
-    const uint8_t t = ss % TEXTURE_COUNT;
-    if (texture->dma)
-    {
-      ss = atomic_fetch_add_explicit(&texture->state.s, 1,
-        memory_order_release) + 1;
-    }
-    else if (texture->tex[t].sync != 0)
+    /* the frame thread has already waited on every synced texture, show the
+     * newest of them instead of stepping through any that were missed */
+    const uint8_t ss =
+      atomic_load_explicit(&texture->state.s, memory_order_acquire);
+    if ((uint8_t)(ss - sd) > 1)
     {
-      switch(glClientWaitSync(texture->tex[t].sync, 0, 20000000)) // 20ms
-      {
-        case GL_ALREADY_SIGNALED:
-        case GL_CONDITION_SATISFIED:
-          glDeleteSync(texture->tex[t].sync);
-          texture->tex[t].sync = 0;
-
-          ss = atomic_fetch_add_explicit(&texture->state.s, 1,
-              memory_order_release) + 1;
-          break;
-
-        case GL_TIMEOUT_EXPIRED:
-          break;
-
-        case GL_WAIT_FAILED:
-        case GL_INVALID_VALUE:
-          glDeleteSync(texture->tex[t].sync);
-          texture->tex[t].sync = 0;
-          EGL_ERROR("glClientWaitSync failed");
-          return EGL_TEX_STATUS_ERROR;
-      }
+      sd = ss - 1;
+      atomic_store_explicit(&texture->state.d, sd, memory_order_release);
     }
-
-    if (ss != sd && ss != (uint8_t)(sd + 1))
-      sd = atomic_fetch_add_explicit(&texture->state.d, 1,
-          memory_order_release) + 1;
   }
 
-  const uint8_t t = sd % TEXTURE_COUNT;
+  const struct Tex * tex = &texture->tex[sd % texture->textureCount];
   glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, texture->tex[t].t);
+  glBindTexture(GL_TEXTURE_2D, texture->dma ? tex->dmaTex : tex->t);
   glBindSampler(0, texture->sampler);
 
   return EGL_TEX_STATUS_OK;
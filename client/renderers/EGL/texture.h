@@ -49,7 +49,7 @@ void egl_texture_free(EGL_Texture ** tex);
 
 bool               egl_texture_setup  (EGL_Texture * texture, enum EGL_PixelFormat pixfmt, size_t width, size_t height, size_t stride, bool streaming, bool useDMA);
 bool               egl_texture_update (EGL_Texture * texture, const uint8_t * buffer);
-bool               egl_texture_update_from_frame(EGL_Texture * texture, const FrameBuffer * frame);
+bool               egl_texture_update_from_frame(EGL_Texture * texture, const FrameBuffer * frame, const FrameDamageRect * damageRects, int damageRectsCount);
 bool               egl_texture_update_from_dma  (EGL_Texture * texture, const FrameBuffer * frmame, const int dmaFd);
 enum EGL_TexStatus egl_texture_process(EGL_Texture * texture);
 enum EGL_TexStatus egl_texture_bind          (EGL_Texture * texture);
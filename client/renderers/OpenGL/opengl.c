@@ -36,13 +36,14 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "common/locking.h"
 #include "dynamic/fonts.h"
 #include "ll.h"
+#include "pool.h"
+#include "cursorstate.h"
 
 #define BUFFER_COUNT       2
 
 #define FPS_TEXTURE        0
-#define MOUSE_TEXTURE      1
-#define ALERT_TEXTURE      2
-#define TEXTURE_COUNT      3
+#define ALERT_TEXTURE      1
+#define TEXTURE_COUNT      2
 
 #define ALERT_TIMEOUT_FLAG ((uint64_t)-1)
 
@@ -78,6 +79,13 @@ static struct Option opengl_options[] =
     .type         = OPTION_TYPE_BOOL,
     .value.x_bool = true
   },
+  {
+    .module       = "opengl",
+    .name         = "bufferStorage",
+    .description  = "Use persistently mapped buffers from GL_ARB_buffer_storage if it is available",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = true
+  },
   {0}
 };
 
@@ -87,6 +95,7 @@ struct OpenGL_Options
   bool vsync;
   bool preventBuffer;
   bool amdPinnedMem;
+  bool bufferStorage;
 };
 
 struct Alert
@@ -100,12 +109,21 @@ struct Alert
   bool          closeFlag;
 };
 
+// a shape in the cursor cache, each has its own texture and display list
+struct MouseShape
+{
+  // the drawn size once uploaded, zero if it has not been
+  int               drawWidth;
+  int               drawHeight;
+};
+
 struct Inst
 {
   LG_RendererParams     params;
   struct OpenGL_Options opt;
 
   bool              amdPinnedMemSupport;
+  bool              bufferStorageSupport;
   bool              renderStarted;
   bool              configured;
   bool              reconfigure;
@@ -130,6 +148,7 @@ struct Inst
   bool              hasBuffers;
   GLuint            vboID[BUFFER_COUNT];
   uint8_t         * texPixels[BUFFER_COUNT];
+  uint8_t         * texMap   [BUFFER_COUNT];
   LG_Lock           syncLock;
   bool              texReady;
   int               texIndex;
@@ -143,6 +162,7 @@ struct Inst
   GLsync            fences[BUFFER_COUNT];
   GLuint            textures[TEXTURE_COUNT];
   struct ll       * alerts;
+  struct pool     * alertPool;
   int               alertList;
 
   bool              waiting;
@@ -152,19 +172,11 @@ struct Inst
   bool              fpsTexture;
   SDL_Rect          fpsRect;
 
-  LG_Lock           mouseLock;
-  LG_RendererCursor mouseCursor;
-  int               mouseWidth;
-  int               mouseHeight;
-  int               mousePitch;
-  uint8_t *         mouseData;
-  size_t            mouseDataSize;
-
-  bool              mouseUpdate;
-  bool              newShape;
-  LG_RendererCursor mouseType;
-  bool              mouseVisible;
-  SDL_Rect          mousePos;
+  CursorState     * cursorState;
+  CursorInfo        cursorInfo;
+  struct MouseShape mouseShapes[KVMFR_CURSOR_CACHE];
+  GLuint            mouseTextures[KVMFR_CURSOR_CACHE];
+  int               mouseActive;
 };
 
 static bool _check_gl_error(unsigned int line, const char * name);
@@ -179,7 +191,9 @@ enum ConfigStatus
 
 static void deconfigure(struct Inst * this);
 static enum ConfigStatus configure(struct Inst * this, SDL_Window *window);
-static void update_mouse_shape(struct Inst * this, bool * newShape);
+static void update_mouse(struct Inst * this);
+static void upload_mouse_shape(struct Inst * this, int index,
+    const CursorImage * image);
 static bool draw_frame(struct Inst * this);
 static void draw_mouse(struct Inst * this);
 static void render_wait(struct Inst * this);
@@ -212,11 +226,14 @@ bool opengl_create(void ** opaque, const LG_RendererParams params)
   this->opt.vsync         = option_get_bool("opengl", "vsync"        );
   this->opt.preventBuffer = option_get_bool("opengl", "preventBuffer");
   this->opt.amdPinnedMem  = option_get_bool("opengl", "amdPinnedMem" );
+  this->opt.bufferStorage = option_get_bool("opengl", "bufferStorage");
 
 
   LG_LOCK_INIT(this->formatLock);
   LG_LOCK_INIT(this->syncLock  );
-  LG_LOCK_INIT(this->mouseLock );
+
+  if (!cursorstate_new(&this->cursorState))
+    return false;
 
   this->font = LG_Fonts[0];
   if (!this->font->create(&this->fontObj, NULL, 14))
@@ -231,7 +248,10 @@ bool opengl_create(void ** opaque, const LG_RendererParams params)
     return false;
   }
 
-  this->alerts = ll_new();
+  this->alerts    = ll_new();
+  this->alertPool = pool_new(sizeof(struct Alert), 4);
+  if (!this->alertPool)
+    return false;
 
   return true;
 }
@@ -261,14 +281,14 @@ void opengl_deinitialize(void * opaque)
   if (this->renderStarted)
   {
     glDeleteLists(this->texList  , BUFFER_COUNT);
-    glDeleteLists(this->mouseList, 1);
+    glDeleteLists(this->mouseList, KVMFR_CURSOR_CACHE);
+    glDeleteTextures(KVMFR_CURSOR_CACHE, this->mouseTextures);
     glDeleteLists(this->fpsList  , 1);
     glDeleteLists(this->alertList, 1);
   }
 
   deconfigure(this);
-  if (this->mouseData)
-    free(this->mouseData);
+  cursorstate_free(&this->cursorState);
 
   if (this->glContext)
   {
@@ -278,16 +298,16 @@ void opengl_deinitialize(void * opaque)
 
   LG_LOCK_FREE(this->formatLock);
   LG_LOCK_FREE(this->syncLock  );
-  LG_LOCK_FREE(this->mouseLock );
 
   struct Alert * alert;
   while(ll_shift(this->alerts, (void **)&alert))
   {
     if (alert->text)
       this->font->release(this->alertFontObj, alert->text);
-    free(alert);
+    pool_put(this->alertPool, alert);
   }
   ll_free(this->alerts);
+  pool_free(this->alertPool);
 
   if (this->font && this->fontObj)
     this->font->destroy(this->fontObj);
@@ -295,6 +315,16 @@ void opengl_deinitialize(void * opaque)
   free(this);
 }
 
+uint32_t opengl_frame_types(void * opaque, FrameType * preferred)
+{
+  // RGBA16F is linear scRGB which we don't map, the host packs it to RGBA10
+  *preferred = FRAME_TYPE_BGRA;
+  return
+    (1U << FRAME_TYPE_BGRA   ) |
+    (1U << FRAME_TYPE_RGBA   ) |
+    (1U << FRAME_TYPE_RGBA10 );
+}
+
 void opengl_on_restart(void * opaque)
 {
   struct Inst * this = (struct Inst *)opaque;
@@ -324,39 +354,21 @@ void opengl_on_resize(void * opaque, const int width, const int height, const LG
   {
     glTranslatef(this->destRect.x, this->destRect.y, 0.0f);
     glScalef(
-      (float)this->destRect.w / (float)this->format.width,
-      (float)this->destRect.h / (float)this->format.height,
+      (float)this->destRect.w / (float)this->format.screenWidth,
+      (float)this->destRect.h / (float)this->format.screenHeight,
       1.0f
     );
   }
 }
 
-bool opengl_on_mouse_shape(void * opaque, const LG_RendererCursor cursor, const int width, const int height, const int pitch, const uint8_t * data)
+bool opengl_on_mouse_shape(void * opaque, const LG_RendererCursor cursor, const int width, const int height, const int pitch, const uint8_t * data, const unsigned int cacheID)
 {
   struct Inst * this = (struct Inst *)opaque;
   if (!this)
     return false;
 
-  LG_LOCK(this->mouseLock);
-  this->mouseCursor = cursor;
-  this->mouseWidth  = width;
-  this->mouseHeight = height;
-  this->mousePitch  = pitch;
-
-  const size_t size = height * pitch;
-  if (size > this->mouseDataSize)
-  {
-    if (this->mouseData)
-      free(this->mouseData);
-    this->mouseData     = (uint8_t *)malloc(size);
-    this->mouseDataSize = size;
-  }
-
-  memcpy(this->mouseData, data, size);
-  this->newShape = true;
-  LG_UNLOCK(this->mouseLock);
-
-  return true;
+  return cursorstate_set_shape(this->cursorState, cursor, width, height, pitch,
+      data, cacheID);
 }
 
 bool opengl_on_mouse_event(void * opaque, const bool visible, const int x, const int y)
@@ -365,14 +377,8 @@ bool opengl_on_mouse_event(void * opaque, const bool visible, const int x, const
   if (!this)
     return false;
 
-  if (this->mousePos.x == x && this->mousePos.y == y && this->mouseVisible == visible)
-    return true;
-
-  this->mouseVisible = visible;
-  this->mousePos.x   = x;
-  this->mousePos.y   = y;
-  this->mouseUpdate  = true;
-  return false;
+  cursorstate_set_pos(this->cursorState, visible, x, y);
+  return true;
 }
 
 bool opengl_on_frame_format(void * opaque, const LG_RendererFormat format, bool useDMA)
@@ -386,7 +392,8 @@ bool opengl_on_frame_format(void * opaque, const LG_RendererFormat format, bool
   return true;
 }
 
-bool opengl_on_frame(void * opaque, const FrameBuffer * frame, int dmaFd)
+bool opengl_on_frame(void * opaque, const FrameBuffer * frame, int dmaFd,
+    const FrameDamageRect * damageRects, int damageRectsCount)
 {
   struct Inst * this = (struct Inst *)opaque;
 
@@ -413,7 +420,9 @@ bool opengl_on_frame(void * opaque, const FrameBuffer * frame, int dmaFd)
 void opengl_on_alert(void * opaque, const LG_MsgAlert alert, const char * message, bool ** closeFlag)
 {
   struct Inst * this = (struct Inst *)opaque;
-  struct Alert * a = malloc(sizeof(struct Alert));
+  struct Alert * a = pool_get(this->alertPool);
+  if (!a)
+    return;
   memset(a, 0, sizeof(struct Alert));
 
   switch(alert)
@@ -450,7 +459,7 @@ void opengl_on_alert(void * opaque, const LG_MsgAlert alert, const char * messag
   if (!(a->text = this->font->render(this->alertFontObj, 0xffffff00, message)))
   {
     DEBUG_ERROR("Failed to render alert text: %s", TTF_GetError());
-    free(a);
+    pool_put(this->alertPool, a);
     return;
   }
 
@@ -517,10 +526,22 @@ bool opengl_render_startup(void * opaque, SDL_Window * window)
       }
       else
         DEBUG_INFO("GL_AMD_pinned_memory is available but not in use");
-      break;
+    }
+    else if (strcmp((const char *)ext, "GL_ARB_buffer_storage") == 0)
+    {
+      if (this->opt.bufferStorage)
+        this->bufferStorageSupport = true;
+      else
+        DEBUG_INFO("GL_ARB_buffer_storage is available but not in use");
     }
   }
 
+  // pinned memory is already written to directly
+  if (this->amdPinnedMemSupport)
+    this->bufferStorageSupport = false;
+  else if (this->bufferStorageSupport)
+    DEBUG_INFO("Using GL_ARB_buffer_storage");
+
   glEnable(GL_TEXTURE_2D);
   glEnable(GL_COLOR_MATERIAL);
   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -529,10 +550,14 @@ bool opengl_render_startup(void * opaque, SDL_Window * window)
 
   // generate lists for drawing
   this->texList   = glGenLists(BUFFER_COUNT);
-  this->mouseList = glGenLists(1);
+  this->mouseList = glGenLists(KVMFR_CURSOR_CACHE);
   this->fpsList   = glGenLists(1);
   this->alertList = glGenLists(1);
 
+  // create the cursor cache textures
+  glGenTextures(KVMFR_CURSOR_CACHE, this->mouseTextures);
+  this->mouseActive = -1;
+
   // create the overlay textures
   glGenTextures(TEXTURE_COUNT, this->textures);
   if (check_gl_error("glGenTextures"))
@@ -542,7 +567,7 @@ bool opengl_render_startup(void * opaque, SDL_Window * window)
   }
   this->hasTextures = true;
 
-  SDL_GL_SetSwapInterval(this->opt.vsync ? 1 : 0);
+  SDL_GL_SetSwapInterval(this->opt.vsync && !this->params.headless ? 1 : 0);
   this->renderStarted = true;
   return true;
 }
@@ -572,8 +597,7 @@ bool opengl_render(void * opaque, SDL_Window * window)
     render_wait(this);
   else
   {
-    bool newShape;
-    update_mouse_shape(this, &newShape);
+    update_mouse(this);
     glCallList(this->texList + this->texIndex);
     draw_mouse(this);
 
@@ -637,7 +661,7 @@ bool opengl_render(void * opaque, SDL_Window * window)
 
       if (close)
       {
-        free(alert);
+        pool_put(this->alertPool, alert);
         ll_shift(this->alerts, NULL);
         continue;
       }
@@ -651,7 +675,8 @@ bool opengl_render(void * opaque, SDL_Window * window)
     break;
   }
 
-  if (this->opt.preventBuffer)
+  // headless the swap does nothing, wait for the GPU so the draw can be timed
+  if (this->opt.preventBuffer || this->params.headless)
   {
     SDL_GL_SwapWindow(window);
     glFinish();
@@ -659,18 +684,18 @@ bool opengl_render(void * opaque, SDL_Window * window)
   else
     SDL_GL_SwapWindow(window);
 
-  this->mouseUpdate = false;
   return true;
 }
 
-void opengl_update_fps(void * opaque, const float avgUPS, const float avgFPS)
+void opengl_update_fps(void * opaque, const float avgUPS, const float avgFPS,
+    const LG_RendererLatency * latency)
 {
   struct Inst * this = (struct Inst *)opaque;
   if (!this->params.showFPS)
     return;
 
-  char str[128];
-  snprintf(str, sizeof(str), "UPS: %8.4f, FPS: %8.4f", avgUPS, avgFPS);
+  char str[512];
+  LG_RendererFormatFPS(str, sizeof(str), avgUPS, avgFPS, latency);
 
   LG_FontBitmap *textSurface = NULL;
   if (!(textSurface = this->font->render(this->fontObj, 0xffffff00, str)))
@@ -819,6 +844,7 @@ const LG_Renderer LGR_OpenGL =
   .create          = opengl_create,
   .initialize      = opengl_initialize,
   .deinitialize    = opengl_deinitialize,
+  .frame_types     = opengl_frame_types,
   .on_restart      = opengl_on_restart,
   .on_resize       = opengl_on_resize,
   .on_mouse_shape  = opengl_on_mouse_shape,
@@ -945,6 +971,33 @@ static enum ConfigStatus configure(struct Inst * this, SDL_Window *window)
         return CONFIG_STATUS_ERROR;
       }
 
+      if (this->bufferStorageSupport)
+      {
+        // mapped for the life of the buffer, the fences keep the GPU and
+        // the writes in draw_frame apart
+        const GLbitfield flags =
+          GL_MAP_WRITE_BIT      |
+          GL_MAP_PERSISTENT_BIT |
+          GL_MAP_COHERENT_BIT;
+
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, this->texSize, NULL, flags);
+        if (check_gl_error("glBufferStorage"))
+        {
+          LG_UNLOCK(this->formatLock);
+          return CONFIG_STATUS_ERROR;
+        }
+
+        this->texMap[i] = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+            this->texSize, flags);
+        if (!this->texMap[i])
+        {
+          check_gl_error("glMapBufferRange");
+          LG_UNLOCK(this->formatLock);
+          return CONFIG_STATUS_ERROR;
+        }
+        continue;
+      }
+
       glBufferData(
         GL_PIXEL_UNPACK_BUFFER,
         this->texSize,
@@ -1007,10 +1060,10 @@ static enum ConfigStatus configure(struct Inst * this, SDL_Window *window)
       glBindTexture(GL_TEXTURE_2D, this->frames[i]);
       glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
       glBegin(GL_TRIANGLE_STRIP);
-        glTexCoord2f(0.0f, 0.0f); glVertex2i(0                 , 0                  );
-        glTexCoord2f(1.0f, 0.0f); glVertex2i(this->format.width, 0                  );
-        glTexCoord2f(0.0f, 1.0f); glVertex2i(0                 , this->format.height);
-        glTexCoord2f(1.0f, 1.0f); glVertex2i(this->format.width, this->format.height);
+        glTexCoord2f(0.0f, 0.0f); glVertex2i(0                       , 0                        );
+        glTexCoord2f(1.0f, 0.0f); glVertex2i(this->format.screenWidth, 0                        );
+        glTexCoord2f(0.0f, 1.0f); glVertex2i(0                       , this->format.screenHeight);
+        glTexCoord2f(1.0f, 1.0f); glVertex2i(this->format.screenWidth, this->format.screenHeight);
      glEnd();
      glBindTexture(GL_TEXTURE_2D, 0);
     glEndList();
@@ -1046,20 +1099,25 @@ static void deconfigure(struct Inst * this)
 
   if (this->hasBuffers)
   {
+    // deleting the buffers also releases their persistent mappings
     glDeleteBuffers(BUFFER_COUNT, this->vboID);
     this->hasBuffers = false;
   }
 
+  for(int i = 0; i < BUFFER_COUNT; ++i)
+  {
+    this->texMap[i] = NULL;
+    if (this->fences[i])
+    {
+      glDeleteSync(this->fences[i]);
+      this->fences[i] = NULL;
+    }
+  }
+
   if (this->amdPinnedMemSupport)
   {
     for(int i = 0; i < BUFFER_COUNT; ++i)
     {
-      if (this->fences[i])
-      {
-        glDeleteSync(this->fences[i]);
-        this->fences[i] = NULL;
-      }
-
       if (this->texPixels[i])
       {
         free(this->texPixels[i]);
@@ -1071,26 +1129,36 @@ static void deconfigure(struct Inst * this)
   this->configured = false;
 }
 
-static void update_mouse_shape(struct Inst * this, bool * newShape)
+// take the newest cursor from the cursor thread, only the shapes that have
+// been replaced since the last render are uploaded
+static void update_mouse(struct Inst * this)
 {
-  LG_LOCK(this->mouseLock);
-  *newShape = this->newShape;
-  if (!this->newShape)
+  cursorstate_get(this->cursorState, &this->cursorInfo);
+
+  for(int i = 0; i < KVMFR_CURSOR_CACHE; ++i)
   {
-    LG_UNLOCK(this->mouseLock);
-    return;
+    const CursorImage * image = cursorstate_take_shape(this->cursorState, i);
+    if (image)
+      upload_mouse_shape(this, i, image);
   }
 
-  const LG_RendererCursor cursor = this->mouseCursor;
-  const int               width  = this->mouseWidth;
-  const int               height = this->mouseHeight;
-  const int               pitch  = this->mousePitch;
-  const uint8_t *         data   = this->mouseData;
+  this->mouseActive = this->cursorInfo.shape;
+}
+
+static void upload_mouse_shape(struct Inst * this, int index,
+    const CursorImage * image)
+{
+  struct MouseShape * shape = &this->mouseShapes[index];
+
+  const LG_RendererCursor cursor = image->type;
+  const int               width  = image->width;
+  const int               height = image->height;
+  const int               pitch  = image->stride;
+  const uint8_t *         data   = image->data;
 
   // tmp buffer for masked colour
   uint32_t tmp[width * height];
 
-  this->mouseType = cursor;
   switch(cursor)
   {
     case LG_CURSOR_MASKED_COLOR:
@@ -1109,7 +1177,7 @@ static void update_mouse_shape(struct Inst * this, bool * newShape)
 
     case LG_CURSOR_COLOR:
     {
-      glBindTexture(GL_TEXTURE_2D, this->textures[MOUSE_TEXTURE]);
+      glBindTexture(GL_TEXTURE_2D, this->mouseTextures[index]);
       glPixelStorei(GL_UNPACK_ALIGNMENT , 4    );
       glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
       glTexImage2D
@@ -1130,12 +1198,12 @@ static void update_mouse_shape(struct Inst * this, bool * newShape)
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
       glBindTexture(GL_TEXTURE_2D, 0);
 
-      this->mousePos.w = width;
-      this->mousePos.h = height;
+      shape->drawWidth  = width;
+      shape->drawHeight = height;
 
-      glNewList(this->mouseList, GL_COMPILE);
+      glNewList(this->mouseList + index, GL_COMPILE);
         glEnable(GL_BLEND);
-        glBindTexture(GL_TEXTURE_2D, this->textures[MOUSE_TEXTURE]);
+        glBindTexture(GL_TEXTURE_2D, this->mouseTextures[index]);
         glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
         glBegin(GL_TRIANGLE_STRIP);
           glTexCoord2f(0.0f, 0.0f); glVertex2i(0    , 0     );
@@ -1166,7 +1234,7 @@ static void update_mouse_shape(struct Inst * this, bool * newShape)
           d[y * width + x + width * hheight] = xorMask;
         }
 
-      glBindTexture(GL_TEXTURE_2D, this->textures[MOUSE_TEXTURE]);
+      glBindTexture(GL_TEXTURE_2D, this->mouseTextures[index]);
       glPixelStorei(GL_UNPACK_ALIGNMENT , 4    );
       glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
       glTexImage2D
@@ -1187,12 +1255,12 @@ static void update_mouse_shape(struct Inst * this, bool * newShape)
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
       glBindTexture(GL_TEXTURE_2D, 0);
 
-      this->mousePos.w = width;
-      this->mousePos.h = hheight;
+      shape->drawWidth  = width;
+      shape->drawHeight = hheight;
 
-      glNewList(this->mouseList, GL_COMPILE);
+      glNewList(this->mouseList + index, GL_COMPILE);
         glEnable(GL_COLOR_LOGIC_OP);
-        glBindTexture(GL_TEXTURE_2D, this->textures[MOUSE_TEXTURE]);
+        glBindTexture(GL_TEXTURE_2D, this->mouseTextures[index]);
         glLogicOp(GL_AND);
         glBegin(GL_TRIANGLE_STRIP);
           glTexCoord2f(0.0f, 0.0f); glVertex2i(0    , 0      );
@@ -1214,8 +1282,6 @@ static void update_mouse_shape(struct Inst * this, bool * newShape)
     }
   }
 
-  this->mouseUpdate = true;
-  LG_UNLOCK(this->mouseLock);
 }
 
 static bool opengl_buffer_fn(void * opaque, const void * data, size_t size)
@@ -1282,17 +1348,34 @@ static bool draw_frame(struct Inst * this)
   glPixelStorei(GL_UNPACK_ALIGNMENT , bpp);
   glPixelStorei(GL_UNPACK_ROW_LENGTH, this->format.width);
 
-  this->texPos = 0;
+  // pinned and persistently mapped buffers are written to directly, the
+  // fence wait above has made sure the GPU is done with it
+  uint8_t * dst = this->amdPinnedMemSupport ?
+    this->texPixels[this->texIndex] : this->texMap[this->texIndex];
 
-  framebuffer_read_fn(
-    this->frame,
-    this->format.height,
-    this->format.width,
-    bpp,
-    this->format.pitch,
-    opengl_buffer_fn,
-    this
-  );
+  if (dst)
+    framebuffer_read(
+      this->frame,
+      dst,
+      this->format.width * bpp,
+      this->format.height,
+      this->format.width,
+      bpp,
+      this->format.pitch
+    );
+  else
+  {
+    this->texPos = 0;
+    framebuffer_read_fn(
+      this->frame,
+      this->format.height,
+      this->format.width,
+      bpp,
+      this->format.pitch,
+      opengl_buffer_fn,
+      this
+    );
+  }
 
   // update the texture
   glTexSubImage2D(
@@ -1345,11 +1428,12 @@ static bool draw_frame(struct Inst * this)
 
 static void draw_mouse(struct Inst * this)
 {
-  if (!this->mouseVisible)
+  if (!this->cursorInfo.visible || this->mouseActive < 0 ||
+      !this->mouseShapes[this->mouseActive].drawWidth)
     return;
 
   glPushMatrix();
-  glTranslatef(this->mousePos.x, this->mousePos.y, 0.0f);
-  glCallList(this->mouseList);
+  glTranslatef(this->cursorInfo.x, this->cursorInfo.y, 0.0f);
+  glCallList(this->mouseList + this->mouseActive);
   glPopMatrix();
 }
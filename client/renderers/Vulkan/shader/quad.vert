@@ -0,0 +1,16 @@
+#version 450
+
+layout(push_constant) uniform Rect
+{
+  vec4 rect; // x, y, w, h in normalized device coordinates
+} pc;
+
+layout(location = 0) out vec2 uv;
+
+void main()
+{
+  // a triangle strip of four vertices, no vertex buffer
+  vec2 p      = vec2(gl_VertexIndex & 1, gl_VertexIndex >> 1);
+  uv          = p;
+  gl_Position = vec4(pc.rect.xy + p * pc.rect.zw, 0.0, 1.0);
+}
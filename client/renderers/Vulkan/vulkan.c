@@ -0,0 +1,2101 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "interface/renderer.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include <vulkan/vulkan.h>
+#include <SDL2/SDL_vulkan.h>
+
+#include "common/debug.h"
+#include "common/option.h"
+#include "common/framebuffer.h"
+#include "common/locking.h"
+
+// the number of frames the CPU may record ahead of the GPU
+#define FRAMES_IN_FLIGHT 2
+
+// the most swapchain images we will make use of
+#define MAX_IMAGES 8
+
+// the number of buffers the frame thread copies into if it can't import
+#define STAGING_COUNT 2
+
+// imported frame buffers, the host only ever uses LGMP_Q_FRAME_LEN of them
+#define IMPORT_MAX (LGMP_Q_FRAME_LEN * 2)
+
+static const uint32_t quad_vert[] =
+#include "quad.vert.inc"
+;
+
+static const uint32_t tex_frag[] =
+#include "tex.frag.inc"
+;
+
+static struct Option vulkan_options[] =
+{
+  {
+    .module         = "vulkan",
+    .name           = "presentMode",
+    .description    = "The present mode to use (mailbox, immediate or fifo)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "mailbox"
+  },
+  {
+    .module         = "vulkan",
+    .name           = "hostImport",
+    .description    = "Import the shared memory with VK_EXT_external_memory_host",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = true
+  },
+  {
+    .module         = "vulkan",
+    .name           = "validation",
+    .description    = "Enable the Vulkan validation layer",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false
+  },
+  {0}
+};
+
+enum SourceType
+{
+  SOURCE_NONE,
+  SOURCE_DMA,
+  SOURCE_HOST,
+  SOURCE_STAGING
+};
+
+// a frame published by the frame thread for the render thread to upload
+struct Source
+{
+  enum SourceType type;
+  const void    * key;   // the frame data, identifies the import
+  int             fd;    // a dup of the DMA-BUF, owned by the source
+  int             index; // staging buffer index
+};
+
+struct Buffer
+{
+  VkBuffer       buffer;
+  VkDeviceMemory memory;
+  VkDeviceSize   offset;
+  void         * map;
+};
+
+struct Import
+{
+  const void  * key;
+  struct Buffer buf;
+};
+
+struct Image
+{
+  VkImage         image;
+  VkDeviceMemory  memory;
+  VkImageView     view;
+  VkImageLayout   layout;
+  VkDescriptorSet set;
+  unsigned int    width, height;
+};
+
+struct Inst
+{
+  LG_RendererParams params;
+  SDL_Window      * window;
+
+  const char       * presentModeName;
+  bool               validation;
+
+  VkInstance         instance;
+  VkSurfaceKHR       surface;
+  VkPhysicalDevice   physicalDevice;
+  VkDevice           device;
+  uint32_t           queueFamily;
+  VkQueue            queue;
+
+  bool               dmaSupport;
+  atomic_bool        dmaFailed;
+  atomic_bool        hostSupport;
+  VkDeviceSize       hostAlign;
+
+  PFN_vkGetMemoryFdPropertiesKHR          getMemoryFdProperties;
+  PFN_vkGetMemoryHostPointerPropertiesEXT getMemoryHostPointerProperties;
+
+  VkSurfaceFormatKHR surfaceFormat;
+  VkPresentModeKHR   presentMode;
+  VkSwapchainKHR     swapchain;
+  VkExtent2D         extent;
+  uint32_t           imageCount;
+  VkImage            images      [MAX_IMAGES];
+  VkImageView        imageViews  [MAX_IMAGES];
+  VkFramebuffer      framebuffers[MAX_IMAGES];
+  VkSemaphore        renderDone  [MAX_IMAGES];
+
+  VkRenderPass          renderPass;
+  VkSampler             sampler;
+  VkDescriptorSetLayout setLayout;
+  VkDescriptorPool      descPool;
+  VkPipelineLayout      pipelineLayout;
+  VkPipeline            desktopPipeline;
+  VkPipeline            cursorPipeline;
+
+  VkCommandPool   cmdPool;
+  VkCommandBuffer cmd         [FRAMES_IN_FLIGHT];
+  VkSemaphore     acquired    [FRAMES_IN_FLIGHT];
+  uint64_t        frameValue  [FRAMES_IN_FLIGHT];
+  unsigned int    frameIndex;
+
+  // signalled with an increasing value by each submit, it paces the render
+  // thread and tells the frame thread when a staging buffer is free again
+  VkSemaphore timeline;
+  uint64_t    timelineValue;
+
+  // owned by the render thread
+  struct Image  desktop;
+  struct Import imports[IMPORT_MAX];
+  unsigned int  importCount;
+  struct Image  cursor;
+  struct Buffer cursorStaging;
+  VkDeviceSize  cursorStagingSize;
+
+  // shared between the threads, guarded by lock
+  LG_Lock           lock;
+  LG_RendererFormat format;
+  bool              formatChanged;
+  struct Source     pending;
+  uint64_t          stagingValue[STAGING_COUNT];
+
+  // owned by the frame thread
+  struct Buffer     staging[STAGING_COUNT];
+  VkDeviceSize      stagingSize;
+  unsigned int      stagingNext;
+
+  atomic_bool       resized;
+  int               width, height;
+  LG_RendererRect   destRect;
+
+  // the cursor shape, converted to BGRA by the cursor thread
+  LG_Lock      cursorLock;
+  uint32_t   * cursorData;
+  size_t       cursorDataSize;
+  int          cursorWidth, cursorHeight;
+  bool         cursorUpdate;
+  bool         cursorVisible;
+  int          cursorX, cursorY;
+};
+
+static void vulkan_free_swapchain(struct Inst * this, bool all);
+
+const char * vulkan_get_name()
+{
+  return "Vulkan";
+}
+
+void vulkan_setup()
+{
+  option_register(vulkan_options);
+}
+
+bool vulkan_create(void ** opaque, const LG_RendererParams params)
+{
+  // create our local storage
+  *opaque = malloc(sizeof(struct Inst));
+  if (!*opaque)
+  {
+    DEBUG_INFO("Failed to allocate %lu bytes", sizeof(struct Inst));
+    return false;
+  }
+  memset(*opaque, 0, sizeof(struct Inst));
+
+  struct Inst * this = (struct Inst *)*opaque;
+  memcpy(&this->params, &params, sizeof(LG_RendererParams));
+
+  this->presentModeName = option_get_string("vulkan", "presentMode");
+  this->validation      = option_get_bool  ("vulkan", "validation" );
+  atomic_store(&this->hostSupport, option_get_bool("vulkan", "hostImport"));
+  this->pending.fd = -1;
+
+  LG_LOCK_INIT(this->lock);
+  LG_LOCK_INIT(this->cursorLock);
+  return true;
+}
+
+bool vulkan_initialize(void * opaque, Uint32 * sdlFlags)
+{
+  *sdlFlags = SDL_WINDOW_VULKAN;
+  return true;
+}
+
+static void vulkan_free_buffer(struct Inst * this, struct Buffer * buf)
+{
+  if (buf->map)
+    vkUnmapMemory(this->device, buf->memory);
+  if (buf->buffer)
+    vkDestroyBuffer(this->device, buf->buffer, NULL);
+  if (buf->memory)
+    vkFreeMemory(this->device, buf->memory, NULL);
+  memset(buf, 0, sizeof(*buf));
+}
+
+static void vulkan_free_image(struct Inst * this, struct Image * img)
+{
+  if (img->view)
+    vkDestroyImageView(this->device, img->view, NULL);
+  if (img->image)
+    vkDestroyImage(this->device, img->image, NULL);
+  if (img->memory)
+    vkFreeMemory(this->device, img->memory, NULL);
+
+  // the descriptor set is reused for the next image
+  VkDescriptorSet set = img->set;
+  memset(img, 0, sizeof(*img));
+  img->set = set;
+}
+
+static void vulkan_free_imports(struct Inst * this)
+{
+  for(unsigned int i = 0; i < this->importCount; ++i)
+    vulkan_free_buffer(this, &this->imports[i].buf);
+  this->importCount = 0;
+}
+
+static void vulkan_free_source(struct Source * src)
+{
+  if (src->fd >= 0)
+    close(src->fd);
+  src->type = SOURCE_NONE;
+  src->fd   = -1;
+}
+
+void vulkan_deinitialize(void * opaque)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  if (this->device)
+  {
+    vkDeviceWaitIdle(this->device);
+
+    vulkan_free_source(&this->pending);
+    vulkan_free_imports(this);
+    vulkan_free_image (this, &this->desktop);
+    vulkan_free_image (this, &this->cursor );
+    vulkan_free_buffer(this, &this->cursorStaging);
+    for(int i = 0; i < STAGING_COUNT; ++i)
+      vulkan_free_buffer(this, &this->staging[i]);
+
+    vulkan_free_swapchain(this, true);
+
+    for(int i = 0; i < FRAMES_IN_FLIGHT; ++i)
+      if (this->acquired[i])
+        vkDestroySemaphore(this->device, this->acquired[i], NULL);
+
+    if (this->timeline)
+      vkDestroySemaphore(this->device, this->timeline, NULL);
+    if (this->cmdPool)
+      vkDestroyCommandPool(this->device, this->cmdPool, NULL);
+    if (this->desktopPipeline)
+      vkDestroyPipeline(this->device, this->desktopPipeline, NULL);
+    if (this->cursorPipeline)
+      vkDestroyPipeline(this->device, this->cursorPipeline, NULL);
+    if (this->pipelineLayout)
+      vkDestroyPipelineLayout(this->device, this->pipelineLayout, NULL);
+    if (this->descPool)
+      vkDestroyDescriptorPool(this->device, this->descPool, NULL);
+    if (this->setLayout)
+      vkDestroyDescriptorSetLayout(this->device, this->setLayout, NULL);
+    if (this->sampler)
+      vkDestroySampler(this->device, this->sampler, NULL);
+    if (this->renderPass)
+      vkDestroyRenderPass(this->device, this->renderPass, NULL);
+
+    vkDestroyDevice(this->device, NULL);
+  }
+
+  if (this->surface)
+    vkDestroySurfaceKHR(this->instance, this->surface, NULL);
+  if (this->instance)
+    vkDestroyInstance(this->instance, NULL);
+
+  free(this->cursorData);
+  LG_LOCK_FREE(this->lock);
+  LG_LOCK_FREE(this->cursorLock);
+  free(this);
+}
+
+bool vulkan_supports(void * opaque, LG_RendererSupport flag)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  switch(flag)
+  {
+    case LG_SUPPORTS_DMABUF:
+      return this->dmaSupport;
+
+    default:
+      return false;
+  }
+}
+
+uint32_t vulkan_frame_types(void * opaque, FrameType * preferred)
+{
+  // the frames are copied into an image as is, there is no YUV conversion and
+  // no mapping of linear scRGB so HDR frames are packed to RGBA10 by the host
+  *preferred = FRAME_TYPE_BGRA;
+  return
+    (1U << FRAME_TYPE_BGRA   ) |
+    (1U << FRAME_TYPE_RGBA   ) |
+    (1U << FRAME_TYPE_RGBA10 );
+}
+
+void vulkan_on_restart(void * opaque)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  // the DMA-BUFs of the last session are gone, the next frame format drops
+  // our imports of them
+  LG_LOCK(this->lock);
+  vulkan_free_source(&this->pending);
+  LG_UNLOCK(this->lock);
+}
+
+void vulkan_on_resize(void * opaque, const int width, const int height, const LG_RendererRect destRect)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  this->width  = width;
+  this->height = height;
+  memcpy(&this->destRect, &destRect, sizeof(LG_RendererRect));
+  atomic_store(&this->resized, true);
+}
+
+bool vulkan_on_mouse_shape(void * opaque, const LG_RendererCursor cursor, const int width, const int height, const int pitch, const uint8_t * data, const unsigned int cacheID)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  // we don't keep a cache of shapes, a repeat of the last one needs nothing
+  if (!data)
+    return true;
+
+  const int h = cursor == LG_CURSOR_MONOCHROME ? height / 2 : height;
+  const size_t size = (size_t)width * h * sizeof(uint32_t);
+
+  LG_LOCK(this->cursorLock);
+  if (size > this->cursorDataSize)
+  {
+    free(this->cursorData);
+    this->cursorData = (uint32_t *)malloc(size);
+    if (!this->cursorData)
+    {
+      this->cursorDataSize = 0;
+      LG_UNLOCK(this->cursorLock);
+      DEBUG_ERROR("Failed to malloc buffer for cursor shape");
+      return false;
+    }
+    this->cursorDataSize = size;
+  }
+
+  uint32_t * dst = this->cursorData;
+  for(int y = 0; y < h; ++y)
+    for(int x = 0; x < width; ++x, ++dst)
+    {
+      switch(cursor)
+      {
+        case LG_CURSOR_COLOR:
+          *dst = ((const uint32_t *)(data + pitch * y))[x];
+          break;
+
+        // inverting the screen needs a blend mode of its own, draw the
+        // inverted pixels in black so they are still seen
+        case LG_CURSOR_MASKED_COLOR:
+        {
+          const uint32_t c = ((const uint32_t *)(data + pitch * y))[x];
+          if (!(c & 0xFF000000))
+            *dst = c | 0xFF000000;
+          else
+            *dst = (c & 0x00FFFFFF) ? 0xFF000000 : 0x00000000;
+          break;
+        }
+
+        case LG_CURSOR_MONOCHROME:
+        {
+          const uint8_t * srcAnd = data + pitch * y + (x / 8);
+          const uint8_t * srcXor = srcAnd + pitch * h;
+          const uint8_t   mask   = 0x80 >> (x % 8);
+          const bool      and    = *srcAnd & mask;
+          const bool      xor    = *srcXor & mask;
+
+          if (!and)
+            *dst = xor ? 0xFFFFFFFF : 0xFF000000;
+          else
+            *dst = xor ? 0xFF000000 : 0x00000000;
+          break;
+        }
+      }
+    }
+
+  this->cursorWidth  = width;
+  this->cursorHeight = h;
+  this->cursorUpdate = true;
+  LG_UNLOCK(this->cursorLock);
+  return true;
+}
+
+bool vulkan_on_mouse_event(void * opaque, const bool visible, const int x, const int y)
+{
+  struct Inst * this = (struct Inst *)opaque;
+  this->cursorVisible = visible;
+  this->cursorX       = x;
+  this->cursorY       = y;
+  return true;
+}
+
+static int32_t vulkan_memory_type(struct Inst * this, uint32_t bits,
+    VkMemoryPropertyFlags flags)
+{
+  VkPhysicalDeviceMemoryProperties props;
+  vkGetPhysicalDeviceMemoryProperties(this->physicalDevice, &props);
+
+  for(uint32_t i = 0; i < props.memoryTypeCount; ++i)
+    if ((bits & (1U << i)) &&
+        (props.memoryTypes[i].propertyFlags & flags) == flags)
+      return i;
+
+  return -1;
+}
+
+static bool vulkan_create_buffer(struct Inst * this, struct Buffer * buf,
+    VkDeviceSize size, VkBufferUsageFlags usage)
+{
+  const VkBufferCreateInfo bufferInfo =
+  {
+    .sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .size        = size,
+    .usage       = usage,
+    .sharingMode = VK_SHARING_MODE_EXCLUSIVE
+  };
+
+  if (vkCreateBuffer(this->device, &bufferInfo, NULL, &buf->buffer) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create a buffer");
+    return false;
+  }
+
+  VkMemoryRequirements req;
+  vkGetBufferMemoryRequirements(this->device, buf->buffer, &req);
+
+  const int32_t type = vulkan_memory_type(this, req.memoryTypeBits,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+  if (type < 0)
+  {
+    DEBUG_ERROR("No host visible memory type for the buffer");
+    vulkan_free_buffer(this, buf);
+    return false;
+  }
+
+  const VkMemoryAllocateInfo allocInfo =
+  {
+    .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    .allocationSize  = req.size,
+    .memoryTypeIndex = type
+  };
+
+  if (vkAllocateMemory(this->device, &allocInfo, NULL, &buf->memory) != VK_SUCCESS ||
+      vkBindBufferMemory(this->device, buf->buffer, buf->memory, 0) != VK_SUCCESS ||
+      vkMapMemory(this->device, buf->memory, 0, VK_WHOLE_SIZE, 0, &buf->map) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to allocate %lu bytes for a buffer", (unsigned long)size);
+    vulkan_free_buffer(this, buf);
+    return false;
+  }
+
+  return true;
+}
+
+bool vulkan_on_frame_format(void * opaque, const LG_RendererFormat format, bool useDMA)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  LG_LOCK(this->lock);
+  vulkan_free_source(&this->pending);
+
+  // the staging buffers can't be freed until the GPU is done with them
+  uint64_t value = 0;
+  for(int i = 0; i < STAGING_COUNT; ++i)
+    if (this->stagingValue[i] > value)
+      value = this->stagingValue[i];
+
+  const VkSemaphoreWaitInfo waitInfo =
+  {
+    .sType          = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+    .semaphoreCount = 1,
+    .pSemaphores    = &this->timeline,
+    .pValues        = &value
+  };
+  vkWaitSemaphores(this->device, &waitInfo, UINT64_MAX);
+
+  for(int i = 0; i < STAGING_COUNT; ++i)
+    vulkan_free_buffer(this, &this->staging[i]);
+  this->stagingSize = (VkDeviceSize)format.height * format.pitch;
+
+  memcpy(&this->format, &format, sizeof(LG_RendererFormat));
+  this->formatChanged = true;
+  LG_UNLOCK(this->lock);
+
+  atomic_store(&this->resized, true);
+  return true;
+}
+
+static void vulkan_publish(struct Inst * this, const struct Source * src)
+{
+  LG_LOCK(this->lock);
+  vulkan_free_source(&this->pending);
+  memcpy(&this->pending, src, sizeof(*src));
+  LG_UNLOCK(this->lock);
+}
+
+bool vulkan_on_frame(void * opaque, const FrameBuffer * frame, int dmaFd,
+    const FrameDamageRect * damageRects, int damageRectsCount)
+{
+  struct Inst * this = (struct Inst *)opaque;
+  const size_t size = this->stagingSize;
+
+  if (atomic_load(&this->dmaFailed))
+    dmaFd = -1;
+
+  // the imported paths read the frame in place, it must be complete first
+  if (dmaFd >= 0 || atomic_load(&this->hostSupport))
+  {
+    if (!framebuffer_wait(frame, size))
+    {
+      DEBUG_ERROR("Failed to wait for the framebuffer");
+      return false;
+    }
+
+    struct Source src =
+    {
+      .key = framebuffer_get_data(frame),
+      .fd  = -1
+    };
+
+    if (dmaFd >= 0)
+    {
+      // the fd may be closed by the frame thread before it is imported
+      src.type = SOURCE_DMA;
+      if ((src.fd = dup(dmaFd)) < 0)
+      {
+        DEBUG_ERROR("Failed to dup the DMA-BUF");
+        return false;
+      }
+    }
+    else
+      src.type = SOURCE_HOST;
+
+    vulkan_publish(this, &src);
+    return true;
+  }
+
+  const unsigned int index = this->stagingNext;
+  struct Buffer    * buf   = &this->staging[index];
+  if (!buf->buffer && !vulkan_create_buffer(this, buf, size,
+        VK_BUFFER_USAGE_TRANSFER_SRC_BIT))
+    return false;
+
+  // wait for the GPU to finish copying out of the buffer
+  LG_LOCK(this->lock);
+  uint64_t value = this->stagingValue[index];
+  LG_UNLOCK(this->lock);
+
+  const VkSemaphoreWaitInfo waitInfo =
+  {
+    .sType          = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+    .semaphoreCount = 1,
+    .pSemaphores    = &this->timeline,
+    .pValues        = &value
+  };
+  vkWaitSemaphores(this->device, &waitInfo, UINT64_MAX);
+
+  if (!framebuffer_read(frame, buf->map, this->format.pitch,
+        this->format.height, this->format.width, this->format.bpp / 8,
+        this->format.pitch))
+  {
+    DEBUG_ERROR("Failed to read the framebuffer");
+    return false;
+  }
+
+  const struct Source src =
+  {
+    .type  = SOURCE_STAGING,
+    .fd    = -1,
+    .index = index
+  };
+  vulkan_publish(this, &src);
+
+  this->stagingNext = (index + 1) % STAGING_COUNT;
+  return true;
+}
+
+void vulkan_on_alert(void * opaque, const LG_MsgAlert alert, const char * message, bool ** closeFlag)
+{
+  // there is no overlay to show alerts on yet
+  DEBUG_INFO("%s", message);
+}
+
+static bool vulkan_has_extension(const VkExtensionProperties * exts,
+    uint32_t count, const char * name)
+{
+  for(uint32_t i = 0; i < count; ++i)
+    if (strcmp(exts[i].extensionName, name) == 0)
+      return true;
+  return false;
+}
+
+static bool vulkan_create_instance(struct Inst * this)
+{
+  unsigned int extCount = 0;
+  if (!SDL_Vulkan_GetInstanceExtensions(this->window, &extCount, NULL))
+  {
+    DEBUG_ERROR("SDL_Vulkan_GetInstanceExtensions failed: %s", SDL_GetError());
+    return false;
+  }
+
+  const char * exts[extCount];
+  if (!SDL_Vulkan_GetInstanceExtensions(this->window, &extCount, exts))
+  {
+    DEBUG_ERROR("SDL_Vulkan_GetInstanceExtensions failed: %s", SDL_GetError());
+    return false;
+  }
+
+  const VkApplicationInfo appInfo =
+  {
+    .sType            = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+    .pApplicationName = "Looking Glass",
+    .pEngineName      = "Looking Glass",
+    .apiVersion       = VK_API_VERSION_1_2
+  };
+
+  const char * layers[] = { "VK_LAYER_KHRONOS_validation" };
+  const VkInstanceCreateInfo createInfo =
+  {
+    .sType                   = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+    .pApplicationInfo        = &appInfo,
+    .enabledLayerCount       = this->validation ? 1 : 0,
+    .ppEnabledLayerNames     = layers,
+    .enabledExtensionCount   = extCount,
+    .ppEnabledExtensionNames = exts
+  };
+
+  if (vkCreateInstance(&createInfo, NULL, &this->instance) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create the Vulkan instance");
+    return false;
+  }
+
+  if (!SDL_Vulkan_CreateSurface(this->window, this->instance, &this->surface))
+  {
+    DEBUG_ERROR("SDL_Vulkan_CreateSurface failed: %s", SDL_GetError());
+    return false;
+  }
+
+  return true;
+}
+
+static bool vulkan_pick_device(struct Inst * this)
+{
+  uint32_t count = 0;
+  vkEnumeratePhysicalDevices(this->instance, &count, NULL);
+  if (!count)
+  {
+    DEBUG_ERROR("There are no Vulkan devices");
+    return false;
+  }
+
+  VkPhysicalDevice devices[count];
+  vkEnumeratePhysicalDevices(this->instance, &count, devices);
+
+  int best = -1;
+  for(uint32_t i = 0; i < count; ++i)
+  {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(devices[i], &props);
+    if (props.apiVersion < VK_API_VERSION_1_2)
+      continue;
+
+    VkPhysicalDeviceVulkan12Features features12 =
+    {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES
+    };
+    VkPhysicalDeviceFeatures2 features =
+    {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+      .pNext = &features12
+    };
+    vkGetPhysicalDeviceFeatures2(devices[i], &features);
+    if (!features12.timelineSemaphore)
+      continue;
+
+    uint32_t qCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(devices[i], &qCount, NULL);
+    VkQueueFamilyProperties queues[qCount];
+    vkGetPhysicalDeviceQueueFamilyProperties(devices[i], &qCount, queues);
+
+    for(uint32_t q = 0; q < qCount; ++q)
+    {
+      VkBool32 present = VK_FALSE;
+      vkGetPhysicalDeviceSurfaceSupportKHR(devices[i], q, this->surface, &present);
+      if (!present || !(queues[q].queueFlags & VK_QUEUE_GRAPHICS_BIT))
+        continue;
+
+      // prefer a real GPU over a software implementation
+      if (best < 0 || props.deviceType != VK_PHYSICAL_DEVICE_TYPE_CPU)
+      {
+        best              = i;
+        this->queueFamily = q;
+      }
+      break;
+    }
+
+    if (best == (int)i && props.deviceType != VK_PHYSICAL_DEVICE_TYPE_CPU)
+      break;
+  }
+
+  if (best < 0)
+  {
+    DEBUG_ERROR("No Vulkan 1.2 device with timeline semaphores can present");
+    return false;
+  }
+
+  this->physicalDevice = devices[best];
+
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(this->physicalDevice, &props);
+  DEBUG_INFO("Device      : %s", props.deviceName);
+  return true;
+}
+
+static bool vulkan_create_device(struct Inst * this)
+{
+  uint32_t count = 0;
+  vkEnumerateDeviceExtensionProperties(this->physicalDevice, NULL, &count, NULL);
+  VkExtensionProperties avail[count];
+  vkEnumerateDeviceExtensionProperties(this->physicalDevice, NULL, &count, avail);
+
+  const char * exts[4];
+  uint32_t     extCount = 0;
+
+  if (!vulkan_has_extension(avail, count, VK_KHR_SWAPCHAIN_EXTENSION_NAME))
+  {
+    DEBUG_ERROR("The device does not support " VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    return false;
+  }
+  exts[extCount++] = VK_KHR_SWAPCHAIN_EXTENSION_NAME;
+
+  this->dmaSupport =
+    vulkan_has_extension(avail, count, VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME) &&
+    vulkan_has_extension(avail, count, VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME);
+  if (this->dmaSupport)
+  {
+    exts[extCount++] = VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME;
+    exts[extCount++] = VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME;
+  }
+
+  if (atomic_load(&this->hostSupport))
+  {
+    if (vulkan_has_extension(avail, count, VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME))
+    {
+      exts[extCount++] = VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME;
+
+      VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostProps =
+      {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT
+      };
+      VkPhysicalDeviceProperties2 props =
+      {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &hostProps
+      };
+      vkGetPhysicalDeviceProperties2(this->physicalDevice, &props);
+      this->hostAlign = hostProps.minImportedHostPointerAlignment;
+    }
+    else
+      atomic_store(&this->hostSupport, false);
+  }
+
+  DEBUG_INFO("DMA-BUF     : %s", this->dmaSupport ? "yes" : "no");
+  DEBUG_INFO("Host Import : %s", atomic_load(&this->hostSupport) ? "yes" : "no");
+
+  const float priority = 1.0f;
+  const VkDeviceQueueCreateInfo queueInfo =
+  {
+    .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+    .queueFamilyIndex = this->queueFamily,
+    .queueCount       = 1,
+    .pQueuePriorities = &priority
+  };
+
+  VkPhysicalDeviceVulkan12Features features12 =
+  {
+    .sType             = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+    .timelineSemaphore = VK_TRUE
+  };
+
+  const VkDeviceCreateInfo createInfo =
+  {
+    .sType                   = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+    .pNext                   = &features12,
+    .queueCreateInfoCount    = 1,
+    .pQueueCreateInfos       = &queueInfo,
+    .enabledExtensionCount   = extCount,
+    .ppEnabledExtensionNames = exts
+  };
+
+  if (vkCreateDevice(this->physicalDevice, &createInfo, NULL, &this->device) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create the Vulkan device");
+    return false;
+  }
+
+  vkGetDeviceQueue(this->device, this->queueFamily, 0, &this->queue);
+
+  if (this->dmaSupport)
+    this->getMemoryFdProperties = (PFN_vkGetMemoryFdPropertiesKHR)
+      vkGetDeviceProcAddr(this->device, "vkGetMemoryFdPropertiesKHR");
+
+  if (atomic_load(&this->hostSupport))
+    this->getMemoryHostPointerProperties = (PFN_vkGetMemoryHostPointerPropertiesEXT)
+      vkGetDeviceProcAddr(this->device, "vkGetMemoryHostPointerPropertiesEXT");
+
+  return true;
+}
+
+static void vulkan_free_swapchain(struct Inst * this, bool all)
+{
+  for(uint32_t i = 0; i < MAX_IMAGES; ++i)
+  {
+    if (this->framebuffers[i])
+      vkDestroyFramebuffer(this->device, this->framebuffers[i], NULL);
+    if (this->imageViews[i])
+      vkDestroyImageView(this->device, this->imageViews[i], NULL);
+    if (this->renderDone[i])
+      vkDestroySemaphore(this->device, this->renderDone[i], NULL);
+
+    this->framebuffers[i] = VK_NULL_HANDLE;
+    this->imageViews  [i] = VK_NULL_HANDLE;
+    this->renderDone  [i] = VK_NULL_HANDLE;
+  }
+
+  if (all && this->swapchain)
+  {
+    vkDestroySwapchainKHR(this->device, this->swapchain, NULL);
+    this->swapchain = VK_NULL_HANDLE;
+  }
+}
+
+static VkPresentModeKHR vulkan_pick_present_mode(struct Inst * this)
+{
+  VkPresentModeKHR want = VK_PRESENT_MODE_FIFO_KHR;
+  if (strcmp(this->presentModeName, "mailbox") == 0)
+    want = VK_PRESENT_MODE_MAILBOX_KHR;
+  else if (strcmp(this->presentModeName, "immediate") == 0)
+    want = VK_PRESENT_MODE_IMMEDIATE_KHR;
+  else if (strcmp(this->presentModeName, "fifo") != 0)
+    DEBUG_WARN("Unknown present mode %s, using fifo", this->presentModeName);
+
+  uint32_t count = 0;
+  vkGetPhysicalDeviceSurfacePresentModesKHR(this->physicalDevice, this->surface,
+      &count, NULL);
+  VkPresentModeKHR modes[count];
+  vkGetPhysicalDeviceSurfacePresentModesKHR(this->physicalDevice, this->surface,
+      &count, modes);
+
+  for(uint32_t i = 0; i < count; ++i)
+    if (modes[i] == want)
+      return want;
+
+  // fifo is the only mode that must be supported
+  if (want != VK_PRESENT_MODE_FIFO_KHR)
+    DEBUG_WARN("The %s present mode is not supported, using fifo",
+        this->presentModeName);
+  return VK_PRESENT_MODE_FIFO_KHR;
+}
+
+static bool vulkan_create_swapchain(struct Inst * this)
+{
+  VkSurfaceCapabilitiesKHR caps;
+  vkGetPhysicalDeviceSurfaceCapabilitiesKHR(this->physicalDevice, this->surface,
+      &caps);
+
+  if (caps.currentExtent.width != UINT32_MAX)
+    this->extent = caps.currentExtent;
+  else
+  {
+    int w, h;
+    SDL_Vulkan_GetDrawableSize(this->window, &w, &h);
+    this->extent.width  = w;
+    this->extent.height = h;
+  }
+
+  // a minimised window has no surface to present to
+  if (!this->extent.width || !this->extent.height)
+  {
+    vulkan_free_swapchain(this, true);
+    return true;
+  }
+
+  uint32_t minImages = caps.minImageCount + 1;
+  if (caps.maxImageCount && minImages > caps.maxImageCount)
+    minImages = caps.maxImageCount;
+  if (minImages > MAX_IMAGES)
+    minImages = MAX_IMAGES;
+
+  VkSwapchainKHR old = this->swapchain;
+  const VkSwapchainCreateInfoKHR createInfo =
+  {
+    .sType            = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+    .surface          = this->surface,
+    .minImageCount    = minImages,
+    .imageFormat      = this->surfaceFormat.format,
+    .imageColorSpace  = this->surfaceFormat.colorSpace,
+    .imageExtent      = this->extent,
+    .imageArrayLayers = 1,
+    .imageUsage       = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+    .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    .preTransform     = caps.currentTransform,
+    .compositeAlpha   =
+      (caps.supportedCompositeAlpha & VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR) ?
+      VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR : VK_COMPOSITE_ALPHA_INHERIT_BIT_KHR,
+    .presentMode      = this->presentMode,
+    .clipped          = VK_TRUE,
+    .oldSwapchain     = old
+  };
+
+  if (vkCreateSwapchainKHR(this->device, &createInfo, NULL, &this->swapchain) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create the swapchain");
+    this->swapchain = VK_NULL_HANDLE;
+    if (old)
+      vkDestroySwapchainKHR(this->device, old, NULL);
+    return false;
+  }
+
+  if (old)
+    vkDestroySwapchainKHR(this->device, old, NULL);
+
+  this->imageCount = 0;
+  vkGetSwapchainImagesKHR(this->device, this->swapchain, &this->imageCount, NULL);
+  if (this->imageCount > MAX_IMAGES)
+    this->imageCount = MAX_IMAGES;
+  vkGetSwapchainImagesKHR(this->device, this->swapchain, &this->imageCount,
+      this->images);
+
+  const VkSemaphoreCreateInfo semInfo =
+  {
+    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO
+  };
+
+  for(uint32_t i = 0; i < this->imageCount; ++i)
+  {
+    const VkImageViewCreateInfo viewInfo =
+    {
+      .sType            = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+      .image            = this->images[i],
+      .viewType         = VK_IMAGE_VIEW_TYPE_2D,
+      .format           = this->surfaceFormat.format,
+      .subresourceRange =
+      {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .levelCount = 1,
+        .layerCount = 1
+      }
+    };
+
+    if (vkCreateImageView(this->device, &viewInfo, NULL, &this->imageViews[i]) != VK_SUCCESS)
+    {
+      DEBUG_ERROR("Failed to create a swapchain image view");
+      return false;
+    }
+
+    const VkFramebufferCreateInfo fbInfo =
+    {
+      .sType           = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+      .renderPass      = this->renderPass,
+      .attachmentCount = 1,
+      .pAttachments    = &this->imageViews[i],
+      .width           = this->extent.width,
+      .height          = this->extent.height,
+      .layers          = 1
+    };
+
+    if (vkCreateFramebuffer(this->device, &fbInfo, NULL, &this->framebuffers[i]) != VK_SUCCESS)
+    {
+      DEBUG_ERROR("Failed to create a framebuffer");
+      return false;
+    }
+
+    if (vkCreateSemaphore(this->device, &semInfo, NULL, &this->renderDone[i]) != VK_SUCCESS)
+    {
+      DEBUG_ERROR("Failed to create a semaphore");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool vulkan_recreate_swapchain(struct Inst * this)
+{
+  vkDeviceWaitIdle(this->device);
+  vulkan_free_swapchain(this, false);
+  return vulkan_create_swapchain(this);
+}
+
+static bool vulkan_create_pipeline(struct Inst * this, bool blend,
+    VkPipeline * pipeline)
+{
+  const VkShaderModuleCreateInfo vertInfo =
+  {
+    .sType    = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+    .codeSize = sizeof(quad_vert),
+    .pCode    = quad_vert
+  };
+
+  const VkShaderModuleCreateInfo fragInfo =
+  {
+    .sType    = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+    .codeSize = sizeof(tex_frag),
+    .pCode    = tex_frag
+  };
+
+  VkShaderModule vert = VK_NULL_HANDLE, frag = VK_NULL_HANDLE;
+  if (vkCreateShaderModule(this->device, &vertInfo, NULL, &vert) != VK_SUCCESS ||
+      vkCreateShaderModule(this->device, &fragInfo, NULL, &frag) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create the shader modules");
+    if (vert)
+      vkDestroyShaderModule(this->device, vert, NULL);
+    return false;
+  }
+
+  const VkPipelineShaderStageCreateInfo stages[] =
+  {
+    {
+      .sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+      .stage  = VK_SHADER_STAGE_VERTEX_BIT,
+      .module = vert,
+      .pName  = "main"
+    },
+    {
+      .sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+      .stage  = VK_SHADER_STAGE_FRAGMENT_BIT,
+      .module = frag,
+      .pName  = "main"
+    }
+  };
+
+  const VkPipelineVertexInputStateCreateInfo vertexInput =
+  {
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO
+  };
+
+  const VkPipelineInputAssemblyStateCreateInfo inputAssembly =
+  {
+    .sType    = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+    .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP
+  };
+
+  const VkPipelineViewportStateCreateInfo viewport =
+  {
+    .sType         = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+    .viewportCount = 1,
+    .scissorCount  = 1
+  };
+
+  const VkPipelineRasterizationStateCreateInfo raster =
+  {
+    .sType       = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+    .polygonMode = VK_POLYGON_MODE_FILL,
+    .cullMode    = VK_CULL_MODE_NONE,
+    .frontFace   = VK_FRONT_FACE_COUNTER_CLOCKWISE,
+    .lineWidth   = 1.0f
+  };
+
+  const VkPipelineMultisampleStateCreateInfo multisample =
+  {
+    .sType                = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+    .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT
+  };
+
+  const VkPipelineColorBlendAttachmentState blendAttachment =
+  {
+    .blendEnable         = blend ? VK_TRUE : VK_FALSE,
+    .srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA,
+    .dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+    .colorBlendOp        = VK_BLEND_OP_ADD,
+    .srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
+    .dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
+    .alphaBlendOp        = VK_BLEND_OP_ADD,
+    .colorWriteMask      =
+      VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+      VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT
+  };
+
+  const VkPipelineColorBlendStateCreateInfo colorBlend =
+  {
+    .sType           = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+    .attachmentCount = 1,
+    .pAttachments    = &blendAttachment
+  };
+
+  const VkDynamicState dynamicStates[] =
+  {
+    VK_DYNAMIC_STATE_VIEWPORT,
+    VK_DYNAMIC_STATE_SCISSOR
+  };
+
+  const VkPipelineDynamicStateCreateInfo dynamic =
+  {
+    .sType             = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+    .dynamicStateCount = 2,
+    .pDynamicStates    = dynamicStates
+  };
+
+  const VkGraphicsPipelineCreateInfo createInfo =
+  {
+    .sType               = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+    .stageCount          = 2,
+    .pStages             = stages,
+    .pVertexInputState   = &vertexInput,
+    .pInputAssemblyState = &inputAssembly,
+    .pViewportState      = &viewport,
+    .pRasterizationState = &raster,
+    .pMultisampleState   = &multisample,
+    .pColorBlendState    = &colorBlend,
+    .pDynamicState       = &dynamic,
+    .layout              = this->pipelineLayout,
+    .renderPass          = this->renderPass
+  };
+
+  const VkResult result = vkCreateGraphicsPipelines(this->device,
+      VK_NULL_HANDLE, 1, &createInfo, NULL, pipeline);
+
+  vkDestroyShaderModule(this->device, vert, NULL);
+  vkDestroyShaderModule(this->device, frag, NULL);
+
+  if (result != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create a pipeline");
+    return false;
+  }
+
+  return true;
+}
+
+static bool vulkan_create_objects(struct Inst * this)
+{
+  // prefer an 8 bit UNORM surface so the frames are shown as is
+  uint32_t count = 0;
+  vkGetPhysicalDeviceSurfaceFormatsKHR(this->physicalDevice, this->surface,
+      &count, NULL);
+  if (!count)
+  {
+    DEBUG_ERROR("The surface has no formats");
+    return false;
+  }
+
+  VkSurfaceFormatKHR formats[count];
+  vkGetPhysicalDeviceSurfaceFormatsKHR(this->physicalDevice, this->surface,
+      &count, formats);
+
+  this->surfaceFormat = formats[0];
+  for(uint32_t i = 0; i < count; ++i)
+    if (formats[i].format == VK_FORMAT_B8G8R8A8_UNORM ||
+        formats[i].format == VK_FORMAT_R8G8B8A8_UNORM)
+    {
+      this->surfaceFormat = formats[i];
+      break;
+    }
+
+  this->presentMode = vulkan_pick_present_mode(this);
+
+  const VkAttachmentDescription attachment =
+  {
+    .format         = this->surfaceFormat.format,
+    .samples        = VK_SAMPLE_COUNT_1_BIT,
+    .loadOp         = VK_ATTACHMENT_LOAD_OP_CLEAR,
+    .storeOp        = VK_ATTACHMENT_STORE_OP_STORE,
+    .stencilLoadOp  = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+    .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+    .initialLayout  = VK_IMAGE_LAYOUT_UNDEFINED,
+    .finalLayout    = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR
+  };
+
+  const VkAttachmentReference colorRef =
+  {
+    .attachment = 0,
+    .layout     = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+  };
+
+  const VkSubpassDescription subpass =
+  {
+    .pipelineBindPoint    = VK_PIPELINE_BIND_POINT_GRAPHICS,
+    .colorAttachmentCount = 1,
+    .pColorAttachments    = &colorRef
+  };
+
+  const VkSubpassDependency dependency =
+  {
+    .srcSubpass    = VK_SUBPASS_EXTERNAL,
+    .dstSubpass    = 0,
+    .srcStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+    .dstStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+    .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+  };
+
+  const VkRenderPassCreateInfo passInfo =
+  {
+    .sType           = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+    .attachmentCount = 1,
+    .pAttachments    = &attachment,
+    .subpassCount    = 1,
+    .pSubpasses      = &subpass,
+    .dependencyCount = 1,
+    .pDependencies   = &dependency
+  };
+
+  if (vkCreateRenderPass(this->device, &passInfo, NULL, &this->renderPass) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create the render pass");
+    return false;
+  }
+
+  const VkSamplerCreateInfo samplerInfo =
+  {
+    .sType        = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+    .magFilter    = VK_FILTER_LINEAR,
+    .minFilter    = VK_FILTER_LINEAR,
+    .mipmapMode   = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+    .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+    .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+    .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE
+  };
+
+  if (vkCreateSampler(this->device, &samplerInfo, NULL, &this->sampler) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create the sampler");
+    return false;
+  }
+
+  const VkDescriptorSetLayoutBinding binding =
+  {
+    .binding            = 0,
+    .descriptorType     = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+    .descriptorCount    = 1,
+    .stageFlags         = VK_SHADER_STAGE_FRAGMENT_BIT,
+    .pImmutableSamplers = &this->sampler
+  };
+
+  const VkDescriptorSetLayoutCreateInfo setLayoutInfo =
+  {
+    .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+    .bindingCount = 1,
+    .pBindings    = &binding
+  };
+
+  if (vkCreateDescriptorSetLayout(this->device, &setLayoutInfo, NULL,
+        &this->setLayout) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create the descriptor set layout");
+    return false;
+  }
+
+  // one set for the desktop and one for the cursor
+  const VkDescriptorPoolSize poolSize =
+  {
+    .type            = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+    .descriptorCount = 2
+  };
+
+  const VkDescriptorPoolCreateInfo poolInfo =
+  {
+    .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+    .maxSets       = 2,
+    .poolSizeCount = 1,
+    .pPoolSizes    = &poolSize
+  };
+
+  if (vkCreateDescriptorPool(this->device, &poolInfo, NULL, &this->descPool) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create the descriptor pool");
+    return false;
+  }
+
+  const VkDescriptorSetLayout setLayouts[] = { this->setLayout, this->setLayout };
+  const VkDescriptorSetAllocateInfo setInfo =
+  {
+    .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+    .descriptorPool     = this->descPool,
+    .descriptorSetCount = 2,
+    .pSetLayouts        = setLayouts
+  };
+
+  VkDescriptorSet sets[2];
+  if (vkAllocateDescriptorSets(this->device, &setInfo, sets) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to allocate the descriptor sets");
+    return false;
+  }
+  this->desktop.set = sets[0];
+  this->cursor .set = sets[1];
+
+  const VkPushConstantRange pushRange =
+  {
+    .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+    .size       = sizeof(float) * 4
+  };
+
+  const VkPipelineLayoutCreateInfo layoutInfo =
+  {
+    .sType                  = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+    .setLayoutCount         = 1,
+    .pSetLayouts            = &this->setLayout,
+    .pushConstantRangeCount = 1,
+    .pPushConstantRanges    = &pushRange
+  };
+
+  if (vkCreatePipelineLayout(this->device, &layoutInfo, NULL,
+        &this->pipelineLayout) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create the pipeline layout");
+    return false;
+  }
+
+  if (!vulkan_create_pipeline(this, false, &this->desktopPipeline) ||
+      !vulkan_create_pipeline(this, true , &this->cursorPipeline ))
+    return false;
+
+  const VkCommandPoolCreateInfo cmdPoolInfo =
+  {
+    .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+    .flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+    .queueFamilyIndex = this->queueFamily
+  };
+
+  if (vkCreateCommandPool(this->device, &cmdPoolInfo, NULL, &this->cmdPool) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create the command pool");
+    return false;
+  }
+
+  const VkCommandBufferAllocateInfo cmdInfo =
+  {
+    .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+    .commandPool        = this->cmdPool,
+    .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+    .commandBufferCount = FRAMES_IN_FLIGHT
+  };
+
+  if (vkAllocateCommandBuffers(this->device, &cmdInfo, this->cmd) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to allocate the command buffers");
+    return false;
+  }
+
+  const VkSemaphoreCreateInfo semInfo =
+  {
+    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO
+  };
+
+  for(int i = 0; i < FRAMES_IN_FLIGHT; ++i)
+    if (vkCreateSemaphore(this->device, &semInfo, NULL, &this->acquired[i]) != VK_SUCCESS)
+    {
+      DEBUG_ERROR("Failed to create a semaphore");
+      return false;
+    }
+
+  const VkSemaphoreTypeCreateInfo timelineType =
+  {
+    .sType         = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+    .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+    .initialValue  = 0
+  };
+
+  const VkSemaphoreCreateInfo timelineInfo =
+  {
+    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+    .pNext = &timelineType
+  };
+
+  if (vkCreateSemaphore(this->device, &timelineInfo, NULL, &this->timeline) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create the timeline semaphore");
+    return false;
+  }
+
+  return true;
+}
+
+bool vulkan_render_startup(void * opaque, SDL_Window * window)
+{
+  struct Inst * this = (struct Inst *)opaque;
+  this->window = window;
+
+  if (!vulkan_create_instance(this) ||
+      !vulkan_pick_device    (this) ||
+      !vulkan_create_device  (this) ||
+      !vulkan_create_objects (this) ||
+      !vulkan_create_swapchain(this))
+    return false;
+
+  DEBUG_INFO("Present Mode: %s",
+      this->presentMode == VK_PRESENT_MODE_MAILBOX_KHR   ? "mailbox"   :
+      this->presentMode == VK_PRESENT_MODE_IMMEDIATE_KHR ? "immediate" :
+      "fifo");
+  return true;
+}
+
+static bool vulkan_create_image(struct Inst * this, struct Image * img,
+    VkFormat format, unsigned int width, unsigned int height)
+{
+  const VkImageCreateInfo imageInfo =
+  {
+    .sType         = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+    .imageType     = VK_IMAGE_TYPE_2D,
+    .format        = format,
+    .extent        = { width, height, 1 },
+    .mipLevels     = 1,
+    .arrayLayers   = 1,
+    .samples       = VK_SAMPLE_COUNT_1_BIT,
+    .tiling        = VK_IMAGE_TILING_OPTIMAL,
+    .usage         = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+    .sharingMode   = VK_SHARING_MODE_EXCLUSIVE,
+    .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
+  };
+
+  if (vkCreateImage(this->device, &imageInfo, NULL, &img->image) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create an image");
+    return false;
+  }
+
+  VkMemoryRequirements req;
+  vkGetImageMemoryRequirements(this->device, img->image, &req);
+
+  const int32_t type = vulkan_memory_type(this, req.memoryTypeBits,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+  const VkMemoryAllocateInfo allocInfo =
+  {
+    .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    .allocationSize  = req.size,
+    .memoryTypeIndex = type
+  };
+
+  if (type < 0 ||
+      vkAllocateMemory(this->device, &allocInfo, NULL, &img->memory) != VK_SUCCESS ||
+      vkBindImageMemory(this->device, img->image, img->memory, 0) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to allocate the image memory");
+    return false;
+  }
+
+  const VkImageViewCreateInfo viewInfo =
+  {
+    .sType            = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+    .image            = img->image,
+    .viewType         = VK_IMAGE_VIEW_TYPE_2D,
+    .format           = format,
+    .subresourceRange =
+    {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .levelCount = 1,
+      .layerCount = 1
+    }
+  };
+
+  if (vkCreateImageView(this->device, &viewInfo, NULL, &img->view) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create an image view");
+    return false;
+  }
+
+  const VkDescriptorImageInfo descImage =
+  {
+    .imageView   = img->view,
+    .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+  };
+
+  const VkWriteDescriptorSet write =
+  {
+    .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+    .dstSet          = img->set,
+    .descriptorCount = 1,
+    .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+    .pImageInfo      = &descImage
+  };
+  vkUpdateDescriptorSets(this->device, 1, &write, 0, NULL);
+
+  img->layout = VK_IMAGE_LAYOUT_UNDEFINED;
+  img->width  = width;
+  img->height = height;
+  return true;
+}
+
+static VkFormat vulkan_frame_format(FrameType type)
+{
+  switch(type)
+  {
+    case FRAME_TYPE_BGRA   : return VK_FORMAT_B8G8R8A8_UNORM;
+    case FRAME_TYPE_RGBA   : return VK_FORMAT_R8G8B8A8_UNORM;
+    case FRAME_TYPE_RGBA10 : return VK_FORMAT_A2B10G10R10_UNORM_PACK32;
+    case FRAME_TYPE_RGBA16F: return VK_FORMAT_R16G16B16A16_SFLOAT;
+    default:
+      return VK_FORMAT_UNDEFINED;
+  }
+}
+
+// import the memory behind a frame as a buffer the GPU copies from directly
+static bool vulkan_import(struct Inst * this, struct Source * src,
+    VkDeviceSize size, struct Buffer * buf)
+{
+  VkExternalMemoryHandleTypeFlagBits handleType;
+  VkDeviceSize allocSize;
+  uint32_t     typeBits;
+
+  VkImportMemoryFdInfoKHR fdInfo =
+  {
+    .sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR
+  };
+
+  VkImportMemoryHostPointerInfoEXT hostInfo =
+  {
+    .sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT
+  };
+
+  const void * importInfo;
+
+  if (src->type == SOURCE_DMA)
+  {
+    handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+    const off_t fdSize = lseek(src->fd, 0, SEEK_END);
+    if (fdSize < (off_t)size)
+    {
+      DEBUG_ERROR("The DMA-BUF is smaller than the frame");
+      return false;
+    }
+    allocSize = fdSize;
+
+    VkMemoryFdPropertiesKHR props =
+    {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_FD_PROPERTIES_KHR
+    };
+    if (this->getMemoryFdProperties(this->device, handleType, src->fd,
+          &props) != VK_SUCCESS)
+    {
+      DEBUG_ERROR("vkGetMemoryFdPropertiesKHR failed");
+      return false;
+    }
+    typeBits = props.memoryTypeBits;
+
+    fdInfo.handleType = handleType;
+    fdInfo.fd         = src->fd;
+    importInfo        = &fdInfo;
+    buf->offset       = 0;
+  }
+  else
+  {
+    handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+
+    // the import must start and end on the minimum alignment
+    const uintptr_t addr  = (uintptr_t)src->key;
+    const uintptr_t start = addr & ~(uintptr_t)(this->hostAlign - 1);
+    buf->offset = addr - start;
+    allocSize   = (buf->offset + size + this->hostAlign - 1) &
+      ~(this->hostAlign - 1);
+
+    VkMemoryHostPointerPropertiesEXT props =
+    {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT
+    };
+    if (this->getMemoryHostPointerProperties(this->device, handleType,
+          (void *)start, &props) != VK_SUCCESS)
+    {
+      DEBUG_ERROR("vkGetMemoryHostPointerPropertiesEXT failed");
+      return false;
+    }
+    typeBits = props.memoryTypeBits;
+
+    hostInfo.handleType   = handleType;
+    hostInfo.pHostPointer = (void *)start;
+    importInfo            = &hostInfo;
+  }
+
+  const VkExternalMemoryBufferCreateInfo extInfo =
+  {
+    .sType       = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO,
+    .handleTypes = handleType
+  };
+
+  const VkBufferCreateInfo bufferInfo =
+  {
+    .sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .pNext       = &extInfo,
+    .size        = allocSize - buf->offset,
+    .usage       = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    .sharingMode = VK_SHARING_MODE_EXCLUSIVE
+  };
+
+  if (vkCreateBuffer(this->device, &bufferInfo, NULL, &buf->buffer) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create the import buffer");
+    return false;
+  }
+
+  VkMemoryRequirements req;
+  vkGetBufferMemoryRequirements(this->device, buf->buffer, &req);
+
+  const int32_t type = vulkan_memory_type(this, req.memoryTypeBits & typeBits, 0);
+  const VkMemoryAllocateInfo allocInfo =
+  {
+    .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    .pNext           = importInfo,
+    .allocationSize  = allocSize,
+    .memoryTypeIndex = type
+  };
+
+  if (type < 0 ||
+      vkAllocateMemory(this->device, &allocInfo, NULL, &buf->memory) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to import the frame memory");
+    vulkan_free_buffer(this, buf);
+    return false;
+  }
+
+  // a successful import owns the fd
+  if (src->type == SOURCE_DMA)
+    src->fd = -1;
+
+  // the buffer starts at the frame, the copy is given the offset instead
+  if (vkBindBufferMemory(this->device, buf->buffer, buf->memory, 0) != VK_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to bind the import buffer");
+    vulkan_free_buffer(this, buf);
+    return false;
+  }
+
+  return true;
+}
+
+static bool vulkan_get_buffer(struct Inst * this, struct Source * src,
+    VkDeviceSize size, VkBuffer * buffer, VkDeviceSize * offset)
+{
+  if (src->type == SOURCE_STAGING)
+  {
+    *buffer = this->staging[src->index].buffer;
+    *offset = 0;
+    return true;
+  }
+
+  for(unsigned int i = 0; i < this->importCount; ++i)
+    if (this->imports[i].key == src->key)
+    {
+      *buffer = this->imports[i].buf.buffer;
+      *offset = this->imports[i].buf.offset;
+      return true;
+    }
+
+  if (this->importCount == IMPORT_MAX)
+  {
+    DEBUG_WARN("Too many imported frames, dropping them");
+    vkQueueWaitIdle(this->queue);
+    vulkan_free_imports(this);
+  }
+
+  struct Import * import = &this->imports[this->importCount];
+  if (!vulkan_import(this, src, size, &import->buf))
+  {
+    // fall back to copying the frames into our own buffers
+    if (src->type == SOURCE_HOST)
+    {
+      DEBUG_WARN("Host memory import failed, falling back to a copy");
+      atomic_store(&this->hostSupport, false);
+    }
+    else
+    {
+      DEBUG_WARN("DMA-BUF import failed, falling back to a copy");
+      atomic_store(&this->dmaFailed, true);
+    }
+    return false;
+  }
+
+  import->key = src->key;
+  ++this->importCount;
+
+  *buffer = import->buf.buffer;
+  *offset = import->buf.offset;
+  return true;
+}
+
+static void vulkan_barrier(VkCommandBuffer cmd, struct Image * img,
+    VkImageLayout layout, VkPipelineStageFlags srcStage,
+    VkAccessFlags srcAccess, VkPipelineStageFlags dstStage,
+    VkAccessFlags dstAccess)
+{
+  const VkImageMemoryBarrier barrier =
+  {
+    .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+    .srcAccessMask       = srcAccess,
+    .dstAccessMask       = dstAccess,
+    .oldLayout           = img->layout,
+    .newLayout           = layout,
+    .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+    .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+    .image               = img->image,
+    .subresourceRange    =
+    {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .levelCount = 1,
+      .layerCount = 1
+    }
+  };
+
+  vkCmdPipelineBarrier(cmd, srcStage, dstStage, 0, 0, NULL, 0, NULL, 1,
+      &barrier);
+  img->layout = layout;
+}
+
+static void vulkan_copy_to_image(VkCommandBuffer cmd, struct Image * img,
+    VkBuffer buffer, VkDeviceSize offset, uint32_t rowLength)
+{
+  const bool first = img->layout == VK_IMAGE_LAYOUT_UNDEFINED;
+  vulkan_barrier(cmd, img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      first ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT :
+        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+      0, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+
+  const VkBufferImageCopy region =
+  {
+    .bufferOffset      = offset,
+    .bufferRowLength   = rowLength,
+    .imageSubresource  =
+    {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .layerCount = 1
+    },
+    .imageExtent       = { img->width, img->height, 1 }
+  };
+
+  vkCmdCopyBufferToImage(cmd, buffer, img->image,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+  vulkan_barrier(cmd, img, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+}
+
+// record the frame and cursor uploads, called with the lock held
+static void vulkan_record_uploads(struct Inst * this, VkCommandBuffer cmd,
+    uint64_t value)
+{
+  if (this->formatChanged)
+  {
+    this->formatChanged = false;
+
+    // nothing in flight may reference the old image or imports
+    vkQueueWaitIdle(this->queue);
+    vulkan_free_imports(this);
+    vulkan_free_image(this, &this->desktop);
+
+    const VkFormat format = vulkan_frame_format(this->format.type);
+    if (format == VK_FORMAT_UNDEFINED)
+      DEBUG_ERROR("Unsupported frame type: %s", FrameTypeStr[this->format.type]);
+    else if (!vulkan_create_image(this, &this->desktop, format,
+          this->format.width, this->format.height))
+      vulkan_free_image(this, &this->desktop);
+  }
+
+  if (this->pending.type != SOURCE_NONE && this->desktop.view)
+  {
+    const VkDeviceSize size = (VkDeviceSize)this->format.height * this->format.pitch;
+    VkBuffer     buffer;
+    VkDeviceSize offset;
+
+    if (vulkan_get_buffer(this, &this->pending, size, &buffer, &offset))
+    {
+      vulkan_copy_to_image(cmd, &this->desktop, buffer, offset,
+          this->format.pitch / (this->format.bpp / 8));
+
+      if (this->pending.type == SOURCE_STAGING)
+        this->stagingValue[this->pending.index] = value;
+    }
+  }
+  vulkan_free_source(&this->pending);
+
+  LG_LOCK(this->cursorLock);
+  if (this->cursorUpdate)
+  {
+    this->cursorUpdate = false;
+
+    const VkDeviceSize size = (VkDeviceSize)this->cursorWidth *
+      this->cursorHeight * sizeof(uint32_t);
+
+    // shape changes are rare, just let the last upload finish
+    vkQueueWaitIdle(this->queue);
+
+    if (size > this->cursorStagingSize)
+    {
+      vulkan_free_buffer(this, &this->cursorStaging);
+      this->cursorStagingSize = 0;
+      if (vulkan_create_buffer(this, &this->cursorStaging, size,
+            VK_BUFFER_USAGE_TRANSFER_SRC_BIT))
+        this->cursorStagingSize = size;
+    }
+
+    if (this->cursor.width  != this->cursorWidth ||
+        this->cursor.height != this->cursorHeight)
+    {
+      vulkan_free_image(this, &this->cursor);
+      if (!vulkan_create_image(this, &this->cursor, VK_FORMAT_B8G8R8A8_UNORM,
+            this->cursorWidth, this->cursorHeight))
+        vulkan_free_image(this, &this->cursor);
+    }
+
+    if (this->cursorStagingSize && this->cursor.view)
+    {
+      memcpy(this->cursorStaging.map, this->cursorData, size);
+      vulkan_copy_to_image(cmd, &this->cursor, this->cursorStaging.buffer, 0, 0);
+    }
+  }
+  LG_UNLOCK(this->cursorLock);
+}
+
+static void vulkan_draw_quad(struct Inst * this, VkCommandBuffer cmd,
+    VkPipeline pipeline, struct Image * img, const float rect[4])
+{
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+      this->pipelineLayout, 0, 1, &img->set, 0, NULL);
+  vkCmdPushConstants(cmd, this->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT,
+      0, sizeof(float) * 4, rect);
+  vkCmdDraw(cmd, 4, 1, 0, 0);
+}
+
+bool vulkan_render(void * opaque, SDL_Window * window)
+{
+  struct Inst * this = (struct Inst *)opaque;
+
+  if (atomic_exchange(&this->resized, false) || !this->swapchain)
+    if (!vulkan_recreate_swapchain(this))
+      return false;
+
+  if (!this->swapchain)
+    return true;
+
+  // wait for this slot's last submit, this keeps us FRAMES_IN_FLIGHT ahead
+  const unsigned int f = this->frameIndex;
+  const VkSemaphoreWaitInfo waitInfo =
+  {
+    .sType          = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+    .semaphoreCount = 1,
+    .pSemaphores    = &this->timeline,
+    .pValues        = &this->frameValue[f]
+  };
+  vkWaitSemaphores(this->device, &waitInfo, UINT64_MAX);
+
+  uint32_t imageIndex;
+  VkResult result = vkAcquireNextImageKHR(this->device, this->swapchain,
+      UINT64_MAX, this->acquired[f], VK_NULL_HANDLE, &imageIndex);
+  if (result == VK_ERROR_OUT_OF_DATE_KHR)
+  {
+    atomic_store(&this->resized, true);
+    return true;
+  }
+
+  if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR)
+  {
+    DEBUG_ERROR("vkAcquireNextImageKHR failed: %d", result);
+    return false;
+  }
+
+  VkCommandBuffer cmd = this->cmd[f];
+  vkResetCommandBuffer(cmd, 0);
+
+  const VkCommandBufferBeginInfo beginInfo =
+  {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+  };
+  vkBeginCommandBuffer(cmd, &beginInfo);
+
+  // the lock is held until the submit so the frame thread can't reuse a
+  // staging buffer before its timeline value is set
+  const uint64_t value = ++this->timelineValue;
+  LG_LOCK(this->lock);
+  vulkan_record_uploads(this, cmd, value);
+
+  const VkClearValue clear = { .color = { .float32 = { 0.0f, 0.0f, 0.0f, 1.0f } } };
+  const VkRenderPassBeginInfo passInfo =
+  {
+    .sType           = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+    .renderPass      = this->renderPass,
+    .framebuffer     = this->framebuffers[imageIndex],
+    .renderArea      = { .extent = this->extent },
+    .clearValueCount = 1,
+    .pClearValues    = &clear
+  };
+  vkCmdBeginRenderPass(cmd, &passInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+  if (this->desktop.layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL &&
+      this->destRect.valid && this->width && this->height)
+  {
+    // the window size may not be the drawable size on HiDPI displays
+    const float sx = (float)this->extent.width  / this->width;
+    const float sy = (float)this->extent.height / this->height;
+
+    const VkViewport viewport =
+    {
+      .x        = this->destRect.x * sx,
+      .y        = this->destRect.y * sy,
+      .width    = this->destRect.w * sx,
+      .height   = this->destRect.h * sy,
+      .maxDepth = 1.0f
+    };
+    const VkRect2D scissor = { .extent = this->extent };
+    vkCmdSetViewport(cmd, 0, 1, &viewport);
+    vkCmdSetScissor (cmd, 0, 1, &scissor );
+
+    const float full[4] = { -1.0f, -1.0f, 2.0f, 2.0f };
+    vulkan_draw_quad(this, cmd, this->desktopPipeline, &this->desktop, full);
+
+    bool visible = this->cursorVisible;
+    int  x       = this->cursorX;
+    int  y       = this->cursorY;
+    if (this->params.latchCursor)
+      this->params.latchCursor(&visible, &x, &y);
+
+    if (visible && this->cursor.layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)
+    {
+      // the cursor is in desktop coordinates, y points down as in Vulkan
+      const float mx = 2.0f / this->format.screenWidth;
+      const float my = 2.0f / this->format.screenHeight;
+      const float rect[4] =
+      {
+        x * mx - 1.0f,
+        y * my - 1.0f,
+        this->cursor.width  * mx,
+        this->cursor.height * my
+      };
+      vulkan_draw_quad(this, cmd, this->cursorPipeline, &this->cursor, rect);
+    }
+  }
+
+  vkCmdEndRenderPass(cmd);
+  vkEndCommandBuffer(cmd);
+
+  const uint64_t signalValues[] = { 0, value };
+  const VkTimelineSemaphoreSubmitInfo timelineInfo =
+  {
+    .sType                     = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+    .signalSemaphoreValueCount = 2,
+    .pSignalSemaphoreValues    = signalValues
+  };
+
+  const VkPipelineStageFlags waitStage =
+    VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  const VkSemaphore signal[] = { this->renderDone[imageIndex], this->timeline };
+
+  const VkSubmitInfo submitInfo =
+  {
+    .sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .pNext                = &timelineInfo,
+    .waitSemaphoreCount   = 1,
+    .pWaitSemaphores      = &this->acquired[f],
+    .pWaitDstStageMask    = &waitStage,
+    .commandBufferCount   = 1,
+    .pCommandBuffers      = &cmd,
+    .signalSemaphoreCount = 2,
+    .pSignalSemaphores    = signal
+  };
+
+  result = vkQueueSubmit(this->queue, 1, &submitInfo, VK_NULL_HANDLE);
+  LG_UNLOCK(this->lock);
+
+  if (result != VK_SUCCESS)
+  {
+    DEBUG_ERROR("vkQueueSubmit failed: %d", result);
+    return false;
+  }
+
+  this->frameValue[f] = value;
+  this->frameIndex    = (f + 1) % FRAMES_IN_FLIGHT;
+
+  const VkPresentInfoKHR presentInfo =
+  {
+    .sType              = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+    .waitSemaphoreCount = 1,
+    .pWaitSemaphores    = &this->renderDone[imageIndex],
+    .swapchainCount     = 1,
+    .pSwapchains        = &this->swapchain,
+    .pImageIndices      = &imageIndex
+  };
+
+  result = vkQueuePresentKHR(this->queue, &presentInfo);
+  if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
+    atomic_store(&this->resized, true);
+  else if (result != VK_SUCCESS)
+  {
+    DEBUG_ERROR("vkQueuePresentKHR failed: %d", result);
+    return false;
+  }
+
+  return true;
+}
+
+void vulkan_update_fps(void * opaque, const float avgUPS, const float avgFPS,
+    const LG_RendererLatency * latency)
+{
+  // there is no overlay to show the FPS on yet
+}
+
+struct LG_Renderer LGR_Vulkan =
+{
+  .get_name        = vulkan_get_name,
+  .setup           = vulkan_setup,
+  .create          = vulkan_create,
+  .initialize      = vulkan_initialize,
+  .deinitialize    = vulkan_deinitialize,
+  .supports        = vulkan_supports,
+  .frame_types     = vulkan_frame_types,
+  .on_restart      = vulkan_on_restart,
+  .on_resize       = vulkan_on_resize,
+  .on_mouse_shape  = vulkan_on_mouse_shape,
+  .on_mouse_event  = vulkan_on_mouse_event,
+  .on_frame_format = vulkan_on_frame_format,
+  .on_frame        = vulkan_on_frame,
+  .on_alert        = vulkan_on_alert,
+  .render_startup  = vulkan_render_startup,
+  .render          = vulkan_render,
+  .update_fps      = vulkan_update_fps
+};
@@ -0,0 +1,438 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "audio.h"
+#include "common/KVMFR.h"
+#include "common/debug.h"
+#include "common/thread.h"
+#include "common/time.h"
+
+#include <SDL2/SDL.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+// a power of two, over a second at 48kHz
+#define AUDIO_RING_FRAMES 65536
+
+// the most the playback rate is changed by to hold the buffer size
+#define AUDIO_MAX_ADJUST  0.005
+
+// the microseconds it takes the jitter estimate to forget a late block
+#define AUDIO_JITTER_DECAY (2 * 1000000)
+
+#define AUDIO_REPORT_INTERVAL (10 * 1000000)
+
+static struct
+{
+  PLGMPClient       lgmp;
+  LGThread        * thread;
+  atomic_bool       running;
+  uint64_t          latency;
+
+  SDL_AudioDeviceID device;
+  uint32_t          sampleRate;
+  uint32_t          channels;
+  uint32_t          deviceFrames;
+
+  // single producer, single consumer, the counts are in frames and wrap
+  float           * ring;
+  atomic_uint       head, tail;
+  atomic_uint       target;
+
+  // the consumer's position between tail and the next frame
+  double            frac;
+  bool              buffering;
+  atomic_uint       underruns;
+
+  // the arrival jitter, measured against the capture times
+  bool              haveTransit;
+  int64_t           minTransit;
+  uint64_t          minTransitTime;
+  double            jitter;
+  uint64_t          lastRecv;
+
+  bool              haveSerial;
+  uint32_t          serial;
+  unsigned int      dropped;
+  atomic_bool       clockValid;
+  _Atomic(int64_t)  clockOffset;
+  uint64_t          nextReport;
+  uint64_t          delaySum;
+  unsigned int      delayCount;
+}
+audio = { 0 };
+
+static void audioCallback(void * opaque, Uint8 * stream, int len)
+{
+  const uint32_t channels = audio.channels;
+  const int      count    = len / (sizeof(float) * channels);
+  float        * out      = (float *)stream;
+
+  const unsigned int head   = atomic_load_explicit(&audio.head, memory_order_acquire);
+  unsigned int       tail   = atomic_load_explicit(&audio.tail, memory_order_relaxed);
+  const unsigned int target = atomic_load_explicit(&audio.target, memory_order_relaxed);
+
+  int i = 0;
+  if (audio.buffering && head - tail < target)
+    goto silence;
+  audio.buffering = false;
+
+  // hold the buffer at the target, the change in pitch is not audible
+  double ratio = 1.0 + ((double)(head - tail) - target) / (target * 50.0);
+  if (ratio > 1.0 + AUDIO_MAX_ADJUST)
+    ratio = 1.0 + AUDIO_MAX_ADJUST;
+  else if (ratio < 1.0 - AUDIO_MAX_ADJUST)
+    ratio = 1.0 - AUDIO_MAX_ADJUST;
+
+  for(; i < count; ++i)
+  {
+    if (head - tail < 2)
+    {
+      audio.buffering = true;
+      atomic_fetch_add_explicit(&audio.underruns, 1, memory_order_relaxed);
+      break;
+    }
+
+    const float * a = audio.ring + (tail       & (AUDIO_RING_FRAMES - 1)) * channels;
+    const float * b = audio.ring + ((tail + 1) & (AUDIO_RING_FRAMES - 1)) * channels;
+    const float   f = audio.frac;
+    for(uint32_t c = 0; c < channels; ++c)
+      out[i * channels + c] = a[c] + (b[c] - a[c]) * f;
+
+    audio.frac += ratio;
+    while(audio.frac >= 1.0)
+    {
+      audio.frac -= 1.0;
+      ++tail;
+    }
+  }
+
+  atomic_store_explicit(&audio.tail, tail, memory_order_release);
+
+silence:
+  memset(out + i * channels, 0, (count - i) * channels * sizeof(float));
+}
+
+static void closeDevice()
+{
+  if (!audio.device)
+    return;
+
+  SDL_CloseAudioDevice(audio.device);
+  audio.device = 0;
+  free(audio.ring);
+  audio.ring = NULL;
+}
+
+static bool openDevice(uint32_t sampleRate, uint32_t channels)
+{
+  closeDevice();
+
+  audio.ring = malloc(AUDIO_RING_FRAMES * channels * sizeof(float));
+  if (!audio.ring)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+
+  audio.sampleRate  = sampleRate;
+  audio.channels    = channels;
+  audio.frac        = 0.0;
+  audio.buffering   = true;
+  audio.haveTransit = false;
+  audio.jitter      = 0.0;
+  atomic_store(&audio.head, 0);
+  atomic_store(&audio.tail, 0);
+
+  // about 5ms per callback, SDL wants a power of two
+  Uint16 samples = 64;
+  while(samples < sampleRate / 200)
+    samples <<= 1;
+
+  SDL_AudioSpec want =
+  {
+    .freq     = sampleRate,
+    .format   = AUDIO_F32SYS,
+    .channels = channels,
+    .samples  = samples,
+    .callback = audioCallback
+  };
+  SDL_AudioSpec have;
+
+  audio.device = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+  if (!audio.device)
+  {
+    DEBUG_ERROR("SDL_OpenAudioDevice Failed: %s", SDL_GetError());
+    free(audio.ring);
+    audio.ring = NULL;
+    return false;
+  }
+
+  audio.deviceFrames = have.samples;
+  DEBUG_INFO("Audio: %u Hz, %u channels, %u frames per period",
+      sampleRate, channels, have.samples);
+
+  SDL_PauseAudioDevice(audio.device, 0);
+  return true;
+}
+
+// the transit time of a block is its arrival less its capture, the offset
+// between the clocks is constant so how far it is over the shortest recent
+// transit is how late the block is
+static void updateJitter(const KVMFRAudio * block, uint64_t recvTime)
+{
+  const int64_t transit = (int64_t)recvTime - (int64_t)block->captureTime;
+  if (!audio.haveTransit || transit < audio.minTransit ||
+      recvTime - audio.minTransitTime > AUDIO_JITTER_DECAY)
+  {
+    audio.haveTransit    = true;
+    audio.minTransit     = transit;
+    audio.minTransitTime = recvTime;
+  }
+
+  const double late = transit - audio.minTransit;
+  const double dt   = audio.lastRecv ? recvTime - audio.lastRecv : 0;
+  audio.lastRecv = recvTime;
+
+  // jump up to a late block at once, forget it slowly
+  if (late > audio.jitter)
+    audio.jitter = late;
+  else
+    audio.jitter -= (audio.jitter - late) * (dt / AUDIO_JITTER_DECAY);
+
+  // the device takes a period at a time, half of one is in the buffer on
+  // average when a block arrives
+  const uint64_t blockTime = block->frames * 1000000ULL / block->sampleRate;
+  const uint64_t us = audio.latency + audio.jitter + blockTime;
+  unsigned int target = us * block->sampleRate / 1000000ULL +
+    audio.deviceFrames / 2;
+  if (target > AUDIO_RING_FRAMES / 4)
+    target = AUDIO_RING_FRAMES / 4;
+  atomic_store_explicit(&audio.target, target, memory_order_relaxed);
+}
+
+static void report()
+{
+  const unsigned int target = atomic_load(&audio.target);
+  const unsigned int avail  = atomic_load(&audio.head) - atomic_load(&audio.tail);
+  const unsigned int underruns = atomic_exchange(&audio.underruns, 0);
+
+  if (audio.delayCount)
+    DEBUG_INFO("Audio: %.1f ms buffered of %.1f, %.1f ms from capture to "
+        "output, %u underruns, %u blocks dropped",
+        avail  * 1000.0 / audio.sampleRate,
+        target * 1000.0 / audio.sampleRate,
+        audio.delaySum / (audio.delayCount * 1000.0),
+        underruns, audio.dropped);
+  else
+    DEBUG_INFO("Audio: %.1f ms buffered of %.1f, %u underruns, %u blocks "
+        "dropped",
+        avail  * 1000.0 / audio.sampleRate,
+        target * 1000.0 / audio.sampleRate,
+        underruns, audio.dropped);
+
+  audio.dropped    = 0;
+  audio.delaySum   = 0;
+  audio.delayCount = 0;
+}
+
+static void playBlock(const KVMFRAudio * block, uint64_t recvTime)
+{
+  if (!audio.device || block->sampleRate != audio.sampleRate ||
+      block->channels != audio.channels)
+    if (!openDevice(block->sampleRate, block->channels))
+      return;
+
+  if (audio.haveSerial && block->serial != audio.serial)
+    audio.dropped += block->serial - audio.serial;
+  audio.haveSerial = true;
+  audio.serial = block->serial + 1;
+
+  updateJitter(block, recvTime);
+
+  const unsigned int head  = atomic_load_explicit(&audio.head, memory_order_relaxed);
+  const unsigned int tail  = atomic_load_explicit(&audio.tail, memory_order_acquire);
+  const unsigned int avail = head - tail;
+
+  // far more than the target is left after a stall, it is not played faster
+  // than the rate adjust so it is skipped instead
+  if (avail + block->frames > AUDIO_RING_FRAMES ||
+      avail > atomic_load(&audio.target) * 3)
+  {
+    ++audio.dropped;
+    return;
+  }
+
+  const uint32_t      channels = block->channels;
+  const float       * data     = (const float *)(block + 1);
+  const unsigned int  start    = head & (AUDIO_RING_FRAMES - 1);
+  unsigned int        first    = AUDIO_RING_FRAMES - start;
+  if (first > block->frames)
+    first = block->frames;
+
+  memcpy(audio.ring + start * channels, data, first * channels * sizeof(float));
+  memcpy(audio.ring, data + first * channels,
+      (block->frames - first) * channels * sizeof(float));
+  atomic_store_explicit(&audio.head, head + block->frames, memory_order_release);
+
+  // the age of the last sample once the buffer ahead of it has played
+  if (atomic_load_explicit(&audio.clockValid, memory_order_relaxed))
+  {
+    const int64_t offset = atomic_load_explicit(&audio.clockOffset,
+        memory_order_relaxed);
+    const int64_t delay = (int64_t)recvTime + offset -
+      (int64_t)block->captureTime + (int64_t)(avail + audio.deviceFrames) *
+      1000000LL / block->sampleRate;
+    if (delay > 0)
+    {
+      audio.delaySum += delay;
+      ++audio.delayCount;
+    }
+  }
+}
+
+static bool audioSubscribe(PLGMPClientQueue * queue)
+{
+  // the host creates the queue if it captures the audio
+  while(atomic_load(&audio.running))
+  {
+    LGMP_STATUS status = lgmpClientSubscribe(audio.lgmp, LGMP_Q_AUDIO, queue);
+    if (status == LGMP_OK)
+      return true;
+
+    if (status == LGMP_ERR_NO_SUCH_QUEUE)
+    {
+      usleep(100000);
+      continue;
+    }
+
+    DEBUG_ERROR("lgmpClientSubscribe Failed (Audio): %s",
+        lgmpStatusString(status));
+    return false;
+  }
+
+  return false;
+}
+
+static int audioThread(void * unused)
+{
+  LGMP_STATUS      status;
+  PLGMPClientQueue queue;
+
+  if (!audioSubscribe(&queue))
+    return 0;
+
+  audio.nextReport = microtime() + AUDIO_REPORT_INTERVAL;
+  while(atomic_load(&audio.running))
+  {
+    LGMPMessage msg;
+    if ((status = lgmpClientProcess(queue, &msg)) != LGMP_OK)
+    {
+      if (status == LGMP_ERR_QUEUE_EMPTY)
+      {
+        usleep(1000);
+        continue;
+      }
+
+      // the host drops a subscriber that falls behind, such as while the
+      // thread was descheduled, subscribe again rather than end the audio
+      if (status == LGMP_ERR_QUEUE_TIMEOUT ||
+          status == LGMP_ERR_QUEUE_UNSUBSCRIBED)
+      {
+        DEBUG_WARN("The audio queue timed out, subscribing again");
+        lgmpClientUnsubscribe(&queue);
+        if (!audioSubscribe(&queue))
+          return 0;
+        continue;
+      }
+
+      if (status != LGMP_ERR_INVALID_SESSION)
+        DEBUG_ERROR("lgmpClientProcess Failed (Audio): %s",
+            lgmpStatusString(status));
+      break;
+    }
+
+    const uint64_t     now   = microtime();
+    const KVMFRAudio * block = (const KVMFRAudio *)msg.mem;
+    if (block->sampleRate && block->channels &&
+        block->channels <= KVMFR_AUDIO_MAX_CHANNELS &&
+        block->frames   <= KVMFR_AUDIO_MAX_FRAMES   &&
+        sizeof(KVMFRAudio) + block->frames * block->channels * sizeof(float) <=
+          msg.size)
+      playBlock(block, now);
+
+    lgmpClientMessageDone(queue);
+
+    if (audio.device && now >= audio.nextReport)
+    {
+      report();
+      audio.nextReport = now + AUDIO_REPORT_INTERVAL;
+    }
+  }
+
+  lgmpClientUnsubscribe(&queue);
+  return 0;
+}
+
+bool audio_start(PLGMPClient lgmp, unsigned int latency)
+{
+  if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0)
+  {
+    DEBUG_ERROR("Failed to initialize the SDL audio: %s", SDL_GetError());
+    return false;
+  }
+
+  audio.lgmp       = lgmp;
+  audio.latency    = latency * 1000ULL;
+  audio.haveSerial = false;
+  audio.dropped    = 0;
+  atomic_store(&audio.running, true);
+
+  if (!lgCreateThread("audioThread", audioThread, NULL, &audio.thread))
+  {
+    DEBUG_ERROR("audio create thread failed");
+    atomic_store(&audio.running, false);
+    SDL_QuitSubSystem(SDL_INIT_AUDIO);
+    return false;
+  }
+
+  return true;
+}
+
+void audio_stop()
+{
+  if (!audio.thread)
+    return;
+
+  atomic_store(&audio.running, false);
+  lgJoinThread(audio.thread, NULL);
+  audio.thread = NULL;
+
+  closeDevice();
+  atomic_store(&audio.clockValid, false);
+  SDL_QuitSubSystem(SDL_INIT_AUDIO);
+}
+
+void audio_set_clock(int64_t offset)
+{
+  atomic_store_explicit(&audio.clockOffset, offset, memory_order_relaxed);
+  atomic_store_explicit(&audio.clockValid, true, memory_order_relaxed);
+}
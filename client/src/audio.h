@@ -0,0 +1,42 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <lgmp/client.h>
+
+/*
+ * The guest audio the host posts on LGMP_Q_AUDIO is played through SDL, which
+ * outputs through PipeWire or PulseAudio. The blocks are kept in a jitter
+ * buffer that is sized from how late they arrive, and is held at that size
+ * by playing it back a fraction of a percent faster or slower instead of
+ * dropping or repeating samples.
+ */
+
+// latency is the milliseconds to buffer on top of the measured jitter
+bool audio_start(PLGMPClient lgmp, unsigned int latency);
+
+// called before the LGMP session ends
+void audio_stop();
+
+// the host microtime minus ours from the frame clock sync, the audio delay
+// is reported on the same clock as the video
+void audio_set_clock(int64_t offset);
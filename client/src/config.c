@@ -23,6 +23,7 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "common/debug.h"
 #include "common/stringutils.h"
 
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <pwd.h>
 #include <unistd.h>
@@ -84,6 +85,13 @@ static struct Option options[] =
     .type          = OPTION_TYPE_INT,
     .value.x_int   = 1000
   },
+  {
+    .module        = "app",
+    .name          = "skipFrames",
+    .description   = "Skip to the newest frame when behind instead of uploading every queued frame",
+    .type          = OPTION_TYPE_BOOL,
+    .value.x_bool  = true
+  },
   {
     .module        = "app",
     .name          = "allowDMA",
@@ -91,6 +99,62 @@ static struct Option options[] =
     .type          = OPTION_TYPE_BOOL,
     .value.x_bool  = true
   },
+  {
+    .module        = "app",
+    .name          = "realtime",
+    .description   = "Use real-time scheduling for the frame and render threads if permitted",
+    .type          = OPTION_TYPE_BOOL,
+    .value.x_bool  = false
+  },
+  {
+    .module         = "app",
+    .name           = "frameAffinity",
+    .description    = "Hex mask of the CPUs to pin the frame thread to (0 for any)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "0"
+  },
+  {
+    .module         = "app",
+    .name           = "readThreads",
+    .description    = "How many threads to split each frame upload across (0 or 1 to disable)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 0
+  },
+  {
+    .module         = "app",
+    .name           = "renderAffinity",
+    .description    = "Hex mask of the CPUs to pin the render thread to (0 for any)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "0"
+  },
+  {
+    .module         = "app",
+    .name           = "numaPin",
+    .description    = "Pin the frame and render threads to the NUMA node of the shared memory if their affinity is not set",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = true
+  },
+  {
+    .module         = "app",
+    .name           = "statsShm",
+    .description    = "Publish frame statistics for monitoring in this POSIX shared memory object, ie: /looking-glass-stats",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "app",
+    .name           = "latencyProbe",
+    .description    = "Send a latency probe this often in ms and log the time from sending it to the present of the frame captured after the host saw it (0 to disable)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 0
+  },
+  {
+    .module         = "app",
+    .name           = "traceFile",
+    .description    = "Record a trace of the frame path and write it here on ScrollLock+T or SIGUSR1",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
 
   // window options
   {
@@ -156,6 +220,27 @@ static struct Option options[] =
     .type           = OPTION_TYPE_BOOL,
     .value.x_bool   = false,
   },
+  {
+    .module         = "win",
+    .name           = "hostScale",
+    .description    = "Ask the host to scale the frame down to the window size before sending it",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
+  {
+    .module         = "win",
+    .name           = "hostScalePercent",
+    .description    = "The percent of the window size to ask the host to scale to, less than 100 with egl:upscale trades GPU time for copy bandwidth",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 100,
+  },
+  {
+    .module         = "win",
+    .name           = "hostCrop",
+    .description    = "Ask the host to capture only this region of the guest desktop as x,y,width,height",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL,
+  },
   {
     .module         = "win",
     .name           = "borderless",
@@ -195,6 +280,34 @@ static struct Option options[] =
     .type           = OPTION_TYPE_INT,
     .value.x_int    = -1,
   },
+  {
+    .module         = "win",
+    .name           = "jitRender",
+    .description    = "Render each new frame just before the next vblank so the newest frame is presented",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
+  {
+    .module         = "win",
+    .name           = "jitMargin",
+    .description    = "The least time in microseconds to start rendering before the vblank when jitRender is enabled",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 2000,
+  },
+  {
+    .module         = "win",
+    .name           = "vrr",
+    .description    = "The display has a variable refresh rate, with jitRender present frames as soon as they arrive",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
+  {
+    .module         = "win",
+    .name           = "maxFPS",
+    .description    = "The most frames per second the host should send (0 = no limit, -1 = the display refresh rate)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = -1,
+  },
   {
     .module         = "win",
     .name           = "showFPS",
@@ -203,6 +316,13 @@ static struct Option options[] =
     .type           = OPTION_TYPE_BOOL,
     .value.x_bool   = false,
   },
+  {
+    .module         = "win",
+    .name           = "headless",
+    .description    = "Render offscreen without a window or vsync and log the render stats, for benchmarking the renderers",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
   {
     .module         = "win",
     .name           = "ignoreQuit",
@@ -275,6 +395,27 @@ static struct Option options[] =
     .type           = OPTION_TYPE_INT,
     .value.x_int    = 0,
   },
+  {
+    .module         = "input",
+    .name           = "mouseRate",
+    .description    = "The most mouse motion messages to send to the guest per second, 0 sends every event",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 1000,
+  },
+  {
+    .module         = "input",
+    .name           = "evdev",
+    .description    = "Read the mouse motion in capture mode directly from this evdev device, ie: /dev/input/by-id/usb-...-event-mouse",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL,
+  },
+  {
+    .module         = "input",
+    .name           = "ivshmem",
+    .description    = "Send the keyboard and mouse input through the shared memory when the host can inject it, SPICE is used otherwise",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = true,
+  },
   {
     .module         = "input",
     .name           = "mouseRedraw",
@@ -282,6 +423,13 @@ static struct Option options[] =
     .type           = OPTION_TYPE_BOOL,
     .value.x_bool   = true,
   },
+  {
+    .module         = "input",
+    .name           = "localCursor",
+    .description    = "Show the guest cursor with the local hardware cursor when the view is not scaled",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
 
   // spice options
   {
@@ -295,7 +443,7 @@ static struct Option options[] =
   {
     .module         = "spice",
     .name           = "host",
-    .description    = "The SPICE server host or UNIX socket",
+    .description    = "The SPICE server host or the path of its UNIX socket",
     .shortopt       = 'c',
     .type           = OPTION_TYPE_STRING,
     .value.x_string = "127.0.0.1"
@@ -336,6 +484,13 @@ static struct Option options[] =
     .type           = OPTION_TYPE_BOOL,
     .value.x_bool   = true
   },
+  {
+    .module         = "spice",
+    .name           = "clipboardShm",
+    .description    = "Sync the clipboard through the shared memory if the host can",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = true
+  },
   {
     .module         = "spice",
     .name           = "scaleCursor",
@@ -358,6 +513,34 @@ static struct Option options[] =
     .type           = OPTION_TYPE_BOOL,
     .value.x_bool   = false
   },
+  {
+    .module         = "mosaic",
+    .name           = "devices",
+    .description    = "Show the VMs of these shared memory devices alongside this one, comma separated, each as path[@fps]",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "mosaic",
+    .name           = "fps",
+    .description    = "The most updates per second of a mosaic device without a rate of its own (0 = unlimited)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 30
+  },
+  {
+    .module         = "audio",
+    .name           = "enable",
+    .description    = "Play the guest audio the host sends through the shared memory",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = true
+  },
+  {
+    .module         = "audio",
+    .name           = "latency",
+    .description    = "Milliseconds of audio to buffer on top of the measured jitter",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 10
+  },
   {0}
 };
 
@@ -422,7 +605,16 @@ bool config_load(int argc, char * argv[])
   // setup the application params for the basic types
   params.cursorPollInterval = option_get_int   ("app", "cursorPollInterval");
   params.framePollInterval  = option_get_int   ("app", "framePollInterval" );
+  params.skipFrames         = option_get_bool  ("app", "skipFrames"        );
   params.allowDMA           = option_get_bool  ("app", "allowDMA"          );
+  params.realtime           = option_get_bool  ("app", "realtime"          );
+  params.frameAffinity      = strtoull(option_get_string("app", "frameAffinity" ), NULL, 16);
+  params.renderAffinity     = strtoull(option_get_string("app", "renderAffinity"), NULL, 16);
+  params.readThreads        = option_get_int   ("app", "readThreads"       );
+  params.numaPin            = option_get_bool  ("app", "numaPin"           );
+  params.traceFile          = option_get_string("app", "traceFile");
+  params.statsShm           = option_get_string("app", "statsShm");
+  params.latencyProbe       = option_get_int   ("app", "latencyProbe");
 
   params.windowTitle   = option_get_string("win", "title"        );
   params.autoResize    = option_get_bool  ("win", "autoResize"   );
@@ -430,11 +622,18 @@ bool config_load(int argc, char * argv[])
   params.keepAspect    = option_get_bool  ("win", "keepAspect"   );
   params.forceAspect   = option_get_bool  ("win", "forceAspect"  );
   params.dontUpscale   = option_get_bool  ("win", "dontUpscale"  );
+  params.hostScale     = option_get_bool  ("win", "hostScale"    );
+  params.hostScalePct  = option_get_int   ("win", "hostScalePercent");
   params.borderless    = option_get_bool  ("win", "borderless"   );
   params.fullscreen    = option_get_bool  ("win", "fullScreen"   );
   params.maximize      = option_get_bool  ("win", "maximize"     );
   params.fpsMin        = option_get_int   ("win", "fpsMin"       );
+  params.jitRender     = option_get_bool  ("win", "jitRender"    );
+  params.jitMargin     = option_get_int   ("win", "jitMargin"    );
+  params.vrr           = option_get_bool  ("win", "vrr"          );
+  params.maxFPS        = option_get_int   ("win", "maxFPS"       );
   params.showFPS       = option_get_bool  ("win", "showFPS"      );
+  params.headless      = option_get_bool  ("win", "headless"     );
   params.ignoreQuit    = option_get_bool  ("win", "ignoreQuit"   );
   params.noScreensaver = option_get_bool  ("win", "noScreensaver");
   params.showAlerts    = option_get_bool  ("win", "alerts"       );
@@ -445,15 +644,63 @@ bool config_load(int argc, char * argv[])
   params.escapeKey           = option_get_int   ("input", "escapeKey"          );
   params.hideMouse           = option_get_bool  ("input", "hideCursor"         );
   params.mouseSens           = option_get_int   ("input", "mouseSens"          );
+  params.mouseRate           = option_get_int   ("input", "mouseRate"          );
+  params.evdev               = option_get_string("input", "evdev"              );
+  params.shmInput            = option_get_bool  ("input", "ivshmem"            );
   params.mouseRedraw         = option_get_bool  ("input", "mouseRedraw"        );
+  params.localCursor         = option_get_bool  ("input", "localCursor"        );
 
   params.minimizeOnFocusLoss = option_get_bool("win", "minimizeOnFocusLoss");
 
+  params.mosaicDevices = option_get_string("mosaic", "devices");
+  params.mosaicFPS     = option_get_int   ("mosaic", "fps"    );
+
+  params.audio        = option_get_bool("audio", "enable" );
+  params.audioLatency = option_get_int ("audio", "latency");
+  if (params.audioLatency < 0 || params.audioLatency > 500)
+  {
+    DEBUG_ERROR("audio:latency must be between 0 and 500");
+    return false;
+  }
+
+  if (params.hostScalePct < 10 || params.hostScalePct > 100)
+  {
+    DEBUG_ERROR("win:hostScalePercent must be between 10 and 100");
+    return false;
+  }
+
+  const char * hostCrop = option_get_string("win", "hostCrop");
+  if (hostCrop && sscanf(hostCrop, "%u,%u,%u,%u",
+        &params.hostCrop.x, &params.hostCrop.y,
+        &params.hostCrop.w, &params.hostCrop.h) != 4)
+  {
+    DEBUG_ERROR("win:hostCrop must be in the form x,y,width,height");
+    return false;
+  }
+
   if (option_get_bool("spice", "enable"))
   {
     params.spiceHost         = option_get_string("spice", "host");
     params.spicePort         = option_get_int   ("spice", "port");
 
+    // a local VM is best reached over its UNIX socket, there is no loopback
+    // TCP stack or Nagle delay, so a path is always taken as one
+    if (params.spiceHost && params.spiceHost[0] == '/')
+    {
+      struct stat st;
+      if (stat(params.spiceHost, &st) != 0 || !S_ISSOCK(st.st_mode))
+      {
+        DEBUG_ERROR("spice:host %s is not a UNIX socket", params.spiceHost);
+        return false;
+      }
+      params.spicePort = 0;
+    }
+    else if (params.spicePort == 0)
+    {
+      DEBUG_ERROR("spice:port 0 needs spice:host to be the path of a UNIX socket");
+      return false;
+    }
+
     params.useSpiceInput     = option_get_bool("spice", "input"    );
     params.useSpiceClipboard = option_get_bool("spice", "clipboard");
 
@@ -461,6 +708,7 @@ bool config_load(int argc, char * argv[])
     {
       params.clipboardToVM    = option_get_bool("spice", "clipboardToVM"   );
       params.clipboardToLocal = option_get_bool("spice", "clipboardToLocal");
+      params.clipboardShm     = option_get_bool("spice", "clipboardShm"    );
 
       if (!params.clipboardToVM && !params.clipboardToLocal)
         params.useSpiceClipboard = false;
@@ -471,6 +719,18 @@ bool config_load(int argc, char * argv[])
     params.alwaysShowCursor  = option_get_bool("spice", "alwaysShowCursor");
   }
 
+  // there is no window to fit, no vblank to aim for and no input, the stats
+  // are always logged but not drawn
+  if (params.headless)
+  {
+    params.fullscreen     = false;
+    params.forceAspect    = false;
+    params.jitRender      = false;
+    params.captureOnStart = false;
+    params.showFPS        = true;
+    params.audio          = false;
+  }
+
   return true;
 }
 
@@ -0,0 +1,207 @@
+/*
+KVMGFX Client - A KVM Client for VGA Passthrough
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "cursorstate.h"
+#include "common/debug.h"
+#include "common/KVMFR.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#define SLOT_FRESH 0x4U
+
+struct ImageBuffer
+{
+  CursorImage image;
+  uint8_t   * data;
+  size_t      size;
+};
+
+/* a triple buffer, the writer fills back and swaps it with mid, the reader
+ * swaps front with mid when it has been marked fresh, so neither ever touches
+ * a buffer the other is using */
+struct Slot
+{
+  struct ImageBuffer buffers[3];
+  atomic_uint        mid;
+  unsigned int       back;  // only used by the writer
+  unsigned int       front; // only used by the reader
+};
+
+// the fields are atomic only so the reader may race the writer, the sequence
+// tells it if it did
+struct CursorState
+{
+  atomic_uint  seq;
+  atomic_bool  visible;
+  atomic_int   x, y;
+  atomic_int   width, height;
+  atomic_int   shape;
+
+  struct Slot  slots[KVMFR_CURSOR_CACHE];
+};
+
+bool cursorstate_new(CursorState ** cs)
+{
+  *cs = (CursorState *)calloc(1, sizeof(**cs));
+  if (!*cs)
+  {
+    DEBUG_ERROR("Failed to allocate the cursor state");
+    return false;
+  }
+
+  atomic_init(&(*cs)->shape, -1);
+  for(int i = 0; i < KVMFR_CURSOR_CACHE; ++i)
+  {
+    struct Slot * slot = &(*cs)->slots[i];
+    slot->front = 0;
+    atomic_init(&slot->mid, 1);
+    slot->back  = 2;
+  }
+
+  return true;
+}
+
+void cursorstate_free(CursorState ** cs)
+{
+  if (!*cs)
+    return;
+
+  for(int i = 0; i < KVMFR_CURSOR_CACHE; ++i)
+    for(int b = 0; b < 3; ++b)
+      free((*cs)->slots[i].buffers[b].data);
+
+  free(*cs);
+  *cs = NULL;
+}
+
+static inline void beginWrite(CursorState * cs)
+{
+  const unsigned int seq =
+    atomic_load_explicit(&cs->seq, memory_order_relaxed);
+  atomic_store_explicit(&cs->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static inline void endWrite(CursorState * cs)
+{
+  const unsigned int seq =
+    atomic_load_explicit(&cs->seq, memory_order_relaxed);
+  atomic_store_explicit(&cs->seq, seq + 1, memory_order_release);
+}
+
+bool cursorstate_set_shape(CursorState * cs, const LG_RendererCursor type,
+    const int width, const int height, const int stride, const uint8_t * data,
+    const unsigned int cacheID)
+{
+  if (cacheID >= KVMFR_CURSOR_CACHE)
+    return false;
+
+  if (data)
+  {
+    struct Slot        * slot = &cs->slots[cacheID];
+    struct ImageBuffer * buf  = &slot->buffers[slot->back];
+
+    // the buffers only grow so a cache of shapes costs nothing once warm
+    const size_t size = (size_t)height * stride;
+    if (size > buf->size)
+    {
+      free(buf->data);
+      buf->data = (uint8_t *)malloc(size);
+      if (!buf->data)
+      {
+        buf->size = 0;
+        DEBUG_ERROR("Failed to malloc buffer for cursor shape");
+        return false;
+      }
+      buf->size = size;
+    }
+
+    memcpy(buf->data, data, size);
+    buf->image = (CursorImage)
+    {
+      .type   = type,
+      .width  = width,
+      .height = height,
+      .stride = stride,
+      .data   = buf->data
+    };
+
+    // publish before the shape ID so the reader never sees the ID first
+    slot->back = atomic_exchange_explicit(&slot->mid, slot->back | SLOT_FRESH,
+        memory_order_acq_rel) & ~SLOT_FRESH;
+  }
+
+  beginWrite(cs);
+  atomic_store_explicit(&cs->width , width  , memory_order_relaxed);
+  atomic_store_explicit(&cs->height, height , memory_order_relaxed);
+  atomic_store_explicit(&cs->shape , cacheID, memory_order_relaxed);
+  endWrite(cs);
+  return true;
+}
+
+void cursorstate_set_pos(CursorState * cs, const bool visible, const int x,
+    const int y)
+{
+  beginWrite(cs);
+  atomic_store_explicit(&cs->visible, visible, memory_order_relaxed);
+  atomic_store_explicit(&cs->x      , x      , memory_order_relaxed);
+  atomic_store_explicit(&cs->y      , y      , memory_order_relaxed);
+  endWrite(cs);
+}
+
+void cursorstate_get(CursorState * cs, CursorInfo * info)
+{
+  unsigned int seq;
+  for(;;)
+  {
+    seq = atomic_load_explicit(&cs->seq, memory_order_acquire);
+    if (seq & 1)
+      continue;
+
+    info->visible = atomic_load_explicit(&cs->visible, memory_order_relaxed);
+    info->x       = atomic_load_explicit(&cs->x      , memory_order_relaxed);
+    info->y       = atomic_load_explicit(&cs->y      , memory_order_relaxed);
+    info->width   = atomic_load_explicit(&cs->width  , memory_order_relaxed);
+    info->height  = atomic_load_explicit(&cs->height , memory_order_relaxed);
+    info->shape   = atomic_load_explicit(&cs->shape  , memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&cs->seq, memory_order_relaxed) == seq)
+      break;
+  }
+
+  info->serial = seq >> 1;
+}
+
+const CursorImage * cursorstate_take_shape(CursorState * cs,
+    const unsigned int cacheID)
+{
+  if (cacheID >= KVMFR_CURSOR_CACHE)
+    return NULL;
+
+  struct Slot * slot = &cs->slots[cacheID];
+  if (!(atomic_load_explicit(&slot->mid, memory_order_relaxed) & SLOT_FRESH))
+    return NULL;
+
+  slot->front = atomic_exchange_explicit(&slot->mid, slot->front,
+      memory_order_acq_rel) & ~SLOT_FRESH;
+  return &slot->buffers[slot->front].image;
+}
@@ -0,0 +1,423 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "input.h"
+#include "spice/spice.h"
+#include "common/debug.h"
+#include "common/thread.h"
+#include "common/time.h"
+
+#include <math.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <linux/input.h>
+
+// a power of two, a few seconds of an 8000Hz mouse that is not coalesced
+#define INPUT_QUEUE_SIZE 4096
+
+typedef enum InputType
+{
+  INPUT_KEY_DOWN,
+  INPUT_KEY_UP,
+  INPUT_MOUSE_PRESS,
+  INPUT_MOUSE_RELEASE,
+  INPUT_MOUSE_MOTION
+}
+InputType;
+
+struct InputEvent
+{
+  InputType type;
+  int32_t   x, y; // the code or button goes in x
+};
+
+static struct
+{
+  LGThread         * thread;
+  atomic_bool        running;
+  atomic_bool        enabled;
+  int                wakeFd;
+  int                evdevFd;
+  atomic_bool        evdevActive;
+  bool               realtime;
+
+  // single producer, single consumer
+  atomic_uint        head, tail;
+  struct InputEvent  queue[INPUT_QUEUE_SIZE];
+
+  atomic_bool        capture;
+  atomic_int         sens;
+  float              sensX, sensY;
+  int32_t            relX , relY;
+
+  // the host's input ring, NULL if it does not inject input
+  volatile KVMFRInput * _Atomic shm;
+  uint32_t              hostSerial;
+  uint64_t              hostSeen;
+}
+in =
+{
+  .wakeFd  = -1,
+  .evdevFd = -1
+};
+
+// the ring is only used while the host is seen polling it
+static bool sendShm(const struct InputEvent * e)
+{
+  volatile KVMFRInput * shm = atomic_load(&in.shm);
+  if (!shm)
+    return false;
+
+  const uint64_t now    = microtime();
+  const uint32_t serial = shm->hostSerial;
+  if (serial != in.hostSerial)
+  {
+    in.hostSerial = serial;
+    in.hostSeen   = now;
+  }
+  else if (now - in.hostSeen > KVMFR_INPUT_TIMEOUT)
+    return false;
+
+  const uint32_t head = shm->head;
+  const uint32_t tail = shm->tail;
+  atomic_thread_fence(memory_order_acquire);
+  if (head - tail >= KVMFR_INPUT_LEN)
+    return false;
+
+  volatile KVMFRInputEvent * d = &shm->events[head % KVMFR_INPUT_LEN];
+  switch(e->type)
+  {
+    case INPUT_KEY_DOWN     : d->type = KVMFR_INPUT_KEY_DOWN     ; break;
+    case INPUT_KEY_UP       : d->type = KVMFR_INPUT_KEY_UP       ; break;
+    case INPUT_MOUSE_PRESS  : d->type = KVMFR_INPUT_MOUSE_PRESS  ; break;
+    case INPUT_MOUSE_RELEASE: d->type = KVMFR_INPUT_MOUSE_RELEASE; break;
+    case INPUT_MOUSE_MOTION : d->type = KVMFR_INPUT_MOUSE_MOTION ; break;
+    default:
+      return false;
+  }
+
+  d->code = e->type == INPUT_MOUSE_MOTION ? 0 : e->x;
+  d->x    = e->x;
+  d->y    = e->y;
+  atomic_thread_fence(memory_order_release);
+  shm->head = head + 1;
+  return true;
+}
+
+static void sendEvent(const struct InputEvent * e)
+{
+  if (sendShm(e))
+    return;
+
+  bool ok;
+  switch(e->type)
+  {
+    case INPUT_KEY_DOWN     : ok = spice_key_down     (e->x)      ; break;
+    case INPUT_KEY_UP       : ok = spice_key_up       (e->x)      ; break;
+    case INPUT_MOUSE_PRESS  : ok = spice_mouse_press  (e->x)      ; break;
+    case INPUT_MOUSE_RELEASE: ok = spice_mouse_release(e->x)      ; break;
+    case INPUT_MOUSE_MOTION : ok = spice_mouse_motion (e->x, e->y); break;
+    default:
+      return;
+  }
+
+  if (!ok)
+    DEBUG_ERROR("Failed to send the input event (type %d)", e->type);
+}
+
+static void drainQueue()
+{
+  unsigned int tail = atomic_load_explicit(&in.tail, memory_order_relaxed);
+  const unsigned int head =
+    atomic_load_explicit(&in.head, memory_order_acquire);
+
+  // the motion queued since the last wake is sent as one message
+  while(tail != head)
+  {
+    struct InputEvent e = in.queue[tail++ % INPUT_QUEUE_SIZE];
+    if (e.type == INPUT_MOUSE_MOTION)
+      for(; tail != head; ++tail)
+      {
+        const struct InputEvent * n = &in.queue[tail % INPUT_QUEUE_SIZE];
+        if (n->type != INPUT_MOUSE_MOTION)
+          break;
+        e.x += n->x;
+        e.y += n->y;
+      }
+
+    sendEvent(&e);
+  }
+
+  atomic_store_explicit(&in.tail, tail, memory_order_release);
+}
+
+static void readEvdev()
+{
+  struct input_event events[64];
+  for(;;)
+  {
+    const ssize_t len = read(in.evdevFd, events, sizeof(events));
+    if (len < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      if (errno != EAGAIN)
+      {
+        DEBUG_ERROR("Failed to read the evdev device, using the SDL motion: %s",
+            strerror(errno));
+        atomic_store(&in.evdevActive, false);
+        close(in.evdevFd);
+        in.evdevFd = -1;
+      }
+      return;
+    }
+
+    for(int i = 0; i < len / sizeof(*events); ++i)
+    {
+      const struct input_event * e = &events[i];
+      if (e->type == EV_REL)
+      {
+        if (e->code == REL_X)
+          in.relX += e->value;
+        else if (e->code == REL_Y)
+          in.relY += e->value;
+        continue;
+      }
+
+      if (e->type != EV_SYN || e->code != SYN_REPORT)
+        continue;
+
+      int32_t x = in.relX;
+      int32_t y = in.relY;
+      in.relX = 0;
+      in.relY = 0;
+
+      if (!atomic_load(&in.capture) || (x == 0 && y == 0))
+        continue;
+
+      // the same scaling the SDL motion gets in capture mode
+      const int sens = atomic_load(&in.sens);
+      if (sens != 0)
+      {
+        in.sensX += ((float)x / 10.0f) * (sens + 10);
+        in.sensY += ((float)y / 10.0f) * (sens + 10);
+        x = floor(in.sensX);
+        y = floor(in.sensY);
+        in.sensX -= x;
+        in.sensY -= y;
+      }
+
+      if (x || y)
+        sendEvent(&(struct InputEvent)
+        {
+          .type = INPUT_MOUSE_MOTION,
+          .x    = x,
+          .y    = y
+        });
+    }
+  }
+}
+
+static int inputThread(void * opaque)
+{
+  if (in.realtime)
+    lgThreadSetPriority(LG_THREAD_PRIORITY_PRESENT);
+
+  struct pollfd fds[2] =
+  {
+    { .fd = in.wakeFd , .events = POLLIN },
+    { .fd = in.evdevFd, .events = POLLIN }
+  };
+
+  while(atomic_load(&in.running))
+  {
+    fds[1].fd = in.evdevFd;
+    if (poll(fds, in.evdevFd >= 0 ? 2 : 1, -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      DEBUG_ERROR("poll failed: %s", strerror(errno));
+      break;
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+      uint64_t count;
+      if (read(in.wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        DEBUG_ERROR("Failed to read the wake eventfd: %s", strerror(errno));
+    }
+
+    drainQueue();
+
+    if (in.evdevFd >= 0 && (fds[1].revents & (POLLIN | POLLERR | POLLHUP)))
+      readEvdev();
+  }
+
+  // anything posted before the stop still goes out
+  drainQueue();
+  return 0;
+}
+
+bool input_start(bool realtime, const char * evdev)
+{
+  in.realtime = realtime;
+  in.wakeFd   = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (in.wakeFd < 0)
+  {
+    DEBUG_ERROR("Failed to create the input eventfd: %s", strerror(errno));
+    return false;
+  }
+
+  if (evdev)
+  {
+    in.evdevFd = open(evdev, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (in.evdevFd < 0)
+      DEBUG_WARN("Failed to open %s, using the SDL motion: %s", evdev,
+          strerror(errno));
+    else
+    {
+      DEBUG_INFO("Using %s for the mouse motion in capture mode", evdev);
+      atomic_store(&in.evdevActive, true);
+    }
+  }
+
+  atomic_store(&in.head, 0);
+  atomic_store(&in.tail, 0);
+  atomic_store(&in.running, true);
+  if (!lgCreateThread("inputThread", inputThread, NULL, &in.thread))
+  {
+    DEBUG_ERROR("Failed to create the input thread");
+    atomic_store(&in.running, false);
+    input_stop();
+    return false;
+  }
+
+  return true;
+}
+
+static void wake()
+{
+  const uint64_t one = 1;
+  if (write(in.wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    DEBUG_ERROR("Failed to wake the input thread: %s", strerror(errno));
+}
+
+void input_set_shm(volatile KVMFRInput * shm)
+{
+  atomic_store(&in.shm, shm);
+}
+
+void input_enable()
+{
+  atomic_store_explicit(&in.enabled, in.thread != NULL, memory_order_release);
+}
+
+void input_stop()
+{
+  atomic_store(&in.enabled, false);
+  if (in.thread)
+  {
+    atomic_store(&in.running, false);
+    wake();
+    lgJoinThread(in.thread, NULL);
+    in.thread = NULL;
+  }
+
+  atomic_store(&in.evdevActive, false);
+  if (in.evdevFd >= 0)
+  {
+    close(in.evdevFd);
+    in.evdevFd = -1;
+  }
+
+  if (in.wakeFd >= 0)
+  {
+    close(in.wakeFd);
+    in.wakeFd = -1;
+  }
+}
+
+static bool post(InputType type, int32_t x, int32_t y)
+{
+  if (!atomic_load_explicit(&in.enabled, memory_order_acquire))
+    return false;
+
+  const unsigned int head =
+    atomic_load_explicit(&in.head, memory_order_relaxed);
+  const unsigned int tail =
+    atomic_load_explicit(&in.tail, memory_order_acquire);
+
+  if (head - tail == INPUT_QUEUE_SIZE)
+  {
+    DEBUG_WARN("The input queue is full, the event was dropped");
+    return false;
+  }
+
+  struct InputEvent * e = &in.queue[head % INPUT_QUEUE_SIZE];
+  e->type = type;
+  e->x    = x;
+  e->y    = y;
+  atomic_store_explicit(&in.head, head + 1, memory_order_release);
+
+  wake();
+  return true;
+}
+
+bool input_key_down(uint32_t code)
+{
+  return post(INPUT_KEY_DOWN, code, 0);
+}
+
+bool input_key_up(uint32_t code)
+{
+  return post(INPUT_KEY_UP, code, 0);
+}
+
+bool input_mouse_press(uint32_t button)
+{
+  return post(INPUT_MOUSE_PRESS, button, 0);
+}
+
+bool input_mouse_release(uint32_t button)
+{
+  return post(INPUT_MOUSE_RELEASE, button, 0);
+}
+
+bool input_mouse_motion(int32_t x, int32_t y)
+{
+  return post(INPUT_MOUSE_MOTION, x, y);
+}
+
+void input_set_capture(bool capture, int sens)
+{
+  atomic_store(&in.sens   , sens   );
+  atomic_store(&in.capture, capture);
+}
+
+bool input_evdev_captured()
+{
+  return atomic_load(&in.evdevActive) && atomic_load(&in.capture);
+}
@@ -0,0 +1,64 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "common/KVMFR.h"
+
+/*
+ * Keyboard and mouse input is sent to SPICE by a thread of its own so slow
+ * work in the SDL event filter, such as the clipboard or a resize, does not
+ * hold it up. The main thread posts the events into a lock-free queue and the
+ * input thread sends them in the order they were posted.
+ *
+ * If an evdev device is given its relative motion is read by the input thread
+ * and sent in place of SDL's while the mouse is captured, which skips the
+ * window system altogether.
+ *
+ * When the host injects input itself the events are written to its ring in
+ * the shared memory instead, SPICE is used while the host is not polling it.
+ */
+
+// realtime raises the thread to real-time scheduling, evdev may be NULL
+bool input_start(bool realtime, const char * evdev);
+
+// sends what is still queued and stops the thread
+void input_stop();
+
+// called once SPICE is ready, until then every event is refused
+void input_enable();
+
+// the input ring of the host, NULL to only use SPICE
+void input_set_shm(volatile KVMFRInput * shm);
+
+// these may only be called from the main thread, false if the queue is full
+// or the thread is not running
+bool input_key_down     (uint32_t code);
+bool input_key_up       (uint32_t code);
+bool input_mouse_press  (uint32_t button);
+bool input_mouse_release(uint32_t button);
+bool input_mouse_motion (int32_t x, int32_t y);
+
+// the evdev motion is only sent while captured, scaled as mouseSens is
+void input_set_capture(bool capture, int sens);
+
+// true if the evdev device is sending the motion so SDL's must not be
+bool input_evdev_captured();
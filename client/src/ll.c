@@ -18,6 +18,7 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
 #include "ll.h"
+#include "pool.h"
 
 #include "common/locking.h"
 #include <stdlib.h>
@@ -34,6 +35,7 @@ struct ll
   struct ll_item * head;
   struct ll_item * tail;
   struct ll_item * pos;
+  struct ll_item * spare; // shifted items kept for the next push
   unsigned int count;
   LG_Lock lock;
 };
@@ -43,7 +45,8 @@ struct ll * ll_new()
   struct ll * list = malloc(sizeof(struct ll));
   list->head = NULL;
   list->tail = NULL;
-  list->pos  = NULL;
+  list->pos   = NULL;
+  list->spare = NULL;
   LG_LOCK_INIT(list->lock);
   return list;
 }
@@ -53,17 +56,32 @@ void ll_free(struct ll * list)
   // never free a list with items in it!
   assert(!list->head);
 
+  while(list->spare)
+  {
+    struct ll_item * item = list->spare;
+    list->spare = item->next;
+    free(item);
+  }
+
   LG_LOCK_FREE(list->lock);
   free(list);
 }
 
 void ll_push(struct ll * list, void * data)
 {
-  struct ll_item * item = malloc(sizeof(struct ll_item));
+  LG_LOCK(list->lock);
+  struct ll_item * item = list->spare;
+  if (item)
+    list->spare = item->next;
+  else
+  {
+    item = malloc(sizeof(struct ll_item));
+    pool_count_pool_alloc();
+  }
+
   item->data = data;
   item->next = NULL;
 
-  LG_LOCK(list->lock);
   if (!list->head)
   {
     list->head = item;
@@ -92,12 +110,14 @@ bool ll_shift(struct ll * list, void ** data)
   list->head = item->next;
 
   list->pos = NULL;
-  LG_UNLOCK(list->lock);
 
   if (data)
     *data = item->data;
 
-  free(item);
+  item->next  = list->spare;
+  list->spare = item;
+  LG_UNLOCK(list->lock);
+
   return true;
 }
 
@@ -0,0 +1,189 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "localcursor.h"
+#include "common/debug.h"
+#include "common/locking.h"
+#include "common/KVMFR.h"
+
+#include <string.h>
+
+struct Shape
+{
+  SDL_Surface * surface; // waiting to be made into the cursor
+  int           hx, hy;
+  SDL_Cursor  * cursor;
+};
+
+static struct
+{
+  LG_Lock      lock;
+  struct Shape shapes[KVMFR_CURSOR_CACHE];
+  int          current;
+  bool         update;
+  SDL_Cursor * active;
+}
+lc =
+{
+  .current = -1
+};
+
+bool localcursor_init()
+{
+  LG_LOCK_INIT(lc.lock);
+  return true;
+}
+
+void localcursor_free()
+{
+  for(int i = 0; i < KVMFR_CURSOR_CACHE; ++i)
+  {
+    struct Shape * shape = &lc.shapes[i];
+    if (shape->surface)
+      SDL_FreeSurface(shape->surface);
+    if (shape->cursor)
+      SDL_FreeCursor(shape->cursor);
+    shape->surface = NULL;
+    shape->cursor  = NULL;
+  }
+
+  lc.current = -1;
+  lc.active  = NULL;
+  LG_LOCK_FREE(lc.lock);
+}
+
+// the hardware cursor can't invert what is under it, inverted pixels are
+// drawn opaque instead so they stay visible
+static void convertShape(const LG_RendererCursor type, const int width,
+    const int height, const int pitch, const uint8_t * data, uint32_t * dst)
+{
+  switch(type)
+  {
+    case LG_CURSOR_COLOR:
+      for(int y = 0; y < height; ++y)
+        memcpy(dst + y * width, data + y * pitch, width * 4);
+      break;
+
+    case LG_CURSOR_MASKED_COLOR:
+      for(int y = 0; y < height; ++y)
+        for(int x = 0; x < width; ++x)
+        {
+          const uint32_t c = ((const uint32_t *)(data + y * pitch))[x];
+          // the alpha byte is the mask, set to xor with the screen
+          if (!(c & 0xFF000000))
+            dst[y * width + x] = c | 0xFF000000;
+          else
+            dst[y * width + x] = (c & 0x00FFFFFF) ? c | 0xFF000000 : 0;
+        }
+      break;
+
+    case LG_CURSOR_MONOCHROME:
+      for(int y = 0; y < height; ++y)
+        for(int x = 0; x < width; ++x)
+        {
+          const uint8_t * srcAnd = data + pitch * y + (x / 8);
+          const uint8_t * srcXor = srcAnd + pitch * height;
+          const uint8_t   mask   = 0x80 >> (x % 8);
+          const bool      and    = *srcAnd & mask;
+          const bool      xor    = *srcXor & mask;
+
+          if (and)
+            dst[y * width + x] = xor ? 0xFF000000 : 0x00000000;
+          else
+            dst[y * width + x] = xor ? 0xFFFFFFFF : 0xFF000000;
+        }
+      break;
+  }
+}
+
+void localcursor_set_shape(const LG_RendererCursor type, const int width,
+    const int height, const int pitch, const uint8_t * data, const int hx,
+    const int hy, const unsigned int cacheID)
+{
+  if (cacheID >= KVMFR_CURSOR_CACHE)
+    return;
+
+  SDL_Surface * surface = NULL;
+  if (data)
+  {
+    // the and and xor masks of a monochrome cursor are stacked
+    const int h = type == LG_CURSOR_MONOCHROME ? height / 2 : height;
+    surface = SDL_CreateRGBSurfaceWithFormat(0, width, h, 32,
+        SDL_PIXELFORMAT_ARGB8888);
+    if (!surface)
+    {
+      DEBUG_ERROR("Failed to create the local cursor surface: %s",
+          SDL_GetError());
+      return;
+    }
+
+    // the surface pitch is always width * 4 for 32bpp
+    convertShape(type, width, h, pitch, data, (uint32_t *)surface->pixels);
+  }
+
+  LG_LOCK(lc.lock);
+  if (surface)
+  {
+    struct Shape * shape = &lc.shapes[cacheID];
+    if (shape->surface)
+      SDL_FreeSurface(shape->surface);
+    shape->surface = surface;
+    shape->hx      = hx;
+    shape->hy      = hy;
+  }
+  lc.current = cacheID;
+  lc.update  = true;
+  LG_UNLOCK(lc.lock);
+}
+
+SDL_Cursor * localcursor_get()
+{
+  if (!lc.update)
+    return lc.active;
+
+  LG_LOCK(lc.lock);
+  lc.update = false;
+  for(int i = 0; i < KVMFR_CURSOR_CACHE; ++i)
+  {
+    struct Shape * shape = &lc.shapes[i];
+    if (!shape->surface)
+      continue;
+
+    SDL_Cursor * cursor = SDL_CreateColorCursor(shape->surface, shape->hx,
+        shape->hy);
+    SDL_FreeSurface(shape->surface);
+    shape->surface = NULL;
+
+    if (!cursor)
+    {
+      DEBUG_ERROR("Failed to create the local cursor: %s", SDL_GetError());
+      continue;
+    }
+
+    // SDL falls back to the default cursor if the current one is freed
+    if (shape->cursor)
+      SDL_FreeCursor(shape->cursor);
+    shape->cursor = cursor;
+  }
+
+  lc.active = lc.current >= 0 ? lc.shapes[lc.current].cursor : NULL;
+  LG_UNLOCK(lc.lock);
+
+  return lc.active;
+}
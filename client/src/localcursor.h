@@ -0,0 +1,44 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <SDL2/SDL.h>
+
+#include "interface/renderer.h"
+
+/*
+ * Shows the guest cursor shape with the local hardware cursor. Shapes arrive
+ * on the cursor thread but SDL cursors must be made on the main thread, so
+ * they are converted and held here until localcursor_get is called.
+ */
+
+bool localcursor_init();
+void localcursor_free();
+
+// store a new shape for cacheID and make it current, a NULL data selects the
+// shape already held for cacheID
+void localcursor_set_shape(const LG_RendererCursor type, const int width,
+    const int height, const int pitch, const uint8_t * data, const int hx,
+    const int hy, const unsigned int cacheID);
+
+// main thread only, returns the SDL cursor for the current shape or NULL
+SDL_Cursor * localcursor_get();
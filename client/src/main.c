@@ -19,6 +19,10 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "main.h"
 #include "config.h"
+#include "localcursor.h"
+#include "input.h"
+#include "mosaic.h"
+#include "audio.h"
 
 #include <getopt.h>
 #include <signal.h>
@@ -32,6 +36,7 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <errno.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <stdatomic.h>
@@ -49,26 +54,41 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "common/locking.h"
 #include "common/event.h"
 #include "common/ivshmem.h"
+#include "common/sysinfo.h"
+#include "common/framebuffer.h"
 #include "common/time.h"
+#include "common/trace.h"
+#include "common/histogram.h"
 #include "common/version.h"
 
 #include "utils.h"
 #include "kb.h"
 #include "ll.h"
+#include "pool.h"
 
 #define RESIZE_TIMEOUT (10 * 1000) // 10ms
+#define REQUEST_TIMEOUT (250 * 1000) // 250ms
+#define PING_INTERVAL   (100 * 1000) // 100ms
+#define CLOCK_WINDOW    16           // pings to keep the best clock sample for
+#define PROBE_TIMEOUT   (1000 * 1000) // 1s
+#define PROBE_REPORT    (10 * 1000 * 1000) // 10s
 
 // forwards
 static int cursorThread(void * unused);
+static int clipboardThread(void * unused);
+void clipboardRequest(const LG_ClipboardReplyFn replyFn, void * opaque);
 static int renderThread(void * unused);
 static int frameThread (void * unused);
 
 static LGEvent  *e_startup = NULL;
 static LGEvent  *e_frame   = NULL;
+static LGEvent  *e_release = NULL;
 static LGThread *t_spice   = NULL;
+static LGThread *t_prefault = NULL;
 static LGThread *t_render  = NULL;
 static LGThread *t_cursor  = NULL;
 static LGThread *t_frame   = NULL;
+static LGThread *t_clipboard = NULL;
 static SDL_Cursor *cursor  = NULL;
 
 struct AppState state;
@@ -76,7 +96,10 @@ struct AppState state;
 // this structure is initialized in config.c
 struct AppParams params = { 0 };
 
-static void handleMouseMoveEvent(int ex, int ey);
+static bool handleMouseMoveEvent(int ex, int ey);
+static void flushMouseMotion();
+static bool queueMouseMotion(int x, int y);
+static void pumpMouseMotion();
 
 static void lgInit()
 {
@@ -95,48 +118,52 @@ static void updatePositionInfo()
 {
   if (state.haveSrcSize)
   {
+    // the desktop is the first cell of the mosaic, the tiles fill the rest
+    const LG_RendererRect cell = LG_RendererMosaicCell(state.mosaicTiles + 1, 0,
+        state.windowW, state.windowH);
+
     if (params.keepAspect)
     {
       const float srcAspect = (float)state.srcSize.y / (float)state.srcSize.x;
-      const float wndAspect = (float)state.windowH / (float)state.windowW;
+      const float wndAspect = (float)cell.h / (float)cell.w;
       bool force = true;
 
       if (params.dontUpscale &&
-          state.srcSize.x <= state.windowW &&
-          state.srcSize.y <= state.windowH)
+          state.srcSize.x <= cell.w &&
+          state.srcSize.y <= cell.h)
       {
         force = false;
         state.dstRect.w = state.srcSize.x;
         state.dstRect.h = state.srcSize.y;
-        state.dstRect.x = state.windowW / 2 - state.srcSize.x / 2;
-        state.dstRect.y = state.windowH / 2 - state.srcSize.y / 2;
+        state.dstRect.x = cell.w / 2 - state.srcSize.x / 2;
+        state.dstRect.y = cell.h / 2 - state.srcSize.y / 2;
       }
       else
       if ((int)(wndAspect * 1000) == (int)(srcAspect * 1000))
       {
         force           = false;
-        state.dstRect.w = state.windowW;
-        state.dstRect.h = state.windowH;
+        state.dstRect.w = cell.w;
+        state.dstRect.h = cell.h;
         state.dstRect.x = 0;
         state.dstRect.y = 0;
       }
       else
       if (wndAspect < srcAspect)
       {
-        state.dstRect.w = (float)state.windowH / srcAspect;
-        state.dstRect.h = state.windowH;
-        state.dstRect.x = (state.windowW >> 1) - (state.dstRect.w >> 1);
+        state.dstRect.w = (float)cell.h / srcAspect;
+        state.dstRect.h = cell.h;
+        state.dstRect.x = (cell.w >> 1) - (state.dstRect.w >> 1);
         state.dstRect.y = 0;
       }
       else
       {
-        state.dstRect.w = state.windowW;
-        state.dstRect.h = (float)state.windowW * srcAspect;
+        state.dstRect.w = cell.w;
+        state.dstRect.h = (float)cell.w * srcAspect;
         state.dstRect.x = 0;
-        state.dstRect.y = (state.windowH >> 1) - (state.dstRect.h >> 1);
+        state.dstRect.y = (cell.h >> 1) - (state.dstRect.h >> 1);
       }
 
-      if (force && params.forceAspect)
+      if (force && params.forceAspect && !state.mosaicTiles)
       {
         state.resizeTimeout = microtime() + RESIZE_TIMEOUT;
         state.resizeDone    = false;
@@ -146,9 +173,11 @@ static void updatePositionInfo()
     {
       state.dstRect.x = 0;
       state.dstRect.y = 0;
-      state.dstRect.w = state.windowW;
-      state.dstRect.h = state.windowH;
+      state.dstRect.w = cell.w;
+      state.dstRect.h = cell.h;
     }
+    state.dstRect.x    += cell.x;
+    state.dstRect.y    += cell.y;
     state.dstRect.valid = true;
 
     state.scale = (
@@ -157,13 +186,319 @@ static void updatePositionInfo()
 
     state.scaleX = (float)state.srcSize.y / (float)state.dstRect.h;
     state.scaleY = (float)state.srcSize.x / (float)state.dstRect.w;
+
+    // wait for the size to settle as the host must restart capture to apply it
+    if (params.hostScale)
+    {
+      state.requestTime    = microtime() + REQUEST_TIMEOUT;
+      state.requestPending = true;
+    }
   }
 
   state.lgrResize = true;
 }
 
+// the refresh rate of the display the window is on, zero if unknown
+static unsigned int getRefreshRate()
+{
+  SDL_DisplayMode mode;
+  const int display = SDL_GetWindowDisplayIndex(state.window);
+  if (display < 0 || SDL_GetCurrentDisplayMode(display, &mode) != 0 ||
+      mode.refresh_rate <= 0)
+    return 0;
+
+  return mode.refresh_rate;
+}
+
+static unsigned int getMaxFPS()
+{
+  if (params.maxFPS >= 0)
+    return params.maxFPS;
+
+  // auto detect, there is no use in the host sending more than we can show
+  return getRefreshRate();
+}
+
+static void sendRequest()
+{
+  if (!state.request)
+    return;
+
+  state.request->targetWidth  = params.hostScale ?
+    state.dstRect.w * params.hostScalePct / 100 : 0;
+  state.request->targetHeight = params.hostScale ?
+    state.dstRect.h * params.hostScalePct / 100 : 0;
+  state.request->maxFPS       = getMaxFPS();
+
+  FrameType preferred = FRAME_TYPE_INVALID;
+  state.request->frameTypes    = state.lgr && state.lgr->frame_types ?
+    state.lgr->frame_types(state.lgrData, &preferred) : 0;
+  state.request->preferredType = preferred;
+
+  state.request->cropX      = params.hostCrop.x;
+  state.request->cropY      = params.hostCrop.y;
+  state.request->cropWidth  = params.hostCrop.w;
+  state.request->cropHeight = params.hostCrop.h;
+  atomic_thread_fence(memory_order_release);
+  ++state.request->serial;
+}
+
+static void sendPing()
+{
+  if (!state.request)
+    return;
+
+  state.pingTime          = microtime();
+  state.request->pingTime = state.pingTime;
+  atomic_thread_fence(memory_order_release);
+  ++state.request->pingSerial;
+}
+
+/* the host tags the first frame it captures after it sees the probe, the time
+ * until that frame is presented covers every stage of the frame path */
+static void sendProbe()
+{
+  if (!state.request)
+    return;
+
+  const uint64_t now = microtime();
+  if (atomic_load(&state.probeSerial))
+  {
+    // no frame is captured while the guest does not update the screen
+    if (now < atomic_load(&state.probeSent) + PROBE_TIMEOUT)
+      return;
+
+    atomic_store(&state.probeSerial, 0);
+    atomic_fetch_add(&state.probeUnanswered, 1);
+  }
+
+  if (now < state.probeNext)
+    return;
+  state.probeNext = now + params.latencyProbe * 1000ULL;
+
+  // zero means no probe is outstanding
+  uint32_t serial = state.request->probeSerial + 1;
+  if (!serial)
+    ++serial;
+
+  atomic_store(&state.probeSent  , now   );
+  atomic_store(&state.probeSerial, serial);
+  atomic_thread_fence(memory_order_release);
+  state.request->probeSerial = serial;
+}
+
+static void recordProbe(const uint64_t probeSent, const uint64_t presentTime)
+{
+  if (presentTime > probeSent)
+    histogram_add(&state.probeHist, presentTime - probeSent);
+}
+
+static void reportProbe()
+{
+  const uint64_t now = microtime();
+  if (now < state.probeReport)
+    return;
+  state.probeReport = now + PROBE_REPORT;
+
+  const unsigned int unanswered = atomic_exchange(&state.probeUnanswered, 0);
+  if (!state.probeHist.count && !unanswered)
+    return;
+
+  const Histogram * h = &state.probeHist;
+  DEBUG_INFO("Latency probe: %" PRIu64 " samples, %u unanswered, "
+      "p50 %.2fms p90 %.2fms p99 %.2fms max %.2fms",
+      h->count, unanswered,
+      histogram_percentile(h, 50.0) / 1000.0,
+      histogram_percentile(h, 90.0) / 1000.0,
+      histogram_percentile(h, 99.0) / 1000.0,
+      h->max / 1000.0);
+  histogram_reset(&state.probeHist);
+}
+
+static float latencyAvg(const uint64_t total, const unsigned int count)
+{
+  if (!count)
+    return -1.0f;
+  return (float)total / count / 1000.0f;
+}
+
+static LG_RendererTiming latencyTiming(const Histogram * hist)
+{
+  if (!hist->count)
+    return (LG_RendererTiming){ -1.0f, -1.0f, -1.0f };
+
+  return (LG_RendererTiming)
+  {
+    .p50 = histogram_percentile(hist, 50.0) / 1000.0f,
+    .p99 = histogram_percentile(hist, 99.0) / 1000.0f,
+    .max = hist->max / 1000.0f
+  };
+}
+
+/* wait for a new frame and then until just before the vblank it can still
+ * make, frames that arrive in the meantime replace it so the newest is shown */
+static void jitWait(struct timespec * time)
+{
+  lgWaitEventAbs(e_frame, time);
+  clock_gettime(CLOCK_MONOTONIC, time);
+  tsAdd(time, state.frameTime);
+
+  // variable refresh displays update when presented to, so present now
+  state.jitTarget = 0;
+  if (params.vrr || !state.jitLastPresent)
+    return;
+
+  const uint64_t now    = microtime();
+  const uint64_t period = state.jitPeriod;
+  uint64_t vblank = state.jitLastPresent + period;
+  if (vblank < now + state.jitBudget)
+    vblank += ((now + state.jitBudget - vblank) / period + 1) * period;
+
+  state.jitTarget = vblank;
+  nsleep((vblank - state.jitBudget - now) * 1000ULL);
+
+  // anything that arrived while sleeping is about to be rendered
+  lgResetEvent(e_frame);
+}
+
+/* with vsync the render returns at the vblank, use it to track the refresh
+ * and grow the budget whenever the targeted vblank was missed */
+static void jitPresented(const uint64_t presentTime, const uint64_t target)
+{
+  if (state.jitLastPresent)
+  {
+    const uint64_t interval = presentTime - state.jitLastPresent;
+    if (interval > state.jitPeriod / 2 && interval < state.jitPeriod * 3 / 2)
+      state.jitPeriod = (state.jitPeriod * 15 + interval) / 16;
+  }
+  state.jitLastPresent = presentTime;
+
+  if (!target)
+    return;
+
+  if (presentTime > target + state.jitPeriod / 2)
+  {
+    state.jitBudget += 500;
+    if (state.jitBudget > state.jitPeriod / 2)
+      state.jitBudget = state.jitPeriod / 2;
+    state.jitHits = 0;
+  }
+  else if (++state.jitHits >= 120)
+  {
+    // creep back towards the margin while the vblanks are being made
+    if (state.jitBudget >= (uint64_t)params.jitMargin + 100)
+      state.jitBudget -= 100;
+    state.jitHits = 0;
+  }
+}
+
+static void accountPresent(const uint64_t uploadTime,
+    const uint64_t captureTime, const uint64_t presentTime)
+{
+  LG_LOCK(state.latencyLock);
+  if (presentTime > uploadTime)
+    state.latency.present += presentTime - uploadTime;
+  ++state.latency.presentCount;
+  if (captureTime && presentTime > captureTime)
+    histogram_add(&state.latency.ageHist, presentTime - captureTime);
+  if (state.lastPresentTime && presentTime > state.lastPresentTime)
+    histogram_add(&state.latency.intervalHist,
+        presentTime - state.lastPresentTime);
+  LG_UNLOCK(state.latencyLock);
+
+  state.lastPresentTime = presentTime;
+}
+
+static void queuePresent(const uint64_t uploadTime, const uint64_t captureTime,
+    const uint64_t probeSent)
+{
+  // the oldest is dropped if the renderer has stopped giving feedback
+  if (state.presentCount == PRESENT_QUEUE_LEN)
+  {
+    state.presentHead = (state.presentHead + 1) % PRESENT_QUEUE_LEN;
+    --state.presentCount;
+  }
+
+  const unsigned int i =
+    (state.presentHead + state.presentCount++) % PRESENT_QUEUE_LEN;
+  state.presentQueue[i] = (struct PendingPresent)
+  {
+    .render      = state.renderSeq,
+    .uploadTime  = uploadTime,
+    .captureTime = captureTime,
+    .jitTarget   = state.jitTarget,
+    .probeSent   = probeSent
+  };
+}
+
+/* the feedback arrives a frame or more after the render, it replaces the time
+ * the render returned for the pacing and the latency of the present stage */
+static void drainPresented()
+{
+  uint64_t render, presentTime, refresh;
+  while(state.lgr->get_presented(state.lgrData, &render, &presentTime, &refresh))
+  {
+    while(state.presentCount)
+    {
+      const struct PendingPresent p = state.presentQueue[state.presentHead];
+      if (p.render > render)
+        break;
+
+      state.presentHead = (state.presentHead + 1) % PRESENT_QUEUE_LEN;
+      --state.presentCount;
+
+      // renders that were replaced before they reached the screen
+      if (p.render != render || !presentTime)
+      {
+        if (p.probeSent)
+          atomic_fetch_add(&state.probeUnanswered, 1);
+        continue;
+      }
+
+      if (p.probeSent)
+        recordProbe(p.probeSent, presentTime);
+
+      if (params.jitRender)
+      {
+        jitPresented(presentTime, p.jitTarget);
+        if (refresh)
+          state.jitPeriod = refresh;
+      }
+
+      if (p.uploadTime)
+        accountPresent(p.uploadTime, p.captureTime, presentTime);
+      else if (params.showFPS)
+        ++state.repeatCount;
+    }
+  }
+}
+
+/* every frame is copied out of the shared memory, keep the threads that do it
+ * on the same node or the copy runs at the speed of the interconnect */
+static void placeOnNode(uint64_t * affinity, const char * thread)
+{
+  const uint64_t cpus = sysinfo_getNodeCPUs(ivshmemGetNode(&state.shm));
+  if (!cpus)
+    return;
+
+  if (!*affinity)
+  {
+    if (params.numaPin)
+      *affinity = cpus;
+    return;
+  }
+
+  if (!(*affinity & cpus))
+    DEBUG_WARN("The %s thread affinity has no CPUs on the NUMA node of the "
+        "shared memory (0x%" PRIx64 ")", thread, cpus);
+}
+
 static int renderThread(void * unused)
 {
+  if (params.realtime)
+    lgThreadSetPriority(LG_THREAD_PRIORITY_PRESENT);
+  lgThreadSetAffinity(NULL, params.renderAffinity);
+
   if (!state.lgr->render_startup(state.lgrData, state.window))
   {
     state.state = APP_STATE_SHUTDOWN;
@@ -176,12 +511,26 @@ static int renderThread(void * unused)
   /* signal to other threads that the renderer is ready */
   lgSignalEvent(e_startup);
 
+  if (!mosaic_start(state.lgr, state.lgrData, e_frame))
+    DEBUG_WARN("Only the primary VM will be shown");
+
+  state.presentFeedback =
+    state.lgr->get_presented && state.lgr->supports &&
+    state.lgr->supports(state.lgrData, LG_SUPPORTS_PRESENT_FEEDBACK);
+  if (state.presentFeedback)
+    DEBUG_INFO("Using present feedback from the renderer");
+
   struct timespec time;
   clock_gettime(CLOCK_MONOTONIC, &time);
 
+  struct PoolSteady steady;
+  pool_steady_reset(&steady);
+
   while(state.state != APP_STATE_SHUTDOWN)
   {
-    if (params.fpsMin != 0)
+    if (params.jitRender)
+      jitWait(&time);
+    else if (params.fpsMin != 0)
     {
       lgWaitEventAbs(e_frame, &time);
       clock_gettime(CLOCK_MONOTONIC, &time);
@@ -193,13 +542,91 @@ static int renderThread(void * unused)
       if (state.lgr)
         state.lgr->on_resize(state.lgrData, state.windowW, state.windowH, state.dstRect);
       state.lgrResize = false;
+      pool_steady_reset(&steady);
+    }
+
+    if (!state.resizeDone && state.resizeTimeout < microtime())
+    {
+      SDL_SetWindowSize(
+        state.window,
+        state.dstRect.w,
+        state.dstRect.h
+      );
+      state.resizeDone = true;
+    }
+
+    if (state.lgr->needs_render && !state.lgr->needs_render(state.lgrData))
+    {
+      // nothing has changed, wait for something to instead of spinning
+      if (params.fpsMin == 0 && !params.jitRender)
+        lgWaitEvent(e_frame, 1);
+      continue;
     }
 
-    if (!state.lgr->render(state.lgrData, state.window))
+    const LGTraceScope renderTrace = lgTraceBegin("render");
+    const uint64_t drawStart = params.showFPS ? microtime() : 0;
+    const bool rendered = state.lgr->render(state.lgrData, state.window);
+    lgTraceEnd(renderTrace);
+    if (!rendered)
       break;
 
+    pool_steady_frame(&steady);
+
+    if (params.showFPS)
+    {
+      const uint64_t drawTime = microtime() - drawStart;
+      LG_LOCK(state.latencyLock);
+      histogram_add(&state.latency.drawHist, drawTime);
+      LG_UNLOCK(state.latencyLock);
+    }
+
+    if (params.jitRender && !state.presentFeedback)
+      jitPresented(microtime(), state.jitTarget);
+
+    // zero if no new frame was uploaded since the last present
+    uint64_t uploadTime = 0;
+    if (params.showFPS || state.stats)
+    {
+      uploadTime = atomic_exchange_explicit(&state.uploadTime, 0,
+          memory_order_acquire);
+      if (state.stats)
+      {
+        if (uploadTime)
+          ++state.stats->framesPresented;
+        else
+          ++state.stats->framesRepeated;
+      }
+    }
+
+    const uint64_t captureTime = uploadTime ?
+      atomic_load_explicit(&state.captureTime, memory_order_relaxed) : 0;
+
+    const uint64_t probeSent = params.latencyProbe ?
+      atomic_exchange(&state.probeUpload, 0) : 0;
+
+    if (state.presentFeedback)
+    {
+      ++state.renderSeq;
+      queuePresent(params.showFPS ? uploadTime : 0, captureTime, probeSent);
+      drainPresented();
+    }
+    else if (probeSent)
+      recordProbe(probeSent, microtime());
+
+    if (params.latencyProbe)
+      reportProbe();
+
     if (params.showFPS)
     {
+      // with feedback these are counted once the render is shown
+      if (!state.presentFeedback)
+      {
+        if (uploadTime)
+          accountPresent(uploadTime, captureTime, microtime());
+        else
+          ++state.repeatCount;
+      }
+
       const uint64_t t    = nanotime();
       state.renderTime   += t - state.lastFrameTime;
       state.lastFrameTime = t;
@@ -215,22 +642,39 @@ static int renderThread(void * unused)
           state.renderCount) /
           1e6f);
 
-        state.lgr->update_fps(state.lgrData, avgUPS, avgFPS);
+        struct LatencyStats l;
+        LG_LOCK(state.latencyLock);
+        l = state.latency;
+        memset(&state.latency, 0, sizeof(state.latency));
+        LG_UNLOCK(state.latencyLock);
+
+        const LG_RendererLatency latency =
+        {
+          .capture    = latencyAvg(l.capture , l.captureCount ),
+          .post       = latencyAvg(l.post    , l.count        ),
+          .transfer   = latencyAvg(l.transfer, l.transferCount),
+          .upload     = latencyAvg(l.upload  , l.count        ),
+          .present    = latencyAvg(l.present , l.presentCount ),
+          .uploadTime = latencyTiming(&l.uploadHist  ),
+          .frameAge   = latencyTiming(&l.ageHist     ),
+          .interval   = latencyTiming(&l.intervalHist),
+          .draw       = latencyTiming(&l.drawHist    ),
+          .dropped    = l.dropped,
+          .skipped    = l.skipped,
+          .repeated   = state.repeatCount
+        };
+        state.repeatCount = 0;
+
+        state.lgr->update_fps(state.lgrData, avgUPS, avgFPS, &latency);
+
+        char str[512];
+        LG_RendererFormatFPS(str, sizeof(str), avgUPS, avgFPS, &latency);
+        DEBUG_INFO("%s", str);
 
         state.renderTime  = 0;
         state.renderCount = 0;
       }
     }
-
-    if (!state.resizeDone && state.resizeTimeout < microtime())
-    {
-      SDL_SetWindowSize(
-        state.window,
-        state.dstRect.w,
-        state.dstRect.h
-      );
-      state.resizeDone = true;
-    }
   }
 
   state.state = APP_STATE_SHUTDOWN;
@@ -241,19 +685,129 @@ static int renderThread(void * unused)
   if (t_frame)
     lgJoinThread(t_frame, NULL);
 
+  mosaic_stop();
   state.lgr->deinitialize(state.lgrData);
   state.lgr = NULL;
   return 0;
 }
 
+// whether the renderer should draw the cursor itself
+static bool guestCursorVisible()
+{
+  return state.cursorVisible && state.drawCursor && !state.localCursor;
+}
+
+// copy the host's cursor position, false if it is unchanged from lastSerial
+// or the host kept writing it
+static bool loadCursorPos(uint32_t lastSerial, uint32_t * serial,
+    int * x, int * y, bool * visible)
+{
+  volatile KVMFRCursorPos * pos = state.cursorPos;
+  if (!pos)
+    return false;
+
+  for(int tries = 0; tries < 1000; ++tries)
+  {
+    *serial = pos->serial;
+    if (*serial == lastSerial)
+      return false;
+
+    // the host is part way through writing it
+    if (*serial & 1)
+      continue;
+
+    atomic_thread_fence(memory_order_acquire);
+    *x       = pos->x;
+    *y       = pos->y;
+    *visible = pos->visible;
+    atomic_thread_fence(memory_order_acquire);
+
+    if (pos->serial == *serial)
+      return true;
+  }
+
+  return false;
+}
+
+// read the latest cursor position from the host, returns true if it changed
+static bool readCursorPos(uint32_t * lastSerial)
+{
+  uint32_t serial;
+  int      x, y;
+  bool     visible;
+  if (!loadCursorPos(*lastSerial, &serial, &x, &y, &visible))
+    return false;
+
+  *lastSerial         = serial;
+  state.cursor.x      = x;
+  state.cursor.y      = y;
+  state.cursorVisible = visible;
+  state.haveCursorPos = true;
+  return true;
+}
+
+// called by the renderer just before it draws the cursor so it is drawn where
+// the host last put it instead of where it was when the cursor thread ran
+static bool latchCursorPos(bool * visible, int * x, int * y)
+{
+  if (!state.haveCursorPos)
+    return false;
+
+  uint32_t serial;
+  if (!loadCursorPos(0, &serial, x, y, visible))
+    return false;
+
+  *visible = *visible && state.drawCursor && !state.localCursor;
+  return true;
+}
+
+// the frame the renderer is holding after on_frame_acquire, zero if none
+static atomic_uint heldFrame = 0;
+
+static void releaseFrame(LG_RendererFrameHandle handle)
+{
+  if (atomic_compare_exchange_strong(&heldFrame, &handle, 0))
+    lgSignalEvent(e_release);
+}
+
+// the LGMP message can only be done with once the renderer has released the
+// frame, as the host may then write over it
+static void waitFrameRelease(LG_RendererFrameHandle handle)
+{
+  static bool warned = false;
+  const uint64_t timeout = microtime() + LG_FRAME_HOLD_TIMEOUT * 1000ULL;
+
+  while(atomic_load(&heldFrame) == handle)
+  {
+    if (state.state != APP_STATE_RUNNING || microtime() >= timeout)
+    {
+      LG_RendererFrameHandle expected = handle;
+      if (atomic_compare_exchange_strong(&heldFrame, &expected, 0) &&
+          state.state == APP_STATE_RUNNING && !warned)
+      {
+        DEBUG_WARN("The renderer held a frame for over %d ms, releasing it",
+            LG_FRAME_HOLD_TIMEOUT);
+        warned = true;
+      }
+      break;
+    }
+
+    lgWaitEvent(e_release, 10);
+  }
+}
+
 static int cursorThread(void * unused)
 {
   LGMP_STATUS         status;
   PLGMPClientQueue    queue;
   LG_RendererCursor   cursorType     = LG_CURSOR_COLOR;
+  uint32_t            posSerial      = 0;
 
   lgWaitEvent(e_startup, TIMEOUT_INFINITE);
 
+  const bool useIRQ = state.hostRings &&
+    ivshmemHasIRQ(&state.shm, KVMFR_IRQ_POINTER);
+
   // subscribe to the pointer queue
   while(state.state == APP_STATE_RUNNING)
   {
@@ -274,6 +828,9 @@ static int cursorThread(void * unused)
 
   while(state.state == APP_STATE_RUNNING)
   {
+    if (readCursorPos(&posSerial))
+      state.updateCursor = true;
+
     LGMPMessage msg;
     if ((status = lgmpClientProcess(queue, &msg)) != LGMP_OK)
     {
@@ -285,7 +842,7 @@ static int cursorThread(void * unused)
           state.lgr->on_mouse_event
           (
             state.lgrData,
-            state.cursorVisible && state.drawCursor,
+            guestCursorVisible(),
             state.cursor.x,
             state.cursor.y
           );
@@ -293,7 +850,11 @@ static int cursorThread(void * unused)
           lgSignalEvent(e_frame);
         }
 
-        usleep(params.cursorPollInterval);
+        if (useIRQ)
+          ivshmemWaitIRQ(&state.shm, KVMFR_IRQ_POINTER,
+              (params.cursorPollInterval + 999) / 1000);
+        else
+          usleep(params.cursorPollInterval);
         continue;
       }
 
@@ -308,10 +869,6 @@ static int cursorThread(void * unused)
     }
 
     KVMFRCursor * cursor = (KVMFRCursor *)msg.mem;
-
-    state.cursorVisible =
-      msg.udata & CURSOR_FLAG_VISIBLE;
-
     if (msg.udata & CURSOR_FLAG_SHAPE)
     {
       switch(cursor->type)
@@ -328,27 +885,35 @@ static int cursorThread(void * unused)
       state.cursor.hx = cursor->hx;
       state.cursor.hy = cursor->hy;
 
-      const uint8_t * data = (const uint8_t *)(cursor + 1);
+      if (cursor->cacheID >= KVMFR_CURSOR_CACHE)
+      {
+        DEBUG_ERROR("Invalid cursor cache ID");
+        lgmpClientMessageDone(queue);
+        continue;
+      }
+
+      // the renderer already has the shape if it is cached
+      const uint8_t * data = (msg.udata & CURSOR_FLAG_CACHED) ?
+        NULL : (const uint8_t *)(cursor + 1);
+
       if (!state.lgr->on_mouse_shape(
         state.lgrData,
         cursorType,
         cursor->width,
         cursor->height,
         cursor->pitch,
-        data)
+        data,
+        cursor->cacheID)
       )
       {
         DEBUG_ERROR("Failed to update mouse shape");
         lgmpClientMessageDone(queue);
         continue;
       }
-    }
 
-    if (msg.udata & CURSOR_FLAG_POSITION)
-    {
-      state.cursor.x      = cursor->x;
-      state.cursor.y      = cursor->y;
-      state.haveCursorPos = true;
+      if (params.localCursor)
+        localcursor_set_shape(cursorType, cursor->width, cursor->height,
+            cursor->pitch, data, cursor->hx, cursor->hy, cursor->cacheID);
     }
 
     lgmpClientMessageDone(queue);
@@ -357,7 +922,7 @@ static int cursorThread(void * unused)
     state.lgr->on_mouse_event
     (
       state.lgrData,
-      state.cursorVisible && state.drawCursor,
+      guestCursorVisible(),
       state.cursor.x,
       state.cursor.y
     );
@@ -370,6 +935,73 @@ static int cursorThread(void * unused)
   return 0;
 }
 
+struct ClockSync
+{
+  uint32_t     serial;
+  bool         valid;
+  int64_t      offset; // the host microtime minus ours
+  int64_t      rtt;
+  unsigned int age;
+};
+
+static void updateClock(struct ClockSync * clock, const KVMFRFrame * frame,
+    const uint64_t recvTime)
+{
+  if (!frame->pingSerial || frame->pingSerial == clock->serial)
+    return;
+  clock->serial = frame->pingSerial;
+
+  const int64_t t0  = frame->pingClientTime;
+  const int64_t t1  = frame->pingHostTime;
+  const int64_t t2  = frame->postTime;
+  const int64_t t3  = recvTime;
+  const int64_t rtt = (t3 - t0) - (t2 - t1);
+  if (rtt < 0)
+    return;
+
+  // the host only sees the ping when it posts a frame which makes the delay
+  // asymmetric, the sample with the shortest round trip is the most accurate
+  if (clock->valid && rtt > clock->rtt && ++clock->age < CLOCK_WINDOW)
+    return;
+
+  clock->offset = ((t1 - t0) + (t2 - t3)) / 2;
+  clock->rtt    = rtt;
+  clock->age    = 0;
+  clock->valid  = true;
+}
+
+static void recordLatency(const KVMFRFrame * frame,
+    const struct ClockSync * clock, const uint64_t recvTime,
+    const uint64_t uploadTime)
+{
+  struct LatencyStats * l = &state.latency;
+  LG_LOCK(state.latencyLock);
+
+  if (frame->presentTime && frame->captureTime >= frame->presentTime)
+  {
+    l->capture += frame->captureTime - frame->presentTime;
+    ++l->captureCount;
+  }
+
+  if (clock->valid)
+  {
+    const int64_t transfer = (int64_t)recvTime + clock->offset -
+      (int64_t)frame->postTime;
+    if (transfer >= 0)
+    {
+      l->transfer += transfer;
+      ++l->transferCount;
+    }
+  }
+
+  l->post   += frame->postTime - frame->captureTime;
+  l->upload += uploadTime - recvTime;
+  ++l->count;
+  histogram_add(&l->uploadHist, uploadTime - recvTime);
+
+  LG_UNLOCK(state.latencyLock);
+}
+
 static int frameThread(void * unused)
 {
   struct DMAFrameInfo
@@ -384,8 +1016,13 @@ static int frameThread(void * unused)
 
   uint32_t          formatVer = 0;
   bool              formatValid = false;
+  bool              formatSkip  = false; // the format is one we can't show
+  uint32_t          frameSerial = 0;
   size_t            dataSize;
+  struct PoolSteady steady = { 0 };
+  LG_RendererFrameHandle holdSerial = 0;
   LG_RendererFormat lgrFormat;
+  struct ClockSync  clock = { 0 };
 
   struct DMAFrameInfo dmaInfo[LGMP_Q_FRAME_LEN] = {0};
   const bool useDMA =
@@ -397,11 +1034,21 @@ static int frameThread(void * unused)
   if (useDMA)
     DEBUG_INFO("Using DMA buffer support");
 
-  SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+  if (!params.realtime || !lgThreadSetPriority(LG_THREAD_PRIORITY_PRESENT))
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+  lgThreadSetAffinity(NULL, params.frameAffinity);
+
   lgWaitEvent(e_startup, TIMEOUT_INFINITE);
   if (state.state != APP_STATE_RUNNING)
     return 0;
 
+  // only once the session says the host rings, an older or unconfigured host
+  // would leave every frame waiting for the timeout
+  const bool useIRQ = state.hostRings &&
+    ivshmemHasIRQ(&state.shm, KVMFR_IRQ_FRAME);
+  if (useIRQ)
+    DEBUG_INFO("Using the doorbell for frame notifications");
+
   // subscribe to the frame queue
   while(state.state == APP_STATE_RUNNING)
   {
@@ -422,12 +1069,26 @@ static int frameThread(void * unused)
 
   while(state.state == APP_STATE_RUNNING && !state.stopVideo)
   {
+    // when behind go straight to the newest frame, uploading the ones it has
+    // replaced only delays it. Errors are left for lgmpClientProcess to report
+    if (params.skipFrames)
+      lgmpClientAdvanceToLast(queue);
+
     LGMPMessage msg;
     if ((status = lgmpClientProcess(queue, &msg)) != LGMP_OK)
     {
       if (status == LGMP_ERR_QUEUE_EMPTY)
       {
-        usleep(params.framePollInterval);
+        // the timeout keeps a missed ring to one poll interval
+        const uint64_t waitStart = microtime();
+        if (useIRQ)
+          ivshmemWaitIRQ(&state.shm, KVMFR_IRQ_FRAME,
+              (params.framePollInterval + 999) / 1000);
+        else
+          usleep(params.framePollInterval);
+
+        if (state.stats)
+          state.stats->frameWaitTime += microtime() - waitStart;
         continue;
       }
 
@@ -441,15 +1102,22 @@ static int frameThread(void * unused)
       break;
     }
 
-    KVMFRFrame * frame       = (KVMFRFrame *)msg.mem;
-    struct DMAFrameInfo *dma = NULL;
+    const uint64_t recvTime    = microtime();
+    KVMFRFrame * frame         = (KVMFRFrame *)msg.mem;
+    struct DMAFrameInfo *dma   = NULL;
+    bool         formatChanged = false;
 
     if (!formatValid || frame->formatVer != formatVer)
     {
+      formatChanged = true;
+      pool_steady_reset(&steady);
+
       // setup the renderer format with the frame format details
       lgrFormat.type   = frame->type;
-      lgrFormat.width  = frame->width;
-      lgrFormat.height = frame->height;
+      lgrFormat.width        = frame->width;
+      lgrFormat.height       = frame->height;
+      lgrFormat.screenWidth  = frame->screenWidth;
+      lgrFormat.screenHeight = frame->screenHeight;
       lgrFormat.stride = frame->stride;
       lgrFormat.pitch  = frame->pitch;
 
@@ -469,27 +1137,42 @@ static int frameThread(void * unused)
           break;
 
         case FRAME_TYPE_YUV420:
-          dataSize       = lgrFormat.height * lgrFormat.width;
+          // the chroma planes follow the luma with half the pitch
+          dataSize       = lgrFormat.height * lgrFormat.pitch;
           dataSize      += (dataSize / 4) * 2;
           lgrFormat.bpp  = 12;
           break;
 
         default:
-          DEBUG_ERROR("Unsupported frameType");
           error = true;
           break;
       }
 
-      if (error)
-      {
-        lgmpClientMessageDone(queue);
-        state.state = APP_STATE_SHUTDOWN;
-        break;
-      }
+      FrameType preferred;
+      if (!error && state.lgr->frame_types &&
+          !(state.lgr->frame_types(state.lgrData, &preferred) &
+            (1U << frame->type)))
+        error = true;
 
       formatValid = true;
       formatVer   = frame->formatVer;
+      formatSkip  = error;
+
+      // the host may send a type the renderer did not list, such as from an
+      // older client's request, skip its frames until the next format
+      if (error)
+        DEBUG_WARN("Skipping the frames of the unsupported frame type %u",
+            (unsigned int)frame->type);
+    }
 
+    if (formatSkip)
+    {
+      lgmpClientMessageDone(queue);
+      continue;
+    }
+
+    if (formatChanged)
+    {
       DEBUG_INFO("Format: %s %ux%u %u %u",
           FrameTypeStr[frame->type],
           frame->width, frame->height,
@@ -551,28 +1234,133 @@ static int frameThread(void * unused)
       }
     }
 
-    if (lgrFormat.width != state.srcSize.x || lgrFormat.height != state.srcSize.y)
+    // the source is the desktop size as the host may have scaled the frame
+    if (lgrFormat.screenWidth  != state.srcSize.x ||
+        lgrFormat.screenHeight != state.srcSize.y)
     {
-      state.srcSize.x = lgrFormat.width;
-      state.srcSize.y = lgrFormat.height;
+      state.srcSize.x = lgrFormat.screenWidth;
+      state.srcSize.y = lgrFormat.screenHeight;
       state.haveSrcSize = true;
-      if (params.autoResize)
-        SDL_SetWindowSize(state.window, lgrFormat.width, lgrFormat.height);
+      if (params.autoResize && !state.mosaicTiles)
+        SDL_SetWindowSize(state.window, lgrFormat.screenWidth,
+            lgrFormat.screenHeight);
 
       updatePositionInfo();
     }
 
+    // a gap in the serials is frames we never saw, skipped or missed, a
+    // repeat keeps the serial of the frame it repeats
+    const uint32_t skipped = formatValid && !formatChanged &&
+      frame->frameSerial != frameSerial ? frame->frameSerial - frameSerial - 1 : 0;
+    frameSerial = frame->frameSerial;
+
+    if (skipped)
+    {
+      if (params.showFPS)
+      {
+        LG_LOCK(state.latencyLock);
+        state.latency.skipped += skipped;
+        LG_UNLOCK(state.latencyLock);
+      }
+
+      if (state.stats)
+        state.stats->framesSkipped += skipped;
+    }
+
+    // the damage is relative to the prior frame which the renderer does not
+    // have if the format just changed or frames were passed over
+    int damageRectsCount = frame->damageRectsCount;
+    if (formatChanged || skipped || damageRectsCount > KVMFR_MAX_DAMAGE_RECTS)
+      damageRectsCount = 0;
+
     FrameBuffer * fb = (FrameBuffer *)(((uint8_t*)frame) + frame->offset);
-    if (!state.lgr->on_frame(state.lgrData, fb, useDMA ? dma->fd : -1))
+    const LGTraceScope frameTrace = lgTraceBegin("on_frame");
+    LG_RendererFrameHandle held = 0;
+    bool uploaded;
+    if (state.lgr->on_frame_acquire)
+    {
+      // zero is never a handle so it can mean nothing is held
+      if (++holdSerial == 0)
+        ++holdSerial;
+      held = holdSerial;
+      atomic_store(&heldFrame, held);
+      uploaded = state.lgr->on_frame_acquire(state.lgrData, held, fb,
+          useDMA ? dma->fd : -1, frame->damageRects, damageRectsCount);
+    }
+    else
+      uploaded = state.lgr->on_frame(state.lgrData, fb,
+          useDMA ? dma->fd : -1, frame->damageRects, damageRectsCount);
+    lgTraceEnd(frameTrace);
+    if (!uploaded)
     {
+      atomic_store(&heldFrame, 0);
       lgmpClientMessageDone(queue);
       DEBUG_ERROR("renderer on frame returned failure");
       state.state = APP_STATE_SHUTDOWN;
       break;
     }
 
+    // the first frame tagged with the outstanding probe answers it
+    uint32_t probe = atomic_load(&state.probeSerial);
+    if (probe && frame->probeSerial == probe)
+    {
+      const uint64_t probeSent = atomic_load(&state.probeSent);
+      if (atomic_compare_exchange_strong(&state.probeSerial, &probe, 0))
+        atomic_store(&state.probeUpload, probeSent);
+    }
+
+    const uint64_t uploadTime = microtime();
+    if (params.showFPS)
+    {
+      updateClock(&clock, frame, recvTime);
+      recordLatency(frame, &clock, recvTime, uploadTime);
+
+      atomic_store_explicit(&state.captureTime, clock.valid ?
+          frame->captureTime - clock.offset : 0, memory_order_relaxed);
+    }
+    else if (params.traceFile || params.audio)
+      updateClock(&clock, frame, recvTime);
+
+    if (params.audio && clock.valid)
+      audio_set_clock(clock.offset);
+
+    if (params.showFPS || state.stats)
+    {
+      // the render thread did not take the prior frame before this replaced it
+      const bool dropped = atomic_exchange_explicit(&state.uploadTime,
+          uploadTime, memory_order_release) != 0;
+
+      if (dropped && params.showFPS)
+      {
+        LG_LOCK(state.latencyLock);
+        ++state.latency.dropped;
+        LG_UNLOCK(state.latencyLock);
+      }
+
+      if (state.stats)
+      {
+        ++state.stats->framesReceived;
+        state.stats->framesDropped += dropped;
+        state.stats->bytesUploaded += dataSize;
+        state.stats->uploadTime    += uploadTime - recvTime;
+        state.stats->updateTime     = uploadTime;
+      }
+    }
+
+    // dump our events in the host's time so the two traces line up
+    if (params.traceFile && clock.valid)
+      lgTraceSetClockOffset(clock.offset);
+
     atomic_fetch_add_explicit(&state.frameCount, 1, memory_order_relaxed);
     lgSignalEvent(e_frame);
+    pool_steady_frame(&steady);
+
+    if (held)
+    {
+      const LGTraceScope holdTrace = lgTraceBegin("frameHeld");
+      waitFrameRelease(held);
+      lgTraceEnd(holdTrace);
+    }
     lgmpClientMessageDone(queue);
   }
 
@@ -587,70 +1375,309 @@ static int frameThread(void * unused)
   }
 
 
-  return 0;
-}
+  return 0;
+}
+
+int spiceThread(void * arg)
+{
+  // the connection is made alongside the rest of the startup, until it is
+  // ready the input is refused and the clipboard is not forwarded
+  if (!spice_connect(params.spiceHost, params.spicePort, ""))
+  {
+    DEBUG_ERROR("Failed to connect to spice server");
+    state.state = APP_STATE_SHUTDOWN;
+    return 1;
+  }
+
+  while(state.state != APP_STATE_SHUTDOWN && !spice_ready())
+    if (!spice_process(1000))
+    {
+      DEBUG_ERROR("Failed to process spice messages");
+      state.state = APP_STATE_SHUTDOWN;
+      return 1;
+    }
+
+  if (state.state == APP_STATE_SHUTDOWN)
+    return 0;
+
+  spice_mouse_mode(true);
+  atomic_store(&state.spiceReady, true);
+  input_enable();
+  DEBUG_INFO("Connected to the SPICE server");
+
+  while(state.state != APP_STATE_SHUTDOWN)
+    if (!spice_process(1000))
+    {
+      if (state.state != APP_STATE_SHUTDOWN)
+      {
+        state.state = APP_STATE_SHUTDOWN;
+        DEBUG_ERROR("failed to process spice messages");
+      }
+      break;
+    }
+
+  state.state = APP_STATE_SHUTDOWN;
+  return 0;
+}
+
+/* fault the shared memory in while the rest of the startup runs rather than
+ * on the first frames */
+static int prefaultThread(void * unused)
+{
+  const size_t pageSize = sysconf(_SC_PAGESIZE);
+  volatile const uint8_t * mem = (volatile const uint8_t *)state.shm.mem;
+
+  const uint64_t start = microtime();
+  for(size_t i = 0; i < state.shm.size; i += pageSize)
+  {
+    if (state.state == APP_STATE_SHUTDOWN)
+      return 0;
+    (void)mem[i];
+  }
+
+  DEBUG_INFO("Prefaulted %zu MiB of shared memory in %" PRIu64 "ms",
+      state.shm.size / 1048576, (microtime() - start) / 1000);
+  return 0;
+}
+
+static inline const uint32_t mapScancode(SDL_Scancode scancode)
+{
+  uint32_t ps2;
+  if (scancode > (sizeof(usb_to_ps2) / sizeof(uint32_t)) || (ps2 = usb_to_ps2[scancode]) == 0)
+  {
+    DEBUG_WARN("Unable to map USB scan code: %x\n", scancode);
+    return 0;
+  }
+  return ps2;
+}
+
+static LG_ClipboardData spice_type_to_clipboard_type(const SpiceDataType type)
+{
+  switch(type)
+  {
+    case SPICE_DATA_TEXT: return LG_CLIPBOARD_DATA_TEXT; break;
+    case SPICE_DATA_PNG : return LG_CLIPBOARD_DATA_PNG ; break;
+    case SPICE_DATA_BMP : return LG_CLIPBOARD_DATA_BMP ; break;
+    case SPICE_DATA_TIFF: return LG_CLIPBOARD_DATA_TIFF; break;
+    case SPICE_DATA_JPEG: return LG_CLIPBOARD_DATA_JPEG; break;
+    default:
+      DEBUG_ERROR("invalid spice data type");
+      return LG_CLIPBOARD_DATA_NONE;
+  }
+}
+
+static SpiceDataType clipboard_type_to_spice_type(const LG_ClipboardData type)
+{
+  switch(type)
+  {
+    case LG_CLIPBOARD_DATA_TEXT: return SPICE_DATA_TEXT; break;
+    case LG_CLIPBOARD_DATA_PNG : return SPICE_DATA_PNG ; break;
+    case LG_CLIPBOARD_DATA_BMP : return SPICE_DATA_BMP ; break;
+    case LG_CLIPBOARD_DATA_TIFF: return SPICE_DATA_TIFF; break;
+    case LG_CLIPBOARD_DATA_JPEG: return SPICE_DATA_JPEG; break;
+    default:
+      DEBUG_ERROR("invalid clipboard data type");
+      return SPICE_DATA_NONE;
+  }
+}
+
+static KVMFRClipboardType clipboard_type_to_kvmfr_type(const LG_ClipboardData type)
+{
+  switch(type)
+  {
+    case LG_CLIPBOARD_DATA_TEXT: return KVMFR_CLIPBOARD_TEXT; break;
+    case LG_CLIPBOARD_DATA_PNG : return KVMFR_CLIPBOARD_PNG ; break;
+    case LG_CLIPBOARD_DATA_BMP : return KVMFR_CLIPBOARD_BMP ; break;
+    case LG_CLIPBOARD_DATA_TIFF: return KVMFR_CLIPBOARD_TIFF; break;
+    case LG_CLIPBOARD_DATA_JPEG: return KVMFR_CLIPBOARD_JPEG; break;
+    default:
+      return KVMFR_CLIPBOARD_TEXT;
+  }
+}
+
+static LG_ClipboardData kvmfr_type_to_clipboard_type(const uint32_t type)
+{
+  switch(type)
+  {
+    case KVMFR_CLIPBOARD_TEXT: return LG_CLIPBOARD_DATA_TEXT; break;
+    case KVMFR_CLIPBOARD_PNG : return LG_CLIPBOARD_DATA_PNG ; break;
+    case KVMFR_CLIPBOARD_BMP : return LG_CLIPBOARD_DATA_BMP ; break;
+    case KVMFR_CLIPBOARD_TIFF: return LG_CLIPBOARD_DATA_TIFF; break;
+    case KVMFR_CLIPBOARD_JPEG: return LG_CLIPBOARD_DATA_JPEG; break;
+    default:
+      DEBUG_ERROR("invalid host clipboard type");
+      return LG_CLIPBOARD_DATA_NONE;
+  }
+}
+
+// the local clipboard is fetched as soon as it changes and handed to the host
+// whole, there is no SPICE style grab for the guest to request it from
+static void shmClipboardNotify(const LG_ClipboardData type, size_t size)
+{
+  if (type == LG_CLIPBOARD_DATA_NONE)
+    return;
+
+  state.cbShmOutType = type;
+  state.cbChunked    = size > 0;
+  state.cbXfer       = size;
+  state.cbShmOutSize = 0;
+  state.cbShmDrop    = false;
+
+  // a chunked transfer is the reply to a request that was already made
+  if (!size && state.lgc && state.lgc->request)
+    state.lgc->request(type);
+}
+
+static void shmClipboardData(const LG_ClipboardData type, uint8_t * data,
+    size_t size)
+{
+  volatile KVMFRClipboardRequest * req = state.cbShm;
+
+  if (state.cbChunked && size > state.cbXfer)
+  {
+    DEBUG_ERROR("refusing to send more then cbXfer bytes for chunked xfer");
+    size = state.cbXfer;
+  }
+
+  if (!state.cbChunked)
+  {
+    state.cbShmOutSize = 0;
+    state.cbShmDrop    = false;
+  }
+
+  // the host is still setting the last clipboard from the buffer
+  if (state.cbShmOutSize == 0)
+    for(int i = 0; req->ackSerial != req->serial; ++i)
+    {
+      if (i == 100)
+      {
+        DEBUG_WARN("The host has not taken the last clipboard, dropping this one");
+        state.cbShmDrop = true;
+        break;
+      }
+      usleep(1000);
+    }
+
+  if (!state.cbShmDrop && state.cbShmOutSize + size > req->bufferSize)
+  {
+    DEBUG_WARN("The clipboard is too large for the host buffer, not sending it");
+    state.cbShmDrop = true;
+  }
+
+  if (!state.cbShmDrop)
+  {
+    memcpy(state.cbShmOut + state.cbShmOutSize, data, size);
+    state.cbShmOutSize += size;
+  }
+
+  state.cbXfer -= size;
+  if (state.cbChunked && state.cbXfer > 0)
+    return;
+
+  if (state.cbShmDrop)
+    return;
+
+  req->type = clipboard_type_to_kvmfr_type(state.cbShmOutType);
+  req->size = state.cbShmOutSize;
+  atomic_thread_fence(memory_order_release);
+  req->serial = req->serial + 1;
+}
+
+static int clipboardThread(void * unused)
+{
+  LGMP_STATUS      status;
+  PLGMPClientQueue queue;
+
+  lgWaitEvent(e_startup, TIMEOUT_INFINITE);
+
+  // the host creates the queue once it has the clipboard of the guest
+  while(state.state == APP_STATE_RUNNING)
+  {
+    status = lgmpClientSubscribe(state.lgmp, LGMP_Q_CLIPBOARD, &queue);
+    if (status == LGMP_OK)
+      break;
+
+    if (status == LGMP_ERR_NO_SUCH_QUEUE)
+    {
+      usleep(100000);
+      continue;
+    }
+
+    DEBUG_ERROR("lgmpClientSubscribe Failed (Clipboard): %s",
+        lgmpStatusString(status));
+    return 0;
+  }
+
+  if (state.state != APP_STATE_RUNNING)
+    return 0;
+
+  DEBUG_INFO("Syncing the clipboard through the shared memory");
+  atomic_store(&state.cbShmActive, true);
 
-int spiceThread(void * arg)
-{
-  while(state.state != APP_STATE_SHUTDOWN)
-    if (!spice_process(1000))
+  while(state.state == APP_STATE_RUNNING)
+  {
+    LGMPMessage msg;
+    if ((status = lgmpClientProcess(queue, &msg)) != LGMP_OK)
     {
-      if (state.state != APP_STATE_SHUTDOWN)
+      if (status == LGMP_ERR_QUEUE_EMPTY)
       {
-        state.state = APP_STATE_SHUTDOWN;
-        DEBUG_ERROR("failed to process spice messages");
+        usleep(10000);
+        continue;
       }
+
+      if (status != LGMP_ERR_INVALID_SESSION)
+        DEBUG_ERROR("lgmpClientProcess Failed (Clipboard): %s",
+            lgmpStatusString(status));
       break;
     }
 
-  state.state = APP_STATE_SHUTDOWN;
-  return 0;
-}
+    // the data is copied out so the host can post the next clipboard
+    const KVMFRClipboard * cb = (const KVMFRClipboard *)msg.mem;
+    const LG_ClipboardData type = kvmfr_type_to_clipboard_type(cb->type);
+    bool valid = type != LG_CLIPBOARD_DATA_NONE &&
+      cb->size <= msg.size - sizeof(KVMFRClipboard);
 
-static inline const uint32_t mapScancode(SDL_Scancode scancode)
-{
-  uint32_t ps2;
-  if (scancode > (sizeof(usb_to_ps2) / sizeof(uint32_t)) || (ps2 = usb_to_ps2[scancode]) == 0)
-  {
-    DEBUG_WARN("Unable to map USB scan code: %x\n", scancode);
-    return 0;
-  }
-  return ps2;
-}
+    if (valid && params.clipboardToLocal)
+    {
+      LG_LOCK(state.cbShmLock);
+      if (cb->size > state.cbShmAlloc)
+      {
+        uint8_t * data = realloc(state.cbShmData, cb->size);
+        if (data)
+        {
+          state.cbShmData  = data;
+          state.cbShmAlloc = cb->size;
+        }
+        else
+          valid = false;
+      }
 
-static LG_ClipboardData spice_type_to_clipboard_type(const SpiceDataType type)
-{
-  switch(type)
-  {
-    case SPICE_DATA_TEXT: return LG_CLIPBOARD_DATA_TEXT; break;
-    case SPICE_DATA_PNG : return LG_CLIPBOARD_DATA_PNG ; break;
-    case SPICE_DATA_BMP : return LG_CLIPBOARD_DATA_BMP ; break;
-    case SPICE_DATA_TIFF: return LG_CLIPBOARD_DATA_TIFF; break;
-    case SPICE_DATA_JPEG: return LG_CLIPBOARD_DATA_JPEG; break;
-    default:
-      DEBUG_ERROR("invalid spice data type");
-      return LG_CLIPBOARD_DATA_NONE;
-  }
-}
+      if (valid)
+      {
+        memcpy(state.cbShmData, cb + 1, cb->size);
+        state.cbShmType = type;
+        state.cbShmSize = cb->size;
+      }
+      LG_UNLOCK(state.cbShmLock);
+    }
 
-static SpiceDataType clipboard_type_to_spice_type(const LG_ClipboardData type)
-{
-  switch(type)
-  {
-    case LG_CLIPBOARD_DATA_TEXT: return SPICE_DATA_TEXT; break;
-    case LG_CLIPBOARD_DATA_PNG : return SPICE_DATA_PNG ; break;
-    case LG_CLIPBOARD_DATA_BMP : return SPICE_DATA_BMP ; break;
-    case LG_CLIPBOARD_DATA_TIFF: return SPICE_DATA_TIFF; break;
-    case LG_CLIPBOARD_DATA_JPEG: return SPICE_DATA_JPEG; break;
-    default:
-      DEBUG_ERROR("invalid clipboard data type");
-      return SPICE_DATA_NONE;
+    lgmpClientMessageDone(queue);
+
+    if (valid && params.clipboardToLocal && state.lgc && state.lgc->notice)
+      state.lgc->notice(clipboardRequest, type);
   }
+
+  atomic_store(&state.cbShmActive, false);
+  lgmpClientUnsubscribe(&queue);
+  return 0;
 }
 
 void clipboardRelease()
 {
-  if (!params.clipboardToVM)
+  if (atomic_load(&state.cbShmActive))
+    return;
+
+  if (!atomic_load(&state.spiceReady) || !params.clipboardToVM)
     return;
 
   spice_clipboard_release();
@@ -658,7 +1685,14 @@ void clipboardRelease()
 
 void clipboardNotify(const LG_ClipboardData type, size_t size)
 {
-  if (!params.clipboardToVM)
+  if (atomic_load(&state.cbShmActive))
+  {
+    if (params.clipboardToVM)
+      shmClipboardNotify(type, size);
+    return;
+  }
+
+  if (!atomic_load(&state.spiceReady) || !params.clipboardToVM)
     return;
 
   if (type == LG_CLIPBOARD_DATA_NONE)
@@ -679,7 +1713,14 @@ void clipboardNotify(const LG_ClipboardData type, size_t size)
 
 void clipboardData(const LG_ClipboardData type, uint8_t * data, size_t size)
 {
-  if (!params.clipboardToVM)
+  if (atomic_load(&state.cbShmActive))
+  {
+    if (params.clipboardToVM)
+      shmClipboardData(type, data, size);
+    return;
+  }
+
+  if (!atomic_load(&state.spiceReady) || !params.clipboardToVM)
     return;
 
   if (state.cbChunked && size > state.cbXfer)
@@ -697,10 +1738,24 @@ void clipboardData(const LG_ClipboardData type, uint8_t * data, size_t size)
 
 void clipboardRequest(const LG_ClipboardReplyFn replyFn, void * opaque)
 {
-  if (!params.clipboardToLocal)
+  if (atomic_load(&state.cbShmActive))
+  {
+    if (!params.clipboardToLocal)
+      return;
+
+    LG_LOCK(state.cbShmLock);
+    if (state.cbShmData)
+      replyFn(opaque, state.cbShmType, state.cbShmData, state.cbShmSize);
+    LG_UNLOCK(state.cbShmLock);
+    return;
+  }
+
+  if (!atomic_load(&state.spiceReady) || !params.clipboardToLocal)
     return;
 
-  struct CBRequest * cbr = (struct CBRequest *)malloc(sizeof(struct CBRequest()));
+  struct CBRequest * cbr = (struct CBRequest *)pool_get(state.cbRequestPool);
+  if (!cbr)
+    return;
 
   cbr->type    = state.cbType;
   cbr->replyFn = replyFn;
@@ -712,6 +1767,9 @@ void clipboardRequest(const LG_ClipboardReplyFn replyFn, void * opaque)
 
 void spiceClipboardNotice(const SpiceDataType type)
 {
+  if (atomic_load(&state.cbShmActive))
+    return;
+
   if (!params.clipboardToLocal)
     return;
 
@@ -724,6 +1782,9 @@ void spiceClipboardNotice(const SpiceDataType type)
 
 void spiceClipboardData(const SpiceDataType type, uint8_t * buffer, uint32_t size)
 {
+  if (atomic_load(&state.cbShmActive))
+    return;
+
   if (!params.clipboardToLocal)
     return;
 
@@ -749,12 +1810,15 @@ void spiceClipboardData(const SpiceDataType type, uint8_t * buffer, uint32_t siz
   if (ll_shift(state.cbRequestList, (void **)&cbr))
   {
     cbr->replyFn(cbr->opaque, spice_type_to_clipboard_type(type), buffer, size);
-    free(cbr);
+    pool_put(state.cbRequestPool, cbr);
   }
 }
 
 void spiceClipboardRelease()
 {
+  if (atomic_load(&state.cbShmActive))
+    return;
+
   if (!params.clipboardToLocal)
     return;
 
@@ -764,6 +1828,9 @@ void spiceClipboardRelease()
 
 void spiceClipboardRequest(const SpiceDataType type)
 {
+  if (atomic_load(&state.cbShmActive))
+    return;
+
   if (!params.clipboardToVM)
     return;
 
@@ -806,7 +1873,8 @@ static bool isValidCursorLocation(int x, int y)
   return false;
 }
 
-static void handleMouseMoveEvent(int ex, int ey)
+/* returns true if the event should be kept to wake the main loop */
+static bool handleMouseMoveEvent(int ex, int ey)
 {
   SDL_Point delta = {
     .x = ex - state.curLastX,
@@ -814,7 +1882,7 @@ static void handleMouseMoveEvent(int ex, int ey)
   };
 
   if (delta.x == 0 && delta.y == 0)
-    return;
+    return false;
 
   state.curLastX = state.curLocalX = ex;
   state.curLastY = state.curLocalY = ey;
@@ -824,11 +1892,11 @@ static void handleMouseMoveEvent(int ex, int ey)
       ex == state.warpToX && ey == state.warpToY)
   {
     state.warpState = WARP_STATE_ON;
-    return;
+    return false;
   }
 
   if (!state.cursorInWindow || state.ignoreInput || !params.useSpiceInput)
-    return;
+    return false;
 
   /* if we don't have the current cursor pos just send cursor movements */
   if (!state.haveCursorPos)
@@ -836,13 +1904,14 @@ static void handleMouseMoveEvent(int ex, int ey)
     if (state.grabMouse)
     {
       state.cursorInView = true;
-      spice_mouse_motion(delta.x, delta.y);
+      const bool wake = queueMouseMotion(delta.x, delta.y);
       if (ex < 100 || ex > state.windowW - 100 ||
           ey < 100 || ey > state.windowH - 100)
         warpMouse(state.windowW / 2, state.windowH / 2);
+      return wake;
     }
 
-    return;
+    return false;
   }
 
   const bool inView = !(
@@ -868,11 +1937,14 @@ static void handleMouseMoveEvent(int ex, int ey)
       if (state.warpState == WARP_STATE_OFF)
         state.warpState = WARP_STATE_ON;
 
-      /* convert guest to local and calculate the delta */
+      /* convert guest to local and calculate the delta, this replaces any
+       * motion not yet sent */
       const int lx = (state.cursor.x / state.scaleX) + state.dstRect.x;
       const int ly = (state.cursor.y / state.scaleY) + state.dstRect.y;
       delta.x = ex - lx;
       delta.y = ey - ly;
+      state.motionX = 0;
+      state.motionY = 0;
     }
     else
     {
@@ -883,8 +1955,9 @@ static void handleMouseMoveEvent(int ex, int ey)
         state.drawCursor = false;
     }
   }
-  else if (inView)
+  else if (inView && !state.localCursor)
   {
+    // the local cursor is the guest's so it must stay where the guest has it
     if (ex < 100 || ex > state.windowW - 100 ||
         ey < 100 || ey > state.windowH - 100)
       warpMouse(state.windowW / 2, state.windowH / 2);
@@ -913,8 +1986,8 @@ static void handleMouseMoveEvent(int ex, int ey)
   if (!state.grabMouse && state.warpState == WARP_STATE_ON)
   {
     const SDL_Point newPos = {
-      .x = (float)(state.cursor.x + delta.x) / state.scaleX,
-      .y = (float)(state.cursor.y + delta.y) / state.scaleY
+      .x = (float)(state.cursor.x + state.motionX + delta.x) / state.scaleX,
+      .y = (float)(state.cursor.y + state.motionY + delta.y) / state.scaleY
     };
 
     /* check if the movement would exit the window */
@@ -926,17 +1999,110 @@ static void handleMouseMoveEvent(int ex, int ey)
       if (isValidCursorLocation(nx, ny))
       {
         /* put the mouse where it should be and disable warp */
+        flushMouseMotion();
         state.warpState = WARP_STATE_WIN_EXIT;
         warpMouse(state.dstRect.x + newPos.x, state.dstRect.y + newPos.y);
         SDL_ShowCursor(SDL_ENABLE);
-        return;
+        return false;
       }
     }
   }
 
   /* send the movement to the guest */
-  if (!spice_mouse_motion(delta.x, delta.y))
+  return queueMouseMotion(delta.x, delta.y);
+}
+
+/* the motion is added up and sent at most every 1 / mouseRate seconds, one
+ * motion event is left in the queue to wake the main loop so the remainder
+ * goes out once it is due even if the mouse has stopped */
+static void flushMouseMotion()
+{
+  if (state.motionX == 0 && state.motionY == 0)
+    return;
+
+  if (!input_mouse_motion(state.motionX, state.motionY))
     DEBUG_ERROR("failed to send mouse motion message");
+
+  state.motionX    = 0;
+  state.motionY    = 0;
+  state.motionNext = microtime() +
+    (params.mouseRate > 0 ? 1000000 / params.mouseRate : 0);
+}
+
+static bool queueMouseMotion(int x, int y)
+{
+  // the input thread reads the motion straight from the device
+  if (state.grabMouse && input_evdev_captured())
+    return false;
+
+  state.motionX += x;
+  state.motionY += y;
+
+  if (microtime() >= state.motionNext)
+  {
+    flushMouseMotion();
+    return false;
+  }
+
+  if (state.motionWake)
+    return false;
+
+  state.motionWake = true;
+  return true;
+}
+
+/* called by the main loop after it has been woken, waits for the pending
+ * motion to be due and sends it */
+static void pumpMouseMotion()
+{
+  if (!state.motionWake)
+    return;
+
+  SDL_FlushEvent(SDL_MOUSEMOTION);
+  SDL_FlushEvent(SDL_SYSWMEVENT );
+
+  const uint64_t now = microtime();
+  if ((state.motionX || state.motionY) && now < state.motionNext)
+    SDL_WaitEventTimeout(NULL, (state.motionNext - now + 999) / 1000);
+
+  state.motionWake = false;
+  flushMouseMotion();
+}
+
+/* with an unscaled view the local pointer sits where the guest cursor is, so
+ * the guest shape can be shown by the local cursor which moves with no delay */
+static void updateLocalCursor()
+{
+  if (!params.localCursor)
+    return;
+
+  SDL_Cursor * shape = localcursor_get();
+  const bool active = shape && !state.scale && !state.grabMouse &&
+    state.haveCursorPos && state.cursorInView && state.cursorInWindow &&
+    state.drawCursor;
+
+  if (active != state.localCursor)
+  {
+    state.localCursor  = active;
+    state.updateCursor = true;
+    if (!active)
+    {
+      SDL_SetCursor(cursor);
+      state.localCursorSet = NULL;
+      if (state.cursorInView && params.hideMouse)
+        SDL_ShowCursor(SDL_DISABLE);
+    }
+  }
+
+  if (!active)
+    return;
+
+  if (shape != state.localCursorSet)
+  {
+    SDL_SetCursor(shape);
+    state.localCursorSet = shape;
+  }
+  SDL_ShowCursor(state.cursorVisible ? SDL_ENABLE : SDL_DISABLE);
 }
 
 static void handleResizeEvent(unsigned int w, unsigned int h)
@@ -958,6 +2124,7 @@ static void handleResizeEvent(unsigned int w, unsigned int h)
 
 static void handleWindowLeave()
 {
+  flushMouseMotion();
   state.cursorInWindow = false;
 
   if (!params.useSpiceInput)
@@ -1055,6 +2222,13 @@ int eventFilter(void * userdata, SDL_Event * event)
         case SDL_WINDOWEVENT_MOVED:
           state.windowPos.x = event->window.data1;
           state.windowPos.y = event->window.data2;
+
+          // the window may now be on a display with a different refresh rate
+          if (params.maxFPS < 0)
+          {
+            state.requestTime    = microtime() + REQUEST_TIMEOUT;
+            state.requestPending = true;
+          }
           break;
 
         // allow a window close event to close the application even if ignoreQuit is set
@@ -1067,6 +2241,8 @@ int eventFilter(void * userdata, SDL_Event * event)
 
     case SDL_SYSWMEVENT:
     {
+      bool wake = false;
+
       // When the window manager forces the window size after calling SDL_SetWindowSize, SDL
       // ignores this update and caches the incorrect window size. As such all related details
       // are incorect including mouse movement information as it clips to the old window size.
@@ -1080,7 +2256,8 @@ int eventFilter(void * userdata, SDL_Event * event)
             break;
 
           case MotionNotify:
-            handleMouseMoveEvent(xe.xmotion.x, xe.xmotion.y);
+            wake = handleMouseMoveEvent(xe.xmotion.x, xe.xmotion.y);
+            updateLocalCursor();
             break;
 
           case EnterNotify:
@@ -1119,13 +2296,19 @@ int eventFilter(void * userdata, SDL_Event * event)
 
       if (params.useSpiceClipboard && state.lgc && state.lgc->wmevent)
         state.lgc->wmevent(event->syswm.msg);
-      return 0;
+      return wake ? 1 : 0;
     }
 
     case SDL_MOUSEMOTION:
+    {
+      bool wake = false;
       if (state.wminfo.subsystem != SDL_SYSWM_X11)
-        handleMouseMoveEvent(event->motion.x, event->motion.y);
+        wake = handleMouseMoveEvent(event->motion.x, event->motion.y);
+      updateLocalCursor();
+      if (wake)
+        return 1;
       break;
+    }
 
     case SDL_KEYDOWN:
     {
@@ -1152,7 +2335,7 @@ int eventFilter(void * userdata, SDL_Event * event)
 
       if (!state.keyDown[sc])
       {
-        if (spice_key_down(scancode))
+        if (input_key_down(scancode))
           state.keyDown[sc] = true;
         else
         {
@@ -1172,8 +2355,10 @@ int eventFilter(void * userdata, SDL_Event * event)
         {
           if (params.useSpiceInput)
           {
+            flushMouseMotion();
             state.grabMouse = !state.grabMouse;
             SDL_SetWindowGrab(state.window, state.grabMouse);
+            input_set_capture(state.grabMouse, state.mouseSens);
 
             app_alert(
               state.grabMouse ? LG_ALERT_SUCCESS  : LG_ALERT_WARNING,
@@ -1203,7 +2388,7 @@ int eventFilter(void * userdata, SDL_Event * event)
       if (scancode == 0)
         break;
 
-      if (spice_key_up(scancode))
+      if (input_key_up(scancode))
         state.keyDown[sc] = false;
       else
       {
@@ -1218,8 +2403,8 @@ int eventFilter(void * userdata, SDL_Event * event)
         break;
 
       if (
-        !spice_mouse_press  (event->wheel.y == 1 ? 4 : 5) ||
-        !spice_mouse_release(event->wheel.y == 1 ? 4 : 5)
+        !input_mouse_press  (event->wheel.y == 1 ? 4 : 5) ||
+        !input_mouse_release(event->wheel.y == 1 ? 4 : 5)
         )
       {
         DEBUG_ERROR("SDL_MOUSEWHEEL: failed to send messages");
@@ -1236,7 +2421,7 @@ int eventFilter(void * userdata, SDL_Event * event)
       if (button > 3)
         button += 2;
 
-      if (!spice_mouse_press(button))
+      if (!input_mouse_press(button))
       {
         DEBUG_ERROR("SDL_MOUSEBUTTONDOWN: failed to send message");
         break;
@@ -1253,7 +2438,7 @@ int eventFilter(void * userdata, SDL_Event * event)
       if (button > 3)
         button += 2;
 
-      if (!spice_mouse_release(button))
+      if (!input_mouse_release(button))
       {
         DEBUG_ERROR("SDL_MOUSEBUTTONUP: failed to send message");
         break;
@@ -1275,6 +2460,10 @@ void int_handler(int signal)
       DEBUG_INFO("Caught signal, shutting down...");
       state.state = APP_STATE_SHUTDOWN;
       break;
+
+    case SIGUSR1:
+      state.traceDump = true;
+      break;
   }
 }
 
@@ -1350,6 +2539,7 @@ static void mouse_sens_inc(SDL_Scancode key, void * opaque)
   char * msg;
   if (state.mouseSens < 9)
     ++state.mouseSens;
+  input_set_capture(state.grabMouse, state.mouseSens);
 
   alloc_sprintf(&msg, "Sensitivity: %s%d", state.mouseSens > 0 ? "+" : "", state.mouseSens);
   app_alert(
@@ -1365,6 +2555,7 @@ static void mouse_sens_dec(SDL_Scancode key, void * opaque)
 
   if (state.mouseSens > -9)
     --state.mouseSens;
+  input_set_capture(state.grabMouse, state.mouseSens);
 
   alloc_sprintf(&msg, "Sensitivity: %s%d", state.mouseSens > 0 ? "+" : "", state.mouseSens);
   app_alert(
@@ -1380,13 +2571,40 @@ static void ctrl_alt_fn(SDL_Scancode key, void * opaque)
   const uint32_t alt  = mapScancode(SDL_SCANCODE_LALT );
   const uint32_t fn   = mapScancode(key);
 
-  spice_key_down(ctrl);
-  spice_key_down(alt );
-  spice_key_down(fn  );
+  input_key_down(ctrl);
+  input_key_down(alt );
+  input_key_down(fn  );
+
+  input_key_up(ctrl);
+  input_key_up(alt );
+  input_key_up(fn  );
+}
+
+static void dump_trace(SDL_Scancode key, void * opaque)
+{
+  if (!params.traceFile)
+  {
+    app_alert(LG_ALERT_WARNING, "Tracing is disabled, set app:traceFile");
+    return;
+  }
+
+  state.traceDump = true;
+}
 
-  spice_key_up(ctrl);
-  spice_key_up(alt );
-  spice_key_up(fn  );
+static void dumpTrace()
+{
+  state.traceDump = false;
+  if (!params.traceFile)
+    return;
+
+  // ask the host to write its side of the trace too
+  if (state.request)
+    ++state.request->traceSerial;
+
+  if (lgTraceDump(params.traceFile))
+    app_alert(LG_ALERT_INFO, "Trace written");
+  else
+    app_alert(LG_ALERT_WARNING, "Failed to write the trace");
 }
 
 static void register_key_binds()
@@ -1397,6 +2615,7 @@ static void register_key_binds()
   state.kbQuit         = app_register_keybind(SDL_SCANCODE_Q     , quit             , NULL);
   state.kbMouseSensInc = app_register_keybind(SDL_SCANCODE_INSERT, mouse_sens_inc   , NULL);
   state.kbMouseSensDec = app_register_keybind(SDL_SCANCODE_DELETE, mouse_sens_dec   , NULL);
+  state.kbTrace        = app_register_keybind(SDL_SCANCODE_T     , dump_trace       , NULL);
 
   state.kbCtrlAltFn[0 ] = app_register_keybind(SDL_SCANCODE_F1 , ctrl_alt_fn, NULL);
   state.kbCtrlAltFn[1 ] = app_register_keybind(SDL_SCANCODE_F2 , ctrl_alt_fn, NULL);
@@ -1420,6 +2639,7 @@ static void release_key_binds()
   app_release_keybind(&state.kbQuit );
   app_release_keybind(&state.kbMouseSensInc);
   app_release_keybind(&state.kbMouseSensDec);
+  app_release_keybind(&state.kbTrace);
   for(int i = 0; i < 12; ++i)
     app_release_keybind(&state.kbCtrlAltFn[i]);
 }
@@ -1436,6 +2656,7 @@ static int lg_run()
 {
   memset(&state, 0, sizeof(state));
   lgInit();
+  LG_LOCK_INIT(state.latencyLock);
 
   state.mouseSens = params.mouseSens;
        if (state.mouseSens < -9) state.mouseSens = -9;
@@ -1446,7 +2667,19 @@ static int lg_run()
   if (XDG_SESSION_TYPE == NULL)
     XDG_SESSION_TYPE = "unspecified";
 
-  if (strcmp(XDG_SESSION_TYPE, "wayland") == 0)
+  if (params.headless)
+  {
+    // SDL's offscreen driver needs no display, the renderer draws into its
+    // own offscreen surface
+    int err = setenv("SDL_VIDEODRIVER", "offscreen", 1);
+    if (err < 0)
+    {
+      DEBUG_ERROR("Unable to set the env variable SDL_VIDEODRIVER: %d", err);
+      return -1;
+    }
+    DEBUG_INFO("Headless, rendering offscreen");
+  }
+  else if (strcmp(XDG_SESSION_TYPE, "wayland") == 0)
   {
      DEBUG_INFO("Wayland detected");
      if (getenv("SDL_VIDEODRIVER") == NULL)
@@ -1471,6 +2704,10 @@ static int lg_run()
   // SIGINT and the user sending a close event, such as ALT+F4
   signal(SIGINT , int_handler);
   signal(SIGTERM, int_handler);
+  signal(SIGUSR1, int_handler);
+
+  if (params.traceFile)
+    lgTraceInit("Looking Glass Client", 2);
 
   // try map the shared memory
   if (!ivshmemOpen(&state.shm))
@@ -1479,6 +2716,25 @@ static int lg_run()
     return -1;
   }
 
+  state.mosaicTiles = mosaic_init(params.mosaicDevices, params.mosaicFPS);
+  if (params.mosaicDevices && !state.mosaicTiles)
+    DEBUG_WARN("The mosaic devices will not be shown");
+
+  placeOnNode(&params.frameAffinity , "frame" );
+  placeOnNode(&params.renderAffinity, "render");
+
+  // the workers share the CPUs of the frame thread they upload for
+  if (!framebuffer_set_read_threads(params.readThreads, params.frameAffinity))
+    DEBUG_WARN("Failed to start the frame read threads, using a single thread");
+
+  if (params.statsShm && !(state.stats = stats_open(params.statsShm)))
+    DEBUG_WARN("Statistics will not be published");
+
+  // the renderer probe and window do not wait on the memory or the spice
+  // connection, both are made ready in the background
+  if (!lgCreateThread("prefaultThread", prefaultThread, NULL, &t_prefault))
+    DEBUG_WARN("Failed to create the prefault thread");
+
   // try to connect to the spice server
   if (params.useSpiceInput || params.useSpiceClipboard)
   {
@@ -1488,21 +2744,12 @@ static int lg_run()
         spiceClipboardRelease,
         spiceClipboardRequest);
 
-    if (!spice_connect(params.spiceHost, params.spicePort, ""))
+    if (params.useSpiceInput && !input_start(params.realtime, params.evdev))
     {
-      DEBUG_ERROR("Failed to connect to spice server");
+      DEBUG_ERROR("Failed to start the input thread");
       return -1;
     }
 
-    while(state.state != APP_STATE_SHUTDOWN && !spice_ready())
-      if (!spice_process(1000))
-      {
-        state.state = APP_STATE_SHUTDOWN;
-        DEBUG_ERROR("Failed to process spice messages");
-        return -1;
-      }
-
-    spice_mouse_mode(true);
     if (!lgCreateThread("spiceThread", spiceThread, NULL, &t_spice))
     {
       DEBUG_ERROR("spice create thread failed");
@@ -1512,8 +2759,12 @@ static int lg_run()
 
   // select and init a renderer
   LG_RendererParams lgrParams;
-  lgrParams.showFPS     = params.showFPS;
-  lgrParams.quickSplash = params.quickSplash;
+  lgrParams.showFPS      = params.showFPS && !params.headless;
+  lgrParams.headless     = params.headless;
+  lgrParams.quickSplash  = params.quickSplash;
+  lgrParams.latchCursor  = latchCursorPos;
+  lgrParams.releaseFrame = releaseFrame;
+  lgrParams.tiles        = state.mosaicTiles;
   Uint32 sdlFlags;
 
   if (params.forceRenderer)
@@ -1555,7 +2806,7 @@ static int lg_run()
     params.w,
     params.h,
     (
-      SDL_WINDOW_SHOWN |
+      (params.headless    ? SDL_WINDOW_HIDDEN     : SDL_WINDOW_SHOWN) |
       (params.allowResize ? SDL_WINDOW_RESIZABLE  : 0) |
       (params.borderless  ? SDL_WINDOW_BORDERLESS : 0) |
       (params.maximize    ? SDL_WINDOW_MAXIMIZED  : 0) |
@@ -1601,6 +2852,15 @@ static int lg_run()
     state.frameTime = 1000000000ULL / (unsigned long long)params.fpsMin;
   }
 
+  if (params.jitRender)
+  {
+    const unsigned int refresh = getRefreshRate();
+    state.jitPeriod = 1000000ULL / (refresh ? refresh : 60);
+    state.jitBudget = params.jitMargin > 0 ? params.jitMargin : 0;
+    DEBUG_INFO("Just in time rendering with a %" PRIu64 "us margin%s",
+        state.jitBudget, params.vrr ? " for a variable refresh display" : "");
+  }
+
   register_key_binds();
 
   // set the compositor hint to bypass for low latency
@@ -1650,7 +2910,7 @@ static int lg_run()
 
       state.lgc = LG_Clipboards[0];
     }
-  } else {
+  } else if (!params.headless) {
     DEBUG_ERROR("Could not get SDL window information %s", SDL_GetError());
     return -1;
   }
@@ -1665,9 +2925,13 @@ static int lg_run()
     }
 
     state.cbRequestList = ll_new();
+    state.cbRequestPool = pool_new(sizeof(struct CBRequest), 4);
+    LG_LOCK_INIT(state.cbShmLock);
   }
 
   initSDLCursor();
+  if (params.localCursor)
+    localcursor_init();
   if (params.hideMouse)
     SDL_ShowCursor(SDL_DISABLE);
 
@@ -1676,6 +2940,7 @@ static int lg_run()
     state.grabMouse = true;
     SDL_SetWindowGrab(state.window, true);
   }
+  input_set_capture(state.grabMouse, state.mouseSens);
 
   // setup the startup condition
   if (!(e_startup = lgCreateEvent(false, 0)))
@@ -1691,6 +2956,12 @@ static int lg_run()
     return -1;
   }
 
+  if (!(e_release = lgCreateEvent(true, 0)))
+  {
+    DEBUG_ERROR("failed to create the frame release event");
+    return -1;
+  }
+
   // start the renderThread so we don't just display junk
   if (!lgCreateThread("renderThread", renderThread, NULL, &t_render))
   {
@@ -1702,10 +2973,10 @@ static int lg_run()
   SDL_SetHintWithPriority(SDL_HINT_MOUSE_RELATIVE_MODE_WARP, "1", SDL_HINT_OVERRIDE);
   SDL_SetEventFilter(eventFilter, NULL);
 
-  // wait for startup to complete so that any error messages below are output at
-  // the end of the output
-  lgWaitEvent(e_startup, TIMEOUT_INFINITE);
-
+  // the renderer starts up (and compiles its shaders) while the session is
+  // set up, the frame and cursor threads wait for it on e_startup. Events are
+  // not pumped until it is ready as the handlers call into the renderer
+  bool rendererReady = false;
   LGMP_STATUS status;
 
   while(state.state == APP_STATE_RUNNING)
@@ -1717,15 +2988,16 @@ static int lg_run()
     return -1;
   }
 
-  /* this short timeout is to allow the LGMP host to update the timestamp before
-   * we start checking for a valid session */
-  SDL_WaitEventTimeout(NULL, 200);
-
   uint32_t udataSize;
   KVMFR *udata;
   int waitCount = 0;
+  uint64_t quickWait;
 
 restart:
+  /* the session is only valid once the LGMP host has updated the timestamp
+   * since we looked, poll quickly for a while rather than waiting a fixed time
+   * as a running host does so within a few milliseconds */
+  quickWait = microtime() + 1000000;
   while(state.state == APP_STATE_RUNNING)
   {
     if ((status = lgmpClientSessionInit(state.lgmp, &udataSize, (uint8_t **)&udata)) == LGMP_OK)
@@ -1737,6 +3009,21 @@ restart:
       return -1;
     }
 
+    if (microtime() < quickWait)
+    {
+      if (!rendererReady)
+        rendererReady = lgWaitEvent(e_startup, 10);
+      else
+        SDL_WaitEventTimeout(NULL, 10);
+      continue;
+    }
+
+    if (!rendererReady)
+    {
+      lgWaitEvent(e_startup, TIMEOUT_INFINITE);
+      rendererReady = true;
+    }
+
     if (waitCount++ == 0)
     {
       DEBUG_BREAK();
@@ -1758,6 +3045,14 @@ restart:
   if (state.state != APP_STATE_RUNNING)
     return -1;
 
+  if (!rendererReady)
+  {
+    lgWaitEvent(e_startup, TIMEOUT_INFINITE);
+    rendererReady = true;
+    if (state.state != APP_STATE_RUNNING)
+      return -1;
+  }
+
   // dont show warnings again after the first startup
   waitCount = 100;
 
@@ -1783,8 +3078,64 @@ restart:
   }
 
   DEBUG_INFO("Host ready, reported version: %s", udata->hostver);
+  state.hostRings = udata->flags & KVMFR_FLAG_DOORBELL;
   DEBUG_INFO("Starting session");
 
+  if (udata->requestOffset + sizeof(KVMFRRequest) <= state.shm.size &&
+      udata->cursorPosOffset + sizeof(KVMFRCursorPos) <= state.shm.size)
+  {
+    state.request = (volatile KVMFRRequest *)
+      ((uint8_t *)state.shm.mem + udata->requestOffset);
+    state.cursorPos = (volatile KVMFRCursorPos *)
+      ((uint8_t *)state.shm.mem + udata->cursorPosOffset);
+
+    // replace any request left behind by a prior client
+    sendRequest();
+  }
+  else
+  {
+    DEBUG_WARN("Invalid host request offset");
+    state.request   = NULL;
+    state.cursorPos = NULL;
+  }
+
+  if (params.shmInput && udata->inputOffset &&
+      udata->inputOffset + sizeof(KVMFRInput) <= state.shm.size)
+  {
+    DEBUG_INFO("Sending input through the shared memory while the host takes it");
+    input_set_shm((volatile KVMFRInput *)
+        ((uint8_t *)state.shm.mem + udata->inputOffset));
+  }
+  else
+    input_set_shm(NULL);
+
+  // the host only gives the buffer once it can sync the guest clipboard
+  state.cbShm = NULL;
+  if (state.lgc && params.useSpiceClipboard && params.clipboardShm &&
+      udata->clipboardOffset &&
+      udata->clipboardOffset + sizeof(KVMFRClipboardRequest) <= state.shm.size)
+  {
+    volatile KVMFRClipboardRequest * req = (volatile KVMFRClipboardRequest *)
+      ((uint8_t *)state.shm.mem + udata->clipboardOffset);
+    const uint32_t bufferSize = req->bufferSize;
+    atomic_thread_fence(memory_order_acquire);
+    if (bufferSize && req->bufferOffset + bufferSize <= state.shm.size)
+    {
+      state.cbShm    = req;
+      state.cbShmOut = (uint8_t *)state.shm.mem + req->bufferOffset;
+    }
+  }
+
+  if (state.cbShm &&
+      !lgCreateThread("clipboardThread", clipboardThread, NULL, &t_clipboard))
+  {
+    DEBUG_ERROR("clipboard create thread failed");
+    return -1;
+  }
+
+  if (params.audio && !audio_start(state.lgmp, params.audioLatency))
+    DEBUG_WARN("The guest audio will not be played");
+
   if (!lgCreateThread("cursorThread", cursorThread, NULL, &t_cursor))
   {
     DEBUG_ERROR("cursor create thread failed");
@@ -1804,11 +3155,33 @@ restart:
       state.state = APP_STATE_RESTART;
       break;
     }
+
+    if (state.requestPending && microtime() >= state.requestTime)
+    {
+      state.requestPending = false;
+      sendRequest();
+    }
+
+    if ((params.showFPS || params.traceFile || params.audio) &&
+        microtime() >= state.pingTime + PING_INTERVAL)
+      sendPing();
+
+    if (params.latencyProbe)
+      sendProbe();
+
+    if (state.traceDump)
+      dumpTrace();
+
+    updateLocalCursor();
     SDL_WaitEventTimeout(NULL, 100);
+    pumpMouseMotion();
   }
 
   if (state.state == APP_STATE_RESTART)
   {
+    if (state.stats)
+      ++state.stats->restarts;
+
     lgSignalEvent(e_startup);
     lgSignalEvent(e_frame);
     lgJoinThread(t_frame , NULL);
@@ -1816,6 +3189,15 @@ restart:
     t_frame  = NULL;
     t_cursor = NULL;
 
+    if (t_clipboard)
+    {
+      lgJoinThread(t_clipboard, NULL);
+      t_clipboard = NULL;
+    }
+
+    if (params.audio)
+      audio_stop();
+
     lgInit();
 
     state.lgr->on_restart(state.lgrData);
@@ -1837,7 +3219,18 @@ static void lg_shutdown()
     lgJoinThread(t_render, NULL);
   }
 
+  // these use the LGMP session until they are stopped
+  if (t_clipboard)
+  {
+    lgJoinThread(t_clipboard, NULL);
+    t_clipboard = NULL;
+  }
+
+  if (params.audio)
+    audio_stop();
+
   lgmpClientFree(&state.lgmp);
+  framebuffer_set_read_threads(0, 0);
 
   if (e_frame)
   {
@@ -1845,6 +3238,12 @@ static void lg_shutdown()
     e_frame = NULL;
   }
 
+  if (e_release)
+  {
+    lgFreeEvent(e_release);
+    e_release = NULL;
+  }
+
   if (e_startup)
   {
     lgFreeEvent(e_startup);
@@ -1852,7 +3251,7 @@ static void lg_shutdown()
   }
 
   // if spice is still connected send key up events for any pressed keys
-  if (params.useSpiceInput && spice_ready())
+  if (params.useSpiceInput && atomic_load(&state.spiceReady))
   {
     for(int i = 0; i < SDL_NUM_SCANCODES; ++i)
       if (state.keyDown[i])
@@ -1861,31 +3260,60 @@ static void lg_shutdown()
         if (scancode == 0)
           continue;
         state.keyDown[i] = false;
-        spice_key_up(scancode);
+        input_key_up(scancode);
       }
+  }
+  input_stop();
 
-    spice_disconnect();
-    if (t_spice)
-      lgJoinThread(t_spice, NULL);
+  // the spice thread may still be connecting, it stops on its own then
+  if (t_spice)
+  {
+    if (atomic_load(&state.spiceReady))
+      spice_disconnect();
+    lgJoinThread(t_spice, NULL);
+    t_spice = NULL;
   }
 
   if (state.lgc)
   {
     state.lgc->free();
+    free(state.cbShmData);
 
     struct CBRequest *cbr;
     while(ll_shift(state.cbRequestList, (void **)&cbr))
-      free(cbr);
+      pool_put(state.cbRequestPool, cbr);
     ll_free(state.cbRequestList);
+    pool_free(state.cbRequestPool);
   }
 
   if (state.window)
     SDL_DestroyWindow(state.window);
 
+  if (params.localCursor)
+    localcursor_free();
+
   if (cursor)
     SDL_FreeCursor(cursor);
 
+  if (t_prefault)
+  {
+    lgJoinThread(t_prefault, NULL);
+    t_prefault = NULL;
+  }
+
   ivshmemClose(&state.shm);
+  mosaic_free();
+  stats_close(state.stats);
+  state.stats = NULL;
+
+  FrameBufferStats fbStats;
+  framebuffer_get_stats(&fbStats);
+  DEBUG_INFO("Frame waits      : spin %" PRIu64 " (<%uus), yield %" PRIu64
+      " (<%uus), sleep %" PRIu64 " (<%uus), timeout %" PRIu64 ", %" PRIu64 "us total",
+      fbStats.spin , fbStats.spinTime,
+      fbStats.yield, fbStats.yieldTime,
+      fbStats.sleep, fbStats.waitLimit,
+      fbStats.timeout, fbStats.waitTime);
 
   release_key_binds();
   SDL_Quit();
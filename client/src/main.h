@@ -25,6 +25,10 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "dynamic/renderers.h"
 #include "dynamic/clipboards.h"
 #include "common/ivshmem.h"
+#include "common/KVMFR.h"
+#include "common/locking.h"
+#include "common/histogram.h"
+#include "stats.h"
 
 #include "spice/spice.h"
 #include <lgmp/client.h>
@@ -50,6 +54,29 @@ enum WarpState
   WARP_STATE_OFF
 };
 
+struct LatencyStats
+{
+  uint64_t     capture, post, transfer, upload, present;
+  unsigned int count, captureCount, transferCount, presentCount;
+
+  // per frame samples in microseconds
+  Histogram    uploadHist, ageHist, intervalHist, drawHist;
+  unsigned int dropped, skipped;
+};
+
+// the number of renders that may be waiting on present feedback
+#define PRESENT_QUEUE_LEN 16
+
+// a render waiting for the renderer to say when it reached the screen
+struct PendingPresent
+{
+  uint64_t render;
+  uint64_t uploadTime;  // zero if no new frame was uploaded
+  uint64_t captureTime;
+  uint64_t jitTarget;
+  uint64_t probeSent;   // zero if the upload did not answer a latency probe
+};
+
 struct AppState
 {
   enum RunState        state;
@@ -86,6 +113,10 @@ struct AppState
   int   curLocalY;
   bool  haveAligned;
 
+  // the guest cursor is being shown with the local cursor
+  bool          localCursor;
+  SDL_Cursor  * localCursorSet;
+
   enum WarpState   warpState;
   int   warpToX  , warpToY;
 
@@ -98,21 +129,77 @@ struct AppState
   bool                 cbChunked;
   size_t               cbXfer;
   struct ll          * cbRequestList;
+  struct pool        * cbRequestPool;
+
+  // the clipboard goes through the host instead of SPICE while this is set
+  atomic_bool                      cbShmActive;
+  volatile KVMFRClipboardRequest * cbShm;
+  LG_ClipboardData                 cbShmOutType;
+  uint8_t                        * cbShmOut;
+  size_t                           cbShmOutSize;
+  bool                             cbShmDrop;
+  LG_Lock                          cbShmLock;
+  LG_ClipboardData                 cbShmType;
+  uint8_t                        * cbShmData;
+  size_t                           cbShmSize;
+  size_t                           cbShmAlloc;
 
   SDL_SysWMinfo        wminfo;
   SDL_Window         * window;
 
+  // the other VMs shown alongside this one, see mosaic.h
+  unsigned int         mosaicTiles;
+
   struct IVSHMEM       shm;
+  bool                 hostRings; // the host sets KVMFR_FLAG_DOORBELL
   PLGMPClient          lgmp;
   PLGMPClientQueue     frameQueue;
   PLGMPClientQueue     pointerQueue;
 
+  volatile KVMFRRequest   * request;
+  volatile KVMFRCursorPos * cursorPos;
+  bool                      requestPending;
+  uint64_t                  requestTime;
+  uint64_t                  pingTime;
+
+  // per stage latency accumulated over the FPS interval
+  LG_Lock               latencyLock;
+  struct LatencyStats   latency;
+  atomic_uint_least64_t uploadTime;
+  atomic_uint_least64_t captureTime; // of the uploaded frame in our clock
+  uint64_t              lastPresentTime;
+  unsigned int          repeatCount;
+
+  volatile LGClientStats * stats;
+
   atomic_uint_least64_t frameTime;
   uint64_t              lastFrameTime;
   uint64_t              renderTime;
   atomic_uint_least64_t frameCount;
   uint64_t              renderCount;
 
+  // just in time rendering, all in microseconds
+  uint64_t     jitLastPresent; // when the last render returned, a vblank with vsync
+  uint64_t     jitPeriod;      // the estimated refresh period
+  uint64_t     jitBudget;      // how long before the vblank to start rendering
+  uint64_t     jitTarget;      // the vblank the current render is aiming for
+  unsigned int jitHits;
+
+  // with present feedback the timing of each render is known afterwards
+  bool                  presentFeedback;
+  uint64_t              renderSeq;
+  struct PendingPresent presentQueue[PRESENT_QUEUE_LEN];
+  unsigned int          presentHead, presentCount;
+
+  // the latency probe, the outstanding serial is zero if there is none
+  uint64_t              probeNext;
+  atomic_uint           probeSerial;
+  atomic_uint_least64_t probeSent;   // when the outstanding probe was sent
+  atomic_uint_least64_t probeUpload; // probeSent of the upload that answered it
+  atomic_uint           probeUnanswered;
+  Histogram             probeHist;   // the round trips, render thread only
+  uint64_t              probeReport;
+
 
   uint64_t resizeTimeout;
   bool     resizeDone;
@@ -124,9 +211,21 @@ struct AppState
   KeybindHandle kbMouseSensInc;
   KeybindHandle kbMouseSensDec;
   KeybindHandle kbCtrlAltFn[12];
+  KeybindHandle kbTrace;
+
+  // set to write the trace out from the main loop
+  volatile bool traceDump;
+
+  // set by the spice thread once it has connected
+  atomic_bool   spiceReady;
 
   int   mouseSens;
   float sensX, sensY;
+
+  // the motion not yet sent to the guest, see queueMouseMotion
+  int      motionX, motionY;
+  uint64_t motionNext; // when the next motion may be sent
+  bool     motionWake; // an event was left queued to wake the main loop
 };
 
 struct AppParams
@@ -136,6 +235,13 @@ struct AppParams
   bool         keepAspect;
   bool         forceAspect;
   bool         dontUpscale;
+  bool         hostScale;
+  int          hostScalePct;
+  struct
+  {
+    unsigned int x, y, w, h;
+  }
+  hostCrop;
   bool         borderless;
   bool         fullscreen;
   bool         maximize;
@@ -144,13 +250,19 @@ struct AppParams
   int          x, y;
   unsigned int w, h;
   int          fpsMin;
+  bool         jitRender;
+  int          jitMargin;
+  bool         vrr;
+  int          maxFPS;
   bool         showFPS;
+  bool         headless;
   bool         useSpiceInput;
   bool         useSpiceClipboard;
   const char * spiceHost;
   unsigned int spicePort;
   bool         clipboardToVM;
   bool         clipboardToLocal;
+  bool         clipboardShm;
   bool         scaleMouseInput;
   bool         hideMouse;
   bool         ignoreQuit;
@@ -165,14 +277,31 @@ struct AppParams
 
   unsigned int cursorPollInterval;
   unsigned int framePollInterval;
+  bool         skipFrames;
   bool         allowDMA;
+  bool         realtime;
+  uint64_t     frameAffinity;
+  uint64_t     renderAffinity;
+  int          readThreads;
+  bool         numaPin;
+  const char * traceFile;
+  const char * statsShm;
+  unsigned int latencyProbe;
+  const char * mosaicDevices;
+  unsigned int mosaicFPS;
+  bool         audio;
+  int          audioLatency;
 
   bool         forceRenderer;
   unsigned int forceRendererIndex;
 
   const char * windowTitle;
   int          mouseSens;
+  int          mouseRate;
+  const char * evdev;
+  bool         shmInput;
   bool         mouseRedraw;
+  bool         localCursor;
 };
 
 struct CBRequest
@@ -0,0 +1,376 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "mosaic.h"
+#include "common/debug.h"
+#include "common/KVMFR.h"
+#include "common/ivshmem.h"
+#include "common/thread.h"
+#include "common/time.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include <lgmp/client.h>
+
+// the host drops a subscriber that leaves a frame in the queue for a second,
+// a limited tile holds the newest frame until it is due so must be faster
+#define MOSAIC_MIN_FPS 2
+
+struct Tile
+{
+  unsigned int   index;
+  char         * path;
+  unsigned int   fps;
+  struct IVSHMEM shm;
+  LGThread     * thread;
+};
+
+struct MosaicState
+{
+  struct Tile         tiles[MOSAIC_MAX_TILES];
+  unsigned int        count;
+  atomic_bool         running;
+
+  const LG_Renderer * lgr;
+  void              * lgrData;
+  LGEvent           * wake;
+};
+
+static struct MosaicState mosaic = { 0 };
+
+unsigned int mosaic_init(const char * devices, unsigned int fps)
+{
+  if (!devices || !*devices)
+    return 0;
+
+  char * list = strdup(devices);
+  if (!list)
+  {
+    DEBUG_ERROR("out of memory");
+    return 0;
+  }
+
+  char * save;
+  for(char * dev = strtok_r(list, ",", &save); dev;
+      dev = strtok_r(NULL, ",", &save))
+  {
+    if (mosaic.count == MOSAIC_MAX_TILES)
+    {
+      DEBUG_WARN("Only %d mosaic devices are supported", MOSAIC_MAX_TILES);
+      break;
+    }
+
+    struct Tile * tile = &mosaic.tiles[mosaic.count];
+    tile->fps = fps;
+
+    char * rate = strrchr(dev, '@');
+    if (rate)
+    {
+      *rate = '\0';
+      char * end;
+      tile->fps = strtoul(rate + 1, &end, 10);
+      if (*end)
+      {
+        DEBUG_ERROR("Invalid mosaic rate: %s", rate + 1);
+        goto fail;
+      }
+    }
+
+    if (tile->fps && tile->fps < MOSAIC_MIN_FPS)
+    {
+      DEBUG_WARN("The rate of %s is raised to the minimum of %d", dev,
+          MOSAIC_MIN_FPS);
+      tile->fps = MOSAIC_MIN_FPS;
+    }
+
+    if (!ivshmemOpenDev(&tile->shm, dev))
+    {
+      DEBUG_ERROR("Failed to map the mosaic device: %s", dev);
+      goto fail;
+    }
+
+    tile->index = mosaic.count++;
+    tile->path  = strdup(dev);
+    DEBUG_INFO("Mosaic tile %u   : %s (%u fps)", tile->index, dev, tile->fps);
+  }
+
+  free(list);
+  return mosaic.count;
+
+fail:
+  free(list);
+  mosaic_free();
+  return 0;
+}
+
+void mosaic_free()
+{
+  mosaic_stop();
+  for(unsigned int i = 0; i < mosaic.count; ++i)
+  {
+    ivshmemClose(&mosaic.tiles[i].shm);
+    free(mosaic.tiles[i].path);
+  }
+  memset(mosaic.tiles, 0, sizeof(mosaic.tiles));
+  mosaic.count = 0;
+}
+
+static bool tileFormat(struct Tile * tile, const KVMFRFrame * frame)
+{
+  LG_RendererFormat format =
+  {
+    .type         = frame->type,
+    .width        = frame->width,
+    .height       = frame->height,
+    .screenWidth  = frame->screenWidth,
+    .screenHeight = frame->screenHeight,
+    .stride       = frame->stride,
+    .pitch        = frame->pitch
+  };
+
+  switch(frame->type)
+  {
+    case FRAME_TYPE_RGBA:
+    case FRAME_TYPE_BGRA:
+    case FRAME_TYPE_RGBA10:
+      format.bpp = 32;
+      break;
+
+    case FRAME_TYPE_RGBA16F:
+      format.bpp = 64;
+      break;
+
+    case FRAME_TYPE_YUV420:
+      format.bpp = 12;
+      break;
+
+    default:
+      DEBUG_ERROR("%s: Unsupported frameType", tile->path);
+      return false;
+  }
+
+  DEBUG_INFO("%s: Format: %s %ux%u", tile->path, FrameTypeStr[frame->type],
+      frame->width, frame->height);
+
+  return mosaic.lgr->on_tile_format(mosaic.lgrData, tile->index, format);
+}
+
+// returns 1 if the host restarted, 0 when stopped and -1 on failure
+static int tileSession(struct Tile * tile, PLGMPClient lgmp)
+{
+  LGMP_STATUS status;
+  uint32_t    udataSize;
+  KVMFR     * udata;
+
+  while(atomic_load(&mosaic.running))
+  {
+    if ((status = lgmpClientSessionInit(lgmp, &udataSize, (uint8_t **)&udata))
+        == LGMP_OK)
+      break;
+
+    if (status != LGMP_ERR_INVALID_SESSION && status != LGMP_ERR_INVALID_MAGIC)
+    {
+      DEBUG_ERROR("%s: lgmpClientSessionInit: %s", tile->path,
+          lgmpStatusString(status));
+      return -1;
+    }
+
+    usleep(100000);
+  }
+
+  if (!atomic_load(&mosaic.running))
+    return 0;
+
+  if (udataSize != sizeof(KVMFR) ||
+      memcmp(udata->magic, KVMFR_MAGIC, sizeof(udata->magic)) != 0 ||
+      udata->version != KVMFR_VERSION)
+  {
+    DEBUG_ERROR("%s: The host application is not compatible with this client",
+        tile->path);
+    return -1;
+  }
+
+  // the aux queue never holds back the client of the VM itself, frames are
+  // skipped instead so each one is shown whole
+  PLGMPClientQueue queue;
+  while(atomic_load(&mosaic.running))
+  {
+    if ((status = lgmpClientSubscribe(lgmp, LGMP_Q_FRAME_AUX, &queue))
+        == LGMP_OK)
+      break;
+
+    if (status != LGMP_ERR_NO_SUCH_QUEUE)
+    {
+      DEBUG_ERROR("%s: lgmpClientSubscribe: %s", tile->path,
+          lgmpStatusString(status));
+      return -1;
+    }
+
+    if (!lgmpClientSessionValid(lgmp))
+      return 1;
+
+    usleep(1000);
+  }
+
+  if (!atomic_load(&mosaic.running))
+    return 0;
+
+  DEBUG_INFO("%s: Session started", tile->path);
+
+  int      ret         = 0;
+  bool     formatValid = false;
+  uint32_t formatVer   = 0;
+  uint64_t due         = 0;
+
+  while(atomic_load(&mosaic.running))
+  {
+    // leave the newest frame in the queue until the tile is due
+    const uint64_t now = microtime();
+    if (now < due)
+    {
+      usleep(due - now < 1000 ? due - now : 1000);
+      continue;
+    }
+
+    lgmpClientAdvanceToLast(queue);
+
+    LGMPMessage msg;
+    if ((status = lgmpClientProcess(queue, &msg)) != LGMP_OK)
+    {
+      if (status == LGMP_ERR_QUEUE_EMPTY)
+      {
+        usleep(1000);
+        continue;
+      }
+
+      if (status == LGMP_ERR_INVALID_SESSION)
+        ret = 1;
+      else
+      {
+        DEBUG_ERROR("%s: lgmpClientProcess: %s", tile->path,
+            lgmpStatusString(status));
+        ret = -1;
+      }
+      break;
+    }
+
+    const KVMFRFrame * frame = (const KVMFRFrame *)msg.mem;
+    if (!formatValid || frame->formatVer != formatVer)
+    {
+      if (!tileFormat(tile, frame))
+      {
+        lgmpClientMessageDone(queue);
+        ret = -1;
+        break;
+      }
+
+      formatValid = true;
+      formatVer   = frame->formatVer;
+    }
+
+    const FrameBuffer * fb =
+      (const FrameBuffer *)(((const uint8_t *)frame) + frame->offset);
+    const bool updated =
+      mosaic.lgr->on_tile_frame(mosaic.lgrData, tile->index, fb);
+    lgmpClientMessageDone(queue);
+
+    if (!updated)
+    {
+      DEBUG_ERROR("%s: The renderer failed to update the tile", tile->path);
+      ret = -1;
+      break;
+    }
+
+    lgSignalEvent(mosaic.wake);
+    if (tile->fps)
+      due = now + 1000000 / tile->fps;
+  }
+
+  lgmpClientUnsubscribe(&queue);
+  return ret;
+}
+
+static int tileThread(void * opaque)
+{
+  struct Tile * tile = (struct Tile *)opaque;
+  PLGMPClient   lgmp;
+  LGMP_STATUS   status;
+
+  if ((status = lgmpClientInit(tile->shm.mem, tile->shm.size, &lgmp))
+      != LGMP_OK)
+  {
+    DEBUG_ERROR("%s: lgmpClientInit: %s", tile->path,
+        lgmpStatusString(status));
+    return -1;
+  }
+
+  int ret;
+  while((ret = tileSession(tile, lgmp)) == 1)
+    DEBUG_INFO("%s: Waiting for the host to restart...", tile->path);
+
+  lgmpClientFree(&lgmp);
+  return ret;
+}
+
+bool mosaic_start(const LG_Renderer * lgr, void * lgrData, LGEvent * wake)
+{
+  if (!mosaic.count)
+    return true;
+
+  if (!lgr->on_tile_format || !lgr->on_tile_frame)
+  {
+    DEBUG_WARN("The %s renderer can not show the mosaic devices",
+        lgr->get_name());
+    return false;
+  }
+
+  mosaic.lgr     = lgr;
+  mosaic.lgrData = lgrData;
+  mosaic.wake    = wake;
+  atomic_store(&mosaic.running, true);
+
+  for(unsigned int i = 0; i < mosaic.count; ++i)
+  {
+    struct Tile * tile = &mosaic.tiles[i];
+    if (!lgCreateThread("mosaicThread", tileThread, tile, &tile->thread))
+    {
+      DEBUG_ERROR("Failed to create the mosaic thread for %s", tile->path);
+      mosaic_stop();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void mosaic_stop()
+{
+  if (!atomic_exchange(&mosaic.running, false))
+    return;
+
+  for(unsigned int i = 0; i < mosaic.count; ++i)
+    if (mosaic.tiles[i].thread)
+    {
+      lgJoinThread(mosaic.tiles[i].thread, NULL);
+      mosaic.tiles[i].thread = NULL;
+    }
+}
@@ -0,0 +1,41 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "interface/renderer.h"
+#include "common/event.h"
+
+// the most VMs shown alongside the desktop of the primary VM
+#define MOSAIC_MAX_TILES 15
+
+// open the shared memory of each device in the comma separated list, each as
+// path[@fps] where fps limits the updates of that tile. Returns the number of
+// tiles, which is zero if there are none or on failure
+unsigned int mosaic_init(const char * devices, unsigned int fps);
+void mosaic_free();
+
+// start a thread for each tile that gives its frames to the renderer and
+// signals wake, called once the renderer has started
+bool mosaic_start(const LG_Renderer * lgr, void * lgrData, LGEvent * wake);
+
+// stop the threads, the renderer is no longer called once this returns
+void mosaic_stop();
@@ -0,0 +1,216 @@
+/*
+KVMGFX Client - A KVM Client for VGA Passthrough
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "pool.h"
+
+#include "common/debug.h"
+#include "common/locking.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+// objects are carved from blocks of this many at a time
+#define POOL_BLOCK 16
+
+struct PoolBlock
+{
+  struct PoolBlock * next;
+  max_align_t        align[];
+};
+
+struct PoolObj
+{
+  struct PoolObj * next;
+};
+
+struct pool
+{
+  size_t             size;
+  struct PoolBlock * blocks;
+  struct PoolObj   * free;
+  LG_Lock            lock;
+};
+
+static _Thread_local unsigned int threadPoolAllocs = 0;
+
+unsigned int pool_thread_pool_allocs()
+{
+  return threadPoolAllocs;
+}
+
+void pool_count_pool_alloc()
+{
+  ++threadPoolAllocs;
+}
+
+static _Thread_local unsigned int threadHeapAllocs = 0;
+
+unsigned int pool_thread_heap_allocs()
+{
+  return threadHeapAllocs;
+}
+
+#ifdef COUNT_ALLOCS
+// the client is linked with --wrap for these so every call made by its own
+// code lands here, the libraries it loads are not counted
+void * __real_malloc (size_t size);
+void * __real_calloc (size_t nmemb, size_t size);
+void * __real_realloc(void * ptr, size_t size);
+
+void * __wrap_malloc(size_t size)
+{
+  ++threadHeapAllocs;
+  return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t nmemb, size_t size)
+{
+  ++threadHeapAllocs;
+  return __real_calloc(nmemb, size);
+}
+
+void * __wrap_realloc(void * ptr, size_t size)
+{
+  ++threadHeapAllocs;
+  return __real_realloc(ptr, size);
+}
+#endif
+
+static bool pool_grow(struct pool * pool, unsigned int count)
+{
+  struct PoolBlock * block = malloc(sizeof(*block) + pool->size * count);
+  if (!block)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+
+  pool_count_pool_alloc();
+  block->next  = pool->blocks;
+  pool->blocks = block;
+
+  uint8_t * obj = (uint8_t *)block->align;
+  for(unsigned int i = 0; i < count; ++i, obj += pool->size)
+  {
+    struct PoolObj * o = (struct PoolObj *)obj;
+    o->next    = pool->free;
+    pool->free = o;
+  }
+
+  return true;
+}
+
+struct pool * pool_new(size_t size, unsigned int count)
+{
+  struct pool * pool = malloc(sizeof(struct pool));
+  if (!pool)
+  {
+    DEBUG_ERROR("out of memory");
+    return NULL;
+  }
+
+  // every object must hold the free list link and keep the next aligned
+  if (size < sizeof(struct PoolObj))
+    size = sizeof(struct PoolObj);
+  size = (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+  pool->size   = size;
+  pool->blocks = NULL;
+  pool->free   = NULL;
+  LG_LOCK_INIT(pool->lock);
+
+  if (count && !pool_grow(pool, count))
+  {
+    free(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+void pool_free(struct pool * pool)
+{
+  if (!pool)
+    return;
+
+  struct PoolBlock * block = pool->blocks;
+  while(block)
+  {
+    struct PoolBlock * next = block->next;
+    free(block);
+    block = next;
+  }
+
+  LG_LOCK_FREE(pool->lock);
+  free(pool);
+}
+
+void * pool_get(struct pool * pool)
+{
+  LG_LOCK(pool->lock);
+  if (!pool->free && !pool_grow(pool, POOL_BLOCK))
+  {
+    LG_UNLOCK(pool->lock);
+    return NULL;
+  }
+
+  struct PoolObj * obj = pool->free;
+  pool->free = obj->next;
+  LG_UNLOCK(pool->lock);
+
+  return obj;
+}
+
+void pool_put(struct pool * pool, void * obj)
+{
+  if (!obj)
+    return;
+
+  struct PoolObj * o = (struct PoolObj *)obj;
+  LG_LOCK(pool->lock);
+  o->next    = pool->free;
+  pool->free = o;
+  LG_UNLOCK(pool->lock);
+}
+
+void pool_steady_reset(struct PoolSteady * steady)
+{
+  steady->frames     = 0;
+  steady->poolAllocs = threadPoolAllocs;
+  steady->heapAllocs = threadHeapAllocs;
+}
+
+void pool_steady_frame(struct PoolSteady * steady)
+{
+#ifndef NDEBUG
+  if (steady->frames < POOL_STEADY_FRAMES)
+    ++steady->frames;
+  else if (threadHeapAllocs != steady->heapAllocs ||
+      threadPoolAllocs != steady->poolAllocs)
+  {
+    DEBUG_ERROR("%u heap allocations, %u pool or list allocations in a steady "
+        "frame", threadHeapAllocs - steady->heapAllocs,
+        threadPoolAllocs - steady->poolAllocs);
+    assert(threadHeapAllocs == steady->heapAllocs);
+    assert(threadPoolAllocs == steady->poolAllocs);
+  }
+#endif
+  steady->poolAllocs = threadPoolAllocs;
+  steady->heapAllocs = threadHeapAllocs;
+}
@@ -0,0 +1,79 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "stats.h"
+#include "common/debug.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static const char * statsName = NULL;
+
+volatile LGClientStats * stats_open(const char * name)
+{
+  // readable by monitoring agents running as other users
+  const int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+  if (fd < 0)
+  {
+    DEBUG_ERROR("Failed to open the stats shared memory %s: %s", name,
+        strerror(errno));
+    return NULL;
+  }
+
+  if (ftruncate(fd, sizeof(LGClientStats)) != 0)
+  {
+    DEBUG_ERROR("Failed to size the stats shared memory: %s", strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+
+  void * map = mmap(NULL, sizeof(LGClientStats), PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED)
+  {
+    DEBUG_ERROR("Failed to map the stats shared memory: %s", strerror(errno));
+    shm_unlink(name);
+    return NULL;
+  }
+
+  volatile LGClientStats * stats = (volatile LGClientStats *)map;
+  memset(map, 0, sizeof(LGClientStats));
+  stats->version = LG_CLIENT_STATS_VERSION;
+  stats->size    = sizeof(LGClientStats);
+
+  statsName = name;
+  DEBUG_INFO("Statistics shm   : %s", name);
+  return stats;
+}
+
+void stats_close(volatile LGClientStats * stats)
+{
+  if (!stats)
+    return;
+
+  munmap((void *)stats, sizeof(LGClientStats));
+  shm_unlink(statsName);
+  statsName = NULL;
+}
@@ -0,0 +1,52 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LG_CLIENT_STATS_VERSION 2
+
+// counters the client keeps for external monitoring in a POSIX shared memory
+// object named by app:statsShm, these only ever grow unless noted, a reader
+// must check the version and that size covers the fields it wants as later
+// versions only append fields
+typedef struct LGClientStats
+{
+  uint32_t version;         // LG_CLIENT_STATS_VERSION
+  uint32_t size;            // sizeof(LGClientStats) for the version
+  uint64_t updateTime;      // client microtime of the last update
+  uint64_t framesReceived;  // frames taken from the frame queue
+  uint64_t framesPresented; // new frames presented
+  uint64_t framesDropped;   // frames replaced before they were presented
+  uint64_t framesRepeated;  // presents without a new frame
+  uint64_t bytesUploaded;   // frame data passed to the renderer
+  uint64_t uploadTime;      // microseconds spent uploading frames
+  uint64_t frameWaitTime;   // microseconds the frame thread waited for frames
+  uint64_t restarts;        // times the host session was lost and reconnected
+
+  // version 2
+  uint64_t framesSkipped;   // frames passed over without being uploaded
+}
+LGClientStats;
+
+// create the shared memory object, returns NULL on failure
+volatile LGClientStats * stats_open(const char * name);
+void stats_close(volatile LGClientStats * stats);
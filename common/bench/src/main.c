@@ -0,0 +1,444 @@
+/*
+KVMGFX Client - A KVM Client for VGA Passthrough
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Measures the copy kernels and the framebuffer protocol over the sizes,
+ * pitches and alignments the frames use, into normal memory, hugepages and
+ * optionally the real IVSHMEM device.
+ */
+
+#include "common/debug.h"
+#include "common/option.h"
+#include "common/copy.h"
+#include "common/framebuffer.h"
+#include "common/ivshmem.h"
+#include "common/time.h"
+#include "common/version.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+#define PAGE_SIZE     4096
+
+struct Region
+{
+  const char * name;
+  uint8_t    * mem;
+  size_t       size;
+  bool         mapped;
+};
+
+struct Size
+{
+  unsigned int width, height;
+};
+
+static const struct Size sizes[] =
+{
+  { 1280,  720 },
+  { 1920, 1080 },
+  { 2560, 1440 },
+  { 3840, 2160 }
+};
+
+// the offsets of the buffer on the CPU side, page aligned, aligned for SSE
+// only and not aligned at all
+static const unsigned int aligns[] = { 0, 16, 3 };
+
+#define BPP   4
+#define COUNT(x) (sizeof(x) / sizeof(*(x)))
+
+static struct Option options[] =
+{
+  {
+    .module         = "bench",
+    .name           = "iterations",
+    .description    = "How many times each case is run, the median is reported",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 20
+  },
+  {
+    .module         = "bench",
+    .name           = "threads",
+    .description    = "The most framebuffer_write threads to try, doubling from 1",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 4
+  },
+  {
+    .module         = "bench",
+    .name           = "hugepages",
+    .description    = "Also measure hugepage backed memory",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = true
+  },
+  {
+    .module         = "bench",
+    .name           = "ivshmem",
+    .description    = "Also measure this IVSHMEM file or kvmfr device, this overwrites its contents so the host must not be running",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "bench",
+    .name           = "csv",
+    .description    = "Also write the results to this CSV file",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {0}
+};
+
+enum Kernel
+{
+  KERNEL_MEMCPY,
+  KERNEL_COPY,
+  KERNEL_WRITE,
+  KERNEL_READ,
+  KERNEL_READ_FN,
+  KERNEL_READ_SWIZZLE
+};
+
+struct Case
+{
+  enum Kernel          kernel;
+  const char         * name;
+  const struct Region* region;
+  struct Size          size;
+  size_t               pitch;
+  unsigned int         align;
+  int                  threads;
+
+  uint8_t            * cpu;     // the buffer on the CPU side
+  FrameBuffer        * fb;      // the frame in the region
+};
+
+static int    iterations;
+static FILE * csv;
+static uint64_t * times;
+
+static bool readFn(void * opaque, const void * src, size_t size)
+{
+  uint8_t ** dst = (uint8_t **)opaque;
+  memcpy(*dst, src, size);
+  *dst += size;
+  return true;
+}
+
+static bool runOnce(const struct Case * c)
+{
+  const size_t size  = c->pitch * c->size.height;
+  uint8_t * fbData   = (uint8_t *)c->fb + FrameBufferStructSize;
+
+  switch(c->kernel)
+  {
+    case KERNEL_MEMCPY:
+      memcpy(fbData, c->cpu, size);
+      return true;
+
+    case KERNEL_COPY:
+      copy_stream(fbData, c->cpu, size);
+      return true;
+
+    case KERNEL_WRITE:
+      framebuffer_prepare(c->fb);
+      return framebuffer_write(c->fb, c->cpu, size);
+
+    case KERNEL_READ:
+      return framebuffer_read(c->fb, c->cpu, c->pitch, c->size.height,
+          c->size.width, BPP, c->pitch);
+
+    case KERNEL_READ_FN:
+    {
+      uint8_t * dst = c->cpu;
+      return framebuffer_read_fn(c->fb, c->size.height, c->size.width, BPP,
+          c->pitch, readFn, &dst);
+    }
+
+    case KERNEL_READ_SWIZZLE:
+      return framebuffer_read_convert(c->fb, c->cpu, c->pitch, c->size.height,
+          c->size.width, c->pitch, COPY_CONVERT_SWIZZLE);
+  }
+
+  return false;
+}
+
+static int compareTimes(const void * a, const void * b)
+{
+  const uint64_t ta = *(const uint64_t *)a;
+  const uint64_t tb = *(const uint64_t *)b;
+  return ta < tb ? -1 : ta > tb;
+}
+
+static void runCase(const struct Case * c)
+{
+  // the reads need a complete frame to read from
+  if (c->kernel == KERNEL_READ || c->kernel == KERNEL_READ_FN ||
+      c->kernel == KERNEL_READ_SWIZZLE)
+  {
+    framebuffer_prepare(c->fb);
+    framebuffer_write(c->fb, c->cpu, c->pitch * c->size.height);
+  }
+
+  // once to fault in the pages
+  if (!runOnce(c))
+  {
+    DEBUG_ERROR("%s failed", c->name);
+    return;
+  }
+
+  for(int i = 0; i < iterations; ++i)
+  {
+    const uint64_t start = nanotime();
+    runOnce(c);
+    times[i] = nanotime() - start;
+  }
+
+  qsort(times, iterations, sizeof(*times), compareTimes);
+  const uint64_t median = times[iterations / 2];
+  const size_t   bytes  = (size_t)c->size.width * BPP * c->size.height;
+  const double   gbps   = (double)bytes / median;
+  const double   perRow = (double)median / c->size.height;
+
+  fprintf(stdout, "%-16s %-8s %4ux%-4u pitch %5zu align %2u threads %d: "
+      "%6.2f GB/s %8.1f ns/row\n",
+      c->name, c->region->name, c->size.width, c->size.height, c->pitch,
+      c->align, c->threads, gbps, perRow);
+
+  if (csv)
+    fprintf(csv, "%s,%s,%u,%u,%zu,%u,%d,%.3f,%.1f\n",
+      c->name, c->region->name, c->size.width, c->size.height, c->pitch,
+      c->align, c->threads, gbps, perRow);
+}
+
+static void runRegion(const struct Region * region, uint8_t * cpu,
+    int maxThreads)
+{
+  const char * defaultCopy = copy_implName();
+
+  for(unsigned int s = 0; s < COUNT(sizes); ++s)
+  {
+    const size_t tight  = (size_t)sizes[s].width * BPP;
+    const size_t padded = ((tight + 255) & ~(size_t)255) + 256;
+
+    struct Case c =
+    {
+      .region  = region,
+      .size    = sizes[s],
+      .threads = 1,
+      // the data lands on a page boundary as the host lays it out
+      .fb      = (FrameBuffer *)(region->mem + PAGE_SIZE - FrameBufferStructSize)
+    };
+
+    if (PAGE_SIZE + padded * sizes[s].height > region->size)
+    {
+      DEBUG_WARN("%s is too small for %ux%u, skipped", region->name,
+          sizes[s].width, sizes[s].height);
+      continue;
+    }
+
+    for(unsigned int a = 0; a < COUNT(aligns); ++a)
+    {
+      c.align = aligns[a];
+      c.cpu   = cpu + aligns[a];
+      c.pitch = tight;
+
+      c.kernel = KERNEL_MEMCPY;
+      c.name   = "memcpy";
+      runCase(&c);
+
+      c.kernel = KERNEL_COPY;
+      const char * impl;
+      for(unsigned int i = 0; (impl = copy_implAt(i)); ++i)
+      {
+        if (!copy_setImpl(impl))
+          continue;
+
+        char name[32];
+        snprintf(name, sizeof(name), "copy %s", impl);
+        c.name = name;
+        runCase(&c);
+      }
+      copy_setImpl(defaultCopy);
+
+      c.kernel = KERNEL_WRITE;
+      c.name   = "fb_write";
+      for(int t = 1; t <= maxThreads; t *= 2)
+      {
+        if (!framebuffer_set_write_threads(t, 0))
+          continue;
+        c.threads = t;
+        runCase(&c);
+      }
+      framebuffer_set_write_threads(1, 0);
+      c.threads = 1;
+
+      // the pitch only matters when reading row by row
+      const size_t pitches[] = { tight, padded };
+      for(unsigned int p = 0; p < COUNT(pitches); ++p)
+      {
+        c.pitch  = pitches[p];
+        c.kernel = KERNEL_READ;
+        c.name   = "fb_read";
+        runCase(&c);
+
+        c.kernel = KERNEL_READ_FN;
+        c.name   = "fb_read_fn";
+        runCase(&c);
+
+        c.kernel = KERNEL_READ_SWIZZLE;
+        c.name   = "fb_read_swizzle";
+        runCase(&c);
+      }
+    }
+  }
+}
+
+static bool allocRegion(struct Region * region, const char * name, size_t size,
+    bool huge)
+{
+  region->name = name;
+  if (huge)
+  {
+    size = (size + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+    void * mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+      DEBUG_WARN("Failed to map %zu MiB of hugepages, are any reserved?",
+          size / 1048576);
+      return false;
+    }
+
+    region->mem    = (uint8_t *)mem;
+    region->mapped = true;
+  }
+  else
+  {
+    region->mem    = (uint8_t *)aligned_alloc(PAGE_SIZE, size);
+    region->mapped = false;
+    if (!region->mem)
+    {
+      DEBUG_ERROR("Failed to allocate %zu MiB", size / 1048576);
+      return false;
+    }
+  }
+
+  region->size = size;
+  memset(region->mem, 0, size);
+  return true;
+}
+
+static void freeRegion(struct Region * region)
+{
+  if (region->mapped)
+    munmap(region->mem, region->size);
+  else
+    free(region->mem);
+  region->mem = NULL;
+}
+
+int main(int argc, char * argv[])
+{
+  DEBUG_INFO("Looking Glass (%s) - Copy Benchmark", BUILD_VERSION);
+
+  option_register(options);
+
+  if (!option_parse(argc, argv) || !option_validate())
+  {
+    option_free();
+    return -1;
+  }
+
+  iterations = option_get_int("bench", "iterations");
+  if (iterations < 1)
+    iterations = 1;
+
+  const int maxThreads = option_get_int("bench", "threads");
+  const char * csvPath = option_get_string("bench", "csv");
+  int ret = -1;
+
+  // the largest frame with the padded pitch, and the offset into the page
+  const size_t frameSize = PAGE_SIZE + (3840 * BPP + 512) * 2160;
+
+  times = (uint64_t *)malloc(sizeof(*times) * iterations);
+  uint8_t * cpu = (uint8_t *)aligned_alloc(PAGE_SIZE, frameSize + PAGE_SIZE);
+  if (!times || !cpu)
+  {
+    DEBUG_ERROR("Out of memory");
+    goto out;
+  }
+  memset(cpu, 0xA5, frameSize + PAGE_SIZE);
+
+  if (csvPath)
+  {
+    if (!(csv = fopen(csvPath, "w")))
+    {
+      DEBUG_ERROR("Failed to open the CSV file: %s", csvPath);
+      goto out;
+    }
+    fprintf(csv, "kernel,memory,width,height,pitch,align,threads,gbps,ns_per_row\n");
+  }
+
+  DEBUG_INFO("Copy Default     : %s", copy_implName());
+
+  struct Region region;
+  if (allocRegion(&region, "ram", frameSize, false))
+  {
+    runRegion(&region, cpu, maxThreads);
+    freeRegion(&region);
+  }
+
+  if (option_get_bool("bench", "hugepages") &&
+      allocRegion(&region, "hugepage", frameSize, true))
+  {
+    runRegion(&region, cpu, maxThreads);
+    freeRegion(&region);
+  }
+
+  const char * shmPath = option_get_string("bench", "ivshmem");
+  if (shmPath)
+  {
+    struct IVSHMEM shm;
+    if (ivshmemOpenDev(&shm, shmPath))
+    {
+      region = (struct Region)
+      {
+        .name = "ivshmem",
+        .mem  = (uint8_t *)shm.mem,
+        .size = shm.size
+      };
+      runRegion(&region, cpu, maxThreads);
+      ivshmemClose(&shm);
+    }
+  }
+
+  ret = 0;
+
+out:
+  framebuffer_set_write_threads(1, 0);
+  if (csv)
+    fclose(csv);
+  free(cpu);
+  free(times);
+  option_free();
+  return ret;
+}
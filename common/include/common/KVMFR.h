@@ -23,8 +23,26 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #define LGMP_Q_POINTER     1
 #define LGMP_Q_FRAME       2
 
-#define LGMP_Q_FRAME_LEN   2
+// frames for consumers that must not hold back the interactive client, the
+// host only posts here once the prior frame is done with so frames are
+// skipped and the damage rects of each frame must be ignored
+#define LGMP_Q_FRAME_AUX   3
+
+// the guest clipboard, see KVMFRClipboard
+#define LGMP_Q_CLIPBOARD   4
+
+// the guest audio output, see KVMFRAudio
+#define LGMP_Q_AUDIO       5
+
+// the most frame buffers the host may use, also the length of the frame queues
+#define LGMP_Q_FRAME_LEN   8
 #define LGMP_Q_POINTER_LEN 20
+#define LGMP_Q_CLIPBOARD_LEN 2
+#define LGMP_Q_AUDIO_LEN   16
+
+// ivshmem doorbell vectors rung by the host after posting
+#define KVMFR_IRQ_POINTER  0
+#define KVMFR_IRQ_FRAME    1
 
 typedef enum FrameType
 {
@@ -34,6 +52,7 @@ typedef enum FrameType
   FRAME_TYPE_RGBA10    , // RGBA interleaved: R,G,B,A 10,10,10,2 bpp
   FRAME_TYPE_RGBA16F   , // RGBA interleaved: R,G,B,A 16,16,16,16 bpp float
   FRAME_TYPE_YUV420    , // YUV420
+  FRAME_TYPE_H264      , // H.264 Annex B access unit, pitch is its size
   FRAME_TYPE_MAX       , // sentinel value
 }
 FrameType;
@@ -44,7 +63,8 @@ enum
 {
   CURSOR_FLAG_POSITION = 0x1,
   CURSOR_FLAG_VISIBLE  = 0x2,
-  CURSOR_FLAG_SHAPE    = 0x4
+  CURSOR_FLAG_SHAPE    = 0x4,
+  CURSOR_FLAG_CACHED   = 0x8  // the shape data was sent before for cacheID
 };
 typedef uint32_t KVMFRCursorFlags;
 
@@ -57,35 +77,240 @@ typedef enum CursorType
 CursorType;
 
 #define KVMFR_MAGIC   "KVMFR---"
-#define KVMFR_VERSION 5
+#define KVMFR_VERSION 27
+
+#define KVMFR_MAX_DAMAGE_RECTS 64
+
+// the number of cursor shapes the client keeps, see KVMFRCursor.cacheID
+#define KVMFR_CURSOR_CACHE 8
+
+// the shared memory the host reserves at the end of the device for requests
+// from the client, this is outside of the LGMP heap
+#define KVMFR_REQUEST_SIZE 8192
+
+// the offset into the request area of the KVMFRCursorPos written by the host,
+// kept away from the KVMFRRequest so the two sides do not share a cache line
+#define KVMFR_CURSOR_POS_OFFSET 2048
+
+// the offset into the request area of the KVMFRStats written by the host
+#define KVMFR_STATS_OFFSET 3072
+#define KVMFR_STATS_VERSION 2
+
+// the offset into the request area of the KVMFRInput ring
+#define KVMFR_INPUT_OFFSET 4096
+
+// the length of the KVMFRInput ring, a power of two
+#define KVMFR_INPUT_LEN 64
+
+// the host advances KVMFRInput.hostSerial at least this often in
+// microseconds while it injects input, if it stops the client uses SPICE
+#define KVMFR_INPUT_TIMEOUT (50 * 1000)
+
+// the offset into the request area of the KVMFRClipboardRequest
+#define KVMFR_CLIPBOARD_OFFSET 6144
+
+enum
+{
+  KVMFR_FLAG_DOORBELL = 0x1  // the host rings KVMFR_IRQ_FRAME and KVMFR_IRQ_POINTER
+};
 
 typedef struct KVMFR
 {
   char     magic[8];
   uint32_t version;
   char     hostver[32];
+  uint32_t requestOffset; // offset from the start of shared memory to the KVMFRRequest
+  uint32_t cursorPosOffset; // offset from the start of shared memory to the KVMFRCursorPos
+  uint32_t statsOffset; // offset from the start of shared memory to the KVMFRStats
+  uint32_t inputOffset; // offset from the start of shared memory to the KVMFRInput, zero if the host does not inject input
+  uint32_t clipboardOffset; // offset from the start of shared memory to the KVMFRClipboardRequest, zero if the host does not sync the clipboard
+  uint32_t flags; // KVMFR_FLAG_*
 }
 KVMFR;
 
+typedef struct KVMFRRequest
+{
+  uint32_t serial;        // incremented by the client after each change
+  uint32_t targetWidth;   // the size the client displays the frame at,
+  uint32_t targetHeight;  // zero for the native resolution
+  uint32_t maxFPS;        // the most frames per second the client can show, zero for no limit
+  uint32_t frameTypes;    // mask of 1 << FrameType the client can show natively, zero for unknown
+  uint32_t preferredType; // the FrameType the client prefers, FRAME_TYPE_INVALID for none
+  uint32_t cropX;         // the region of the guest desktop to capture,
+  uint32_t cropY;         // a zero width or height for the host's
+  uint32_t cropWidth;     // configured region
+  uint32_t cropHeight;
+  uint32_t traceSerial;   // incremented by the client to ask the host to write its trace
+
+  // clock calibration, the client writes pingTime and then increments
+  // pingSerial, the host echoes both back in the next frame it posts
+  uint32_t pingSerial;
+  uint64_t pingTime;      // client microtime when the ping was sent
+
+  // latency probe, incremented by the client, the host tags the first frame
+  // it captures after seeing the change with the new value
+  uint32_t probeSerial;
+}
+KVMFRRequest;
+
+// the latest cursor position and visibility, these are not queued but are
+// overwritten in place by the host, the serial is odd while it is writing
+typedef struct KVMFRCursorPos
+{
+  uint32_t serial;
+  int16_t  x, y;
+  uint32_t visible;
+}
+KVMFRCursorPos;
+
+// counters the host keeps for external monitoring, these only ever grow
+// unless noted, a reader must check the version and that size covers the
+// fields it wants as later versions only append fields
+typedef struct KVMFRStats
+{
+  uint32_t version;        // KVMFR_STATS_VERSION
+  uint32_t size;           // sizeof(KVMFRStats) for the version
+  uint64_t updateTime;     // host microtime of the last update
+  uint64_t framesCaptured; // frames the capture interface produced
+  uint64_t framesPosted;   // frames posted to the frame queues, including repeats
+  uint64_t framesDropped;  // captured frames that could not be posted
+  uint64_t bytesCopied;    // frame data written into shared memory
+  uint64_t copyTime;       // microseconds spent writing frame data
+  uint64_t waitTime;       // microseconds waiting for the capture interface
+  uint64_t bufferWaitTime; // microseconds waiting for a free frame buffer
+  uint64_t reinits;        // times the capture was restarted
+  uint32_t queuePending;   // frames in the frame queue not yet consumed (gauge)
+  uint32_t frameBuffers;   // the number of frame buffers in use (gauge)
+
+  // version 2
+  uint32_t presentInterval; // predicted microseconds between guest presents (gauge)
+  uint32_t reserved;
+  uint64_t presentHits;     // presents that arrived when predicted
+  uint64_t presentMisses;   // presents that did not
+}
+KVMFRStats;
+
+typedef enum KVMFRInputType
+{
+  KVMFR_INPUT_KEY_DOWN     , // code is a PS/2 set 1 scancode as sent to SPICE
+  KVMFR_INPUT_KEY_UP       ,
+  KVMFR_INPUT_MOUSE_PRESS  , // code is a SPICE button, 4 and 5 are the wheel
+  KVMFR_INPUT_MOUSE_RELEASE,
+  KVMFR_INPUT_MOUSE_MOTION   // x and y are the relative motion
+}
+KVMFRInputType;
+
+typedef struct KVMFRInputEvent
+{
+  uint32_t type; // KVMFRInputType
+  uint32_t code;
+  int32_t  x, y;
+}
+KVMFRInputEvent;
+
+// a single producer ring from the client to the host, the client writes an
+// event and then advances head, the host injects it and then advances tail
+typedef struct KVMFRInput
+{
+  uint32_t        hostSerial; // advanced by the host each time it polls
+  uint32_t        tail;
+  uint8_t         hostPad[56];
+  uint32_t        head;
+  uint8_t         clientPad[60];
+  KVMFRInputEvent events[KVMFR_INPUT_LEN];
+}
+KVMFRInput;
+
+typedef enum KVMFRClipboardType
+{
+  KVMFR_CLIPBOARD_TEXT, // UTF-8 with LF line endings
+  KVMFR_CLIPBOARD_PNG ,
+  KVMFR_CLIPBOARD_BMP , // with the BITMAPFILEHEADER
+  KVMFR_CLIPBOARD_TIFF,
+  KVMFR_CLIPBOARD_JPEG
+}
+KVMFRClipboardType;
+
+// posted on LGMP_Q_CLIPBOARD when the guest clipboard changes, the data follows
+typedef struct KVMFRClipboard
+{
+  uint32_t type; // KVMFRClipboardType
+  uint32_t size;
+}
+KVMFRClipboard;
+
+// the clipboard from the client, it writes the data into the host's buffer
+// and then the type and size before it increments serial, the host sets
+// ackSerial to serial once it is done with the buffer
+typedef struct KVMFRClipboardRequest
+{
+  uint64_t bufferOffset; // from the start of shared memory
+  uint32_t bufferSize;
+  uint32_t ackSerial;
+  uint8_t  hostPad[48];
+  uint32_t serial;
+  uint32_t type;         // KVMFRClipboardType
+  uint32_t size;
+}
+KVMFRClipboardRequest;
+
+// the most sample frames and channels of each audio block
+#define KVMFR_AUDIO_MAX_FRAMES   1024
+#define KVMFR_AUDIO_MAX_CHANNELS 8
+
+// posted on LGMP_Q_AUDIO as the guest plays audio, when nothing is playing
+// nothing is posted. The interleaved 32 bit float samples follow
+typedef struct KVMFRAudio
+{
+  uint32_t sampleRate;
+  uint32_t channels;
+  uint32_t frames;
+  uint32_t serial;      // incremented per block, a gap is a dropped block
+  uint64_t captureTime; // host microtime of the first sample, as the frames
+}
+KVMFRAudio;
+
+// the pointer queue only carries shape changes, see KVMFRCursorPos
 typedef struct KVMFRCursor
 {
-  int16_t    x, y;        // cursor x & y position
   CursorType type;        // shape buffer data type
   int8_t     hx, hy;      // shape hotspot x & y
   uint32_t   width;       // width of the shape
   uint32_t   height;      // height of the shape
   uint32_t   pitch;       // row length in bytes of the shape
+  uint32_t   cacheID;     // the cache slot the shape is stored in
 }
 KVMFRCursor;
 
+typedef struct FrameDamageRect
+{
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
+}
+FrameDamageRect;
+
 typedef struct KVMFRFrame
 {
-  uint32_t  formatVer;   // the frame format version number
-  FrameType type;        // the frame data type
-  uint32_t  width;       // the width
-  uint32_t  height;      // the height
-  uint32_t  stride;      // the row stride (zero if compressed data)
-  uint32_t  pitch;       // the row pitch  (stride in bytes or the compressed frame size)
-  uint32_t  offset;      // offset from the start of this header to the FrameBuffer header
+  uint32_t        formatVer;        // the frame format version number
+  FrameType       type;             // the frame data type
+  uint32_t        width;            // the width
+  uint32_t        height;           // the height
+  uint32_t        screenWidth;      // the width of the desktop before any scaling
+  uint32_t        screenHeight;     // the height of the desktop before any scaling
+  uint32_t        stride;           // the row stride (zero if compressed data)
+  uint32_t        pitch;            // the row pitch  (stride in bytes or the compressed frame size)
+  uint64_t        offset;           // offset from the start of this header to the FrameBuffer header
+  uint64_t        presentTime;      // host microtime the guest presented the frame (zero if unknown)
+  uint64_t        captureTime;      // host microtime the capture of the frame completed
+  uint64_t        postTime;         // host microtime the frame was posted to the client
+  uint32_t        pingSerial;       // the last KVMFRRequest pingSerial seen by the host
+  uint64_t        pingClientTime;   // the KVMFRRequest pingTime for pingSerial
+  uint64_t        pingHostTime;     // host microtime the ping was seen
+  uint32_t        frameSerial;      // incremented for each new frame, a repeat keeps the serial
+  uint32_t        probeSerial;      // the KVMFRRequest probeSerial seen before this frame was captured
+  uint32_t        damageRectsCount; // the number of damage rects (zero if the entire frame changed)
+  FrameDamageRect damageRects[KVMFR_MAX_DAMAGE_RECTS]; // the areas changed since the prior frame
 }
 KVMFRFrame;
@@ -0,0 +1,82 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR)
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "common/KVMFR.h"
+
+/*
+ * The interface between an indirect display driver (IddCx) and the IDD
+ * capture of the host. The driver creates a mapping holding a KVMFRIdd, an
+ * auto reset event it signals after each frame, and KVMFR_IDD_TEXTURES named
+ * shared textures on the render adapter that it copies the swapchain into.
+ *
+ * The textures are shared with a keyed mutex, both sides only ever acquire
+ * and release key 0. When the mode changes the driver recreates the
+ * textures before it increments formatVer.
+ *
+ * The frame is published with a sequence, the driver fills in frame then
+ * increments serial, the host copies frame and reads it again if serial
+ * changed while it did.
+ */
+
+#define KVMFR_IDD_MAGIC   "LGIDD---"
+#define KVMFR_IDD_VERSION 1
+
+// in the global namespace as the driver runs as a service
+#define KVMFR_IDD_MAPPING "Global\\LookingGlassIDD"
+#define KVMFR_IDD_EVENT   "Global\\LookingGlassIDDFrame"
+#define KVMFR_IDD_TEXTURE L"Global\\LookingGlassIDDTexture%u"
+
+#define KVMFR_IDD_TEXTURES 3
+
+typedef struct KVMFRIddFrame
+{
+  uint32_t        index;            // the texture the frame is in
+  uint32_t        damageRectsCount; // zero if the entire frame changed
+  FrameDamageRect damageRects[KVMFR_MAX_DAMAGE_RECTS];
+  uint64_t        presentTime;      // the microtime of the present
+}
+KVMFRIddFrame;
+
+typedef struct KVMFRIdd
+{
+  char     magic[8];
+  uint32_t version;
+
+  // written by the driver
+  uint32_t          adapterLuidLow;  // the adapter the textures are on
+  int32_t           adapterLuidHigh;
+  volatile uint32_t formatVer;
+  uint32_t          width, height;
+  uint32_t          format;          // the DXGI_FORMAT of the textures
+  uint32_t          refresh;         // the refresh rate of the mode in Hz
+
+  volatile uint64_t serial;
+  KVMFRIddFrame     frame;
+
+  // written by the host, the mode the client asked for which the driver adds
+  // to the monitor and switches to, zero to leave it to the driver. The
+  // serial is incremented after each request
+  volatile uint32_t requestWidth, requestHeight;
+  volatile uint32_t requestRefresh;
+  volatile uint32_t requestSerial;
+}
+KVMFRIdd;
@@ -0,0 +1,108 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR)
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "common/KVMFR.h"
+
+/*
+ * A recording of the frame and cursor streams the host sent. The file is a
+ * KVMFRRecordHeader followed by records that each start with a KVMFRRecord,
+ * everything is in host byte order and every record is padded to a multiple
+ * of 8 bytes so the file can be memory mapped and walked in place.
+ */
+
+#define KVMFR_RECORD_MAGIC   "LGREC---"
+#define KVMFR_RECORD_VERSION 1
+
+// records start on this alignment
+#define KVMFR_RECORD_ALIGN 8
+
+typedef struct KVMFRRecordHeader
+{
+  char     magic[8];
+  uint32_t version;      // KVMFR_RECORD_VERSION
+  uint32_t kvmfrVersion; // the KVMFR_VERSION of the stream that was recorded
+  char     hostver[32];  // the host version that sent the stream
+  uint64_t startTime;    // the microtime the recording started
+}
+KVMFRRecordHeader;
+
+typedef enum KVMFRRecordType
+{
+  KVMFR_RECORD_FRAME       , // KVMFRRecordFrame
+  KVMFR_RECORD_CURSOR_SHAPE, // KVMFRRecordCursor
+  KVMFR_RECORD_CURSOR_POS    // KVMFRCursorPos
+}
+KVMFRRecordType;
+
+typedef struct KVMFRRecord
+{
+  uint32_t type;   // KVMFRRecordType
+  uint32_t size;   // the size of the record including this header and padding
+  uint64_t time;   // microseconds since the recording started
+}
+KVMFRRecord;
+
+typedef enum KVMFRRecordPayload
+{
+  KVMFR_PAYLOAD_NONE  , // only the header and damage were recorded
+  KVMFR_PAYLOAD_FULL  , // dataSize bytes of frame data
+  KVMFR_PAYLOAD_DAMAGE, // the rows of each damage rect, width * bpp bytes each
+  KVMFR_PAYLOAD_TILES   // the tiles of the damage rects (the whole frame if
+                        // none) each as a TileHeader and its coded data, in
+                        // the order of tilecodec_tile. Only for 4 bpp
+}
+KVMFRRecordPayload;
+
+// followed by the damage rects and then the payload
+typedef struct KVMFRRecordFrame
+{
+  uint32_t formatVer;
+  uint32_t type;             // FrameType
+  uint32_t width;
+  uint32_t height;
+  uint32_t screenWidth;
+  uint32_t screenHeight;
+  uint32_t stride;
+  uint32_t pitch;
+  uint32_t dataSize;         // the size of the whole frame data
+  uint32_t payload;          // KVMFRRecordPayload
+  uint32_t bpp;              // bytes per pixel for a damage payload
+  uint32_t damageRectsCount; // zero if the entire frame changed
+}
+KVMFRRecordFrame;
+
+// followed by height * pitch bytes of shape data
+typedef struct KVMFRRecordCursor
+{
+  uint32_t type;             // CursorType
+  int32_t  hx, hy;
+  uint32_t width;
+  uint32_t height;
+  uint32_t pitch;
+}
+KVMFRRecordCursor;
+
+static inline uint32_t kvmfrRecordSize(uint64_t size)
+{
+  return (uint32_t)((size + KVMFR_RECORD_ALIGN - 1) &
+      ~(uint64_t)(KVMFR_RECORD_ALIGN - 1));
+}
@@ -0,0 +1,68 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR)
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "common/KVMFRRecord.h"
+
+/*
+ * The stream looking-glass-relay sends to the Relay capture of a remote host.
+ * It is a sequence of messages that each start with a KVMFRRelayMsg, the
+ * first is always KVMFR_RELAY_HELLO. Everything is in host byte order, both
+ * ends must be the same architecture.
+ *
+ * A frame is sent as a KVMFR_RELAY_FRAME followed by KVMFR_RELAY_FRAME_DATA
+ * messages holding the payload in order, cursor messages may be sent between
+ * them so the cursor is not held up behind a large frame. A message may end
+ * part way through a row of a raw payload, but always holds whole tiles of a
+ * KVMFR_PAYLOAD_TILES payload.
+ */
+
+#define KVMFR_RELAY_MAGIC   "LGRELAY-"
+#define KVMFR_RELAY_VERSION 1
+
+#define KVMFR_RELAY_PORT 5910
+
+typedef enum KVMFRRelayType
+{
+  KVMFR_RELAY_HELLO       , // KVMFRRelayHello
+  KVMFR_RELAY_FRAME       , // KVMFRRecordFrame, the damage rects
+  KVMFR_RELAY_FRAME_DATA  , // the next part of the frame payload
+  KVMFR_RELAY_CURSOR_SHAPE, // KVMFRRecordCursor, height * pitch bytes of shape
+  KVMFR_RELAY_CURSOR_POS    // KVMFRCursorPos
+}
+KVMFRRelayType;
+
+typedef struct KVMFRRelayMsg
+{
+  uint32_t type; // KVMFRRelayType
+  uint32_t size; // the size of the message after this header
+}
+KVMFRRelayMsg;
+
+typedef struct KVMFRRelayHello
+{
+  char     magic[8];
+  uint32_t version;      // KVMFR_RELAY_VERSION
+  uint32_t kvmfrVersion; // the KVMFR_VERSION of the host being relayed
+  char     hostver[32];  // the version of the host being relayed
+  uint32_t maxFrameSize; // the size of the host's frame buffers
+}
+KVMFRRelayHello;
@@ -0,0 +1,64 @@
+/*
+KVMGFX Client - A KVM Client for VGA Passthrough
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * Copy size bytes using non-temporal (streaming) loads and stores, this is
+ * intended for large copies into or out of the shared memory. The widest
+ * implementation the CPU supports is selected on first use.
+ *
+ * The stores are fenced before returning so the data is visible before any
+ * following progress update.
+ */
+void copy_stream(void * dst, const void * src, size_t size);
+
+/**
+ * Get the name of the selected implementation
+ */
+const char * copy_implName();
+
+/**
+ * Get the name of the implementation at index, NULL past the last one. This
+ * is intended for benchmarking, use copy_setImpl to select it
+ */
+const char * copy_implAt(unsigned int index);
+
+/**
+ * Force the named implementation, returns false if it is unknown or the CPU
+ * does not support it
+ */
+bool copy_setImpl(const char * name);
+
+typedef enum CopyConvert
+{
+  COPY_CONVERT_NONE,   // copy the pixels as they are
+  COPY_CONVERT_SWIZZLE // swap red and blue of 32 bit BGRA or RGBA
+}
+CopyConvert;
+
+/**
+ * Convert count 32 bit pixels from src into dst in a single pass using the
+ * widest implementation the CPU supports. Unlike copy_stream the stores are
+ * cached as the destination is usually read again soon.
+ */
+void copy_convert(void * dst, const void * src, size_t count, CopyConvert conv);
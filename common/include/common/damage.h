@@ -0,0 +1,52 @@
+/*
+KVMGFX Client - A KVM Client for VGA Passthrough
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include "common/KVMFR.h"
+
+typedef struct FrameDamage
+{
+  bool            full;  // the entire frame is damaged
+  unsigned int    count; // the number of rects if not full
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+}
+FrameDamage;
+
+/**
+ * Clear the damage, nothing has changed
+ */
+void damage_reset(FrameDamage * damage);
+
+/**
+ * Mark the entire frame as damaged
+ */
+void damage_set_full(FrameDamage * damage);
+
+/**
+ * Add the rects to the damage, a count of zero damages the entire frame
+ */
+void damage_add(FrameDamage * damage, const FrameDamageRect * rects,
+    unsigned int count);
+
+/**
+ * Merge the damage in src into damage
+ */
+void damage_merge(FrameDamage * damage, const FrameDamage * src);
@@ -23,10 +23,37 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "common/KVMFR.h"
+#include "common/copy.h"
+
 typedef struct stFrameBuffer FrameBuffer;
 
+/* the most tiles of a tiled frame, see framebuffer_prepare_tiled */
+#define FB_MAX_TILES 512
+
+typedef struct FrameBufferTiles
+{
+  uint32_t     serial;        // the serial the frame is being written in
+  unsigned int cols, rows;    // the tiles across and down, row major
+  unsigned int width, height; // the pixels of each, less at the edges
+}
+FrameBufferTiles;
+
 typedef bool (*FrameBufferReadFn)(void * opaque, const void * src, size_t size);
 
+typedef struct FrameBufferStats
+{
+  // the wait thresholds in microseconds
+  unsigned int spinTime, yieldTime, waitLimit;
+
+  // the number of waits satisfied in each tier, and those that timed out
+  uint64_t spin, yield, sleep, timeout;
+
+  // the total time spent waiting in microseconds
+  uint64_t waitTime;
+}
+FrameBufferStats;
+
 /**
  * The size of the FrameBuffer struct
  */
@@ -35,7 +62,12 @@ extern const size_t FrameBufferStructSize;
 /**
  * Wait for the framebuffer to fill to the specified size
  */
-void framebuffer_wait(const FrameBuffer * frame, size_t size);
+bool framebuffer_wait(const FrameBuffer * frame, size_t size);
+
+/**
+ * Get the reader wait statistics for tuning
+ */
+void framebuffer_get_stats(FrameBufferStats * stats);
 
 /**
  * Read data from the KVMFRFrame into the dst buffer
@@ -43,18 +75,111 @@ void framebuffer_wait(const FrameBuffer * frame, size_t size);
 bool framebuffer_read(const FrameBuffer * frame, void * dst, size_t dstpitch,
     size_t height, size_t width, size_t bpp, size_t pitch);
 
+/**
+ * Read only the damaged rects from the KVMFRFrame into the dst buffer
+ */
+bool framebuffer_read_rects(const FrameBuffer * frame, void * dst,
+    size_t dstpitch, size_t bpp, size_t pitch, const FrameDamageRect * rects,
+    unsigned int count);
+
 /**
  * Read data from the KVMFRFrame using a callback
  */
 bool framebuffer_read_fn(const FrameBuffer * frame, size_t height, size_t width,
     size_t bpp, size_t pitch, FrameBufferReadFn fn, void * opaque);
 
+/**
+ * Read the KVMFRFrame into the dst buffer converting each row as it is
+ * copied, the frame and dst are both 32 bits per pixel, see copy_convert
+ */
+bool framebuffer_read_convert(const FrameBuffer * frame, void * dst,
+    size_t dstpitch, size_t height, size_t width, size_t pitch,
+    CopyConvert conv);
+
 /**
  * Prepare the framebuffer for writing
  */
 void framebuffer_prepare(FrameBuffer * frame);
 
+/**
+ * Prepare the framebuffer for writing in fixed size tiles that may complete in
+ * any order, each marked with the serial it was last written in. Only the
+ * tiles covering the rects are rewritten, or all of them if count is zero or
+ * the layout changed, the rest keep their contents and serial. The pixels
+ * stay in rows of pitch bytes so only packed formats can be tiled
+ */
+void framebuffer_prepare_tiled(FrameBuffer * frame, uint32_t serial,
+    size_t width, size_t height, size_t bpp, size_t pitch,
+    const FrameDamageRect * rects, unsigned int count);
+
+/**
+ * Get the tile layout, false if the frame is linear
+ */
+bool framebuffer_get_tiles(const FrameBuffer * frame, FrameBufferTiles * tiles);
+
+/**
+ * Get the serial the tile was last written in, false while it is being
+ * rewritten
+ */
+bool framebuffer_tile_serial(const FrameBuffer * frame, unsigned int index,
+    uint32_t * serial);
+
+/**
+ * Write one tile of a tiled frame from the whole image in src, which has the
+ * pitch of the frame. Any thread may write any pending tile
+ */
+void framebuffer_write_tile(FrameBuffer * frame, const void * src,
+    unsigned int index);
+
+/**
+ * Set how many bytes framebuffer_write copies between progress updates
+ */
+void framebuffer_set_write_chunk(size_t size);
+
+/**
+ * Split framebuffer_write across count threads including the caller, each
+ * worker is pinned to the next CPU in the affinity mask if it is non zero.
+ * A count of 1 or less stops the workers. Must not be called while a write
+ * is in progress
+ */
+bool framebuffer_set_write_threads(int count, uint64_t affinity);
+
+/**
+ * Split framebuffer_read across count threads including the caller, each
+ * copies its own stripe of the destination as soon as the producer has
+ * written it. The workers are pinned like framebuffer_set_write_threads. A
+ * count of 1 or less stops the workers. Concurrent reads from other threads
+ * are done without them while they are busy. Must not be called while a read
+ * is in progress
+ */
+bool framebuffer_set_read_threads(int count, uint64_t affinity);
+
+/**
+ * Get a pointer to the frame data, the caller must use framebuffer_wait
+ * before accessing it
+ */
+const uint8_t * framebuffer_get_data(const FrameBuffer * frame);
+
+/**
+ * Get a pointer to the frame data for writing it directly, the writer must
+ * then call framebuffer_set_write_ptr to publish the progress
+ */
+uint8_t * framebuffer_get_write_data(FrameBuffer * frame);
+
+/**
+ * Publish that size bytes of the frame data have been written
+ */
+void framebuffer_set_write_ptr(FrameBuffer * frame, size_t size);
+
 /**
  * Write data from the src buffer into the KVMFRFrame
  */
 bool framebuffer_write(FrameBuffer * frame, const void * src, size_t size);
+
+/**
+ * Write only the damaged rects from the src buffer into the KVMFRFrame, the
+ * remainder of the frame must already hold the prior contents
+ */
+bool framebuffer_write_rects(FrameBuffer * frame, const void * src,
+    size_t pitch, size_t height, size_t bpp, const FrameDamageRect * rects,
+    unsigned int count);
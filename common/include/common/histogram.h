@@ -0,0 +1,61 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * A histogram with buckets that grow with the value, each power of two is
+ * split into HISTOGRAM_SUB_BUCKETS linear buckets so every recorded value is
+ * within about 6% of the value reported for its bucket.
+ */
+
+#define HISTOGRAM_SUB_BITS    4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS     ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct Histogram
+{
+  uint64_t count;
+  uint64_t max;
+  uint32_t buckets[HISTOGRAM_BUCKETS];
+}
+Histogram;
+
+/**
+ * Remove every sample
+ */
+void histogram_reset(Histogram * hist);
+
+/**
+ * Record a sample
+ */
+void histogram_add(Histogram * hist, uint64_t value);
+
+/**
+ * Add the samples in src to hist
+ */
+void histogram_merge(Histogram * hist, const Histogram * src);
+
+/**
+ * The value that percentile (0 to 100) of the samples are at or below, this
+ * is the top of the bucket the sample fell in and is never above the max
+ */
+uint64_t histogram_percentile(const Histogram * hist, double percentile);
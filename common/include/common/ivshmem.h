@@ -38,6 +38,17 @@ bool ivshmemOpenDev(struct IVSHMEM * dev, const char * shmDev);
 void ivshmemClose(struct IVSHMEM * dev);
 void ivshmemFree(struct IVSHMEM * dev);
 
+/* the NUMA node the memory is on, -1 if it is not known */
+int ivshmemGetNode(struct IVSHMEM * dev);
+
 /* Linux KVMFR support only for now (VM->VM) */
 bool ivshmemHasDMA   (struct IVSHMEM * dev);
 int  ivshmemGetDMABuf(struct IVSHMEM * dev, uint64_t offset, uint64_t size);
+
+/* ivshmem-doorbell support, rings the configured peer (Windows only for now) */
+bool ivshmemCanRing     (struct IVSHMEM * dev, unsigned int vector);
+bool ivshmemRingDoorbell(struct IVSHMEM * dev, unsigned int vector);
+
+/* Linux KVMFR ivshmem-doorbell support, timeout is in milliseconds */
+bool ivshmemHasIRQ (struct IVSHMEM * dev, unsigned int vector);
+bool ivshmemWaitIRQ(struct IVSHMEM * dev, unsigned int vector, unsigned int timeout);
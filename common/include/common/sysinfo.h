@@ -17,8 +17,14 @@ this program; if not, write to the Free Software Foundation, Inc., 59 Temple
 Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
+#include <stdint.h>
+
 // returns the maximum number of multisamples supported by the system
 int sysinfo_gfx_max_multisample();
 
 // returns the page size
-long sysinfo_getPageSize();
\ No newline at end of file
+long sysinfo_getPageSize();
+
+// returns a mask of the CPUs (the first 64 only) on the NUMA node, 0 if the
+// node is not known
+uint64_t sysinfo_getNodeCPUs(int node);
@@ -20,9 +20,26 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct LGThread LGThread;
 typedef int (*LGThreadFunction)(void * opaque);
 
+typedef enum LGThreadPriority
+{
+  LG_THREAD_PRIORITY_NORMAL,
+  LG_THREAD_PRIORITY_CAPTURE, // a real-time capture task, MMCSS "Capture"
+  LG_THREAD_PRIORITY_PRESENT  // a real-time presentation task, MMCSS "Games"
+}
+LGThreadPriority;
+
 bool lgCreateThread(const char * name, LGThreadFunction function, void * opaque, LGThread ** handle);
 bool lgJoinThread  (LGThread * handle, int * resultCode);
+
+// restrict the thread to the CPUs set in the mask, a mask of 0 is a no-op, a
+// NULL handle is the calling thread
+bool lgThreadSetAffinity(LGThread * handle, uint64_t mask);
+
+// set the scheduling of the calling thread, if real-time scheduling is not
+// permitted a raised time shared priority is used instead
+bool lgThreadSetPriority(LGThreadPriority priority);
@@ -0,0 +1,81 @@
+/*
+KVMGFX Client - A KVM Client for VGA Passthrough
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "common/KVMFR.h"
+
+/*
+ * A lossless codec for tiles of 32 bit pixels. Each row is coded as runs of
+ * pixels that repeat the one to the left, match the row above or are sent
+ * as is, desktop content is mostly the first two. A tile has no state from
+ * outside of it so the tiles of a frame can be coded in parallel, and is
+ * decoded in place into the destination image.
+ */
+
+// the most pixels on either side of a tile
+#define TILECODEC_SIZE 64
+
+// the header of a coded tile, followed by size bytes of coded data
+typedef struct TileHeader
+{
+  uint16_t x, y;
+  uint16_t width, height;
+  uint32_t size;
+}
+TileHeader;
+
+/**
+ * The number of tiles the rects are split into, a count of zero is the
+ * entire frame
+ */
+unsigned int tilecodec_count(const FrameDamageRect * rects, unsigned int count,
+    unsigned int width, unsigned int height);
+
+/**
+ * Get the tile at index of the split of the rects, as tilecodec_count
+ */
+FrameDamageRect tilecodec_tile(const FrameDamageRect * rects,
+    unsigned int count, unsigned int width, unsigned int height,
+    unsigned int index);
+
+/**
+ * The largest the coded data of a tile can be
+ */
+static inline size_t tilecodec_maxSize(unsigned int width, unsigned int height)
+{
+  return (size_t)height * (1 + (size_t)width * 4);
+}
+
+/**
+ * Code the tile at src into dst, which must hold tilecodec_maxSize bytes.
+ * Returns the size of the coded data
+ */
+size_t tilecodec_encode(const uint8_t * src, size_t pitch, unsigned int width,
+    unsigned int height, uint8_t * dst);
+
+/**
+ * Decode the tile into dst, false if the data is not a valid tile of this
+ * size. On failure the tile in dst is left part way through
+ */
+bool tilecodec_decode(const uint8_t * src, size_t size, uint8_t * dst,
+    size_t pitch, unsigned int width, unsigned int height);
@@ -48,8 +48,17 @@ static inline uint64_t microtime()
 #endif
 }
 
-#if !defined(_WIN32)
-//FIXME: make win32 versions
+#if defined(_WIN32)
+uint64_t nanotime();
+
+// sleeps on a high resolution timer and spins out the remainder so short waits
+// are honoured without raising the system timer resolution
+void nsleep(uint64_t ns);
+
+// a waitable timer private to the calling thread, high resolution if the OS
+// supports it
+HANDLE lgGetThreadTimer();
+#else
 static inline uint64_t nanotime()
 {
   struct timespec time;
@@ -0,0 +1,82 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "common/time.h"
+
+/*
+ * A low overhead trace of where the time goes on the hot paths. Each thread
+ * records into its own ring so recording never takes a lock, and the rings
+ * can be written out as Chrome trace JSON which chrome://tracing and
+ * Perfetto can load.
+ *
+ * While tracing is disabled a scope costs a single relaxed load.
+ */
+
+// the number of events each thread keeps, older events are overwritten
+#define LG_TRACE_EVENTS 8192
+
+extern atomic_bool lgTraceEnabled;
+
+typedef struct LGTraceScope
+{
+  const char * name;
+  uint64_t     start;
+}
+LGTraceScope;
+
+// enable tracing, the process name and id label the events when exported
+void lgTraceInit(const char * process, int pid);
+
+// the dumped timestamps are moved by this many microseconds, this lets one
+// side convert its events into the other's clock so both traces line up
+void lgTraceSetClockOffset(int64_t offset);
+
+// name the calling thread's ring, called for threads made by lgCreateThread
+void lgTraceSetThreadName(const char * name);
+
+// return the calling thread's ring for reuse by a later thread
+void lgTraceThreadExit();
+
+void lgTraceRecord(const char * name, uint64_t start, uint64_t end);
+
+// write every ring out to path as Chrome trace JSON
+bool lgTraceDump(const char * path);
+
+static inline bool lgTraceActive()
+{
+  return atomic_load_explicit(&lgTraceEnabled, memory_order_relaxed);
+}
+
+// the name must be a string literal or otherwise outlive the trace
+static inline LGTraceScope lgTraceBegin(const char * name)
+{
+  return (LGTraceScope){ .name = name, .start = lgTraceActive() ? microtime() : 0 };
+}
+
+static inline void lgTraceEnd(const LGTraceScope scope)
+{
+  if (scope.start)
+    lgTraceRecord(scope.name, scope.start, microtime());
+}
@@ -26,5 +26,6 @@ const char * FrameTypeStr[FRAME_TYPE_MAX] =
   "FRAME_TYPE_RGBA",
   "FRAME_TYPE_RGBA10",
   "FRAME_TYPE_RGBA16F",
-  "FRAME_TYPE_YUV420"
+  "FRAME_TYPE_YUV420",
+  "FRAME_TYPE_H264"
 };
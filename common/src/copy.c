@@ -0,0 +1,317 @@
+/*
+KVMGFX Client - A KVM Client for VGA Passthrough
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "common/copy.h"
+#include "common/debug.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <immintrin.h>
+
+typedef void (*CopyFn)(void * dst, const void * src, size_t size);
+
+static void copy_resolve(void * dst, const void * src, size_t size);
+
+static CopyFn       copyFn   = copy_resolve;
+static const char * copyName = NULL;
+
+#define ALIGNED(x, a) (((uintptr_t)(x) & ((a) - 1)) == 0)
+
+__attribute__((target("sse4.1")))
+static void copy_sse(void * dst, const void * src, size_t size)
+{
+  uint8_t       * d = (uint8_t *)dst;
+  const uint8_t * s = (const uint8_t *)src;
+
+  if (ALIGNED(d, 16) && ALIGNED(s, 16))
+  {
+    for(; size > 63; size -= 64, s += 64, d += 64)
+    {
+      __m128i v1 = _mm_stream_load_si128((__m128i *)s + 0);
+      __m128i v2 = _mm_stream_load_si128((__m128i *)s + 1);
+      __m128i v3 = _mm_stream_load_si128((__m128i *)s + 2);
+      __m128i v4 = _mm_stream_load_si128((__m128i *)s + 3);
+      _mm_stream_si128((__m128i *)d + 0, v1);
+      _mm_stream_si128((__m128i *)d + 1, v2);
+      _mm_stream_si128((__m128i *)d + 2, v3);
+      _mm_stream_si128((__m128i *)d + 3, v4);
+    }
+    _mm_sfence();
+  }
+  else
+  {
+    for(; size > 63; size -= 64, s += 64, d += 64)
+    {
+      __m128i v1 = _mm_loadu_si128((__m128i *)s + 0);
+      __m128i v2 = _mm_loadu_si128((__m128i *)s + 1);
+      __m128i v3 = _mm_loadu_si128((__m128i *)s + 2);
+      __m128i v4 = _mm_loadu_si128((__m128i *)s + 3);
+      _mm_storeu_si128((__m128i *)d + 0, v1);
+      _mm_storeu_si128((__m128i *)d + 1, v2);
+      _mm_storeu_si128((__m128i *)d + 2, v3);
+      _mm_storeu_si128((__m128i *)d + 3, v4);
+    }
+  }
+
+  if (size)
+    memcpy(d, s, size);
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(void * dst, const void * src, size_t size)
+{
+  uint8_t       * d = (uint8_t *)dst;
+  const uint8_t * s = (const uint8_t *)src;
+
+  if (ALIGNED(d, 32) && ALIGNED(s, 32))
+  {
+    for(; size > 127; size -= 128, s += 128, d += 128)
+    {
+      __m256i v1 = _mm256_stream_load_si256((__m256i *)s + 0);
+      __m256i v2 = _mm256_stream_load_si256((__m256i *)s + 1);
+      __m256i v3 = _mm256_stream_load_si256((__m256i *)s + 2);
+      __m256i v4 = _mm256_stream_load_si256((__m256i *)s + 3);
+      _mm256_stream_si256((__m256i *)d + 0, v1);
+      _mm256_stream_si256((__m256i *)d + 1, v2);
+      _mm256_stream_si256((__m256i *)d + 2, v3);
+      _mm256_stream_si256((__m256i *)d + 3, v4);
+    }
+    _mm_sfence();
+  }
+  else
+  {
+    for(; size > 127; size -= 128, s += 128, d += 128)
+    {
+      __m256i v1 = _mm256_loadu_si256((__m256i *)s + 0);
+      __m256i v2 = _mm256_loadu_si256((__m256i *)s + 1);
+      __m256i v3 = _mm256_loadu_si256((__m256i *)s + 2);
+      __m256i v4 = _mm256_loadu_si256((__m256i *)s + 3);
+      _mm256_storeu_si256((__m256i *)d + 0, v1);
+      _mm256_storeu_si256((__m256i *)d + 1, v2);
+      _mm256_storeu_si256((__m256i *)d + 2, v3);
+      _mm256_storeu_si256((__m256i *)d + 3, v4);
+    }
+  }
+  _mm256_zeroupper();
+
+  if (size)
+    copy_sse(d, s, size);
+}
+
+__attribute__((target("avx512f")))
+static void copy_avx512(void * dst, const void * src, size_t size)
+{
+  uint8_t       * d = (uint8_t *)dst;
+  const uint8_t * s = (const uint8_t *)src;
+
+  if (ALIGNED(d, 64) && ALIGNED(s, 64))
+  {
+    for(; size > 255; size -= 256, s += 256, d += 256)
+    {
+      __m512i v1 = _mm512_stream_load_si512((__m512i *)s + 0);
+      __m512i v2 = _mm512_stream_load_si512((__m512i *)s + 1);
+      __m512i v3 = _mm512_stream_load_si512((__m512i *)s + 2);
+      __m512i v4 = _mm512_stream_load_si512((__m512i *)s + 3);
+      _mm512_stream_si512((__m512i *)d + 0, v1);
+      _mm512_stream_si512((__m512i *)d + 1, v2);
+      _mm512_stream_si512((__m512i *)d + 2, v3);
+      _mm512_stream_si512((__m512i *)d + 3, v4);
+    }
+    _mm_sfence();
+  }
+  else
+  {
+    for(; size > 255; size -= 256, s += 256, d += 256)
+    {
+      __m512i v1 = _mm512_loadu_si512((__m512i *)s + 0);
+      __m512i v2 = _mm512_loadu_si512((__m512i *)s + 1);
+      __m512i v3 = _mm512_loadu_si512((__m512i *)s + 2);
+      __m512i v4 = _mm512_loadu_si512((__m512i *)s + 3);
+      _mm512_storeu_si512((__m512i *)d + 0, v1);
+      _mm512_storeu_si512((__m512i *)d + 1, v2);
+      _mm512_storeu_si512((__m512i *)d + 2, v3);
+      _mm512_storeu_si512((__m512i *)d + 3, v4);
+    }
+  }
+  _mm256_zeroupper();
+
+  if (size)
+    copy_sse(d, s, size);
+}
+
+static const struct
+{
+  const char * name;
+  CopyFn       fn;
+}
+copyImpls[] =
+{
+  { "AVX-512", copy_avx512 },
+  { "AVX2"   , copy_avx2   },
+  { "SSE4.1" , copy_sse    }
+};
+
+#define COPY_IMPLS (sizeof(copyImpls) / sizeof(*copyImpls))
+
+// __builtin_cpu_supports needs a literal so the features are checked here
+static bool copy_supported(unsigned int i)
+{
+  __builtin_cpu_init();
+  switch(i)
+  {
+    case 0: return __builtin_cpu_supports("avx512f");
+    case 1: return __builtin_cpu_supports("avx2");
+    case 2: return true;
+  }
+  return false;
+}
+
+static void copy_select()
+{
+  // the SSE4.1 version is the baseline and always used as the fallback
+  unsigned int i = 0;
+  while(i < COPY_IMPLS - 1 && !copy_supported(i))
+    ++i;
+
+  copyName = copyImpls[i].name;
+  copyFn   = copyImpls[i].fn;
+
+  DEBUG_INFO("Copy Method      : %s", copyName);
+}
+
+static void copy_resolve(void * dst, const void * src, size_t size)
+{
+  copy_select();
+  copyFn(dst, src, size);
+}
+
+void copy_stream(void * dst, const void * src, size_t size)
+{
+  copyFn(dst, src, size);
+}
+
+const char * copy_implName()
+{
+  if (!copyName)
+    copy_select();
+
+  return copyName;
+}
+
+const char * copy_implAt(unsigned int index)
+{
+  if (index >= COPY_IMPLS)
+    return NULL;
+
+  return copyImpls[index].name;
+}
+
+bool copy_setImpl(const char * name)
+{
+  for(unsigned int i = 0; i < COPY_IMPLS; ++i)
+    if (strcmp(copyImpls[i].name, name) == 0)
+    {
+      if (!copy_supported(i))
+        return false;
+
+      copyName = copyImpls[i].name;
+      copyFn   = copyImpls[i].fn;
+      return true;
+    }
+
+  return false;
+}
+
+static inline uint32_t swizzle_pixel(uint32_t p)
+{
+  return (p & 0xFF00FF00) | ((p & 0xFF) << 16) | ((p >> 16) & 0xFF);
+}
+
+static void convert_swizzle_c(uint32_t * d, const uint32_t * s, size_t count)
+{
+  for(size_t i = 0; i < count; ++i)
+    d[i] = swizzle_pixel(s[i]);
+}
+
+__attribute__((target("ssse3")))
+static void convert_swizzle_ssse3(uint32_t * d, const uint32_t * s,
+    size_t count)
+{
+  const __m128i mask = _mm_setr_epi8(
+      2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+  for(; count > 3; count -= 4, s += 4, d += 4)
+    _mm_storeu_si128((__m128i *)d,
+        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)s), mask));
+
+  convert_swizzle_c(d, s, count);
+}
+
+__attribute__((target("avx2")))
+static void convert_swizzle_avx2(uint32_t * d, const uint32_t * s,
+    size_t count)
+{
+  const __m256i mask = _mm256_setr_epi8(
+      2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+      2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+  for(; count > 15; count -= 16, s += 16, d += 16)
+  {
+    __m256i v1 = _mm256_loadu_si256((const __m256i *)s + 0);
+    __m256i v2 = _mm256_loadu_si256((const __m256i *)s + 1);
+    _mm256_storeu_si256((__m256i *)d + 0, _mm256_shuffle_epi8(v1, mask));
+    _mm256_storeu_si256((__m256i *)d + 1, _mm256_shuffle_epi8(v2, mask));
+  }
+  _mm256_zeroupper();
+
+  convert_swizzle_ssse3(d, s, count);
+}
+
+typedef void (*SwizzleFn)(uint32_t * d, const uint32_t * s, size_t count);
+
+static SwizzleFn swizzleFn = NULL;
+
+static void convert_select()
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    swizzleFn = convert_swizzle_avx2;
+  else if (__builtin_cpu_supports("ssse3"))
+    swizzleFn = convert_swizzle_ssse3;
+  else
+    swizzleFn = convert_swizzle_c;
+}
+
+void copy_convert(void * dst, const void * src, size_t count, CopyConvert conv)
+{
+  if (!swizzleFn)
+    convert_select();
+
+  switch(conv)
+  {
+    case COPY_CONVERT_NONE:
+      memcpy(dst, src, count * 4);
+      break;
+
+    case COPY_CONVERT_SWIZZLE:
+      swizzleFn((uint32_t *)dst, (const uint32_t *)src, count);
+      break;
+  }
+}
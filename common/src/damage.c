@@ -0,0 +1,98 @@
+/*
+KVMGFX Client - A KVM Client for VGA Passthrough
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "common/damage.h"
+
+static inline bool rectContains(const FrameDamageRect * a,
+    const FrameDamageRect * b)
+{
+  return
+    b->x >= a->x && b->x + b->width  <= a->x + a->width &&
+    b->y >= a->y && b->y + b->height <= a->y + a->height;
+}
+
+void damage_reset(FrameDamage * damage)
+{
+  damage->full  = false;
+  damage->count = 0;
+}
+
+void damage_set_full(FrameDamage * damage)
+{
+  damage->full  = true;
+  damage->count = 0;
+}
+
+static void damage_add_rect(FrameDamage * damage, const FrameDamageRect * rect)
+{
+  if (rect->width == 0 || rect->height == 0)
+    return;
+
+  unsigned int out = 0;
+  for(unsigned int i = 0; i < damage->count; ++i)
+  {
+    // already covered by an existing rect
+    if (rectContains(&damage->rects[i], rect))
+      return;
+
+    // drop existing rects that the new rect covers
+    if (rectContains(rect, &damage->rects[i]))
+      continue;
+
+    damage->rects[out++] = damage->rects[i];
+  }
+  damage->count = out;
+
+  // too many rects, it's cheaper to just copy everything
+  if (damage->count == KVMFR_MAX_DAMAGE_RECTS)
+  {
+    damage_set_full(damage);
+    return;
+  }
+
+  damage->rects[damage->count++] = *rect;
+}
+
+void damage_add(FrameDamage * damage, const FrameDamageRect * rects,
+    unsigned int count)
+{
+  if (damage->full)
+    return;
+
+  if (count == 0)
+  {
+    damage_set_full(damage);
+    return;
+  }
+
+  for(unsigned int i = 0; i < count && !damage->full; ++i)
+    damage_add_rect(damage, rects + i);
+}
+
+void damage_merge(FrameDamage * damage, const FrameDamage * src)
+{
+  if (src->full)
+  {
+    damage_set_full(damage);
+    return;
+  }
+
+  for(unsigned int i = 0; i < src->count && !damage->full; ++i)
+    damage_add_rect(damage, src->rects + i);
+}
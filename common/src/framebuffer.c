@@ -19,120 +19,637 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "common/framebuffer.h"
 #include "common/debug.h"
+#include "common/time.h"
+#include "common/copy.h"
+#include "common/thread.h"
+#include "common/event.h"
+#include "common/trace.h"
 
 #include <string.h>
+#include <stddef.h>
+#include <stdalign.h>
 #include <stdatomic.h>
 #include <emmintrin.h>
-#include <smmintrin.h>
 #include <unistd.h>
 
-#define FB_CHUNK_SIZE 1048576 // 1MB
-#define FB_SPIN_LIMIT 10000   // 10ms
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
+#define FB_CHUNK_SIZE 131072  // 128KB
+
+/* the writer is usually in another VM so there is nothing that can wake us,
+ * instead spin for a short while as the data is normally only moments away,
+ * then yield, and only then fall back to sleeping */
+#define FB_SPIN_TIME  20      // 20us
+#define FB_YIELD_TIME 200     // 200us
+#define FB_WAIT_LIMIT 500000  // 500ms, about what 10000 usleep(1) calls took
+
+/* the most threads framebuffer_write will split a frame across */
+#define FB_MAX_THREADS 8
+
+/* the smallest tile of the tiled layout, the tiles are made taller until the
+ * frame fits in FB_MAX_TILES */
+#define FB_TILE_WIDTH  256
+#define FB_TILE_HEIGHT 64
+
+/* a tile being rewritten has this set along with the serial of its frame */
+#define FB_TILE_PENDING 0x80000000U
 
 struct stFrameBuffer
 {
-  atomic_uint_least32_t wp;
-  uint8_t               data[0];
+  atomic_uint_least64_t wp;
+
+  /* the tiled layout, tileCols is zero if the frame is linear */
+  uint32_t              serial;
+  uint16_t              tileCols, tileRows;
+  uint16_t              tileWidth, tileHeight;
+  uint32_t              width, height, bpp, pitch;
+  atomic_uint_least32_t tiles[FB_MAX_TILES]; // the serial each was written in
+
+  /* the host places the frame so this falls on its alignment, keep the header
+   * a multiple of the cache line so the data can be copied with aligned
+   * non-temporal loads and stores */
+  alignas(64) uint8_t   data[0];
 };
 
-const size_t FrameBufferStructSize = sizeof(FrameBuffer);
+const size_t FrameBufferStructSize = offsetof(FrameBuffer, data);
+
+static size_t fbChunkSize = FB_CHUNK_SIZE;
+
+static struct
+{
+  _Atomic(uint64_t) spin, yield, sleep, timeout;
+  _Atomic(uint64_t) waitTime;
+}
+stats = { 0 };
+
+struct FBWorker
+{
+  LGThread * thread;
+  LGEvent  * start;
+};
+
+struct FBWorkers
+{
+  int             count;
+  struct FBWorker workers[FB_MAX_THREADS];
+  atomic_bool     running;
+  atomic_int      busy;
+};
+
+static struct
+{
+  struct FBWorkers w;
+
+  // the current job, only modified while all the workers are idle
+  FrameBuffer   * frame;
+  const uint16_t* tiles; // the tiles to write instead of chunks if not NULL
+  uint8_t       * dst;
+  const uint8_t * src;
+  size_t          size;
+  size_t          chunk;
+  unsigned int    chunks;
+  atomic_uint     next;
+  atomic_bool   * done;
+  unsigned int    doneSize;
+}
+pool = { 0 };
+
+static struct
+{
+  struct FBWorkers w;
+  atomic_flag      inUse;
+
+  // the current read, only modified while all the workers are idle
+  const FrameBuffer * frame;
+  uint8_t           * dst;
+  size_t              dstpitch, pitch, bpp, linewidth, height;
+  size_t              rows;    // in each stripe
+  unsigned int        stripes; // or tiles of a tiled frame
+  atomic_uint         next;
+  atomic_bool         failed;
+}
+readPool = { .inUse = ATOMIC_FLAG_INIT };
+
+static inline bool fb_ready(const FrameBuffer * frame, size_t size)
+{
+  return atomic_load_explicit(&frame->wp, memory_order_acquire) >= size;
+}
+
+static inline bool fb_tile_ready(const FrameBuffer * frame, size_t index)
+{
+  return !(atomic_load_explicit(&frame->tiles[index], memory_order_acquire) &
+      FB_TILE_PENDING);
+}
+
+static inline bool fb_tiled(const FrameBuffer * frame)
+{
+  return frame->tileCols != 0;
+}
+
+static inline void fb_yield()
+{
+#if defined(_WIN32)
+  SwitchToThread();
+#else
+  sched_yield();
+#endif
+}
+
+typedef bool (*FBReadyFn)(const FrameBuffer * frame, size_t arg);
+
+static inline bool fb_wait_for(const FrameBuffer * frame, FBReadyFn ready,
+    size_t arg)
+{
+  if (ready(frame, arg))
+    return true;
+
+  const uint64_t start = microtime();
+  uint64_t elapsed;
+  _Atomic(uint64_t) * tier;
+
+  /* busy spin */
+  tier = &stats.spin;
+  do
+  {
+    for(int i = 0; i < 64; ++i)
+      _mm_pause();
+
+    if (ready(frame, arg))
+      goto done;
+
+    elapsed = microtime() - start;
+  }
+  while(elapsed < FB_SPIN_TIME);
+
+  /* give up our time slice */
+  tier = &stats.yield;
+  do
+  {
+    fb_yield();
+    if (ready(frame, arg))
+      goto done;
+
+    elapsed = microtime() - start;
+  }
+  while(elapsed < FB_YIELD_TIME);
+
+  /* sleep */
+  tier = &stats.sleep;
+  do
+  {
+    usleep(1);
+    if (ready(frame, arg))
+      goto done;
+
+    elapsed = microtime() - start;
+  }
+  while(elapsed < FB_WAIT_LIMIT);
+
+  atomic_fetch_add_explicit(&stats.timeout, 1, memory_order_relaxed);
+  return false;
+
+done:
+  atomic_fetch_add_explicit(tier, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stats.waitTime, microtime() - start,
+      memory_order_relaxed);
+  return true;
+}
+
+static inline bool fb_wait_tile(const FrameBuffer * frame, size_t index)
+{
+  return fb_wait_for(frame, fb_tile_ready, index);
+}
+
+/* wait for the tiles covering the area, in order */
+static bool fb_wait_area(const FrameBuffer * frame, size_t x, size_t y,
+    size_t width, size_t height)
+{
+  if (!width || !height)
+    return true;
+
+  const size_t tx0 = x / frame->tileWidth;
+  const size_t ty0 = y / frame->tileHeight;
+  if (tx0 >= frame->tileCols || ty0 >= frame->tileRows)
+    return true;
+
+  size_t tx1 = (x + width  - 1) / frame->tileWidth;
+  size_t ty1 = (y + height - 1) / frame->tileHeight;
+  if (tx1 >= frame->tileCols) tx1 = frame->tileCols - 1;
+  if (ty1 >= frame->tileRows) ty1 = frame->tileRows - 1;
+
+  for(size_t ty = ty0; ty <= ty1; ++ty)
+    for(size_t tx = tx0; tx <= tx1; ++tx)
+      if (!fb_wait_tile(frame, ty * frame->tileCols + tx))
+        return false;
+
+  return true;
+}
+
+static bool fb_wait(const FrameBuffer * frame, size_t size)
+{
+  if (!fb_tiled(frame))
+    return fb_wait_for(frame, fb_ready, size);
+
+  /* whole rows of tiles, the data past the last row is not tiled */
+  const size_t rows = (size + frame->pitch - 1) / frame->pitch;
+  return fb_wait_area(frame, 0, 0, frame->width,
+      rows < frame->height ? rows : frame->height);
+}
+
+void framebuffer_get_stats(FrameBufferStats * out)
+{
+  out->spinTime  = FB_SPIN_TIME;
+  out->yieldTime = FB_YIELD_TIME;
+  out->waitLimit = FB_WAIT_LIMIT;
+  out->spin      = atomic_load_explicit(&stats.spin    , memory_order_relaxed);
+  out->yield     = atomic_load_explicit(&stats.yield   , memory_order_relaxed);
+  out->sleep     = atomic_load_explicit(&stats.sleep   , memory_order_relaxed);
+  out->timeout   = atomic_load_explicit(&stats.timeout , memory_order_relaxed);
+  out->waitTime  = atomic_load_explicit(&stats.waitTime, memory_order_relaxed);
+}
+
+bool framebuffer_wait(const FrameBuffer * frame, size_t size)
+{
+  return fb_wait(frame, size);
+}
 
-void framebuffer_wait(const FrameBuffer * frame, size_t size)
+static void fb_workers_stop(struct FBWorkers * p)
 {
-  while(atomic_load_explicit(&frame->wp, memory_order_acquire) < size)
+  atomic_store_explicit(&p->running, false, memory_order_release);
+  for(int i = 0; i < p->count; ++i)
+    lgSignalEvent(p->workers[i].start);
+
+  for(int i = 0; i < p->count; ++i)
   {
-    int spinCount = 0;
-    while(frame->wp < size)
+    lgJoinThread(p->workers[i].thread, NULL);
+    lgFreeEvent(p->workers[i].start);
+  }
+
+  p->count = 0;
+}
+
+/* count includes the calling thread which also takes part in each job */
+static bool fb_workers_start(struct FBWorkers * p, int count,
+    uint64_t affinity, LGThreadFunction fn, const char * name)
+{
+  if (p->count)
+    fb_workers_stop(p);
+
+  count = count > FB_MAX_THREADS + 1 ? FB_MAX_THREADS : count - 1;
+  if (count <= 0)
+    return true;
+
+  /* assign each worker the next cpu in the affinity mask */
+  uint64_t cpus = affinity;
+
+  atomic_store_explicit(&p->running, true, memory_order_release);
+  for(int i = 0; i < count; ++i)
+  {
+    struct FBWorker * w = &p->workers[i];
+    if (!(w->start = lgCreateEvent(true, 0)))
+    {
+      DEBUG_ERROR("Failed to create the %s event", name);
+      fb_workers_stop(p);
+      return false;
+    }
+
+    if (!lgCreateThread(name, fn, w, &w->thread))
+    {
+      DEBUG_ERROR("Failed to create the %s thread", name);
+      lgFreeEvent(w->start);
+      fb_workers_stop(p);
+      return false;
+    }
+
+    ++p->count;
+
+    if (affinity)
     {
-      if (++spinCount == FB_SPIN_LIMIT)
-        return;
-      usleep(1);
+      if (!cpus)
+        cpus = affinity;
+
+      const uint64_t cpu = cpus & -cpus;
+      cpus &= ~cpu;
+      lgThreadSetAffinity(w->thread, cpu);
     }
   }
+
+  return true;
 }
 
-bool framebuffer_read(const FrameBuffer * frame, void * restrict dst,
+static inline void fb_workers_run(struct FBWorkers * p)
+{
+  atomic_store_explicit(&p->busy, p->count, memory_order_release);
+  for(int i = 0; i < p->count; ++i)
+    lgSignalEvent(p->workers[i].start);
+}
+
+/* the job can not be changed until every worker has stopped claiming */
+static inline void fb_workers_wait(struct FBWorkers * p)
+{
+  while(atomic_load_explicit(&p->busy, memory_order_acquire) > 0)
+    _mm_pause();
+}
+
+/* copy the tiles as they complete in whatever order they are written */
+static bool fb_read_tiled(const FrameBuffer * frame, uint8_t * restrict dst,
     size_t dstpitch, size_t height, size_t width, size_t bpp, size_t pitch)
 {
-  uint8_t * restrict d     = (uint8_t*)dst;
-  uint_least32_t rp        = 0;
-  size_t         y         = 0;
-  const size_t   linewidth = width * bpp;
-  const size_t   blocks    = linewidth / 64;
-  const size_t   left      = linewidth % 64;
+  if (height > frame->height) height = frame->height;
+  if (width  > frame->width ) width  = frame->width;
+  if (!width || !height)
+    return true;
 
-  while(y < height)
-  {
-    uint_least32_t wp;
-    int spinCount = 0;
+  const size_t rows  = (height + frame->tileHeight - 1) / frame->tileHeight;
+  const size_t cols  = (width  + frame->tileWidth  - 1) / frame->tileWidth;
+  const size_t count = rows * cols;
+
+  uint64_t copied[FB_MAX_TILES / 64] = { 0 };
+  size_t   left  = count;
+  size_t   first = 0; // the first tile not yet copied
 
-    /* spinlock */
-    wp = atomic_load_explicit(&frame->wp, memory_order_acquire);
-    while(wp - rp < linewidth)
+  while(left)
+  {
+    bool progress = false;
+    for(size_t i = first; i < count; ++i)
     {
-      if (++spinCount == FB_SPIN_LIMIT)
-        return false;
+      if (copied[i / 64] & (1ULL << (i % 64)))
+        continue;
+
+      const size_t tx    = i % cols;
+      const size_t ty    = i / cols;
+      const size_t index = ty * frame->tileCols + tx;
+      if (!fb_tile_ready(frame, index))
+        continue;
 
-      usleep(1);
-      wp = atomic_load_explicit(&frame->wp, memory_order_acquire);
+      const size_t x = tx * frame->tileWidth;
+      const size_t y = ty * frame->tileHeight;
+      const size_t w = (width  - x > frame->tileWidth  ? frame->tileWidth  : width  - x) * bpp;
+      const size_t h =  height - y > frame->tileHeight ? frame->tileHeight : height - y;
+
+      for(size_t r = y; r < y + h; ++r)
+        copy_stream(dst + r * dstpitch + x * bpp,
+            frame->data + r * pitch + x * bpp, w);
+
+      copied[i / 64] |= 1ULL << (i % 64);
+      progress = true;
+      --left;
     }
 
+    if (progress)
+      continue;
+
+    /* nothing was ready, wait on the first that is still to come */
+    while(copied[first / 64] & (1ULL << (first % 64)))
+      ++first;
+
+    const size_t index = (first / cols) * frame->tileCols + first % cols;
+    if (!fb_wait_tile(frame, index))
+      return false;
+  }
+
+  return true;
+}
+
+/* copy stripe or tile i of the current read once the producer has written it */
+static bool fb_read_item(unsigned int i)
+{
+  const FrameBuffer * frame = readPool.frame;
+  size_t y, h, x = 0, w = readPool.linewidth;
+
+  if (fb_tiled(frame))
+  {
+    const size_t cols = (readPool.linewidth + frame->tileWidth - 1) /
+      frame->tileWidth;
+    const size_t tx   = i % cols;
+    const size_t ty   = i / cols;
+    if (!fb_wait_tile(frame, ty * frame->tileCols + tx))
+      return false;
+
+    x = tx * frame->tileWidth;
+    y = ty * frame->tileHeight;
+    if (w - x > frame->tileWidth)
+      w = frame->tileWidth;
+    else
+      w -= x;
+    h = readPool.height - y > frame->tileHeight ?
+      frame->tileHeight : readPool.height - y;
+
+    x *= readPool.bpp;
+    w *= readPool.bpp;
+  }
+  else
+  {
+    y = i * readPool.rows;
+    h = readPool.height - y > readPool.rows ? readPool.rows :
+      readPool.height - y;
+
+    /* follow the producer, the last row of the stripe implies the rest */
+    if (!fb_wait(frame, (y + h - 1) * readPool.pitch + w))
+      return false;
+
     _mm_mfence();
-    __m128i * restrict s = (__m128i *)(frame->data + rp);
-    for(int i = 0; i < blocks; ++i)
-    {
-      __m128i *_d = (__m128i *)d;
-      __m128i *_s = (__m128i *)s;
-      __m128i v1 = _mm_stream_load_si128(_s + 0);
-      __m128i v2 = _mm_stream_load_si128(_s + 1);
-      __m128i v3 = _mm_stream_load_si128(_s + 2);
-      __m128i v4 = _mm_stream_load_si128(_s + 3);
-
-      _mm_storeu_si128(_d + 0, v1);
-      _mm_storeu_si128(_d + 1, v2);
-      _mm_storeu_si128(_d + 2, v3);
-      _mm_storeu_si128(_d + 3, v4);
-
-      d += 64;
-      s += 4;
-    }
+  }
+
+  for(size_t r = y; r < y + h; ++r)
+    copy_stream(readPool.dst + r * readPool.dstpitch + x,
+        frame->data + r * readPool.pitch + x, w);
+
+  return true;
+}
+
+static void fb_read_claim(void)
+{
+  unsigned int i;
+  while((i = atomic_fetch_add_explicit(&readPool.next, 1,
+          memory_order_relaxed)) < readPool.stripes)
+  {
+    if (atomic_load_explicit(&readPool.failed, memory_order_relaxed))
+      break;
 
-    if (left)
+    if (!fb_read_item(i))
     {
-      memcpy(d, s, left);
-      d += left;
+      atomic_store_explicit(&readPool.failed, true, memory_order_relaxed);
+      break;
     }
+  }
+}
+
+static int fb_read_worker(void * opaque)
+{
+  struct FBWorker * w = (struct FBWorker *)opaque;
+
+  while(true)
+  {
+    lgWaitEvent(w->start, TIMEOUT_INFINITE);
+    if (!atomic_load_explicit(&readPool.w.running, memory_order_acquire))
+      break;
+
+    fb_read_claim();
+    atomic_fetch_sub_explicit(&readPool.w.busy, 1, memory_order_release);
+  }
+
+  return 0;
+}
+
+bool framebuffer_set_read_threads(int count, uint64_t affinity)
+{
+  const bool ret = fb_workers_start(&readPool.w, count, affinity,
+      fb_read_worker, "FBReadWorker");
+
+  if (readPool.w.count)
+    DEBUG_INFO("Frame read threads: %d", readPool.w.count + 1);
+
+  return ret;
+}
+
+/* split the read into stripes, or tiles, claimed in order by the workers and
+ * the caller so each copies its part as soon as the producer has written it */
+static bool fb_read_parallel(const FrameBuffer * frame, uint8_t * dst,
+    size_t dstpitch, size_t height, size_t width, size_t bpp, size_t pitch)
+{
+  readPool.frame    = frame;
+  readPool.dst      = dst;
+  readPool.dstpitch = dstpitch;
+  readPool.pitch    = pitch;
+  readPool.bpp      = bpp;
+
+  if (fb_tiled(frame))
+  {
+    if (height > frame->height) height = frame->height;
+    if (width  > frame->width ) width  = frame->width;
+
+    /* in pixels for a tiled read, each item is one tile */
+    readPool.linewidth = width;
+    readPool.height    = height;
+    readPool.stripes   =
+      ((height + frame->tileHeight - 1) / frame->tileHeight) *
+      ((width  + frame->tileWidth  - 1) / frame->tileWidth );
+  }
+  else
+  {
+    readPool.linewidth = width * bpp;
+    readPool.height    = height;
+    readPool.rows      = fbChunkSize / readPool.linewidth;
+    if (!readPool.rows)
+      readPool.rows = 1;
+    readPool.stripes   = (height + readPool.rows - 1) / readPool.rows;
+  }
+
+  atomic_store_explicit(&readPool.next  , 0    , memory_order_relaxed);
+  atomic_store_explicit(&readPool.failed, false, memory_order_relaxed);
+  fb_workers_run(&readPool.w);
+
+  fb_read_claim();
+
+  fb_workers_wait(&readPool.w);
+  const bool ret = !atomic_load_explicit(&readPool.failed, memory_order_relaxed);
+  atomic_flag_clear_explicit(&readPool.inUse, memory_order_release);
+  return ret;
+}
+
+static bool fb_read(const FrameBuffer * frame, void * restrict dst,
+    size_t dstpitch, size_t height, size_t width, size_t bpp, size_t pitch)
+{
+  /* a read from another thread, such as a mosaic tile, while the workers
+   * are busy is done by the caller alone */
+  if (readPool.w.count && height * width * bpp >= fbChunkSize * 2 &&
+      !atomic_flag_test_and_set_explicit(&readPool.inUse, memory_order_acquire))
+    return fb_read_parallel(frame, dst, dstpitch, height, width, bpp, pitch);
+
+  if (fb_tiled(frame))
+    return fb_read_tiled(frame, dst, dstpitch, height, width, bpp, pitch);
+
+  uint8_t * restrict d     = (uint8_t*)dst;
+  size_t         rp        = 0;
+  size_t         y         = 0;
+  const size_t   linewidth = width * bpp;
+
+  while(y < height)
+  {
+    if (!fb_wait(frame, rp + linewidth))
+      return false;
+
+    _mm_mfence();
+    copy_stream(d, frame->data + rp, linewidth);
 
     rp += pitch;
-    d  += dstpitch - linewidth;
+    d  += dstpitch;
     ++y;
   }
 
   return true;
 }
 
+bool framebuffer_read(const FrameBuffer * frame, void * restrict dst,
+    size_t dstpitch, size_t height, size_t width, size_t bpp, size_t pitch)
+{
+  const LGTraceScope trace = lgTraceBegin("framebuffer_read");
+  const bool ret = fb_read(frame, dst, dstpitch, height, width, bpp, pitch);
+  lgTraceEnd(trace);
+  return ret;
+}
+
+static bool fb_read_rects(const FrameBuffer * frame, void * restrict dst,
+    size_t dstpitch, size_t bpp, size_t pitch, const FrameDamageRect * rects,
+    unsigned int count)
+{
+  uint8_t * restrict d = (uint8_t*)dst;
+
+  for(unsigned int i = 0; i < count; ++i)
+  {
+    const FrameDamageRect * r = rects + i;
+    const size_t linewidth = r->width * bpp;
+
+    if (fb_tiled(frame) &&
+        !fb_wait_area(frame, r->x, r->y, r->width, r->height))
+      return false;
+
+    for(size_t y = r->y; y < r->y + r->height; ++y)
+    {
+      const size_t rp = y * pitch + r->x * bpp;
+      if (!fb_tiled(frame) && !fb_wait(frame, rp + linewidth))
+        return false;
+
+      copy_stream(d + y * dstpitch + r->x * bpp, frame->data + rp, linewidth);
+    }
+  }
+
+  return true;
+}
+
+bool framebuffer_read_rects(const FrameBuffer * frame, void * restrict dst,
+    size_t dstpitch, size_t bpp, size_t pitch, const FrameDamageRect * rects,
+    unsigned int count)
+{
+  const LGTraceScope trace = lgTraceBegin("framebuffer_read_rects");
+  const bool ret = fb_read_rects(frame, dst, dstpitch, bpp, pitch, rects, count);
+  lgTraceEnd(trace);
+  return ret;
+}
+
 bool framebuffer_read_fn(const FrameBuffer * frame, size_t height, size_t width,
     size_t bpp, size_t pitch, FrameBufferReadFn fn, void * opaque)
 {
-  uint_least32_t rp        = 0;
+  size_t         rp        = 0;
   size_t         y         = 0;
   const size_t   linewidth = width * bpp;
 
   while(y < height)
   {
-    uint_least32_t wp;
-    int spinCount = 0;
-
-    /* spinlock */
-    wp = atomic_load_explicit(&frame->wp, memory_order_acquire);
-    while(wp - rp < linewidth)
+    if (fb_tiled(frame))
     {
-      if (++spinCount == FB_SPIN_LIMIT)
+      /* the rows are given in order so wait a row of tiles at a time */
+      if (y % frame->tileHeight == 0 &&
+          !fb_wait_area(frame, 0, y, width, frame->tileHeight))
         return false;
-
-      usleep(1);
-      wp = atomic_load_explicit(&frame->wp, memory_order_acquire);
     }
+    else if (!fb_wait(frame, rp + linewidth))
+      return false;
 
     if (!fn(opaque, frame->data + rp, linewidth))
       return false;
@@ -144,52 +661,445 @@ bool framebuffer_read_fn(const FrameBuffer * frame, size_t height, size_t width,
   return true;
 }
 
+static bool fb_read_convert(const FrameBuffer * frame, uint8_t * restrict dst,
+    size_t dstpitch, size_t height, size_t width, size_t pitch,
+    CopyConvert conv)
+{
+  const size_t linewidth = width * 4;
+  size_t       rp        = 0;
+
+  for(size_t y = 0; y < height; ++y, dst += dstpitch, rp += pitch)
+  {
+    if (fb_tiled(frame))
+    {
+      if (y % frame->tileHeight == 0 &&
+          !fb_wait_area(frame, 0, y, width, frame->tileHeight))
+        return false;
+    }
+    else if (!fb_wait(frame, rp + linewidth))
+      return false;
+
+    copy_convert(dst, frame->data + rp, width, conv);
+  }
+
+  return true;
+}
+
+bool framebuffer_read_convert(const FrameBuffer * frame, void * restrict dst,
+    size_t dstpitch, size_t height, size_t width, size_t pitch,
+    CopyConvert conv)
+{
+  const LGTraceScope trace = lgTraceBegin("framebuffer_read_convert");
+  const bool ret = fb_read_convert(frame, dst, dstpitch, height, width, pitch,
+      conv);
+  lgTraceEnd(trace);
+  return ret;
+}
+
 /**
  * Prepare the framebuffer for writing
  */
 void framebuffer_prepare(FrameBuffer * frame)
 {
+  frame->tileCols = 0;
   atomic_store_explicit(&frame->wp, 0, memory_order_release);
 }
 
-bool framebuffer_write(FrameBuffer * frame, const void * restrict src, size_t size)
+static inline void fb_mark_pending(FrameBuffer * frame, size_t index)
+{
+  atomic_store_explicit(&frame->tiles[index], frame->serial | FB_TILE_PENDING,
+      memory_order_relaxed);
+}
+
+void framebuffer_prepare_tiled(FrameBuffer * frame, uint32_t serial,
+    size_t width, size_t height, size_t bpp, size_t pitch,
+    const FrameDamageRect * rects, unsigned int count)
+{
+  const size_t cols  = (width + FB_TILE_WIDTH - 1) / FB_TILE_WIDTH;
+  size_t       tileH = FB_TILE_HEIGHT;
+  size_t       rows  = (height + tileH - 1) / tileH;
+  while(cols && rows * cols > FB_MAX_TILES && tileH <= UINT16_MAX / 2)
+  {
+    tileH *= 2;
+    rows   = (height + tileH - 1) / tileH;
+  }
+
+  if (!cols || !rows || rows * cols > FB_MAX_TILES)
+  {
+    framebuffer_prepare(frame);
+    return;
+  }
+
+  /* the tiles only keep their contents if the layout is unchanged */
+  const bool keep = count > 0 && count <= KVMFR_MAX_DAMAGE_RECTS &&
+    frame->tileCols   == cols  && frame->tileRows == rows  &&
+    frame->tileHeight == tileH && frame->width    == width &&
+    frame->height     == height && frame->bpp     == bpp   &&
+    frame->pitch      == pitch;
+
+  frame->serial     = serial & ~FB_TILE_PENDING;
+  frame->tileCols   = cols;
+  frame->tileRows   = rows;
+  frame->tileWidth  = FB_TILE_WIDTH;
+  frame->tileHeight = tileH;
+  frame->width      = width;
+  frame->height     = height;
+  frame->bpp        = bpp;
+  frame->pitch      = pitch;
+
+  const size_t tiles = cols * rows;
+  if (!keep)
+  {
+    for(size_t i = 0; i < tiles; ++i)
+      fb_mark_pending(frame, i);
+  }
+  else
+  {
+    /* a tile left unfinished by an earlier write is rewritten too */
+    for(size_t i = 0; i < tiles; ++i)
+      if (!fb_tile_ready(frame, i))
+        fb_mark_pending(frame, i);
+
+    for(unsigned int i = 0; i < count; ++i)
+    {
+      const FrameDamageRect * r = rects + i;
+      if (!r->width || !r->height || r->x >= width || r->y >= height)
+        continue;
+
+      const size_t tx1 = (r->x + r->width  - 1) / FB_TILE_WIDTH;
+      const size_t ty1 = (r->y + r->height - 1) / tileH;
+      for(size_t ty = r->y / tileH; ty <= ty1 && ty < rows; ++ty)
+        for(size_t tx = r->x / FB_TILE_WIDTH; tx <= tx1 && tx < cols; ++tx)
+          fb_mark_pending(frame, ty * cols + tx);
+    }
+  }
+
+  atomic_store_explicit(&frame->wp, 0, memory_order_release);
+}
+
+bool framebuffer_get_tiles(const FrameBuffer * frame, FrameBufferTiles * tiles)
+{
+  if (!fb_tiled(frame))
+    return false;
+
+  tiles->serial = frame->serial;
+  tiles->cols   = frame->tileCols;
+  tiles->rows   = frame->tileRows;
+  tiles->width  = frame->tileWidth;
+  tiles->height = frame->tileHeight;
+  return true;
+}
+
+bool framebuffer_tile_serial(const FrameBuffer * frame, unsigned int index,
+    uint32_t * serial)
 {
-  __m128i * restrict s = (__m128i *)src;
-  __m128i * restrict d = (__m128i *)frame->data;
+  const uint32_t value =
+    atomic_load_explicit(&frame->tiles[index], memory_order_acquire);
+  if (value & FB_TILE_PENDING)
+    return false;
+
+  *serial = value;
+  return true;
+}
+
+void framebuffer_set_write_chunk(size_t size)
+{
+  // keep the chunks aligned for the wider copy implementations
+  size = (size + 63) & ~(size_t)63;
+  fbChunkSize = size ? size : 64;
+}
+
+const uint8_t * framebuffer_get_data(const FrameBuffer * frame)
+{
+  return frame->data;
+}
+
+uint8_t * framebuffer_get_write_data(FrameBuffer * frame)
+{
+  return frame->data;
+}
+
+void framebuffer_set_write_ptr(FrameBuffer * frame, size_t size)
+{
+  if (fb_tiled(frame))
+  {
+    /* the rows written so far complete every tile above them */
+    const size_t rows = size / frame->pitch;
+    const size_t done = rows >= frame->height ? frame->tileRows :
+      rows / frame->tileHeight;
+
+    for(size_t i = 0; i < done * frame->tileCols; ++i)
+      if (!fb_tile_ready(frame, i))
+        atomic_store_explicit(&frame->tiles[i], frame->serial,
+            memory_order_release);
+  }
+
+  atomic_store_explicit(&frame->wp, size, memory_order_release);
+}
+
+static void fb_copy_tile(FrameBuffer * frame, const uint8_t * src,
+    unsigned int index)
+{
+  const size_t x = (index % frame->tileCols) * frame->tileWidth;
+  const size_t y = (index / frame->tileCols) * frame->tileHeight;
+  const size_t w = frame->width  - x > frame->tileWidth ?
+    frame->tileWidth  : frame->width  - x;
+  const size_t h = frame->height - y > frame->tileHeight ?
+    frame->tileHeight : frame->height - y;
+
+  const size_t offset = y * frame->pitch + x * frame->bpp;
+  for(size_t r = 0; r < h; ++r)
+    copy_stream(frame->data + offset + r * frame->pitch,
+        src + offset + r * frame->pitch, w * frame->bpp);
+
+  atomic_store_explicit(&frame->tiles[index], frame->serial,
+      memory_order_release);
+}
+
+void framebuffer_write_tile(FrameBuffer * frame, const void * src,
+    unsigned int index)
+{
+  fb_copy_tile(frame, (const uint8_t *)src, index);
+}
+
+static inline size_t fb_copy_chunk(unsigned int i)
+{
+  const size_t offset = i * pool.chunk;
+  const size_t len    = pool.size - offset > pool.chunk ?
+    pool.chunk : pool.size - offset;
+
+  copy_stream(pool.dst + offset, pool.src + offset, len);
+  atomic_store_explicit(&pool.done[i], true, memory_order_release);
+  return len;
+}
+
+static int fb_worker(void * opaque)
+{
+  struct FBWorker * w = (struct FBWorker *)opaque;
+
+  while(true)
+  {
+    lgWaitEvent(w->start, TIMEOUT_INFINITE);
+    if (!atomic_load_explicit(&pool.w.running, memory_order_acquire))
+      break;
+
+    unsigned int i;
+    while((i = atomic_fetch_add_explicit(&pool.next, 1,
+            memory_order_relaxed)) < pool.chunks)
+    {
+      if (pool.tiles)
+        fb_copy_tile(pool.frame, pool.src, pool.tiles[i]);
+      else
+        fb_copy_chunk(i);
+    }
+
+    atomic_fetch_sub_explicit(&pool.w.busy, 1, memory_order_release);
+  }
+
+  return 0;
+}
+
+bool framebuffer_set_write_threads(int count, uint64_t affinity)
+{
+  const bool ret = fb_workers_start(&pool.w, count, affinity, fb_worker,
+      "FBWriteWorker");
+
+  if (!pool.w.count)
+  {
+    free(pool.done);
+    pool.done     = NULL;
+    pool.doneSize = 0;
+  }
+  else
+    DEBUG_INFO("Frame write threads: %d", pool.w.count + 1);
+
+  return ret;
+}
+
+static bool fb_write_striped(FrameBuffer * frame, const uint8_t * src,
+    size_t size)
+{
+  const unsigned int chunks = (size + fbChunkSize - 1) / fbChunkSize;
+  if (chunks > pool.doneSize)
+  {
+    atomic_bool * done = realloc(pool.done, sizeof(*done) * chunks);
+    if (!done)
+    {
+      DEBUG_ERROR("out of memory");
+      return false;
+    }
+    pool.done     = done;
+    pool.doneSize = chunks;
+  }
+
+  for(unsigned int i = 0; i < chunks; ++i)
+    atomic_init(&pool.done[i], false);
+
+  pool.dst    = frame->data;
+  pool.src    = src;
+  pool.size   = size;
+  pool.chunk  = fbChunkSize;
+  pool.chunks = chunks;
+  atomic_store_explicit(&pool.next, 0, memory_order_relaxed);
+  fb_workers_run(&pool.w);
+
+  /* copy along side the workers, only ever publishing the contiguous prefix
+   * that is complete so the write pointer stays monotonic */
+  unsigned int published = 0;
+  unsigned int i;
+  while((i = atomic_fetch_add_explicit(&pool.next, 1,
+          memory_order_relaxed)) < chunks)
+  {
+    fb_copy_chunk(i);
+
+    const unsigned int start = published;
+    while(published < chunks &&
+        atomic_load_explicit(&pool.done[published], memory_order_acquire))
+      ++published;
+
+    if (published != start)
+      atomic_store_explicit(&frame->wp, published == chunks ? size :
+          published * fbChunkSize, memory_order_release);
+  }
+
+  /* wait for the workers to finish the remaining chunks */
+  while(published < chunks)
+  {
+    if (!atomic_load_explicit(&pool.done[published], memory_order_acquire))
+    {
+      _mm_pause();
+      continue;
+    }
+
+    while(published < chunks &&
+        atomic_load_explicit(&pool.done[published], memory_order_acquire))
+      ++published;
+
+    atomic_store_explicit(&frame->wp, published == chunks ? size :
+        published * fbChunkSize, memory_order_release);
+  }
+
+  fb_workers_wait(&pool.w);
+  return true;
+}
+
+/* write the pending tiles in any order, split across the workers */
+static bool fb_write_tiled(FrameBuffer * frame, const uint8_t * src)
+{
+  uint16_t     list[FB_MAX_TILES];
+  unsigned int count = 0;
+  const unsigned int tiles = frame->tileCols * frame->tileRows;
+  for(unsigned int i = 0; i < tiles; ++i)
+    if (!fb_tile_ready(frame, i))
+      list[count++] = i;
+
+  _mm_mfence();
+
+  if (pool.w.count && count > 1)
+  {
+    pool.frame  = frame;
+    pool.tiles  = list;
+    pool.src    = src;
+    pool.chunks = count;
+    atomic_store_explicit(&pool.next, 0, memory_order_relaxed);
+    fb_workers_run(&pool.w);
+
+    unsigned int i;
+    while((i = atomic_fetch_add_explicit(&pool.next, 1,
+            memory_order_relaxed)) < count)
+      fb_copy_tile(frame, src, list[i]);
+
+    fb_workers_wait(&pool.w);
+    pool.tiles = NULL;
+  }
+  else
+    for(unsigned int i = 0; i < count; ++i)
+      fb_copy_tile(frame, src, list[i]);
+
+  atomic_store_explicit(&frame->wp, (size_t)frame->pitch * frame->height,
+      memory_order_release);
+  return true;
+}
+
+static bool fb_write(FrameBuffer * frame, const void * restrict src, size_t size)
+{
+  const uint8_t * restrict s = (const uint8_t *)src;
   size_t wp = 0;
 
+  if (fb_tiled(frame))
+    return fb_write_tiled(frame, s);
+
   _mm_mfence();
 
-  /* copy in chunks */
-  while(size > 63)
+  if (pool.w.count && size >= fbChunkSize * 2)
+    return fb_write_striped(frame, s, size);
+
+  /* copy in chunks, publishing the progress after each */
+  while(wp < size)
   {
-    __m128i *_d = (__m128i *)d;
-    __m128i *_s = (__m128i *)s;
-    __m128i v1 = _mm_stream_load_si128(_s + 0);
-    __m128i v2 = _mm_stream_load_si128(_s + 1);
-    __m128i v3 = _mm_stream_load_si128(_s + 2);
-    __m128i v4 = _mm_stream_load_si128(_s + 3);
+    const size_t len = size - wp > fbChunkSize ? fbChunkSize : size - wp;
+    copy_stream(frame->data + wp, s + wp, len);
+    wp += len;
+    atomic_store_explicit(&frame->wp, wp, memory_order_release);
+  }
+
+  return true;
+}
 
-    _mm_store_si128(_d + 0, v1);
-    _mm_store_si128(_d + 1, v2);
-    _mm_store_si128(_d + 2, v3);
-    _mm_store_si128(_d + 3, v4);
+bool framebuffer_write(FrameBuffer * frame, const void * restrict src, size_t size)
+{
+  const LGTraceScope trace = lgTraceBegin("framebuffer_write");
+  const bool ret = fb_write(frame, src, size);
+  lgTraceEnd(trace);
+  return ret;
+}
 
-    s    += 4;
-    d    += 4;
-    size -= 64;
-    wp   += 64;
+static bool fb_write_rects(FrameBuffer * frame, const void * restrict src,
+    size_t pitch, size_t height, size_t bpp, const FrameDamageRect * rects,
+    unsigned int count)
+{
+  /* the pending tiles already cover the rects */
+  if (fb_tiled(frame) || count == 0 || count > KVMFR_MAX_DAMAGE_RECTS)
+    return fb_write(frame, src, pitch * height);
 
-    if (wp % FB_CHUNK_SIZE == 0)
-      atomic_store_explicit(&frame->wp, wp, memory_order_release);
+  /* sort the rects top down so the reader can progress as we write */
+  const FrameDamageRect * sorted[KVMFR_MAX_DAMAGE_RECTS];
+  for(unsigned int i = 0; i < count; ++i)
+  {
+    unsigned int j = i;
+    for(; j > 0 && sorted[j - 1]->y > rects[i].y; --j)
+      sorted[j] = sorted[j - 1];
+    sorted[j] = rects + i;
   }
 
-  if(size)
+  /* nothing above the first rect has changed */
+  atomic_store_explicit(&frame->wp, sorted[0]->y * pitch, memory_order_release);
+
+  const uint8_t * s = (const uint8_t *)src;
+  for(unsigned int i = 0; i < count; ++i)
   {
-    memcpy(frame->data + wp, s, size);
-    wp += size;
+    const FrameDamageRect * r = sorted[i];
+    const size_t offset = r->y * pitch + r->x * bpp;
+    const size_t width  = r->width * bpp;
+
+    for(size_t y = 0; y < r->height; ++y)
+      copy_stream(frame->data + offset + y * pitch, s + offset + y * pitch, width);
+
+    /* every row above the next rect is now final */
+    const size_t wp = (i + 1 < count) ? sorted[i + 1]->y * pitch :
+      height * pitch;
+    atomic_store_explicit(&frame->wp, wp, memory_order_release);
   }
 
-  atomic_store_explicit(&frame->wp, wp, memory_order_release);
   return true;
 }
+
+bool framebuffer_write_rects(FrameBuffer * frame, const void * restrict src,
+    size_t pitch, size_t height, size_t bpp, const FrameDamageRect * rects,
+    unsigned int count)
+{
+  const LGTraceScope trace = lgTraceBegin("framebuffer_write_rects");
+  const bool ret = fb_write_rects(frame, src, pitch, height, bpp, rects, count);
+  lgTraceEnd(trace);
+  return ret;
+}
@@ -0,0 +1,89 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "common/histogram.h"
+
+#include <string.h>
+
+static inline unsigned int bucketIndex(uint64_t value)
+{
+  if (value < HISTOGRAM_SUB_BUCKETS)
+    return value;
+
+  // the top HISTOGRAM_SUB_BITS + 1 bits pick the bucket
+  const unsigned int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+  return HISTOGRAM_SUB_BUCKETS * (shift + 1) +
+    (unsigned int)((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+static inline uint64_t bucketTop(unsigned int index)
+{
+  if (index < HISTOGRAM_SUB_BUCKETS)
+    return index;
+
+  const unsigned int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+  const uint64_t     sub   = index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+void histogram_reset(Histogram * hist)
+{
+  memset(hist, 0, sizeof(*hist));
+}
+
+void histogram_add(Histogram * hist, uint64_t value)
+{
+  ++hist->buckets[bucketIndex(value)];
+  ++hist->count;
+  if (value > hist->max)
+    hist->max = value;
+}
+
+void histogram_merge(Histogram * hist, const Histogram * src)
+{
+  for(unsigned int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    hist->buckets[i] += src->buckets[i];
+
+  hist->count += src->count;
+  if (src->max > hist->max)
+    hist->max = src->max;
+}
+
+uint64_t histogram_percentile(const Histogram * hist, double percentile)
+{
+  if (!hist->count)
+    return 0;
+
+  uint64_t want = (uint64_t)(hist->count * percentile / 100.0 + 0.5);
+  if (want < 1)
+    want = 1;
+
+  uint64_t seen = 0;
+  for(unsigned int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+  {
+    seen += hist->buckets[i];
+    if (seen >= want)
+    {
+      const uint64_t top = bucketTop(i);
+      return top < hist->max ? top : hist->max;
+    }
+  }
+
+  return hist->max;
+}
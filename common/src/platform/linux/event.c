@@ -22,20 +22,28 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "common/debug.h"
 
 #include <stdlib.h>
-#include <pthread.h>
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdatomic.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 struct LGEvent
 {
-  pthread_mutex_t mutex;
-  pthread_cond_t  cond;
-  atomic_uint     count;
-  bool            autoReset;
+  atomic_uint signaled;
+  atomic_uint waiters;
+  bool        autoReset;
 };
 
+static inline long futex(atomic_uint * addr, int op, unsigned int val,
+    const struct timespec * ts)
+{
+  return syscall(SYS_futex, addr, op, val, ts, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
 LGEvent * lgCreateEvent(bool autoReset, unsigned int msSpinTime)
 {
   LGEvent * handle = (LGEvent *)calloc(sizeof(LGEvent), 1);
@@ -45,31 +53,8 @@ LGEvent * lgCreateEvent(bool autoReset, unsigned int msSpinTime)
     return NULL;
   }
 
-  if (pthread_mutex_init(&handle->mutex, NULL) != 0)
-  {
-    DEBUG_ERROR("Failed to create the mutex");
-    free(handle);
-    return NULL;
-  }
-
-  pthread_condattr_t cattr;
-  pthread_condattr_init(&cattr);
-
-  if (pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC) != 0)
-  {
-    DEBUG_ERROR("Failed to set the condition clock to realtime");
-    pthread_mutex_destroy(&handle->mutex);
-    free(handle);
-    return NULL;
-  }
-
-  if (pthread_cond_init(&handle->cond, &cattr) != 0)
-  {
-    pthread_mutex_destroy(&handle->mutex);
-    free(handle);
-    return NULL;
-  }
-
+  atomic_init(&handle->signaled, 0);
+  atomic_init(&handle->waiters , 0);
   handle->autoReset = autoReset;
   return handle;
 }
@@ -77,64 +62,65 @@ LGEvent * lgCreateEvent(bool autoReset, unsigned int msSpinTime)
 void lgFreeEvent(LGEvent * handle)
 {
   assert(handle);
-
-  pthread_cond_destroy (&handle->cond );
-  pthread_mutex_destroy(&handle->mutex);
   free(handle);
 }
 
+static inline bool consumeSignal(LGEvent * handle)
+{
+  if (!handle->autoReset)
+    return atomic_load_explicit(&handle->signaled, memory_order_acquire) != 0;
+
+  unsigned int expected = 1;
+  return atomic_compare_exchange_strong_explicit(&handle->signaled, &expected,
+      0, memory_order_acquire, memory_order_relaxed);
+}
+
 bool lgWaitEventAbs(LGEvent * handle, struct timespec * ts)
 {
   assert(handle);
 
-  bool ret = true;
-  int  res;
-
-  while(ret && atomic_load(&handle->count) == 0)
+  while(!consumeSignal(handle))
   {
-    if (pthread_mutex_lock(&handle->mutex) != 0)
+    // the waiter count lets lgSignalEvent skip the syscall when nobody waits,
+    // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC timeout
+    atomic_fetch_add(&handle->waiters, 1);
+    const long res = futex(&handle->signaled,
+        FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, 0, ts);
+    const int  err = errno;
+    atomic_fetch_sub(&handle->waiters, 1);
+
+    if (res == 0)
+      continue;
+
+    switch(err)
     {
-      DEBUG_ERROR("Failed to lock the mutex");
-      return false;
-    }
-
-    if (!ts)
-    {
-      if ((res = pthread_cond_wait(&handle->cond, &handle->mutex)) != 0)
-      {
-        DEBUG_ERROR("Failed to wait on the condition (err: %d)", res);
-        ret = false;
-      }
-    }
-    else
-    {
-      switch((res = pthread_cond_timedwait(&handle->cond, &handle->mutex, ts)))
-      {
-        case 0:
-          break;
-
-        case ETIMEDOUT:
-          ret = false;
-          break;
-
-        default:
-          ret = false;
-          DEBUG_ERROR("Timed wait failed (err: %d)", res);
-          break;
-      }
-    }
-
-    if (pthread_mutex_unlock(&handle->mutex) != 0)
-    {
-      DEBUG_ERROR("Failed to unlock the mutex");
-      return false;
+      // signalled before we slept, or a spurious wakeup
+      case EAGAIN:
+      case EINTR:
+        continue;
+
+      // the signal may have landed as the wait timed out
+      case ETIMEDOUT:
+        return consumeSignal(handle);
+
+      default:
+        DEBUG_ERROR("Futex wait failed (err: %d)", err);
+        return false;
     }
   }
 
-  if (ret && handle->autoReset)
-    atomic_fetch_sub(&handle->count, 1);
+  return true;
+}
+
+static bool waitEventNS(LGEvent * handle, uint64_t timeout)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-  return ret;
+  const uint64_t nsec = ts.tv_nsec + timeout;
+  ts.tv_sec  += nsec / 1000000000ULL;
+  ts.tv_nsec  = nsec % 1000000000ULL;
+  return lgWaitEventAbs(handle, &ts);
 }
 
 bool lgWaitEventNS(LGEvent * handle, unsigned int timeout)
@@ -142,18 +128,7 @@ bool lgWaitEventNS(LGEvent * handle, unsigned int timeout)
   if (timeout == TIMEOUT_INFINITE)
     return lgWaitEventAbs(handle, NULL);
 
-  struct timespec ts;
-  clock_gettime(CLOCK_MONOTONIC, &ts);
-  uint64_t nsec = ts.tv_nsec + timeout;
-  if(nsec > 1000000000UL)
-  {
-    ts.tv_nsec = nsec - 1000000000UL;
-    ++ts.tv_sec;
-  }
-  else
-    ts.tv_nsec = nsec;
-
-  return lgWaitEventAbs(handle, &ts);
+  return waitEventNS(handle, timeout);
 }
 
 bool lgWaitEvent(LGEvent * handle, unsigned int timeout)
@@ -161,22 +136,28 @@ bool lgWaitEvent(LGEvent * handle, unsigned int timeout)
   if (timeout == TIMEOUT_INFINITE)
     return lgWaitEventAbs(handle, NULL);
 
-  return lgWaitEventNS(handle, timeout * 1000000U);
+  if (timeout == 0)
+    return consumeSignal(handle);
+
+  return waitEventNS(handle, (uint64_t)timeout * 1000000ULL);
 }
 
 bool lgSignalEvent(LGEvent * handle)
 {
   assert(handle);
 
-  const bool signalled = atomic_fetch_add_explicit(&handle->count, 1,
-      memory_order_acquire) > 0;
+  // already signalled, any waiter will see it before it sleeps
+  if (atomic_exchange(&handle->signaled, 1) != 0)
+    return true;
 
-  if (signalled)
+  if (atomic_load(&handle->waiters) == 0)
     return true;
 
-  if (pthread_cond_broadcast(&handle->cond) != 0)
+  // an auto reset event is only consumed by a single waiter
+  if (futex(&handle->signaled, FUTEX_WAKE | FUTEX_PRIVATE_FLAG,
+        handle->autoReset ? 1 : INT_MAX, NULL) < 0)
   {
-    DEBUG_ERROR("Failed to signal the condition");
+    DEBUG_ERROR("Failed to wake the waiters (err: %d)", errno);
     return false;
   }
 
@@ -186,6 +167,6 @@ bool lgSignalEvent(LGEvent * handle)
 bool lgResetEvent(LGEvent * handle)
 {
   assert(handle);
-  atomic_store(&handle->count, 0);
+  atomic_store(&handle->signaled, 0);
   return true;
 }
@@ -26,6 +26,13 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <linux/mempolicy.h>
+#include <poll.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -35,11 +42,22 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "common/stringutils.h"
 #include "module/kvmfr.h"
 
+#define IVSHMEM_MAX_IRQS 8
+
+// how the mapping is set up, see the app:shm* options
+#define IVSHMEM_POPULATE (1U << 0)
+#define IVSHMEM_LOCK     (1U << 1)
+
 struct IVSHMEMInfo
 {
-  int devFd;
-  int dmaFd;
-  int size;
+  int  devFd;
+  int  dmaFd;
+  int  size;
+  bool locked;
+  int  node;
+
+  int irqCount;
+  int irqFd[IVSHMEM_MAX_IRQS];
 };
 
 static bool ivshmemDeviceValidator(struct Option * opt, const char ** error)
@@ -96,25 +114,137 @@ void ivshmemOptionsInit()
       .validator      = ivshmemDeviceValidator,
       .getValues      = ivshmemDeviceGetValues
     },
+    {
+      .module         = "app",
+      .name           = "shmPrefault",
+      .description    = "Fault the whole shared memory file in when it is mapped (MAP_POPULATE)",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "app",
+      .name           = "shmLock",
+      .description    = "Lock the shared memory file into RAM so it is never paged out (mlock)",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
     {0}
   };
 
   option_register(options);
 }
 
+static bool openDev(struct IVSHMEM * dev, const char * shmDevice,
+    unsigned int flags);
+
 bool ivshmemOpen(struct IVSHMEM * dev)
 {
-  return ivshmemOpenDev(dev, option_get_string("app", "shmFile"));
+  unsigned int flags = 0;
+  if (option_get_bool("app", "shmPrefault"))
+    flags |= IVSHMEM_POPULATE;
+  if (option_get_bool("app", "shmLock"))
+    flags |= IVSHMEM_LOCK;
+
+  return openDev(dev, option_get_string("app", "shmFile"), flags);
 }
 
 bool ivshmemOpenDev(struct IVSHMEM * dev, const char * shmDevice)
+{
+  return openDev(dev, shmDevice, 0);
+}
+
+/* the hints only apply to a file, the kvmfr module maps its pages up front
+ * and they can not be swapped or merged into huge pages */
+static bool adviseFile(int fd, void * map, size_t size, unsigned int flags)
+{
+  struct statfs fs;
+  if (fstatfs(fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC)
+    DEBUG_INFO("Huge pages       : hugetlbfs, %ld KiB", (long)fs.f_bsize / 1024);
+  else
+  {
+    // tmpfs only backs the file with huge pages if shmem_enabled allows it
+    if (madvise(map, size, MADV_HUGEPAGE) == 0)
+      DEBUG_INFO("Huge pages       : transparent (if shmem_enabled allows)");
+    else
+      DEBUG_INFO("Huge pages       : no");
+  }
+
+  // every frame reads through the whole buffer, read ahead and keep it
+  madvise(map, size, MADV_WILLNEED);
+
+  if (!(flags & IVSHMEM_LOCK))
+    return false;
+
+  if (mlock(map, size) != 0)
+  {
+    DEBUG_WARN("Failed to lock the shared memory, check RLIMIT_MEMLOCK: %s",
+        strerror(errno));
+    return false;
+  }
+
+  DEBUG_INFO("Locked           : yes");
+  return true;
+}
+
+// the kvmfr device is parented to the PCI device which knows its node
+static int deviceNode(const char * shmDevice)
+{
+  char * path;
+  alloc_sprintf(&path, "/sys/class/kvmfr/%s/device/numa_node",
+      shmDevice + 5);
+  if (!path)
+    return -1;
+
+  int node = -1;
+  FILE * fp = fopen(path, "r");
+  free(path);
+  if (fp)
+  {
+    if (fscanf(fp, "%d", &node) != 1)
+      node = -1;
+    fclose(fp);
+  }
+  return node;
+}
+
+// where a file is placed is up to whoever faulted its pages in so sample it
+// across its length and report the node holding most of it
+static int memoryNode(void * map, size_t size)
+{
+  #define NODE_SAMPLES 16
+  #define NODE_MAX     64
+
+  unsigned int count[NODE_MAX] = { 0 };
+  for(int i = 0; i < NODE_SAMPLES; ++i)
+  {
+    int node;
+    void * addr = (uint8_t *)map + (size / NODE_SAMPLES) * i;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr,
+          MPOL_F_NODE | MPOL_F_ADDR) != 0)
+      return -1;
+
+    if (node >= 0 && node < NODE_MAX)
+      ++count[node];
+  }
+
+  int best = -1;
+  for(int i = 0; i < NODE_MAX; ++i)
+    if (count[i] && (best < 0 || count[i] > count[best]))
+      best = i;
+
+  return best;
+}
+
+static bool openDev(struct IVSHMEM * dev, const char * shmDevice,
+    unsigned int flags)
 {
   assert(dev);
 
   unsigned int devSize;
-  int devFd = -1;
-  int dmaFd = -1;
-  int mapFd = -1;
+  int devFd    = -1;
+  int dmaFd    = -1;
+  int mapFd    = -1;
+  int irqCount = 0;
 
   dev->opaque = NULL;
 
@@ -148,6 +278,13 @@ bool ivshmemOpenDev(struct IVSHMEM * dev, const char * shmDevice)
     }
 
     mapFd = dmaFd;
+
+    // older modules do not support the doorbell
+    irqCount = ioctl(devFd, KVMFR_GET_IRQ_COUNT, 0);
+    if (irqCount < 0)
+      irqCount = 0;
+    else if (irqCount > IVSHMEM_MAX_IRQS)
+      irqCount = IVSHMEM_MAX_IRQS;
   }
   else
   {
@@ -171,7 +308,8 @@ bool ivshmemOpenDev(struct IVSHMEM * dev, const char * shmDevice)
     mapFd = devFd;
   }
 
-  void * map = mmap(0, devSize, PROT_READ | PROT_WRITE, MAP_SHARED, mapFd, 0);
+  void * map = mmap(0, devSize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | ((flags & IVSHMEM_POPULATE) ? MAP_POPULATE : 0), mapFd, 0);
   if (map == MAP_FAILED)
   {
     DEBUG_ERROR("Failed to map the shared memory device: %s", shmDevice);
@@ -179,11 +317,25 @@ bool ivshmemOpenDev(struct IVSHMEM * dev, const char * shmDevice)
     return false;
   }
 
+  const bool locked = dmaFd < 0 && adviseFile(mapFd, map, devSize, flags);
+
   struct IVSHMEMInfo * info =
     (struct IVSHMEMInfo *)malloc(sizeof(struct IVSHMEMInfo));
-  info->size  = devSize;
-  info->devFd = devFd;
-  info->dmaFd = dmaFd;
+  info->size   = devSize;
+  info->devFd  = devFd;
+  info->dmaFd  = dmaFd;
+  info->locked = locked;
+  info->node   = dmaFd < 0 ? memoryNode(map, devSize) : deviceNode(shmDevice);
+
+  if (info->node >= 0)
+    DEBUG_INFO("NUMA Node        : %d", info->node);
+
+  info->irqCount = irqCount;
+  for(int i = 0; i < IVSHMEM_MAX_IRQS; ++i)
+    info->irqFd[i] = -1;
+
+  if (irqCount > 0)
+    DEBUG_INFO("Doorbell vectors : %d", irqCount);
 
   dev->opaque = info;
   dev->size   = devSize;
@@ -201,8 +353,20 @@ void ivshmemClose(struct IVSHMEM * dev)
   struct IVSHMEMInfo * info =
     (struct IVSHMEMInfo *)dev->opaque;
 
+  if (info->locked)
+    munlock(dev->mem, info->size);
   munmap(dev->mem, info->size);
 
+  for(int i = 0; i < info->irqCount; ++i)
+  {
+    if (info->irqFd[i] < 0)
+      continue;
+
+    const struct kvmfr_irqfd irqfd = { .vector = i, .fd = -1 };
+    ioctl(info->devFd, KVMFR_SET_IRQFD, &irqfd);
+    close(info->irqFd[i]);
+  }
+
   if (info->dmaFd >= 0)
     close(info->dmaFd);
 
@@ -214,6 +378,16 @@ void ivshmemClose(struct IVSHMEM * dev)
   dev->opaque = NULL;
 }
 
+int ivshmemGetNode(struct IVSHMEM * dev)
+{
+  assert(dev && dev->opaque);
+
+  struct IVSHMEMInfo * info =
+    (struct IVSHMEMInfo *)dev->opaque;
+
+  return info->node;
+}
+
 bool ivshmemHasDMA(struct IVSHMEM * dev)
 {
   assert(dev && dev->opaque);
@@ -249,3 +423,72 @@ int ivshmemGetDMABuf(struct IVSHMEM * dev, uint64_t offset, uint64_t size)
 
   return fd;
 }
+
+bool ivshmemCanRing(struct IVSHMEM * dev, unsigned int vector)
+{
+  return false;
+}
+
+bool ivshmemRingDoorbell(struct IVSHMEM * dev, unsigned int vector)
+{
+  // not supported, the linux client only consumes frames
+  return false;
+}
+
+bool ivshmemHasIRQ(struct IVSHMEM * dev, unsigned int vector)
+{
+  assert(dev && dev->opaque);
+
+  struct IVSHMEMInfo * info =
+    (struct IVSHMEMInfo *)dev->opaque;
+
+  if (vector >= info->irqCount)
+    return false;
+
+  if (info->irqFd[vector] >= 0)
+    return true;
+
+  int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fd < 0)
+  {
+    DEBUG_ERROR("Failed to create the eventfd: %s", strerror(errno));
+    return false;
+  }
+
+  const struct kvmfr_irqfd irqfd = { .vector = vector, .fd = fd };
+  if (ioctl(info->devFd, KVMFR_SET_IRQFD, &irqfd) < 0)
+  {
+    DEBUG_ERROR("Failed to bind doorbell vector %u: %s", vector, strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  info->irqFd[vector] = fd;
+  return true;
+}
+
+bool ivshmemWaitIRQ(struct IVSHMEM * dev, unsigned int vector, unsigned int timeout)
+{
+  if (!ivshmemHasIRQ(dev, vector))
+    return false;
+
+  struct IVSHMEMInfo * info =
+    (struct IVSHMEMInfo *)dev->opaque;
+
+  struct pollfd fds =
+  {
+    .fd     = info->irqFd[vector],
+    .events = POLLIN
+  };
+
+  if (poll(&fds, 1, timeout) <= 0)
+    return false;
+
+  // clear the counter, the eventfd holds any interrupt that arrived before we
+  // started waiting so there is no lost wakeup
+  uint64_t value;
+  if (read(fds.fd, &value, sizeof(value)) != sizeof(value))
+    return false;
+
+  return true;
+}
@@ -17,6 +17,8 @@ this program; if not, write to the Free Software Foundation, Inc., 59 Temple
 Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <GL/glx.h>
 
@@ -67,4 +69,41 @@ int sysinfo_gfx_max_multisample()
 long sysinfo_getPageSize()
 {
   return sysconf(_SC_PAGESIZE);
-}
\ No newline at end of file
+}
+
+uint64_t sysinfo_getNodeCPUs(int node)
+{
+  if (node < 0)
+    return 0;
+
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+  FILE * fp = fopen(path, "r");
+  if (!fp)
+    return 0;
+
+  // the list is in the form 0-7,16-23
+  uint64_t mask = 0;
+  int first, last;
+  while(fscanf(fp, "%d", &first) == 1)
+  {
+    last = first;
+    int c = fgetc(fp);
+    if (c == '-')
+    {
+      if (fscanf(fp, "%d", &last) != 1)
+        break;
+      c = fgetc(fp);
+    }
+
+    for(int i = first; i <= last && i < 64; ++i)
+      mask |= 1ULL << i;
+
+    if (c != ',')
+      break;
+  }
+
+  fclose(fp);
+  return mask;
+}
@@ -20,9 +20,16 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "common/thread.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include "common/debug.h"
+#include "common/trace.h"
 
 struct LGThread
 {
@@ -36,7 +43,9 @@ struct LGThread
 static void * threadWrapper(void * opaque)
 {
   LGThread * handle = (LGThread *)opaque;
+  lgTraceSetThreadName(handle->name);
   handle->resultCode = handle->function(handle->opaque);
+  lgTraceThreadExit();
   return NULL;
 }
 
@@ -74,3 +83,79 @@ bool lgJoinThread(LGThread * handle, int * resultCode)
   free(handle);
   return true;
 }
+
+bool lgThreadSetAffinity(LGThread * handle, uint64_t mask)
+{
+  if (!mask)
+    return true;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for(int i = 0; i < 64; ++i)
+    if (mask & (1ULL << i))
+      CPU_SET(i, &set);
+
+  const pthread_t thread = handle ? handle->handle : pthread_self();
+  if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0)
+  {
+    DEBUG_ERROR("pthread_setaffinity_np failed for thread: %s",
+        handle ? handle->name : "self");
+    return false;
+  }
+
+  return true;
+}
+
+bool lgThreadSetPriority(LGThreadPriority priority)
+{
+  struct sched_param param = { 0 };
+  int policy, nice;
+
+  switch(priority)
+  {
+    case LG_THREAD_PRIORITY_NORMAL:
+      policy = SCHED_OTHER;
+      nice   = 0;
+      break;
+
+    // capture always blocks waiting for the next frame so can run until then
+    case LG_THREAD_PRIORITY_CAPTURE:
+      policy               = SCHED_FIFO;
+      param.sched_priority = 10;
+      nice                 = -10;
+      break;
+
+    // presentation threads share the CPU between themselves
+    case LG_THREAD_PRIORITY_PRESENT:
+      policy               = SCHED_RR;
+      param.sched_priority = 5;
+      nice                 = -5;
+      break;
+
+    default:
+      DEBUG_ERROR("Invalid thread priority: %d", priority);
+      return false;
+  }
+
+  // the nice value is per thread on Linux
+  const pid_t tid = syscall(SYS_gettid);
+
+  int err = pthread_setschedparam(pthread_self(), policy, &param);
+  if (err == 0)
+  {
+    if (policy == SCHED_OTHER)
+      setpriority(PRIO_PROCESS, tid, nice);
+    return true;
+  }
+
+  // without CAP_SYS_NICE or an RLIMIT_RTPRIO allowance fall back to nice
+  if (setpriority(PRIO_PROCESS, tid, nice) == 0)
+  {
+    DEBUG_INFO("Real-time scheduling is not permitted (%s), using nice %d",
+        strerror(err), nice);
+    return true;
+  }
+
+  DEBUG_WARN("Unable to raise the thread priority: %s", strerror(errno));
+  return false;
+}
@@ -19,30 +19,143 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "common/time.h"
 #include "common/debug.h"
+#include "common/thread.h"
 
 #include <errno.h>
-#include <signal.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+// the epoll id of the event used to stop the timer thread
+#define TIMER_WAKE_ID 0
 
 struct LGTimer
 {
   LGTimerFn   fn;
   void      * udata;
-  timer_t     id;
+  int         fd;
+  uint64_t    id;
   bool        running;
+  LGTimer   * next;
 };
 
-static void TimerProc(union sigval arg)
+// every timer is serviced by a single thread waiting on their timerfds, it is
+// started with the first timer and stopped with the last
+static struct
+{
+  pthread_mutex_t lock;
+  LGThread      * thread;
+  int             epollFd;
+  int             wakeFd;
+  LGTimer       * timers;
+  uint64_t        nextID;
+}
+timers =
+{
+  .lock    = PTHREAD_MUTEX_INITIALIZER,
+  .epollFd = -1,
+  .wakeFd  = -1,
+  .nextID  = TIMER_WAKE_ID + 1
+};
+
+static int timerThread(void * opaque)
+{
+  const int          epollFd = (int)(intptr_t)opaque;
+  struct epoll_event events[16];
+
+  while(true)
+  {
+    const int count = epoll_wait(epollFd, events, 16, -1);
+    if (count < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      DEBUG_ERROR("epoll_wait failed: %s", strerror(errno));
+      return -1;
+    }
+
+    // the callbacks run under the lock so a destroyed timer can't fire, but
+    // this means a callback must not create or destroy timers itself
+    pthread_mutex_lock(&timers.lock);
+    for(int i = 0; i < count; ++i)
+    {
+      if (events[i].data.u64 == TIMER_WAKE_ID)
+      {
+        pthread_mutex_unlock(&timers.lock);
+        return 0;
+      }
+
+      // the timer may have been destroyed since the expiry was reported
+      LGTimer * timer = timers.timers;
+      while(timer && timer->id != events[i].data.u64)
+        timer = timer->next;
+
+      uint64_t expirations;
+      if (!timer || read(timer->fd, &expirations, sizeof(expirations)) !=
+          sizeof(expirations))
+        continue;
+
+      if (timer->running && !timer->fn(timer->udata))
+      {
+        const struct itimerspec stop = { 0 };
+        timerfd_settime(timer->fd, 0, &stop, NULL);
+        timer->running = false;
+      }
+    }
+    pthread_mutex_unlock(&timers.lock);
+  }
+}
+
+static bool startTimerThread()
 {
-  LGTimer * timer = (LGTimer *)arg.sival_ptr;
-  if (!timer->fn(timer->udata))
+  timers.epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (timers.epollFd < 0)
+  {
+    DEBUG_ERROR("failed to create the timer epoll: %s", strerror(errno));
+    return false;
+  }
+
+  timers.wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (timers.wakeFd < 0)
+  {
+    DEBUG_ERROR("failed to create the timer wake event: %s", strerror(errno));
+    goto fail;
+  }
+
+  struct epoll_event ev =
+  {
+    .events   = EPOLLIN,
+    .data.u64 = TIMER_WAKE_ID
+  };
+
+  if (epoll_ctl(timers.epollFd, EPOLL_CTL_ADD, timers.wakeFd, &ev) != 0)
+  {
+    DEBUG_ERROR("failed to add the timer wake event: %s", strerror(errno));
+    goto fail;
+  }
+
+  if (!lgCreateThread("timerThread", timerThread,
+        (void *)(intptr_t)timers.epollFd, &timers.thread))
   {
-    if (timer_delete(timer->id))
-      DEBUG_ERROR("failed to destroy the timer: %s", strerror(errno));
-    timer->running = false;
+    DEBUG_ERROR("failed to create the timer thread");
+    goto fail;
   }
+
+  return true;
+
+fail:
+  if (timers.wakeFd >= 0)
+    close(timers.wakeFd);
+  close(timers.epollFd);
+  timers.wakeFd  = -1;
+  timers.epollFd = -1;
+  return false;
 }
 
 bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
@@ -60,14 +173,8 @@ bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
   ret->udata   = udata;
   ret->running = true;
 
-  struct sigevent sev =
-  {
-    .sigev_notify = SIGEV_THREAD,
-    .sigev_notify_function = &TimerProc,
-    .sigev_value.sival_ptr = ret,
-  };
-
-  if (timer_create(CLOCK_MONOTONIC, &sev, &ret->id))
+  ret->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (ret->fd < 0)
   {
     DEBUG_ERROR("failed to create timer: %s", strerror(errno));
     free(ret);
@@ -76,8 +183,8 @@ bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
 
   struct timespec interval =
   {
-    .tv_sec = 0,
-    .tv_nsec = intervalMS * 1000 * 1000,
+    .tv_sec  = intervalMS / 1000,
+    .tv_nsec = (intervalMS % 1000) * 1000 * 1000,
   };
   struct itimerspec spec =
   {
@@ -85,25 +192,80 @@ bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
     .it_value = interval,
   };
 
-  if (timer_settime(ret->id, 0, &spec, NULL))
+  if (timerfd_settime(ret->fd, 0, &spec, NULL))
   {
     DEBUG_ERROR("failed to set timer: %s", strerror(errno));
-    timer_delete(ret->id);
+    close(ret->fd);
     free(ret);
     return false;
   }
 
+  pthread_mutex_lock(&timers.lock);
+  if (!timers.thread && !startTimerThread())
+    goto fail;
+
+  ret->id = timers.nextID++;
+  struct epoll_event ev =
+  {
+    .events   = EPOLLIN,
+    .data.u64 = ret->id
+  };
+
+  if (epoll_ctl(timers.epollFd, EPOLL_CTL_ADD, ret->fd, &ev) != 0)
+  {
+    DEBUG_ERROR("failed to add the timer: %s", strerror(errno));
+    goto fail;
+  }
+
+  ret->next     = timers.timers;
+  timers.timers = ret;
+  pthread_mutex_unlock(&timers.lock);
+
   *result = ret;
   return true;
+
+fail:
+  pthread_mutex_unlock(&timers.lock);
+  close(ret->fd);
+  free(ret);
+  return false;
 }
 
 void lgTimerDestroy(LGTimer * timer)
 {
-  if (timer->running)
+  pthread_mutex_lock(&timers.lock);
+
+  for(LGTimer ** t = &timers.timers; *t; t = &(*t)->next)
+    if (*t == timer)
+    {
+      *t = timer->next;
+      break;
+    }
+
+  epoll_ctl(timers.epollFd, EPOLL_CTL_DEL, timer->fd, NULL);
+  close(timer->fd);
+  free(timer);
+
+  if (timers.timers)
   {
-    if (timer_delete(timer->id))
-      DEBUG_ERROR("failed to destroy the timer: %s", strerror(errno));
+    pthread_mutex_unlock(&timers.lock);
+    return;
   }
 
-  free(timer);
+  // that was the last timer, stop the thread
+  LGThread * thread  = timers.thread;
+  const int  epollFd = timers.epollFd;
+  const int  wakeFd  = timers.wakeFd;
+  timers.thread  = NULL;
+  timers.epollFd = -1;
+  timers.wakeFd  = -1;
+
+  const uint64_t value = 1;
+  if (write(wakeFd, &value, sizeof(value)) != sizeof(value))
+    DEBUG_ERROR("failed to wake the timer thread: %s", strerror(errno));
+  pthread_mutex_unlock(&timers.lock);
+
+  lgJoinThread(thread, NULL);
+  close(wakeFd );
+  close(epollFd);
 }
@@ -134,16 +134,35 @@ bool lgWaitEvent(LGEvent * event, unsigned int timeout)
     }
   }
 
-  const DWORD to = (timeout == TIMEOUT_INFINITE) ? INFINITE : (DWORD)timeout;
+  // wait timeouts are rounded to the system timer tick, a high resolution
+  // timer expires when asked to without raising the system wide resolution
+  HANDLE handles[2] = { event->handle, NULL };
+  DWORD  count      = 1;
+  DWORD  to         = (timeout == TIMEOUT_INFINITE) ? INFINITE : (DWORD)timeout;
+
+  if (timeout != TIMEOUT_INFINITE && timeout > 0)
+  {
+    HANDLE timer = lgGetThreadTimer();
+    LARGE_INTEGER due = { .QuadPart = -(LONGLONG)timeout * 10000LL };
+    if (timer && SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE))
+    {
+      handles[count++] = timer;
+      to = INFINITE;
+    }
+  }
+
   while(true)
   {
-    switch(WaitForSingleObject(event->handle, to))
+    switch(WaitForMultipleObjects(count, handles, FALSE, to))
     {
       case WAIT_OBJECT_0:
         if (!event->reset)
           event->signaled = true;
         return true;
 
+      case WAIT_OBJECT_0 + 1:
+        return false;
+
       case WAIT_ABANDONED:
         continue;
 
@@ -27,12 +27,55 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <assert.h>
 #include <setupapi.h>
 #include <io.h>
+#include <string.h>
 
 struct IVSHMEMInfo
 {
-  HANDLE handle;
+  HANDLE         handle;
+  int            peer;
+  UINT16         vectors;
 };
 
+static const struct
+{
+  const char * name;
+  UINT8        mode;
+}
+cacheModes[] =
+{
+  { "writecombined", IVSHMEM_CACHE_WRITECOMBINED },
+  { "cached"       , IVSHMEM_CACHE_CACHED        },
+  { "noncached"    , IVSHMEM_CACHE_NONCACHED     }
+};
+
+#define CACHE_MODES (sizeof(cacheModes) / sizeof(*cacheModes))
+
+static int getCacheMode(const char * name)
+{
+  for(int i = 0; i < CACHE_MODES; ++i)
+    if (strcmp(cacheModes[i].name, name) == 0)
+      return i;
+  return -1;
+}
+
+static bool ivshmemCacheModeValidator(struct Option * opt, const char ** error)
+{
+  if (getCacheMode(opt->value.x_string) < 0)
+  {
+    *error = "Invalid cache mode, must be one of writecombined, cached or noncached";
+    return false;
+  }
+  return true;
+}
+
+static StringList ivshmemCacheModeGetValues(struct Option * option)
+{
+  StringList sl = stringlist_new(false);
+  for(int i = 0; i < CACHE_MODES; ++i)
+    stringlist_push(sl, (char *)cacheModes[i].name);
+  return sl;
+}
+
 void ivshmemOptionsInit()
 {
   static struct Option options[] = {
@@ -43,6 +86,22 @@ void ivshmemOptionsInit()
       .type           = OPTION_TYPE_INT,
       .value.x_int    = 0
     },
+    {
+      .module         = "os",
+      .name           = "doorbellPeer",
+      .description    = "The ivshmem-doorbell peer ID to notify of updates (-1 to disable)",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = -1
+    },
+    {
+      .module         = "os",
+      .name           = "shmCacheMode",
+      .description    = "The caching mode of the IVSHMEM mapping (writecombined, cached or noncached)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = "writecombined",
+      .validator      = ivshmemCacheModeValidator,
+      .getValues      = ivshmemCacheModeGetValues
+    },
     {0}
   };
 
@@ -107,8 +166,10 @@ bool ivshmemInit(struct IVSHMEM * dev)
   struct IVSHMEMInfo * info =
     (struct IVSHMEMInfo *)malloc(sizeof(struct IVSHMEMInfo));
 
-  info->handle = handle;
-  dev->opaque  = info;
+  info->handle  = handle;
+  info->peer    = option_get_int("os", "doorbellPeer");
+  info->vectors = 0;
+  dev->opaque   = info;
   dev->size    = 0;
   dev->mem     = NULL;
 
@@ -128,7 +189,10 @@ bool ivshmemOpen(struct IVSHMEM * dev)
     return 0;
   }
 
-  IVSHMEM_MMAP_CONFIG config = { .cacheMode = IVSHMEM_CACHE_WRITECOMBINED };
+  /* the frame is written with streaming stores that write combining suits best,
+   * cached is there for comparison as it makes reads from the mapping fast */
+  const int cacheMode = getCacheMode(option_get_string("os", "shmCacheMode"));
+  IVSHMEM_MMAP_CONFIG config = { .cacheMode = cacheModes[cacheMode].mode };
   IVSHMEM_MMAP map = { 0 };
   if (!DeviceIoControl(
     info->handle,
@@ -143,6 +207,13 @@ bool ivshmemOpen(struct IVSHMEM * dev)
 
   dev->size   = (unsigned int)size;
   dev->mem    = map.ptr;
+
+  DEBUG_INFO("IVSHMEM Cache    : %s", cacheModes[cacheMode].name);
+
+  info->vectors = map.vectors;
+  if (info->peer >= 0 && info->vectors == 0)
+    DEBUG_WARN("doorbellPeer is set but the device has no vectors (ivshmem-plain?)");
+
   return true;
 }
 
@@ -168,3 +239,40 @@ void ivshmemFree(struct IVSHMEM * dev)
   free(info);
   dev->opaque = NULL;
 }
+
+int ivshmemGetNode(struct IVSHMEM * dev)
+{
+  // the node of the device is not known from inside the guest
+  return -1;
+}
+
+bool ivshmemCanRing(struct IVSHMEM * dev, unsigned int vector)
+{
+  assert(dev && dev->opaque);
+
+  struct IVSHMEMInfo * info = (struct IVSHMEMInfo *)dev->opaque;
+  return info->peer >= 0 && vector < info->vectors;
+}
+
+bool ivshmemRingDoorbell(struct IVSHMEM * dev, unsigned int vector)
+{
+  assert(dev && dev->opaque);
+
+  struct IVSHMEMInfo * info = (struct IVSHMEMInfo *)dev->opaque;
+  if (!ivshmemCanRing(dev, vector))
+    return false;
+
+  IVSHMEM_RING ring =
+  {
+    .peerID = info->peer,
+    .vector = vector
+  };
+
+  if (!DeviceIoControl(info->handle, IOCTL_IVSHMEM_RING_DOORBELL, &ring, sizeof(IVSHMEM_RING), NULL, 0, NULL, NULL))
+  {
+    DEBUG_WINERROR("DeviceIoControl failed", GetLastError());
+    return false;
+  }
+
+  return true;
+}
@@ -30,4 +30,12 @@ long sysinfo_getPageSize()
   SYSTEM_INFO si;
   GetSystemInfo(&si);
   return si.dwPageSize;
-}
\ No newline at end of file
+}
+
+uint64_t sysinfo_getNodeCPUs(int node)
+{
+  ULONGLONG mask;
+  if (node < 0 || node > 255 || !GetNumaNodeProcessorMask((UCHAR)node, &mask))
+    return 0;
+  return mask;
+}
@@ -19,9 +19,11 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "common/thread.h"
 #include "common/debug.h"
+#include "common/trace.h"
 #include "common/windebug.h"
 
 #include <windows.h>
+#include <avrt.h>
 
 struct LGThread
 {
@@ -34,10 +36,15 @@ struct LGThread
   int                resultCode;
 };
 
+// the MMCSS registration of the calling thread, if any
+static _Thread_local HANDLE mmcssTask = NULL;
+
 static DWORD WINAPI threadWrapper(LPVOID lpParameter)
 {
   LGThread * handle = (LGThread *)lpParameter;
+  lgTraceSetThreadName(handle->name);
   handle->resultCode = handle->function(handle->opaque);
+  lgTraceThreadExit();
   return 0;
 }
 
@@ -91,3 +98,75 @@ bool lgJoinThread(LGThread * handle, int * resultCode)
   return false;
 }
 
+
+bool lgThreadSetAffinity(LGThread * handle, uint64_t mask)
+{
+  if (!mask)
+    return true;
+
+  const HANDLE thread = handle ? handle->handle : GetCurrentThread();
+  if (!SetThreadAffinityMask(thread, (DWORD_PTR)mask))
+  {
+    DEBUG_WINERROR("SetThreadAffinityMask failed", GetLastError());
+    return false;
+  }
+
+  return true;
+}
+
+bool lgThreadSetPriority(LGThreadPriority priority)
+{
+  const char * task;
+  int          fallback;
+
+  switch(priority)
+  {
+    case LG_THREAD_PRIORITY_NORMAL:
+      task     = NULL;
+      fallback = THREAD_PRIORITY_NORMAL;
+      break;
+
+    case LG_THREAD_PRIORITY_CAPTURE:
+      task     = "Capture";
+      fallback = THREAD_PRIORITY_TIME_CRITICAL;
+      break;
+
+    case LG_THREAD_PRIORITY_PRESENT:
+      task     = "Games";
+      fallback = THREAD_PRIORITY_HIGHEST;
+      break;
+
+    default:
+      DEBUG_ERROR("Invalid thread priority: %d", priority);
+      return false;
+  }
+
+  if (mmcssTask)
+  {
+    AvRevertMmThreadCharacteristics(mmcssTask);
+    mmcssTask = NULL;
+  }
+
+  if (task)
+  {
+    // MMCSS boosts the thread into the real-time range while still reserving
+    // some time for the rest of the system
+    DWORD taskIndex = 0;
+    mmcssTask = AvSetMmThreadCharacteristicsA(task, &taskIndex);
+    if (mmcssTask)
+    {
+      AvSetMmThreadPriority(mmcssTask, AVRT_PRIORITY_HIGH);
+      return true;
+    }
+
+    DEBUG_WINERROR("AvSetMmThreadCharacteristics failed", GetLastError());
+  }
+
+  if (!SetThreadPriority(GetCurrentThread(), fallback))
+  {
+    DEBUG_WINERROR("SetThreadPriority failed", GetLastError());
+    return false;
+  }
+
+  return true;
+}
@@ -19,54 +19,179 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "common/time.h"
 #include "common/debug.h"
+#include "common/windebug.h"
 
-// decared by the platform
-extern HWND MessageHWND;
+#include <stdlib.h>
+
+// not defined by older SDKs, supported since Windows 10 1803
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+// the range of the spin used to absorb the timer latency, in nanoseconds
+#define SPIN_TAIL_MIN  20000
+#define SPIN_TAIL_INIT 500000
+#define SPIN_TAIL_MAX  2000000
+
+struct ThreadTimer
+{
+  HANDLE   handle;
+  uint64_t spinTail;
+};
+
+static _Thread_local struct ThreadTimer threadTimer = { 0 };
 
 struct LGTimer
 {
   LGTimerFn   fn;
   void      * udata;
-  UINT_PTR    handle;
-  bool        running;
+  HANDLE      timer;
+  HANDLE      stop;
+  HANDLE      thread;
 };
 
-static void TimerProc(HWND Arg1, UINT Arg2, UINT_PTR Arg3, DWORD Arg4)
+HANDLE lgGetThreadTimer()
 {
-  LGTimer * timer = (LGTimer *)Arg3;
-  if (!timer->fn(timer->udata))
+  if (threadTimer.handle)
+    return threadTimer.handle;
+
+  threadTimer.handle = CreateWaitableTimerExW(NULL, NULL,
+      CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+
+  // fall back to a normal timer on older versions of Windows
+  if (!threadTimer.handle)
+    threadTimer.handle = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+
+  if (!threadTimer.handle)
+    DEBUG_WINERROR("Failed to create the thread timer", GetLastError());
+
+  threadTimer.spinTail = SPIN_TAIL_INIT;
+  return threadTimer.handle;
+}
+
+uint64_t nanotime()
+{
+  static LARGE_INTEGER freq = { 0 };
+  if (!freq.QuadPart)
+    QueryPerformanceFrequency(&freq);
+
+  LARGE_INTEGER time;
+  QueryPerformanceCounter(&time);
+
+  // split to avoid overflowing the multiply
+  return (time.QuadPart / freq.QuadPart) * 1000000000ULL +
+    (time.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+}
+
+void nsleep(uint64_t ns)
+{
+  const uint64_t end = nanotime() + ns;
+
+  // sleep on the timer for all but the tail the timer may overshoot by
+  HANDLE timer = lgGetThreadTimer();
+  if (timer && ns > threadTimer.spinTail + SPIN_TAIL_MIN)
   {
-    KillTimer(Arg1, timer->handle);
-    timer->running = false;
+    const uint64_t wake = end - threadTimer.spinTail;
+    LARGE_INTEGER  due  =
+    {
+      .QuadPart = -(LONGLONG)((ns - threadTimer.spinTail) / 100)
+    };
+
+    if (SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE) &&
+        WaitForSingleObject(timer, INFINITE) == WAIT_OBJECT_0)
+    {
+      // track twice the average lateness so the spin nearly always covers it
+      const uint64_t now  = nanotime();
+      const uint64_t late = now > wake ? now - wake : 0;
+      uint64_t       tail = threadTimer.spinTail;
+
+      tail = tail - tail / 8 + late / 4;
+      if (tail < SPIN_TAIL_MIN)
+        tail = SPIN_TAIL_MIN;
+      else if (tail > SPIN_TAIL_MAX)
+        tail = SPIN_TAIL_MAX;
+      threadTimer.spinTail = tail;
+    }
   }
+
+  while(nanotime() < end)
+    YieldProcessor();
+}
+
+static DWORD WINAPI timerThread(LPVOID lpParameter)
+{
+  LGTimer * timer   = (LGTimer *)lpParameter;
+  HANDLE  handles[] = { timer->stop, timer->timer };
+
+  while(WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+    if (!timer->fn(timer->udata))
+      break;
+
+  CancelWaitableTimer(timer->timer);
+  return 0;
 }
 
 bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
     void * udata, LGTimer ** result)
 {
-  LGTimer * ret = malloc(sizeof(LGTimer));
+  LGTimer * ret = calloc(sizeof(LGTimer), 1);
   if (!ret)
   {
     DEBUG_ERROR("failed to malloc LGTimer struct");
     return false;
   }
 
-  ret->fn      = fn;
-  ret->udata   = udata;
-  ret->running = true;
-  ret->handle  = SetTimer(MessageHWND, (UINT_PTR)ret, intervalMS, TimerProc);
+  ret->fn    = fn;
+  ret->udata = udata;
+  ret->timer = CreateWaitableTimerExW(NULL, NULL,
+      CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+  if (!ret->timer)
+    ret->timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+
+  if (!ret->timer)
+  {
+    DEBUG_WINERROR("failed to create the timer", GetLastError());
+    goto fail;
+  }
+
+  if (!(ret->stop = CreateEvent(NULL, TRUE, FALSE, NULL)))
+  {
+    DEBUG_WINERROR("failed to create the timer stop event", GetLastError());
+    goto fail;
+  }
+
+  LARGE_INTEGER due = { .QuadPart = -(LONGLONG)intervalMS * 10000LL };
+  if (!SetWaitableTimer(ret->timer, &due, intervalMS, NULL, NULL, FALSE))
+  {
+    DEBUG_WINERROR("failed to set the timer", GetLastError());
+    goto fail;
+  }
+
+  if (!(ret->thread = CreateThread(NULL, 0, timerThread, ret, 0, NULL)))
+  {
+    DEBUG_WINERROR("failed to create the timer thread", GetLastError());
+    goto fail;
+  }
 
   *result = ret;
   return true;
+
+fail:
+  if (ret->timer)
+    CloseHandle(ret->timer);
+  if (ret->stop)
+    CloseHandle(ret->stop);
+  free(ret);
+  return false;
 }
 
 void lgTimerDestroy(LGTimer * timer)
 {
-  if (timer->running)
-  {
-    if (!KillTimer(MessageHWND, timer->handle))
-      DEBUG_ERROR("failed to destroy the timer");
-  }
+  SetEvent(timer->stop);
+  WaitForSingleObject(timer->thread, INFINITE);
 
+  CloseHandle(timer->thread);
+  CloseHandle(timer->stop  );
+  CloseHandle(timer->timer );
   free(timer);
 }
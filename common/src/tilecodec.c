@@ -0,0 +1,225 @@
+/*
+KVMGFX Client - A KVM Client for VGA Passthrough
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "common/tilecodec.h"
+
+#include <assert.h>
+#include <string.h>
+
+/*
+ * Each row of a tile is a sequence of ops, a byte with the type in the top
+ * two bits and the number of pixels less one in the rest. Ops never cross a
+ * row so a row of a tile is always one op or more.
+ */
+
+enum
+{
+  OP_RAW  = 0, // the pixels follow
+  OP_LEFT = 1, // repeat the pixel to the left
+  OP_UP   = 2  // copy the pixels of the row above
+};
+
+#define OP_MAX 64
+
+static FrameDamageRect getRect(const FrameDamageRect * rects,
+    unsigned int count, unsigned int width, unsigned int height,
+    unsigned int i)
+{
+  if (count)
+    return rects[i];
+
+  return (FrameDamageRect)
+  {
+    .width  = width,
+    .height = height
+  };
+}
+
+static inline unsigned int tilesIn(const FrameDamageRect * r)
+{
+  return ((r->width  + TILECODEC_SIZE - 1) / TILECODEC_SIZE) *
+         ((r->height + TILECODEC_SIZE - 1) / TILECODEC_SIZE);
+}
+
+unsigned int tilecodec_count(const FrameDamageRect * rects, unsigned int count,
+    unsigned int width, unsigned int height)
+{
+  unsigned int tiles = 0;
+  for(unsigned int i = 0; i < (count ? count : 1); ++i)
+  {
+    const FrameDamageRect r = getRect(rects, count, width, height, i);
+    tiles += tilesIn(&r);
+  }
+  return tiles;
+}
+
+FrameDamageRect tilecodec_tile(const FrameDamageRect * rects,
+    unsigned int count, unsigned int width, unsigned int height,
+    unsigned int index)
+{
+  for(unsigned int i = 0; i < (count ? count : 1); ++i)
+  {
+    const FrameDamageRect r = getRect(rects, count, width, height, i);
+    const unsigned int n = tilesIn(&r);
+    if (index >= n)
+    {
+      index -= n;
+      continue;
+    }
+
+    const unsigned int across = (r.width + TILECODEC_SIZE - 1) / TILECODEC_SIZE;
+    const unsigned int tx     = (index % across) * TILECODEC_SIZE;
+    const unsigned int ty     = (index / across) * TILECODEC_SIZE;
+    return (FrameDamageRect)
+    {
+      .x      = r.x + tx,
+      .y      = r.y + ty,
+      .width  = r.width  - tx < TILECODEC_SIZE ? r.width  - tx : TILECODEC_SIZE,
+      .height = r.height - ty < TILECODEC_SIZE ? r.height - ty : TILECODEC_SIZE
+    };
+  }
+
+  return (FrameDamageRect){ 0 };
+}
+
+static inline uint8_t * putRaw(uint8_t * out, const uint32_t * px,
+    unsigned int count)
+{
+  if (!count)
+    return out;
+
+  *out++ = (OP_RAW << 6) | (count - 1);
+  memcpy(out, px, count * sizeof(*px));
+  return out + count * sizeof(*px);
+}
+
+// a run only pays for itself at two pixels, a single pixel is left as raw
+static uint8_t * encodeRow(const uint32_t * row, const uint32_t * up,
+    unsigned int width, uint8_t * out)
+{
+  unsigned int raw = 0;
+  unsigned int x   = 0;
+  while(x < width)
+  {
+    unsigned int upRun = 0;
+    if (up)
+      while(x + upRun < width && row[x + upRun] == up[x + upRun])
+        ++upRun;
+
+    unsigned int leftRun = 0;
+    if (x)
+    {
+      const uint32_t left = row[x - 1];
+      while(x + leftRun < width && row[x + leftRun] == left)
+        ++leftRun;
+    }
+
+    const bool useUp       = upRun >= leftRun;
+    const unsigned int run = useUp ? upRun : leftRun;
+    if (run < 2)
+    {
+      ++x;
+      continue;
+    }
+
+    out    = putRaw(out, row + raw, x - raw);
+    *out++ = ((useUp ? OP_UP : OP_LEFT) << 6) | (run - 1);
+    x     += run;
+    raw    = x;
+  }
+
+  return putRaw(out, row + raw, x - raw);
+}
+
+size_t tilecodec_encode(const uint8_t * src, size_t pitch, unsigned int width,
+    unsigned int height, uint8_t * dst)
+{
+  assert(width <= TILECODEC_SIZE && width <= OP_MAX);
+
+  uint8_t * out = dst;
+  const uint32_t * up = NULL;
+  for(unsigned int y = 0; y < height; ++y, src += pitch)
+  {
+    const uint32_t * row = (const uint32_t *)src;
+    out = encodeRow(row, up, width, out);
+    up  = row;
+  }
+
+  return out - dst;
+}
+
+bool tilecodec_decode(const uint8_t * src, size_t size, uint8_t * dst,
+    size_t pitch, unsigned int width, unsigned int height)
+{
+  const uint8_t * in  = src;
+  const uint8_t * end = src + size;
+
+  const uint32_t * up = NULL;
+  for(unsigned int y = 0; y < height; ++y, dst += pitch)
+  {
+    uint32_t * row = (uint32_t *)dst;
+    unsigned int x = 0;
+    while(x < width)
+    {
+      if (in == end)
+        return false;
+
+      const uint8_t      op    = *in++;
+      const unsigned int count = (op & (OP_MAX - 1)) + 1;
+      if (count > width - x)
+        return false;
+
+      switch(op >> 6)
+      {
+        case OP_RAW:
+          if ((size_t)(end - in) < count * sizeof(*row))
+            return false;
+          memcpy(row + x, in, count * sizeof(*row));
+          in += count * sizeof(*row);
+          break;
+
+        case OP_LEFT:
+        {
+          if (!x)
+            return false;
+
+          const uint32_t left = row[x - 1];
+          for(unsigned int i = 0; i < count; ++i)
+            row[x + i] = left;
+          break;
+        }
+
+        case OP_UP:
+          if (!up)
+            return false;
+          memcpy(row + x, up + x, count * sizeof(*row));
+          break;
+
+        default:
+          return false;
+      }
+
+      x += count;
+    }
+
+    up = row;
+  }
+
+  return in == end;
+}
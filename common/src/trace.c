@@ -0,0 +1,214 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "common/trace.h"
+#include "common/debug.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+struct TraceEvent
+{
+  const char * name;
+  uint64_t     start;
+  uint64_t     end;
+};
+
+// only the owning thread writes a ring, readers use the write position to
+// tell which events have not been overwritten while they were copied
+struct TraceRing
+{
+  struct TraceRing    * next;
+  atomic_bool           inUse;
+  unsigned int          tid;
+  const char * volatile name;
+
+  atomic_uint_least64_t wp;
+  struct TraceEvent     events[LG_TRACE_EVENTS];
+};
+
+atomic_bool lgTraceEnabled = false;
+
+static struct
+{
+  const char              * process;
+  int                       pid;
+  atomic_int_least64_t      clockOffset;
+  atomic_uint               nextTID;
+  _Atomic(struct TraceRing *) rings;
+  atomic_flag               dumping;
+}
+trace =
+{
+  .process = "unknown",
+  .dumping = ATOMIC_FLAG_INIT
+};
+
+static _Thread_local struct TraceRing * ring       = NULL;
+static _Thread_local const char       * threadName = NULL;
+
+void lgTraceInit(const char * process, int pid)
+{
+  trace.process = process;
+  trace.pid     = pid;
+  atomic_store(&lgTraceEnabled, true);
+}
+
+void lgTraceSetClockOffset(int64_t offset)
+{
+  atomic_store_explicit(&trace.clockOffset, offset, memory_order_relaxed);
+}
+
+void lgTraceSetThreadName(const char * name)
+{
+  threadName = name;
+  if (ring)
+    ring->name = name;
+}
+
+void lgTraceThreadExit()
+{
+  if (!ring)
+    return;
+
+  atomic_store(&ring->inUse, false);
+  ring = NULL;
+}
+
+static struct TraceRing * getRing()
+{
+  // reuse the ring of a thread that has gone
+  struct TraceRing * r = atomic_load(&trace.rings);
+  for(; r; r = r->next)
+  {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&r->inUse, &expected, true))
+      break;
+  }
+
+  if (!r)
+  {
+    r = (struct TraceRing *)calloc(1, sizeof(*r));
+    if (!r)
+    {
+      // don't try again on every event
+      DEBUG_ERROR("Failed to allocate a trace ring, tracing disabled");
+      atomic_store(&lgTraceEnabled, false);
+      return NULL;
+    }
+
+    r->tid = atomic_fetch_add(&trace.nextTID, 1) + 1;
+    atomic_store(&r->inUse, true);
+
+    r->next = atomic_load(&trace.rings);
+    while(!atomic_compare_exchange_weak(&trace.rings, &r->next, r)) {}
+  }
+
+  r->name = threadName ? threadName : "main";
+  return r;
+}
+
+void lgTraceRecord(const char * name, uint64_t start, uint64_t end)
+{
+  if (!ring && !(ring = getRing()))
+    return;
+
+  const uint64_t      wp = atomic_load_explicit(&ring->wp, memory_order_relaxed);
+  struct TraceEvent * e  = &ring->events[wp % LG_TRACE_EVENTS];
+  e->name  = name;
+  e->start = start;
+  e->end   = end;
+  atomic_store_explicit(&ring->wp, wp + 1, memory_order_release);
+}
+
+static void dumpRing(FILE * fp, struct TraceRing * r, struct TraceEvent * copy,
+    int64_t offset)
+{
+  fprintf(fp,
+    ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+    "\"args\":{\"name\":\"%s\"}}",
+    trace.pid, r->tid, r->name);
+
+  const uint64_t end   = atomic_load_explicit(&r->wp, memory_order_acquire);
+  const uint64_t start = end > LG_TRACE_EVENTS ? end - LG_TRACE_EVENTS : 0;
+  for(uint64_t i = start; i < end; ++i)
+    copy[i - start] = r->events[i % LG_TRACE_EVENTS];
+
+  // drop anything the owner wrote over while it was copied, the slot after
+  // the write position may be part way through being written
+  const uint64_t now   = atomic_load_explicit(&r->wp, memory_order_acquire);
+  const uint64_t valid = now >= LG_TRACE_EVENTS ? now - LG_TRACE_EVENTS + 1 : 0;
+
+  for(uint64_t i = start > valid ? start : valid; i < end; ++i)
+  {
+    const struct TraceEvent * e = &copy[i - start];
+    fprintf(fp,
+      ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" PRId64 ",\"dur\":%" PRIu64
+      ",\"pid\":%d,\"tid\":%u}",
+      e->name, (int64_t)e->start + offset, e->end - e->start,
+      trace.pid, r->tid);
+  }
+}
+
+bool lgTraceDump(const char * path)
+{
+  if (atomic_flag_test_and_set(&trace.dumping))
+    return false;
+
+  bool ret = false;
+  struct TraceEvent * copy = NULL;
+  FILE * fp = fopen(path, "w");
+  if (!fp)
+  {
+    DEBUG_ERROR("Failed to open the trace file: %s", path);
+    goto out;
+  }
+
+  copy = (struct TraceEvent *)malloc(sizeof(*copy) * LG_TRACE_EVENTS);
+  if (!copy)
+  {
+    DEBUG_ERROR("Failed to allocate memory for the trace dump");
+    goto out;
+  }
+
+  const int64_t offset =
+    atomic_load_explicit(&trace.clockOffset, memory_order_relaxed);
+
+  fprintf(fp,
+    "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+    "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,"
+    "\"args\":{\"name\":\"%s\"}}",
+    trace.pid, trace.process);
+
+  for(struct TraceRing * r = atomic_load(&trace.rings); r; r = r->next)
+    dumpRing(fp, r, copy, offset);
+
+  fprintf(fp, "\n]}\n");
+  ret = true;
+  DEBUG_INFO("Trace written to: %s", path);
+
+out:
+  free(copy);
+  if (fp)
+    fclose(fp);
+  atomic_flag_clear(&trace.dumping);
+  return ret;
+}
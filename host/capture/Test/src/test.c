@@ -0,0 +1,630 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "interface/capture.h"
+#include "common/debug.h"
+#include "common/event.h"
+#include "common/damage.h"
+#include "common/locking.h"
+#include "common/option.h"
+#include "common/time.h"
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <math.h>
+
+/*
+ * A synthetic capture that draws a test pattern at a fixed rate, this needs
+ * no GPU or desktop so the rest of the pipeline can be benchmarked alone.
+ *
+ * Each frame a band covering test:damage percent of the frame is redrawn in
+ * a new colour, the band moves down the frame so every buffer is exercised.
+ */
+
+#define POINTER_SIZE 32
+
+enum CursorPattern
+{
+  CURSOR_NONE,
+  CURSOR_CIRCLE,
+  CURSOR_BOUNCE
+};
+
+struct test
+{
+  bool              initialized;
+  volatile bool     stop;
+  LGEvent         * frameEvent;
+
+  CaptureGetPointerBuffer  getPointerBufferFn;
+  CapturePostPointerBuffer postPointerBufferFn;
+
+  unsigned int      formatVer;
+  unsigned int      width, height;
+  unsigned int      bpp;
+  CaptureFormat     format;
+  unsigned int      damage;
+  enum CursorPattern cursor;
+  uint64_t          interval; // ns between frames, zero to run unpaced
+
+  uint8_t         * data;
+  uint64_t          nextFrame;
+  unsigned int      bandY;
+  uint64_t          serial;
+  bool              shapeSent;
+  int               cursorX, cursorY, cursorDX, cursorDY;
+
+  // the changes made since the frame thread last took a frame
+  LG_Lock           lock;
+  bool              pending;
+  uint64_t          pendingSerial;
+  uint64_t          pendingTime;
+  FrameDamage       pendingDamage;
+
+  // the frame being sent
+  uint64_t          frameSerial;
+  FrameDamage       frameDamage;
+};
+
+static struct test * this = NULL;
+
+static const char * test_getName()
+{
+  return "Test";
+}
+
+static bool test_validateFormat(struct Option * opt, const char ** error)
+{
+  const char * f = opt->value.x_string;
+  if (strcmp(f, "bgra"  ) == 0 || strcmp(f, "rgba"   ) == 0 ||
+      strcmp(f, "rgba10") == 0 || strcmp(f, "rgba16f") == 0)
+    return true;
+
+  *error = "Invalid format, must be one of: bgra, rgba, rgba10, rgba16f";
+  return false;
+}
+
+static bool test_validateCursor(struct Option * opt, const char ** error)
+{
+  const char * c = opt->value.x_string;
+  if (strcmp(c, "none") == 0 || strcmp(c, "circle") == 0 ||
+      strcmp(c, "bounce") == 0)
+    return true;
+
+  *error = "Invalid cursor pattern, must be one of: none, circle, bounce";
+  return false;
+}
+
+static void test_initOptions()
+{
+  struct Option options[] =
+  {
+    {
+      .module         = "test",
+      .name           = "enable",
+      .description    = "Send a synthetic test pattern instead of capturing the desktop",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "test",
+      .name           = "width",
+      .description    = "The width of the test pattern",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 1920
+    },
+    {
+      .module         = "test",
+      .name           = "height",
+      .description    = "The height of the test pattern",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 1080
+    },
+    {
+      .module         = "test",
+      .name           = "format",
+      .description    = "The frame format (bgra, rgba, rgba10, rgba16f)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = "bgra",
+      .validator      = test_validateFormat
+    },
+    {
+      .module         = "test",
+      .name           = "fps",
+      .description    = "Frames per second to send (0 = as fast as possible)",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 60
+    },
+    {
+      .module         = "test",
+      .name           = "damage",
+      .description    = "The percentage of the frame that changes each frame (0-100)",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 100
+    },
+    {
+      .module         = "test",
+      .name           = "cursor",
+      .description    = "How the cursor moves (none, circle, bounce)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = "circle",
+      .validator      = test_validateCursor
+    },
+    {0}
+  };
+
+  option_register(options);
+}
+
+static bool test_create(
+    CaptureGetPointerBuffer  getPointerBufferFn,
+    CapturePostPointerBuffer postPointerBufferFn)
+{
+  assert(!this);
+
+  // never picked over a real capture unless asked for
+  if (!option_get_bool("test", "enable"))
+    return false;
+
+  const int width  = option_get_int("test", "width" );
+  const int height = option_get_int("test", "height");
+  const int fps    = option_get_int("test", "fps"   );
+  const int damage = option_get_int("test", "damage");
+  if (width < 2 || height < 2 || fps < 0 || damage < 0 || damage > 100)
+  {
+    DEBUG_ERROR("Invalid test pattern settings");
+    return false;
+  }
+
+  this             = (struct test *)calloc(sizeof(struct test), 1);
+  this->frameEvent = lgCreateEvent(true, 20);
+
+  if (!this->frameEvent)
+  {
+    DEBUG_ERROR("Failed to create the frame event");
+    free(this);
+    this = NULL;
+    return false;
+  }
+
+  this->width    = width  & ~1;
+  this->height   = height & ~1;
+  this->damage   = damage;
+  this->interval = fps ? 1000000000ULL / fps : 0;
+
+  const char * format = option_get_string("test", "format");
+  this->bpp = 4;
+  if (strcmp(format, "rgba") == 0)
+    this->format = CAPTURE_FMT_RGBA;
+  else if (strcmp(format, "rgba10") == 0)
+    this->format = CAPTURE_FMT_RGBA10;
+  else if (strcmp(format, "rgba16f") == 0)
+  {
+    this->format = CAPTURE_FMT_RGBA16F;
+    this->bpp    = 8;
+  }
+  else
+    this->format = CAPTURE_FMT_BGRA;
+
+  const char * cursor = option_get_string("test", "cursor");
+  if (strcmp(cursor, "none") == 0)
+    this->cursor = CURSOR_NONE;
+  else if (strcmp(cursor, "bounce") == 0)
+    this->cursor = CURSOR_BOUNCE;
+  else
+    this->cursor = CURSOR_CIRCLE;
+
+  LG_LOCK_INIT(this->lock);
+  this->getPointerBufferFn  = getPointerBufferFn;
+  this->postPointerBufferFn = postPointerBufferFn;
+  return true;
+}
+
+// a pixel of the format for the colour, the components are 0.0 to 1.0
+static uint64_t test_pixel(float r, float g, float b)
+{
+  switch(this->format)
+  {
+    case CAPTURE_FMT_BGRA:
+      return 0xFF000000U | (uint32_t)(r * 255.0f) << 16 |
+        (uint32_t)(g * 255.0f) << 8 | (uint32_t)(b * 255.0f);
+
+    case CAPTURE_FMT_RGBA:
+      return 0xFF000000U | (uint32_t)(b * 255.0f) << 16 |
+        (uint32_t)(g * 255.0f) << 8 | (uint32_t)(r * 255.0f);
+
+    case CAPTURE_FMT_RGBA10:
+      return 0xC0000000U | (uint32_t)(b * 1023.0f) << 20 |
+        (uint32_t)(g * 1023.0f) << 10 | (uint32_t)(r * 1023.0f);
+
+    case CAPTURE_FMT_RGBA16F:
+    {
+      // half floats of 0.0 to 1.0 in 1/1024 steps starting at 1/16
+      #define HALF(x) ((x) < 0.0625f ? 0 : \
+          (uint64_t)(0x2C00 + (uint32_t)(((x) - 0.0625f) / 0.9375f * 0x1000)))
+      return HALF(r) | HALF(g) << 16 | HALF(b) << 32 | (uint64_t)0x3C00 << 48;
+      #undef HALF
+    }
+
+    default:
+      return 0;
+  }
+}
+
+static void test_fillRows(unsigned int y, unsigned int height, uint64_t pixel)
+{
+  const size_t pitch = (size_t)this->width * this->bpp;
+  uint8_t * row = this->data + pitch * y;
+
+  // fill the first row and copy it down
+  if (this->bpp == 8)
+    for(unsigned int x = 0; x < this->width; ++x)
+      ((uint64_t *)row)[x] = pixel;
+  else
+    for(unsigned int x = 0; x < this->width; ++x)
+      ((uint32_t *)row)[x] = (uint32_t)pixel;
+
+  for(unsigned int i = 1; i < height; ++i)
+    memcpy(row + pitch * i, row, pitch);
+}
+
+// a colour that changes each frame
+static uint64_t test_serialPixel(uint64_t serial)
+{
+  static const float colours[][3] =
+  {
+    { 1.0f, 0.0f, 0.0f },
+    { 0.0f, 1.0f, 0.0f },
+    { 0.0f, 0.0f, 1.0f },
+    { 1.0f, 1.0f, 0.0f },
+    { 0.0f, 1.0f, 1.0f },
+    { 1.0f, 0.0f, 1.0f },
+    { 1.0f, 1.0f, 1.0f }
+  };
+
+  const float * c = colours[serial % (sizeof(colours) / sizeof(*colours))];
+  return test_pixel(c[0], c[1], c[2]);
+}
+
+static bool test_init()
+{
+  assert(this);
+  assert(!this->initialized);
+
+  this->stop = false;
+  lgResetEvent(this->frameEvent);
+
+  this->data = malloc((size_t)this->width * this->height * this->bpp);
+  if (!this->data)
+  {
+    DEBUG_ERROR("Failed to allocate the test pattern");
+    return false;
+  }
+
+  // horizontal bars of grey so a missing update is easy to see
+  const unsigned int bars = 8;
+  for(unsigned int i = 0; i < bars; ++i)
+  {
+    const unsigned int y0 = this->height *  i      / bars;
+    const unsigned int y1 = this->height * (i + 1) / bars;
+    const float        v  = (float)i / (bars - 1);
+    test_fillRows(y0, y1 - y0, test_pixel(v, v, v));
+  }
+
+  DEBUG_INFO("Frame Size       : %u x %u", this->width, this->height);
+  DEBUG_INFO("Frame Rate       : %s%.2f", this->interval ? "" : "unpaced ",
+      this->interval ? 1e9 / this->interval : 0.0);
+  DEBUG_INFO("Damage           : %u%%", this->damage);
+
+  this->bandY        = 0;
+  this->serial       = 0;
+  this->shapeSent    = false;
+  this->nextFrame    = nanotime();
+  this->cursorX      = this->width  / 2;
+  this->cursorY      = this->height / 2;
+  this->cursorDX     = 7;
+  this->cursorDY     = 5;
+  this->pending      = false;
+
+  // the first frame is always sent in full
+  damage_set_full(&this->pendingDamage);
+
+  ++this->formatVer;
+  this->initialized = true;
+  return true;
+}
+
+static void test_stop()
+{
+  this->stop = true;
+  lgSignalEvent(this->frameEvent);
+}
+
+static bool test_deinit()
+{
+  assert(this);
+  free(this->data);
+  this->data        = NULL;
+  this->initialized = false;
+  return true;
+}
+
+static void test_free()
+{
+  lgFreeEvent(this->frameEvent);
+  free(this);
+  this = NULL;
+}
+
+static size_t test_getMaxFrameSize()
+{
+  return (size_t)this->width * this->height * this->bpp;
+}
+
+// a white square with a black border
+static void test_sendShape()
+{
+  void   * data;
+  uint32_t size;
+  if (!this->getPointerBufferFn(&data, &size) ||
+      size < POINTER_SIZE * POINTER_SIZE * 4)
+    return;
+
+  uint32_t * d = (uint32_t *)data;
+  for(int y = 0; y < POINTER_SIZE; ++y)
+    for(int x = 0; x < POINTER_SIZE; ++x)
+    {
+      const bool edge = x < 2 || y < 2 ||
+        x >= POINTER_SIZE - 2 || y >= POINTER_SIZE - 2;
+      d[y * POINTER_SIZE + x] = edge ? 0xFF000000 : 0xFFFFFFFF;
+    }
+
+  const CapturePointer pointer =
+  {
+    .positionUpdate = true,
+    .x              = this->cursorX,
+    .y              = this->cursorY,
+    .visible        = true,
+    .shapeUpdate    = true,
+    .format         = CAPTURE_FMT_COLOR,
+    .width          = POINTER_SIZE,
+    .height         = POINTER_SIZE,
+    .pitch          = POINTER_SIZE * 4
+  };
+
+  this->postPointerBufferFn(pointer);
+  this->shapeSent = true;
+}
+
+static void test_moveCursor()
+{
+  switch(this->cursor)
+  {
+    case CURSOR_NONE:
+      return;
+
+    case CURSOR_CIRCLE:
+    {
+      // one turn every two seconds at 60fps
+      const double a = (double)this->serial * (2.0 * M_PI / 120.0);
+      const int    r = (this->height < this->width ? this->height : this->width) / 3;
+      this->cursorX = this->width  / 2 + (int)(cos(a) * r);
+      this->cursorY = this->height / 2 + (int)(sin(a) * r);
+      break;
+    }
+
+    case CURSOR_BOUNCE:
+      this->cursorX += this->cursorDX;
+      this->cursorY += this->cursorDY;
+      if (this->cursorX < 0 || this->cursorX >= (int)this->width - POINTER_SIZE)
+      {
+        this->cursorDX = -this->cursorDX;
+        this->cursorX += this->cursorDX * 2;
+      }
+      if (this->cursorY < 0 || this->cursorY >= (int)this->height - POINTER_SIZE)
+      {
+        this->cursorDY = -this->cursorDY;
+        this->cursorY += this->cursorDY * 2;
+      }
+      break;
+  }
+
+  const CapturePointer pointer =
+  {
+    .positionUpdate = true,
+    .x              = this->cursorX,
+    .y              = this->cursorY,
+    .visible        = true
+  };
+  this->postPointerBufferFn(pointer);
+}
+
+static CaptureResult test_capture()
+{
+  assert(this);
+  assert(this->initialized);
+
+  if (this->cursor != CURSOR_NONE && !this->shapeSent)
+    test_sendShape();
+
+  // sleep until the frame is due, then schedule the next from when this one
+  // was due so the rate does not drift
+  if (this->interval)
+  {
+    const uint64_t now = nanotime();
+    if (now < this->nextFrame)
+    {
+      const uint64_t wait = this->nextFrame - now;
+      nsleep(wait < 100000000ULL ? wait : 100000000ULL);
+      if (nanotime() < this->nextFrame)
+        return CAPTURE_RESULT_TIMEOUT;
+    }
+
+    this->nextFrame += this->interval;
+
+    // if we fell behind by more than a frame start again from now rather
+    // than sending a burst to catch up
+    if (this->nextFrame + this->interval < now)
+      this->nextFrame = now + this->interval;
+  }
+
+  if (this->stop)
+    return CAPTURE_RESULT_TIMEOUT;
+
+  ++this->serial;
+  test_moveCursor();
+
+  // the band the next getFrame redraws
+  FrameDamageRect rects[2];
+  unsigned int count = 0;
+  if (this->damage == 100)
+    count = 0;
+  else if (this->damage > 0)
+  {
+    unsigned int bandH = this->height * this->damage / 100;
+    if (bandH < 1)
+      bandH = 1;
+
+    const unsigned int y = this->bandY;
+    const unsigned int h = y + bandH > this->height ? this->height - y : bandH;
+    rects[count++] = (FrameDamageRect){ 0, y, this->width, h };
+    if (h < bandH)
+      rects[count++] = (FrameDamageRect){ 0, 0, this->width, bandH - h };
+    this->bandY = (y + bandH) % this->height;
+  }
+
+  LG_LOCK(this->lock);
+  if (this->damage == 0)
+  {
+    // only the cursor moved
+    if (!this->pendingDamage.full && this->pendingDamage.count == 0)
+    {
+      LG_UNLOCK(this->lock);
+      return CAPTURE_RESULT_OK;
+    }
+  }
+  else
+    damage_add(&this->pendingDamage, rects, count);
+
+  this->pending       = true;
+  this->pendingSerial = this->serial;
+  this->pendingTime   = microtime();
+  LG_UNLOCK(this->lock);
+
+  lgSignalEvent(this->frameEvent);
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult test_waitFrame(CaptureFrame * frame)
+{
+  assert(this);
+  assert(this->initialized);
+
+  LG_LOCK(this->lock);
+  if (!this->pending)
+  {
+    LG_UNLOCK(this->lock);
+
+    // NOTE: the event may be signaled when there are no frames available
+    if (!lgWaitEvent(this->frameEvent, 1000))
+      return CAPTURE_RESULT_TIMEOUT;
+
+    LG_LOCK(this->lock);
+    if (!this->pending)
+    {
+      LG_UNLOCK(this->lock);
+      return CAPTURE_RESULT_TIMEOUT;
+    }
+  }
+
+  this->frameDamage = this->pendingDamage;
+  this->frameSerial = this->pendingSerial;
+  frame->presentTime = this->pendingTime;
+  damage_reset(&this->pendingDamage);
+  this->pending = false;
+  LG_UNLOCK(this->lock);
+
+  frame->formatVer    = this->formatVer;
+  frame->width        = this->width;
+  frame->height       = this->height;
+  frame->screenWidth  = this->width;
+  frame->screenHeight = this->height;
+  frame->pitch        = this->width * this->bpp;
+  frame->stride       = this->width;
+  frame->format       = this->format;
+
+  if (this->frameDamage.full)
+    frame->damageRectsCount = 0;
+  else
+  {
+    frame->damageRectsCount = this->frameDamage.count;
+    memcpy(frame->damageRects, this->frameDamage.rects,
+        this->frameDamage.count * sizeof(FrameDamageRect));
+  }
+
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult test_getFrame(FrameBuffer * frame,
+    const FrameDamageRect * rects, unsigned int rectsCount)
+{
+  assert(this);
+  assert(this->initialized);
+
+  // draw the changes into the pattern, a full frame redraws just the band
+  // so the first frame keeps the grey bars
+  const uint64_t pixel = test_serialPixel(this->frameSerial);
+  if (!this->frameDamage.full)
+    for(unsigned int i = 0; i < this->frameDamage.count; ++i)
+      test_fillRows(this->frameDamage.rects[i].y,
+          this->frameDamage.rects[i].height, pixel);
+  else if (this->frameSerial && this->damage == 100)
+    test_fillRows(0, this->height, pixel);
+
+  const unsigned int pitch = this->width * this->bpp;
+  if (rectsCount == 0)
+    framebuffer_write(frame, this->data, (size_t)pitch * this->height);
+  else
+    framebuffer_write_rects(frame, this->data, pitch, this->height, this->bpp,
+        rects, rectsCount);
+
+  return CAPTURE_RESULT_OK;
+}
+
+static void test_wakeFrame()
+{
+  assert(this);
+  lgSignalEvent(this->frameEvent);
+}
+
+struct CaptureInterface Capture_Test =
+{
+  .getName         = test_getName,
+  .initOptions     = test_initOptions,
+  .create          = test_create,
+  .init            = test_init,
+  .stop            = test_stop,
+  .deinit          = test_deinit,
+  .free            = test_free,
+  .getMaxFrameSize = test_getMaxFrameSize,
+  .capture         = test_capture,
+  .waitFrame       = test_waitFrame,
+  .getFrame        = test_getFrame,
+  .wakeFrame       = test_wakeFrame
+};
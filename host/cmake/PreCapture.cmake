@@ -14,3 +14,12 @@ function(add_capture name)
   set(CAPTURE_LINK "${CAPTURE_LINK};capture_${name}" PARENT_SCOPE)
   add_subdirectory(${name})
 endfunction()
+
+# captures that are not tied to a platform live in host/capture
+set(CAPTURE_SHARED_DIR "${CMAKE_CURRENT_LIST_DIR}/../capture")
+function(add_shared_capture name)
+  set(CAPTURE      "${CAPTURE};${name}" PARENT_SCOPE)
+  set(CAPTURE_LINK "${CAPTURE_LINK};capture_${name}" PARENT_SCOPE)
+  add_subdirectory("${CAPTURE_SHARED_DIR}/${name}"
+    "${CMAKE_CURRENT_BINARY_DIR}/${name}")
+endfunction()
@@ -22,6 +22,7 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <stdbool.h>
 #include <stdint.h>
 #include "common/framebuffer.h"
+#include "common/KVMFR.h"
 
 typedef enum CaptureResult
 {
@@ -40,6 +41,7 @@ typedef enum CaptureFormat
   CAPTURE_FMT_RGBA10 ,
   CAPTURE_FMT_RGBA16F,
   CAPTURE_FMT_YUV420 ,
+  CAPTURE_FMT_H264   ,
 
   // pointer formats
   CAPTURE_FMT_COLOR ,
@@ -50,14 +52,33 @@ typedef enum CaptureFormat
 }
 CaptureFormat;
 
+// a region of the desktop, a zero width or height is the whole desktop
+typedef struct CaptureRect
+{
+  unsigned int x, y;
+  unsigned int width, height;
+}
+CaptureRect;
+
 typedef struct CaptureFrame
 {
-  unsigned int   formatVer;
-  unsigned int   width;
-  unsigned int   height;
-  unsigned int   pitch;
-  unsigned int   stride;
-  CaptureFormat  format;
+  unsigned int    formatVer;
+  unsigned int    width;
+  unsigned int    height;
+  unsigned int    pitch;
+  unsigned int    stride;
+  CaptureFormat   format;
+
+  // the size of the desktop if the frame was scaled, zero if not
+  unsigned int    screenWidth;
+  unsigned int    screenHeight;
+
+  // the microtime the guest presented the frame, zero if unknown
+  uint64_t        presentTime;
+
+  // the areas changed since the last frame, zero if the entire frame changed
+  unsigned int    damageRectsCount;
+  FrameDamageRect damageRects[KVMFR_MAX_DAMAGE_RECTS];
 }
 CaptureFrame;
 
@@ -75,6 +96,19 @@ typedef struct CapturePointer
 }
 CapturePointer;
 
+// statistics an interface may keep, see KVMFRStats
+typedef struct CaptureStats
+{
+  // the predicted microseconds between the guest's presents, zero if unknown
+  unsigned int presentInterval;
+
+  // presents that arrived inside the window of the prediction, and those that
+  // did not
+  uint64_t     presentHits;
+  uint64_t     presentMisses;
+}
+CaptureStats;
+
 typedef bool (*CaptureGetPointerBuffer )(void ** data, uint32_t * size);
 typedef void (*CapturePostPointerBuffer)(CapturePointer pointer);
 
@@ -89,13 +123,113 @@ typedef struct CaptureInterface
   );
 
   bool          (*init           )();
+
+  // optional, recover from CAPTURE_RESULT_REINIT keeping the device and only
+  // recreating what depends on the mode. If this fails the caller does a full
+  // deinit and init
+  bool          (*reinit         )();
+
   void          (*stop           )();
   bool          (*deinit         )();
   void          (*free           )();
-  unsigned int  (*getMaxFrameSize)();
+  size_t        (*getMaxFrameSize)();
 
   CaptureResult (*capture   )();
   CaptureResult (*waitFrame )(CaptureFrame * frame);
-  CaptureResult (*getFrame  )(FrameBuffer  * frame);
+  CaptureResult (*getFrame  )(FrameBuffer  * frame,
+      const FrameDamageRect * rects, unsigned int rectsCount);
+
+  // optional, the size the client displays the frame at so the interface can
+  // scale it down before it is copied, zero for the native resolution
+  void          (*setTargetSize)(unsigned int width, unsigned int height);
+
+  // optional, restrict the capture to a region of the desktop, the frame is
+  // then the size of the region and the pointer is relative to it
+  void          (*setCrop)(CaptureRect crop);
+
+  // optional, the formats the client can show natively as a mask of
+  // 1 << CaptureFormat (zero if it did not say) and the one it prefers
+  // (CAPTURE_FMT_MAX for no preference), the interface should pick the
+  // capture and conversion path from these
+  void          (*setFormats)(unsigned int formats, CaptureFormat preferred);
+
+  // optional, the most frames per second the client wants, zero for no limit.
+  // frames over the limit should be dropped before they are copied
+  void          (*setFrameRate)(unsigned int maxFPS);
+
+  // optional, fill in the statistics the interface keeps
+  void          (*getStats)(CaptureStats * stats);
+
+  // optional, make a waitFrame in progress return soon, it may return
+  // CAPTURE_RESULT_TIMEOUT. Called from another thread
+  void          (*wakeFrame)();
 }
 CaptureInterface;
+
+/**
+ * Clamp the crop to the source, the result is rounded down to an even size
+ * and position. Returns false if the whole source is to be captured
+ */
+static inline bool captureClampCrop(unsigned int srcWidth,
+    unsigned int srcHeight, CaptureRect * crop)
+{
+  if (crop->width && crop->height &&
+      crop->x < srcWidth && crop->y < srcHeight)
+  {
+    crop->x &= ~1U;
+    crop->y &= ~1U;
+    if (crop->width  > srcWidth  - crop->x) crop->width  = srcWidth  - crop->x;
+    if (crop->height > srcHeight - crop->y) crop->height = srcHeight - crop->y;
+    crop->width  &= ~1U;
+    crop->height &= ~1U;
+
+    if (crop->width >= 2 && crop->height >= 2 &&
+        (crop->width != srcWidth || crop->height != srcHeight))
+      return true;
+  }
+
+  crop->x      = 0;
+  crop->y      = 0;
+  crop->width  = srcWidth;
+  crop->height = srcHeight;
+  return false;
+}
+
+/**
+ * Fit the source size inside the target keeping the aspect ratio, the result
+ * is never larger than the source and is rounded down to an even size.
+ * Returns false if no scaling is required
+ */
+static inline bool captureFitTarget(unsigned int srcWidth,
+    unsigned int srcHeight, unsigned int targetWidth, unsigned int targetHeight,
+    unsigned int * width, unsigned int * height)
+{
+  *width  = srcWidth;
+  *height = srcHeight;
+
+  if (!targetWidth || !targetHeight ||
+      (targetWidth >= srcWidth && targetHeight >= srcHeight))
+    return false;
+
+  if ((uint64_t)targetWidth * srcHeight < (uint64_t)targetHeight * srcWidth)
+  {
+    *width  = targetWidth;
+    *height = (uint64_t)srcHeight * targetWidth / srcWidth;
+  }
+  else
+  {
+    *width  = (uint64_t)srcWidth * targetHeight / srcHeight;
+    *height = targetHeight;
+  }
+
+  *width  &= ~1U;
+  *height &= ~1U;
+  if (*width < 2 || *height < 2)
+  {
+    *width  = srcWidth;
+    *height = srcHeight;
+    return false;
+  }
+
+  return true;
+}
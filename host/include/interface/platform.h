@@ -20,6 +20,8 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include "common/KVMFR.h"
 
 int  app_main(int argc, char * argv[]);
 bool app_init();
@@ -28,3 +30,29 @@ void app_quit();
 // these must be implemented for each OS
 const char * os_getExecutable();
 const char * os_getDataPath();
+
+// inject the input the client sends through the shared memory, init returns
+// false if the OS can not and the client then uses SPICE, events are given
+// from a single thread
+bool os_inputInit();
+void os_inputFree();
+bool os_inputEvent(const KVMFRInputEvent * event);
+
+// sync the guest clipboard with the client, init returns false if the OS can
+// not, changeFn is called from a thread of the OS code each time something
+// other than os_clipboardSet changes the clipboard
+typedef void (*ClipboardChangeFn)(KVMFRClipboardType type, const void * data,
+    size_t size);
+
+bool os_clipboardInit(ClipboardChangeFn changeFn);
+void os_clipboardFree();
+bool os_clipboardSet(KVMFRClipboardType type, const void * data, size_t size);
+
+// capture what the guest plays, init returns false if the OS can not, dataFn
+// is called from a thread of the OS code with interleaved float samples, the
+// captureTime is the microtime of the first sample
+typedef void (*AudioDataFn)(uint32_t sampleRate, uint32_t channels,
+    const float * data, uint32_t frames, uint64_t captureTime);
+
+bool os_audioInit(AudioDataFn dataFn);
+void os_audioFree();
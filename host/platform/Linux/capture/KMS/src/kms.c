@@ -0,0 +1,708 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "interface/capture.h"
+#include "interface/platform.h"
+#include "common/debug.h"
+#include "common/event.h"
+#include "common/option.h"
+#include "common/locking.h"
+#include "common/time.h"
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+
+// the number of bands a GPU read back is published in
+#define READ_BANDS 8
+
+struct Buffer
+{
+  uint32_t     fbID;
+  int          dmabuf;
+  unsigned int width, height, pitch, offset;
+  uint32_t     format;
+  uint64_t     modifier;
+  bool         linear;
+  uint64_t     presentTime;
+};
+
+struct kms
+{
+  bool      initialized;
+  bool      stop;
+  int       fd;
+  uint32_t  crtcID;
+  uint32_t  vblankPipe;
+  LGEvent * frameEvent;
+
+  CaptureGetPointerBuffer  getPointerBufferFn;
+  CapturePostPointerBuffer postPointerBufferFn;
+
+  // the newest buffer found by the capture thread, and the one being sent
+  LG_Lock       bufferLock;
+  bool          hasPending;
+  struct Buffer pending;
+  struct Buffer current;
+  uint32_t      lastFbID;
+
+  // the mapping of the current buffer if it is linear
+  void        * map;
+  size_t        mapSize;
+
+  // buffers with tiled layouts are read back through the GPU
+  bool          eglFailed;
+  EGLDisplay    display;
+  EGLContext    context;
+  GLuint        texture;
+  GLuint        fbo;
+  PFNEGLCREATEIMAGEKHRPROC            eglCreateImageKHR;
+  PFNEGLDESTROYIMAGEKHRPROC           eglDestroyImageKHR;
+  PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
+
+  unsigned int formatVer;
+  unsigned int width, height;
+  uint32_t     format;
+  bool         readBack;
+};
+
+static struct kms * this = NULL;
+
+// forwards
+
+static bool kms_deinit();
+
+// implementation
+
+static const char * kms_getName()
+{
+  return "KMS";
+}
+
+static void kms_initOptions()
+{
+  struct Option options[] =
+  {
+    {
+      .module         = "kms",
+      .name           = "device",
+      .description    = "The DRM device to capture the scanout of",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = "/dev/dri/card0"
+    },
+    {0}
+  };
+
+  option_register(options);
+}
+
+static bool kms_create(
+    CaptureGetPointerBuffer  getPointerBufferFn,
+    CapturePostPointerBuffer postPointerBufferFn)
+{
+  assert(!this);
+  this             = (struct kms *)calloc(sizeof(struct kms), 1);
+  this->fd         = -1;
+  this->frameEvent = lgCreateEvent(true, 20);
+
+  if (!this->frameEvent)
+  {
+    DEBUG_ERROR("Failed to create the frame event");
+    free(this);
+    return false;
+  }
+
+  this->pending.dmabuf      = -1;
+  this->current.dmabuf      = -1;
+  this->getPointerBufferFn  = getPointerBufferFn;
+  this->postPointerBufferFn = postPointerBufferFn;
+  return true;
+}
+
+static bool kms_init()
+{
+  assert(this);
+  assert(!this->initialized);
+
+  this->stop       = false;
+  this->hasPending = false;
+  this->lastFbID   = 0;
+  LG_LOCK_INIT(this->bufferLock);
+  lgResetEvent(this->frameEvent);
+
+  const char * device = option_get_string("kms", "device");
+  this->fd = open(device, O_RDWR | O_CLOEXEC);
+  if (this->fd < 0)
+  {
+    DEBUG_ERROR("Failed to open %s", device);
+    goto fail;
+  }
+
+  // find the first active CRTC, the buffer on its primary plane is the desktop
+  drmModeRes * res = drmModeGetResources(this->fd);
+  if (!res)
+  {
+    DEBUG_ERROR("Failed to get the DRM resources");
+    goto fail;
+  }
+
+  for(int i = 0; i < res->count_crtcs; ++i)
+  {
+    drmModeCrtc * crtc = drmModeGetCrtc(this->fd, res->crtcs[i]);
+    if (!crtc)
+      continue;
+
+    if (crtc->mode_valid && crtc->buffer_id)
+    {
+      this->crtcID = crtc->crtc_id;
+      this->width  = crtc->width;
+      this->height = crtc->height;
+
+      if (i == 0)
+        this->vblankPipe = 0;
+      else if (i == 1)
+        this->vblankPipe = DRM_VBLANK_SECONDARY;
+      else
+        this->vblankPipe = (i << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+          DRM_VBLANK_HIGH_CRTC_MASK;
+
+      drmModeFreeCrtc(crtc);
+      break;
+    }
+
+    drmModeFreeCrtc(crtc);
+  }
+  drmModeFreeResources(res);
+
+  if (!this->crtcID)
+  {
+    DEBUG_ERROR("Failed to find an active CRTC");
+    goto fail;
+  }
+
+  DEBUG_INFO("Device           : %s", device);
+  DEBUG_INFO("CRTC             : %u", this->crtcID);
+  DEBUG_INFO("Frame Size       : %u x %u", this->width, this->height);
+
+  ++this->formatVer;
+  this->initialized = true;
+  return true;
+fail:
+  kms_deinit();
+  return false;
+}
+
+static void kms_stop()
+{
+  this->stop = true;
+  lgSignalEvent(this->frameEvent);
+}
+
+static void kms_releaseBuffer(struct Buffer * buffer)
+{
+  if (buffer->dmabuf >= 0)
+  {
+    close(buffer->dmabuf);
+    buffer->dmabuf = -1;
+  }
+  buffer->fbID = 0;
+}
+
+static void kms_unmapCurrent()
+{
+  if (this->map)
+  {
+    munmap(this->map, this->mapSize);
+    this->map = NULL;
+  }
+}
+
+static void kms_freeEGL()
+{
+  if (this->display == EGL_NO_DISPLAY)
+    return;
+
+  if (this->fbo)
+  {
+    glDeleteFramebuffers(1, &this->fbo);
+    this->fbo = 0;
+  }
+
+  if (this->texture)
+  {
+    glDeleteTextures(1, &this->texture);
+    this->texture = 0;
+  }
+
+  eglMakeCurrent(this->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  if (this->context != EGL_NO_CONTEXT)
+  {
+    eglDestroyContext(this->display, this->context);
+    this->context = EGL_NO_CONTEXT;
+  }
+
+  eglTerminate(this->display);
+  this->display = EGL_NO_DISPLAY;
+}
+
+static bool kms_deinit()
+{
+  assert(this);
+
+  kms_unmapCurrent();
+  kms_releaseBuffer(&this->pending);
+  kms_releaseBuffer(&this->current);
+  this->hasPending = false;
+
+  if (this->fd >= 0)
+  {
+    close(this->fd);
+    this->fd = -1;
+  }
+
+  this->crtcID      = 0;
+  this->initialized = false;
+  return true;
+}
+
+static void kms_free()
+{
+  // the context was made current on the frame thread which has now exited
+  kms_freeEGL();
+  lgFreeEvent(this->frameEvent);
+  free(this);
+  this = NULL;
+}
+
+static size_t kms_getMaxFrameSize()
+{
+  // the largest pitch a scanout buffer is likely to be padded to
+  return (size_t)((this->width * 4 + 255) & ~255) * this->height;
+}
+
+// export the buffer behind the framebuffer as a DMA-BUF
+static bool kms_exportBuffer(uint32_t fbID, struct Buffer * buffer)
+{
+  drmModeFB2 * fb = drmModeGetFB2(this->fd, fbID);
+  if (!fb)
+  {
+    DEBUG_ERROR("Failed to get the framebuffer, is the host running as root?");
+    return false;
+  }
+
+  bool ret = false;
+  if (!fb->handles[0])
+  {
+    DEBUG_ERROR("No handle for the framebuffer, CAP_SYS_ADMIN is required");
+    goto out;
+  }
+
+  if (drmPrimeHandleToFD(this->fd, fb->handles[0], DRM_CLOEXEC | DRM_RDWR,
+        &buffer->dmabuf) != 0)
+  {
+    DEBUG_ERROR("Failed to export the framebuffer");
+    goto out;
+  }
+
+  // buffers without modifiers use the implicit linear layout
+  buffer->fbID     = fbID;
+  buffer->width    = fb->width;
+  buffer->height   = fb->height;
+  buffer->pitch    = fb->pitches[0];
+  buffer->offset   = fb->offsets[0];
+  buffer->format   = fb->pixel_format;
+  buffer->modifier = (fb->flags & DRM_MODE_FB_MODIFIERS) ?
+    fb->modifier : DRM_FORMAT_MOD_LINEAR;
+  buffer->linear   = buffer->modifier == DRM_FORMAT_MOD_LINEAR;
+  ret = true;
+
+out:
+  // the handles are ours to close, the DMA-BUF holds its own reference
+  for(int i = 0; i < 4; ++i)
+  {
+    if (!fb->handles[i])
+      continue;
+
+    bool dup = false;
+    for(int j = 0; j < i; ++j)
+      if (fb->handles[j] == fb->handles[i])
+        dup = true;
+
+    if (!dup)
+    {
+      struct drm_gem_close gemClose = { .handle = fb->handles[i] };
+      drmIoctl(this->fd, DRM_IOCTL_GEM_CLOSE, &gemClose);
+    }
+  }
+
+  drmModeFreeFB2(fb);
+  return ret;
+}
+
+static CaptureResult kms_capture()
+{
+  assert(this);
+  assert(this->initialized);
+
+  // pace to the display, a new frame can only be scanned out on vblank
+  drmVBlank vbl =
+  {
+    .request =
+    {
+      .type     = DRM_VBLANK_RELATIVE | this->vblankPipe,
+      .sequence = 1
+    }
+  };
+
+  // the vblank timestamp is CLOCK_MONOTONIC which is also the microtime base
+  uint64_t presentTime;
+  if (drmWaitVBlank(this->fd, &vbl) == 0)
+    presentTime = (uint64_t)vbl.reply.tval_sec * 1000000LL + vbl.reply.tval_usec;
+  else
+  {
+    usleep(1000);
+    presentTime = microtime();
+  }
+
+  drmModeCrtc * crtc = drmModeGetCrtc(this->fd, this->crtcID);
+  if (!crtc)
+  {
+    DEBUG_ERROR("Failed to get the CRTC");
+    return CAPTURE_RESULT_ERROR;
+  }
+
+  const uint32_t fbID = crtc->buffer_id;
+  const bool     resized =
+    crtc->width != this->width || crtc->height != this->height;
+  drmModeFreeCrtc(crtc);
+
+  if (resized || !fbID)
+    return CAPTURE_RESULT_REINIT;
+
+  // nothing was flipped, compositors present by flipping to a new buffer
+  if (fbID == this->lastFbID)
+    return CAPTURE_RESULT_TIMEOUT;
+
+  struct Buffer buffer = { .dmabuf = -1 };
+  if (!kms_exportBuffer(fbID, &buffer))
+    return CAPTURE_RESULT_ERROR;
+
+  this->lastFbID     = fbID;
+  buffer.presentTime = presentTime;
+
+  // replace any buffer the frame thread has not taken yet
+  LG_LOCK(this->bufferLock);
+  kms_releaseBuffer(&this->pending);
+  this->pending    = buffer;
+  this->hasPending = true;
+  LG_UNLOCK(this->bufferLock);
+
+  lgSignalEvent(this->frameEvent);
+  return CAPTURE_RESULT_OK;
+}
+
+static bool kms_initEGL()
+{
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (!getPlatformDisplay)
+  {
+    DEBUG_ERROR("eglGetPlatformDisplayEXT is not available");
+    return false;
+  }
+
+  this->display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+      EGL_DEFAULT_DISPLAY, NULL);
+  if (this->display == EGL_NO_DISPLAY || !eglInitialize(this->display, NULL, NULL))
+  {
+    DEBUG_ERROR("Failed to initialize the surfaceless EGL display");
+    this->display = EGL_NO_DISPLAY;
+    return false;
+  }
+
+  const char * exts = eglQueryString(this->display, EGL_EXTENSIONS);
+  if (!strstr(exts, "EGL_EXT_image_dma_buf_import_modifiers") ||
+      !strstr(exts, "EGL_KHR_surfaceless_context") ||
+      !strstr(exts, "EGL_KHR_no_config_context"))
+  {
+    DEBUG_ERROR("DMA-BUF import with modifiers is not supported");
+    return false;
+  }
+
+  this->eglCreateImageKHR  = (PFNEGLCREATEIMAGEKHRPROC )eglGetProcAddress("eglCreateImageKHR" );
+  this->eglDestroyImageKHR = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
+  this->glEGLImageTargetTexture2DOES =
+    (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)eglGetProcAddress("glEGLImageTargetTexture2DOES");
+
+  if (!this->eglCreateImageKHR || !this->eglDestroyImageKHR ||
+      !this->glEGLImageTargetTexture2DOES)
+  {
+    DEBUG_ERROR("Failed to get the EGL image functions");
+    return false;
+  }
+
+  eglBindAPI(EGL_OPENGL_ES_API);
+  const EGLint ctxAttribs[] =
+  {
+    EGL_CONTEXT_CLIENT_VERSION, 2,
+    EGL_NONE
+  };
+
+  this->context = eglCreateContext(this->display, EGL_NO_CONFIG_KHR,
+      EGL_NO_CONTEXT, ctxAttribs);
+  if (this->context == EGL_NO_CONTEXT)
+  {
+    DEBUG_ERROR("Failed to create the EGL context");
+    return false;
+  }
+
+  if (!eglMakeCurrent(this->display, EGL_NO_SURFACE, EGL_NO_SURFACE, this->context))
+  {
+    DEBUG_ERROR("Failed to make the EGL context current");
+    return false;
+  }
+
+  glGenTextures(1, &this->texture);
+  glBindTexture(GL_TEXTURE_2D, this->texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glGenFramebuffers(1, &this->fbo);
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  return true;
+}
+
+// the capture format of a linear buffer, or false if it is not supported
+static bool kms_getFormat(uint32_t format, CaptureFormat * out)
+{
+  switch(format)
+  {
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_ARGB8888:
+      *out = CAPTURE_FMT_BGRA;
+      return true;
+
+    case DRM_FORMAT_XBGR8888:
+    case DRM_FORMAT_ABGR8888:
+      *out = CAPTURE_FMT_RGBA;
+      return true;
+
+    case DRM_FORMAT_XBGR2101010:
+    case DRM_FORMAT_ABGR2101010:
+      *out = CAPTURE_FMT_RGBA10;
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+static CaptureResult kms_waitFrame(CaptureFrame * frame)
+{
+  assert(this);
+  assert(this->initialized);
+
+  if (!lgWaitEvent(this->frameEvent, 1000))
+    return CAPTURE_RESULT_TIMEOUT;
+
+  if (this->stop)
+    return CAPTURE_RESULT_REINIT;
+
+  LG_LOCK(this->bufferLock);
+  if (!this->hasPending)
+  {
+    LG_UNLOCK(this->bufferLock);
+    return CAPTURE_RESULT_TIMEOUT;
+  }
+
+  kms_unmapCurrent();
+  kms_releaseBuffer(&this->current);
+  this->current          = this->pending;
+  this->pending.dmabuf   = -1;
+  this->hasPending       = false;
+  LG_UNLOCK(this->bufferLock);
+
+  struct Buffer * buf = &this->current;
+  CaptureFormat   format;
+  bool            readBack = !buf->linear || !kms_getFormat(buf->format, &format);
+
+  if (!readBack)
+  {
+    this->mapSize = buf->offset + buf->pitch * buf->height;
+    this->map     = mmap(NULL, this->mapSize, PROT_READ, MAP_SHARED, buf->dmabuf, 0);
+    if (this->map == MAP_FAILED)
+    {
+      this->map = NULL;
+      readBack  = true;
+    }
+  }
+
+  if (readBack)
+  {
+    if (this->eglFailed)
+    {
+      DEBUG_ERROR("Unsupported framebuffer layout 0x%" PRIx64 " format 0x%x",
+          buf->modifier, buf->format);
+      return CAPTURE_RESULT_ERROR;
+    }
+
+    if (this->display == EGL_NO_DISPLAY && !kms_initEGL())
+    {
+      kms_freeEGL();
+      this->eglFailed = true;
+      return CAPTURE_RESULT_ERROR;
+    }
+
+    // the GPU converts the buffer into packed RGBA as it is read back
+    format = CAPTURE_FMT_RGBA;
+  }
+
+  const unsigned int pitch = readBack ? buf->width * 4 : buf->pitch;
+  if (readBack != this->readBack || format != this->format ||
+      pitch * buf->height > kms_getMaxFrameSize())
+  {
+    if (pitch * buf->height > kms_getMaxFrameSize())
+    {
+      DEBUG_ERROR("The framebuffer is larger than the maximum frame size");
+      return CAPTURE_RESULT_ERROR;
+    }
+
+    this->readBack = readBack;
+    this->format   = format;
+    ++this->formatVer;
+  }
+
+  frame->formatVer        = this->formatVer;
+  frame->width            = buf->width;
+  frame->height           = buf->height;
+  frame->screenWidth      = buf->width;
+  frame->screenHeight     = buf->height;
+  frame->pitch            = pitch;
+  frame->stride           = pitch / 4;
+  frame->format           = format;
+  frame->presentTime      = buf->presentTime;
+  frame->damageRectsCount = 0;
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult kms_readBack(FrameBuffer * frame)
+{
+  const struct Buffer * buf = &this->current;
+  const EGLint attribs[] =
+  {
+    EGL_WIDTH                         , buf->width,
+    EGL_HEIGHT                        , buf->height,
+    EGL_LINUX_DRM_FOURCC_EXT          , buf->format,
+    EGL_DMA_BUF_PLANE0_FD_EXT         , buf->dmabuf,
+    EGL_DMA_BUF_PLANE0_OFFSET_EXT     , buf->offset,
+    EGL_DMA_BUF_PLANE0_PITCH_EXT      , buf->pitch,
+    EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, (EGLint)(buf->modifier & 0xFFFFFFFF),
+    EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT, (EGLint)(buf->modifier >> 32),
+    EGL_NONE
+  };
+
+  EGLImageKHR image = this->eglCreateImageKHR(this->display, EGL_NO_CONTEXT,
+      EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+  if (image == EGL_NO_IMAGE_KHR)
+  {
+    DEBUG_ERROR("Failed to import the DMA-BUF");
+    return CAPTURE_RESULT_ERROR;
+  }
+
+  glBindTexture(GL_TEXTURE_2D, this->texture);
+  this->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+  glBindFramebuffer(GL_FRAMEBUFFER, this->fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+      this->texture, 0);
+
+  CaptureResult result = CAPTURE_RESULT_OK;
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+  {
+    DEBUG_ERROR("The imported framebuffer is not complete");
+    result = CAPTURE_RESULT_ERROR;
+    goto out;
+  }
+
+  // read straight into the shared memory, publishing each band as it lands
+  uint8_t          * dst   = framebuffer_get_write_data(frame);
+  const unsigned int pitch = buf->width * 4;
+  const unsigned int band  = (buf->height + READ_BANDS - 1) / READ_BANDS;
+  for(unsigned int y = 0; y < buf->height; y += band)
+  {
+    const unsigned int rows = buf->height - y < band ? buf->height - y : band;
+    glReadPixels(0, y, buf->width, rows, GL_RGBA, GL_UNSIGNED_BYTE,
+        dst + y * pitch);
+    framebuffer_set_write_ptr(frame, (y + rows) * pitch);
+  }
+
+out:
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  this->eglDestroyImageKHR(this->display, image);
+  return result;
+}
+
+static CaptureResult kms_getFrame(FrameBuffer * frame,
+    const FrameDamageRect * rects, unsigned int rectsCount)
+{
+  assert(this);
+  assert(this->initialized);
+
+  if (this->readBack)
+    return kms_readBack(frame);
+
+  // bracket the CPU access so the exporter can keep the caches coherent
+  const struct Buffer * buf  = &this->current;
+  struct dma_buf_sync   sync = { .flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ };
+  ioctl(buf->dmabuf, DMA_BUF_IOCTL_SYNC, &sync);
+
+  framebuffer_write(frame, (uint8_t *)this->map + buf->offset,
+      buf->pitch * buf->height);
+
+  sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+  ioctl(buf->dmabuf, DMA_BUF_IOCTL_SYNC, &sync);
+  return CAPTURE_RESULT_OK;
+}
+
+struct CaptureInterface Capture_KMS =
+{
+  .getName         = kms_getName,
+  .initOptions     = kms_initOptions,
+  .create          = kms_create,
+  .init            = kms_init,
+  .stop            = kms_stop,
+  .deinit          = kms_deinit,
+  .free            = kms_free,
+  .getMaxFrameSize = kms_getMaxFrameSize,
+  .capture         = kms_capture,
+  .waitFrame       = kms_waitFrame,
+  .getFrame        = kms_getFrame
+};
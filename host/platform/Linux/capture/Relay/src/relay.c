@@ -0,0 +1,957 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "interface/capture.h"
+#include "common/debug.h"
+#include "common/event.h"
+#include "common/damage.h"
+#include "common/locking.h"
+#include "common/option.h"
+#include "common/stringutils.h"
+#include "common/thread.h"
+#include "common/time.h"
+#include "common/KVMFRRelay.h"
+#include "common/tilecodec.h"
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ * Takes the frames and cursor looking-glass-relay sends from another host,
+ * so the clients of this host show the desktop of that one.
+ *
+ * The receive thread reads the frame data straight into the image and then
+ * releases the frame, it waits for the frame thread to be done with the
+ * image before the next frame is read into it. The frame thread then writes
+ * the image out with the damage as any other capture does. Coded tiles are
+ * read into a buffer and decoded into the image.
+ */
+
+// the most rows read at once for a damage payload
+#define RELAY_IOV 64
+
+struct relay
+{
+  bool              initialized;
+  volatile bool     stop;
+  volatile bool     disconnected;
+  LGEvent         * frameEvent;
+  LGEvent         * takenEvent;
+  LGEvent         * closedEvent;
+
+  CaptureGetPointerBuffer  getPointerBufferFn;
+  CapturePostPointerBuffer postPointerBufferFn;
+
+  char            * host;
+  char            * port;
+  int               fd;
+  LGThread        * thread;
+  size_t            maxFrameSize;
+  uint8_t         * image;
+  uint8_t         * coded;
+  size_t            codedSize;
+
+  unsigned int      formatVer;
+  bool              formatValid;
+  uint32_t          lastFormatVer;
+
+  // the frame released to the frame thread, the image is only written by
+  // the receive thread when none is pending or being sent
+  LG_Lock           lock;
+  bool              pending;
+  bool              busy;
+  KVMFRRecordFrame  pendingInfo;
+  uint64_t          pendingTime;
+  FrameDamage       pendingDamage;
+
+  // the frame being sent
+  KVMFRRecordFrame  frameInfo;
+};
+
+static struct relay * this = NULL;
+
+static const char * relay_getName()
+{
+  return "Relay";
+}
+
+static void relay_initOptions()
+{
+  struct Option options[] =
+  {
+    {
+      .module         = "relay",
+      .name           = "connect",
+      .description    = "Show the desktop sent by looking-glass-relay at this host[:port] instead of capturing",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = NULL
+    },
+    {0}
+  };
+
+  option_register(options);
+}
+
+// split host[:port], an IPv6 address must be in brackets to have a port
+static bool relay_parseAddress(const char * addr)
+{
+  const char * end   = addr + strlen(addr);
+  const char * host  = addr;
+  const char * colon = strrchr(addr, ':');
+
+  if (*addr == '[')
+  {
+    const char * close = strchr(addr, ']');
+    if (!close || (close[1] && close[1] != ':'))
+      return false;
+
+    host  = addr + 1;
+    end   = close;
+    colon = close[1] ? close + 1 : NULL;
+  }
+  else if (colon && strchr(addr, ':') != colon)
+    colon = NULL; // a bare IPv6 address
+  else if (colon)
+    end = colon;
+
+  if (host == end)
+    return false;
+
+  this->host = strndup(host, end - host);
+  if (colon && colon[1])
+    this->port = strdup(colon + 1);
+  else
+    alloc_sprintf(&this->port, "%d", KVMFR_RELAY_PORT);
+
+  return this->host && this->port;
+}
+
+static bool relay_create(
+    CaptureGetPointerBuffer  getPointerBufferFn,
+    CapturePostPointerBuffer postPointerBufferFn)
+{
+  assert(!this);
+
+  // never picked over a real capture unless asked for
+  const char * addr = option_get_string("relay", "connect");
+  if (!addr)
+    return false;
+
+  this     = (struct relay *)calloc(sizeof(struct relay), 1);
+  this->fd = -1;
+  if (!relay_parseAddress(addr))
+  {
+    DEBUG_ERROR("Invalid relay address: %s", addr);
+    goto fail;
+  }
+
+  this->frameEvent  = lgCreateEvent(true, 20);
+  this->takenEvent  = lgCreateEvent(true, 20);
+  this->closedEvent = lgCreateEvent(false, 0);
+  if (!this->frameEvent || !this->takenEvent || !this->closedEvent)
+  {
+    DEBUG_ERROR("Failed to create the events");
+    goto fail;
+  }
+
+  LG_LOCK_INIT(this->lock);
+  this->getPointerBufferFn  = getPointerBufferFn;
+  this->postPointerBufferFn = postPointerBufferFn;
+  return true;
+
+fail:
+  if (this->frameEvent)
+    lgFreeEvent(this->frameEvent);
+  if (this->takenEvent)
+    lgFreeEvent(this->takenEvent);
+  if (this->closedEvent)
+    lgFreeEvent(this->closedEvent);
+  free(this->host);
+  free(this->port);
+  free(this);
+  this = NULL;
+  return false;
+}
+
+// read all of iov, it is modified to track the progress
+static bool relay_recvv(struct iovec * iov, int count)
+{
+  while(count)
+  {
+    const ssize_t len = readv(this->fd, iov, count);
+    if (len <= 0)
+    {
+      if (len < 0 && errno == EINTR)
+        continue;
+
+      if (!this->stop)
+      {
+        if (len == 0)
+          DEBUG_INFO("The relay disconnected");
+        else
+          DEBUG_ERROR("Failed to read from the relay: %s", strerror(errno));
+      }
+      return false;
+    }
+
+    size_t left = len;
+    while(count && left >= iov->iov_len)
+    {
+      left -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+
+    if (left)
+    {
+      iov->iov_base  = (uint8_t *)iov->iov_base + left;
+      iov->iov_len  -= left;
+    }
+  }
+
+  return true;
+}
+
+static bool relay_recv(void * data, size_t size)
+{
+  struct iovec iov = { .iov_base = data, .iov_len = size };
+  return relay_recvv(&iov, 1);
+}
+
+static bool relay_skip(size_t size)
+{
+  uint8_t discard[4096];
+  while(size)
+  {
+    const size_t len = size < sizeof(discard) ? size : sizeof(discard);
+    if (!relay_recv(discard, len))
+      return false;
+    size -= len;
+  }
+  return true;
+}
+
+static bool relay_connect()
+{
+  struct addrinfo hints =
+  {
+    .ai_family   = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM
+  };
+
+  struct addrinfo * res;
+  int err;
+  if ((err = getaddrinfo(this->host, this->port, &hints, &res)) != 0)
+  {
+    DEBUG_ERROR("Failed to resolve %s: %s", this->host, gai_strerror(err));
+    return false;
+  }
+
+  // the timeouts are for the connect and the hello only
+  const struct timeval timeout = { .tv_sec = 5 };
+  for(struct addrinfo * ai = res; ai; ai = ai->ai_next)
+  {
+    if ((this->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+      continue;
+
+    setsockopt(this->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(this->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(this->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+
+    close(this->fd);
+    this->fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (this->fd < 0)
+  {
+    DEBUG_ERROR("Failed to connect to the relay at %s:%s", this->host,
+        this->port);
+    return false;
+  }
+
+  const int one = 1;
+  setsockopt(this->fd, IPPROTO_TCP, TCP_NODELAY , &one, sizeof(one));
+  setsockopt(this->fd, SOL_SOCKET , SO_KEEPALIVE, &one, sizeof(one));
+
+  KVMFRRelayMsg   msg;
+  KVMFRRelayHello hello;
+  if (!relay_recv(&msg, sizeof(msg)))
+    return false;
+
+  if (msg.type != KVMFR_RELAY_HELLO || msg.size < sizeof(hello) ||
+      !relay_recv(&hello, sizeof(hello)) ||
+      memcmp(hello.magic, KVMFR_RELAY_MAGIC, sizeof(hello.magic)) != 0)
+  {
+    DEBUG_ERROR("%s:%s is not a Looking Glass relay", this->host, this->port);
+    return false;
+  }
+
+  if (hello.version != KVMFR_RELAY_VERSION ||
+      hello.kvmfrVersion != KVMFR_VERSION)
+  {
+    DEBUG_ERROR("Unsupported relay version %u (KVMFR %u), expected %u (KVMFR %u)",
+        hello.version, hello.kvmfrVersion, KVMFR_RELAY_VERSION, KVMFR_VERSION);
+    return false;
+  }
+
+  if (!relay_skip(msg.size - sizeof(hello)))
+    return false;
+
+  const struct timeval none = { 0 };
+  setsockopt(this->fd, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof(none));
+  setsockopt(this->fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+
+  char hostver[sizeof(hello.hostver) + 1];
+  memcpy(hostver, hello.hostver, sizeof(hello.hostver));
+  hostver[sizeof(hello.hostver)] = '\0';
+
+  this->maxFrameSize = hello.maxFrameSize;
+  DEBUG_INFO("Relay            : %s:%s from host %s", this->host, this->port,
+      hostver);
+  return true;
+}
+
+static bool relay_rectValid(const KVMFRRecordFrame * info,
+    const FrameDamageRect * r)
+{
+  const uint64_t x2 = (uint64_t)r->x + r->width;
+  const uint64_t y2 = (uint64_t)r->y + r->height;
+  return r->width && r->height && x2 <= info->width && y2 <= info->height &&
+    (y2 - 1) * info->pitch + x2 * info->bpp <= info->dataSize;
+}
+
+static bool relay_frameValid(const KVMFRRecordFrame * info,
+    const FrameDamageRect * rects, size_t * payloadSize)
+{
+  if (info->type <= FRAME_TYPE_INVALID || info->type >= FRAME_TYPE_MAX ||
+      info->dataSize > this->maxFrameSize)
+    return false;
+
+  switch(info->payload)
+  {
+    case KVMFR_PAYLOAD_FULL:
+      *payloadSize = info->dataSize;
+      return true;
+
+    case KVMFR_PAYLOAD_DAMAGE:
+      if ((info->bpp != 4 && info->bpp != 8) || !info->damageRectsCount)
+        return false;
+
+      *payloadSize = 0;
+      for(uint32_t i = 0; i < info->damageRectsCount; ++i)
+      {
+        if (!relay_rectValid(info, &rects[i]))
+          return false;
+        *payloadSize += (size_t)rects[i].width * rects[i].height * info->bpp;
+      }
+      return true;
+
+    // the payload size is the number of tiles
+    case KVMFR_PAYLOAD_TILES:
+    {
+      if (info->bpp != 4 || !info->width || !info->height ||
+          (uint64_t)(info->height - 1) * info->pitch +
+          (uint64_t)info->width * 4 > info->dataSize)
+        return false;
+
+      for(uint32_t i = 0; i < info->damageRectsCount; ++i)
+        if (!relay_rectValid(info, &rects[i]))
+          return false;
+
+      *payloadSize = tilecodec_count(rects, info->damageRectsCount,
+          info->width, info->height);
+      return true;
+    }
+
+    default:
+      return false;
+  }
+}
+
+// wait until the frame thread is done with the image
+static bool relay_waitImage()
+{
+  while(!this->stop)
+  {
+    LG_LOCK(this->lock);
+    const bool inUse = this->pending || this->busy;
+    LG_UNLOCK(this->lock);
+
+    if (!inUse)
+      return true;
+
+    lgWaitEvent(this->takenEvent, 100);
+  }
+  return false;
+}
+
+static bool relay_recvShape(size_t size)
+{
+  KVMFRRecordCursor info;
+  if (size < sizeof(info) || !relay_recv(&info, sizeof(info)))
+    return false;
+
+  const size_t dataSize = (size_t)info.height * info.pitch;
+  if (info.type > CURSOR_TYPE_MASKED_COLOR || sizeof(info) + dataSize != size)
+  {
+    DEBUG_ERROR("Invalid cursor shape from the relay");
+    return false;
+  }
+
+  void   * data;
+  uint32_t bufSize;
+  if (!this->getPointerBufferFn(&data, &bufSize))
+    return relay_skip(dataSize);
+
+  if (dataSize > bufSize)
+  {
+    DEBUG_WARN("The cursor shape is too large, skipping");
+    return relay_skip(dataSize);
+  }
+
+  if (!relay_recv(data, dataSize))
+    return false;
+
+  CapturePointer pointer =
+  {
+    .shapeUpdate = true,
+    .hx          = info.hx,
+    .hy          = info.hy,
+    .width       = info.width,
+    .height      = info.height,
+    .pitch       = info.pitch
+  };
+
+  switch(info.type)
+  {
+    case CURSOR_TYPE_COLOR       : pointer.format = CAPTURE_FMT_COLOR ; break;
+    case CURSOR_TYPE_MONOCHROME  : pointer.format = CAPTURE_FMT_MONO  ; break;
+    case CURSOR_TYPE_MASKED_COLOR: pointer.format = CAPTURE_FMT_MASKED; break;
+  }
+
+  this->postPointerBufferFn(pointer);
+  return true;
+}
+
+static bool relay_recvPos(size_t size)
+{
+  KVMFRCursorPos pos;
+  if (size < sizeof(pos) || !relay_recv(&pos, sizeof(pos)) ||
+      !relay_skip(size - sizeof(pos)))
+    return false;
+
+  const CapturePointer pointer =
+  {
+    .positionUpdate = true,
+    .x              = pos.x,
+    .y              = pos.y,
+    .visible        = pos.visible
+  };
+  this->postPointerBufferFn(pointer);
+  return true;
+}
+
+// any message that is not frame data, false if the stream can not go on
+static bool relay_recvOther(const KVMFRRelayMsg * msg)
+{
+  switch(msg->type)
+  {
+    case KVMFR_RELAY_CURSOR_SHAPE:
+      return relay_recvShape(msg->size);
+
+    case KVMFR_RELAY_CURSOR_POS:
+      return relay_recvPos(msg->size);
+
+    case KVMFR_RELAY_HELLO:
+    case KVMFR_RELAY_FRAME:
+    case KVMFR_RELAY_FRAME_DATA:
+      DEBUG_ERROR("Unexpected message %u from the relay", msg->type);
+      return false;
+
+    // skip messages from a later version
+    default:
+      return relay_skip(msg->size);
+  }
+}
+
+// the next FRAME_DATA message, handling the cursor updates sent before it
+static bool relay_nextData(size_t * size)
+{
+  for(;;)
+  {
+    KVMFRRelayMsg msg;
+    if (!relay_recv(&msg, sizeof(msg)))
+      return false;
+
+    if (msg.type == KVMFR_RELAY_FRAME_DATA)
+    {
+      *size = msg.size;
+      return true;
+    }
+
+    if (!relay_recvOther(&msg))
+      return false;
+  }
+}
+
+// the payload is the data in order, in messages of any size
+static bool relay_recvData(const KVMFRRecordFrame * info,
+    const FrameDamageRect * rects, size_t payloadSize)
+{
+  uint32_t rect = 0, row = 0;
+  size_t   rowDone = 0;
+  size_t   done    = 0;
+  while(done < payloadSize)
+  {
+    size_t len;
+    if (!relay_nextData(&len))
+      return false;
+
+    if (len > payloadSize - done)
+    {
+      DEBUG_ERROR("Too much frame data from the relay");
+      return false;
+    }
+
+    done += len;
+    if (info->payload == KVMFR_PAYLOAD_FULL)
+    {
+      if (!relay_recv(this->image + done - len, len))
+        return false;
+      continue;
+    }
+
+    // read the rows of the damage rects in place, a message may end part way
+    // through a row
+    while(len)
+    {
+      struct iovec iov[RELAY_IOV];
+      int n = 0;
+      while(n < RELAY_IOV && len)
+      {
+        const FrameDamageRect * r = &rects[rect];
+        const size_t rowSize = (size_t)r->width * info->bpp;
+        size_t seg = rowSize - rowDone;
+        if (seg > len)
+          seg = len;
+
+        iov[n++] = (struct iovec)
+        {
+          .iov_base = this->image + (size_t)(r->y + row) * info->pitch +
+            (size_t)r->x * info->bpp + rowDone,
+          .iov_len  = seg
+        };
+        len     -= seg;
+        rowDone += seg;
+
+        if (rowDone == rowSize)
+        {
+          rowDone = 0;
+          if (++row == r->height)
+          {
+            row = 0;
+            ++rect;
+          }
+        }
+      }
+
+      if (!relay_recvv(iov, n))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+// the tiles are decoded as each message of whole tiles arrives
+static bool relay_recvTiles(const KVMFRRecordFrame * info, unsigned int tiles)
+{
+  const size_t tileMax = sizeof(TileHeader) +
+    tilecodec_maxSize(TILECODEC_SIZE, TILECODEC_SIZE);
+
+  unsigned int done = 0;
+  while(done < tiles)
+  {
+    size_t len;
+    if (!relay_nextData(&len))
+      return false;
+
+    if (len > (size_t)(tiles - done) * tileMax)
+    {
+      DEBUG_ERROR("Too much frame data from the relay");
+      return false;
+    }
+
+    if (len > this->codedSize)
+    {
+      free(this->coded);
+      if (!(this->coded = malloc(len)))
+      {
+        DEBUG_ERROR("Out of memory");
+        this->codedSize = 0;
+        return false;
+      }
+      this->codedSize = len;
+    }
+
+    if (!relay_recv(this->coded, len))
+      return false;
+
+    for(size_t pos = 0; pos < len; ++done)
+    {
+      TileHeader hdr;
+      if (done == tiles || len - pos < sizeof(hdr))
+        goto invalid;
+
+      memcpy(&hdr, this->coded + pos, sizeof(hdr));
+      pos += sizeof(hdr);
+
+      const FrameDamageRect r =
+      {
+        .x      = hdr.x,
+        .y      = hdr.y,
+        .width  = hdr.width,
+        .height = hdr.height
+      };
+
+      if (hdr.width > TILECODEC_SIZE || hdr.height > TILECODEC_SIZE ||
+          !relay_rectValid(info, &r) || hdr.size > len - pos ||
+          !tilecodec_decode(this->coded + pos, hdr.size,
+            this->image + (size_t)hdr.y * info->pitch + (size_t)hdr.x * 4,
+            info->pitch, hdr.width, hdr.height))
+        goto invalid;
+
+      pos += hdr.size;
+    }
+  }
+
+  return true;
+
+invalid:
+  DEBUG_ERROR("Invalid tile from the relay");
+  return false;
+}
+
+static bool relay_recvFrame(size_t size)
+{
+  KVMFRRecordFrame info;
+  FrameDamageRect  rects[KVMFR_MAX_DAMAGE_RECTS];
+  if (size < sizeof(info) || !relay_recv(&info, sizeof(info)) ||
+      info.damageRectsCount > KVMFR_MAX_DAMAGE_RECTS ||
+      size != sizeof(info) + info.damageRectsCount * sizeof(*rects) ||
+      !relay_recv(rects, info.damageRectsCount * sizeof(*rects)))
+    return false;
+
+  size_t payloadSize;
+  if (!relay_frameValid(&info, rects, &payloadSize))
+  {
+    DEBUG_ERROR("Invalid frame from the relay");
+    return false;
+  }
+
+  if (!relay_waitImage())
+    return false;
+
+  if (info.payload == KVMFR_PAYLOAD_TILES)
+  {
+    if (!relay_recvTiles(&info, payloadSize))
+      return false;
+  }
+  else if (!relay_recvData(&info, rects, payloadSize))
+    return false;
+
+  LG_LOCK(this->lock);
+  if (!this->formatValid || info.formatVer != this->lastFormatVer)
+  {
+    this->lastFormatVer = info.formatVer;
+    this->formatValid   = true;
+    ++this->formatVer;
+    damage_set_full(&this->pendingDamage);
+  }
+
+  // a full payload is sent when the damage did not cover everything
+  if (info.payload == KVMFR_PAYLOAD_FULL)
+    damage_set_full(&this->pendingDamage);
+  else
+    damage_add(&this->pendingDamage, rects, info.damageRectsCount);
+
+  this->pendingInfo = info;
+  this->pendingTime = microtime();
+  this->pending     = true;
+  LG_UNLOCK(this->lock);
+
+  lgSignalEvent(this->frameEvent);
+  return true;
+}
+
+static int relay_thread(void * opaque)
+{
+  while(!this->stop)
+  {
+    KVMFRRelayMsg msg;
+    if (!relay_recv(&msg, sizeof(msg)))
+      break;
+
+    if (msg.type == KVMFR_RELAY_FRAME)
+    {
+      if (!relay_recvFrame(msg.size))
+        break;
+    }
+    else if (!relay_recvOther(&msg))
+      break;
+  }
+
+  this->disconnected = true;
+  lgSignalEvent(this->closedEvent);
+  lgSignalEvent(this->frameEvent);
+  return 0;
+}
+
+static bool relay_init()
+{
+  assert(this);
+  assert(!this->initialized);
+
+  this->stop         = false;
+  this->disconnected = false;
+  lgResetEvent(this->frameEvent);
+  lgResetEvent(this->takenEvent);
+  lgResetEvent(this->closedEvent);
+
+  if (!relay_connect())
+    goto fail;
+
+  this->image = calloc(1, this->maxFrameSize);
+  if (!this->image)
+  {
+    DEBUG_ERROR("Failed to allocate the relay image");
+    goto fail;
+  }
+
+  this->pending     = false;
+  this->busy        = false;
+  this->formatValid = false;
+  damage_reset(&this->pendingDamage);
+
+  if (!lgCreateThread("relayThread", relay_thread, NULL, &this->thread))
+  {
+    DEBUG_ERROR("Failed to create the relay thread");
+    goto fail;
+  }
+
+  this->initialized = true;
+  return true;
+
+fail:
+  free(this->image);
+  this->image = NULL;
+  if (this->fd >= 0)
+  {
+    close(this->fd);
+    this->fd = -1;
+  }
+  return false;
+}
+
+static void relay_stop()
+{
+  this->stop = true;
+
+  // wake the receive thread
+  if (this->fd >= 0)
+    shutdown(this->fd, SHUT_RDWR);
+
+  lgSignalEvent(this->frameEvent);
+  lgSignalEvent(this->takenEvent);
+  lgSignalEvent(this->closedEvent);
+}
+
+static bool relay_deinit()
+{
+  assert(this);
+  if (this->thread)
+  {
+    this->stop = true;
+    shutdown(this->fd, SHUT_RDWR);
+    lgSignalEvent(this->takenEvent);
+    lgJoinThread(this->thread, NULL);
+    this->thread = NULL;
+  }
+
+  if (this->fd >= 0)
+  {
+    close(this->fd);
+    this->fd = -1;
+  }
+
+  free(this->image);
+  free(this->coded);
+  this->image       = NULL;
+  this->coded       = NULL;
+  this->codedSize   = 0;
+  this->initialized = false;
+  return true;
+}
+
+static void relay_free()
+{
+  lgFreeEvent(this->frameEvent);
+  lgFreeEvent(this->takenEvent);
+  lgFreeEvent(this->closedEvent);
+  free(this->host);
+  free(this->port);
+  free(this);
+  this = NULL;
+}
+
+static size_t relay_getMaxFrameSize()
+{
+  return this->maxFrameSize;
+}
+
+static CaptureResult relay_capture()
+{
+  assert(this);
+  assert(this->initialized);
+
+  // the frames and cursor arrive on the receive thread
+  lgWaitEvent(this->closedEvent, 100);
+  if (this->disconnected && !this->stop)
+    return CAPTURE_RESULT_REINIT;
+
+  return CAPTURE_RESULT_TIMEOUT;
+}
+
+static CaptureResult relay_waitFrame(CaptureFrame * frame)
+{
+  assert(this);
+  assert(this->initialized);
+
+  LG_LOCK(this->lock);
+
+  // the last frame has been written out if the frame thread is waiting again
+  if (this->busy)
+  {
+    this->busy = false;
+    lgSignalEvent(this->takenEvent);
+  }
+
+  if (!this->pending)
+  {
+    LG_UNLOCK(this->lock);
+
+    // NOTE: the event may be signaled when there are no frames available
+    if (!lgWaitEvent(this->frameEvent, 1000))
+      return CAPTURE_RESULT_TIMEOUT;
+
+    LG_LOCK(this->lock);
+    if (!this->pending)
+    {
+      LG_UNLOCK(this->lock);
+      return CAPTURE_RESULT_TIMEOUT;
+    }
+  }
+
+  const FrameDamage damage = this->pendingDamage;
+  this->frameInfo    = this->pendingInfo;
+  frame->presentTime = this->pendingTime;
+  frame->formatVer   = this->formatVer;
+  damage_reset(&this->pendingDamage);
+  this->pending = false;
+  this->busy    = true;
+  LG_UNLOCK(this->lock);
+
+  const KVMFRRecordFrame * info = &this->frameInfo;
+  frame->width        = info->width;
+  frame->height       = info->height;
+  frame->screenWidth  = info->screenWidth;
+  frame->screenHeight = info->screenHeight;
+  frame->pitch        = info->pitch;
+  frame->stride       = info->stride;
+
+  switch(info->type)
+  {
+    case FRAME_TYPE_BGRA   : frame->format = CAPTURE_FMT_BGRA   ; break;
+    case FRAME_TYPE_RGBA   : frame->format = CAPTURE_FMT_RGBA   ; break;
+    case FRAME_TYPE_RGBA10 : frame->format = CAPTURE_FMT_RGBA10 ; break;
+    case FRAME_TYPE_RGBA16F: frame->format = CAPTURE_FMT_RGBA16F; break;
+    case FRAME_TYPE_YUV420 : frame->format = CAPTURE_FMT_YUV420 ; break;
+    case FRAME_TYPE_H264   : frame->format = CAPTURE_FMT_H264   ; break;
+    default:
+      return CAPTURE_RESULT_ERROR;
+  }
+
+  if (damage.full)
+    frame->damageRectsCount = 0;
+  else
+  {
+    frame->damageRectsCount = damage.count;
+    memcpy(frame->damageRects, damage.rects,
+        damage.count * sizeof(FrameDamageRect));
+  }
+
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult relay_getFrame(FrameBuffer * frame,
+    const FrameDamageRect * rects, unsigned int rectsCount)
+{
+  assert(this);
+  assert(this->initialized);
+
+  const KVMFRRecordFrame * info = &this->frameInfo;
+  if (rectsCount == 0 || !info->bpp)
+    framebuffer_write(frame, this->image, info->dataSize);
+  else
+    framebuffer_write_rects(frame, this->image, info->pitch, info->height,
+        info->bpp, rects, rectsCount);
+
+  // let the receive thread have the image back
+  LG_LOCK(this->lock);
+  this->busy = false;
+  LG_UNLOCK(this->lock);
+  lgSignalEvent(this->takenEvent);
+
+  return CAPTURE_RESULT_OK;
+}
+
+struct CaptureInterface Capture_Relay =
+{
+  .getName         = relay_getName,
+  .initOptions     = relay_initOptions,
+  .create          = relay_create,
+  .init            = relay_init,
+  .stop            = relay_stop,
+  .deinit          = relay_deinit,
+  .free            = relay_free,
+  .getMaxFrameSize = relay_getMaxFrameSize,
+  .capture         = relay_capture,
+  .waitFrame       = relay_waitFrame,
+  .getFrame        = relay_getFrame
+};
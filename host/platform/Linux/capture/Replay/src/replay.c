@@ -0,0 +1,792 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "interface/capture.h"
+#include "common/debug.h"
+#include "common/event.h"
+#include "common/damage.h"
+#include "common/locking.h"
+#include "common/option.h"
+#include "common/time.h"
+#include "common/KVMFRRecord.h"
+#include "common/tilecodec.h"
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Replays a recording made by the client profiler (profile:record) through
+ * the host as if it was being captured, so the clients can be tested against
+ * the exact frame sequence a user saw without a guest.
+ *
+ * The recording is mapped and walked in place. capture() paces the records
+ * and posts the cursor, the frame data is only applied to the image by
+ * getFrame so it never changes while it is being written out.
+ */
+
+struct replay
+{
+  bool              initialized;
+  volatile bool     stop;
+  LGEvent         * frameEvent;
+  LGEvent         * takenEvent;
+
+  CaptureGetPointerBuffer  getPointerBufferFn;
+  CapturePostPointerBuffer postPointerBufferFn;
+
+  bool              maxRate;
+  bool              loop;
+
+  uint8_t         * map;
+  size_t            mapSize;
+  size_t            first;        // the offset of the first record
+  size_t            end;          // the offset past the last complete record
+  size_t            maxFrameSize;
+  uint64_t          frames;
+
+  uint8_t         * image;
+  size_t            pos;          // the offset of the next record
+  uint64_t          startTime;    // nanotime the replay was at timeBase
+  uint64_t          timeBase;     // the record time playback started at
+  bool              finished;
+
+  unsigned int      formatVer;
+  bool              formatValid;
+  uint32_t          lastFormatVer;
+  bool              forceFull;
+
+  // the frames released since the frame thread last took one
+  LG_Lock           lock;
+  bool              pending;
+  size_t            pendingFirst, pendingLast;
+  uint64_t          pendingTime;
+  FrameDamage       pendingDamage;
+
+  // the frames being sent
+  size_t            frameFirst, frameLast;
+  FrameDamage       frameDamage;
+};
+
+static struct replay * this = NULL;
+
+static inline const KVMFRRecord * replay_record(size_t pos)
+{
+  return (const KVMFRRecord *)(this->map + pos);
+}
+
+static inline const KVMFRRecordFrame * replay_frameInfo(size_t pos)
+{
+  return (const KVMFRRecordFrame *)(replay_record(pos) + 1);
+}
+
+static const char * replay_getName()
+{
+  return "Replay";
+}
+
+static bool replay_validateRate(struct Option * opt, const char ** error)
+{
+  if (strcmp(opt->value.x_string, "original") == 0 ||
+      strcmp(opt->value.x_string, "max"     ) == 0)
+    return true;
+
+  *error = "Invalid rate, must be one of: original, max";
+  return false;
+}
+
+static void replay_initOptions()
+{
+  struct Option options[] =
+  {
+    {
+      .module         = "replay",
+      .name           = "file",
+      .description    = "Replay this recording instead of capturing the desktop",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = NULL
+    },
+    {
+      .module         = "replay",
+      .name           = "rate",
+      .description    = "The replay speed (original = as recorded, max = as fast as the frames are taken)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = "original",
+      .validator      = replay_validateRate
+    },
+    {
+      .module         = "replay",
+      .name           = "loop",
+      .description    = "Start the recording again when it ends",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {0}
+  };
+
+  option_register(options);
+}
+
+static bool replay_rectValid(const KVMFRRecordFrame * info,
+    const FrameDamageRect * r)
+{
+  const uint64_t x2 = (uint64_t)r->x + r->width;
+  const uint64_t y2 = (uint64_t)r->y + r->height;
+  return r->width && r->height && x2 <= info->width && y2 <= info->height &&
+    (y2 - 1) * info->pitch + x2 * info->bpp <= info->dataSize;
+}
+
+// walk the tile headers, the coded data is checked as it is decoded
+static bool replay_tilesValid(const KVMFRRecordFrame * info,
+    const FrameDamageRect * rects, size_t size)
+{
+  const uint8_t * pos = (const uint8_t *)(rects + info->damageRectsCount);
+  const unsigned int tiles = tilecodec_count(rects, info->damageRectsCount,
+      info->width, info->height);
+
+  for(unsigned int i = 0; i < tiles; ++i)
+  {
+    TileHeader hdr;
+    if (size < sizeof(hdr))
+      return false;
+
+    memcpy(&hdr, pos, sizeof(hdr));
+    pos  += sizeof(hdr);
+    size -= sizeof(hdr);
+
+    const FrameDamageRect r =
+    {
+      .x      = hdr.x,
+      .y      = hdr.y,
+      .width  = hdr.width,
+      .height = hdr.height
+    };
+
+    if (hdr.width > TILECODEC_SIZE || hdr.height > TILECODEC_SIZE ||
+        !replay_rectValid(info, &r) || hdr.size > size)
+      return false;
+
+    pos  += hdr.size;
+    size -= hdr.size;
+  }
+
+  return true;
+}
+
+static bool replay_frameValid(const KVMFRRecord * rec)
+{
+  const size_t size = rec->size - sizeof(*rec);
+  if (size < sizeof(KVMFRRecordFrame))
+    return false;
+
+  const KVMFRRecordFrame * info = (const KVMFRRecordFrame *)(rec + 1);
+  if (info->type <= FRAME_TYPE_INVALID || info->type >= FRAME_TYPE_MAX ||
+      info->damageRectsCount > KVMFR_MAX_DAMAGE_RECTS)
+    return false;
+
+  const FrameDamageRect * rects = (const FrameDamageRect *)(info + 1);
+  size_t need = sizeof(*info) + info->damageRectsCount * sizeof(*rects);
+  if (need > size)
+    return false;
+
+  switch(info->payload)
+  {
+    case KVMFR_PAYLOAD_NONE:
+      break;
+
+    case KVMFR_PAYLOAD_FULL:
+      need += info->dataSize;
+      break;
+
+    case KVMFR_PAYLOAD_DAMAGE:
+      if ((info->bpp != 4 && info->bpp != 8) || !info->damageRectsCount)
+        return false;
+
+      for(uint32_t i = 0; i < info->damageRectsCount; ++i)
+      {
+        const FrameDamageRect * r = &rects[i];
+        if (!replay_rectValid(info, r))
+          return false;
+        need += (size_t)r->width * r->height * info->bpp;
+      }
+      break;
+
+    case KVMFR_PAYLOAD_TILES:
+      if (info->bpp != 4 || !info->width || !info->height ||
+          (uint64_t)(info->height - 1) * info->pitch +
+          (uint64_t)info->width * 4 > info->dataSize)
+        return false;
+
+      for(uint32_t i = 0; i < info->damageRectsCount; ++i)
+        if (!replay_rectValid(info, &rects[i]))
+          return false;
+
+      return replay_tilesValid(info, rects, size - need);
+
+    default:
+      return false;
+  }
+
+  return need <= size;
+}
+
+static bool replay_cursorValid(const KVMFRRecord * rec)
+{
+  const size_t size = rec->size - sizeof(*rec);
+  if (size < sizeof(KVMFRRecordCursor))
+    return false;
+
+  const KVMFRRecordCursor * info = (const KVMFRRecordCursor *)(rec + 1);
+  return info->type <= CURSOR_TYPE_MASKED_COLOR &&
+    sizeof(*info) + (uint64_t)info->height * info->pitch <= size;
+}
+
+// check every record once so playback can trust them, a recording that was
+// cut short is played up to the last complete record
+static bool replay_scan()
+{
+  const KVMFRRecordHeader * hdr = (const KVMFRRecordHeader *)this->map;
+  if (this->mapSize < sizeof(*hdr) ||
+      memcmp(hdr->magic, KVMFR_RECORD_MAGIC, sizeof(hdr->magic)) != 0)
+  {
+    DEBUG_ERROR("Not a Looking Glass recording");
+    return false;
+  }
+
+  if (hdr->version != KVMFR_RECORD_VERSION)
+  {
+    DEBUG_ERROR("Unsupported recording version %u, expected %u",
+        hdr->version, KVMFR_RECORD_VERSION);
+    return false;
+  }
+
+  char hostver[sizeof(hdr->hostver) + 1];
+  memcpy(hostver, hdr->hostver, sizeof(hdr->hostver));
+  hostver[sizeof(hdr->hostver)] = '\0';
+
+  this->first        = kvmfrRecordSize(sizeof(*hdr));
+  this->maxFrameSize = 0;
+  this->frames       = 0;
+
+  uint64_t duration = 0;
+  size_t   pos      = this->first;
+  while(pos + sizeof(KVMFRRecord) <= this->mapSize)
+  {
+    const KVMFRRecord * rec = replay_record(pos);
+    if (rec->size < sizeof(*rec) || rec->size % KVMFR_RECORD_ALIGN ||
+        rec->size > this->mapSize - pos)
+      break;
+
+    bool valid = true;
+    switch(rec->type)
+    {
+      case KVMFR_RECORD_FRAME:
+        if (!(valid = replay_frameValid(rec)))
+          break;
+
+        const KVMFRRecordFrame * info = (const KVMFRRecordFrame *)(rec + 1);
+        if (info->dataSize > this->maxFrameSize)
+          this->maxFrameSize = info->dataSize;
+        ++this->frames;
+        break;
+
+      case KVMFR_RECORD_CURSOR_SHAPE:
+        valid = replay_cursorValid(rec);
+        break;
+
+      case KVMFR_RECORD_CURSOR_POS:
+        valid = rec->size - sizeof(*rec) >= sizeof(KVMFRCursorPos);
+        break;
+
+      // skip records from a later version
+      default:
+        break;
+    }
+
+    if (!valid)
+    {
+      DEBUG_ERROR("Invalid record at offset %zu", pos);
+      return false;
+    }
+
+    duration = rec->time;
+    pos     += rec->size;
+  }
+
+  this->end = pos;
+  if (pos != this->mapSize)
+    DEBUG_WARN("The recording is truncated, playing up to offset %zu", pos);
+
+  if (!this->frames)
+  {
+    DEBUG_ERROR("The recording has no frames");
+    return false;
+  }
+
+  DEBUG_INFO("Recording        : KVMFR %u from host %s", hdr->kvmfrVersion,
+      hostver);
+  DEBUG_INFO("Frames           : %lu over %.2f s",
+      (unsigned long)this->frames, duration / 1e6);
+  return true;
+}
+
+static bool replay_create(
+    CaptureGetPointerBuffer  getPointerBufferFn,
+    CapturePostPointerBuffer postPointerBufferFn)
+{
+  assert(!this);
+
+  // never picked over a real capture unless asked for
+  const char * path = option_get_string("replay", "file");
+  if (!path)
+    return false;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    DEBUG_ERROR("Failed to open the recording: %s", path);
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0)
+  {
+    DEBUG_ERROR("Failed to get the size of the recording: %s", path);
+    close(fd);
+    return false;
+  }
+
+  void * map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    DEBUG_ERROR("Failed to map the recording: %s", path);
+    return false;
+  }
+
+  this             = (struct replay *)calloc(sizeof(struct replay), 1);
+  this->map        = map;
+  this->mapSize    = st.st_size;
+  this->maxRate    = strcmp(option_get_string("replay", "rate"), "max") == 0;
+  this->loop       = option_get_bool("replay", "loop");
+
+  if (!replay_scan())
+    goto fail;
+
+  this->frameEvent = lgCreateEvent(true, 20);
+  this->takenEvent = lgCreateEvent(true, 20);
+  if (!this->frameEvent || !this->takenEvent)
+  {
+    DEBUG_ERROR("Failed to create the events");
+    goto fail;
+  }
+
+  LG_LOCK_INIT(this->lock);
+  this->getPointerBufferFn  = getPointerBufferFn;
+  this->postPointerBufferFn = postPointerBufferFn;
+  return true;
+
+fail:
+  if (this->frameEvent)
+    lgFreeEvent(this->frameEvent);
+  if (this->takenEvent)
+    lgFreeEvent(this->takenEvent);
+  munmap(this->map, this->mapSize);
+  free(this);
+  this = NULL;
+  return false;
+}
+
+static void replay_restart()
+{
+  this->pos       = this->first;
+  this->timeBase  = replay_record(this->first)->time;
+  this->startTime = nanotime();
+  this->forceFull = true;
+  this->finished  = false;
+}
+
+static bool replay_init()
+{
+  assert(this);
+  assert(!this->initialized);
+
+  this->stop = false;
+  lgResetEvent(this->frameEvent);
+  lgResetEvent(this->takenEvent);
+
+  this->image = calloc(1, this->maxFrameSize);
+  if (!this->image)
+  {
+    DEBUG_ERROR("Failed to allocate the replay image");
+    return false;
+  }
+
+  DEBUG_INFO("Replay Rate      : %s", this->maxRate ? "max" : "original");
+
+  this->pending     = false;
+  this->formatValid = false;
+  replay_restart();
+
+  this->initialized = true;
+  return true;
+}
+
+static void replay_stop()
+{
+  this->stop = true;
+  lgSignalEvent(this->frameEvent);
+  lgSignalEvent(this->takenEvent);
+}
+
+static bool replay_deinit()
+{
+  assert(this);
+  free(this->image);
+  this->image       = NULL;
+  this->initialized = false;
+  return true;
+}
+
+static void replay_free()
+{
+  lgFreeEvent(this->frameEvent);
+  lgFreeEvent(this->takenEvent);
+  munmap(this->map, this->mapSize);
+  free(this);
+  this = NULL;
+}
+
+static size_t replay_getMaxFrameSize()
+{
+  return this->maxFrameSize;
+}
+
+static void replay_postShape(const KVMFRRecord * rec)
+{
+  const KVMFRRecordCursor * info = (const KVMFRRecordCursor *)(rec + 1);
+  const size_t size = (size_t)info->height * info->pitch;
+
+  void   * data;
+  uint32_t bufSize;
+  if (!this->getPointerBufferFn(&data, &bufSize))
+    return;
+
+  if (size > bufSize)
+  {
+    DEBUG_WARN("The cursor shape is too large, skipping");
+    return;
+  }
+
+  memcpy(data, info + 1, size);
+
+  CapturePointer pointer =
+  {
+    .shapeUpdate = true,
+    .hx          = info->hx,
+    .hy          = info->hy,
+    .width       = info->width,
+    .height      = info->height,
+    .pitch       = info->pitch
+  };
+
+  switch(info->type)
+  {
+    case CURSOR_TYPE_COLOR       : pointer.format = CAPTURE_FMT_COLOR ; break;
+    case CURSOR_TYPE_MONOCHROME  : pointer.format = CAPTURE_FMT_MONO  ; break;
+    case CURSOR_TYPE_MASKED_COLOR: pointer.format = CAPTURE_FMT_MASKED; break;
+  }
+
+  this->postPointerBufferFn(pointer);
+}
+
+static void replay_postPos(const KVMFRRecord * rec)
+{
+  const KVMFRCursorPos * pos = (const KVMFRCursorPos *)(rec + 1);
+  const CapturePointer pointer =
+  {
+    .positionUpdate = true,
+    .x              = pos->x,
+    .y              = pos->y,
+    .visible        = pos->visible
+  };
+  this->postPointerBufferFn(pointer);
+}
+
+// release the frame to the frame thread, false if the last is still pending
+static bool replay_releaseFrame(size_t pos)
+{
+  const KVMFRRecordFrame * info  = replay_frameInfo(pos);
+  const FrameDamageRect  * rects = (const FrameDamageRect *)(info + 1);
+
+  LG_LOCK(this->lock);
+
+  // at the max rate every frame is sent so the replay is the same each time
+  if (this->pending && this->maxRate)
+  {
+    LG_UNLOCK(this->lock);
+    return false;
+  }
+
+  if (!this->formatValid || info->formatVer != this->lastFormatVer)
+  {
+    this->lastFormatVer = info->formatVer;
+    this->formatValid   = true;
+    ++this->formatVer;
+    this->forceFull     = true;
+  }
+
+  if (this->forceFull)
+  {
+    damage_set_full(&this->pendingDamage);
+    this->forceFull = false;
+  }
+  else
+    damage_add(&this->pendingDamage, rects, info->damageRectsCount);
+
+  if (!this->pending)
+    this->pendingFirst = pos;
+  this->pendingLast = pos;
+  this->pendingTime = microtime();
+  this->pending     = true;
+  LG_UNLOCK(this->lock);
+
+  lgSignalEvent(this->frameEvent);
+  return true;
+}
+
+static CaptureResult replay_capture()
+{
+  assert(this);
+  assert(this->initialized);
+
+  while(!this->stop)
+  {
+    if (this->pos >= this->end)
+    {
+      // wait for the last frames to go out before going back to the start
+      LG_LOCK(this->lock);
+      const bool pending = this->pending;
+      LG_UNLOCK(this->lock);
+
+      if (!this->loop || pending)
+      {
+        if (!this->finished && !this->loop)
+        {
+          DEBUG_INFO("The replay has finished");
+          this->finished = true;
+        }
+
+        lgWaitEvent(this->takenEvent, 100);
+        return CAPTURE_RESULT_TIMEOUT;
+      }
+
+      replay_restart();
+    }
+
+    const KVMFRRecord * rec = replay_record(this->pos);
+
+    // sleep until the record is due
+    if (!this->maxRate)
+    {
+      const uint64_t due = this->startTime + (rec->time - this->timeBase) * 1000ULL;
+      const uint64_t now = nanotime();
+      if (now < due)
+      {
+        const uint64_t wait = due - now;
+        nsleep(wait < 100000000ULL ? wait : 100000000ULL);
+        if (nanotime() < due)
+          return CAPTURE_RESULT_TIMEOUT;
+      }
+    }
+
+    switch(rec->type)
+    {
+      case KVMFR_RECORD_FRAME:
+        if (!replay_releaseFrame(this->pos))
+        {
+          lgWaitEvent(this->takenEvent, 100);
+          return CAPTURE_RESULT_TIMEOUT;
+        }
+        this->pos += rec->size;
+        return CAPTURE_RESULT_OK;
+
+      case KVMFR_RECORD_CURSOR_SHAPE:
+        replay_postShape(rec);
+        break;
+
+      case KVMFR_RECORD_CURSOR_POS:
+        replay_postPos(rec);
+        break;
+    }
+
+    this->pos += rec->size;
+  }
+
+  return CAPTURE_RESULT_TIMEOUT;
+}
+
+static CaptureResult replay_waitFrame(CaptureFrame * frame)
+{
+  assert(this);
+  assert(this->initialized);
+
+  LG_LOCK(this->lock);
+  if (!this->pending)
+  {
+    LG_UNLOCK(this->lock);
+
+    // NOTE: the event may be signaled when there are no frames available
+    if (!lgWaitEvent(this->frameEvent, 1000))
+      return CAPTURE_RESULT_TIMEOUT;
+
+    LG_LOCK(this->lock);
+    if (!this->pending)
+    {
+      LG_UNLOCK(this->lock);
+      return CAPTURE_RESULT_TIMEOUT;
+    }
+  }
+
+  this->frameDamage  = this->pendingDamage;
+  this->frameFirst   = this->pendingFirst;
+  this->frameLast    = this->pendingLast;
+  frame->presentTime = this->pendingTime;
+  frame->formatVer   = this->formatVer;
+  damage_reset(&this->pendingDamage);
+  this->pending = false;
+  LG_UNLOCK(this->lock);
+
+  lgSignalEvent(this->takenEvent);
+
+  const KVMFRRecordFrame * info = replay_frameInfo(this->frameLast);
+  frame->width        = info->width;
+  frame->height       = info->height;
+  frame->screenWidth  = info->screenWidth;
+  frame->screenHeight = info->screenHeight;
+  frame->pitch        = info->pitch;
+  frame->stride       = info->stride;
+
+  switch(info->type)
+  {
+    case FRAME_TYPE_BGRA   : frame->format = CAPTURE_FMT_BGRA   ; break;
+    case FRAME_TYPE_RGBA   : frame->format = CAPTURE_FMT_RGBA   ; break;
+    case FRAME_TYPE_RGBA10 : frame->format = CAPTURE_FMT_RGBA10 ; break;
+    case FRAME_TYPE_RGBA16F: frame->format = CAPTURE_FMT_RGBA16F; break;
+    case FRAME_TYPE_YUV420 : frame->format = CAPTURE_FMT_YUV420 ; break;
+    case FRAME_TYPE_H264   : frame->format = CAPTURE_FMT_H264   ; break;
+    default:
+      return CAPTURE_RESULT_ERROR;
+  }
+
+  if (this->frameDamage.full)
+    frame->damageRectsCount = 0;
+  else
+  {
+    frame->damageRectsCount = this->frameDamage.count;
+    memcpy(frame->damageRects, this->frameDamage.rects,
+        this->frameDamage.count * sizeof(FrameDamageRect));
+  }
+
+  return CAPTURE_RESULT_OK;
+}
+
+static void replay_applyFrame(const KVMFRRecordFrame * info)
+{
+  const FrameDamageRect * rects = (const FrameDamageRect *)(info + 1);
+  const uint8_t         * src   = (const uint8_t *)(rects + info->damageRectsCount);
+
+  switch(info->payload)
+  {
+    case KVMFR_PAYLOAD_FULL:
+      memcpy(this->image, src, info->dataSize);
+      break;
+
+    case KVMFR_PAYLOAD_DAMAGE:
+      for(uint32_t i = 0; i < info->damageRectsCount; ++i)
+      {
+        const FrameDamageRect * r   = &rects[i];
+        const size_t            len = (size_t)r->width * info->bpp;
+        uint8_t * dst = this->image + (size_t)r->y * info->pitch +
+          (size_t)r->x * info->bpp;
+        for(uint32_t y = 0; y < r->height; ++y, dst += info->pitch, src += len)
+          memcpy(dst, src, len);
+      }
+      break;
+
+    case KVMFR_PAYLOAD_TILES:
+    {
+      const unsigned int tiles = tilecodec_count(rects, info->damageRectsCount,
+          info->width, info->height);
+      for(unsigned int i = 0; i < tiles; ++i)
+      {
+        TileHeader hdr;
+        memcpy(&hdr, src, sizeof(hdr));
+        src += sizeof(hdr);
+
+        if (!tilecodec_decode(src, hdr.size,
+              this->image + (size_t)hdr.y * info->pitch + (size_t)hdr.x * 4,
+              info->pitch, hdr.width, hdr.height))
+          DEBUG_WARN("Invalid tile in the recording");
+        src += hdr.size;
+      }
+      break;
+    }
+  }
+}
+
+static CaptureResult replay_getFrame(FrameBuffer * frame,
+    const FrameDamageRect * rects, unsigned int rectsCount)
+{
+  assert(this);
+  assert(this->initialized);
+
+  // apply every frame released since the last one that was sent
+  for(size_t pos = this->frameFirst; pos <= this->frameLast;
+      pos += replay_record(pos)->size)
+    if (replay_record(pos)->type == KVMFR_RECORD_FRAME)
+      replay_applyFrame(replay_frameInfo(pos));
+
+  const KVMFRRecordFrame * info = replay_frameInfo(this->frameLast);
+  if (rectsCount == 0 || !info->bpp)
+    framebuffer_write(frame, this->image, info->dataSize);
+  else
+    framebuffer_write_rects(frame, this->image, info->pitch, info->height,
+        info->bpp, rects, rectsCount);
+
+  return CAPTURE_RESULT_OK;
+}
+
+struct CaptureInterface Capture_Replay =
+{
+  .getName         = replay_getName,
+  .initOptions     = replay_initOptions,
+  .create          = replay_create,
+  .init            = replay_init,
+  .stop            = replay_stop,
+  .deinit          = replay_deinit,
+  .free            = replay_free,
+  .getMaxFrameSize = replay_getMaxFrameSize,
+  .capture         = replay_capture,
+  .waitFrame       = replay_waitFrame,
+  .getFrame        = replay_getFrame
+};
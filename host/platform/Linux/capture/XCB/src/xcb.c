@@ -21,31 +21,85 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "interface/platform.h"
 #include "common/debug.h"
 #include "common/event.h"
+#include "common/damage.h"
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <xcb/shm.h>
 #include <xcb/xfixes.h>
+#include <xcb/damage.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 
+// one segment can be filled by the X server while the other is being sent
+#define SEGMENTS 2
+
+enum SegmentState
+{
+  SEGMENT_STATE_UNUSED,
+  SEGMENT_STATE_PENDING,
+  SEGMENT_STATE_READING
+};
+
+struct Segment
+{
+  volatile enum SegmentState state;
+  uint32_t                   seg;
+  int                        shmID;
+  void                     * data;
+
+  // the requests that are filling the segment
+  unsigned int               requestCount;
+  xcb_shm_get_image_cookie_t requests[KVMFR_MAX_DAMAGE_RECTS];
+
+  // areas of the segment that are out of date
+  FrameDamage                segDamage;
+
+  // areas that changed since the prior frame that was sent
+  FrameDamage                frameDamage;
+};
+
+struct Band
+{
+  unsigned int y, height;
+};
+
 struct xcb
 {
   bool               initialized;
+  bool               stop;
   xcb_connection_t * xcb;
   xcb_screen_t     * xcbScreen;
-  uint32_t           seg;
-  int                shmID;
-  void             * data;
   LGEvent          * frameEvent;
 
+  CaptureGetPointerBuffer  getPointerBufferFn;
+  CapturePostPointerBuffer postPointerBufferFn;
+
+  // XDamage is optional, without it every frame is fetched in full
+  bool                hasDamage;
+  uint8_t             damageEvent;
+  xcb_damage_damage_t damage;
+  xcb_xfixes_region_t region;
+  bool                damaged;
+
+  struct Segment segments[SEGMENTS];
+  int            segWIndex;
+  int            segRIndex;
+  atomic_int     segReady;
+  FrameDamage    pendingDamage;
+
+  // the region of the screen to capture, the values it was applied at, and
+  // the clamped region in use
+  atomic_uint  cropX, cropY, cropWidth, cropHeight;
+  CaptureRect  appliedCrop;
+  CaptureRect  crop;
+
+  unsigned int formatVer;
   unsigned int width;
   unsigned int height;
-
-  bool                                 hasFrame;
-  xcb_shm_get_image_cookie_t           imgC;
-  xcb_xfixes_get_cursor_image_cookie_t curC;
 };
 
 struct xcb * this = NULL;
@@ -53,7 +107,7 @@ struct xcb * this = NULL;
 // forwards
 
 static bool xcb_deinit();
-static unsigned int xcb_getMaxFrameSize();
+static size_t xcb_getMaxFrameSize();
 
 // implementation
 
@@ -62,12 +116,12 @@ static const char * xcb_getName()
   return "XCB";
 }
 
-static bool xcb_create()
+static bool xcb_create(
+    CaptureGetPointerBuffer  getPointerBufferFn,
+    CapturePostPointerBuffer postPointerBufferFn)
 {
   assert(!this);
   this             = (struct xcb *)calloc(sizeof(struct xcb), 1);
-  this->shmID      = -1;
-  this->data       = (void *)-1;
   this->frameEvent = lgCreateEvent(true, 20);
 
   if (!this->frameEvent)
@@ -77,6 +131,47 @@ static bool xcb_create()
     return false;
   }
 
+  for(int i = 0; i < SEGMENTS; ++i)
+  {
+    this->segments[i].shmID = -1;
+    this->segments[i].data  = (void *)-1;
+  }
+
+  this->getPointerBufferFn  = getPointerBufferFn;
+  this->postPointerBufferFn = postPointerBufferFn;
+  return true;
+}
+
+static bool xcb_initDamage()
+{
+  const xcb_query_extension_reply_t * ext =
+    xcb_get_extension_data(this->xcb, &xcb_damage_id);
+  if (!ext || !ext->present ||
+      !xcb_get_extension_data(this->xcb, &xcb_xfixes_id)->present)
+    return false;
+
+  // the versions must be negotiated before the extensions can be used
+  xcb_xfixes_query_version_reply_t * fixes = xcb_xfixes_query_version_reply(
+      this->xcb, xcb_xfixes_query_version(this->xcb, 2, 0), NULL);
+  if (!fixes || fixes->major_version < 2)
+  {
+    free(fixes);
+    return false;
+  }
+  free(fixes);
+
+  xcb_damage_query_version_reply_t * damage = xcb_damage_query_version_reply(
+      this->xcb, xcb_damage_query_version(this->xcb, 1, 1), NULL);
+  if (!damage)
+    return false;
+  free(damage);
+
+  this->damageEvent = ext->first_event;
+  this->damage      = xcb_generate_id(this->xcb);
+  this->region      = xcb_generate_id(this->xcb);
+  xcb_damage_create(this->xcb, this->damage, this->xcbScreen->root,
+      XCB_DAMAGE_REPORT_LEVEL_NON_EMPTY);
+  xcb_xfixes_create_region(this->xcb, this->region, 0, NULL);
   return true;
 }
 
@@ -85,6 +180,10 @@ static bool xcb_init()
   assert(this);
   assert(!this->initialized);
 
+  this->stop      = false;
+  this->segWIndex = 0;
+  this->segRIndex = 0;
+  atomic_store(&this->segReady, 0);
   lgResetEvent(this->frameEvent);
 
   this->xcb = xcb_connect(NULL, NULL);
@@ -103,27 +202,61 @@ static bool xcb_init()
   xcb_screen_iterator_t iter;
   iter            = xcb_setup_roots_iterator(xcb_get_setup(this->xcb));
   this->xcbScreen = iter.data;
-  this->width     = iter.data->width_in_pixels;
-  this->height    = iter.data->height_in_pixels;
-  DEBUG_INFO("Frame Size       : %u x %u", this->width, this->height);
 
-  this->seg   = xcb_generate_id(this->xcb);
-  this->shmID = shmget(IPC_PRIVATE, xcb_getMaxFrameSize(), IPC_CREAT | 0777);
-  if (this->shmID == -1)
+  // the rest of the pipeline only sees the cropped region
+  this->appliedCrop = (CaptureRect)
   {
-    DEBUG_ERROR("shmget failed");
-    goto fail;
-  }
+    .x      = atomic_load(&this->cropX     ),
+    .y      = atomic_load(&this->cropY     ),
+    .width  = atomic_load(&this->cropWidth ),
+    .height = atomic_load(&this->cropHeight)
+  };
+  this->crop = this->appliedCrop;
+  if (captureClampCrop(iter.data->width_in_pixels, iter.data->height_in_pixels,
+        &this->crop))
+    DEBUG_INFO("Cropping to      : %u x %u at %u, %u", this->crop.width,
+        this->crop.height, this->crop.x, this->crop.y);
+
+  this->width  = this->crop.width;
+  this->height = this->crop.height;
+  DEBUG_INFO("Frame Size       : %u x %u", this->width, this->height);
 
-  xcb_shm_attach(this->xcb, this->seg ,this->shmID, false);
-  this->data = shmat(this->shmID, NULL, 0);
-  if ((uintptr_t)this->data == -1)
+  for(int i = 0; i < SEGMENTS; ++i)
   {
-    DEBUG_ERROR("shmat failed");
-    goto fail;
+    struct Segment * seg = &this->segments[i];
+    seg->state        = SEGMENT_STATE_UNUSED;
+    seg->requestCount = 0;
+    seg->seg          = xcb_generate_id(this->xcb);
+    seg->shmID        = shmget(IPC_PRIVATE, xcb_getMaxFrameSize(), IPC_CREAT | 0777);
+    if (seg->shmID == -1)
+    {
+      DEBUG_ERROR("shmget failed");
+      goto fail;
+    }
+
+    xcb_shm_attach(this->xcb, seg->seg, seg->shmID, false);
+    seg->data = shmat(seg->shmID, NULL, 0);
+    if ((uintptr_t)seg->data == -1)
+    {
+      DEBUG_ERROR("shmat failed");
+      goto fail;
+    }
+    DEBUG_INFO("Frame Data %d     : 0x%" PRIXPTR, i, (uintptr_t)seg->data);
+
+    damage_set_full(&seg->segDamage);
+    damage_reset(&seg->frameDamage);
   }
-  DEBUG_INFO("Frame Data       : 0x%" PRIXPTR, (uintptr_t)this->data);
 
+  this->hasDamage = xcb_initDamage();
+  if (!this->hasDamage)
+    DEBUG_WARN("XDamage is not available, every frame will be captured in full");
+
+  // the first frame is always sent
+  this->damaged = true;
+  damage_set_full(&this->pendingDamage);
+  xcb_flush(this->xcb);
+
+  ++this->formatVer;
   this->initialized = true;
   return true;
 fail:
@@ -131,20 +264,44 @@ fail:
   return false;
 }
 
+static void xcb_stop()
+{
+  this->stop = true;
+  lgSignalEvent(this->frameEvent);
+}
+
 static bool xcb_deinit()
 {
   assert(this);
 
-  if ((uintptr_t)this->data != -1)
+  for(int i = 0; i < SEGMENTS; ++i)
   {
-    shmdt(this->data);
-    this->data = (void *)-1;
+    struct Segment * seg = &this->segments[i];
+
+    // discard any replies that are still outstanding
+    for(unsigned int r = 0; r < seg->requestCount; ++r)
+      xcb_discard_reply(this->xcb, seg->requests[r].sequence);
+    seg->requestCount = 0;
+
+    if ((uintptr_t)seg->data != -1)
+    {
+      xcb_shm_detach(this->xcb, seg->seg);
+      shmdt(seg->data);
+      seg->data = (void *)-1;
+    }
+
+    if (seg->shmID != -1)
+    {
+      shmctl(seg->shmID, IPC_RMID, NULL);
+      seg->shmID = -1;
+    }
   }
 
-  if (this->shmID != -1)
+  if (this->hasDamage)
   {
-    shmctl(this->shmID, IPC_RMID, NULL);
-    this->shmID = -1;
+    xcb_damage_destroy(this->xcb, this->damage);
+    xcb_xfixes_destroy_region(this->xcb, this->region);
+    this->hasDamage = false;
   }
 
   if (this->xcb)
@@ -154,7 +311,7 @@ static bool xcb_deinit()
   }
 
   this->initialized = false;
-  return false;
+  return true;
 }
 
 static void xcb_free()
@@ -164,73 +321,303 @@ static void xcb_free()
   this = NULL;
 }
 
-static unsigned int xcb_getMaxFrameSize()
+static size_t xcb_getMaxFrameSize()
 {
-  return this->width * this->height * 4;
+  return (size_t)this->width * this->height * 4;
 }
 
-static CaptureResult xcb_capture()
+static void xcb_pollEvents()
 {
-  assert(this);
-  assert(this->initialized);
+  xcb_generic_event_t * event;
+  while((event = xcb_poll_for_event(this->xcb)))
+  {
+    if (this->hasDamage &&
+        (event->response_type & ~0x80) == this->damageEvent + XCB_DAMAGE_NOTIFY)
+      this->damaged = true;
+    free(event);
+  }
+}
+
+// wait for the X server to report that something changed
+static CaptureResult xcb_waitDamage()
+{
+  xcb_pollEvents();
+  if (!this->damaged)
+  {
+    struct pollfd fd =
+    {
+      .fd     = xcb_get_file_descriptor(this->xcb),
+      .events = POLLIN
+    };
+
+    if (poll(&fd, 1, 100) > 0)
+      xcb_pollEvents();
+  }
+
+  if (xcb_connection_has_error(this->xcb))
+  {
+    DEBUG_ERROR("The X connection failed");
+    return CAPTURE_RESULT_ERROR;
+  }
+
+  return this->damaged ? CAPTURE_RESULT_OK : CAPTURE_RESULT_TIMEOUT;
+}
+
+// move the reported damage into rects, the damage object is reset so it will
+// report again on the next change
+static void xcb_getDamage(FrameDamage * damage)
+{
+  damage_reset(damage);
+  this->damaged = false;
+
+  if (!this->hasDamage)
+  {
+    damage_set_full(damage);
+    return;
+  }
+
+  xcb_damage_subtract(this->xcb, this->damage, XCB_NONE, this->region);
+  xcb_xfixes_fetch_region_reply_t * reply = xcb_xfixes_fetch_region_reply(
+      this->xcb, xcb_xfixes_fetch_region(this->xcb, this->region), NULL);
+  if (!reply)
+  {
+    damage_set_full(damage);
+    return;
+  }
 
-  if (!this->hasFrame)
+  const xcb_rectangle_t * rects = xcb_xfixes_fetch_region_rectangles(reply);
+  const int count = xcb_xfixes_fetch_region_rectangles_length(reply);
+  for(int i = 0; i < count && !damage->full; ++i)
   {
-    this->imgC = xcb_shm_get_image_unchecked(
+    // move into the cropped region and clip to it
+    const int x      = rects[i].x - (int)this->crop.x;
+    const int y      = rects[i].y - (int)this->crop.y;
+    const int left   = x < 0 ? 0 : x;
+    const int top    = y < 0 ? 0 : y;
+    const int right  = x + rects[i].width;
+    const int bottom = y + rects[i].height;
+
+    const FrameDamageRect r =
+    {
+      .x      = left,
+      .y      = top,
+      .width  = (right  > (int)this->width  ? (int)this->width  : right ) - left,
+      .height = (bottom > (int)this->height ? (int)this->height : bottom) - top
+    };
+
+    if ((int)r.width > 0 && (int)r.height > 0)
+      damage_add(damage, &r, 1);
+  }
+  free(reply);
+
+  // a change was reported but nothing on screen was affected
+  if (!damage->full && damage->count == 0)
+    this->damaged = false;
+}
+
+static int xcb_compareBands(const void * a, const void * b)
+{
+  const struct Band * ba = (const struct Band *)a;
+  const struct Band * bb = (const struct Band *)b;
+  return (int)ba->y - (int)bb->y;
+}
+
+// fetch the out of date rows of the segment, whole rows are requested so the
+// image lands in the segment with the full frame layout
+static void xcb_requestSegment(struct Segment * seg)
+{
+  struct Band  bands[KVMFR_MAX_DAMAGE_RECTS];
+  unsigned int count = 0;
+
+  if (seg->segDamage.full)
+    bands[count++] = (struct Band){ .y = 0, .height = this->height };
+  else
+  {
+    for(unsigned int i = 0; i < seg->segDamage.count; ++i)
+    {
+      bands[count].y      = seg->segDamage.rects[i].y;
+      bands[count].height = seg->segDamage.rects[i].height;
+      ++count;
+    }
+
+    // join the bands that overlap or touch
+    qsort(bands, count, sizeof(*bands), xcb_compareBands);
+    unsigned int joined = 0;
+    for(unsigned int i = 0; i < count; ++i)
+    {
+      if (joined > 0 &&
+          bands[i].y <= bands[joined - 1].y + bands[joined - 1].height)
+      {
+        struct Band * b = &bands[joined - 1];
+        const unsigned int end = bands[i].y + bands[i].height;
+        if (end > b->y + b->height)
+          b->height = end - b->y;
+        continue;
+      }
+      bands[joined++] = bands[i];
+    }
+    count = joined;
+  }
+
+  const unsigned int pitch = this->width * 4;
+  for(unsigned int i = 0; i < count; ++i)
+    seg->requests[i] = xcb_shm_get_image(
         this->xcb,
         this->xcbScreen->root,
-        0, 0,
+        this->crop.x, this->crop.y + bands[i].y,
         this->width,
-        this->height,
+        bands[i].height,
         ~0,
         XCB_IMAGE_FORMAT_Z_PIXMAP,
-        this->seg,
-        0);
+        seg->seg,
+        bands[i].y * pitch);
 
-    this->hasFrame  = true;
+  seg->requestCount = count;
+  xcb_flush(this->xcb);
+}
+
+static CaptureResult xcb_capture()
+{
+  assert(this);
+  assert(this->initialized);
+
+  if (atomic_load_explicit(&this->cropX     , memory_order_relaxed) != this->appliedCrop.x     ||
+      atomic_load_explicit(&this->cropY     , memory_order_relaxed) != this->appliedCrop.y     ||
+      atomic_load_explicit(&this->cropWidth , memory_order_relaxed) != this->appliedCrop.width ||
+      atomic_load_explicit(&this->cropHeight, memory_order_relaxed) != this->appliedCrop.height)
+    return CAPTURE_RESULT_REINIT;
+
+  CaptureResult result = xcb_waitDamage();
+  if (result != CAPTURE_RESULT_OK)
+    return result;
+
+  FrameDamage damage;
+  xcb_getDamage(&damage);
+  if (!damage.full && damage.count == 0)
+    return CAPTURE_RESULT_TIMEOUT;
+
+  // every segment and the next frame sent needs these changes, even if this
+  // frame is skipped below
+  damage_merge(&this->pendingDamage, &damage);
+  for(int i = 0; i < SEGMENTS; ++i)
+    damage_merge(&this->segments[i].segDamage, &damage);
+
+  // if the segment is still in use skip the frame to keep up
+  struct Segment * seg = &this->segments[this->segWIndex];
+  if (seg->state != SEGMENT_STATE_UNUSED)
+    return CAPTURE_RESULT_OK;
+
+  // the request stays in flight until the frame is sent
+  xcb_requestSegment(seg);
+  damage_reset(&seg->segDamage);
+  seg->frameDamage = this->pendingDamage;
+  damage_reset(&this->pendingDamage);
+
+  seg->state = SEGMENT_STATE_PENDING;
+  if (atomic_fetch_add_explicit(&this->segReady, 1, memory_order_release) == 0)
     lgSignalEvent(this->frameEvent);
-  }
+
+  if (++this->segWIndex == SEGMENTS)
+    this->segWIndex = 0;
 
   return CAPTURE_RESULT_OK;
 }
 
 static CaptureResult xcb_waitFrame(CaptureFrame * frame)
 {
-  lgWaitEvent(this->frameEvent, TIMEOUT_INFINITE);
+  assert(this);
+  assert(this->initialized);
 
-  frame->width  = this->width;
-  frame->height = this->height;
-  frame->pitch  = this->width * 4;
-  frame->stride = this->width;
-  frame->format = CAPTURE_FMT_BGRA;
+  // NOTE: the event may be signaled when there are no frames available
+  if (atomic_load_explicit(&this->segReady, memory_order_acquire) == 0)
+  {
+    if (!lgWaitEvent(this->frameEvent, 1000))
+      return CAPTURE_RESULT_TIMEOUT;
+
+    // the count will still be zero if we are stopping
+    if (atomic_load_explicit(&this->segReady, memory_order_acquire) == 0)
+      return CAPTURE_RESULT_TIMEOUT;
+  }
 
+  struct Segment * seg = &this->segments[this->segRIndex];
+  seg->state = SEGMENT_STATE_READING;
+
+  frame->formatVer    = this->formatVer;
+  frame->width        = this->width;
+  frame->height       = this->height;
+  frame->screenWidth  = this->width;
+  frame->screenHeight = this->height;
+  frame->pitch        = this->width * 4;
+  frame->stride       = this->width;
+  frame->format       = CAPTURE_FMT_BGRA;
+
+  if (seg->frameDamage.full)
+    frame->damageRectsCount = 0;
+  else
+  {
+    frame->damageRectsCount = seg->frameDamage.count;
+    memcpy(frame->damageRects, seg->frameDamage.rects,
+        seg->frameDamage.count * sizeof(FrameDamageRect));
+  }
+
+  atomic_fetch_sub_explicit(&this->segReady, 1, memory_order_release);
   return CAPTURE_RESULT_OK;
 }
 
-static CaptureResult xcb_getFrame(FrameBuffer frame)
+static CaptureResult xcb_getFrame(FrameBuffer * frame,
+    const FrameDamageRect * rects, unsigned int rectsCount)
 {
   assert(this);
   assert(this->initialized);
 
-  xcb_shm_get_image_reply_t * img;
-  img = xcb_shm_get_image_reply(this->xcb, this->imgC, NULL);
-  if (!img)
+  struct Segment * seg    = &this->segments[this->segRIndex];
+  CaptureResult    result = CAPTURE_RESULT_OK;
+
+  // wait for the X server to finish filling the segment
+  for(unsigned int i = 0; i < seg->requestCount; ++i)
   {
-    DEBUG_ERROR("Failed to get image reply");
-    return CAPTURE_RESULT_ERROR;
+    xcb_generic_error_t       * error = NULL;
+    xcb_shm_get_image_reply_t * img   =
+      xcb_shm_get_image_reply(this->xcb, seg->requests[i], &error);
+
+    if (!img)
+    {
+      DEBUG_ERROR("Failed to get image reply");
+      result = CAPTURE_RESULT_ERROR;
+    }
+
+    free(error);
+    free(img);
+  }
+  seg->requestCount = 0;
+
+  if (result == CAPTURE_RESULT_OK)
+  {
+    const unsigned int pitch = this->width * 4;
+    if (rectsCount == 0)
+      framebuffer_write(frame, seg->data, pitch * this->height);
+    else
+      framebuffer_write_rects(frame, seg->data, pitch, this->height, 4,
+          rects, rectsCount);
   }
+  else
+    // the segment contents can't be trusted
+    damage_set_full(&seg->segDamage);
 
-  framebuffer_write(frame, this->data, this->width * this->height * 4);
-  free(img);
+  seg->state = SEGMENT_STATE_UNUSED;
+  if (++this->segRIndex == SEGMENTS)
+    this->segRIndex = 0;
 
-  this->hasFrame = false;
-  return CAPTURE_RESULT_OK;
+  return result;
 }
 
-static CaptureResult xcb_getPointer(CapturePointer * pointer)
+static void xcb_setCrop(CaptureRect crop)
 {
-  memset(pointer, 0, sizeof(CapturePointer));
-  return CAPTURE_RESULT_OK;
+  assert(this);
+  atomic_store(&this->cropX     , crop.x     );
+  atomic_store(&this->cropY     , crop.y     );
+  atomic_store(&this->cropWidth , crop.width );
+  atomic_store(&this->cropHeight, crop.height);
 }
 
 struct CaptureInterface Capture_XCB =
@@ -238,11 +625,12 @@ struct CaptureInterface Capture_XCB =
   .getName         = xcb_getName,
   .create          = xcb_create,
   .init            = xcb_init,
+  .stop            = xcb_stop,
   .deinit          = xcb_deinit,
   .free            = xcb_free,
   .getMaxFrameSize = xcb_getMaxFrameSize,
   .capture         = xcb_capture,
   .waitFrame       = xcb_waitFrame,
   .getFrame        = xcb_getFrame,
-  .getPointer      = xcb_getPointer
-};
\ No newline at end of file
+  .setCrop         = xcb_setCrop
+};
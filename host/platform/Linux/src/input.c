@@ -0,0 +1,210 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "interface/platform.h"
+#include "common/debug.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+static int uinputFd = -1;
+
+// PS/2 set 1 scancodes below 0x59 are the same as the evdev key codes, the
+// extended ones need looking up
+static const struct
+{
+  uint32_t scancode;
+  uint16_t key;
+}
+extendedKeys[] =
+{
+  { 0xe01c, KEY_KPENTER   },
+  { 0xe01d, KEY_RIGHTCTRL },
+  { 0xe035, KEY_KPSLASH   },
+  { 0xe037, KEY_SYSRQ     },
+  { 0xe038, KEY_RIGHTALT  },
+  { 0xe046, KEY_PAUSE     },
+  { 0xe047, KEY_HOME      },
+  { 0xe048, KEY_UP        },
+  { 0xe049, KEY_PAGEUP    },
+  { 0xe04b, KEY_LEFT      },
+  { 0xe04d, KEY_RIGHT     },
+  { 0xe04f, KEY_END       },
+  { 0xe050, KEY_DOWN      },
+  { 0xe051, KEY_PAGEDOWN  },
+  { 0xe052, KEY_INSERT    },
+  { 0xe053, KEY_DELETE    },
+  { 0xe05b, KEY_LEFTMETA  },
+  { 0xe05c, KEY_RIGHTMETA },
+  { 0xe05d, KEY_COMPOSE   }
+};
+
+static int toKey(uint32_t scancode)
+{
+  if (scancode > 0 && scancode < 0x59)
+    return scancode;
+
+  if (scancode == 0x59)
+    return KEY_KPEQUAL;
+
+  for(int i = 0; i < sizeof(extendedKeys) / sizeof(*extendedKeys); ++i)
+    if (extendedKeys[i].scancode == scancode)
+      return extendedKeys[i].key;
+
+  return -1;
+}
+
+static const uint16_t buttons[] =
+{
+  [1] = BTN_LEFT,
+  [2] = BTN_MIDDLE,
+  [3] = BTN_RIGHT,
+  [6] = BTN_SIDE,
+  [7] = BTN_EXTRA
+};
+
+bool os_inputInit()
+{
+  uinputFd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+  if (uinputFd < 0)
+  {
+    DEBUG_ERROR("Failed to open /dev/uinput: %s", strerror(errno));
+    return false;
+  }
+
+  bool ok =
+    ioctl(uinputFd, UI_SET_EVBIT , EV_KEY   ) == 0 &&
+    ioctl(uinputFd, UI_SET_EVBIT , EV_REL   ) == 0 &&
+    ioctl(uinputFd, UI_SET_RELBIT, REL_X    ) == 0 &&
+    ioctl(uinputFd, UI_SET_RELBIT, REL_Y    ) == 0 &&
+    ioctl(uinputFd, UI_SET_RELBIT, REL_WHEEL) == 0;
+
+  for(int key = 1; ok && key < KEY_COMPOSE + 1; ++key)
+    ok = ioctl(uinputFd, UI_SET_KEYBIT, key) == 0;
+
+  for(int i = 0; ok && i < sizeof(buttons) / sizeof(*buttons); ++i)
+    if (buttons[i])
+      ok = ioctl(uinputFd, UI_SET_KEYBIT, buttons[i]) == 0;
+
+  struct uinput_setup setup =
+  {
+    .id =
+    {
+      .bustype = BUS_VIRTUAL,
+      .vendor  = 0x1af4,
+      .product = 0x1100
+    },
+    .name = "Looking Glass Input"
+  };
+
+  if (!ok ||
+      ioctl(uinputFd, UI_DEV_SETUP , &setup) < 0 ||
+      ioctl(uinputFd, UI_DEV_CREATE) < 0)
+  {
+    DEBUG_ERROR("Failed to create the uinput device: %s", strerror(errno));
+    close(uinputFd);
+    uinputFd = -1;
+    return false;
+  }
+
+  return true;
+}
+
+void os_inputFree()
+{
+  if (uinputFd < 0)
+    return;
+
+  ioctl(uinputFd, UI_DEV_DESTROY);
+  close(uinputFd);
+  uinputFd = -1;
+}
+
+static bool emit(uint16_t type, uint16_t code, int32_t value)
+{
+  struct input_event e =
+  {
+    .type  = type,
+    .code  = code,
+    .value = value
+  };
+
+  if (write(uinputFd, &e, sizeof(e)) != sizeof(e))
+  {
+    DEBUG_ERROR("Failed to write to uinput: %s", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+bool os_inputEvent(const KVMFRInputEvent * event)
+{
+  bool ok;
+  switch(event->type)
+  {
+    case KVMFR_INPUT_KEY_DOWN:
+    case KVMFR_INPUT_KEY_UP:
+    {
+      const int key = toKey(event->code);
+      if (key < 0)
+        return true;
+
+      ok = emit(EV_KEY, key, event->type == KVMFR_INPUT_KEY_DOWN);
+      break;
+    }
+
+    case KVMFR_INPUT_MOUSE_PRESS:
+    case KVMFR_INPUT_MOUSE_RELEASE:
+    {
+      const bool down = event->type == KVMFR_INPUT_MOUSE_PRESS;
+
+      // the wheel is a press and release of a button, one step per press
+      if (event->code == 4 || event->code == 5)
+      {
+        if (!down)
+          return true;
+        ok = emit(EV_REL, REL_WHEEL, event->code == 4 ? 1 : -1);
+        break;
+      }
+
+      if (event->code >= sizeof(buttons) / sizeof(*buttons) ||
+          !buttons[event->code])
+        return true;
+
+      ok = emit(EV_KEY, buttons[event->code], down);
+      break;
+    }
+
+    case KVMFR_INPUT_MOUSE_MOTION:
+      ok =
+        (!event->x || emit(EV_REL, REL_X, event->x)) &&
+        (!event->y || emit(EV_REL, REL_Y, event->y));
+      break;
+
+    default:
+      return true;
+  }
+
+  return ok && emit(EV_SYN, SYN_REPORT, 0);
+}
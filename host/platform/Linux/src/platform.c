@@ -69,3 +69,28 @@ const char * os_getDataPath()
 {
   return app.dataPath;
 }
+
+// the Linux host has no clipboard of its own to sync, the client uses SPICE
+bool os_clipboardInit(ClipboardChangeFn changeFn)
+{
+  return false;
+}
+
+void os_clipboardFree()
+{
+}
+
+bool os_clipboardSet(KVMFRClipboardType type, const void * data, size_t size)
+{
+  return false;
+}
+
+// the guest audio is only captured on Windows
+bool os_audioInit(AudioDataFn dataFn)
+{
+  return false;
+}
+
+void os_audioFree()
+{
+}
@@ -24,15 +24,23 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "common/option.h"
 #include "common/locking.h"
 #include "common/event.h"
+#include "common/thread.h"
+#include "common/damage.h"
+#include "common/time.h"
+#include "common/trace.h"
 
 #include <assert.h>
 #include <stdatomic.h>
 #include <unistd.h>
 #include <dxgi.h>
-#include <d3d11.h>
+#include <d3d11_4.h>
 #include <d3dcommon.h>
 
 #include "dxgi_extra.h"
+#include "yuv.h"
+#include "scale.h"
+#include "zerocopy.h"
+#include "encode.h"
 
 typedef enum _D3DKMT_SCHEDULINGPRIORITYCLASS
 {
@@ -48,6 +56,36 @@ typedef NTSTATUS WINAPI (*PD3DKMTSetProcessSchedulingPriorityClass)(HANDLE, D3DK
 
 #define LOCKED(x) INTERLOCKED_SECTION(this->deviceContextLock, x)
 
+// the size in pixels of the tiles hashed to detect unchanged frames
+#define DEDUP_TILE_SIZE 64
+#define DEDUP_FNV_PRIME 0x100000001b3ULL
+
+// the acquire lock polls in microseconds, quickly from just before the
+// predicted present until it is missed, otherwise slowly which also bounds
+// the latency of pointer only updates
+#define ACQUIRE_MARGIN 500
+#define ACQUIRE_POLL   100
+#define ACQUIRE_SLEEP  1000
+
+// presents further apart than this in microseconds restart the prediction
+#define CADENCE_RESET  100000
+
+// the adaptive format is judged over windows of this many microseconds, a
+// switch needs as many windows in a row that agree and is not made again
+// until the dwell has passed
+#define ADAPT_WINDOW   1000000
+#define ADAPT_HOLD     3
+#define ADAPT_DWELL    10000000
+
+// the share of the frame budget a full BGRA frame may take before switching
+// to YUV420, and the share it must fall under to switch back
+#define ADAPT_HIGH     0.6
+#define ADAPT_LOW      0.4
+
+// the damaged share of the frame and the frame rate that mark video
+#define ADAPT_VIDEO_AREA 0.3
+#define ADAPT_VIDEO_FPS  20
+
 enum TextureState
 {
   TEXTURE_STATE_UNUSED,
@@ -61,9 +99,37 @@ typedef struct Texture
   volatile enum TextureState state;
   ID3D11Texture2D          * tex;
   D3D11_MAPPED_SUBRESOURCE   map;
+
+  // completion of the copy into this texture, either the fence value it was
+  // signalled with, or an event query when fences are not available
+  UINT64                     fenceValue;
+  ID3D11Query              * query;
+
+  // areas of the staging texture that are out of date
+  FrameDamage                texDamage;
+
+  // areas that changed since the prior frame that was copied
+  FrameDamage                frameDamage;
+
+  // the microtime the frame in this texture was presented by the guest
+  uint64_t                   presentTime;
+
+  // the encoded frame when encoding, zero sized if the encoder held it back
+  uint8_t                  * bits;
+  size_t                     bitsSize;
 }
 Texture;
 
+// a pointer shape copied out of the duplication, the frame it came with can
+// then be released before the shape is converted and posted
+typedef struct PointerShape
+{
+  uint8_t                       * data;
+  UINT                            alloc, size;
+  DXGI_OUTDUPL_POINTER_SHAPE_INFO info;
+}
+PointerShape;
+
 // locals
 struct iface
 {
@@ -78,7 +144,78 @@ struct iface
   ID3D11Device             * device;
   ID3D11DeviceContext      * deviceContext;
   LG_Lock                    deviceContextLock;
+  ID3D11DeviceContext      * copyContext;
+  ID3D11DeviceContext4     * deviceContext4;
+  ID3D11Fence              * fence;
+  UINT64                     fenceValue;
+  HANDLE                     fenceEvent;
   bool                       useAcquireLock;
+  bool                       useYUV420;
+  YUVConvert               * yuv;
+
+  // pick YUV420 while full BGRA frames take too much of the frame budget and
+  // the content is video, decided in the frame thread and applied at init
+  bool                       useAdaptive;
+  atomic_bool                adaptYUV420;
+  bool                       appliedAdaptYUV420;
+  uint64_t                   adaptStart, adaptSwitch, adaptWait;
+  uint64_t                   adaptCost;
+  unsigned int               adaptFrames, adaptCostFrames, adaptAgree;
+  double                     adaptArea;
+  bool                       usePackHDR;
+  int                        sdrWhiteLevel;
+  ScaleConvert             * scale;
+  bool                       useZeroCopy;
+  ZeroCopy                 * zeroCopy;
+  bool                       useD3D12Copy;
+  bool                       copyHighPriority;
+  ZeroCopy                 * readback;
+  bool                       useDedup;
+  bool                       useEncode;
+  int                        encodeBitrate;
+  Encode                   * encode;
+
+  // hashes of the tiles of the last frame sent, zero if not known
+  uint64_t                 * tileHash;
+  unsigned int               tilesX, tilesY;
+  unsigned int               tileFormatVer;
+
+  // a copy of the desktop that the conversion passes can sample
+  ID3D11Texture2D          * srcTex;
+  ID3D11ShaderResourceView * srcView;
+
+  // the size requested by the client, and the size it was applied at
+  atomic_uint                targetWidth, targetHeight;
+  unsigned int               appliedWidth, appliedHeight;
+
+  // the region of the desktop to capture, the values it was applied at, and
+  // the clamped region in use
+  atomic_uint                cropX, cropY, cropWidth, cropHeight;
+  CaptureRect                appliedCrop;
+  CaptureRect                crop;
+  bool                       cropped;
+
+  // the formats the client can show natively as a mask of 1 << CaptureFormat,
+  // and the one it prefers, with the values they were applied at
+  atomic_uint                clientFormats;
+  atomic_int                 clientPreferred;
+  unsigned int               appliedFormats;
+  CaptureFormat              appliedPreferred;
+
+  // the minimum time between copies asked for by the client in microseconds,
+  // frames that arrive sooner are held on the GPU until it elapses
+  atomic_uint                frameInterval;
+  uint64_t                   lastCopyTime;
+  ID3D11Texture2D          * holdTex;
+  bool                       held;
+  LONGLONG                   heldPresentTime;
+
+  // the guest's present cadence, an average of the interval between presents
+  // in microseconds, and how often the next present fell in its window
+  uint64_t                   lastPresent;
+  atomic_uint                presentInterval;
+  atomic_uint_fast64_t       presentHits, presentMisses;
+
   D3D_FEATURE_LEVEL          featureLevel;
   IDXGIOutputDuplication   * dup;
   int                        maxTextures;
@@ -87,6 +224,7 @@ struct iface
   int                        texWIndex;
   atomic_int                 texReady;
   bool                       needsRelease;
+  FrameDamage                pendingDamage;
 
   CaptureGetPointerBuffer    getPointerBufferFn;
   CapturePostPointerBuffer   postPointerBufferFn;
@@ -95,17 +233,34 @@ struct iface
   unsigned int  formatVer;
   unsigned int  width;
   unsigned int  height;
+  unsigned int  outWidth;
+  unsigned int  outHeight;
   unsigned int  pitch;
   unsigned int  stride;
+  unsigned int  bpp;
   CaptureFormat format;
 
   int  lastPointerX, lastPointerY;
   bool lastPointerVisible;
+
+  // the pointer is posted by its own thread so the shape conversion and post
+  // are off the capture path, the shapes are swapped between the capture,
+  // the pending update and the thread under the lock
+  LGThread     * pointerThread;
+  LGEvent      * pointerEvent;
+  LG_Lock        pointerLock;
+  volatile bool  pointerRunning;
+  PointerShape   shapes[3];
+  PointerShape * shapeCapture, * shapePending, * shapeThread;
+  bool           pendingPost, pendingShape, pendingPosition, pendingVisible;
+  int            pendingX, pendingY;
 };
 
 static bool           dpiDone = false;
 static struct iface * this    = NULL;
 
+static int dxgi_pointerThread(void * unused);
+
 // forwards
 
 static bool          dxgi_deinit();
@@ -136,6 +291,13 @@ static void dxgi_initOptions()
       .type           = OPTION_TYPE_STRING,
       .value.x_string = NULL
     },
+    {
+      .module         = "dxgi",
+      .name           = "outputIndex",
+      .description    = "Which of the matching desktop outputs to capture, counted across adapters",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 0
+    },
     {
       .module         = "dxgi",
       .name           = "maxTextures",
@@ -150,6 +312,76 @@ static void dxgi_initOptions()
       .type           = OPTION_TYPE_BOOL,
       .value.x_bool   = true
     },
+    {
+      .module         = "dxgi",
+      .name           = "zeroCopy",
+      .description    = "Copy frames from the GPU straight into shared memory using D3D12 (EXPERIMENTAL)",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "dxgi",
+      .name           = "d3d12Copy",
+      .description    = "Read frames back on a D3D12 copy queue instead of the D3D11 context, several frames may be in flight (EXPERIMENTAL)",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "dxgi",
+      .name           = "copyHighPriority",
+      .description    = "Run the D3D12 copy queue at high priority, disable to leave the GPU to the guest's own work first",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {
+      .module         = "dxgi",
+      .name           = "yuv420",
+      .description    = "Convert the frame to YUV420 on the GPU to reduce the data copied to the client",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "dxgi",
+      .name           = "adaptiveYUV420",
+      .description    = "Switch to YUV420 while full frames take too long to copy for the frame rate and the content is video",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "dxgi",
+      .name           = "packHDR",
+      .description    = "Pack HDR frames to 10-bit SDR on the GPU even if the client can show them",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "dxgi",
+      .name           = "sdrWhiteLevel",
+      .description    = "The brightness in nits of SDR white when packing HDR frames",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 80
+    },
+    {
+      .module         = "dxgi",
+      .name           = "dedup",
+      .description    = "Don't send frames that are identical to the last frame sent",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {
+      .module         = "dxgi",
+      .name           = "encode",
+      .description    = "Encode the frame to H.264 on the GPU for clients that can decode it",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "dxgi",
+      .name           = "encodeBitrate",
+      .description    = "The H.264 bitrate in kbit/s",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 20000
+    },
     {0}
   };
 
@@ -179,388 +411,436 @@ static bool dxgi_create(CaptureGetPointerBuffer getPointerBufferFn, CapturePostP
     this->maxTextures = 1;
 
   this->useAcquireLock      = option_get_bool("dxgi", "useAcquireLock");
+  this->useYUV420           = option_get_bool("dxgi", "yuv420");
+  this->useAdaptive         = option_get_bool("dxgi", "adaptiveYUV420");
+  atomic_init(&this->adaptYUV420, false);
+  this->usePackHDR          = option_get_bool("dxgi", "packHDR");
+  this->sdrWhiteLevel       = option_get_int ("dxgi", "sdrWhiteLevel");
+  if (this->sdrWhiteLevel < 1)
+    this->sdrWhiteLevel = 80;
+  atomic_init(&this->clientFormats  , 0);
+  atomic_init(&this->clientPreferred, CAPTURE_FMT_MAX);
+  this->useZeroCopy         = option_get_bool("dxgi", "zeroCopy");
+  this->useD3D12Copy        = option_get_bool("dxgi", "d3d12Copy");
+  this->copyHighPriority    = option_get_bool("dxgi", "copyHighPriority");
+  this->useDedup            = option_get_bool("dxgi", "dedup");
+  this->useEncode           = option_get_bool("dxgi", "encode");
+  this->encodeBitrate       = option_get_int ("dxgi", "encodeBitrate");
+  if (this->encodeBitrate < 1)
+    this->encodeBitrate = 20000;
   this->texture             = calloc(sizeof(struct Texture), this->maxTextures);
   this->getPointerBufferFn  = getPointerBufferFn;
   this->postPointerBufferFn = postPointerBufferFn;
+
+  this->pointerEvent = lgCreateEvent(true, 0);
+  if (!this->pointerEvent)
+  {
+    DEBUG_ERROR("failed to create the pointer event");
+    lgFreeEvent(this->frameEvent);
+    free(this->texture);
+    free(this);
+    this = NULL;
+    return false;
+  }
+
+  LG_LOCK_INIT(this->pointerLock);
+  this->shapeCapture = &this->shapes[0];
+  this->shapePending = &this->shapes[1];
+  this->shapeThread  = &this->shapes[2];
   return true;
 }
 
-static bool dxgi_init()
+// switch the calling thread to the desktop receiving input so the secure
+// desktop (UAC dialogs) can be captured
+static HDESK dxgi_attachInputDesktop()
 {
-  assert(this);
-
-  this->desktop = OpenInputDesktop(0, FALSE, GENERIC_READ);
-  if (!this->desktop)
-    DEBUG_WINERROR("Failed to open the desktop", GetLastError());
-  else
+  HDESK desktop = OpenInputDesktop(0, FALSE, GENERIC_READ);
+  if (!desktop)
   {
-    if (!SetThreadDesktop(this->desktop))
-    {
-      DEBUG_WINERROR("Failed to set thread desktop", GetLastError());
-      CloseDesktop(this->desktop);
-      this->desktop = NULL;
-    }
+    DEBUG_WINERROR("Failed to open the desktop", GetLastError());
+    return NULL;
   }
 
-  if (!this->desktop)
+  if (!SetThreadDesktop(desktop))
   {
-    DEBUG_INFO("The above error(s) will prevent LG from being able to capture the secure desktop (UAC dialogs)");
-    DEBUG_INFO("This is not a failure, please do not report this as an issue.");
-    DEBUG_INFO("To fix this, install and run the Looking Glass host as a service.");
-    DEBUG_INFO("looking-glass-host.exe InstallService");
+    DEBUG_WINERROR("Failed to set thread desktop", GetLastError());
+    CloseDesktop(desktop);
+    return NULL;
   }
 
-  // this is required for DXGI 1.5 support to function
-  if (!dpiDone)
-  {
-    DECLARE_HANDLE(DPI_AWARENESS_CONTEXT);
-    #define DPI_AWARENESS_CONTEXT_PER_MONITOR_AWARE_V2  ((DPI_AWARENESS_CONTEXT)-4)
-    typedef BOOL (*User32_SetProcessDpiAwarenessContext)(DPI_AWARENESS_CONTEXT value);
-
-    HMODULE user32 = LoadLibraryA("user32.dll");
-    User32_SetProcessDpiAwarenessContext fn;
-    fn = (User32_SetProcessDpiAwarenessContext)GetProcAddress(user32, "SetProcessDpiAwarenessContext");
-    if (fn)
-      fn(DPI_AWARENESS_CONTEXT_PER_MONITOR_AWARE_V2);
-    FreeLibrary(user32);
-    dpiDone = true;
-  }
+  return desktop;
+}
 
+// create the duplication and the textures frames are copied through, these
+// depend on the output mode so are recreated on a mode change
+static bool dxgi_initDuplication()
+{
   HRESULT          status;
   DXGI_OUTPUT_DESC outputDesc;
 
-  this->stop      = false;
   this->texRIndex = 0;
   this->texWIndex = 0;
   atomic_store(&this->texReady, 0);
 
+  damage_set_full(&this->pendingDamage);
+  for(int i = 0; i < this->maxTextures; ++i)
+  {
+    this->texture[i].state = TEXTURE_STATE_UNUSED;
+    damage_set_full(&this->texture[i].texDamage);
+    damage_set_full(&this->texture[i].frameDamage);
+  }
+
   lgResetEvent(this->frameEvent);
+  this->held = false;
 
-  status = CreateDXGIFactory1(&IID_IDXGIFactory1, (void **)&this->factory);
+  IDXGIOutput_GetDesc(this->output, &outputDesc);
+  const unsigned int desktopWidth  =
+    outputDesc.DesktopCoordinates.right  - outputDesc.DesktopCoordinates.left;
+  const unsigned int desktopHeight =
+    outputDesc.DesktopCoordinates.bottom - outputDesc.DesktopCoordinates.top;
+  ++this->formatVer;
+  DEBUG_INFO("Capture Size     : %u x %u", desktopWidth, desktopHeight);
+
+  // the rest of the pipeline only sees the cropped region
+  this->appliedCrop = (CaptureRect)
+  {
+    .x      = atomic_load(&this->cropX     ),
+    .y      = atomic_load(&this->cropY     ),
+    .width  = atomic_load(&this->cropWidth ),
+    .height = atomic_load(&this->cropHeight)
+  };
+  this->crop    = this->appliedCrop;
+  this->cropped = captureClampCrop(desktopWidth, desktopHeight, &this->crop);
+  this->width   = this->crop.width;
+  this->height  = this->crop.height;
+  if (this->cropped)
+    DEBUG_INFO("Cropping to      : %u x %u at %u, %u", this->crop.width,
+        this->crop.height, this->crop.x, this->crop.y);
+
+  this->appliedFormats     = atomic_load(&this->clientFormats  );
+  this->appliedPreferred   = atomic_load(&this->clientPreferred);
+  this->appliedAdaptYUV420 = atomic_load(&this->adaptYUV420);
+
+  // the frames measured so far were in the old format
+  this->adaptStart      = 0;
+  this->adaptFrames     = 0;
+  this->adaptCostFrames = 0;
+  this->adaptCost       = 0;
+  this->adaptArea       = 0.0;
+  this->adaptAgree      = 0;
+
+  IDXGIOutput5 * output5 = NULL;
+  status = IDXGIOutput_QueryInterface(this->output, &IID_IDXGIOutput5, (void **)&output5);
   if (FAILED(status))
   {
-    DEBUG_WINERROR("Failed to create DXGIFactory1", status);
-    goto fail;
-  }
+    DEBUG_WARN("IDXGIOutput5 is not available, please update windows for improved performance!");
+    DEBUG_WARN("Falling back to IDXIGOutput1");
 
-  const char * optAdapter = option_get_string("dxgi", "adapter");
-  const char * optOutput  = option_get_string("dxgi", "output" );
+    IDXGIOutput1 * output1 = NULL;
+    status = IDXGIOutput_QueryInterface(this->output, &IID_IDXGIOutput1, (void **)&output1);
+    if (FAILED(status))
+    {
+      DEBUG_ERROR("Failed to query IDXGIOutput1 from the output");
+      return false;
+    }
 
-  for(int i = 0; IDXGIFactory1_EnumAdapters1(this->factory, i, &this->adapter) != DXGI_ERROR_NOT_FOUND; ++i)
-  {
-    if (optAdapter)
+    // we try this twice in case we still get an error on re-initialization
+    for (int i = 0; i < 2; ++i)
     {
-      DXGI_ADAPTER_DESC1 adapterDesc;
-      status = IDXGIAdapter1_GetDesc1(this->adapter, &adapterDesc);
-      if (FAILED(status))
-      {
-        DEBUG_WINERROR("Failed to get the device description", status);
-        goto fail;
-      }
+      status = IDXGIOutput1_DuplicateOutput(output1, (IUnknown *)this->device, &this->dup);
+      if (SUCCEEDED(status))
+        break;
+      Sleep(200);
+    }
 
-      const size_t s = (wcslen(adapterDesc.Description)+1) * 2;
-      char * desc = malloc(s);
-      wcstombs(desc, adapterDesc.Description, s);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("DuplicateOutput Failed", status);
+      IDXGIOutput1_Release(output1);
+      return false;
+    }
+    IDXGIOutput1_Release(output1);
+  }
+  else
+  {
+    static const struct
+    {
+      DXGI_FORMAT   dxgi;
+      CaptureFormat format;
+    }
+    formats[] =
+    {
+      { DXGI_FORMAT_B8G8R8A8_UNORM    , CAPTURE_FMT_BGRA    },
+      { DXGI_FORMAT_R8G8B8A8_UNORM    , CAPTURE_FMT_RGBA    },
+      { DXGI_FORMAT_R10G10B10A2_UNORM , CAPTURE_FMT_RGBA10  },
+      { DXGI_FORMAT_R16G16B16A16_FLOAT, CAPTURE_FMT_RGBA16F }
+    };
 
-      if (strstr(desc, optAdapter) == NULL)
-      {
-        DEBUG_INFO("Not using adapter: %ls", adapterDesc.Description);
-        free(desc);
-        IDXGIAdapter1_Release(this->adapter);
-        this->adapter = NULL;
+    // only offer what the client can show natively, with the format it
+    // prefers first, BGRA is always offered as DWM can convert anything to it
+    // and RGBA16F is offered to any client that can show RGBA10 as we pack it
+    // down on the GPU rather than let DWM take HDR down to 8-bit
+    const unsigned int packable = (1U << CAPTURE_FMT_RGBA10);
+    DXGI_FORMAT  supportedFormats[sizeof(formats) / sizeof(*formats)];
+    unsigned int formatCount = 0;
+    for(int i = 0; i < sizeof(formats) / sizeof(*formats); ++i)
+      if (formats[i].format == this->appliedPreferred)
+        supportedFormats[formatCount++] = formats[i].dxgi;
+
+    for(int i = 0; i < sizeof(formats) / sizeof(*formats); ++i)
+    {
+      if (formats[i].format == this->appliedPreferred)
         continue;
-      }
-      free(desc);
 
-      DEBUG_INFO("Adapter matched, trying: %ls", adapterDesc.Description);
+      if (formats[i].format == CAPTURE_FMT_BGRA || !this->appliedFormats ||
+          (this->appliedFormats & (1U << formats[i].format)) ||
+          (formats[i].format == CAPTURE_FMT_RGBA16F &&
+           (this->appliedFormats & packable)))
+        supportedFormats[formatCount++] = formats[i].dxgi;
     }
 
-    for(int n = 0; IDXGIAdapter1_EnumOutputs(this->adapter, n, &this->output) != DXGI_ERROR_NOT_FOUND; ++n)
+    // we try this twice in case we still get an error on re-initialization
+    for (int i = 0; i < 2; ++i)
     {
-      IDXGIOutput_GetDesc(this->output, &outputDesc);
-      if (optOutput)
-      {
-        const size_t s = (wcslen(outputDesc.DeviceName)+1) * 2;
-        char * desc = malloc(s);
-        wcstombs(desc, outputDesc.DeviceName, s);
-
-        if (strstr(desc, optOutput) == NULL)
-        {
-          DEBUG_INFO("Not using adapter output: %ls", outputDesc.DeviceName);
-          free(desc);
-          IDXGIOutput_Release(this->output);
-          this->output = NULL;
-          continue;
-        }
+      status = IDXGIOutput5_DuplicateOutput1(
+        output5,
+        (IUnknown *)this->device,
+        0,
+        formatCount,
+        supportedFormats,
+        &this->dup);
 
-        free(desc);
+      if (SUCCEEDED(status))
+        break;
 
-        DEBUG_INFO("Adapter output matched, trying: %ls", outputDesc.DeviceName);
-      }
+      // if access is denied we just keep trying until it isn't
+      if (status == E_ACCESSDENIED)
+        --i;
 
-      if (outputDesc.AttachedToDesktop)
-        break;
+      Sleep(200);
+    }
 
-      IDXGIOutput_Release(this->output);
-      this->output = NULL;
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("DuplicateOutput1 Failed", status);
+      IDXGIOutput5_Release(output5);
+      return false;
     }
+    IDXGIOutput5_Release(output5);
+  }
 
-    if (this->output)
+  DXGI_OUTDUPL_DESC dupDesc;
+  IDXGIOutputDuplication_GetDesc(this->dup, &dupDesc);
+  DEBUG_INFO("Source Format    : %s", GetDXGIFormatStr(dupDesc.ModeDesc.Format));
+
+  this->bpp = 4;
+  switch(dupDesc.ModeDesc.Format)
+  {
+    case DXGI_FORMAT_B8G8R8A8_UNORM    : this->format = CAPTURE_FMT_BGRA   ; break;
+    case DXGI_FORMAT_R8G8B8A8_UNORM    : this->format = CAPTURE_FMT_RGBA   ; break;
+    case DXGI_FORMAT_R10G10B10A2_UNORM : this->format = CAPTURE_FMT_RGBA10 ; break;
+
+    case DXGI_FORMAT_R16G16B16A16_FLOAT:
+      this->format = CAPTURE_FMT_RGBA16F;
+      this->bpp = 8;
       break;
 
-    IDXGIAdapter1_Release(this->adapter);
-    this->adapter = NULL;
+    default:
+      DEBUG_ERROR("Unsupported source format");
+      return false;
   }
 
-  if (!this->output)
+  // 64bpp HDR frames are packed to RGBA10 unless the client can show them,
+  // this halves the copy and the client no longer has to map scRGB itself
+  DXGI_FORMAT outFormat = dupDesc.ModeDesc.Format;
+  bool        pack      = false;
+  if (this->format == CAPTURE_FMT_RGBA16F && (this->usePackHDR ||
+        (this->appliedFormats &&
+         !(this->appliedFormats & (1U << CAPTURE_FMT_RGBA16F)))))
   {
-    DEBUG_ERROR("Failed to locate a valid output device");
-    goto fail;
+    pack         = true;
+    outFormat    = DXGI_FORMAT_R10G10B10A2_UNORM;
+    this->format = CAPTURE_FMT_RGBA10;
+    this->bpp    = 4;
+    DEBUG_INFO("Packing HDR to   : RGBA10, SDR white %d nits",
+        this->sdrWhiteLevel);
   }
 
-  static const D3D_FEATURE_LEVEL win8[] =
+  // the client may ask for YUV420 or be unable to show it
+  bool yuv420    = false;
+  bool useYUV420 = this->useYUV420 || this->appliedAdaptYUV420 ||
+    this->appliedPreferred == CAPTURE_FMT_YUV420;
+  if (this->appliedFormats && !(this->appliedFormats & (1U << CAPTURE_FMT_YUV420)))
+    useYUV420 = false;
+
+  if (useYUV420)
   {
-    D3D_FEATURE_LEVEL_11_1,
-    D3D_FEATURE_LEVEL_11_0,
-    D3D_FEATURE_LEVEL_10_1,
-    D3D_FEATURE_LEVEL_10_0,
-    D3D_FEATURE_LEVEL_9_3,
-    D3D_FEATURE_LEVEL_9_2,
-    D3D_FEATURE_LEVEL_9_1
-  };
+    if (this->format == CAPTURE_FMT_BGRA || this->format == CAPTURE_FMT_RGBA)
+      yuv420 = true;
+    else
+      DEBUG_WARN("YUV420 conversion is only supported for 8-bit formats");
+  }
 
-  static const D3D_FEATURE_LEVEL win10[] =
+  // the bitstream is only sent to a client that said it can decode it
+  bool h264 = (this->useEncode ||
+      this->appliedPreferred == CAPTURE_FMT_H264) &&
+    (this->appliedFormats & (1U << CAPTURE_FMT_H264));
+  if (h264)
+    yuv420 = false;
+
+  // scale the frame down to the size the client displays it at
+  this->appliedWidth  = atomic_load(&this->targetWidth );
+  this->appliedHeight = atomic_load(&this->targetHeight);
+  const bool scaled = captureFitTarget(this->width, this->height,
+      this->appliedWidth, this->appliedHeight,
+      &this->outWidth, &this->outHeight);
+
+  if (scaled || yuv420 || pack || h264 || this->cropped)
   {
-    D3D_FEATURE_LEVEL_12_1,
-    D3D_FEATURE_LEVEL_12_0,
-    D3D_FEATURE_LEVEL_11_1,
-    D3D_FEATURE_LEVEL_11_0,
-    D3D_FEATURE_LEVEL_10_1,
-    D3D_FEATURE_LEVEL_10_0,
-    D3D_FEATURE_LEVEL_9_3,
-    D3D_FEATURE_LEVEL_9_2,
-    D3D_FEATURE_LEVEL_9_1
-  };
-
-  const D3D_FEATURE_LEVEL * featureLevels;
-  unsigned int featureLevelCount;
-  if (IsWindows8())
-  {
-    featureLevels     = win8;
-    featureLevelCount = sizeof(win8) / sizeof(D3D_FEATURE_LEVEL);
-  }
-  else
-  {
-    featureLevels     = win10;
-    featureLevelCount = sizeof(win10) / sizeof(D3D_FEATURE_LEVEL);
-  }
-
-  IDXGIAdapter * tmp;
-  status = IDXGIAdapter1_QueryInterface(this->adapter, &IID_IDXGIAdapter, (void **)&tmp);
-  if (FAILED(status))
-  {
-    DEBUG_ERROR("Failed to query IDXGIAdapter interface");
-    goto fail;
-  }
-
-  status = D3D11CreateDevice(
-    tmp,
-    D3D_DRIVER_TYPE_UNKNOWN,
-    NULL,
-    D3D11_CREATE_DEVICE_VIDEO_SUPPORT,
-    featureLevels, featureLevelCount,
-    D3D11_SDK_VERSION,
-    &this->device,
-    &this->featureLevel,
-    &this->deviceContext);
-
-  LG_LOCK_INIT(this->deviceContextLock);
-
-  IDXGIAdapter_Release(tmp);
-
-  if (FAILED(status))
-  {
-    DEBUG_WINERROR("Failed to create D3D11 device", status);
-    goto fail;
-  }
-
-  DXGI_ADAPTER_DESC1 adapterDesc;
-  IDXGIAdapter1_GetDesc1(this->adapter, &adapterDesc);
-  this->width  = outputDesc.DesktopCoordinates.right  - outputDesc.DesktopCoordinates.left;
-  this->height = outputDesc.DesktopCoordinates.bottom - outputDesc.DesktopCoordinates.top;
-  ++this->formatVer;
-
-  DEBUG_INFO("Device Descripion: %ls"    , adapterDesc.Description);
-  DEBUG_INFO("Device Vendor ID : 0x%x"   , adapterDesc.VendorId);
-  DEBUG_INFO("Device Device ID : 0x%x"   , adapterDesc.DeviceId);
-  DEBUG_INFO("Device Video Mem : %u MiB" , (unsigned)(adapterDesc.DedicatedVideoMemory  / 1048576));
-  DEBUG_INFO("Device Sys Mem   : %u MiB" , (unsigned)(adapterDesc.DedicatedSystemMemory / 1048576));
-  DEBUG_INFO("Shared Sys Mem   : %u MiB" , (unsigned)(adapterDesc.SharedSystemMemory    / 1048576));
-  DEBUG_INFO("Feature Level    : 0x%x"   , this->featureLevel);
-  DEBUG_INFO("Capture Size     : %u x %u", this->width, this->height);
-  DEBUG_INFO("AcquireLock      : %s"     , this->useAcquireLock ? "enabled" : "disabled");
-
-  // bump up our priority
-  {
-    HMODULE gdi32 = GetModuleHandleA("GDI32");
-    if (gdi32)
+    D3D11_TEXTURE2D_DESC srcDesc =
     {
-      PD3DKMTSetProcessSchedulingPriorityClass fn =
-        (PD3DKMTSetProcessSchedulingPriorityClass)GetProcAddress(gdi32, "D3DKMTSetProcessSchedulingPriorityClass");
-
-      if (fn)
-      {
-        status = fn(GetCurrentProcess(), D3DKMT_SCHEDULINGPRIORITYCLASS_REALTIME);
-        if (FAILED(status))
-        {
-          DEBUG_WARN("Failed to set realtime GPU priority.");
-          DEBUG_INFO("This is not a failure, please do not report this as an issue.");
-          DEBUG_INFO("To fix this, install and run the Looking Glass host as a service.");
-          DEBUG_INFO("looking-glass-host.exe InstallService");
-        }
-      }
-    }
+      .Width            = this->width,
+      .Height           = this->height,
+      .MipLevels        = 1,
+      .ArraySize        = 1,
+      .Format           = dupDesc.ModeDesc.Format,
+      .SampleDesc.Count = 1,
+      .Usage            = D3D11_USAGE_DEFAULT,
+      .BindFlags        = D3D11_BIND_SHADER_RESOURCE
+    };
 
-    IDXGIDevice * dxgi;
-    status = ID3D11Device_QueryInterface(this->device, &IID_IDXGIDevice, (void **)&dxgi);
+    status = ID3D11Device_CreateTexture2D(this->device, &srcDesc, NULL, &this->srcTex);
     if (FAILED(status))
     {
-      DEBUG_WINERROR("failed to query DXGI interface from device", status);
-      goto fail;
+      DEBUG_WINERROR("Failed to create the source texture", status);
+      return false;
     }
 
-    IDXGIDevice_SetGPUThreadPriority(dxgi, 7);
-    IDXGIDevice_Release(dxgi);
-  }
-
-  // try to reduce the latency
-  {
-    IDXGIDevice1 * dxgi;
-    status = ID3D11Device_QueryInterface(this->device, &IID_IDXGIDevice1, (void **)&dxgi);
+    status = ID3D11Device_CreateShaderResourceView(this->device,
+        (ID3D11Resource *)this->srcTex, NULL, &this->srcView);
     if (FAILED(status))
     {
-      DEBUG_WINERROR("failed to query DXGI interface from device", status);
-      goto fail;
+      DEBUG_WINERROR("Failed to create the source view", status);
+      return false;
     }
-
-    IDXGIDevice1_SetMaximumFrameLatency(dxgi, 1);
-    IDXGIDevice1_Release(dxgi);
   }
 
-  IDXGIOutput5 * output5 = NULL;
-  status = IDXGIOutput_QueryInterface(this->output, &IID_IDXGIOutput5, (void **)&output5);
-  if (FAILED(status))
+  // the YUV420 pass does its own scaling, the scaler also does the packing
+  if ((scaled || pack) && !yuv420)
   {
-    DEBUG_WARN("IDXGIOutput5 is not available, please update windows for improved performance!");
-    DEBUG_WARN("Falling back to IDXIGOutput1");
-
-    IDXGIOutput1 * output1 = NULL;
-    status = IDXGIOutput_QueryInterface(this->output, &IID_IDXGIOutput1, (void **)&output1);
-    if (FAILED(status))
+    if (!scale_create(this->device, this->outWidth, this->outHeight,
+          outFormat, pack ? this->sdrWhiteLevel : 0.0f, &this->scale))
     {
-      DEBUG_ERROR("Failed to query IDXGIOutput1 from the output");
-      goto fail;
+      DEBUG_ERROR("Failed to create the scaler");
+      return false;
     }
+  }
 
-    // we try this twice in case we still get an error on re-initialization
-    for (int i = 0; i < 2; ++i)
-    {
-      status = IDXGIOutput1_DuplicateOutput(output1, (IUnknown *)this->device, &this->dup);
-      if (SUCCEEDED(status))
-        break;
-      Sleep(200);
-    }
+  if (scaled)
+    DEBUG_INFO("Scaling to       : %u x %u", this->outWidth, this->outHeight);
 
-    if (FAILED(status))
-    {
-      DEBUG_WINERROR("DuplicateOutput Failed", status);
-      IDXGIOutput1_Release(output1);
-      goto fail;
-    }
-    IDXGIOutput1_Release(output1);
-  }
-  else
+  // the encoder takes the converted frame and replaces the staging textures
+  if (h264)
   {
-    const DXGI_FORMAT supportedFormats[] =
-    {
-      DXGI_FORMAT_B8G8R8A8_UNORM,
-      DXGI_FORMAT_R8G8B8A8_UNORM,
-      DXGI_FORMAT_R10G10B10A2_UNORM,
-      DXGI_FORMAT_R16G16B16A16_FLOAT
-    };
-
-    // we try this twice in case we still get an error on re-initialization
-    for (int i = 0; i < 2; ++i)
+    ID3D11Texture2D * encodeSrc =
+      this->scale ? scale_getTexture(this->scale) : this->srcTex;
+    if (encode_create(this->adapter, this->device, this->deviceContext,
+          encodeSrc, this->outWidth, this->outHeight, this->encodeBitrate,
+          &this->encode))
     {
-      status = IDXGIOutput5_DuplicateOutput1(
-        output5,
-        (IUnknown *)this->device,
-        0,
-        sizeof(supportedFormats) / sizeof(DXGI_FORMAT),
-        supportedFormats,
-        &this->dup);
-
-      if (SUCCEEDED(status))
-        break;
-
-      // if access is denied we just keep trying until it isn't
-      if (status == E_ACCESSDENIED)
-        --i;
-
-      Sleep(200);
-    }
+      const size_t maxSize = (size_t)this->outWidth * this->outHeight * 3 / 2;
+      for(int i = 0; i < this->maxTextures; ++i)
+        if (!(this->texture[i].bits = malloc(maxSize)))
+        {
+          DEBUG_ERROR("out of memory");
+          return false;
+        }
 
-    if (FAILED(status))
-    {
-      DEBUG_WINERROR("DuplicateOutput1 Failed", status);
-      IDXGIOutput5_Release(output5);
-      goto fail;
+      this->format = CAPTURE_FMT_H264;
+      this->bpp    = 0;
+      this->pitch  = 0;
+      this->stride = 0;
+      DEBUG_INFO("Encoding to      : H.264 at %d kbit/s", this->encodeBitrate);
+      return true;
     }
-    IDXGIOutput5_Release(output5);
-  }
-
-  DXGI_OUTDUPL_DESC dupDesc;
-  IDXGIOutputDuplication_GetDesc(this->dup, &dupDesc);
-  DEBUG_INFO("Source Format    : %s", GetDXGIFormatStr(dupDesc.ModeDesc.Format));
-
-  uint8_t bpp = 4;
-  switch(dupDesc.ModeDesc.Format)
-  {
-    case DXGI_FORMAT_B8G8R8A8_UNORM    : this->format = CAPTURE_FMT_BGRA   ; break;
-    case DXGI_FORMAT_R8G8B8A8_UNORM    : this->format = CAPTURE_FMT_RGBA   ; break;
-    case DXGI_FORMAT_R10G10B10A2_UNORM : this->format = CAPTURE_FMT_RGBA10 ; break;
-
-    case DXGI_FORMAT_R16G16B16A16_FLOAT:
-      this->format = CAPTURE_FMT_RGBA16F;
-      bpp = 8;
-      break;
 
-    default:
-      DEBUG_ERROR("Unsupported source format");
-      goto fail;
+    DEBUG_WARN("Hardware encoding is not available, sending raw frames");
   }
 
   D3D11_TEXTURE2D_DESC texDesc;
   memset(&texDesc, 0, sizeof(texDesc));
-  texDesc.Width              = this->width;
-  texDesc.Height             = this->height;
+  texDesc.Width              = this->outWidth;
+  texDesc.Height             = this->outHeight;
   texDesc.MipLevels          = 1;
   texDesc.ArraySize          = 1;
   texDesc.SampleDesc.Count   = 1;
   texDesc.SampleDesc.Quality = 0;
   texDesc.Usage              = D3D11_USAGE_STAGING;
-  texDesc.Format             = dupDesc.ModeDesc.Format;
+  texDesc.Format             = outFormat;
   texDesc.BindFlags          = 0;
   texDesc.CPUAccessFlags     = D3D11_CPU_ACCESS_READ;
   texDesc.MiscFlags          = 0;
 
+  if (yuv420)
+  {
+    // a single R8 texture holding the three planes, the width is aligned so
+    // the staging pitch matches it and the planes are tightly packed
+    texDesc.Width  = (this->outWidth + 255) & ~255;
+    texDesc.Height = this->outHeight * 3 / 2;
+    texDesc.Format = DXGI_FORMAT_R8_UNORM;
+  }
+
+  if (this->useZeroCopy && !yuv420)
+  {
+    if (zerocopy_create(this->adapter, this->device, this->maxTextures,
+          this->outWidth, this->outHeight, texDesc.Format, false,
+          this->copyHighPriority, &this->zeroCopy))
+    {
+      // the shared textures take the place of the staging textures
+      for(int i = 0; i < this->maxTextures; ++i)
+      {
+        this->texture[i].tex = zerocopy_getTexture(this->zeroCopy, i);
+        ID3D11Texture2D_AddRef(this->texture[i].tex);
+      }
+
+      this->pitch  = zerocopy_getPitch(this->zeroCopy);
+      this->stride = this->pitch / this->bpp;
+      DEBUG_INFO("Zero copy        : enabled");
+      goto done;
+    }
+
+    DEBUG_WARN("Zero copy is not available, falling back to staging textures");
+  }
+
+  if (this->useD3D12Copy && !this->zeroCopy && !yuv420)
+  {
+    if (zerocopy_create(this->adapter, this->device, this->maxTextures,
+          this->outWidth, this->outHeight, texDesc.Format, true,
+          this->copyHighPriority, &this->readback))
+    {
+      // the textures are read back by D3D12 in place of the staging textures
+      for(int i = 0; i < this->maxTextures; ++i)
+      {
+        this->texture[i].tex = zerocopy_getTexture(this->readback, i);
+        ID3D11Texture2D_AddRef(this->texture[i].tex);
+      }
+
+      this->pitch  = zerocopy_getPitch(this->readback);
+      this->stride = this->pitch / this->bpp;
+      DEBUG_INFO("D3D12 copy       : enabled");
+      goto done;
+    }
+
+    DEBUG_WARN("The D3D12 copy is not available, falling back to staging textures");
+  }
+
   for(int i = 0; i < this->maxTextures; ++i)
   {
     status = ID3D11Device_CreateTexture2D(this->device, &texDesc, NULL, &this->texture[i].tex);
     if (FAILED(status))
     {
       DEBUG_WINERROR("Failed to create texture", status);
-      goto fail;
+      return false;
     }
   }
 
@@ -570,333 +850,1674 @@ static bool dxgi_init()
   if (FAILED(status))
   {
     DEBUG_WINERROR("Failed to map the texture", status);
-    goto fail;
+    return false;
   }
   this->pitch  = mapping.RowPitch;
-  this->stride = mapping.RowPitch / bpp;
+  this->stride = mapping.RowPitch / this->bpp;
   ID3D11DeviceContext_Unmap(this->deviceContext, (ID3D11Resource *)this->texture[0].tex, 0);
 
-  QueryPerformanceFrequency(&this->perfFreq) ;
-  QueryPerformanceCounter  (&this->frameTime);
-  this->initialized = true;
-  return true;
-
-fail:
-  dxgi_deinit();
-  return false;
-}
-
-static void dxgi_stop()
-{
-  this->stop = true;
-}
-
-static bool dxgi_deinit()
-{
-  assert(this);
-
-  for(int i = 0; i < this->maxTextures; ++i)
+  if (yuv420)
   {
-    this->texture[i].state = TEXTURE_STATE_UNUSED;
-
-    if (this->texture[i].map.pData)
+    if (this->pitch != texDesc.Width)
     {
-      ID3D11DeviceContext_Unmap(this->deviceContext, (ID3D11Resource*)this->texture[i].tex, 0);
-      this->texture[i].map.pData = NULL;
+      DEBUG_ERROR("Unexpected YUV420 staging pitch: %u", this->pitch);
+      return false;
     }
 
-    if (this->texture[i].tex)
+    if (!yuv_create(this->device, this->outWidth, this->outHeight, this->pitch,
+          &this->yuv))
     {
-      ID3D11Texture2D_Release(this->texture[i].tex);
-      this->texture[i].tex = NULL;
+      DEBUG_ERROR("Failed to create the YUV420 converter");
+      return false;
     }
-  }
 
-  if (this->dup)
-  {
-    dxgi_releaseFrame();
-    IDXGIOutputDuplication_Release(this->dup);
-    this->dup = NULL;
+    this->format = CAPTURE_FMT_YUV420;
+    this->bpp    = 1;
+    this->stride = this->pitch;
+    DEBUG_INFO("Converting to YUV420 on the GPU");
   }
 
-  if (this->deviceContext)
+done:
+  if (!this->fence)
   {
-    ID3D11DeviceContext_Release(this->deviceContext);
-    this->deviceContext = NULL;
+    const D3D11_QUERY_DESC queryDesc =
+    {
+      .Query     = D3D11_QUERY_EVENT,
+      .MiscFlags = 0
+    };
+
+    for(int i = 0; i < this->maxTextures; ++i)
+    {
+      status = ID3D11Device_CreateQuery(this->device, &queryDesc, &this->texture[i].query);
+      if (FAILED(status))
+      {
+        DEBUG_WINERROR("Failed to create the event query", status);
+        return false;
+      }
+    }
   }
 
-  if (this->output)
+  return true;
+}
+
+static bool dxgi_init()
+{
+  assert(this);
+
+  this->desktop = dxgi_attachInputDesktop();
+  if (!this->desktop)
+  {
+    DEBUG_INFO("The above error(s) will prevent LG from being able to capture the secure desktop (UAC dialogs)");
+    DEBUG_INFO("This is not a failure, please do not report this as an issue.");
+    DEBUG_INFO("To fix this, install and run the Looking Glass host as a service.");
+    DEBUG_INFO("looking-glass-host.exe InstallService");
+  }
+
+  // this is required for DXGI 1.5 support to function
+  if (!dpiDone)
+  {
+    DECLARE_HANDLE(DPI_AWARENESS_CONTEXT);
+    #define DPI_AWARENESS_CONTEXT_PER_MONITOR_AWARE_V2  ((DPI_AWARENESS_CONTEXT)-4)
+    typedef BOOL (*User32_SetProcessDpiAwarenessContext)(DPI_AWARENESS_CONTEXT value);
+
+    HMODULE user32 = LoadLibraryA("user32.dll");
+    User32_SetProcessDpiAwarenessContext fn;
+    fn = (User32_SetProcessDpiAwarenessContext)GetProcAddress(user32, "SetProcessDpiAwarenessContext");
+    if (fn)
+      fn(DPI_AWARENESS_CONTEXT_PER_MONITOR_AWARE_V2);
+    FreeLibrary(user32);
+    dpiDone = true;
+  }
+
+  HRESULT          status;
+  DXGI_OUTPUT_DESC outputDesc;
+
+  this->stop = false;
+
+  status = CreateDXGIFactory1(&IID_IDXGIFactory1, (void **)&this->factory);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create DXGIFactory1", status);
+    goto fail;
+  }
+
+  const char * optAdapter = option_get_string("dxgi", "adapter");
+  const char * optOutput  = option_get_string("dxgi", "output" );
+  int          skip       = option_get_int   ("dxgi", "outputIndex");
+
+  for(int i = 0; IDXGIFactory1_EnumAdapters1(this->factory, i, &this->adapter) != DXGI_ERROR_NOT_FOUND; ++i)
+  {
+    if (optAdapter)
+    {
+      DXGI_ADAPTER_DESC1 adapterDesc;
+      status = IDXGIAdapter1_GetDesc1(this->adapter, &adapterDesc);
+      if (FAILED(status))
+      {
+        DEBUG_WINERROR("Failed to get the device description", status);
+        goto fail;
+      }
+
+      const size_t s = (wcslen(adapterDesc.Description)+1) * 2;
+      char * desc = malloc(s);
+      wcstombs(desc, adapterDesc.Description, s);
+
+      if (strstr(desc, optAdapter) == NULL)
+      {
+        DEBUG_INFO("Not using adapter: %ls", adapterDesc.Description);
+        free(desc);
+        IDXGIAdapter1_Release(this->adapter);
+        this->adapter = NULL;
+        continue;
+      }
+      free(desc);
+
+      DEBUG_INFO("Adapter matched, trying: %ls", adapterDesc.Description);
+    }
+
+    for(int n = 0; IDXGIAdapter1_EnumOutputs(this->adapter, n, &this->output) != DXGI_ERROR_NOT_FOUND; ++n)
+    {
+      IDXGIOutput_GetDesc(this->output, &outputDesc);
+      if (optOutput)
+      {
+        const size_t s = (wcslen(outputDesc.DeviceName)+1) * 2;
+        char * desc = malloc(s);
+        wcstombs(desc, outputDesc.DeviceName, s);
+
+        if (strstr(desc, optOutput) == NULL)
+        {
+          DEBUG_INFO("Not using adapter output: %ls", outputDesc.DeviceName);
+          free(desc);
+          IDXGIOutput_Release(this->output);
+          this->output = NULL;
+          continue;
+        }
+
+        free(desc);
+
+        DEBUG_INFO("Adapter output matched, trying: %ls", outputDesc.DeviceName);
+      }
+
+      if (outputDesc.AttachedToDesktop && skip-- == 0)
+        break;
+
+      IDXGIOutput_Release(this->output);
+      this->output = NULL;
+    }
+
+    if (this->output)
+      break;
+
+    IDXGIAdapter1_Release(this->adapter);
+    this->adapter = NULL;
+  }
+
+  if (!this->output)
+  {
+    DEBUG_ERROR("Failed to locate a valid output device");
+    goto fail;
+  }
+
+  static const D3D_FEATURE_LEVEL win8[] =
+  {
+    D3D_FEATURE_LEVEL_11_1,
+    D3D_FEATURE_LEVEL_11_0,
+    D3D_FEATURE_LEVEL_10_1,
+    D3D_FEATURE_LEVEL_10_0,
+    D3D_FEATURE_LEVEL_9_3,
+    D3D_FEATURE_LEVEL_9_2,
+    D3D_FEATURE_LEVEL_9_1
+  };
+
+  static const D3D_FEATURE_LEVEL win10[] =
+  {
+    D3D_FEATURE_LEVEL_12_1,
+    D3D_FEATURE_LEVEL_12_0,
+    D3D_FEATURE_LEVEL_11_1,
+    D3D_FEATURE_LEVEL_11_0,
+    D3D_FEATURE_LEVEL_10_1,
+    D3D_FEATURE_LEVEL_10_0,
+    D3D_FEATURE_LEVEL_9_3,
+    D3D_FEATURE_LEVEL_9_2,
+    D3D_FEATURE_LEVEL_9_1
+  };
+
+  const D3D_FEATURE_LEVEL * featureLevels;
+  unsigned int featureLevelCount;
+  if (IsWindows8())
+  {
+    featureLevels     = win8;
+    featureLevelCount = sizeof(win8) / sizeof(D3D_FEATURE_LEVEL);
+  }
+  else
+  {
+    featureLevels     = win10;
+    featureLevelCount = sizeof(win10) / sizeof(D3D_FEATURE_LEVEL);
+  }
+
+  IDXGIAdapter * tmp;
+  status = IDXGIAdapter1_QueryInterface(this->adapter, &IID_IDXGIAdapter, (void **)&tmp);
+  if (FAILED(status))
+  {
+    DEBUG_ERROR("Failed to query IDXGIAdapter interface");
+    goto fail;
+  }
+
+  status = D3D11CreateDevice(
+    tmp,
+    D3D_DRIVER_TYPE_UNKNOWN,
+    NULL,
+    D3D11_CREATE_DEVICE_VIDEO_SUPPORT,
+    featureLevels, featureLevelCount,
+    D3D11_SDK_VERSION,
+    &this->device,
+    &this->featureLevel,
+    &this->deviceContext);
+
+  LG_LOCK_INIT(this->deviceContextLock);
+
+  IDXGIAdapter_Release(tmp);
+
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create D3D11 device", status);
+    goto fail;
+  }
+
+  // record the copies on a deferred context so the immediate context is only
+  // locked long enough to submit them
+  status = ID3D11Device_CreateDeferredContext(this->device, 0, &this->copyContext);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the deferred context", status);
+    DEBUG_WARN("Falling back to copying on the immediate context");
+    this->copyContext = NULL;
+  }
+
+  // a fence lets the frame thread wait for the copies without the context
+  {
+    ID3D11Device5 * device5;
+    status = ID3D11Device_QueryInterface(this->device, &IID_ID3D11Device5, (void **)&device5);
+    if (SUCCEEDED(status))
+    {
+      status = ID3D11Device5_CreateFence(device5, 0, D3D11_FENCE_FLAG_NONE,
+          &IID_ID3D11Fence, (void **)&this->fence);
+      ID3D11Device5_Release(device5);
+    }
+
+    if (SUCCEEDED(status))
+      status = ID3D11DeviceContext_QueryInterface(this->deviceContext,
+          &IID_ID3D11DeviceContext4, (void **)&this->deviceContext4);
+
+    if (SUCCEEDED(status))
+    {
+      this->fenceEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+      if (!this->fenceEvent)
+        status = E_FAIL;
+    }
+
+    if (FAILED(status))
+    {
+      DEBUG_WARN("ID3D11Fence is not available, falling back to event queries");
+      if (this->deviceContext4)
+      {
+        ID3D11DeviceContext4_Release(this->deviceContext4);
+        this->deviceContext4 = NULL;
+      }
+
+      if (this->fence)
+      {
+        ID3D11Fence_Release(this->fence);
+        this->fence = NULL;
+      }
+    }
+    this->fenceValue = 0;
+  }
+
+  DXGI_ADAPTER_DESC1 adapterDesc;
+  IDXGIAdapter1_GetDesc1(this->adapter, &adapterDesc);
+
+  DEBUG_INFO("Device Descripion: %ls"    , adapterDesc.Description);
+  DEBUG_INFO("Device Vendor ID : 0x%x"   , adapterDesc.VendorId);
+  DEBUG_INFO("Device Device ID : 0x%x"   , adapterDesc.DeviceId);
+  DEBUG_INFO("Device Video Mem : %u MiB" , (unsigned)(adapterDesc.DedicatedVideoMemory  / 1048576));
+  DEBUG_INFO("Device Sys Mem   : %u MiB" , (unsigned)(adapterDesc.DedicatedSystemMemory / 1048576));
+  DEBUG_INFO("Shared Sys Mem   : %u MiB" , (unsigned)(adapterDesc.SharedSystemMemory    / 1048576));
+  DEBUG_INFO("Feature Level    : 0x%x"   , this->featureLevel);
+  DEBUG_INFO("AcquireLock      : %s"     , this->useAcquireLock ? "enabled" : "disabled");
+
+  // bump up our priority
+  {
+    HMODULE gdi32 = GetModuleHandleA("GDI32");
+    if (gdi32)
+    {
+      PD3DKMTSetProcessSchedulingPriorityClass fn =
+        (PD3DKMTSetProcessSchedulingPriorityClass)GetProcAddress(gdi32, "D3DKMTSetProcessSchedulingPriorityClass");
+
+      if (fn)
+      {
+        status = fn(GetCurrentProcess(), D3DKMT_SCHEDULINGPRIORITYCLASS_REALTIME);
+        if (FAILED(status))
+        {
+          DEBUG_WARN("Failed to set realtime GPU priority.");
+          DEBUG_INFO("This is not a failure, please do not report this as an issue.");
+          DEBUG_INFO("To fix this, install and run the Looking Glass host as a service.");
+          DEBUG_INFO("looking-glass-host.exe InstallService");
+        }
+      }
+    }
+
+    IDXGIDevice * dxgi;
+    status = ID3D11Device_QueryInterface(this->device, &IID_IDXGIDevice, (void **)&dxgi);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("failed to query DXGI interface from device", status);
+      goto fail;
+    }
+
+    IDXGIDevice_SetGPUThreadPriority(dxgi, 7);
+    IDXGIDevice_Release(dxgi);
+  }
+
+  // try to reduce the latency
+  {
+    IDXGIDevice1 * dxgi;
+    status = ID3D11Device_QueryInterface(this->device, &IID_IDXGIDevice1, (void **)&dxgi);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("failed to query DXGI interface from device", status);
+      goto fail;
+    }
+
+    IDXGIDevice1_SetMaximumFrameLatency(dxgi, 1);
+    IDXGIDevice1_Release(dxgi);
+  }
+
+  if (!dxgi_initDuplication())
+    goto fail;
+
+  this->pendingPost    = false;
+  this->pendingShape   = false;
+  this->pointerRunning = true;
+  if (!lgCreateThread("DXGIPointer", dxgi_pointerThread, NULL,
+        &this->pointerThread))
+  {
+    DEBUG_ERROR("Failed to create the pointer thread");
+    this->pointerRunning = false;
+    goto fail;
+  }
+
+  QueryPerformanceFrequency(&this->perfFreq) ;
+  QueryPerformanceCounter  (&this->frameTime);
+  this->initialized = true;
+  return true;
+
+fail:
+  dxgi_deinit();
+  return false;
+}
+
+static void dxgi_stop()
+{
+  this->stop = true;
+}
+
+static void dxgi_freeDuplication()
+{
+  for(int i = 0; i < this->maxTextures; ++i)
+  {
+    this->texture[i].state = TEXTURE_STATE_UNUSED;
+
+    // a D3D12 readback is unmapped when it is freed
+    if (this->texture[i].map.pData)
+    {
+      if (!this->readback)
+        ID3D11DeviceContext_Unmap(this->deviceContext, (ID3D11Resource*)this->texture[i].tex, 0);
+      this->texture[i].map.pData = NULL;
+    }
+
+    if (this->texture[i].tex)
+    {
+      ID3D11Texture2D_Release(this->texture[i].tex);
+      this->texture[i].tex = NULL;
+    }
+
+    if (this->texture[i].query)
+    {
+      ID3D11Query_Release(this->texture[i].query);
+      this->texture[i].query = NULL;
+    }
+
+    free(this->texture[i].bits);
+    this->texture[i].bits     = NULL;
+    this->texture[i].bitsSize = 0;
+  }
+
+  encode_free  (&this->encode  );
+  yuv_free     (&this->yuv     );
+  scale_free   (&this->scale   );
+  zerocopy_free(&this->zeroCopy);
+  zerocopy_free(&this->readback);
+
+  if (this->srcView)
+  {
+    ID3D11ShaderResourceView_Release(this->srcView);
+    this->srcView = NULL;
+  }
+
+  if (this->srcTex)
+  {
+    ID3D11Texture2D_Release(this->srcTex);
+    this->srcTex = NULL;
+  }
+
+  if (this->holdTex)
+  {
+    ID3D11Texture2D_Release(this->holdTex);
+    this->holdTex = NULL;
+  }
+  this->held = false;
+
+  if (this->dup)
+  {
+    dxgi_releaseFrame();
+    IDXGIOutputDuplication_Release(this->dup);
+    this->dup = NULL;
+  }
+}
+
+static bool dxgi_reinit()
+{
+  assert(this);
+  assert(this->initialized);
+
+  // a lost device can only be recovered by recreating it
+  HRESULT status = ID3D11Device_GetDeviceRemovedReason(this->device);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("The device was removed", status);
+    return false;
+  }
+
+  // the input desktop may have changed, e.g. to or from the secure desktop
+  HDESK desktop = dxgi_attachInputDesktop();
+  if (desktop)
+  {
+    if (this->desktop)
+      CloseDesktop(this->desktop);
+    this->desktop = desktop;
+  }
+
+  dxgi_freeDuplication();
+  this->stop = false;
+  return dxgi_initDuplication();
+}
+
+static bool dxgi_deinit()
+{
+  assert(this);
+
+  if (this->pointerThread)
+  {
+    this->pointerRunning = false;
+    lgSignalEvent(this->pointerEvent);
+    lgJoinThread(this->pointerThread, NULL);
+    this->pointerThread = NULL;
+  }
+
+  dxgi_freeDuplication();
+
+  if (this->fence)
+  {
+    ID3D11Fence_Release(this->fence);
+    this->fence = NULL;
+  }
+
+  if (this->fenceEvent)
+  {
+    CloseHandle(this->fenceEvent);
+    this->fenceEvent = NULL;
+  }
+
+  if (this->deviceContext4)
+  {
+    ID3D11DeviceContext4_Release(this->deviceContext4);
+    this->deviceContext4 = NULL;
+  }
+
+  if (this->copyContext)
+  {
+    ID3D11DeviceContext_Release(this->copyContext);
+    this->copyContext = NULL;
+  }
+
+  if (this->deviceContext)
+  {
+    ID3D11DeviceContext_Release(this->deviceContext);
+    this->deviceContext = NULL;
+  }
+
+  if (this->output)
   {
     IDXGIOutput_Release(this->output);
     this->output = NULL;
   }
 
-  if (this->device)
+  if (this->device)
+  {
+    ID3D11Device_Release(this->device);
+    this->device = NULL;
+  }
+
+  if (this->adapter)
+  {
+    IDXGIAdapter1_Release(this->adapter);
+    this->adapter = NULL;
+  }
+
+  if (this->factory)
+  {
+    // if this doesn't free we have a memory leak
+    DWORD count = IDXGIFactory1_Release(this->factory);
+    this->factory = NULL;
+    if (count != 0)
+    {
+      DEBUG_ERROR("Factory release is %lu, there is a memory leak!", count);
+      return false;
+    }
+  }
+
+  LG_LOCK_FREE(this->deviceContextLock);
+
+  if (this->desktop)
+  {
+    CloseDesktop(this->desktop);
+    this->desktop = NULL;
+  }
+
+  this->initialized = false;
+  return true;
+}
+
+static void dxgi_free()
+{
+  assert(this);
+
+  if (this->initialized)
+    dxgi_deinit();
+
+  free(this->texture);
+  free(this->tileHash);
+  for(int i = 0; i < 3; ++i)
+    free(this->shapes[i].data);
+  lgFreeEvent(this->pointerEvent);
+
+  free(this);
+  this = NULL;
+}
+
+static size_t dxgi_getMaxFrameSize()
+{
+  assert(this);
+  assert(this->initialized);
+
+  if (this->yuv)
+    return (size_t)this->outHeight * this->pitch * 3 / 2;
+
+  // an access unit larger than the raw NV12 frame is dropped
+  if (this->encode)
+    return (size_t)this->outWidth * this->outHeight * 3 / 2;
+
+  // the GPU writes whole aligned blocks
+  if (this->zeroCopy)
+    return ((size_t)this->outHeight * this->pitch + ZEROCOPY_ALIGN - 1) &
+      ~(size_t)(ZEROCOPY_ALIGN - 1);
+
+  return (size_t)this->outHeight * this->pitch;
+}
+
+static CaptureResult dxgi_hResultToCaptureResult(const HRESULT status)
+{
+  switch(status)
+  {
+    case S_OK:
+      return CAPTURE_RESULT_OK;
+
+    case DXGI_ERROR_WAIT_TIMEOUT:
+      return CAPTURE_RESULT_TIMEOUT;
+
+    case WAIT_ABANDONED:
+    case DXGI_ERROR_ACCESS_LOST:
+      return CAPTURE_RESULT_REINIT;
+
+    default:
+      return CAPTURE_RESULT_ERROR;
+  }
+}
+
+static void dxgi_addRect(FrameDamageRect * rects, unsigned int * count,
+    const RECT * rect)
+{
+  // move into the cropped region and clip to it
+  const LONG cx     = this->crop.x, cy = this->crop.y;
+  const LONG left   = max(rect->left   - cx, 0);
+  const LONG top    = max(rect->top    - cy, 0);
+  const LONG right  = min(rect->right  - cx, (LONG)this->width );
+  const LONG bottom = min(rect->bottom - cy, (LONG)this->height);
+
+  if (right <= left || bottom <= top)
+    return;
+
+  FrameDamageRect * r = &rects[(*count)++];
+  if (this->outWidth == this->width && this->outHeight == this->height)
+  {
+    r->x      = left;
+    r->y      = top;
+    r->width  = right  - left;
+    r->height = bottom - top;
+    return;
+  }
+
+  // scale into the output, growing by a pixel for the filter footprint
+  const LONG w  = this->width , h  = this->height;
+  const LONG ow = this->outWidth, oh = this->outHeight;
+  const LONG sl = max(left * ow / w - 1, 0);
+  const LONG st = max(top  * oh / h - 1, 0);
+  const LONG sr = min((right  * ow + w - 1) / w + 1, ow);
+  const LONG sb = min((bottom * oh + h - 1) / h + 1, oh);
+
+  r->x      = sl;
+  r->y      = st;
+  r->width  = sr - sl;
+  r->height = sb - st;
+}
+
+static void dxgi_getFrameDamage(const DXGI_OUTDUPL_FRAME_INFO * frameInfo,
+    FrameDamage * damage)
+{
+  damage_reset(damage);
+  if (frameInfo->TotalMetadataBufferSize == 0)
+  {
+    damage_set_full(damage);
+    return;
+  }
+
+  HRESULT                 status;
+  UINT                    size;
+  DXGI_OUTDUPL_MOVE_RECT  moveRects [KVMFR_MAX_DAMAGE_RECTS];
+  RECT                    dirtyRects[KVMFR_MAX_DAMAGE_RECTS];
+  FrameDamageRect         rects     [KVMFR_MAX_DAMAGE_RECTS];
+  unsigned int            count = 0;
+  unsigned int            moveCount;
+
+  LOCKED({status = IDXGIOutputDuplication_GetFrameMoveRects(this->dup,
+      sizeof(moveRects), moveRects, &size);});
+  if (FAILED(status))
+  {
+    // DXGI_ERROR_MORE_DATA, there are too many to be worth tracking
+    damage_set_full(damage);
+    return;
+  }
+
+  // only the destination of a move is changed
+  moveCount = size / sizeof(*moveRects);
+  for(unsigned int i = 0; i < moveCount; ++i)
+    dxgi_addRect(rects, &count, &moveRects[i].DestinationRect);
+
+  LOCKED({status = IDXGIOutputDuplication_GetFrameDirtyRects(this->dup,
+      sizeof(*dirtyRects) * (KVMFR_MAX_DAMAGE_RECTS - moveCount), dirtyRects,
+      &size);});
+  if (FAILED(status))
+  {
+    damage_set_full(damage);
+    return;
+  }
+
+  for(unsigned int i = 0; i < size / sizeof(*dirtyRects); ++i)
+    dxgi_addRect(rects, &count, &dirtyRects[i]);
+
+  damage_add(damage, rects, count);
+}
+
+// issue the copy from GPU to CPU RAM, only bringing the areas of the staging
+// texture that are out of date up to date
+// copy the captured region into the source texture and scale it, returns the
+// texture holding the result
+static ID3D11Texture2D * dxgi_recordSource(ID3D11DeviceContext * ctx,
+    ID3D11Texture2D * src)
+{
+  ID3D11Texture2D * copySrc = src;
+  if (this->srcTex)
+  {
+    if (this->cropped)
+    {
+      const D3D11_BOX box =
+      {
+        .left   = this->crop.x,
+        .top    = this->crop.y,
+        .front  = 0,
+        .right  = this->crop.x + this->crop.width,
+        .bottom = this->crop.y + this->crop.height,
+        .back   = 1
+      };
+      ID3D11DeviceContext_CopySubresourceRegion(ctx,
+        (ID3D11Resource *)this->srcTex, 0, 0, 0, 0,
+        (ID3D11Resource *)src, 0, &box);
+    }
+    else
+      ID3D11DeviceContext_CopyResource(ctx,
+        (ID3D11Resource *)this->srcTex, (ID3D11Resource *)src);
+    copySrc = this->srcTex;
+  }
+
+  if (this->scale)
+  {
+    scale_convert(this->scale, ctx, this->srcView);
+    copySrc = scale_getTexture(this->scale);
+  }
+
+  return copySrc;
+}
+
+static void dxgi_recordCopy(ID3D11DeviceContext * ctx, Texture * tex,
+    ID3D11Texture2D * src)
+{
+  ID3D11Texture2D * copySrc = dxgi_recordSource(ctx, src);
+  if (this->yuv)
+    yuv_convert(this->yuv, ctx, this->srcView, tex->tex);
+  else if (tex->texDamage.full)
+    ID3D11DeviceContext_CopyResource(ctx,
+      (ID3D11Resource *)tex->tex, (ID3D11Resource *)copySrc);
+  else
+    for(unsigned int i = 0; i < tex->texDamage.count; ++i)
+    {
+      const FrameDamageRect * r = &tex->texDamage.rects[i];
+      const D3D11_BOX box =
+      {
+        .left   = r->x,
+        .top    = r->y,
+        .front  = 0,
+        .right  = r->x + r->width,
+        .bottom = r->y + r->height,
+        .back   = 1
+      };
+
+      ID3D11DeviceContext_CopySubresourceRegion(ctx,
+        (ID3D11Resource *)tex->tex, 0, r->x, r->y, 0,
+        (ID3D11Resource *)copySrc, 0, &box);
+    }
+}
+
+// the video processor and encoder run on the immediate context, the access
+// unit is ready in memory before the texture is posted
+static bool dxgi_encodeFrame(Texture * tex, ID3D11Texture2D * src)
+{
+  const LGTraceScope trace = lgTraceBegin("encodeFrame");
+  LOCKED(
+  {
+    dxgi_recordSource(this->deviceContext, src);
+    encode_convert(this->encode);
+  });
+
+  const uint8_t * data;
+  size_t          size;
+  const bool ok = encode_process(this->encode, microtime(), &data, &size);
+  lgTraceEnd(trace);
+  if (!ok)
+    return false;
+
+  if (size > dxgi_getMaxFrameSize())
+  {
+    DEBUG_WARN("Dropping an oversized access unit of %zu bytes", size);
+    size = 0;
+  }
+
+  memcpy(tex->bits, data, size);
+  tex->bitsSize = size;
+  return true;
+}
+
+static bool dxgi_copyFrame(Texture * tex, ID3D11Texture2D * src)
+{
+  if (this->encode)
+    return dxgi_encodeFrame(tex, src);
+
+  HRESULT             status;
+  ID3D11CommandList * list  = NULL;
+  const LGTraceScope  trace = lgTraceBegin("copyFrame");
+
+  if (this->copyContext)
+  {
+    dxgi_recordCopy(this->copyContext, tex, src);
+    status = ID3D11DeviceContext_FinishCommandList(this->copyContext, FALSE, &list);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to finish the command list", status);
+      lgTraceEnd(trace);
+      return false;
+    }
+  }
+
+  LOCKED(
+  {
+    if (list)
+      ID3D11DeviceContext_ExecuteCommandList(this->deviceContext, list, FALSE);
+    else
+      dxgi_recordCopy(this->deviceContext, tex, src);
+
+    if (this->zeroCopy)
+      zerocopy_signal(this->zeroCopy, this->deviceContext, this->texWIndex);
+    else if (this->readback)
+      zerocopy_signal(this->readback, this->deviceContext, this->texWIndex);
+    else if (this->fence)
+    {
+      tex->fenceValue = ++this->fenceValue;
+      ID3D11DeviceContext4_Signal(this->deviceContext4, this->fence, tex->fenceValue);
+    }
+    else
+      ID3D11DeviceContext_End(this->deviceContext, (ID3D11Asynchronous *)tex->query);
+
+    ID3D11DeviceContext_Flush(this->deviceContext);
+  });
+
+  if (list)
+    ID3D11CommandList_Release(list);
+
+  // queued behind the copy on the GPU, the lock is not needed
+  if (this->readback &&
+      !zerocopy_submit(this->readback, this->texWIndex, tex->texDamage.rects,
+        tex->texDamage.full ? 0 : tex->texDamage.count))
+  {
+    lgTraceEnd(trace);
+    return false;
+  }
+
+  lgTraceEnd(trace);
+  return true;
+}
+
+static void dxgi_postTexture(Texture * tex, LONGLONG presentTime)
+{
+  // the texture is now current, and carries the damage since the prior
+  // frame that was sent
+  damage_reset(&tex->texDamage);
+  tex->frameDamage = this->pendingDamage;
+  damage_reset(&this->pendingDamage);
+
+  // set the state, and signal
+  tex->state     = TEXTURE_STATE_PENDING_MAP;
+  tex->formatVer = this->formatVer;
+  tex->presentTime = presentTime / (this->perfFreq.QuadPart / 1000000LL);
+  if (atomic_fetch_add_explicit(&this->texReady, 1, memory_order_relaxed) == 0)
+    lgSignalEvent(this->frameEvent);
+
+  // advance the write index
+  if (++this->texWIndex == this->maxTextures)
+    this->texWIndex = 0;
+
+  // update the last frame time
+  this->frameTime.QuadPart = presentTime;
+  this->lastCopyTime       = microtime();
+  this->held               = false;
+}
+
+// keep a GPU copy of a frame that was not sent so it is not lost if the
+// desktop stops updating before the next copy is allowed
+static bool dxgi_holdFrame(ID3D11Texture2D * src, LONGLONG presentTime)
+{
+  if (!this->holdTex)
+  {
+    D3D11_TEXTURE2D_DESC desc;
+    ID3D11Texture2D_GetDesc(src, &desc);
+    desc.Usage          = D3D11_USAGE_DEFAULT;
+    desc.BindFlags      = 0;
+    desc.CPUAccessFlags = 0;
+    desc.MiscFlags      = 0;
+
+    HRESULT status = ID3D11Device_CreateTexture2D(this->device, &desc, NULL,
+        &this->holdTex);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to create the hold texture", status);
+      return false;
+    }
+  }
+
+  LOCKED({
+    ID3D11DeviceContext_CopyResource(this->deviceContext,
+      (ID3D11Resource *)this->holdTex, (ID3D11Resource *)src);
+  });
+
+  this->held            = true;
+  this->heldPresentTime = presentTime;
+  return true;
+}
+
+// microseconds until the next copy is allowed, zero if it is allowed now
+static unsigned int dxgi_copyDelay()
+{
+  const unsigned int interval =
+    atomic_load_explicit(&this->frameInterval, memory_order_relaxed);
+  if (!interval)
+    return 0;
+
+  const uint64_t elapsed = microtime() - this->lastCopyTime;
+  return elapsed >= interval ? 0 : interval - elapsed;
+}
+
+// send the held frame once the client is ready for it
+static CaptureResult dxgi_flushHeld()
+{
+  if (!this->held || dxgi_copyDelay())
+    return CAPTURE_RESULT_TIMEOUT;
+
+  Texture * tex = &this->texture[this->texWIndex];
+  if (tex->state != TEXTURE_STATE_UNUSED)
+    return CAPTURE_RESULT_TIMEOUT;
+
+  if (!dxgi_copyFrame(tex, this->holdTex))
+    return CAPTURE_RESULT_ERROR;
+
+  dxgi_postTexture(tex, this->heldPresentTime);
+  return CAPTURE_RESULT_OK;
+}
+
+// the window either side of the predicted present counted as a hit
+static inline uint64_t dxgi_presentWindow(unsigned int interval)
+{
+  return max(1000U, interval / 8);
+}
+
+// the microtime the next present is predicted at, zero if unknown
+static uint64_t dxgi_presentDue(uint64_t now)
+{
+  const unsigned int interval =
+    atomic_load_explicit(&this->presentInterval, memory_order_relaxed);
+  if (!interval)
+    return 0;
+
+  // presents the guest skipped keep the same phase
+  uint64_t due = this->lastPresent + interval;
+  const uint64_t window = dxgi_presentWindow(interval);
+  if (now > due + window)
+    due += ((now - due - window) / interval + 1) * interval;
+
+  return due;
+}
+
+static void dxgi_updateCadence(LONGLONG presentTime)
+{
+  const uint64_t present = presentTime / (this->perfFreq.QuadPart / 1000000LL);
+  if (present <= this->lastPresent)
+    return;
+
+  const uint64_t elapsed = present - this->lastPresent;
+  const unsigned int interval =
+    atomic_load_explicit(&this->presentInterval, memory_order_relaxed);
+
+  if (!this->lastPresent || elapsed > CADENCE_RESET)
+    atomic_store_explicit(&this->presentInterval, 0, memory_order_relaxed);
+  else if (!interval)
+    atomic_store_explicit(&this->presentInterval, elapsed, memory_order_relaxed);
+  else
+  {
+    // the first due no earlier than the window before this present
+    const uint64_t due    = dxgi_presentDue(present);
+    const uint64_t window = dxgi_presentWindow(interval);
+    if (present + window >= due)
+      atomic_fetch_add_explicit(&this->presentHits  , 1, memory_order_relaxed);
+    else
+      atomic_fetch_add_explicit(&this->presentMisses, 1, memory_order_relaxed);
+
+    // skipped presents are a multiple of the interval, only average single
+    // intervals so the prediction follows the refresh rate the guest runs at
+    if (elapsed < interval * 3 / 2)
+      atomic_store_explicit(&this->presentInterval,
+          (interval * 7 + elapsed) / 8, memory_order_relaxed);
+  }
+
+  this->lastPresent = present;
+}
+
+// sleep between the polls of the acquire lock without holding the lock
+static void dxgi_acquireSleep()
+{
+  const uint64_t now = microtime();
+  const uint64_t due = dxgi_presentDue(now);
+  uint64_t sleep = ACQUIRE_SLEEP;
+
+  if (due)
+  {
+    if (now + ACQUIRE_MARGIN >= due)
+      sleep = ACQUIRE_POLL;
+    else
+      sleep = min(sleep, due - ACQUIRE_MARGIN - now);
+  }
+
+  // don't sleep past the time the held frame is due
+  if (this->held)
+    sleep = max((uint64_t)ACQUIRE_POLL, min(sleep, (uint64_t)dxgi_copyDelay()));
+
+  nsleep(sleep * 1000ULL);
+}
+
+static void dxgi_getStats(CaptureStats * stats)
+{
+  stats->presentInterval =
+    atomic_load_explicit(&this->presentInterval, memory_order_relaxed);
+  stats->presentHits     =
+    atomic_load_explicit(&this->presentHits    , memory_order_relaxed);
+  stats->presentMisses   =
+    atomic_load_explicit(&this->presentMisses  , memory_order_relaxed);
+}
+
+static CaptureResult dxgi_capture()
+{
+  assert(this);
+  assert(this->initialized);
+
+  Texture                 * tex;
+  CaptureResult             result;
+  HRESULT                   status;
+  DXGI_OUTDUPL_FRAME_INFO   frameInfo;
+  IDXGIResource           * res;
+
+  bool copyFrame   = false;
+  bool copyPointer = false;
+  ID3D11Texture2D * src;
+
+  bool           postPointer      = false;
+  CapturePointer pointer          = { 0 };
+
+  // release the prior frame
+  result = dxgi_releaseFrame();
+  if (result != CAPTURE_RESULT_OK)
+    return result;
+
+  // the client wants a different size or format, restart to rebuild the
+  // textures
+  if (atomic_load_explicit(&this->targetWidth    , memory_order_relaxed) != this->appliedWidth   ||
+      atomic_load_explicit(&this->targetHeight   , memory_order_relaxed) != this->appliedHeight  ||
+      atomic_load_explicit(&this->clientFormats  , memory_order_relaxed) != this->appliedFormats ||
+      atomic_load_explicit(&this->clientPreferred, memory_order_relaxed) != this->appliedPreferred ||
+      atomic_load_explicit(&this->adaptYUV420    , memory_order_relaxed) != this->appliedAdaptYUV420 ||
+      atomic_load_explicit(&this->cropX          , memory_order_relaxed) != this->appliedCrop.x    ||
+      atomic_load_explicit(&this->cropY          , memory_order_relaxed) != this->appliedCrop.y    ||
+      atomic_load_explicit(&this->cropWidth      , memory_order_relaxed) != this->appliedCrop.width ||
+      atomic_load_explicit(&this->cropHeight     , memory_order_relaxed) != this->appliedCrop.height)
+    return CAPTURE_RESULT_REINIT;
+
+  const LGTraceScope acquireTrace = lgTraceBegin("AcquireNextFrame");
+  if (this->useAcquireLock)
+  {
+    // the lock is only held for a poll that does not wait, the polls are
+    // scheduled around the guest's predicted present
+    LOCKED({
+        status = IDXGIOutputDuplication_AcquireNextFrame(this->dup, 0, &frameInfo, &res);
+    });
+
+    if (status == DXGI_ERROR_WAIT_TIMEOUT)
+      dxgi_acquireSleep();
+  }
+  else
+  {
+    // don't wait past the time the held frame is due
+    UINT timeout = 1000;
+    if (this->held)
+      timeout = max(1U, (dxgi_copyDelay() + 999) / 1000);
+    status = IDXGIOutputDuplication_AcquireNextFrame(this->dup, timeout, &frameInfo, &res);
+  }
+  lgTraceEnd(acquireTrace);
+
+  result = dxgi_hResultToCaptureResult(status);
+  if (result != CAPTURE_RESULT_OK)
+  {
+    if (result == CAPTURE_RESULT_ERROR)
+      DEBUG_WINERROR("AcquireNextFrame failed", status);
+    else if (result == CAPTURE_RESULT_TIMEOUT)
+      return dxgi_flushHeld();
+    return result;
+  }
+
+  this->needsRelease = true;
+
+  if (frameInfo.LastPresentTime.QuadPart != 0)
+  {
+    dxgi_updateCadence(frameInfo.LastPresentTime.QuadPart);
+
+    FrameDamage damage;
+    dxgi_getFrameDamage(&frameInfo, &damage);
+
+    // every staging texture and the next frame we send needs these changes,
+    // even if this frame is skipped below
+    damage_merge(&this->pendingDamage, &damage);
+    for(int i = 0; i < this->maxTextures; ++i)
+      damage_merge(&this->texture[i].texDamage, &damage);
+
+    tex = &this->texture[this->texWIndex];
+
+    status = IDXGIResource_QueryInterface(res, &IID_ID3D11Texture2D, (void **)&src);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to get the texture from the dxgi resource", status);
+      IDXGIResource_Release(res);
+      return CAPTURE_RESULT_ERROR;
+    }
+
+    // if the texture is free and the client wants another frame copy it now,
+    // otherwise hold it until then so the last change is never lost
+    if (tex->state == TEXTURE_STATE_UNUSED && !dxgi_copyDelay())
+      copyFrame = true;
+    else
+    {
+      const bool ok = dxgi_holdFrame(src, frameInfo.LastPresentTime.QuadPart);
+      ID3D11Texture2D_Release(src);
+      if (!ok)
+      {
+        IDXGIResource_Release(res);
+        return CAPTURE_RESULT_ERROR;
+      }
+    }
+  }
+
+  IDXGIResource_Release(res);
+
+  // if the pointer shape has changed
+  if (frameInfo.PointerShapeBufferSize > 0)
+  {
+    PointerShape * shape = this->shapeCapture;
+    if (shape->alloc < frameInfo.PointerShapeBufferSize)
+    {
+      uint8_t * data = realloc(shape->data, frameInfo.PointerShapeBufferSize);
+      if (!data)
+        DEBUG_ERROR("out of memory");
+      else
+      {
+        shape->data  = data;
+        shape->alloc = frameInfo.PointerShapeBufferSize;
+      }
+    }
+
+    copyPointer = shape->alloc >= frameInfo.PointerShapeBufferSize;
+  }
+
+  if (!copyFrame && this->held)
+  {
+    result = dxgi_flushHeld();
+    if (result == CAPTURE_RESULT_ERROR)
+      return result;
+  }
+
+  // the frame copy is issued first, the shape only has to be taken out of
+  // the duplication before the frame is released
+  if (copyFrame)
+  {
+    const bool ok = dxgi_copyFrame(tex, src);
+    ID3D11Texture2D_Release(src);
+    if (!ok)
+      return CAPTURE_RESULT_ERROR;
+
+    dxgi_postTexture(tex, frameInfo.LastPresentTime.QuadPart);
+  }
+
+  if (copyPointer)
+  {
+    PointerShape * shape = this->shapeCapture;
+    LOCKED({status = IDXGIOutputDuplication_GetFramePointerShape(
+        this->dup, shape->alloc, shape->data, &shape->size, &shape->info);});
+
+    result = dxgi_hResultToCaptureResult(status);
+    if (result != CAPTURE_RESULT_OK)
+    {
+      if (result == CAPTURE_RESULT_ERROR)
+        DEBUG_WINERROR("Failed to get the new pointer shape", status);
+      return result;
+    }
+
+    pointer.shapeUpdate = true;
+    postPointer         = true;
+  }
+
+  if (frameInfo.LastMouseUpdateTime.QuadPart)
+  {
+    /* the pointer position is only valid if the pointer is visible */
+    if (frameInfo.PointerPosition.Visible &&
+      (frameInfo.PointerPosition.Position.x != this->lastPointerX ||
+       frameInfo.PointerPosition.Position.y != this->lastPointerY))
+    {
+      pointer.positionUpdate = true;
+      this->lastPointerX = frameInfo.PointerPosition.Position.x;
+      this->lastPointerY = frameInfo.PointerPosition.Position.y;
+      pointer.x   = this->lastPointerX - (int)this->crop.x;
+      pointer.y   = this->lastPointerY - (int)this->crop.y;
+      postPointer = true;
+    }
+
+    if (this->lastPointerVisible != frameInfo.PointerPosition.Visible)
+    {
+      this->lastPointerVisible = frameInfo.PointerPosition.Visible;
+      postPointer = true;
+    }
+  }
+
+  // hand the pointer to its thread, updates it has not taken yet are merged
+  // as only the newest shape and position matter
+  if (postPointer)
+  {
+    LG_LOCK(this->pointerLock);
+    if (pointer.shapeUpdate)
+    {
+      PointerShape * shape = this->shapePending;
+      this->shapePending   = this->shapeCapture;
+      this->shapeCapture   = shape;
+      this->pendingShape   = true;
+    }
+
+    if (pointer.positionUpdate)
+    {
+      this->pendingPosition = true;
+      this->pendingX        = pointer.x;
+      this->pendingY        = pointer.y;
+    }
+
+    this->pendingVisible = this->lastPointerVisible;
+    this->pendingPost    = true;
+    LG_UNLOCK(this->pointerLock);
+
+    lgSignalEvent(this->pointerEvent);
+  }
+
+  return CAPTURE_RESULT_OK;
+}
+
+// convert the shape into a pointer buffer for the client
+static bool dxgi_convertShape(const PointerShape * shape,
+    CapturePointer * pointer)
+{
+  switch(shape->info.Type)
   {
-    ID3D11Device_Release(this->device);
-    this->device = NULL;
+    case DXGI_OUTDUPL_POINTER_SHAPE_TYPE_COLOR       : pointer->format = CAPTURE_FMT_COLOR ; break;
+    case DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MASKED_COLOR: pointer->format = CAPTURE_FMT_MASKED; break;
+    case DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MONOCHROME  : pointer->format = CAPTURE_FMT_MONO  ; break;
+    default:
+      DEBUG_ERROR("Unsupported cursor format");
+      return false;
   }
 
-  if (this->adapter)
+  void   * data;
+  uint32_t size;
+  if (!this->getPointerBufferFn(&data, &size))
   {
-    IDXGIAdapter1_Release(this->adapter);
-    this->adapter = NULL;
+    DEBUG_WARN("Failed to obtain a buffer for the pointer shape");
+    return false;
   }
 
-  if (this->factory)
+  if (shape->size > size)
   {
-    // if this doesn't free we have a memory leak
-    DWORD count = IDXGIFactory1_Release(this->factory);
-    this->factory = NULL;
-    if (count != 0)
-    {
-      DEBUG_ERROR("Factory release is %lu, there is a memory leak!", count);
-      return false;
-    }
+    DEBUG_WARN("The pointer shape is larger than the pointer buffer");
+    return false;
   }
+  memcpy(data, shape->data, shape->size);
 
-  LG_LOCK_FREE(this->deviceContextLock);
+  CURSORINFO ci = { .cbSize = sizeof(CURSORINFO) };
+  ICONINFO ii;
+  if (GetCursorInfo(&ci) && ci.hCursor && GetIconInfo(ci.hCursor, &ii))
+  {
+    DeleteObject(ii.hbmMask);
+    DeleteObject(ii.hbmColor);
 
-  if (this->desktop)
+    pointer->hx = ii.xHotspot;
+    pointer->hy = ii.yHotspot;
+  }
+  else
   {
-    CloseDesktop(this->desktop);
-    this->desktop = NULL;
+    pointer->hx = 0;
+    pointer->hy = 0;
   }
 
-  this->initialized = false;
+  pointer->shapeUpdate = true;
+  pointer->width       = shape->info.Width;
+  pointer->height      = shape->info.Height;
+  pointer->pitch       = shape->info.Pitch;
   return true;
 }
 
-static void dxgi_free()
+static int dxgi_pointerThread(void * unused)
 {
-  assert(this);
+  // the hotspot is read from the desktop that is being captured
+  if (this->desktop)
+    SetThreadDesktop(this->desktop);
 
-  if (this->initialized)
-    dxgi_deinit();
+  while(this->pointerRunning)
+  {
+    if (!lgWaitEvent(this->pointerEvent, 1000))
+      continue;
 
-  free(this->texture);
+    CapturePointer pointer = { 0 };
+    bool           shape;
 
-  free(this);
-  this = NULL;
-}
+    LG_LOCK(this->pointerLock);
+    if (!this->pendingPost)
+    {
+      LG_UNLOCK(this->pointerLock);
+      continue;
+    }
 
-static unsigned int dxgi_getMaxFrameSize()
-{
-  assert(this);
-  assert(this->initialized);
+    shape = this->pendingShape;
+    if (shape)
+    {
+      PointerShape * tmp = this->shapeThread;
+      this->shapeThread  = this->shapePending;
+      this->shapePending = tmp;
+    }
+
+    pointer.positionUpdate = this->pendingPosition;
+    pointer.x              = this->pendingX;
+    pointer.y              = this->pendingY;
+    pointer.visible        = this->pendingVisible;
+
+    this->pendingPost     = false;
+    this->pendingShape    = false;
+    this->pendingPosition = false;
+    LG_UNLOCK(this->pointerLock);
+
+    if (shape && !dxgi_convertShape(this->shapeThread, &pointer))
+      pointer.shapeUpdate = false;
+
+    this->postPointerBufferFn(pointer);
+  }
 
-  return this->height * this->pitch;
+  return 0;
 }
 
-static CaptureResult dxgi_hResultToCaptureResult(const HRESULT status)
+// wait for the GPU to finish copying into the texture so the map can't stall
+static CaptureResult dxgi_waitTexture(Texture * tex)
 {
-  switch(status)
+  if (this->fence)
   {
-    case S_OK:
+    // the fence is free threaded, the device context is not needed to wait on it
+    if (ID3D11Fence_GetCompletedValue(this->fence) >= tex->fenceValue)
       return CAPTURE_RESULT_OK;
 
-    case DXGI_ERROR_WAIT_TIMEOUT:
-      return CAPTURE_RESULT_TIMEOUT;
+    HRESULT status = ID3D11Fence_SetEventOnCompletion(this->fence,
+        tex->fenceValue, this->fenceEvent);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to set the fence event", status);
+      return CAPTURE_RESULT_ERROR;
+    }
 
-    case WAIT_ABANDONED:
-    case DXGI_ERROR_ACCESS_LOST:
-      return CAPTURE_RESULT_REINIT;
+    switch(WaitForSingleObject(this->fenceEvent, 1000))
+    {
+      case WAIT_OBJECT_0:
+        return CAPTURE_RESULT_OK;
 
-    default:
-      return CAPTURE_RESULT_ERROR;
+      case WAIT_TIMEOUT:
+        return CAPTURE_RESULT_TIMEOUT;
+
+      default:
+        DEBUG_WINERROR("Failed to wait on the fence event", GetLastError());
+        return CAPTURE_RESULT_ERROR;
+    }
   }
-}
 
-static CaptureResult dxgi_capture()
-{
-  assert(this);
-  assert(this->initialized);
+  // queries must be polled through the context, but unlike a failed map this
+  // only holds the lock for a moment each time
+  for(int i = 0; ; ++i)
+  {
+    HRESULT status;
+    LOCKED({status = ID3D11DeviceContext_GetData(this->deviceContext,
+        (ID3D11Asynchronous *)tex->query, NULL, 0,
+        D3D11_ASYNC_GETDATA_DONOTFLUSH);});
 
-  Texture                 * tex;
-  CaptureResult             result;
-  HRESULT                   status;
-  DXGI_OUTDUPL_FRAME_INFO   frameInfo;
-  IDXGIResource           * res;
+    if (status == S_OK)
+      return CAPTURE_RESULT_OK;
 
-  bool copyFrame   = false;
-  bool copyPointer = false;
-  ID3D11Texture2D * src;
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to get the query data", status);
+      return CAPTURE_RESULT_ERROR;
+    }
 
-  bool           postPointer      = false;
-  CapturePointer pointer          = { 0 };
-  void *         pointerShape     = NULL;
-  UINT           pointerShapeSize = 0;
+    if (i == 1000)
+      return CAPTURE_RESULT_TIMEOUT;
 
-  // release the prior frame
-  result = dxgi_releaseFrame();
-  if (result != CAPTURE_RESULT_OK)
-    return result;
+    if (i < 100)
+      YieldProcessor();
+    else
+      nsleep(1000);
+  }
+}
 
-  if (this->useAcquireLock)
+static uint64_t dxgi_hashTile(const uint8_t * data, unsigned int tx,
+    unsigned int ty)
+{
+  const unsigned int left   = tx * DEDUP_TILE_SIZE;
+  const unsigned int top    = ty * DEDUP_TILE_SIZE;
+  const unsigned int bytes  = min(DEDUP_TILE_SIZE, this->outWidth  - left) *
+    this->bpp;
+  const unsigned int height = min(DEDUP_TILE_SIZE, this->outHeight - top );
+
+  // FNV-1a over 64-bit words in four lanes so the multiplies can overlap
+  uint64_t h[4] =
   {
-    LOCKED({
-        status = IDXGIOutputDuplication_AcquireNextFrame(this->dup, 1, &frameInfo, &res);
-    });
-  }
-  else
-    status = IDXGIOutputDuplication_AcquireNextFrame(this->dup, 1000, &frameInfo, &res);
+    0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL,
+    0x9e3779b97f4a7c15ULL, 0x7f4a7c159e3779b9ULL
+  };
 
-  result = dxgi_hResultToCaptureResult(status);
-  if (result != CAPTURE_RESULT_OK)
+  for(unsigned int y = 0; y < height; ++y)
   {
-    if (result == CAPTURE_RESULT_ERROR)
-      DEBUG_WINERROR("AcquireNextFrame failed", status);
-    return result;
+    const uint8_t * row = data + (top + y) * this->pitch + left * this->bpp;
+    unsigned int    i   = 0;
+
+    for(; i + 32 <= bytes; i += 32)
+    {
+      const uint64_t * w = (const uint64_t *)(row + i);
+      h[0] = (h[0] ^ w[0]) * DEDUP_FNV_PRIME;
+      h[1] = (h[1] ^ w[1]) * DEDUP_FNV_PRIME;
+      h[2] = (h[2] ^ w[2]) * DEDUP_FNV_PRIME;
+      h[3] = (h[3] ^ w[3]) * DEDUP_FNV_PRIME;
+    }
+
+    for(; i + 4 <= bytes; i += 4)
+      h[0] = (h[0] ^ *(const uint32_t *)(row + i)) * DEDUP_FNV_PRIME;
   }
 
-  this->needsRelease = true;
+  uint64_t hash = h[0];
+  for(int i = 1; i < 4; ++i)
+    hash = (hash ^ h[i]) * DEDUP_FNV_PRIME;
 
-  if (frameInfo.LastPresentTime.QuadPart != 0)
+  // zero is reserved for tiles that are not known
+  return hash | 1;
+}
+
+static void dxgi_addTileRun(FrameDamage * damage, unsigned int start,
+    unsigned int end, unsigned int ty)
+{
+  const unsigned int x = start * DEDUP_TILE_SIZE;
+  const unsigned int y = ty    * DEDUP_TILE_SIZE;
+  const FrameDamageRect rect =
   {
-    tex = &this->texture[this->texWIndex];
+    .x      = x,
+    .y      = y,
+    .width  = min(end * DEDUP_TILE_SIZE, this->outWidth) - x,
+    .height = min(DEDUP_TILE_SIZE, this->outHeight - y)
+  };
+  damage_add(damage, &rect, 1);
+}
+
+/**
+ * compare the mapped frame against the last frame sent, returns false if it is
+ * identical. When DXGI could only report full damage the damage is narrowed to
+ * the tiles that actually changed.
+ */
+static bool dxgi_dedupFrame(Texture * tex)
+{
+  if (tex->formatVer != this->tileFormatVer)
+  {
+    this->tilesX = (this->outWidth  + DEDUP_TILE_SIZE - 1) / DEDUP_TILE_SIZE;
+    this->tilesY = (this->outHeight + DEDUP_TILE_SIZE - 1) / DEDUP_TILE_SIZE;
 
-    // check if the texture is free, if not skip the frame to keep up
-    if (tex->state == TEXTURE_STATE_UNUSED)
+    free(this->tileHash);
+    this->tileHash = calloc(sizeof(*this->tileHash),
+        this->tilesX * this->tilesY);
+    if (!this->tileHash)
     {
-      copyFrame = true;
-      status = IDXGIResource_QueryInterface(res, &IID_ID3D11Texture2D, (void **)&src);
-      if (FAILED(status))
-      {
-        DEBUG_WINERROR("Failed to get the texture from the dxgi resource", status);
-        IDXGIResource_Release(res);
-        return CAPTURE_RESULT_ERROR;
-      }
+      DEBUG_ERROR("Failed to allocate the tile hashes, dedup disabled");
+      this->useDedup = false;
+      return true;
     }
+
+    this->tileFormatVer = tex->formatVer;
   }
 
-  IDXGIResource_Release(res);
+  FrameDamage   * damage = &tex->frameDamage;
+  const uint8_t * data   = (const uint8_t *)tex->map.pData;
 
-  // if the pointer shape has changed
-  uint32_t bufferSize;
-  if (frameInfo.PointerShapeBufferSize > 0)
+  // only the damaged tiles can differ from the last frame sent
+  if (!damage->full)
   {
-    if(!this->getPointerBufferFn(&pointerShape, &bufferSize))
-      DEBUG_WARN("Failed to obtain a buffer for the pointer shape");
-    else
-      copyPointer = true;
+    bool changed = false;
+    for(unsigned int i = 0; i < damage->count; ++i)
+    {
+      const FrameDamageRect * r = &damage->rects[i];
+      const unsigned int x1 = (r->x + r->width  - 1) / DEDUP_TILE_SIZE;
+      const unsigned int y1 = (r->y + r->height - 1) / DEDUP_TILE_SIZE;
+
+      for(unsigned int ty = r->y / DEDUP_TILE_SIZE; ty <= y1; ++ty)
+        for(unsigned int tx = r->x / DEDUP_TILE_SIZE; tx <= x1; ++tx)
+        {
+          uint64_t     * stored = &this->tileHash[ty * this->tilesX + tx];
+          const uint64_t hash   = dxgi_hashTile(data, tx, ty);
+          if (hash != *stored)
+          {
+            *stored = hash;
+            changed = true;
+          }
+        }
+    }
+    return changed;
   }
 
-  if (copyFrame || copyPointer)
+  // hash every tile, but once enough has changed that the damage would not be
+  // worth narrowing stop reading and leave the rest to be checked next time
+  const unsigned int limit   = this->tilesX * this->tilesY / 8;
+  unsigned int       changed = 0;
+  bool               abort   = false;
+  FrameDamage        refined;
+  damage_reset(&refined);
+
+  for(unsigned int ty = 0; ty < this->tilesY; ++ty)
   {
-    DXGI_OUTDUPL_POINTER_SHAPE_INFO shapeInfo;
-    LOCKED(
+    int runStart = -1;
+    for(unsigned int tx = 0; tx < this->tilesX; ++tx)
     {
-      if (copyFrame)
+      uint64_t * stored = &this->tileHash[ty * this->tilesX + tx];
+      if (abort)
       {
-        // issue the copy from GPU to CPU RAM
-        ID3D11DeviceContext_CopyResource(this->deviceContext,
-          (ID3D11Resource *)tex->tex, (ID3D11Resource *)src);
+        *stored = 0;
+        continue;
       }
 
-      if (copyPointer)
+      const uint64_t hash = dxgi_hashTile(data, tx, ty);
+      if (hash == *stored)
       {
-        // grab the pointer shape
-        status = IDXGIOutputDuplication_GetFramePointerShape(
-            this->dup, bufferSize, pointerShape, &pointerShapeSize, &shapeInfo);
+        if (runStart >= 0)
+        {
+          dxgi_addTileRun(&refined, runStart, tx, ty);
+          runStart = -1;
+        }
+        continue;
       }
 
-      ID3D11DeviceContext_Flush(this->deviceContext);
-    });
+      *stored = hash;
+      ++changed;
+      if (runStart < 0)
+        runStart = tx;
+    }
 
-    if (copyFrame)
-    {
-      ID3D11Texture2D_Release(src);
+    if (abort)
+      continue;
 
-      // set the state, and signal
-      tex->state     = TEXTURE_STATE_PENDING_MAP;
-      tex->formatVer = this->formatVer;
-      if (atomic_fetch_add_explicit(&this->texReady, 1, memory_order_relaxed) == 0)
-        lgSignalEvent(this->frameEvent);
+    if (runStart >= 0)
+      dxgi_addTileRun(&refined, runStart, this->tilesX, ty);
 
-      // advance the write index
-      if (++this->texWIndex == this->maxTextures)
-        this->texWIndex = 0;
+    abort = refined.full || changed > limit;
+  }
 
-      // update the last frame time
-      this->frameTime.QuadPart = frameInfo.LastPresentTime.QuadPart;
-    }
+  if (changed == 0)
+    return false;
 
-    if (copyPointer)
-    {
-      result = dxgi_hResultToCaptureResult(status);
-      if (result != CAPTURE_RESULT_OK)
-      {
-        if (result == CAPTURE_RESULT_ERROR)
-          DEBUG_WINERROR("Failed to get the new pointer shape", status);
-        return result;
-      }
+  if (!abort)
+    *damage = refined;
 
-      switch(shapeInfo.Type)
-      {
-        case DXGI_OUTDUPL_POINTER_SHAPE_TYPE_COLOR       : pointer.format = CAPTURE_FMT_COLOR ; break;
-        case DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MASKED_COLOR: pointer.format = CAPTURE_FMT_MASKED; break;
-        case DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MONOCHROME  : pointer.format = CAPTURE_FMT_MONO  ; break;
-        default:
-          DEBUG_ERROR("Unsupported cursor format");
-          return CAPTURE_RESULT_ERROR;
-      }
+  return true;
+}
 
-      CURSORINFO ci = { .cbSize = sizeof(CURSORINFO) };
-      ICONINFO ii;
-      if (GetCursorInfo(&ci) && ci.hCursor && GetIconInfo(ci.hCursor, &ii))
-      {
-        DeleteObject(ii.hbmMask);
-        DeleteObject(ii.hbmColor);
+// the share of the frame the damage covers, the rects may overlap
+static double dxgi_damageArea(const FrameDamage * damage)
+{
+  if (damage->full)
+    return 1.0;
 
-        pointer.hx = ii.xHotspot;
-        pointer.hy = ii.yHotspot;
-      }
-      else
-      {
-        pointer.hx = 0;
-        pointer.hy = 0;
-      }
+  uint64_t area = 0;
+  for(unsigned int i = 0; i < damage->count; ++i)
+    area += (uint64_t)damage->rects[i].width * damage->rects[i].height;
 
-      pointer.shapeUpdate = true;
-      pointer.width       = shapeInfo.Width;
-      pointer.height      = shapeInfo.Height;
-      pointer.pitch       = shapeInfo.Pitch;
-      postPointer         = true;
-    }
+  return min(1.0, (double)area / ((uint64_t)this->outWidth * this->outHeight));
+}
+
+// account a frame that was sent, and at the end of each window decide which
+// format the next init should use, cost is the time the wait, map and write
+// of the frame took
+static void dxgi_adaptFrame(const Texture * tex, uint64_t now, uint64_t cost,
+    bool whole)
+{
+  // only 8-bit frames can be converted, and the client must show YUV420
+  const bool canConvert = !this->encode &&
+    (this->format == CAPTURE_FMT_BGRA || this->format == CAPTURE_FMT_RGBA ||
+     this->format == CAPTURE_FMT_YUV420) &&
+    (!this->appliedFormats ||
+     (this->appliedFormats & (1U << CAPTURE_FMT_YUV420)));
+
+  if (!this->useAdaptive || !canConvert || this->useYUV420 ||
+      this->appliedPreferred == CAPTURE_FMT_YUV420)
+    return;
+
+  if (!this->adaptStart)
+    this->adaptStart = now;
+
+  const double damaged = dxgi_damageArea(&tex->frameDamage);
+  ++this->adaptFrames;
+  this->adaptArea += damaged;
+
+  // the cost of a few rects is mostly overhead and says little of the time a
+  // full frame takes, larger damage is scaled up to the whole frame
+  if (whole || damaged >= 0.1)
+  {
+    this->adaptCost += whole ? cost : (uint64_t)(cost / damaged);
+    ++this->adaptCostFrames;
   }
 
-  if (frameInfo.LastMouseUpdateTime.QuadPart)
+  const uint64_t elapsed = now - this->adaptStart;
+  if (elapsed < ADAPT_WINDOW)
+    return;
+
+  // the budget is the client's frame rate limit, or the guest's cadence
+  unsigned int budget =
+    atomic_load_explicit(&this->frameInterval, memory_order_relaxed);
+  if (!budget)
+    budget = atomic_load_explicit(&this->presentInterval, memory_order_relaxed);
+  if (!budget)
+    budget = 16667;
+
+  const double fps   = this->adaptFrames * 1e6 / elapsed;
+  const double area  = this->adaptArea / this->adaptFrames;
+  const bool   video = area >= ADAPT_VIDEO_AREA && fps >= ADAPT_VIDEO_FPS;
+
+  // YUV420 frames are 1.5 bytes per pixel, scale to what BGRA would cost
+  double bgraCost = -1.0;
+  if (this->adaptCostFrames)
   {
-    /* the pointer position is only valid if the pointer is visible */
-    if (frameInfo.PointerPosition.Visible &&
-      (frameInfo.PointerPosition.Position.x != this->lastPointerX ||
-       frameInfo.PointerPosition.Position.y != this->lastPointerY))
-    {
-      pointer.positionUpdate = true;
-      pointer.x =
-        this->lastPointerX =
-        frameInfo.PointerPosition.Position.x;
-      pointer.y =
-        this->lastPointerY =
-        frameInfo.PointerPosition.Position.y;
-      postPointer = true;
-    }
+    bgraCost = (double)this->adaptCost / this->adaptCostFrames;
+    if (this->appliedAdaptYUV420)
+      bgraCost *= 4.0 / 1.5;
+  }
 
-    if (this->lastPointerVisible != frameInfo.PointerPosition.Visible)
-    {
-      this->lastPointerVisible = frameInfo.PointerPosition.Visible;
-      postPointer = true;
-    }
+  bool want = this->appliedAdaptYUV420;
+  if (!video)
+    want = false;
+  else if (bgraCost >= 0.0)
+  {
+    if (bgraCost > budget * ADAPT_HIGH)
+      want = true;
+    else if (bgraCost < budget * ADAPT_LOW)
+      want = false;
   }
 
-  // post back the pointer information
-  if (postPointer)
+  this->adaptStart      = now;
+  this->adaptFrames     = 0;
+  this->adaptCostFrames = 0;
+  this->adaptCost       = 0;
+  this->adaptArea       = 0.0;
+
+  if (want == this->appliedAdaptYUV420)
   {
-    pointer.visible = this->lastPointerVisible;
-    this->postPointerBufferFn(pointer);
+    this->adaptAgree = 0;
+    return;
   }
 
-  return CAPTURE_RESULT_OK;
+  // dampen the switch so the format does not flap with the content
+  if (++this->adaptAgree < ADAPT_HOLD ||
+      (this->adaptSwitch && now - this->adaptSwitch < ADAPT_DWELL))
+    return;
+
+  DEBUG_INFO("Adaptive format  : %s (%.0f%% damaged at %.1f fps, a full BGRA "
+      "frame takes %.0f of %u us)", want ? "YUV420" : "BGRA", area * 100.0,
+      fps, bgraCost, budget);
+
+  this->adaptAgree  = 0;
+  this->adaptSwitch = now;
+  atomic_store(&this->adaptYUV420, want);
 }
 
 static CaptureResult dxgi_waitFrame(CaptureFrame * frame)
@@ -916,9 +2537,33 @@ static CaptureResult dxgi_waitFrame(CaptureFrame * frame)
   }
 
   Texture * tex = &this->texture[this->texRIndex];
+  this->adaptWait = microtime();
+
+  // with zero copy there is nothing to map as the GPU writes the frame in
+  // getFrame, an encoded frame is already in memory, a D3D12 readback is
+  // mapped for its life, otherwise wait for the copy to complete before
+  // mapping
+  if (this->readback)
+  {
+    const LGTraceScope trace = lgTraceBegin("waitReadback");
+    const bool ok = zerocopy_wait(this->readback, this->texRIndex, &tex->map.pData);
+    lgTraceEnd(trace);
+    if (!ok)
+      return CAPTURE_RESULT_ERROR;
+
+    tex->map.RowPitch = this->pitch;
+  }
+  else if (!this->zeroCopy && !this->encode)
+  {
+    const LGTraceScope trace = lgTraceBegin("waitTexture");
+    CaptureResult result = dxgi_waitTexture(tex);
+    lgTraceEnd(trace);
+    if (result != CAPTURE_RESULT_OK)
+      return result;
+  }
 
-  // try to map the resource, but don't wait for it
-  for (int i = 0; ; ++i)
+  // the copy is complete, the map should not have to wait
+  for (int i = 0; !this->zeroCopy && !this->encode && !this->readback; ++i)
   {
     HRESULT status;
     LOCKED({status = ID3D11DeviceContext_Map(this->deviceContext, (ID3D11Resource*)tex->tex, 0, D3D11_MAP_READ, 0x100000L, &tex->map);});
@@ -927,7 +2572,7 @@ static CaptureResult dxgi_waitFrame(CaptureFrame * frame)
       if (i == 100)
         return CAPTURE_RESULT_TIMEOUT;
 
-      usleep(1);
+      nsleep(1000);
       continue;
     }
 
@@ -940,28 +2585,98 @@ static CaptureResult dxgi_waitFrame(CaptureFrame * frame)
     break;
   }
 
+  // the planes are not addressable by tile and zero copy has nothing mapped,
+  // the encoder may also have held the frame back to produce it later
+  if (this->encode ? !tex->bitsSize :
+      this->useDedup && !this->yuv && !this->zeroCopy && !dxgi_dedupFrame(tex))
+  {
+    // the frame is identical to the last one sent, release it unposted
+    if (!this->encode && !this->readback)
+    {
+      LOCKED({ID3D11DeviceContext_Unmap(this->deviceContext, (ID3D11Resource*)tex->tex, 0);});
+    }
+    tex->state = TEXTURE_STATE_UNUSED;
+
+    if (++this->texRIndex == this->maxTextures)
+      this->texRIndex = 0;
+
+    atomic_fetch_sub_explicit(&this->texReady, 1, memory_order_release);
+    return CAPTURE_RESULT_TIMEOUT;
+  }
+
   tex->state = TEXTURE_STATE_MAPPED;
 
-  frame->formatVer = tex->formatVer;
-  frame->width     = this->width;
-  frame->height    = this->height;
-  frame->pitch     = this->pitch;
-  frame->stride    = this->stride;
-  frame->format    = this->format;
+  frame->formatVer    = tex->formatVer;
+  frame->width        = this->outWidth;
+  frame->height       = this->outHeight;
+  frame->screenWidth  = this->width;
+  frame->screenHeight = this->height;
+  frame->pitch        = this->encode ? tex->bitsSize : this->pitch;
+  frame->stride       = this->stride;
+  frame->format       = this->format;
+  frame->presentTime  = tex->presentTime;
+
+  // the planes and bitstream are not addressable by rect, always send the
+  // whole frame
+  if (this->yuv || this->encode || tex->frameDamage.full)
+    frame->damageRectsCount = 0;
+  else
+  {
+    frame->damageRectsCount = tex->frameDamage.count;
+    memcpy(frame->damageRects, tex->frameDamage.rects,
+        tex->frameDamage.count * sizeof(FrameDamageRect));
+  }
 
   atomic_fetch_sub_explicit(&this->texReady, 1, memory_order_release);
   return CAPTURE_RESULT_OK;
 }
 
-static CaptureResult dxgi_getFrame(FrameBuffer * frame)
+static CaptureResult dxgi_getFrame(FrameBuffer * frame,
+    const FrameDamageRect * rects, unsigned int rectsCount)
 {
   assert(this);
   assert(this->initialized);
 
   Texture * tex = &this->texture[this->texRIndex];
 
-  framebuffer_write(frame, tex->map.pData, this->pitch * this->height);
-  LOCKED({ID3D11DeviceContext_Unmap(this->deviceContext, (ID3D11Resource*)tex->tex, 0);});
+  if (this->zeroCopy)
+  {
+    // the reader can only see the frame once the GPU copy has completed
+    if (!zerocopy_copy(this->zeroCopy, this->texRIndex,
+          framebuffer_get_write_data(frame), rects, rectsCount))
+      return CAPTURE_RESULT_ERROR;
+
+    framebuffer_set_write_ptr(frame, this->pitch * this->outHeight);
+
+    const uint64_t now = microtime();
+    dxgi_adaptFrame(tex, now, now - this->adaptWait, rectsCount == 0);
+
+    tex->state = TEXTURE_STATE_UNUSED;
+    if (++this->texRIndex == this->maxTextures)
+      this->texRIndex = 0;
+
+    return CAPTURE_RESULT_OK;
+  }
+
+  if (this->encode)
+    framebuffer_write(frame, tex->bits, tex->bitsSize);
+  else if (this->yuv)
+    framebuffer_write(frame, tex->map.pData, this->pitch * this->outHeight * 3 / 2);
+  else if (rectsCount == 0)
+    framebuffer_write(frame, tex->map.pData, this->pitch * this->outHeight);
+  else
+    framebuffer_write_rects(frame, tex->map.pData, this->pitch, this->outHeight,
+        this->bpp, rects, rectsCount);
+
+  if (!this->encode && !this->readback)
+  {
+    LOCKED({ID3D11DeviceContext_Unmap(this->deviceContext, (ID3D11Resource*)tex->tex, 0);});
+  }
+
+  const uint64_t now = microtime();
+  dxgi_adaptFrame(tex, now, now - this->adaptWait,
+      this->yuv || this->encode || rectsCount == 0);
+
   tex->state = TEXTURE_STATE_UNUSED;
 
   if (++this->texRIndex == this->maxTextures)
@@ -970,6 +2685,43 @@ static CaptureResult dxgi_getFrame(FrameBuffer * frame)
   return CAPTURE_RESULT_OK;
 }
 
+static void dxgi_setTargetSize(unsigned int width, unsigned int height)
+{
+  assert(this);
+  atomic_store(&this->targetWidth , width );
+  atomic_store(&this->targetHeight, height);
+}
+
+static void dxgi_setCrop(CaptureRect crop)
+{
+  assert(this);
+  atomic_store(&this->cropX     , crop.x     );
+  atomic_store(&this->cropY     , crop.y     );
+  atomic_store(&this->cropWidth , crop.width );
+  atomic_store(&this->cropHeight, crop.height);
+}
+
+static void dxgi_setFormats(unsigned int formats, CaptureFormat preferred)
+{
+  assert(this);
+  atomic_store(&this->clientFormats  , formats  );
+  atomic_store(&this->clientPreferred, preferred);
+}
+
+static void dxgi_setFrameRate(unsigned int maxFPS)
+{
+  assert(this);
+
+  // allow a little jitter so a source running at the limit is not halved
+  unsigned int interval = 0;
+  if (maxFPS)
+  {
+    interval  = 1000000 / maxFPS;
+    interval -= interval / 16;
+  }
+  atomic_store(&this->frameInterval, interval);
+}
+
 static CaptureResult dxgi_releaseFrame()
 {
   assert(this);
@@ -1003,17 +2755,30 @@ static CaptureResult dxgi_releaseFrame()
   return CAPTURE_RESULT_OK;
 }
 
+static void dxgi_wakeFrame()
+{
+  assert(this);
+  lgSignalEvent(this->frameEvent);
+}
+
 struct CaptureInterface Capture_DXGI =
 {
   .getName         = dxgi_getName,
   .initOptions     = dxgi_initOptions,
   .create          = dxgi_create,
   .init            = dxgi_init,
+  .reinit          = dxgi_reinit,
   .stop            = dxgi_stop,
   .deinit          = dxgi_deinit,
   .free            = dxgi_free,
   .getMaxFrameSize = dxgi_getMaxFrameSize,
   .capture         = dxgi_capture,
   .waitFrame       = dxgi_waitFrame,
-  .getFrame        = dxgi_getFrame
+  .getFrame        = dxgi_getFrame,
+  .setTargetSize   = dxgi_setTargetSize,
+  .setCrop         = dxgi_setCrop,
+  .setFormats      = dxgi_setFormats,
+  .setFrameRate    = dxgi_setFrameRate,
+  .getStats        = dxgi_getStats,
+  .wakeFrame       = dxgi_wakeFrame
 };
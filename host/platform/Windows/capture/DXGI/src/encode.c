@@ -0,0 +1,714 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "encode.h"
+#include "common/debug.h"
+#include "common/windebug.h"
+#include "common/time.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <d3d10.h>
+#include <mfapi.h>
+#include <mfidl.h>
+#include <mferror.h>
+#include <mftransform.h>
+#include <codecapi.h>
+
+// the nominal rate given to the encoder for rate control, the frames are
+// sent as the desktop changes so this is only used to size the bitrate
+#define ENCODE_FPS 60
+
+// how long to wait on the encoder for a frame before giving up
+#define ENCODE_TIMEOUT 1000
+
+struct Encode
+{
+  unsigned int                     width, height;
+  bool                             started;
+
+  ID3D11VideoDevice              * videoDevice;
+  ID3D11VideoContext             * videoContext;
+  ID3D11VideoProcessorEnumerator * vpEnum;
+  ID3D11VideoProcessor           * vp;
+  ID3D11VideoProcessorInputView  * inView;
+  ID3D11VideoProcessorOutputView * outView;
+  ID3D11Texture2D                * nv12;
+
+  UINT                             token;
+  IMFDXGIDeviceManager           * devManager;
+  IMFTransform                   * mft;
+  IMFMediaEventGenerator         * events;
+  DWORD                            inID, outID;
+  bool                             providesSamples;
+  DWORD                            outSize;
+
+  // input requests from the encoder that have not been answered
+  unsigned int                     needInput;
+
+  uint8_t                        * bits;
+  size_t                           bitsSize;
+};
+
+#define RELEASE(type, x) if (x) { type##_Release(x); x = NULL; }
+
+static bool encode_createProcessor(Encode * this, ID3D11Device * device,
+    ID3D11DeviceContext * context, ID3D11Texture2D * src)
+{
+  HRESULT status;
+  D3D11_TEXTURE2D_DESC srcDesc;
+  ID3D11Texture2D_GetDesc(src, &srcDesc);
+
+  status = ID3D11Device_QueryInterface(device, &IID_ID3D11VideoDevice,
+      (void **)&this->videoDevice);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to get the video device", status);
+    return false;
+  }
+
+  status = ID3D11DeviceContext_QueryInterface(context, &IID_ID3D11VideoContext,
+      (void **)&this->videoContext);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to get the video context", status);
+    return false;
+  }
+
+  const D3D11_VIDEO_PROCESSOR_CONTENT_DESC contentDesc =
+  {
+    .InputFrameFormat = D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE,
+    .InputFrameRate   = { ENCODE_FPS, 1 },
+    .InputWidth       = srcDesc.Width,
+    .InputHeight      = srcDesc.Height,
+    .OutputFrameRate  = { ENCODE_FPS, 1 },
+    .OutputWidth      = this->width,
+    .OutputHeight     = this->height,
+    .Usage            = D3D11_VIDEO_USAGE_OPTIMAL_SPEED
+  };
+
+  status = ID3D11VideoDevice_CreateVideoProcessorEnumerator(this->videoDevice,
+      &contentDesc, &this->vpEnum);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the video processor enumerator", status);
+    return false;
+  }
+
+  status = ID3D11VideoDevice_CreateVideoProcessor(this->videoDevice,
+      this->vpEnum, 0, &this->vp);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the video processor", status);
+    return false;
+  }
+
+  const D3D11_TEXTURE2D_DESC nv12Desc =
+  {
+    .Width            = this->width,
+    .Height           = this->height,
+    .MipLevels        = 1,
+    .ArraySize        = 1,
+    .Format           = DXGI_FORMAT_NV12,
+    .SampleDesc.Count = 1,
+    .Usage            = D3D11_USAGE_DEFAULT,
+    .BindFlags        = D3D11_BIND_RENDER_TARGET
+  };
+
+  status = ID3D11Device_CreateTexture2D(device, &nv12Desc, NULL, &this->nv12);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the NV12 texture", status);
+    return false;
+  }
+
+  const D3D11_VIDEO_PROCESSOR_INPUT_VIEW_DESC inDesc =
+  {
+    .ViewDimension = D3D11_VPIV_DIMENSION_TEXTURE2D
+  };
+
+  status = ID3D11VideoDevice_CreateVideoProcessorInputView(this->videoDevice,
+      (ID3D11Resource *)src, this->vpEnum, &inDesc, &this->inView);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the video processor input view", status);
+    return false;
+  }
+
+  const D3D11_VIDEO_PROCESSOR_OUTPUT_VIEW_DESC outDesc =
+  {
+    .ViewDimension = D3D11_VPOV_DIMENSION_TEXTURE2D
+  };
+
+  status = ID3D11VideoDevice_CreateVideoProcessorOutputView(this->videoDevice,
+      (ID3D11Resource *)this->nv12, this->vpEnum, &outDesc, &this->outView);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the video processor output view", status);
+    return false;
+  }
+
+  // the desktop is full range, the stream is limited range BT.709 which is
+  // what decoders assume when the bitstream doesn't say
+  const D3D11_VIDEO_PROCESSOR_COLOR_SPACE inSpace =
+  {
+    .RGB_Range = 0
+  };
+  const D3D11_VIDEO_PROCESSOR_COLOR_SPACE outSpace =
+  {
+    .YCbCr_Matrix  = 1,
+    .Nominal_Range = D3D11_VIDEO_PROCESSOR_NOMINAL_RANGE_16_235
+  };
+
+  ID3D11VideoContext_VideoProcessorSetStreamColorSpace(this->videoContext,
+      this->vp, 0, &inSpace);
+  ID3D11VideoContext_VideoProcessorSetOutputColorSpace(this->videoContext,
+      this->vp, &outSpace);
+  ID3D11VideoContext_VideoProcessorSetStreamAutoProcessingMode(
+      this->videoContext, this->vp, 0, FALSE);
+
+  return true;
+}
+
+// pick the hardware encoder of the adapter we capture from, the first one is
+// used if none of them say which vendor they belong to
+static bool encode_findTransform(Encode * this, IDXGIAdapter1 * adapter)
+{
+  HRESULT status;
+  DXGI_ADAPTER_DESC1 adapterDesc;
+  status = IDXGIAdapter1_GetDesc1(adapter, &adapterDesc);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to get the adapter description", status);
+    return false;
+  }
+
+  wchar_t vendor[16];
+  _snwprintf(vendor, sizeof(vendor) / sizeof(*vendor), L"VEN_%04X",
+      adapterDesc.VendorId);
+
+  const MFT_REGISTER_TYPE_INFO inInfo  = { MFMediaType_Video, MFVideoFormat_NV12 };
+  const MFT_REGISTER_TYPE_INFO outInfo = { MFMediaType_Video, MFVideoFormat_H264 };
+
+  IMFActivate ** activate = NULL;
+  UINT32         count    = 0;
+  status = MFTEnumEx(MFT_CATEGORY_VIDEO_ENCODER,
+      MFT_ENUM_FLAG_HARDWARE | MFT_ENUM_FLAG_SORTANDFILTER,
+      &inInfo, &outInfo, &activate, &count);
+  if (FAILED(status) || count == 0)
+  {
+    DEBUG_ERROR("No hardware H.264 encoder was found");
+    if (SUCCEEDED(status))
+      CoTaskMemFree(activate);
+    return false;
+  }
+
+  UINT32 use = 0;
+  for(UINT32 i = 0; i < count; ++i)
+  {
+    wchar_t * id;
+    if (FAILED(IMFActivate_GetAllocatedString(activate[i],
+        &MFT_ENUM_HARDWARE_VENDOR_ID_Attribute, &id, NULL)))
+      continue;
+
+    const bool match = _wcsicmp(id, vendor) == 0;
+    CoTaskMemFree(id);
+    if (match)
+    {
+      use = i;
+      break;
+    }
+  }
+
+  wchar_t * name;
+  if (SUCCEEDED(IMFActivate_GetAllocatedString(activate[use],
+      &MFT_FRIENDLY_NAME_Attribute, &name, NULL)))
+  {
+    DEBUG_INFO("Encoder          : %ls", name);
+    CoTaskMemFree(name);
+  }
+
+  status = IMFActivate_ActivateObject(activate[use], &IID_IMFTransform,
+      (void **)&this->mft);
+
+  for(UINT32 i = 0; i < count; ++i)
+    IMFActivate_Release(activate[i]);
+  CoTaskMemFree(activate);
+
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to activate the encoder", status);
+    return false;
+  }
+
+  return true;
+}
+
+static bool encode_setTypes(Encode * this, unsigned int bitrate)
+{
+  HRESULT        status;
+  IMFMediaType * type = NULL;
+
+  const UINT64 frameSize = ((UINT64)this->width << 32) | this->height;
+  const UINT64 frameRate = ((UINT64)ENCODE_FPS  << 32) | 1;
+
+  // the encoder must have its output type set before its input type
+  status = MFCreateMediaType(&type);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the output media type", status);
+    return false;
+  }
+
+  IMFMediaType_SetGUID  (type, &MF_MT_MAJOR_TYPE         , &MFMediaType_Video );
+  IMFMediaType_SetGUID  (type, &MF_MT_SUBTYPE            , &MFVideoFormat_H264);
+  IMFMediaType_SetUINT32(type, &MF_MT_AVG_BITRATE        , bitrate * 1000     );
+  IMFMediaType_SetUINT64(type, &MF_MT_FRAME_SIZE         , frameSize          );
+  IMFMediaType_SetUINT64(type, &MF_MT_FRAME_RATE         , frameRate          );
+  IMFMediaType_SetUINT32(type, &MF_MT_INTERLACE_MODE     ,
+      MFVideoInterlace_Progressive);
+  IMFMediaType_SetUINT32(type, &MF_MT_MPEG2_PROFILE      ,
+      eAVEncH264VProfile_Main);
+
+  // a client that joins part way through, or misses a frame, recovers at
+  // the next IDR frame
+  IMFMediaType_SetUINT32(type, &MF_MT_MAX_KEYFRAME_SPACING, ENCODE_FPS * 2);
+
+  status = IMFTransform_SetOutputType(this->mft, this->outID, type, 0);
+  IMFMediaType_Release(type);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to set the encoder output type", status);
+    return false;
+  }
+
+  status = MFCreateMediaType(&type);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the input media type", status);
+    return false;
+  }
+
+  IMFMediaType_SetGUID  (type, &MF_MT_MAJOR_TYPE    , &MFMediaType_Video );
+  IMFMediaType_SetGUID  (type, &MF_MT_SUBTYPE       , &MFVideoFormat_NV12);
+  IMFMediaType_SetUINT64(type, &MF_MT_FRAME_SIZE    , frameSize          );
+  IMFMediaType_SetUINT64(type, &MF_MT_FRAME_RATE    , frameRate          );
+  IMFMediaType_SetUINT32(type, &MF_MT_INTERLACE_MODE,
+      MFVideoInterlace_Progressive);
+
+  status = IMFTransform_SetInputType(this->mft, this->inID, type, 0);
+  IMFMediaType_Release(type);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to set the encoder input type", status);
+    return false;
+  }
+
+  MFT_OUTPUT_STREAM_INFO info;
+  status = IMFTransform_GetOutputStreamInfo(this->mft, this->outID, &info);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to get the encoder output stream info", status);
+    return false;
+  }
+
+  this->providesSamples = info.dwFlags & (MFT_OUTPUT_STREAM_PROVIDES_SAMPLES |
+      MFT_OUTPUT_STREAM_CAN_PROVIDE_SAMPLES);
+  this->outSize = info.cbSize ? info.cbSize : this->width * this->height;
+  return true;
+}
+
+bool encode_create(IDXGIAdapter1 * adapter, ID3D11Device * device,
+    ID3D11DeviceContext * context, ID3D11Texture2D * src, unsigned int width,
+    unsigned int height, unsigned int bitrate, Encode ** enc)
+{
+  if ((width & 1) || (height & 1))
+  {
+    DEBUG_ERROR("H.264 encoding requires an even width and height");
+    return false;
+  }
+
+  Encode * this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+
+  this->width  = width;
+  this->height = height;
+
+  HRESULT status;
+  status = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+  if (FAILED(status) && status != RPC_E_CHANGED_MODE)
+  {
+    DEBUG_WINERROR("Failed to initialize COM", status);
+    free(this);
+    return false;
+  }
+
+  status = MFStartup(MF_VERSION, MFSTARTUP_LITE);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to start Media Foundation", status);
+    free(this);
+    return false;
+  }
+  this->started = true;
+
+  // the encoder uses the device from its own threads
+  ID3D10Multithread * mt;
+  if (SUCCEEDED(ID3D11Device_QueryInterface(device, &IID_ID3D10Multithread,
+      (void **)&mt)))
+  {
+    ID3D10Multithread_SetMultithreadProtected(mt, TRUE);
+    ID3D10Multithread_Release(mt);
+  }
+
+  if (!encode_createProcessor(this, device, context, src))
+    goto fail;
+
+  if (!encode_findTransform(this, adapter))
+    goto fail;
+
+  IMFAttributes * attribs;
+  status = IMFTransform_GetAttributes(this->mft, &attribs);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to get the encoder attributes", status);
+    goto fail;
+  }
+
+  // hardware encoders are asynchronous and must be unlocked before use
+  IMFAttributes_SetUINT32(attribs, &MF_TRANSFORM_ASYNC_UNLOCK, TRUE);
+  IMFAttributes_SetUINT32(attribs, &MF_LOW_LATENCY           , TRUE);
+  IMFAttributes_Release(attribs);
+
+  status = IMFTransform_QueryInterface(this->mft, &IID_IMFMediaEventGenerator,
+      (void **)&this->events);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("The encoder is not asynchronous", status);
+    goto fail;
+  }
+
+  status = IMFTransform_GetStreamIDs(this->mft, 1, &this->inID, 1, &this->outID);
+  if (status == E_NOTIMPL)
+  {
+    this->inID  = 0;
+    this->outID = 0;
+  }
+  else if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to get the encoder stream IDs", status);
+    goto fail;
+  }
+
+  status = MFCreateDXGIDeviceManager(&this->token, &this->devManager);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the DXGI device manager", status);
+    goto fail;
+  }
+
+  status = IMFDXGIDeviceManager_ResetDevice(this->devManager,
+      (IUnknown *)device, this->token);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to set the device manager device", status);
+    goto fail;
+  }
+
+  status = IMFTransform_ProcessMessage(this->mft, MFT_MESSAGE_SET_D3D_MANAGER,
+      (ULONG_PTR)this->devManager);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("The encoder can't take D3D11 textures", status);
+    goto fail;
+  }
+
+  if (!encode_setTypes(this, bitrate))
+    goto fail;
+
+  IMFTransform_ProcessMessage(this->mft, MFT_MESSAGE_NOTIFY_BEGIN_STREAMING, 0);
+  IMFTransform_ProcessMessage(this->mft, MFT_MESSAGE_NOTIFY_START_OF_STREAM, 0);
+
+  *enc = this;
+  return true;
+
+fail:
+  encode_free(&this);
+  return false;
+}
+
+void encode_free(Encode ** enc)
+{
+  Encode * this = *enc;
+  if (!this)
+    return;
+
+  if (this->mft)
+  {
+    IMFTransform_ProcessMessage(this->mft, MFT_MESSAGE_NOTIFY_END_OF_STREAM, 0);
+    IMFTransform_ProcessMessage(this->mft, MFT_MESSAGE_COMMAND_FLUSH       , 0);
+    IMFTransform_ProcessMessage(this->mft, MFT_MESSAGE_SET_D3D_MANAGER     , 0);
+  }
+
+  RELEASE(IMFMediaEventGenerator        , this->events      );
+  RELEASE(IMFTransform                  , this->mft         );
+  RELEASE(IMFDXGIDeviceManager          , this->devManager  );
+  RELEASE(ID3D11VideoProcessorOutputView, this->outView     );
+  RELEASE(ID3D11VideoProcessorInputView , this->inView      );
+  RELEASE(ID3D11Texture2D               , this->nv12        );
+  RELEASE(ID3D11VideoProcessor          , this->vp          );
+  RELEASE(ID3D11VideoProcessorEnumerator, this->vpEnum      );
+  RELEASE(ID3D11VideoContext            , this->videoContext);
+  RELEASE(ID3D11VideoDevice             , this->videoDevice );
+
+  if (this->started)
+    MFShutdown();
+
+  free(this->bits);
+  free(this);
+  *enc = NULL;
+}
+
+void encode_convert(Encode * this)
+{
+  D3D11_VIDEO_PROCESSOR_STREAM stream =
+  {
+    .Enable        = TRUE,
+    .pInputSurface = this->inView
+  };
+
+  ID3D11VideoContext_VideoProcessorBlt(this->videoContext, this->vp,
+      this->outView, 0, 1, &stream);
+}
+
+static bool encode_input(Encode * this, uint64_t time)
+{
+  HRESULT          status;
+  IMFMediaBuffer * buffer = NULL;
+  IMFSample      * sample = NULL;
+
+  status = MFCreateDXGISurfaceBuffer(&IID_ID3D11Texture2D,
+      (IUnknown *)this->nv12, 0, FALSE, &buffer);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the input buffer", status);
+    return false;
+  }
+
+  status = MFCreateSample(&sample);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the input sample", status);
+    IMFMediaBuffer_Release(buffer);
+    return false;
+  }
+
+  IMFSample_AddBuffer        (sample, buffer);
+  IMFSample_SetSampleTime    (sample, time * 10);
+  IMFSample_SetSampleDuration(sample, 10000000 / ENCODE_FPS);
+  IMFMediaBuffer_Release(buffer);
+
+  status = IMFTransform_ProcessInput(this->mft, this->inID, sample, 0);
+  IMFSample_Release(sample);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to encode the frame", status);
+    return false;
+  }
+
+  return true;
+}
+
+static bool encode_output(Encode * this)
+{
+  HRESULT status;
+  MFT_OUTPUT_DATA_BUFFER out = { .dwStreamID = this->outID };
+
+  if (!this->providesSamples)
+  {
+    IMFMediaBuffer * buffer;
+    status = MFCreateMemoryBuffer(this->outSize, &buffer);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to create the output buffer", status);
+      return false;
+    }
+
+    status = MFCreateSample(&out.pSample);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to create the output sample", status);
+      IMFMediaBuffer_Release(buffer);
+      return false;
+    }
+
+    IMFSample_AddBuffer(out.pSample, buffer);
+    IMFMediaBuffer_Release(buffer);
+  }
+
+  DWORD flags;
+  status = IMFTransform_ProcessOutput(this->mft, 0, 1, &out, &flags);
+  if (out.pEvents)
+    IMFCollection_Release(out.pEvents);
+
+  if (status == MF_E_TRANSFORM_STREAM_CHANGE)
+  {
+    // the encoder changed the output type, accept what it now offers
+    RELEASE(IMFSample, out.pSample);
+    IMFMediaType * type;
+    status = IMFTransform_GetOutputAvailableType(this->mft, this->outID, 0,
+        &type);
+    if (SUCCEEDED(status))
+    {
+      status = IMFTransform_SetOutputType(this->mft, this->outID, type, 0);
+      IMFMediaType_Release(type);
+    }
+
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to renegotiate the encoder output type", status);
+      return false;
+    }
+    return true;
+  }
+
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to get the encoded frame", status);
+    RELEASE(IMFSample, out.pSample);
+    return false;
+  }
+
+  IMFMediaBuffer * buffer;
+  status = IMFSample_ConvertToContiguousBuffer(out.pSample, &buffer);
+  IMFSample_Release(out.pSample);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to get the encoded frame buffer", status);
+    return false;
+  }
+
+  BYTE * data;
+  DWORD  len;
+  status = IMFMediaBuffer_Lock(buffer, &data, NULL, &len);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to lock the encoded frame buffer", status);
+    IMFMediaBuffer_Release(buffer);
+    return false;
+  }
+
+  // a second access unit before the caller has taken the first is appended,
+  // the client decodes them in order
+  uint8_t * bits = realloc(this->bits, this->bitsSize + len);
+  if (!bits)
+  {
+    DEBUG_ERROR("out of memory");
+    IMFMediaBuffer_Unlock(buffer);
+    IMFMediaBuffer_Release(buffer);
+    return false;
+  }
+
+  memcpy(bits + this->bitsSize, data, len);
+  this->bits      = bits;
+  this->bitsSize += len;
+
+  IMFMediaBuffer_Unlock(buffer);
+  IMFMediaBuffer_Release(buffer);
+  return true;
+}
+
+bool encode_process(Encode * this, uint64_t time, const uint8_t ** data,
+    size_t * size)
+{
+  bool           fed      = false;
+  unsigned int   pending  = 0;
+  const uint64_t deadline = microtime() + ENCODE_TIMEOUT * 1000ULL;
+
+  this->bitsSize = 0;
+
+  // hand the frame to the encoder when it asks for input, and wait for it to
+  // either give a frame back or ask for more input if it holds frames back,
+  // requests made before this frame was given don't count
+  while(!fed || (!this->bitsSize && this->needInput <= pending))
+  {
+    if (!fed && this->needInput)
+    {
+      --this->needInput;
+      if (!encode_input(this, time))
+        return false;
+      fed     = true;
+      pending = this->needInput;
+      continue;
+    }
+
+    IMFMediaEvent * event;
+    HRESULT status = IMFMediaEventGenerator_GetEvent(this->events,
+        MF_EVENT_FLAG_NO_WAIT, &event);
+    if (status == MF_E_NO_EVENTS_AVAILABLE)
+    {
+      if (microtime() > deadline)
+      {
+        DEBUG_ERROR("Timed out waiting on the encoder");
+        return false;
+      }
+
+      nsleep(100000);
+      continue;
+    }
+
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to get the encoder event", status);
+      return false;
+    }
+
+    MediaEventType type;
+    status = IMFMediaEvent_GetType(event, &type);
+    IMFMediaEvent_Release(event);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to get the encoder event type", status);
+      return false;
+    }
+
+    switch(type)
+    {
+      case METransformNeedInput:
+        ++this->needInput;
+        break;
+
+      case METransformHaveOutput:
+        if (!encode_output(this))
+          return false;
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  *data = this->bits;
+  *size = this->bitsSize;
+  return true;
+}
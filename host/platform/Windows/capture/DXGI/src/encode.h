@@ -0,0 +1,56 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <dxgi.h>
+#include <d3d11.h>
+
+typedef struct Encode Encode;
+
+/**
+ * Create a H.264 encoder on the hardware encoder (NVENC, AMF or QSV) of the
+ * adapter through its Media Foundation transform. Frames are taken from src
+ * which must stay the same texture for the life of the encoder and are
+ * scaled to width x height, both of which must be even. The bitrate is in
+ * kbit/s
+ */
+bool encode_create(IDXGIAdapter1 * adapter, ID3D11Device * device,
+    ID3D11DeviceContext * context, ID3D11Texture2D * src, unsigned int width,
+    unsigned int height, unsigned int bitrate, Encode ** enc);
+
+void encode_free(Encode ** enc);
+
+/**
+ * Convert the current contents of src into the encoder's input, the device
+ * context must be locked
+ */
+void encode_convert(Encode * enc);
+
+/**
+ * Encode the frame converted by the last encode_convert, the device context
+ * must NOT be locked. On success data points to an Annex B access unit that
+ * is valid until the next call, size is zero if the encoder has not produced
+ * one for this frame yet. The time is in microseconds
+ */
+bool encode_process(Encode * enc, uint64_t time, const uint8_t ** data,
+    size_t * size);
@@ -0,0 +1,205 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "scale.h"
+#include "shader.h"
+#include "common/debug.h"
+#include "common/windebug.h"
+
+#include <stdlib.h>
+
+struct ScaleConvert
+{
+  unsigned int             width, height;
+  ID3D11Texture2D        * dstTex;
+  ID3D11RenderTargetView * dstView;
+  ID3D11VertexShader     * vs;
+  ID3D11PixelShader      * ps;
+  ID3D11SamplerState     * sampler;
+  ID3D11Buffer           * params;
+};
+
+static const char psSource[] =
+  "Texture2D<float4> src : register(t0);\n"
+  "SamplerState      ss  : register(s0);\n"
+  "cbuffer params : register(b0) { float2 size; float white, pad; };\n"
+  "\n"
+  "float4 main(float4 pos : SV_Position) : SV_Target\n"
+  "{\n"
+  "  return src.SampleLevel(ss, pos.xy / size, 0);\n"
+  "}\n";
+
+// maps linear scRGB (1.0 = 80 nits) to sRGB, white scales the reference white
+// to 1.0 and anything brighter or outside of the sRGB gamut is clipped
+static const char psPackSource[] =
+  "Texture2D<float4> src : register(t0);\n"
+  "SamplerState      ss  : register(s0);\n"
+  "cbuffer params : register(b0) { float2 size; float white, pad; };\n"
+  "\n"
+  "float4 main(float4 pos : SV_Position) : SV_Target\n"
+  "{\n"
+  "  float3 c = saturate(src.SampleLevel(ss, pos.xy / size, 0).rgb * white);\n"
+  "  c = c <= 0.0031308 ? c * 12.92 : 1.055 * pow(c, 1.0 / 2.4) - 0.055;\n"
+  "  return float4(c, 1.0);\n"
+  "}\n";
+
+bool scale_create(ID3D11Device * device, unsigned int width,
+    unsigned int height, DXGI_FORMAT format, float sdrWhite,
+    ScaleConvert ** conv)
+{
+  ScaleConvert * this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+
+  this->width  = width;
+  this->height = height;
+
+  HRESULT status;
+  const D3D11_TEXTURE2D_DESC texDesc =
+  {
+    .Width            = width,
+    .Height           = height,
+    .MipLevels        = 1,
+    .ArraySize        = 1,
+    .Format           = format,
+    .SampleDesc.Count = 1,
+    .Usage            = D3D11_USAGE_DEFAULT,
+    .BindFlags        = D3D11_BIND_RENDER_TARGET
+  };
+
+  status = ID3D11Device_CreateTexture2D(device, &texDesc, NULL, &this->dstTex);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the scale target texture", status);
+    goto fail;
+  }
+
+  status = ID3D11Device_CreateRenderTargetView(device,
+      (ID3D11Resource *)this->dstTex, NULL, &this->dstView);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the scale target view", status);
+    goto fail;
+  }
+
+  const D3D11_SAMPLER_DESC samplerDesc =
+  {
+    .Filter         = D3D11_FILTER_MIN_MAG_MIP_LINEAR,
+    .AddressU       = D3D11_TEXTURE_ADDRESS_CLAMP,
+    .AddressV       = D3D11_TEXTURE_ADDRESS_CLAMP,
+    .AddressW       = D3D11_TEXTURE_ADDRESS_CLAMP,
+    .ComparisonFunc = D3D11_COMPARISON_NEVER,
+    .MaxLOD         = D3D11_FLOAT32_MAX
+  };
+
+  status = ID3D11Device_CreateSamplerState(device, &samplerDesc, &this->sampler);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the scale sampler", status);
+    goto fail;
+  }
+
+  const float params[4] =
+  {
+    width, height, sdrWhite > 0.0f ? 80.0f / sdrWhite : 1.0f, 0.0f
+  };
+  const D3D11_BUFFER_DESC bufferDesc =
+  {
+    .ByteWidth = sizeof(params),
+    .Usage     = D3D11_USAGE_IMMUTABLE,
+    .BindFlags = D3D11_BIND_CONSTANT_BUFFER
+  };
+  const D3D11_SUBRESOURCE_DATA bufferData = { .pSysMem = params };
+
+  status = ID3D11Device_CreateBuffer(device, &bufferDesc, &bufferData,
+      &this->params);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the scale constant buffer", status);
+    goto fail;
+  }
+
+  if (!shader_create(device, sdrWhite > 0.0f ? psPackSource : psSource,
+        &this->vs, &this->ps))
+    goto fail;
+
+  *conv = this;
+  return true;
+
+fail:
+  scale_free(&this);
+  return false;
+}
+
+#define RELEASE(type, x) if (x) { type##_Release(x); x = NULL; }
+
+void scale_free(ScaleConvert ** conv)
+{
+  ScaleConvert * this = *conv;
+  if (!this)
+    return;
+
+  RELEASE(ID3D11Buffer          , this->params );
+  RELEASE(ID3D11SamplerState    , this->sampler);
+  RELEASE(ID3D11PixelShader     , this->ps     );
+  RELEASE(ID3D11VertexShader    , this->vs     );
+  RELEASE(ID3D11RenderTargetView, this->dstView);
+  RELEASE(ID3D11Texture2D       , this->dstTex );
+
+  free(this);
+  *conv = NULL;
+}
+
+void scale_convert(ScaleConvert * this, ID3D11DeviceContext * context,
+    ID3D11ShaderResourceView * src)
+{
+  const D3D11_VIEWPORT viewport =
+  {
+    .Width    = this->width,
+    .Height   = this->height,
+    .MinDepth = 0.0f,
+    .MaxDepth = 1.0f
+  };
+
+  ID3D11DeviceContext_IASetInputLayout      (context, NULL);
+  ID3D11DeviceContext_IASetPrimitiveTopology(context,
+      D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+  ID3D11DeviceContext_VSSetShader           (context, this->vs, NULL, 0);
+  ID3D11DeviceContext_PSSetShader           (context, this->ps, NULL, 0);
+  ID3D11DeviceContext_PSSetShaderResources  (context, 0, 1, &src);
+  ID3D11DeviceContext_PSSetSamplers         (context, 0, 1, &this->sampler);
+  ID3D11DeviceContext_PSSetConstantBuffers  (context, 0, 1, &this->params);
+  ID3D11DeviceContext_RSSetViewports        (context, 1, &viewport);
+  ID3D11DeviceContext_OMSetRenderTargets    (context, 1, &this->dstView, NULL);
+  ID3D11DeviceContext_Draw                  (context, 3, 0);
+
+  // unbind the views so the resources can be copied freely
+  ID3D11ShaderResourceView * nullView   = NULL;
+  ID3D11RenderTargetView   * nullTarget = NULL;
+  ID3D11DeviceContext_PSSetShaderResources(context, 0, 1, &nullView);
+  ID3D11DeviceContext_OMSetRenderTargets  (context, 1, &nullTarget, NULL);
+}
+
+ID3D11Texture2D * scale_getTexture(ScaleConvert * this)
+{
+  return this->dstTex;
+}
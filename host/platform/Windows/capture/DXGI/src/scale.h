@@ -0,0 +1,45 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <d3d11.h>
+
+typedef struct ScaleConvert ScaleConvert;
+
+/**
+ * Create a pass that scales a texture to width x height in the given format
+ * with a bilinear filter. If sdrWhite is non zero the source is treated as
+ * scRGB and packed to sRGB with sdrWhite nits as the reference white
+ */
+bool scale_create(ID3D11Device * device, unsigned int width,
+    unsigned int height, DXGI_FORMAT format, float sdrWhite,
+    ScaleConvert ** conv);
+
+void scale_free(ScaleConvert ** conv);
+
+/**
+ * Scale the frame in src, the result is held in the texture returned by
+ * scale_getTexture until the next call. The device context must be locked
+ */
+void scale_convert(ScaleConvert * conv, ID3D11DeviceContext * context,
+    ID3D11ShaderResourceView * src);
+
+ID3D11Texture2D * scale_getTexture(ScaleConvert * conv);
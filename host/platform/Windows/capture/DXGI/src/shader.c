@@ -0,0 +1,112 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "shader.h"
+#include "common/debug.h"
+#include "common/windebug.h"
+
+#include <string.h>
+#include <d3dcompiler.h>
+
+// a single triangle that covers the whole target
+static const char vsSource[] =
+  "float4 main(uint id : SV_VertexID) : SV_Position\n"
+  "{\n"
+  "  float2 uv = float2((id << 1) & 2, id & 2);\n"
+  "  return float4(uv * float2(2, -2) + float2(-1, 1), 0, 1);\n"
+  "}\n";
+
+static ID3DBlob * shader_compile(pD3DCompile compile, const char * source,
+    size_t size, const char * target)
+{
+  ID3DBlob * code = NULL, * errors = NULL;
+  HRESULT status = compile(source, size, NULL, NULL, NULL, "main", target,
+      D3DCOMPILE_OPTIMIZATION_LEVEL3, 0, &code, &errors);
+
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to compile the shader", status);
+    if (errors)
+    {
+      DEBUG_ERROR("%s", (const char *)ID3D10Blob_GetBufferPointer(errors));
+      ID3D10Blob_Release(errors);
+    }
+    return NULL;
+  }
+
+  if (errors)
+    ID3D10Blob_Release(errors);
+
+  return code;
+}
+
+bool shader_create(ID3D11Device * device, const char * psSource,
+    ID3D11VertexShader ** vs, ID3D11PixelShader ** ps)
+{
+  HMODULE d3dcompiler = LoadLibraryA("d3dcompiler_47.dll");
+  if (!d3dcompiler)
+  {
+    DEBUG_ERROR("Failed to load d3dcompiler_47.dll");
+    return false;
+  }
+
+  bool       result = false;
+  ID3DBlob * vsCode = NULL;
+  ID3DBlob * psCode = NULL;
+  HRESULT    status;
+
+  pD3DCompile compile = (pD3DCompile)GetProcAddress(d3dcompiler, "D3DCompile");
+  if (!compile)
+  {
+    DEBUG_ERROR("Failed to find D3DCompile");
+    goto done;
+  }
+
+  if (!(vsCode = shader_compile(compile, vsSource, sizeof(vsSource) - 1, "vs_4_0")) ||
+      !(psCode = shader_compile(compile, psSource, strlen(psSource), "ps_4_0")))
+    goto done;
+
+  status = ID3D11Device_CreateVertexShader(device,
+      ID3D10Blob_GetBufferPointer(vsCode), ID3D10Blob_GetBufferSize(vsCode),
+      NULL, vs);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the vertex shader", status);
+    goto done;
+  }
+
+  status = ID3D11Device_CreatePixelShader(device,
+      ID3D10Blob_GetBufferPointer(psCode), ID3D10Blob_GetBufferSize(psCode),
+      NULL, ps);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the pixel shader", status);
+    goto done;
+  }
+
+  result = true;
+
+done:
+  if (vsCode)
+    ID3D10Blob_Release(vsCode);
+  if (psCode)
+    ID3D10Blob_Release(psCode);
+  FreeLibrary(d3dcompiler);
+  return result;
+}
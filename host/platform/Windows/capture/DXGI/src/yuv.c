@@ -0,0 +1,215 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "yuv.h"
+#include "shader.h"
+#include "common/debug.h"
+#include "common/windebug.h"
+
+#include <stdlib.h>
+
+struct YUVConvert
+{
+  unsigned int             width, height, pitch;
+  ID3D11Texture2D        * dstTex;
+  ID3D11RenderTargetView * dstView;
+  ID3D11VertexShader     * vs;
+  ID3D11PixelShader      * ps;
+  ID3D11SamplerState     * sampler;
+  ID3D11Buffer           * params;
+};
+
+/* each output texel is one byte of the I420 frame, the chroma is sampled at
+ * the centre of each 2x2 block so the bilinear filter averages it for us. The
+ * BT.601 full range matrix matches the client's desktop_yuv shader. */
+static const char psSource[] =
+  "Texture2D<float4> src : register(t0);\n"
+  "SamplerState      ss  : register(s0);\n"
+  "cbuffer params : register(b0) { uint width, height, pitch, pad; };\n"
+  "\n"
+  "float main(float4 pos : SV_Position) : SV_Target\n"
+  "{\n"
+  "  uint x = (uint)pos.x, y = (uint)pos.y;\n"
+  "  if (y < height)\n"
+  "  {\n"
+  "    if (x >= width) return 0;\n"
+  "    float2 uv = (float2(x, y) + 0.5) / float2(width, height);\n"
+  "    float3 c  = src.SampleLevel(ss, uv, 0).rgb;\n"
+  "    return dot(c, float3(0.299, 0.587, 0.114));\n"
+  "  }\n"
+  "\n"
+  "  uint cp    = pitch / 2;\n"
+  "  uint size  = cp * (height / 2);\n"
+  "  uint off   = (y - height) * pitch + x;\n"
+  "  bool isV   = off >= size;\n"
+  "  if (isV) off -= size;\n"
+  "  uint cx = off % cp, cy = off / cp;\n"
+  "  if (cx >= width / 2) return 0;\n"
+  "\n"
+  "  float2 uv = float2(cx * 2 + 1, cy * 2 + 1) / float2(width, height);\n"
+  "  float3 c  = src.SampleLevel(ss, uv, 0).rgb;\n"
+  "  if (isV)\n"
+  "    return dot(c, float3( 0.5     , -0.418688, -0.081312)) + 0.5;\n"
+  "  return   dot(c, float3(-0.168736, -0.331264,  0.5     )) + 0.5;\n"
+  "}\n";
+
+bool yuv_create(ID3D11Device * device, unsigned int width, unsigned int height,
+    unsigned int pitch, YUVConvert ** conv)
+{
+  if ((width & 1) || (height & 1) || (pitch & 1) || pitch < width)
+  {
+    DEBUG_ERROR("YUV420 requires an even width and height");
+    return false;
+  }
+
+  YUVConvert * this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+
+  this->width  = width;
+  this->height = height;
+  this->pitch  = pitch;
+
+  HRESULT status;
+  const D3D11_TEXTURE2D_DESC texDesc =
+  {
+    .Width            = pitch,
+    .Height           = height * 3 / 2,
+    .MipLevels        = 1,
+    .ArraySize        = 1,
+    .Format           = DXGI_FORMAT_R8_UNORM,
+    .SampleDesc.Count = 1,
+    .Usage            = D3D11_USAGE_DEFAULT,
+    .BindFlags        = D3D11_BIND_RENDER_TARGET
+  };
+
+  status = ID3D11Device_CreateTexture2D(device, &texDesc, NULL, &this->dstTex);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the YUV target texture", status);
+    goto fail;
+  }
+
+  status = ID3D11Device_CreateRenderTargetView(device,
+      (ID3D11Resource *)this->dstTex, NULL, &this->dstView);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the YUV target view", status);
+    goto fail;
+  }
+
+  const D3D11_SAMPLER_DESC samplerDesc =
+  {
+    .Filter         = D3D11_FILTER_MIN_MAG_MIP_LINEAR,
+    .AddressU       = D3D11_TEXTURE_ADDRESS_CLAMP,
+    .AddressV       = D3D11_TEXTURE_ADDRESS_CLAMP,
+    .AddressW       = D3D11_TEXTURE_ADDRESS_CLAMP,
+    .ComparisonFunc = D3D11_COMPARISON_NEVER,
+    .MaxLOD         = D3D11_FLOAT32_MAX
+  };
+
+  status = ID3D11Device_CreateSamplerState(device, &samplerDesc, &this->sampler);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the YUV sampler", status);
+    goto fail;
+  }
+
+  const UINT params[4] = { width, height, pitch, 0 };
+  const D3D11_BUFFER_DESC bufferDesc =
+  {
+    .ByteWidth = sizeof(params),
+    .Usage     = D3D11_USAGE_IMMUTABLE,
+    .BindFlags = D3D11_BIND_CONSTANT_BUFFER
+  };
+  const D3D11_SUBRESOURCE_DATA bufferData = { .pSysMem = params };
+
+  status = ID3D11Device_CreateBuffer(device, &bufferDesc, &bufferData,
+      &this->params);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the YUV constant buffer", status);
+    goto fail;
+  }
+
+  if (!shader_create(device, psSource, &this->vs, &this->ps))
+    goto fail;
+
+  *conv = this;
+  return true;
+
+fail:
+  yuv_free(&this);
+  return false;
+}
+
+#define RELEASE(type, x) if (x) { type##_Release(x); x = NULL; }
+
+void yuv_free(YUVConvert ** conv)
+{
+  YUVConvert * this = *conv;
+  if (!this)
+    return;
+
+  RELEASE(ID3D11Buffer          , this->params );
+  RELEASE(ID3D11SamplerState    , this->sampler);
+  RELEASE(ID3D11PixelShader     , this->ps     );
+  RELEASE(ID3D11VertexShader    , this->vs     );
+  RELEASE(ID3D11RenderTargetView, this->dstView);
+  RELEASE(ID3D11Texture2D       , this->dstTex );
+
+  free(this);
+  *conv = NULL;
+}
+
+void yuv_convert(YUVConvert * this, ID3D11DeviceContext * context,
+    ID3D11ShaderResourceView * src, ID3D11Texture2D * dst)
+{
+  const D3D11_VIEWPORT viewport =
+  {
+    .Width    = this->pitch,
+    .Height   = this->height * 3 / 2,
+    .MinDepth = 0.0f,
+    .MaxDepth = 1.0f
+  };
+
+  ID3D11DeviceContext_IASetInputLayout      (context, NULL);
+  ID3D11DeviceContext_IASetPrimitiveTopology(context,
+      D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+  ID3D11DeviceContext_VSSetShader           (context, this->vs, NULL, 0);
+  ID3D11DeviceContext_PSSetShader           (context, this->ps, NULL, 0);
+  ID3D11DeviceContext_PSSetShaderResources  (context, 0, 1, &src);
+  ID3D11DeviceContext_PSSetSamplers         (context, 0, 1, &this->sampler);
+  ID3D11DeviceContext_PSSetConstantBuffers  (context, 0, 1, &this->params);
+  ID3D11DeviceContext_RSSetViewports        (context, 1, &viewport);
+  ID3D11DeviceContext_OMSetRenderTargets    (context, 1, &this->dstView, NULL);
+  ID3D11DeviceContext_Draw                  (context, 3, 0);
+
+  // unbind the views so the resources can be copied freely
+  ID3D11ShaderResourceView * nullView   = NULL;
+  ID3D11RenderTargetView   * nullTarget = NULL;
+  ID3D11DeviceContext_PSSetShaderResources(context, 0, 1, &nullView);
+  ID3D11DeviceContext_OMSetRenderTargets  (context, 1, &nullTarget, NULL);
+
+  ID3D11DeviceContext_CopyResource(context,
+      (ID3D11Resource *)dst, (ID3D11Resource *)this->dstTex);
+}
@@ -0,0 +1,43 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <d3d11.h>
+
+typedef struct YUVConvert YUVConvert;
+
+/**
+ * Create a converter that renders a RGB texture into a single R8 texture of
+ * pitch x (height * 3 / 2) holding the planar YUV420 (I420) frame, Y at full
+ * resolution followed by U and V each with a pitch of pitch / 2. The source
+ * is scaled to width x height which must be even.
+ */
+bool yuv_create(ID3D11Device * device, unsigned int width, unsigned int height,
+    unsigned int pitch, YUVConvert ** conv);
+
+void yuv_free(YUVConvert ** conv);
+
+/**
+ * Convert the frame in src into dst, dst must be a pitch x (height * 3 / 2)
+ * R8 texture such as a staging texture. The device context must be locked
+ */
+void yuv_convert(YUVConvert * conv, ID3D11DeviceContext * context,
+    ID3D11ShaderResourceView * src, ID3D11Texture2D * dst);
@@ -0,0 +1,609 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "zerocopy.h"
+#include "common/debug.h"
+#include "common/windebug.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <dxgi1_2.h>
+#include <d3d11_4.h>
+#include <d3d12.h>
+
+#define ALIGN_TO(x, a) (((x) + ((a) - 1)) & ~((a) - 1))
+
+// one for each frame buffer the host cycles through, plus some spare
+#define MAX_HEAPS 4
+
+struct Heap
+{
+  void           * addr;
+  ID3D12Heap     * heap;
+  ID3D12Resource * buffer;
+};
+
+struct Slot
+{
+  ID3D11Texture2D * tex;
+  ID3D12Resource  * res;
+  UINT64            ready;
+
+  // the readback of this texture, each slot records its own so several can
+  // be in flight on the copy queue
+  ID3D12CommandAllocator    * allocator;
+  ID3D12GraphicsCommandList * list;
+  ID3D12Resource            * readback;
+  void                      * map;
+  UINT64                      copied;
+};
+
+struct ZeroCopy
+{
+  HMODULE                     d3d12;
+  ID3D12Device3             * device;
+  ID3D12CommandQueue        * queue;
+  ID3D12CommandAllocator    * allocator;
+  ID3D12GraphicsCommandList * list;
+
+  // signalled by D3D11 when a texture is ready to copy
+  ID3D11Fence               * fence11;
+  ID3D12Fence               * sharedFence;
+  UINT64                      sharedValue;
+
+  // signalled by D3D12 when the copy into shared memory is complete
+  ID3D12Fence               * fence;
+  UINT64                      fenceValue;
+  HANDLE                      event;
+
+  unsigned int                width, height, pitch;
+  size_t                      size;
+  DXGI_FORMAT                 format;
+
+  bool                        readback;
+  int                         count;
+  struct Slot               * slots;
+  struct Heap                 heaps[MAX_HEAPS];
+  int                         nextHeap;
+};
+
+// open a shared NT handle on the D3D12 device, the handle is closed
+static bool zerocopy_openShared(ZeroCopy * this, HANDLE handle, REFIID riid,
+    void ** out)
+{
+  HRESULT status = ID3D12Device3_OpenSharedHandle(this->device, handle, riid, out);
+  CloseHandle(handle);
+
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to open the shared handle", status);
+    return false;
+  }
+
+  return true;
+}
+
+static bool zerocopy_createReadback(ZeroCopy * this, struct Slot * slot)
+{
+  HRESULT status = ID3D12Device3_CreateCommandAllocator(this->device,
+      D3D12_COMMAND_LIST_TYPE_COPY, &IID_ID3D12CommandAllocator,
+      (void **)&slot->allocator);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the command allocator", status);
+    return false;
+  }
+
+  status = ID3D12Device3_CreateCommandList(this->device, 0,
+      D3D12_COMMAND_LIST_TYPE_COPY, slot->allocator, NULL,
+      &IID_ID3D12GraphicsCommandList, (void **)&slot->list);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the command list", status);
+    return false;
+  }
+  ID3D12GraphicsCommandList_Close(slot->list);
+
+  const D3D12_HEAP_PROPERTIES heapProps =
+  {
+    .Type = D3D12_HEAP_TYPE_READBACK
+  };
+
+  const D3D12_RESOURCE_DESC desc =
+  {
+    .Dimension        = D3D12_RESOURCE_DIMENSION_BUFFER,
+    .Width            = this->size,
+    .Height           = 1,
+    .DepthOrArraySize = 1,
+    .MipLevels        = 1,
+    .Format           = DXGI_FORMAT_UNKNOWN,
+    .SampleDesc.Count = 1,
+    .Layout           = D3D12_TEXTURE_LAYOUT_ROW_MAJOR
+  };
+
+  status = ID3D12Device3_CreateCommittedResource(this->device, &heapProps,
+      D3D12_HEAP_FLAG_NONE, &desc, D3D12_RESOURCE_STATE_COPY_DEST, NULL,
+      &IID_ID3D12Resource, (void **)&slot->readback);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the readback buffer", status);
+    return false;
+  }
+
+  // readback buffers may stay mapped, the fence orders the reads
+  status = ID3D12Resource_Map(slot->readback, 0, NULL, &slot->map);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to map the readback buffer", status);
+    return false;
+  }
+
+  return true;
+}
+
+bool zerocopy_create(IDXGIAdapter1 * adapter, ID3D11Device * device,
+    int count, unsigned int width, unsigned int height, DXGI_FORMAT format,
+    bool readback, bool highPriority, ZeroCopy ** zc)
+{
+  HRESULT status;
+  ZeroCopy * this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+
+  this->width  = width;
+  this->height = height;
+  this->format   = format;
+  this->count    = count;
+  this->readback = readback;
+
+  const unsigned int bpp = format == DXGI_FORMAT_R16G16B16A16_FLOAT ? 8 : 4;
+  this->pitch = ALIGN_TO(width * bpp, D3D12_TEXTURE_DATA_PITCH_ALIGNMENT);
+  this->size  = ALIGN_TO((size_t)this->pitch * height, ZEROCOPY_ALIGN);
+
+  this->d3d12 = LoadLibraryA("d3d12.dll");
+  if (!this->d3d12)
+  {
+    DEBUG_ERROR("Failed to load d3d12.dll");
+    goto fail;
+  }
+
+  PFN_D3D12_CREATE_DEVICE createDevice = (PFN_D3D12_CREATE_DEVICE)
+    GetProcAddress(this->d3d12, "D3D12CreateDevice");
+  if (!createDevice)
+  {
+    DEBUG_ERROR("Failed to find D3D12CreateDevice");
+    goto fail;
+  }
+
+  // OpenExistingHeapFromAddress requires ID3D12Device3
+  status = createDevice((IUnknown *)adapter, D3D_FEATURE_LEVEL_11_0,
+      &IID_ID3D12Device3, (void **)&this->device);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the D3D12 device", status);
+    goto fail;
+  }
+
+  const D3D12_COMMAND_QUEUE_DESC queueDesc =
+  {
+    .Type     = D3D12_COMMAND_LIST_TYPE_COPY,
+    .Priority = highPriority ?
+      D3D12_COMMAND_QUEUE_PRIORITY_HIGH : D3D12_COMMAND_QUEUE_PRIORITY_NORMAL
+  };
+
+  status = ID3D12Device3_CreateCommandQueue(this->device, &queueDesc,
+      &IID_ID3D12CommandQueue, (void **)&this->queue);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the copy queue", status);
+    goto fail;
+  }
+
+  status = ID3D12Device3_CreateCommandAllocator(this->device,
+      D3D12_COMMAND_LIST_TYPE_COPY, &IID_ID3D12CommandAllocator,
+      (void **)&this->allocator);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the command allocator", status);
+    goto fail;
+  }
+
+  status = ID3D12Device3_CreateCommandList(this->device, 0,
+      D3D12_COMMAND_LIST_TYPE_COPY, this->allocator, NULL,
+      &IID_ID3D12GraphicsCommandList, (void **)&this->list);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the command list", status);
+    goto fail;
+  }
+  ID3D12GraphicsCommandList_Close(this->list);
+
+  status = ID3D12Device3_CreateFence(this->device, 0, D3D12_FENCE_FLAG_NONE,
+      &IID_ID3D12Fence, (void **)&this->fence);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the fence", status);
+    goto fail;
+  }
+
+  this->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (!this->event)
+  {
+    DEBUG_WINERROR("Failed to create the fence event", GetLastError());
+    goto fail;
+  }
+
+  ID3D11Device5 * device5;
+  status = ID3D11Device_QueryInterface(device, &IID_ID3D11Device5, (void **)&device5);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("ID3D11Device5 is not available", status);
+    goto fail;
+  }
+
+  status = ID3D11Device5_CreateFence(device5, 0, D3D11_FENCE_FLAG_SHARED,
+      &IID_ID3D11Fence, (void **)&this->fence11);
+  ID3D11Device5_Release(device5);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the shared fence", status);
+    goto fail;
+  }
+
+  HANDLE handle;
+  status = ID3D11Fence_CreateSharedHandle(this->fence11, NULL, GENERIC_ALL,
+      NULL, &handle);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to share the fence", status);
+    goto fail;
+  }
+
+  if (!zerocopy_openShared(this, handle, &IID_ID3D12Fence,
+        (void **)&this->sharedFence))
+    goto fail;
+
+  this->slots = calloc(count, sizeof(*this->slots));
+  if (!this->slots)
+  {
+    DEBUG_ERROR("out of memory");
+    goto fail;
+  }
+
+  const D3D11_TEXTURE2D_DESC texDesc =
+  {
+    .Width            = width,
+    .Height           = height,
+    .MipLevels        = 1,
+    .ArraySize        = 1,
+    .Format           = format,
+    .SampleDesc.Count = 1,
+    .Usage            = D3D11_USAGE_DEFAULT,
+    .MiscFlags        = D3D11_RESOURCE_MISC_SHARED |
+                        D3D11_RESOURCE_MISC_SHARED_NTHANDLE
+  };
+
+  for(int i = 0; i < count; ++i)
+  {
+    struct Slot * slot = &this->slots[i];
+    status = ID3D11Device_CreateTexture2D(device, &texDesc, NULL, &slot->tex);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to create the shared texture", status);
+      goto fail;
+    }
+
+    IDXGIResource1 * res;
+    status = ID3D11Texture2D_QueryInterface(slot->tex, &IID_IDXGIResource1,
+        (void **)&res);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to get the IDXGIResource1", status);
+      goto fail;
+    }
+
+    status = IDXGIResource1_CreateSharedHandle(res, NULL, GENERIC_ALL, NULL,
+        &handle);
+    IDXGIResource1_Release(res);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to share the texture", status);
+      goto fail;
+    }
+
+    if (!zerocopy_openShared(this, handle, &IID_ID3D12Resource,
+          (void **)&slot->res))
+      goto fail;
+
+    if (readback && !zerocopy_createReadback(this, slot))
+      goto fail;
+  }
+
+  *zc = this;
+  return true;
+
+fail:
+  zerocopy_free(&this);
+  return false;
+}
+
+#define RELEASE(type, x) if (x) { type##_Release(x); x = NULL; }
+
+void zerocopy_free(ZeroCopy ** zc)
+{
+  ZeroCopy * this = *zc;
+  if (!this)
+    return;
+
+  for(int i = 0; i < MAX_HEAPS; ++i)
+  {
+    RELEASE(ID3D12Resource, this->heaps[i].buffer);
+    RELEASE(ID3D12Heap    , this->heaps[i].heap  );
+  }
+
+  if (this->slots)
+  {
+    for(int i = 0; i < this->count; ++i)
+    {
+      struct Slot * slot = &this->slots[i];
+      if (slot->map)
+        ID3D12Resource_Unmap(slot->readback, 0, NULL);
+
+      RELEASE(ID3D12Resource           , slot->readback );
+      RELEASE(ID3D12GraphicsCommandList, slot->list     );
+      RELEASE(ID3D12CommandAllocator   , slot->allocator);
+      RELEASE(ID3D12Resource           , slot->res      );
+      RELEASE(ID3D11Texture2D          , slot->tex      );
+    }
+    free(this->slots);
+  }
+
+  RELEASE(ID3D12Fence              , this->sharedFence);
+  RELEASE(ID3D11Fence              , this->fence11    );
+  RELEASE(ID3D12Fence              , this->fence      );
+  RELEASE(ID3D12GraphicsCommandList, this->list       );
+  RELEASE(ID3D12CommandAllocator   , this->allocator  );
+  RELEASE(ID3D12CommandQueue       , this->queue      );
+  RELEASE(ID3D12Device3            , this->device     );
+
+  if (this->event)
+    CloseHandle(this->event);
+
+  if (this->d3d12)
+    FreeLibrary(this->d3d12);
+
+  free(this);
+  *zc = NULL;
+}
+
+unsigned int zerocopy_getPitch(ZeroCopy * this)
+{
+  return this->pitch;
+}
+
+ID3D11Texture2D * zerocopy_getTexture(ZeroCopy * this, int index)
+{
+  return this->slots[index].tex;
+}
+
+bool zerocopy_signal(ZeroCopy * this, ID3D11DeviceContext * context, int index)
+{
+  ID3D11DeviceContext4 * context4;
+  HRESULT status = ID3D11DeviceContext_QueryInterface(context,
+      &IID_ID3D11DeviceContext4, (void **)&context4);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("ID3D11DeviceContext4 is not available", status);
+    return false;
+  }
+
+  this->slots[index].ready = ++this->sharedValue;
+  status = ID3D11DeviceContext4_Signal(context4, this->fence11,
+      this->slots[index].ready);
+  ID3D11DeviceContext4_Release(context4);
+
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to signal the shared fence", status);
+    return false;
+  }
+
+  return true;
+}
+
+static struct Heap * zerocopy_getHeap(ZeroCopy * this, void * dst)
+{
+  for(int i = 0; i < MAX_HEAPS; ++i)
+    if (this->heaps[i].addr == dst && this->heaps[i].buffer)
+      return &this->heaps[i];
+
+  // replace the oldest mapping
+  struct Heap * h = &this->heaps[this->nextHeap];
+  if (++this->nextHeap == MAX_HEAPS)
+    this->nextHeap = 0;
+
+  RELEASE(ID3D12Resource, h->buffer);
+  RELEASE(ID3D12Heap    , h->heap  );
+  h->addr = NULL;
+
+  HRESULT status = ID3D12Device3_OpenExistingHeapFromAddress(this->device, dst,
+      &IID_ID3D12Heap, (void **)&h->heap);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("OpenExistingHeapFromAddress failed", status);
+    return NULL;
+  }
+
+  const D3D12_RESOURCE_DESC desc =
+  {
+    .Dimension        = D3D12_RESOURCE_DIMENSION_BUFFER,
+    .Width            = this->size,
+    .Height           = 1,
+    .DepthOrArraySize = 1,
+    .MipLevels        = 1,
+    .Format           = DXGI_FORMAT_UNKNOWN,
+    .SampleDesc.Count = 1,
+    .Layout           = D3D12_TEXTURE_LAYOUT_ROW_MAJOR,
+    .Flags            = D3D12_RESOURCE_FLAG_ALLOW_CROSS_ADAPTER
+  };
+
+  status = ID3D12Device3_CreatePlacedResource(this->device, h->heap, 0, &desc,
+      D3D12_RESOURCE_STATE_COPY_DEST, NULL, &IID_ID3D12Resource,
+      (void **)&h->buffer);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to place the frame buffer resource", status);
+    RELEASE(ID3D12Heap, h->heap);
+    return NULL;
+  }
+
+  h->addr = dst;
+  return h;
+}
+
+// record the copy of the rects of the slot's texture into the buffer, a count
+// of zero copies the whole texture
+static void zerocopy_record(ZeroCopy * this, ID3D12GraphicsCommandList * list,
+    int index, ID3D12Resource * buffer, const FrameDamageRect * rects,
+    unsigned int count)
+{
+  const D3D12_TEXTURE_COPY_LOCATION dstLoc =
+  {
+    .pResource       = buffer,
+    .Type            = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT,
+    .PlacedFootprint =
+    {
+      .Offset    = 0,
+      .Footprint =
+      {
+        .Format   = this->format,
+        .Width    = this->width,
+        .Height   = this->height,
+        .Depth    = 1,
+        .RowPitch = this->pitch
+      }
+    }
+  };
+
+  const D3D12_TEXTURE_COPY_LOCATION srcLoc =
+  {
+    .pResource        = this->slots[index].res,
+    .Type             = D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX,
+    .SubresourceIndex = 0
+  };
+
+  if (count == 0)
+    ID3D12GraphicsCommandList_CopyTextureRegion(list,
+        &dstLoc, 0, 0, 0, &srcLoc, NULL);
+  else
+    for(unsigned int i = 0; i < count; ++i)
+    {
+      const FrameDamageRect * r = &rects[i];
+      const D3D12_BOX box =
+      {
+        .left   = r->x,
+        .top    = r->y,
+        .front  = 0,
+        .right  = r->x + r->width,
+        .bottom = r->y + r->height,
+        .back   = 1
+      };
+
+      ID3D12GraphicsCommandList_CopyTextureRegion(list,
+          &dstLoc, r->x, r->y, 0, &srcLoc, &box);
+    }
+
+  ID3D12GraphicsCommandList_Close(list);
+}
+
+// run the list once D3D11 has finished writing the texture, returns the fence
+// value the copy completes at
+static UINT64 zerocopy_execute(ZeroCopy * this, ID3D12GraphicsCommandList * list,
+    int index)
+{
+  // wait on the GPU for D3D11 to finish writing the texture
+  ID3D12CommandQueue_Wait(this->queue, this->sharedFence,
+      this->slots[index].ready);
+
+  ID3D12CommandList * lists[] = { (ID3D12CommandList *)list };
+  ID3D12CommandQueue_ExecuteCommandLists(this->queue, 1, lists);
+  ID3D12CommandQueue_Signal(this->queue, this->fence, ++this->fenceValue);
+  return this->fenceValue;
+}
+
+static bool zerocopy_waitFence(ZeroCopy * this, UINT64 value)
+{
+  if (ID3D12Fence_GetCompletedValue(this->fence) >= value)
+    return true;
+
+  ID3D12Fence_SetEventOnCompletion(this->fence, value, this->event);
+  if (WaitForSingleObject(this->event, 1000) != WAIT_OBJECT_0)
+  {
+    DEBUG_ERROR("Timed out waiting for the frame copy");
+    return false;
+  }
+
+  return true;
+}
+
+bool zerocopy_copy(ZeroCopy * this, int index, void * dst,
+    const FrameDamageRect * rects, unsigned int count)
+{
+  if ((uintptr_t)dst & (ZEROCOPY_ALIGN - 1))
+  {
+    DEBUG_ERROR("The frame buffer is not aligned for zero copy");
+    return false;
+  }
+
+  struct Heap * h = zerocopy_getHeap(this, dst);
+  if (!h)
+    return false;
+
+  ID3D12CommandAllocator_Reset(this->allocator);
+  ID3D12GraphicsCommandList_Reset(this->list, this->allocator, NULL);
+  zerocopy_record(this, this->list, index, h->buffer, rects, count);
+
+  return zerocopy_waitFence(this, zerocopy_execute(this, this->list, index));
+}
+
+bool zerocopy_submit(ZeroCopy * this, int index, const FrameDamageRect * rects,
+    unsigned int count)
+{
+  // the slot is not reused until the reader is done with its last readback
+  struct Slot * slot = &this->slots[index];
+  ID3D12CommandAllocator_Reset(slot->allocator);
+  ID3D12GraphicsCommandList_Reset(slot->list, slot->allocator, NULL);
+  zerocopy_record(this, slot->list, index, slot->readback, rects, count);
+
+  slot->copied = zerocopy_execute(this, slot->list, index);
+  return true;
+}
+
+bool zerocopy_wait(ZeroCopy * this, int index, void ** data)
+{
+  struct Slot * slot = &this->slots[index];
+  if (!zerocopy_waitFence(this, slot->copied))
+    return false;
+
+  *data = slot->map;
+  return true;
+}
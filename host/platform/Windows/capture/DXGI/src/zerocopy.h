@@ -0,0 +1,78 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <dxgi.h>
+#include <d3d11.h>
+
+#include "common/KVMFR.h"
+
+typedef struct ZeroCopy ZeroCopy;
+
+// the alignment D3D12 requires of the shared memory the frame is written to
+#define ZEROCOPY_ALIGN 0x10000
+
+/**
+ * Create the D3D12 copy path. It owns count D3D11 textures shared with D3D12
+ * that take the place of the staging textures, these are copied on a D3D12
+ * copy queue either straight into shared memory by zerocopy_copy, or with
+ * readback into buffers in system memory by zerocopy_submit. A copy queue
+ * that is not high priority leaves the GPU to the guest's own work first.
+ */
+bool zerocopy_create(IDXGIAdapter1 * adapter, ID3D11Device * device,
+    int count, unsigned int width, unsigned int height, DXGI_FORMAT format,
+    bool readback, bool highPriority, ZeroCopy ** zc);
+
+void zerocopy_free(ZeroCopy ** zc);
+
+// the row pitch of the frame in shared memory
+unsigned int zerocopy_getPitch(ZeroCopy * zc);
+
+ID3D11Texture2D * zerocopy_getTexture(ZeroCopy * zc, int index);
+
+/**
+ * Mark the copy into the texture as complete, this must be called on the
+ * device context after the copy while it is locked
+ */
+bool zerocopy_signal(ZeroCopy * zc, ID3D11DeviceContext * context, int index);
+
+/**
+ * Copy the texture into dst which must be ZEROCOPY_ALIGN aligned, a count of
+ * zero copies the whole texture. Blocks until the GPU has finished. Does not
+ * touch the D3D11 device context.
+ */
+bool zerocopy_copy(ZeroCopy * zc, int index, void * dst,
+    const FrameDamageRect * rects, unsigned int count);
+
+/**
+ * Queue the readback of the rects of the texture after zerocopy_signal, a
+ * count of zero reads the whole texture. Does not wait, each texture has its
+ * own readback so several can be in flight. Does not touch the D3D11 device
+ * context.
+ */
+bool zerocopy_submit(ZeroCopy * zc, int index, const FrameDamageRect * rects,
+    unsigned int count);
+
+/**
+ * Wait for the last readback of the texture and get its data, the rows are
+ * zerocopy_getPitch apart. The data is valid until the next submit.
+ */
+bool zerocopy_wait(ZeroCopy * zc, int index, void ** data);
@@ -0,0 +1,916 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "interface/capture.h"
+#include "interface/platform.h"
+#include "common/debug.h"
+#include "common/windebug.h"
+#include "common/option.h"
+#include "common/locking.h"
+#include "common/time.h"
+#include "common/KVMFRIdd.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <wchar.h>
+#include <dxgi.h>
+#include <d3d11_1.h>
+
+#include "zerocopy.h"
+
+/*
+ * Frames from the Looking Glass indirect display driver, see
+ * common/KVMFRIdd.h. The driver hands each swapchain buffer over as a shared
+ * texture so there is no duplication API in the way, and it can be asked for
+ * any mode as the display is virtual.
+ */
+
+// missing from older mingw headers
+HRESULT __stdcall CreateDXGIFactory1(REFIID riid, void **factory);
+
+#define LOCKED(x) INTERLOCKED_SECTION(this->deviceContextLock, x)
+
+enum TextureState
+{
+  TEXTURE_STATE_UNUSED,
+  TEXTURE_STATE_PENDING_MAP,
+  TEXTURE_STATE_MAPPED
+};
+
+typedef struct Texture
+{
+  volatile enum TextureState state;
+  ID3D11Texture2D          * tex;
+  ID3D11Query              * query;
+  D3D11_MAPPED_SUBRESOURCE   map;
+
+  uint64_t                   presentTime;
+  unsigned int               damageRectsCount;
+  FrameDamageRect            damageRects[KVMFR_MAX_DAMAGE_RECTS];
+}
+Texture;
+
+struct iface
+{
+  bool                       initialized;
+  volatile bool              stop;
+
+  HANDLE                     mapping;
+  KVMFRIdd                 * idd;
+  HANDLE                     frameEvent;
+
+  IDXGIAdapter1            * adapter;
+  ID3D11Device             * device;
+  ID3D11DeviceContext      * deviceContext;
+  LG_Lock                    deviceContextLock;
+
+  // the driver's textures and the formatVer they were opened at
+  ID3D11Texture2D          * shared[KVMFR_IDD_TEXTURES];
+  IDXGIKeyedMutex          * mutex [KVMFR_IDD_TEXTURES];
+  uint32_t                   driverFormatVer;
+  uint64_t                   lastSerial;
+
+  bool                       followClient;
+  bool                       pointerSent;
+  bool                       useZeroCopy;
+  bool                       copyHighPriority;
+  ZeroCopy                 * zeroCopy;
+
+  int                        maxTextures;
+  Texture                  * texture;
+  int                        texRIndex;
+  int                        texWIndex;
+  atomic_int                 texReady;
+  HANDLE                     readyEvent;
+
+  CaptureGetPointerBuffer    getPointerBufferFn;
+  CapturePostPointerBuffer   postPointerBufferFn;
+
+  unsigned int               formatVer;
+  unsigned int               width;
+  unsigned int               height;
+  unsigned int               pitch;
+  unsigned int               stride;
+  unsigned int               bpp;
+  DXGI_FORMAT                dxgiFormat;
+  CaptureFormat              format;
+};
+
+static struct iface * this = NULL;
+
+static bool idd_deinit();
+
+static const char * idd_getName()
+{
+  return "IDD";
+}
+
+static void idd_initOptions()
+{
+  struct Option options[] =
+  {
+    {
+      .module         = "idd",
+      .name           = "enable",
+      .description    = "Capture from the indirect display driver when it is installed",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {
+      .module         = "idd",
+      .name           = "followClient",
+      .description    = "Ask the driver for a mode the size of the client's window",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "idd",
+      .name           = "maxTextures",
+      .description    = "The maximum number of frames to buffer before skipping frames",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 3
+    },
+    {
+      .module         = "idd",
+      .name           = "zeroCopy",
+      .description    = "Copy frames into shared memory on the GPU with D3D12",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "idd",
+      .name           = "copyHighPriority",
+      .description    = "Run the D3D12 copy queue at high priority",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {0}
+  };
+
+  option_register(options);
+}
+
+static bool idd_create(CaptureGetPointerBuffer getPointerBufferFn, CapturePostPointerBuffer postPointerBufferFn)
+{
+  assert(!this);
+
+  if (!option_get_bool("idd", "enable"))
+    return false;
+
+  // the driver is not installed or has no display, this is not an error
+  HANDLE mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, KVMFR_IDD_MAPPING);
+  if (!mapping)
+    return false;
+
+  this = (struct iface *)calloc(sizeof(struct iface), 1);
+  if (!this)
+  {
+    DEBUG_ERROR("failed to allocate idd struct");
+    CloseHandle(mapping);
+    return false;
+  }
+
+  this->mapping = mapping;
+  this->idd     = (KVMFRIdd *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0,
+      sizeof(KVMFRIdd));
+  if (!this->idd)
+  {
+    DEBUG_WINERROR("Failed to map the driver's header", GetLastError());
+    goto fail;
+  }
+
+  if (memcmp(this->idd->magic, KVMFR_IDD_MAGIC, sizeof(this->idd->magic)) != 0 ||
+      this->idd->version != KVMFR_IDD_VERSION)
+  {
+    DEBUG_ERROR("The indirect display driver is not compatible (version %u, expected %u)",
+        this->idd->version, KVMFR_IDD_VERSION);
+    goto fail;
+  }
+
+  this->frameEvent = OpenEventA(SYNCHRONIZE, FALSE, KVMFR_IDD_EVENT);
+  if (!this->frameEvent)
+  {
+    DEBUG_WINERROR("Failed to open the driver's frame event", GetLastError());
+    goto fail;
+  }
+
+  this->readyEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (!this->readyEvent)
+  {
+    DEBUG_WINERROR("Failed to create the ready event", GetLastError());
+    goto fail;
+  }
+
+  this->followClient     = option_get_bool("idd", "followClient"    );
+  this->maxTextures      = option_get_int ("idd", "maxTextures"     );
+  this->useZeroCopy      = option_get_bool("idd", "zeroCopy"        );
+  this->copyHighPriority = option_get_bool("idd", "copyHighPriority");
+  if (this->maxTextures <= 0)
+    this->maxTextures = 1;
+
+  this->texture = calloc(sizeof(Texture), this->maxTextures);
+  if (!this->texture)
+  {
+    DEBUG_ERROR("failed to allocate the textures");
+    goto fail;
+  }
+
+  this->getPointerBufferFn  = getPointerBufferFn;
+  this->postPointerBufferFn = postPointerBufferFn;
+  return true;
+
+fail:
+  if (this->readyEvent)
+    CloseHandle(this->readyEvent);
+  if (this->frameEvent)
+    CloseHandle(this->frameEvent);
+  if (this->idd)
+    UnmapViewOfFile(this->idd);
+  CloseHandle(this->mapping);
+  free(this);
+  this = NULL;
+  return false;
+}
+
+static bool idd_createDevice()
+{
+  IDXGIFactory1 * factory;
+  HRESULT status = CreateDXGIFactory1(&IID_IDXGIFactory1, (void **)&factory);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create DXGIFactory1", status);
+    return false;
+  }
+
+  // the textures can only be opened on the adapter the driver renders with
+  IDXGIAdapter1 * adapter;
+  for(int i = 0; IDXGIFactory1_EnumAdapters1(factory, i, &adapter) != DXGI_ERROR_NOT_FOUND; ++i)
+  {
+    DXGI_ADAPTER_DESC1 desc;
+    IDXGIAdapter1_GetDesc1(adapter, &desc);
+    if (desc.AdapterLuid.LowPart  == this->idd->adapterLuidLow &&
+        desc.AdapterLuid.HighPart == this->idd->adapterLuidHigh)
+    {
+      DEBUG_INFO("Device Name      : %ls", desc.Description);
+      this->adapter = adapter;
+      break;
+    }
+    IDXGIAdapter1_Release(adapter);
+  }
+  IDXGIFactory1_Release(factory);
+
+  if (!this->adapter)
+  {
+    DEBUG_ERROR("The driver's render adapter was not found");
+    return false;
+  }
+
+  IDXGIAdapter * tmp;
+  status = IDXGIAdapter1_QueryInterface(this->adapter, &IID_IDXGIAdapter, (void **)&tmp);
+  if (FAILED(status))
+  {
+    DEBUG_ERROR("Failed to query IDXGIAdapter interface");
+    return false;
+  }
+
+  status = D3D11CreateDevice(
+    tmp,
+    D3D_DRIVER_TYPE_UNKNOWN,
+    NULL,
+    0,
+    NULL, 0,
+    D3D11_SDK_VERSION,
+    &this->device,
+    NULL,
+    &this->deviceContext);
+  IDXGIAdapter_Release(tmp);
+
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create D3D11 device", status);
+    return false;
+  }
+
+  LG_LOCK_INIT(this->deviceContextLock);
+  return true;
+}
+
+static bool idd_openShared()
+{
+  ID3D11Device1 * device1;
+  HRESULT status = ID3D11Device_QueryInterface(this->device, &IID_ID3D11Device1,
+      (void **)&device1);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to query the ID3D11Device1 interface", status);
+    return false;
+  }
+
+  bool ok = true;
+  for(int i = 0; i < KVMFR_IDD_TEXTURES; ++i)
+  {
+    wchar_t name[64];
+    swprintf(name, sizeof(name) / sizeof(*name), KVMFR_IDD_TEXTURE, i);
+
+    status = ID3D11Device1_OpenSharedResourceByName(device1, name,
+        DXGI_SHARED_RESOURCE_READ, &IID_ID3D11Texture2D,
+        (void **)&this->shared[i]);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to open the driver's texture", status);
+      ok = false;
+      break;
+    }
+
+    status = ID3D11Texture2D_QueryInterface(this->shared[i],
+        &IID_IDXGIKeyedMutex, (void **)&this->mutex[i]);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("The driver's texture has no keyed mutex", status);
+      ok = false;
+      break;
+    }
+  }
+
+  ID3D11Device1_Release(device1);
+  return ok;
+}
+
+static bool idd_setFormat()
+{
+  this->dxgiFormat = this->idd->format;
+  switch(this->dxgiFormat)
+  {
+    case DXGI_FORMAT_B8G8R8A8_UNORM    : this->format = CAPTURE_FMT_BGRA   ; this->bpp = 4; break;
+    case DXGI_FORMAT_R8G8B8A8_UNORM    : this->format = CAPTURE_FMT_RGBA   ; this->bpp = 4; break;
+    case DXGI_FORMAT_R10G10B10A2_UNORM : this->format = CAPTURE_FMT_RGBA10 ; this->bpp = 4; break;
+    case DXGI_FORMAT_R16G16B16A16_FLOAT: this->format = CAPTURE_FMT_RGBA16F; this->bpp = 8; break;
+
+    default:
+      DEBUG_ERROR("Unsupported source format: %u", (unsigned int)this->dxgiFormat);
+      return false;
+  }
+
+  return true;
+}
+
+static bool idd_createTextures()
+{
+  HRESULT status;
+
+  if (this->useZeroCopy)
+  {
+    if (zerocopy_create(this->adapter, this->device, this->maxTextures,
+          this->width, this->height, this->dxgiFormat, false,
+          this->copyHighPriority, &this->zeroCopy))
+    {
+      // the shared textures take the place of the staging textures
+      for(int i = 0; i < this->maxTextures; ++i)
+      {
+        this->texture[i].tex = zerocopy_getTexture(this->zeroCopy, i);
+        ID3D11Texture2D_AddRef(this->texture[i].tex);
+      }
+
+      this->pitch  = zerocopy_getPitch(this->zeroCopy);
+      this->stride = this->pitch / this->bpp;
+      DEBUG_INFO("Zero copy        : enabled");
+      return true;
+    }
+
+    DEBUG_WARN("Zero copy is not available, falling back to staging textures");
+  }
+
+  D3D11_TEXTURE2D_DESC texDesc;
+  memset(&texDesc, 0, sizeof(texDesc));
+  texDesc.Width              = this->width;
+  texDesc.Height             = this->height;
+  texDesc.MipLevels          = 1;
+  texDesc.ArraySize          = 1;
+  texDesc.SampleDesc.Count   = 1;
+  texDesc.SampleDesc.Quality = 0;
+  texDesc.Usage              = D3D11_USAGE_STAGING;
+  texDesc.Format             = this->dxgiFormat;
+  texDesc.BindFlags          = 0;
+  texDesc.CPUAccessFlags     = D3D11_CPU_ACCESS_READ;
+  texDesc.MiscFlags          = 0;
+
+  const D3D11_QUERY_DESC queryDesc =
+  {
+    .Query     = D3D11_QUERY_EVENT,
+    .MiscFlags = 0
+  };
+
+  for(int i = 0; i < this->maxTextures; ++i)
+  {
+    status = ID3D11Device_CreateTexture2D(this->device, &texDesc, NULL,
+        &this->texture[i].tex);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to create texture", status);
+      return false;
+    }
+
+    status = ID3D11Device_CreateQuery(this->device, &queryDesc,
+        &this->texture[i].query);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to create the event query", status);
+      return false;
+    }
+  }
+
+  // map the texture simply to get the pitch and stride
+  D3D11_MAPPED_SUBRESOURCE mapping;
+  status = ID3D11DeviceContext_Map(this->deviceContext,
+      (ID3D11Resource *)this->texture[0].tex, 0, D3D11_MAP_READ, 0, &mapping);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to map the texture", status);
+    return false;
+  }
+  this->pitch  = mapping.RowPitch;
+  this->stride = mapping.RowPitch / this->bpp;
+  ID3D11DeviceContext_Unmap(this->deviceContext,
+      (ID3D11Resource *)this->texture[0].tex, 0);
+  return true;
+}
+
+static bool idd_init()
+{
+  assert(this);
+
+  this->stop        = false;
+  this->pointerSent = false;
+  this->texRIndex   = 0;
+  this->texWIndex   = 0;
+  atomic_store(&this->texReady, 0);
+  ResetEvent(this->readyEvent);
+
+  if (!idd_createDevice())
+    goto fail;
+
+  // the mode may change while the textures are opened, start again if so
+  for(int retry = 0; ; ++retry)
+  {
+    this->driverFormatVer = this->idd->formatVer;
+    atomic_thread_fence(memory_order_acquire);
+    this->width  = this->idd->width;
+    this->height = this->idd->height;
+
+    if (!idd_setFormat() || !this->width || !this->height)
+      goto fail;
+
+    const bool ok = idd_openShared();
+    atomic_thread_fence(memory_order_acquire);
+    if (this->idd->formatVer == this->driverFormatVer)
+    {
+      if (!ok)
+        goto fail;
+      break;
+    }
+
+    for(int i = 0; i < KVMFR_IDD_TEXTURES; ++i)
+    {
+      if (this->mutex[i])
+        IDXGIKeyedMutex_Release(this->mutex[i]);
+      if (this->shared[i])
+        ID3D11Texture2D_Release(this->shared[i]);
+      this->mutex[i]  = NULL;
+      this->shared[i] = NULL;
+    }
+
+    if (retry == 10)
+    {
+      DEBUG_ERROR("The driver's mode did not settle");
+      goto fail;
+    }
+  }
+
+  if (!idd_createTextures())
+    goto fail;
+
+  // anything currently in the textures may be older than the last frame sent
+  this->lastSerial = 0;
+
+  DEBUG_INFO("Capture Size     : %u x %u @ %u Hz", this->width, this->height,
+      this->idd->refresh);
+  DEBUG_INFO("Max Textures     : %d", this->maxTextures);
+
+  ++this->formatVer;
+  this->initialized = true;
+  return true;
+
+fail:
+  idd_deinit();
+  return false;
+}
+
+static void idd_stop()
+{
+  this->stop = true;
+  SetEvent(this->readyEvent);
+}
+
+static bool idd_deinit()
+{
+  assert(this);
+
+  for(int i = 0; i < this->maxTextures; ++i)
+  {
+    Texture * tex = &this->texture[i];
+    if (tex->map.pData)
+    {
+      ID3D11DeviceContext_Unmap(this->deviceContext, (ID3D11Resource *)tex->tex, 0);
+      tex->map.pData = NULL;
+    }
+
+    if (tex->tex)
+    {
+      ID3D11Texture2D_Release(tex->tex);
+      tex->tex = NULL;
+    }
+
+    if (tex->query)
+    {
+      ID3D11Query_Release(tex->query);
+      tex->query = NULL;
+    }
+
+    tex->state = TEXTURE_STATE_UNUSED;
+  }
+
+  zerocopy_free(&this->zeroCopy);
+
+  for(int i = 0; i < KVMFR_IDD_TEXTURES; ++i)
+  {
+    if (this->mutex[i])
+    {
+      IDXGIKeyedMutex_Release(this->mutex[i]);
+      this->mutex[i] = NULL;
+    }
+
+    if (this->shared[i])
+    {
+      ID3D11Texture2D_Release(this->shared[i]);
+      this->shared[i] = NULL;
+    }
+  }
+
+  if (this->deviceContext)
+  {
+    ID3D11DeviceContext_Release(this->deviceContext);
+    this->deviceContext = NULL;
+    LG_LOCK_FREE(this->deviceContextLock);
+  }
+
+  if (this->device)
+  {
+    ID3D11Device_Release(this->device);
+    this->device = NULL;
+  }
+
+  if (this->adapter)
+  {
+    IDXGIAdapter1_Release(this->adapter);
+    this->adapter = NULL;
+  }
+
+  this->initialized = false;
+  return true;
+}
+
+static void idd_free()
+{
+  assert(this);
+
+  if (this->initialized)
+    idd_deinit();
+
+  CloseHandle(this->readyEvent);
+  CloseHandle(this->frameEvent);
+  UnmapViewOfFile(this->idd);
+  CloseHandle(this->mapping);
+  free(this->texture);
+
+  free(this);
+  this = NULL;
+}
+
+static size_t idd_getMaxFrameSize()
+{
+  assert(this);
+  assert(this->initialized);
+
+  // the GPU writes whole aligned blocks
+  if (this->zeroCopy)
+    return ((size_t)this->height * this->pitch + ZEROCOPY_ALIGN - 1) &
+      ~(size_t)(ZEROCOPY_ALIGN - 1);
+
+  return (size_t)this->height * this->pitch;
+}
+
+// take a consistent copy of the last frame the driver published
+static uint64_t idd_readFrame(KVMFRIddFrame * frame)
+{
+  for(;;)
+  {
+    const uint64_t serial = this->idd->serial;
+    atomic_thread_fence(memory_order_acquire);
+    memcpy(frame, (const void *)&this->idd->frame, sizeof(*frame));
+    atomic_thread_fence(memory_order_acquire);
+    if (this->idd->serial == serial)
+      return serial;
+  }
+}
+
+static CaptureResult idd_capture()
+{
+  assert(this);
+  assert(this->initialized);
+
+  // IddCx composes the cursor into the frame when the driver does not set up
+  // a hardware cursor, so there is never one to send
+  if (!this->pointerSent)
+  {
+    const CapturePointer pointer =
+    {
+      .positionUpdate = true,
+      .visible        = false
+    };
+    this->postPointerBufferFn(pointer);
+    this->pointerSent = true;
+  }
+
+  switch(WaitForSingleObject(this->frameEvent, 1000))
+  {
+    case WAIT_OBJECT_0:
+      break;
+
+    case WAIT_TIMEOUT:
+      return CAPTURE_RESULT_TIMEOUT;
+
+    default:
+      DEBUG_WINERROR("Failed to wait on the frame event", GetLastError());
+      return CAPTURE_RESULT_ERROR;
+  }
+
+  if (this->stop)
+    return CAPTURE_RESULT_TIMEOUT;
+
+  if (this->idd->formatVer != this->driverFormatVer)
+  {
+    DEBUG_INFO("The driver's mode changed");
+    return CAPTURE_RESULT_REINIT;
+  }
+
+  KVMFRIddFrame info;
+  const uint64_t serial = idd_readFrame(&info);
+  if (serial == this->lastSerial || info.index >= KVMFR_IDD_TEXTURES)
+    return CAPTURE_RESULT_TIMEOUT;
+
+  Texture * tex = &this->texture[this->texWIndex];
+  if (tex->state != TEXTURE_STATE_UNUSED)
+  {
+    // the client is behind, skip this frame
+    return CAPTURE_RESULT_TIMEOUT;
+  }
+
+  HRESULT status = IDXGIKeyedMutex_AcquireSync(this->mutex[info.index], 0, 100);
+  if (status == WAIT_TIMEOUT)
+    return CAPTURE_RESULT_TIMEOUT;
+
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to acquire the driver's texture", status);
+    return CAPTURE_RESULT_ERROR;
+  }
+
+  LOCKED(
+  {
+    ID3D11DeviceContext_CopyResource(this->deviceContext,
+        (ID3D11Resource *)tex->tex, (ID3D11Resource *)this->shared[info.index]);
+
+    if (this->zeroCopy)
+      zerocopy_signal(this->zeroCopy, this->deviceContext, this->texWIndex);
+    else
+      ID3D11DeviceContext_End(this->deviceContext,
+          (ID3D11Asynchronous *)tex->query);
+
+    ID3D11DeviceContext_Flush(this->deviceContext);
+  });
+
+  IDXGIKeyedMutex_ReleaseSync(this->mutex[info.index], 0);
+
+  // the damage is only complete if no frame was skipped
+  tex->presentTime = info.presentTime;
+  if (this->lastSerial && serial == this->lastSerial + 1 &&
+      info.damageRectsCount <= KVMFR_MAX_DAMAGE_RECTS)
+  {
+    tex->damageRectsCount = info.damageRectsCount;
+    memcpy(tex->damageRects, info.damageRects,
+        info.damageRectsCount * sizeof(FrameDamageRect));
+  }
+  else
+    tex->damageRectsCount = 0;
+
+  this->lastSerial = serial;
+
+  tex->state = TEXTURE_STATE_PENDING_MAP;
+  if (++this->texWIndex == this->maxTextures)
+    this->texWIndex = 0;
+
+  atomic_fetch_add_explicit(&this->texReady, 1, memory_order_release);
+  SetEvent(this->readyEvent);
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult idd_waitTexture(Texture * tex)
+{
+  // queries must be polled through the context, this only holds the lock
+  // for a moment each time
+  for(int i = 0; ; ++i)
+  {
+    HRESULT status;
+    LOCKED({status = ID3D11DeviceContext_GetData(this->deviceContext,
+        (ID3D11Asynchronous *)tex->query, NULL, 0,
+        D3D11_ASYNC_GETDATA_DONOTFLUSH);});
+
+    if (status == S_OK)
+      return CAPTURE_RESULT_OK;
+
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to get the query data", status);
+      return CAPTURE_RESULT_ERROR;
+    }
+
+    if (i == 1000)
+      return CAPTURE_RESULT_TIMEOUT;
+
+    if (i < 100)
+      YieldProcessor();
+    else
+      nsleep(1000);
+  }
+}
+
+static CaptureResult idd_waitFrame(CaptureFrame * frame)
+{
+  assert(this);
+  assert(this->initialized);
+
+  // NOTE: the event may be signaled when there are no frames available
+  if (atomic_load_explicit(&this->texReady, memory_order_acquire) == 0)
+  {
+    if (WaitForSingleObject(this->readyEvent, 1000) != WAIT_OBJECT_0)
+      return CAPTURE_RESULT_TIMEOUT;
+
+    if (atomic_load_explicit(&this->texReady, memory_order_acquire) == 0)
+      return CAPTURE_RESULT_TIMEOUT;
+  }
+
+  Texture * tex = &this->texture[this->texRIndex];
+
+  // with zero copy the GPU writes the frame in getFrame
+  if (!this->zeroCopy)
+  {
+    CaptureResult result = idd_waitTexture(tex);
+    if (result != CAPTURE_RESULT_OK)
+      return result;
+
+    HRESULT status;
+    LOCKED({status = ID3D11DeviceContext_Map(this->deviceContext,
+        (ID3D11Resource *)tex->tex, 0, D3D11_MAP_READ, 0, &tex->map);});
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to map the texture", status);
+      return CAPTURE_RESULT_ERROR;
+    }
+  }
+
+  tex->state = TEXTURE_STATE_MAPPED;
+
+  frame->formatVer        = this->formatVer;
+  frame->width            = this->width;
+  frame->height           = this->height;
+  frame->screenWidth      = this->width;
+  frame->screenHeight     = this->height;
+  frame->pitch            = this->pitch;
+  frame->stride           = this->stride;
+  frame->format           = this->format;
+  frame->presentTime      = tex->presentTime;
+  frame->damageRectsCount = tex->damageRectsCount;
+  memcpy(frame->damageRects, tex->damageRects,
+      tex->damageRectsCount * sizeof(FrameDamageRect));
+
+  atomic_fetch_sub_explicit(&this->texReady, 1, memory_order_release);
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult idd_getFrame(FrameBuffer * frame,
+    const FrameDamageRect * rects, unsigned int rectsCount)
+{
+  assert(this);
+  assert(this->initialized);
+
+  Texture * tex = &this->texture[this->texRIndex];
+
+  if (this->zeroCopy)
+  {
+    // the reader can only see the frame once the GPU copy has completed
+    if (!zerocopy_copy(this->zeroCopy, this->texRIndex,
+          framebuffer_get_write_data(frame), rects, rectsCount))
+      return CAPTURE_RESULT_ERROR;
+
+    framebuffer_set_write_ptr(frame, this->pitch * this->height);
+  }
+  else
+  {
+    if (rectsCount == 0)
+      framebuffer_write(frame, tex->map.pData, this->pitch * this->height);
+    else
+      framebuffer_write_rects(frame, tex->map.pData, this->pitch, this->height,
+          this->bpp, rects, rectsCount);
+
+    LOCKED({ID3D11DeviceContext_Unmap(this->deviceContext,
+        (ID3D11Resource *)tex->tex, 0);});
+    tex->map.pData = NULL;
+  }
+
+  tex->state = TEXTURE_STATE_UNUSED;
+  if (++this->texRIndex == this->maxTextures)
+    this->texRIndex = 0;
+
+  return CAPTURE_RESULT_OK;
+}
+
+static void idd_request()
+{
+  atomic_thread_fence(memory_order_release);
+  ++this->idd->requestSerial;
+}
+
+static void idd_setTargetSize(unsigned int width, unsigned int height)
+{
+  assert(this);
+
+  // the display is virtual so it can be made the size it is shown at rather
+  // than scaling the frame
+  if (!this->followClient)
+    return;
+
+  this->idd->requestWidth  = width  & ~1U;
+  this->idd->requestHeight = height & ~1U;
+  idd_request();
+}
+
+static void idd_setFrameRate(unsigned int maxFPS)
+{
+  assert(this);
+  if (!this->followClient)
+    return;
+
+  this->idd->requestRefresh = maxFPS;
+  idd_request();
+}
+
+static void idd_wakeFrame()
+{
+  assert(this);
+  SetEvent(this->readyEvent);
+}
+
+struct CaptureInterface Capture_IDD =
+{
+  .getName         = idd_getName,
+  .initOptions     = idd_initOptions,
+  .create          = idd_create,
+  .init            = idd_init,
+  .stop            = idd_stop,
+  .deinit          = idd_deinit,
+  .free            = idd_free,
+  .getMaxFrameSize = idd_getMaxFrameSize,
+  .capture         = idd_capture,
+  .waitFrame       = idd_waitFrame,
+  .getFrame        = idd_getFrame,
+  .setTargetSize   = idd_setTargetSize,
+  .setFrameRate    = idd_setFrameRate,
+  .wakeFrame       = idd_wakeFrame
+};
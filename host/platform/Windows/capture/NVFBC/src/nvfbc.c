@@ -25,6 +25,8 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "common/framebuffer.h"
 #include "common/event.h"
 #include "common/thread.h"
+#include "common/locking.h"
+#include "common/damage.h"
 #include <assert.h>
 #include <stdlib.h>
 #include <windows.h>
@@ -32,10 +34,20 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <NvFBC/nvFBC.h>
 #include "wrapper.h"
 
+#define DIFFMAP_BLOCK 128
+
+// the number of bands the CUDA copy is published in
+#define CUDA_BANDS 8
+
 struct iface
 {
-  bool        stop;
-  NvFBCHandle nvfbc;
+  bool            stop;
+  NvFBCHandle     nvfbc;
+  NvFBCCudaHandle cuda;
+
+  // the buffer holding the newest grab and the one being copied out, or -1
+  int                cudaLatest, cudaReading;
+  NvFBCFrameGrabInfo cudaGrabInfo[NVFBC_CUDA_BUFFERS];
 
   bool                       seperateCursor;
   CaptureGetPointerBuffer    getPointerBufferFn;
@@ -45,6 +57,13 @@ struct iface
   unsigned int maxWidth , maxHeight;
   unsigned int width    , height;
 
+  // the size requested by the client
+  volatile unsigned int targetWidth, targetHeight;
+
+  // the region to capture, and the clamped region of the last grab
+  CaptureRect crop;
+  CaptureRect region;
+
   unsigned int formatVer;
   unsigned int grabWidth, grabHeight, grabStride;
 
@@ -52,6 +71,8 @@ struct iface
   uint8_t * diffMap;
 
   NvFBCFrameGrabInfo grabInfo;
+  LG_Lock            damageLock;
+  FrameDamage        damage;
 
   LGEvent * frameEvent;
   LGEvent * cursorEvents[2];
@@ -98,10 +119,17 @@ static void nvfbc_initOptions()
     {
       .module         = "nvfbc",
       .name           = "decoupleCursor",
-      .description    = "Capture the cursor seperately",
+      .description    = "Capture the cursor separately so moving it sends a cursor update instead of a frame",
       .type           = OPTION_TYPE_BOOL,
       .value.x_bool   = true
     },
+    {
+      .module         = "nvfbc",
+      .name           = "cuda",
+      .description    = "Grab into CUDA memory and DMA the frame into shared memory (Quadro only)",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
     {0}
   };
 
@@ -137,7 +165,14 @@ static bool nvfbc_create(
   }
 
   this = (struct iface *)calloc(sizeof(struct iface), 1);
-  if (!NvFBCToSysCreate(privData, privDataLen, &this->nvfbc, &this->maxWidth, &this->maxHeight))
+  if (option_get_bool("nvfbc", "cuda"))
+  {
+    if (!NvFBCToCudaCreate(privData, privDataLen, &this->cuda, &this->maxWidth, &this->maxHeight))
+      DEBUG_WARN("NvFBCToCuda is not available, falling back to NvFBCToSys");
+  }
+
+  if (!this->cuda &&
+      !NvFBCToSysCreate(privData, privDataLen, &this->nvfbc, &this->maxWidth, &this->maxHeight))
   {
     free(privData);
     nvfbc_free();
@@ -153,6 +188,8 @@ static bool nvfbc_create(
     return false;
   }
 
+  LG_LOCK_INIT(this->damageLock);
+
   this->seperateCursor      = option_get_bool("nvfbc", "decoupleCursor");
   this->getPointerBufferFn  = getPointerBufferFn;
   this->postPointerBufferFn = postPointerBufferFn;
@@ -164,10 +201,27 @@ static bool nvfbc_init()
 {
   this->stop = false;
   getDesktopSize(&this->width, &this->height);
+  this->region = (CaptureRect){ 0, 0, this->width, this->height };
   lgResetEvent(this->frameEvent);
+  damage_set_full(&this->damage);
 
   HANDLE event;
-  if (!NvFBCToSysSetup(
+  if (this->cuda)
+  {
+    this->cudaLatest  = -1;
+    this->cudaReading = -1;
+
+    if (!NvFBCToCudaSetup(
+      this->cuda,
+      BUFFER_FMT_ARGB,
+      this->seperateCursor,
+      &event
+    ))
+    {
+      return false;
+    }
+  }
+  else if (!NvFBCToSysSetup(
     this->nvfbc,
     BUFFER_FMT_ARGB,
     !this->seperateCursor,
@@ -189,6 +243,7 @@ static bool nvfbc_init()
     this->cursorEvents[1] = lgWrapEvent(event);
 
   DEBUG_INFO("Cursor mode      : %s", this->seperateCursor ? "decoupled" : "integrated");
+  DEBUG_INFO("Interface        : %s", this->cuda ? "NvFBCToCuda" : "NvFBCToSys");
 
   Sleep(100);
 
@@ -230,7 +285,8 @@ static bool nvfbc_deinit()
 
 static void nvfbc_free()
 {
-  NvFBCToSysRelease(&this->nvfbc);
+  NvFBCToSysRelease (&this->nvfbc);
+  NvFBCToCudaRelease(&this->cuda );
 
   if (this->frameEvent)
     lgFreeEvent(this->frameEvent);
@@ -240,42 +296,167 @@ static void nvfbc_free()
   NvFBCFree();
 }
 
-static unsigned int nvfbc_getMaxFrameSize()
+static size_t nvfbc_getMaxFrameSize()
+{
+  if (this->cuda)
+    return NvFBCToCudaGetBufferSize(this->cuda);
+
+  return (size_t)this->maxWidth * this->maxHeight * 4;
+}
+
+static CaptureResult nvfbc_captureCuda()
 {
-  return this->maxWidth * this->maxHeight * 4;
+  // grab into a buffer that is neither waiting to be sent nor being copied out
+  // so the next grab overlaps the DMA of the prior one
+  int buffer;
+  LG_LOCK(this->damageLock);
+  for(buffer = 0; buffer < NVFBC_CUDA_BUFFERS; ++buffer)
+    if (buffer != this->cudaLatest && buffer != this->cudaReading)
+      break;
+  LG_UNLOCK(this->damageLock);
+
+  NvFBCFrameGrabInfo * grabInfo = &this->cudaGrabInfo[buffer];
+  CaptureResult result = NvFBCToCudaCapture(
+    this->cuda,
+    1000,
+    buffer,
+    grabInfo
+  );
+
+  if (result != CAPTURE_RESULT_OK)
+    return result;
+
+  // there is no diff map for CUDA grabs, every frame is sent whole
+  LG_LOCK(this->damageLock);
+  damage_set_full(&this->damage);
+  this->cudaLatest = buffer;
+  LG_UNLOCK(this->damageLock);
+
+  lgSignalEvent(this->frameEvent);
+  return CAPTURE_RESULT_OK;
+}
+
+static bool nvfbc_diffMapChanged(unsigned int w, unsigned int h)
+{
+  for(unsigned int i = 0; i < w * h; ++i)
+    if (this->diffMap[i])
+      return true;
+  return false;
 }
 
 static CaptureResult nvfbc_capture()
 {
+  if (this->cuda)
+    return nvfbc_captureCuda();
+
   getDesktopSize(&this->width, &this->height);
+
+  // NvFBC can either crop or scale the frame down to the size the client
+  // displays it at, but not both
+  CaptureRect  region  = this->crop;
+  const bool   cropped = captureClampCrop(this->width, this->height, &region);
+  unsigned int width   = region.width, height = region.height;
+  const bool   scale   = !cropped && captureFitTarget(this->width, this->height,
+      this->targetWidth, this->targetHeight, &width, &height);
+
   NvFBCFrameGrabInfo grabInfo;
   CaptureResult result = NvFBCToSysCapture(
     this->nvfbc,
     1000,
-    0, 0,
-    this->width,
-    this->height,
+    region.x, region.y,
+    width,
+    height,
+    scale,
     &grabInfo
   );
 
   if (result != CAPTURE_RESULT_OK)
     return result;
 
-  bool changed = false;
-  const unsigned int h = (this->height + 127) / 128;
-  const unsigned int w = (this->width  + 127) / 128;
-  for(unsigned int y = 0; y < h; ++y)
-    for(unsigned int x = 0; x < w; ++x)
-      if (this->diffMap[(y*w)+x])
+  this->region = region;
+
+  const unsigned int h = (this->height + DIFFMAP_BLOCK - 1) / DIFFMAP_BLOCK;
+  const unsigned int w = (this->width  + DIFFMAP_BLOCK - 1) / DIFFMAP_BLOCK;
+
+  // the diff map is in desktop blocks which do not map onto the scaled or
+  // cropped frame, but an empty map still means the grab only woke for the
+  // decoupled cursor and there is no frame to send
+  if (scale || cropped)
+  {
+    if (!nvfbc_diffMapChanged(w, h))
+      return CAPTURE_RESULT_TIMEOUT;
+
+    LG_LOCK(this->damageLock);
+    damage_set_full(&this->damage);
+    memcpy(&this->grabInfo, &grabInfo, sizeof(grabInfo));
+    LG_UNLOCK(this->damageLock);
+
+    lgSignalEvent(this->frameEvent);
+    return CAPTURE_RESULT_OK;
+  }
+
+  // convert the changed blocks into rects, joining horizontal runs of blocks
+  // and then runs on consecutive rows that line up
+  FrameDamageRect    rects[KVMFR_MAX_DAMAGE_RECTS];
+  unsigned int       count    = 0;
+  bool               overflow = false;
+  for(unsigned int y = 0; y < h && !overflow; ++y)
+    for(unsigned int x = 0; x < w && !overflow; ++x)
+    {
+      if (!this->diffMap[(y*w)+x])
+        continue;
+
+      unsigned int end = x + 1;
+      while(end < w && this->diffMap[(y*w)+end])
+        ++end;
+
+      const unsigned int left   = x * DIFFMAP_BLOCK;
+      const unsigned int top    = y * DIFFMAP_BLOCK;
+      const unsigned int right  = min(end     * DIFFMAP_BLOCK, grabInfo.dwWidth );
+      const unsigned int bottom = min((y + 1) * DIFFMAP_BLOCK, grabInfo.dwHeight);
+      x = end;
+
+      if (right <= left || bottom <= top)
+        continue;
+
+      const FrameDamageRect r =
       {
-        changed = true;
-        break;
-      }
+        .x      = left,
+        .y      = top,
+        .width  = right  - left,
+        .height = bottom - top
+      };
+
+      unsigned int i;
+      for(i = 0; i < count; ++i)
+        if (rects[i].x == r.x && rects[i].width == r.width &&
+            rects[i].y + rects[i].height == r.y)
+        {
+          rects[i].height += r.height;
+          break;
+        }
+
+      if (i < count)
+        continue;
 
-  if (!changed)
+      if (count == KVMFR_MAX_DAMAGE_RECTS)
+        overflow = true;
+      else
+        rects[count++] = r;
+    }
+
+  if (!overflow && count == 0)
     return CAPTURE_RESULT_TIMEOUT;
 
+  // accumulate the damage as the prior grab may not have been sent yet
+  LG_LOCK(this->damageLock);
+  if (overflow)
+    damage_set_full(&this->damage);
+  else
+    damage_add(&this->damage, rects, count);
   memcpy(&this->grabInfo, &grabInfo, sizeof(grabInfo));
+  LG_UNLOCK(this->damageLock);
+
   lgSignalEvent(this->frameEvent);
   return CAPTURE_RESULT_OK;
 }
@@ -288,6 +469,33 @@ static CaptureResult nvfbc_waitFrame(CaptureFrame * frame)
   if (this->stop)
     return CAPTURE_RESULT_REINIT;
 
+  LG_LOCK(this->damageLock);
+  if (this->cuda)
+  {
+    // the event may be signaled when there are no frames available
+    if (this->cudaLatest < 0)
+    {
+      LG_UNLOCK(this->damageLock);
+      return CAPTURE_RESULT_TIMEOUT;
+    }
+
+    this->cudaReading = this->cudaLatest;
+    this->cudaLatest  = -1;
+    memcpy(&this->grabInfo, &this->cudaGrabInfo[this->cudaReading],
+        sizeof(this->grabInfo));
+  }
+
+  if (this->damage.full)
+    frame->damageRectsCount = 0;
+  else
+  {
+    frame->damageRectsCount = this->damage.count;
+    memcpy(frame->damageRects, this->damage.rects,
+        this->damage.count * sizeof(FrameDamageRect));
+  }
+  damage_reset(&this->damage);
+  LG_UNLOCK(this->damageLock);
+
   if (
     this->grabInfo.dwWidth       != this->grabWidth  ||
     this->grabInfo.dwHeight      != this->grabHeight ||
@@ -299,11 +507,13 @@ static CaptureResult nvfbc_waitFrame(CaptureFrame * frame)
     ++this->formatVer;
   }
 
-  frame->formatVer = this->formatVer;
-  frame->width     = this->grabWidth;
-  frame->height    = this->grabHeight;
-  frame->pitch     = this->grabStride * 4;
-  frame->stride    = this->grabStride;
+  frame->formatVer    = this->formatVer;
+  frame->width        = this->grabWidth;
+  frame->height       = this->grabHeight;
+  frame->screenWidth  = this->region.width;
+  frame->screenHeight = this->region.height;
+  frame->pitch        = this->grabStride * 4;
+  frame->stride       = this->grabStride;
 
 #if 0
   //NvFBC never sets bIsHDR so instead we check for any data in the alpha channel
@@ -325,16 +535,66 @@ static CaptureResult nvfbc_waitFrame(CaptureFrame * frame)
   return CAPTURE_RESULT_OK;
 }
 
-static CaptureResult nvfbc_getFrame(FrameBuffer * frame)
+static void nvfbc_cudaProgress(void * opaque, size_t done)
 {
-  framebuffer_write(
-    frame,
-    this->frameBuffer,
-    this->grabInfo.dwHeight * this->grabInfo.dwBufferWidth * 4
-  );
+  framebuffer_set_write_ptr((FrameBuffer *)opaque, done);
+}
+
+static CaptureResult nvfbc_getFrame(FrameBuffer * frame,
+    const FrameDamageRect * rects, unsigned int rectsCount)
+{
+  if (this->cuda)
+  {
+    const bool ok = NvFBCToCudaCopy(
+      this->cuda,
+      this->cudaReading,
+      framebuffer_get_write_data(frame),
+      this->grabInfo.dwHeight * this->grabInfo.dwBufferWidth * 4,
+      CUDA_BANDS,
+      nvfbc_cudaProgress,
+      frame
+    );
+
+    LG_LOCK(this->damageLock);
+    this->cudaReading = -1;
+    LG_UNLOCK(this->damageLock);
+
+    return ok ? CAPTURE_RESULT_OK : CAPTURE_RESULT_ERROR;
+  }
+
+  if (rectsCount == 0)
+    framebuffer_write(
+      frame,
+      this->frameBuffer,
+      this->grabInfo.dwHeight * this->grabInfo.dwBufferWidth * 4
+    );
+  else
+    framebuffer_write_rects(
+      frame,
+      this->frameBuffer,
+      this->grabInfo.dwBufferWidth * 4,
+      this->grabInfo.dwHeight,
+      4,
+      rects,
+      rectsCount
+    );
   return CAPTURE_RESULT_OK;
 }
 
+static void nvfbc_setTargetSize(unsigned int width, unsigned int height)
+{
+  this->targetWidth  = width;
+  this->targetHeight = height;
+}
+
+// CUDA grabs are always of the whole desktop
+static void nvfbc_setCrop(CaptureRect crop)
+{
+  if (this->cuda && crop.width && crop.height)
+    DEBUG_WARN("Cropping is not supported with CUDA grabs");
+  this->crop = crop;
+}
+
 static int pointerThread(void * unused)
 {
   while(!this->stop)
@@ -360,10 +620,14 @@ static int pointerThread(void * unused)
         continue;
       }
 
-      result = NvFBCToSysGetCursor(this->nvfbc, &pointer, data, size);
+      if (this->cuda)
+        result = NvFBCToCudaGetCursor(this->cuda, &pointer, data, size);
+      else
+        result = NvFBCToSysGetCursor(this->nvfbc, &pointer, data, size);
+
       if (result != CAPTURE_RESULT_OK)
       {
-        DEBUG_WARN("NvFBCToSysGetCursor failed");
+        DEBUG_WARN("Failed to get the cursor");
         continue;
       }
 
@@ -376,8 +640,8 @@ static int pointerThread(void * unused)
     {
       pointer.positionUpdate = true;
       pointer.visible        = this->mouseVisible;
-      pointer.x              = this->mouseX - this->mouseHotX;
-      pointer.y              = this->mouseY - this->mouseHotY;
+      pointer.x              = this->mouseX - this->mouseHotX - (int)this->region.x;
+      pointer.y              = this->mouseY - this->mouseHotY - (int)this->region.y;
     }
 
     this->postPointerBufferFn(pointer);
@@ -399,5 +663,7 @@ struct CaptureInterface Capture_NVFBC =
   .getMaxFrameSize = nvfbc_getMaxFrameSize,
   .capture         = nvfbc_capture,
   .waitFrame       = nvfbc_waitFrame,
-  .getFrame        = nvfbc_getFrame
+  .getFrame        = nvfbc_getFrame,
+  .setTargetSize   = nvfbc_setTargetSize,
+  .setCrop         = nvfbc_setCrop
 };
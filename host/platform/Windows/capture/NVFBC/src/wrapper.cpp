@@ -20,7 +20,9 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "wrapper.h"
 #include "common/windebug.h"
 #include <windows.h>
+#include <stdint.h>
 #include <NvFBC/nvFBCToSys.h>
+#include <NvFBC/nvFBCCuda.h>
 
 #ifdef _WIN64
 #define NVFBC_DLL "NvFBC64.dll"
@@ -47,7 +49,158 @@ struct stNvFBCHandle
   int          retry;
 };
 
-static NVAPI nvapi;
+// the subset of the CUDA driver API that is needed, loaded at runtime so the
+// CUDA toolkit is not required to build
+typedef int                  CuResult;
+typedef int                  CuDevice;
+typedef unsigned long long   CuDevicePtr;
+typedef struct CuContextSt * CuContext;
+typedef struct CuStreamSt  * CuStream;
+typedef struct CuEventSt   * CuEvent;
+
+#define CU_SUCCESS                   0
+#define CU_CTX_SCHED_BLOCKING_SYNC   0x4
+#define CU_STREAM_NON_BLOCKING       0x1
+#define CU_EVENT_BLOCKING_SYNC       0x1
+#define CU_EVENT_DISABLE_TIMING      0x2
+#define CU_MEMHOSTREGISTER_PORTABLE  0x1
+
+struct CudaAPI
+{
+  bool    initialized;
+  HMODULE dll;
+
+  CuResult (WINAPI * init             )(unsigned int flags);
+  CuResult (WINAPI * deviceGet        )(CuDevice * device, int ordinal);
+  CuResult (WINAPI * ctxCreate        )(CuContext * ctx, unsigned int flags, CuDevice device);
+  CuResult (WINAPI * ctxDestroy       )(CuContext ctx);
+  CuResult (WINAPI * ctxPushCurrent   )(CuContext ctx);
+  CuResult (WINAPI * ctxPopCurrent    )(CuContext * ctx);
+  CuResult (WINAPI * memAlloc         )(CuDevicePtr * ptr, size_t size);
+  CuResult (WINAPI * memFree          )(CuDevicePtr ptr);
+  CuResult (WINAPI * memHostRegister  )(void * ptr, size_t size, unsigned int flags);
+  CuResult (WINAPI * memHostUnregister)(void * ptr);
+  CuResult (WINAPI * memcpyDtoHAsync  )(void * dst, CuDevicePtr src, size_t size, CuStream stream);
+  CuResult (WINAPI * streamCreate     )(CuStream * stream, unsigned int flags);
+  CuResult (WINAPI * streamDestroy    )(CuStream stream);
+  CuResult (WINAPI * eventCreate      )(CuEvent * event, unsigned int flags);
+  CuResult (WINAPI * eventDestroy     )(CuEvent event);
+  CuResult (WINAPI * eventRecord      )(CuEvent event, CuStream stream);
+  CuResult (WINAPI * eventSynchronize )(CuEvent event);
+};
+
+// host memory that has been registered for DMA, one per frame buffer the host
+// cycles through plus some spare
+#define MAX_PINNED 4
+
+struct Pinned
+{
+  void * addr;
+  size_t size;
+  bool   pinned;
+};
+
+struct stNvFBCCudaHandle
+{
+  NvFBCCuda   * nvfbc;
+  int           retry;
+
+  CuContext     ctx;
+  CuStream      stream;
+  CuEvent       events[NVFBC_CUDA_MAX_BANDS];
+  unsigned int  bufferSize;
+  CuDevicePtr   buffers[NVFBC_CUDA_BUFFERS];
+
+  struct Pinned pinned[MAX_PINNED];
+  int           nextPinned;
+};
+
+static NVAPI   nvapi;
+static CudaAPI cuda;
+
+static CaptureResult grabResult(NVFBCRESULT status,
+    const NvFBCFrameGrabInfo * grabInfo, int * retry)
+{
+  if (grabInfo->bMustRecreate)
+  {
+    DEBUG_INFO("NvFBC reported recreation is required");
+    return CAPTURE_RESULT_REINIT;
+  }
+
+  switch(status)
+  {
+    case NVFBC_SUCCESS:
+      *retry = 0;
+      break;
+
+    case NVFBC_ERROR_INVALID_PARAM:
+      if (*retry < 2)
+      {
+        Sleep(100);
+        ++*retry;
+        return CAPTURE_RESULT_TIMEOUT;
+      }
+      return CAPTURE_RESULT_ERROR;
+
+    case NVFBC_ERROR_DYNAMIC_DISABLE:
+      DEBUG_ERROR("NvFBC was disabled by someone else");
+      return CAPTURE_RESULT_ERROR;
+
+    case NVFBC_ERROR_INVALIDATED_SESSION:
+      DEBUG_WARN("Session was invalidated, attempting to restart");
+      return CAPTURE_RESULT_REINIT;
+
+    default:
+      DEBUG_ERROR("Unknown NVFBCRESULT failure 0x%x", status);
+      return CAPTURE_RESULT_ERROR;
+  }
+
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult cursorResult(NVFBC_CURSOR_CAPTURE_PARAMS * params,
+    CapturePointer * pointer, void * buffer, unsigned int size)
+{
+  pointer->hx          = params->dwXHotSpot;
+  pointer->hy          = params->dwYHotSpot;
+  pointer->width       = params->dwWidth;
+  pointer->height      = params->dwHeight;
+  pointer->pitch       = params->dwPitch;
+  pointer->visible     = params->bIsHwCursor;
+  pointer->shapeUpdate = params->bIsHwCursor;
+
+  if (!params->bIsHwCursor)
+    return CAPTURE_RESULT_OK;
+
+  switch(params->dwPointerFlags & 0x7)
+  {
+    case 0x1:
+      pointer->format  = CAPTURE_FMT_MONO;
+      pointer->height *= 2;
+      break;
+
+    case 0x2:
+      pointer->format = CAPTURE_FMT_COLOR;
+      break;
+
+    case 0x4:
+      pointer->format = CAPTURE_FMT_MASKED;
+      break;
+
+    default:
+      DEBUG_ERROR("Invalid/unknown pointer data format");
+      return CAPTURE_RESULT_ERROR;
+  }
+
+  if (params->dwBufferSize > size)
+  {
+    DEBUG_WARN("Cursor data larger then provided buffer");
+    params->dwBufferSize = size;
+  }
+
+  memcpy(buffer, params->pBits, params->dwBufferSize);
+  return CAPTURE_RESULT_OK;
+}
 
 bool NvFBCInit()
 {
@@ -223,6 +376,7 @@ CaptureResult NvFBCToSysCapture(
   const unsigned int   y,
   const unsigned int   width,
   const unsigned int   height,
+  const bool           scale,
   NvFBCFrameGrabInfo * grabInfo
 )
 {
@@ -231,7 +385,8 @@ CaptureResult NvFBCToSysCapture(
   params.dwVersion           = NVFBC_TOSYS_GRAB_FRAME_PARAMS_VER;
   params.dwFlags             = NVFBC_TOSYS_WAIT_WITH_TIMEOUT;
   params.dwWaitTime          = waitTime;
-  params.eGMode              = NVFBC_TOSYS_SOURCEMODE_CROP;
+  params.eGMode              = scale ?
+    NVFBC_TOSYS_SOURCEMODE_SCALE : NVFBC_TOSYS_SOURCEMODE_CROP;
   params.dwStartX            = x;
   params.dwStartY            = y;
   params.dwTargetWidth       = width;
@@ -240,91 +395,373 @@ CaptureResult NvFBCToSysCapture(
 
   grabInfo->bMustRecreate = FALSE;
   NVFBCRESULT status = handle->nvfbc->NvFBCToSysGrabFrame(&params);
-  if (grabInfo->bMustRecreate)
-  {
-    DEBUG_INFO("NvFBC reported recreation is required");
-    return CAPTURE_RESULT_REINIT;
-  }
+  return grabResult(status, grabInfo, &handle->retry);
+}
 
-  switch(status)
+CaptureResult NvFBCToSysGetCursor(NvFBCHandle handle, CapturePointer * pointer, void * buffer, unsigned int size)
+{
+  NVFBC_CURSOR_CAPTURE_PARAMS params;
+  params.dwVersion = NVFBC_CURSOR_CAPTURE_PARAMS_VER;
+
+  if (handle->nvfbc->NvFBCToSysCursorCapture(&params) != NVFBC_SUCCESS)
   {
-    case NVFBC_SUCCESS:
-      handle->retry = 0;
-      break;
+    DEBUG_ERROR("Failed to get the cursor");
+    return CAPTURE_RESULT_ERROR;
+  }
 
-    case NVFBC_ERROR_INVALID_PARAM:
-      if (handle->retry < 2)
-      {
-        Sleep(100);
-        ++handle->retry;
-        return CAPTURE_RESULT_TIMEOUT;
-      }
-      return CAPTURE_RESULT_ERROR;
+  return cursorResult(&params, pointer, buffer, size);
+}
 
-    case NVFBC_ERROR_DYNAMIC_DISABLE:
-      DEBUG_ERROR("NvFBC was disabled by someone else");
-      return CAPTURE_RESULT_ERROR;
+static bool cudaInit()
+{
+  if (cuda.initialized)
+    return true;
 
-    case NVFBC_ERROR_INVALIDATED_SESSION:
-      DEBUG_WARN("Session was invalidated, attempting to restart");
-      return CAPTURE_RESULT_REINIT;
+  cuda.dll = LoadLibraryA("nvcuda.dll");
+  if (!cuda.dll)
+  {
+    DEBUG_WINERROR("Failed to load nvcuda.dll", GetLastError());
+    return false;
+  }
 
-    default:
-      DEBUG_ERROR("Unknown NVFBCRESULT failure 0x%x", status);
-      return CAPTURE_RESULT_ERROR;
+  #define CUDA_PROC(x, name) \
+    *(FARPROC *)&cuda.x = GetProcAddress(cuda.dll, name); \
+    if (!cuda.x) \
+    { \
+      DEBUG_ERROR("Failed to get the proc address for " name); \
+      FreeLibrary(cuda.dll); \
+      return false; \
+    }
+
+  CUDA_PROC(init             , "cuInit"              );
+  CUDA_PROC(deviceGet        , "cuDeviceGet"         );
+  CUDA_PROC(ctxCreate        , "cuCtxCreate_v2"      );
+  CUDA_PROC(ctxDestroy       , "cuCtxDestroy_v2"     );
+  CUDA_PROC(ctxPushCurrent   , "cuCtxPushCurrent_v2" );
+  CUDA_PROC(ctxPopCurrent    , "cuCtxPopCurrent_v2"  );
+  CUDA_PROC(memAlloc         , "cuMemAlloc_v2"       );
+  CUDA_PROC(memFree          , "cuMemFree_v2"        );
+  CUDA_PROC(memHostRegister  , "cuMemHostRegister_v2");
+  CUDA_PROC(memHostUnregister, "cuMemHostUnregister" );
+  CUDA_PROC(memcpyDtoHAsync  , "cuMemcpyDtoHAsync_v2");
+  CUDA_PROC(streamCreate     , "cuStreamCreate"      );
+  CUDA_PROC(streamDestroy    , "cuStreamDestroy_v2"  );
+  CUDA_PROC(eventCreate      , "cuEventCreate"       );
+  CUDA_PROC(eventDestroy     , "cuEventDestroy_v2"   );
+  CUDA_PROC(eventRecord      , "cuEventRecord"       );
+  CUDA_PROC(eventSynchronize , "cuEventSynchronize"  );
+  #undef CUDA_PROC
+
+  if (cuda.init(0) != CU_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to initialize CUDA");
+    FreeLibrary(cuda.dll);
+    return false;
   }
 
-  return CAPTURE_RESULT_OK;
+  cuda.initialized = true;
+  return true;
 }
 
-CaptureResult NvFBCToSysGetCursor(NvFBCHandle handle, CapturePointer * pointer, void * buffer, unsigned int size)
+bool NvFBCToCudaCreate(
+  void            * privData,
+  unsigned int      privDataSize,
+  NvFBCCudaHandle * handle,
+  unsigned int    * maxWidth,
+  unsigned int    * maxHeight
+)
 {
-  NVFBC_CURSOR_CAPTURE_PARAMS params;
-  params.dwVersion = NVFBC_CURSOR_CAPTURE_PARAMS_VER;
+  *handle = NULL;
+  if (!cudaInit())
+    return false;
 
-  if (handle->nvfbc->NvFBCToSysCursorCapture(&params) != NVFBC_SUCCESS)
+  NvFBCCudaHandle h = (NvFBCCudaHandle)calloc(sizeof(struct stNvFBCCudaHandle), 1);
+  if (!h)
   {
-    DEBUG_ERROR("Failed to get the cursor");
-    return CAPTURE_RESULT_ERROR;
+    DEBUG_ERROR("Failed to allocate the handle");
+    return false;
+  }
+
+  // NvFBC binds to the CUDA context that is current when it is created
+  CuDevice device;
+  if (cuda.deviceGet(&device, 0) != CU_SUCCESS ||
+      cuda.ctxCreate(&h->ctx, CU_CTX_SCHED_BLOCKING_SYNC, device) != CU_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create the CUDA context");
+    free(h);
+    return false;
   }
 
-  pointer->hx          = params.dwXHotSpot;
-  pointer->hy          = params.dwYHotSpot;
-  pointer->width       = params.dwWidth;
-  pointer->height      = params.dwHeight;
-  pointer->pitch       = params.dwPitch;
-  pointer->visible     = params.bIsHwCursor;
-  pointer->shapeUpdate = params.bIsHwCursor;
+  // the context is left pushed by ctxCreate
+  *handle = h;
 
-  if (!params.bIsHwCursor)
-    return CAPTURE_RESULT_OK;
+  NvFBCCreateParams params = {0};
+  params.dwVersion         = NVFBC_CREATE_PARAMS_VER;
+  params.dwInterfaceType   = NVFBC_SHARED_CUDA;
+  params.pDevice           = NULL;
+  params.dwAdapterIdx      = 0;
+  params.dwPrivateDataSize = privDataSize;
+  params.pPrivateData      = privData;
 
-  switch(params.dwPointerFlags & 0x7)
+  if (nvapi.createEx(&params) != NVFBC_SUCCESS)
   {
-    case 0x1:
-      pointer->format  = CAPTURE_FMT_MONO;
-      pointer->height *= 2;
-      break;
+    DEBUG_ERROR("Failed to create the NvFBCCuda interface");
+    goto fail;
+  }
 
-    case 0x2:
-      pointer->format = CAPTURE_FMT_COLOR;
-      break;
+  h->nvfbc = static_cast<NvFBCCuda *>(params.pNvFBC);
 
-    case 0x4:
-      pointer->format = CAPTURE_FMT_MASKED;
+  NvU32 size;
+  if (h->nvfbc->NvFBCCudaGetMaxBufferSize(&size) != NVFBC_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to get the maximum buffer size");
+    goto fail;
+  }
+  h->bufferSize = size;
+
+  if (cuda.streamCreate(&h->stream, CU_STREAM_NON_BLOCKING) != CU_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to create the CUDA stream");
+    goto fail;
+  }
+
+  for(int i = 0; i < NVFBC_CUDA_MAX_BANDS; ++i)
+    if (cuda.eventCreate(&h->events[i],
+          CU_EVENT_BLOCKING_SYNC | CU_EVENT_DISABLE_TIMING) != CU_SUCCESS)
+    {
+      DEBUG_ERROR("Failed to create the CUDA events");
+      goto fail;
+    }
+
+  if (maxWidth)
+    *maxWidth = params.dwMaxDisplayWidth;
+
+  if (maxHeight)
+    *maxHeight = params.dwMaxDisplayHeight;
+
+  CuContext ctx;
+  cuda.ctxPopCurrent(&ctx);
+  return true;
+
+fail:
+  {
+    CuContext ctx;
+    cuda.ctxPopCurrent(&ctx);
+  }
+  NvFBCToCudaRelease(handle);
+  return false;
+}
+
+void NvFBCToCudaRelease(NvFBCCudaHandle * handle)
+{
+  NvFBCCudaHandle h = *handle;
+  if (!h)
+    return;
+
+  cuda.ctxPushCurrent(h->ctx);
+
+  if (h->nvfbc)
+    h->nvfbc->NvFBCCudaRelease();
+
+  for(int i = 0; i < MAX_PINNED; ++i)
+    if (h->pinned[i].pinned)
+      cuda.memHostUnregister(h->pinned[i].addr);
+
+  for(int i = 0; i < NVFBC_CUDA_BUFFERS; ++i)
+    if (h->buffers[i])
+      cuda.memFree(h->buffers[i]);
+
+  for(int i = 0; i < NVFBC_CUDA_MAX_BANDS; ++i)
+    if (h->events[i])
+      cuda.eventDestroy(h->events[i]);
+
+  if (h->stream)
+    cuda.streamDestroy(h->stream);
+
+  CuContext ctx;
+  cuda.ctxPopCurrent(&ctx);
+  cuda.ctxDestroy(h->ctx);
+
+  free(h);
+  *handle = NULL;
+}
+
+bool NvFBCToCudaSetup(
+  NvFBCCudaHandle   handle,
+  enum BufferFormat format,
+  bool              seperateCursorCapture,
+  HANDLE          * cursorEvent
+)
+{
+  NVFBC_CUDA_SETUP_PARAMS params = {0};
+  params.dwVersion = NVFBC_CUDA_SETUP_PARAMS_VER;
+
+  switch(format)
+  {
+    case BUFFER_FMT_ARGB  : params.eFormat = NVFBC_TOCUDA_ARGB; break;
+    case BUFFER_FMT_ARGB10:
+      params.eFormat     = NVFBC_TOCUDA_ARGB10;
+      params.bHDRRequest = TRUE;
       break;
 
     default:
-      DEBUG_ERROR("Invalid/unknown pointer data format");
-      return CAPTURE_RESULT_ERROR;
+      DEBUG_INFO("Invalid format");
+      return false;
   }
 
-  if (params.dwBufferSize > size)
+  params.bEnableSeparateCursorCapture = seperateCursorCapture ? TRUE : FALSE;
+
+  bool ret = false;
+  cuda.ctxPushCurrent(handle->ctx);
+
+  if (handle->nvfbc->NvFBCCudaSetup(&params) != NVFBC_SUCCESS)
   {
-    DEBUG_WARN("Cursor data larger then provided buffer");
-    params.dwBufferSize = size;
+    DEBUG_ERROR("Failed to setup NVFBCCuda");
+    goto out;
   }
 
-  memcpy(buffer, params.pBits, params.dwBufferSize);
-  return CAPTURE_RESULT_OK;
+  for(int i = 0; i < NVFBC_CUDA_BUFFERS; ++i)
+    if (!handle->buffers[i] &&
+        cuda.memAlloc(&handle->buffers[i], handle->bufferSize) != CU_SUCCESS)
+    {
+      DEBUG_ERROR("Failed to allocate the CUDA device buffers");
+      goto out;
+    }
+
+  if (cursorEvent)
+    *cursorEvent = params.hCursorCaptureEvent;
+
+  ret = true;
+
+out:
+  CuContext ctx;
+  cuda.ctxPopCurrent(&ctx);
+  return ret;
+}
+
+unsigned int NvFBCToCudaGetBufferSize(NvFBCCudaHandle handle)
+{
+  return handle->bufferSize;
+}
+
+CaptureResult NvFBCToCudaCapture(
+  NvFBCCudaHandle      handle,
+  const unsigned int   waitTime,
+  const int            buffer,
+  NvFBCFrameGrabInfo * grabInfo
+)
+{
+  NVFBC_CUDA_GRAB_FRAME_PARAMS params = {0};
+
+  params.dwVersion           = NVFBC_CUDA_GRAB_FRAME_PARAMS_VER;
+  params.dwFlags             = NVFBC_TOCUDA_WAIT_WITH_TIMEOUT;
+  params.dwTimeoutMs         = waitTime;
+  params.pCUDADeviceBuffer   = (void *)(uintptr_t)handle->buffers[buffer];
+  params.pNvFBCFrameGrabInfo = grabInfo;
+
+  cuda.ctxPushCurrent(handle->ctx);
+  grabInfo->bMustRecreate = FALSE;
+  NVFBCRESULT status = handle->nvfbc->NvFBCCudaGrabFrame(&params);
+  CuContext ctx;
+  cuda.ctxPopCurrent(&ctx);
+
+  return grabResult(status, grabInfo, &handle->retry);
+}
+
+// pin the destination so the copy is a true DMA, IVSHMEM may not allow this in
+// which case the driver stages the copy through its own pinned memory
+static void pinHost(NvFBCCudaHandle handle, void * dst)
+{
+  for(int i = 0; i < MAX_PINNED; ++i)
+    if (handle->pinned[i].addr == dst)
+      return;
+
+  struct Pinned * p = &handle->pinned[handle->nextPinned];
+  if (++handle->nextPinned == MAX_PINNED)
+    handle->nextPinned = 0;
+
+  if (p->pinned)
+    cuda.memHostUnregister(p->addr);
+
+  p->addr   = dst;
+  p->size   = handle->bufferSize;
+  p->pinned = cuda.memHostRegister(dst, p->size,
+      CU_MEMHOSTREGISTER_PORTABLE) == CU_SUCCESS;
+
+  if (!p->pinned)
+    DEBUG_WARN("Failed to pin %p, DMA will be staged", dst);
+}
+
+bool NvFBCToCudaCopy(
+  NvFBCCudaHandle     handle,
+  const int           buffer,
+  void              * dst,
+  size_t              size,
+  unsigned int        bands,
+  NvFBCCudaProgressFn progress,
+  void              * opaque
+)
+{
+  if (bands < 1)
+    bands = 1;
+  else if (bands > NVFBC_CUDA_MAX_BANDS)
+    bands = NVFBC_CUDA_MAX_BANDS;
+
+  bool ret = false;
+  cuda.ctxPushCurrent(handle->ctx);
+  pinHost(handle, dst);
+
+  // queue every band up front so the DMA engine never idles, then publish
+  // each as it completes so the client can start reading early
+  const size_t band = (((size + bands - 1) / bands) + 0xFFF) & ~(size_t)0xFFF;
+  unsigned int count = 0;
+  for(size_t offset = 0; offset < size; offset += band, ++count)
+  {
+    const size_t len = size - offset < band ? size - offset : band;
+    if (cuda.memcpyDtoHAsync((uint8_t *)dst + offset,
+          handle->buffers[buffer] + offset, len, handle->stream) != CU_SUCCESS ||
+        cuda.eventRecord(handle->events[count], handle->stream) != CU_SUCCESS)
+    {
+      DEBUG_ERROR("Failed to queue the CUDA copy");
+      goto out;
+    }
+  }
+
+  for(unsigned int i = 0; i < count; ++i)
+  {
+    if (cuda.eventSynchronize(handle->events[i]) != CU_SUCCESS)
+    {
+      DEBUG_ERROR("Failed to wait for the CUDA copy");
+      goto out;
+    }
+
+    const size_t done = (i + 1) * band;
+    progress(opaque, done < size ? done : size);
+  }
+
+  ret = true;
+
+out:
+  CuContext ctx;
+  cuda.ctxPopCurrent(&ctx);
+  return ret;
+}
+
+CaptureResult NvFBCToCudaGetCursor(NvFBCCudaHandle handle, CapturePointer * pointer, void * buffer, unsigned int size)
+{
+  NVFBC_CURSOR_CAPTURE_PARAMS params;
+  params.dwVersion = NVFBC_CURSOR_CAPTURE_PARAMS_VER;
+
+  cuda.ctxPushCurrent(handle->ctx);
+  NVFBCRESULT status = handle->nvfbc->NvFBCCudaCursorCapture(&params);
+  CuContext ctx;
+  cuda.ctxPopCurrent(&ctx);
+
+  if (status != NVFBC_SUCCESS)
+  {
+    DEBUG_ERROR("Failed to get the cursor");
+    return CAPTURE_RESULT_ERROR;
+  }
+
+  return cursorResult(&params, pointer, buffer, size);
 }
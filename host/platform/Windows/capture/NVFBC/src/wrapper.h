@@ -18,6 +18,7 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <NvFBC/nvFBC.h>
 
 #ifdef __cplusplus
@@ -26,7 +27,16 @@ extern "C" {
 
 #include "interface/capture.h"
 
-typedef struct stNvFBCHandle * NvFBCHandle;
+typedef struct stNvFBCHandle     * NvFBCHandle;
+typedef struct stNvFBCCudaHandle * NvFBCCudaHandle;
+
+// the number of device buffers the CUDA interface grabs into
+#define NVFBC_CUDA_BUFFERS 3
+
+// the most DMA bands a copy may be split into
+#define NVFBC_CUDA_MAX_BANDS 16
+
+typedef void (*NvFBCCudaProgressFn)(void * opaque, size_t done);
 
 enum BufferFormat
 {
@@ -78,11 +88,56 @@ CaptureResult NvFBCToSysCapture(
   const unsigned int   y,
   const unsigned int   width,
   const unsigned int   height,
+  const bool           scale,
   NvFBCFrameGrabInfo * grabInfo
 );
 
 CaptureResult NvFBCToSysGetCursor(NvFBCHandle handle, CapturePointer * pointer, void * buffer, unsigned int size);
 
+bool NvFBCToCudaCreate(
+  void            * privData,
+  unsigned int      privDataSize,
+  NvFBCCudaHandle * handle,
+  unsigned int    * maxWidth,
+  unsigned int    * maxHeight
+);
+void NvFBCToCudaRelease(NvFBCCudaHandle * handle);
+
+bool NvFBCToCudaSetup(
+  NvFBCCudaHandle   handle,
+  enum BufferFormat format,
+  bool              seperateCursorCapture,
+  HANDLE          * cursorEvent
+);
+
+/**
+ * The size of each device buffer, frames are never larger than this
+ */
+unsigned int NvFBCToCudaGetBufferSize(NvFBCCudaHandle handle);
+
+CaptureResult NvFBCToCudaCapture(
+  NvFBCCudaHandle      handle,
+  const unsigned int   waitTime,
+  const int            buffer,
+  NvFBCFrameGrabInfo * grabInfo
+);
+
+/**
+ * Copy size bytes of the device buffer into dst using asynchronous DMA split
+ * into bands, calling progress as each band lands. dst is pinned on first use
+ */
+bool NvFBCToCudaCopy(
+  NvFBCCudaHandle     handle,
+  const int           buffer,
+  void              * dst,
+  size_t              size,
+  unsigned int        bands,
+  NvFBCCudaProgressFn progress,
+  void              * opaque
+);
+
+CaptureResult NvFBCToCudaGetCursor(NvFBCCudaHandle handle, CapturePointer * pointer, void * buffer, unsigned int size);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,1077 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "interface/capture.h"
+#include "interface/platform.h"
+#include "common/debug.h"
+#include "common/windebug.h"
+#include "common/option.h"
+#include "common/locking.h"
+#include "common/event.h"
+#include "common/time.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <wchar.h>
+#include <d3d11.h>
+
+#include "wgc_abi.h"
+#include "zerocopy.h"
+
+/*
+ * Windows.Graphics.Capture, the compositor copies the window or monitor into
+ * a pool of GPU textures and signals each one from a system thread. Unlike
+ * desktop duplication a single window can be captured, and only when it
+ * presents. No damage is reported so every frame is sent whole.
+ */
+
+#define LOCKED(x) INTERLOCKED_SECTION(this->deviceContextLock, x)
+
+// the textures in the frame pool, one being copied and one being composed
+#define POOL_BUFFERS 2
+
+enum TextureState
+{
+  TEXTURE_STATE_UNUSED,
+  TEXTURE_STATE_PENDING_MAP,
+  TEXTURE_STATE_MAPPED
+};
+
+typedef struct Texture
+{
+  volatile enum TextureState state;
+  ID3D11Texture2D          * tex;
+  ID3D11Query              * query;
+  D3D11_MAPPED_SUBRESOURCE   map;
+
+  // the microtime the frame in this texture was composed
+  uint64_t                   presentTime;
+}
+Texture;
+
+struct iface
+{
+  bool                          initialized;
+  volatile bool                 stop;
+  bool                          roInit;
+
+  ID3D11Device                * device;
+  ID3D11DeviceContext         * deviceContext;
+  LG_Lock                       deviceContextLock;
+  IDXGIAdapter1               * adapter;
+  IInspectable                * winrtDevice;
+
+  IGraphicsCaptureItem        * item;
+  IDirect3D11CaptureFramePool * pool;
+  IGraphicsCaptureSession     * session;
+  WGCEventToken                 arrivedToken;
+  bool                          arrivedAdded;
+  WGCSizeInt32                  poolSize;
+
+  bool                          drawCursor;
+  bool                          pointerSent;
+  bool                          useZeroCopy;
+  bool                          copyHighPriority;
+  ZeroCopy                    * zeroCopy;
+
+  int                           maxTextures;
+  Texture                     * texture;
+  int                           texRIndex;
+  int                           texWIndex;
+  atomic_int                    texReady;
+
+  CaptureGetPointerBuffer       getPointerBufferFn;
+  CapturePostPointerBuffer      postPointerBufferFn;
+
+  // signalled from the frame pool's thread when a frame is composed, and by
+  // capture when a texture is ready to map
+  LGEvent                     * arrivedEvent;
+  LGEvent                     * frameEvent;
+
+  unsigned int                  formatVer;
+  unsigned int                  width;
+  unsigned int                  height;
+  unsigned int                  pitch;
+  unsigned int                  stride;
+};
+
+static struct iface * this = NULL;
+
+static bool wgc_deinit();
+
+static const char * wgc_getName()
+{
+  return "WGC";
+}
+
+static void wgc_initOptions()
+{
+  struct Option options[] =
+  {
+    {
+      .module         = "wgc",
+      .name           = "enable",
+      .description    = "Capture with Windows.Graphics.Capture instead of desktop duplication",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "wgc",
+      .name           = "window",
+      .description    = "Capture the first window with this in its title instead of a monitor",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = ""
+    },
+    {
+      .module         = "wgc",
+      .name           = "monitor",
+      .description    = "The monitor to capture when no window is given",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 0
+    },
+    {
+      .module         = "wgc",
+      .name           = "cursor",
+      .description    = "Draw the cursor into the frame, the client is then never sent one",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {
+      .module         = "wgc",
+      .name           = "maxTextures",
+      .description    = "The maximum number of frames to buffer before skipping frames",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 3
+    },
+    {
+      .module         = "wgc",
+      .name           = "zeroCopy",
+      .description    = "Copy frames into shared memory on the GPU with D3D12",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "wgc",
+      .name           = "copyHighPriority",
+      .description    = "Run the D3D12 copy queue at high priority",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {0}
+  };
+
+  option_register(options);
+}
+
+static bool wgc_create(CaptureGetPointerBuffer getPointerBufferFn, CapturePostPointerBuffer postPointerBufferFn)
+{
+  assert(!this);
+
+  // desktop duplication is preferred unless this is asked for
+  if (!option_get_bool("wgc", "enable"))
+    return false;
+
+  this = (struct iface *)calloc(sizeof(struct iface), 1);
+  if (!this)
+  {
+    DEBUG_ERROR("failed to allocate wgc struct");
+    return false;
+  }
+
+  this->arrivedEvent = lgCreateEvent(true, 0);
+  this->frameEvent   = lgCreateEvent(true, 17);
+  if (!this->arrivedEvent || !this->frameEvent)
+  {
+    DEBUG_ERROR("failed to create the frame events");
+    goto fail;
+  }
+
+  this->drawCursor       = option_get_bool("wgc", "cursor"          );
+  this->maxTextures      = option_get_int ("wgc", "maxTextures"     );
+  this->useZeroCopy      = option_get_bool("wgc", "zeroCopy"        );
+  this->copyHighPriority = option_get_bool("wgc", "copyHighPriority");
+  if (this->maxTextures <= 0)
+    this->maxTextures = 1;
+
+  this->texture = calloc(sizeof(Texture), this->maxTextures);
+  if (!this->texture)
+  {
+    DEBUG_ERROR("failed to allocate the textures");
+    goto fail;
+  }
+
+  this->getPointerBufferFn  = getPointerBufferFn;
+  this->postPointerBufferFn = postPointerBufferFn;
+  return true;
+
+fail:
+  if (this->arrivedEvent)
+    lgFreeEvent(this->arrivedEvent);
+  if (this->frameEvent)
+    lgFreeEvent(this->frameEvent);
+  free(this);
+  this = NULL;
+  return false;
+}
+
+/*** the FrameArrived delegate, it lives as long as the module ***/
+
+static HRESULT STDMETHODCALLTYPE wgc_handlerQueryInterface(
+    IFramePoolArrivedHandler * This, REFIID riid, void ** ppvObject)
+{
+  // the pool calls back on its own thread so the delegate must be agile
+  if (IsEqualIID(riid, &IID_IUnknown) ||
+      IsEqualIID(riid, &IID_IAgileObject) ||
+      IsEqualIID(riid, &IID_IFramePoolArrivedHandler))
+  {
+    *ppvObject = This;
+    return S_OK;
+  }
+
+  *ppvObject = NULL;
+  return E_NOINTERFACE;
+}
+
+static ULONG STDMETHODCALLTYPE wgc_handlerAddRef(IFramePoolArrivedHandler * This)
+{
+  return 1;
+}
+
+static ULONG STDMETHODCALLTYPE wgc_handlerRelease(IFramePoolArrivedHandler * This)
+{
+  return 1;
+}
+
+static HRESULT STDMETHODCALLTYPE wgc_handlerInvoke(
+    IFramePoolArrivedHandler * This, IDirect3D11CaptureFramePool * sender,
+    IInspectable * args)
+{
+  // the frame is taken by the capture thread, only wake it here
+  struct iface * iface = this;
+  if (iface)
+    lgSignalEvent(iface->arrivedEvent);
+  return S_OK;
+}
+
+static const IFramePoolArrivedHandlerVtbl arrivedHandlerVtbl =
+{
+  .QueryInterface = wgc_handlerQueryInterface,
+  .AddRef         = wgc_handlerAddRef,
+  .Release        = wgc_handlerRelease,
+  .Invoke         = wgc_handlerInvoke
+};
+
+static IFramePoolArrivedHandler arrivedHandler = { &arrivedHandlerVtbl };
+
+/*** capture item selection ***/
+
+struct WGCFindWindow
+{
+  const char * title;
+  HWND         hwnd;
+};
+
+static BOOL CALLBACK wgc_findWindowProc(HWND hwnd, LPARAM lParam)
+{
+  struct WGCFindWindow * find = (struct WGCFindWindow *)lParam;
+  if (!IsWindowVisible(hwnd))
+    return TRUE;
+
+  char title[256];
+  if (GetWindowTextA(hwnd, title, sizeof(title)) <= 0)
+    return TRUE;
+
+  if (!strstr(title, find->title))
+    return TRUE;
+
+  find->hwnd = hwnd;
+  return FALSE;
+}
+
+struct WGCFindMonitor
+{
+  int      index;
+  HMONITOR monitor;
+};
+
+static BOOL CALLBACK wgc_findMonitorProc(HMONITOR monitor, HDC hdc,
+    LPRECT rect, LPARAM lParam)
+{
+  struct WGCFindMonitor * find = (struct WGCFindMonitor *)lParam;
+  if (find->index-- > 0)
+    return TRUE;
+
+  find->monitor = monitor;
+  return FALSE;
+}
+
+static bool wgc_getFactory(const wchar_t * className, REFIID riid, void ** factory)
+{
+  HSTRING name;
+  HRESULT status = WindowsCreateString(className, wcslen(className), &name);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the class name string", status);
+    return false;
+  }
+
+  status = RoGetActivationFactory(name, riid, factory);
+  WindowsDeleteString(name);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to get the activation factory", status);
+    return false;
+  }
+
+  return true;
+}
+
+static bool wgc_createItem()
+{
+  IGraphicsCaptureItemInterop * interop;
+  if (!wgc_getFactory(L"Windows.Graphics.Capture.GraphicsCaptureItem",
+        &IID_IGraphicsCaptureItemInterop, (void **)&interop))
+    return false;
+
+  HRESULT status;
+  const char * title = option_get_string("wgc", "window");
+  if (title && *title)
+  {
+    struct WGCFindWindow find = { .title = title };
+    EnumWindows(wgc_findWindowProc, (LPARAM)&find);
+    if (!find.hwnd)
+    {
+      DEBUG_ERROR("No window has \"%s\" in its title", title);
+      WGC_RELEASE(interop);
+      return false;
+    }
+
+    status = WGC_CALL(interop, CreateForWindow, find.hwnd,
+        &IID_IGraphicsCaptureItem, (void **)&this->item);
+    DEBUG_INFO("Window           : %s", title);
+  }
+  else
+  {
+    struct WGCFindMonitor find = { .index = option_get_int("wgc", "monitor") };
+    EnumDisplayMonitors(NULL, NULL, wgc_findMonitorProc, (LPARAM)&find);
+    if (!find.monitor)
+    {
+      DEBUG_ERROR("Monitor %d does not exist", option_get_int("wgc", "monitor"));
+      WGC_RELEASE(interop);
+      return false;
+    }
+
+    status = WGC_CALL(interop, CreateForMonitor, find.monitor,
+        &IID_IGraphicsCaptureItem, (void **)&this->item);
+    DEBUG_INFO("Monitor          : %d", option_get_int("wgc", "monitor"));
+  }
+
+  WGC_RELEASE(interop);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the capture item", status);
+    return false;
+  }
+
+  return true;
+}
+
+static bool wgc_isSupported()
+{
+  IGraphicsCaptureSessionStatics * statics;
+  if (!wgc_getFactory(L"Windows.Graphics.Capture.GraphicsCaptureSession",
+        &IID_IGraphicsCaptureSessionStatics, (void **)&statics))
+    return false;
+
+  boolean supported = false;
+  WGC_CALL(statics, IsSupported, &supported);
+  WGC_RELEASE(statics);
+  return supported;
+}
+
+static bool wgc_createDevice()
+{
+  HRESULT status = D3D11CreateDevice(
+    NULL,
+    D3D_DRIVER_TYPE_HARDWARE,
+    NULL,
+    D3D11_CREATE_DEVICE_BGRA_SUPPORT,
+    NULL, 0,
+    D3D11_SDK_VERSION,
+    &this->device,
+    NULL,
+    &this->deviceContext);
+
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create D3D11 device", status);
+    return false;
+  }
+
+  LG_LOCK_INIT(this->deviceContextLock);
+
+  PCreateDirect3D11DeviceFromDXGIDevice createDevice =
+    (PCreateDirect3D11DeviceFromDXGIDevice)GetProcAddress(
+        GetModuleHandleA("d3d11.dll"), "CreateDirect3D11DeviceFromDXGIDevice");
+  if (!createDevice)
+  {
+    DEBUG_ERROR("CreateDirect3D11DeviceFromDXGIDevice is not available");
+    return false;
+  }
+
+  IDXGIDevice * dxgiDevice;
+  status = ID3D11Device_QueryInterface(this->device, &IID_IDXGIDevice,
+      (void **)&dxgiDevice);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to query the IDXGIDevice interface", status);
+    return false;
+  }
+
+  // the zero copy path creates its D3D12 device on the same adapter
+  IDXGIAdapter * adapter;
+  status = IDXGIDevice_GetAdapter(dxgiDevice, &adapter);
+  if (SUCCEEDED(status))
+  {
+    status = IDXGIAdapter_QueryInterface(adapter, &IID_IDXGIAdapter1,
+        (void **)&this->adapter);
+    IDXGIAdapter_Release(adapter);
+  }
+
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to get the adapter", status);
+    IDXGIDevice_Release(dxgiDevice);
+    return false;
+  }
+
+  status = createDevice(dxgiDevice, &this->winrtDevice);
+  IDXGIDevice_Release(dxgiDevice);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the WinRT device", status);
+    return false;
+  }
+
+  DXGI_ADAPTER_DESC1 adapterDesc;
+  IDXGIAdapter1_GetDesc1(this->adapter, &adapterDesc);
+  DEBUG_INFO("Device Name      : %ls", adapterDesc.Description);
+  return true;
+}
+
+static bool wgc_createTextures()
+{
+  HRESULT status;
+
+  if (this->useZeroCopy)
+  {
+    if (zerocopy_create(this->adapter, this->device, this->maxTextures,
+          this->width, this->height, DXGI_FORMAT_B8G8R8A8_UNORM, false,
+          this->copyHighPriority, &this->zeroCopy))
+    {
+      // the shared textures take the place of the staging textures
+      for(int i = 0; i < this->maxTextures; ++i)
+      {
+        this->texture[i].tex = zerocopy_getTexture(this->zeroCopy, i);
+        ID3D11Texture2D_AddRef(this->texture[i].tex);
+      }
+
+      this->pitch  = zerocopy_getPitch(this->zeroCopy);
+      this->stride = this->pitch / 4;
+      DEBUG_INFO("Zero copy        : enabled");
+      return true;
+    }
+
+    DEBUG_WARN("Zero copy is not available, falling back to staging textures");
+  }
+
+  D3D11_TEXTURE2D_DESC texDesc;
+  memset(&texDesc, 0, sizeof(texDesc));
+  texDesc.Width              = this->width;
+  texDesc.Height             = this->height;
+  texDesc.MipLevels          = 1;
+  texDesc.ArraySize          = 1;
+  texDesc.SampleDesc.Count   = 1;
+  texDesc.SampleDesc.Quality = 0;
+  texDesc.Usage              = D3D11_USAGE_STAGING;
+  texDesc.Format             = DXGI_FORMAT_B8G8R8A8_UNORM;
+  texDesc.BindFlags          = 0;
+  texDesc.CPUAccessFlags     = D3D11_CPU_ACCESS_READ;
+  texDesc.MiscFlags          = 0;
+
+  const D3D11_QUERY_DESC queryDesc =
+  {
+    .Query     = D3D11_QUERY_EVENT,
+    .MiscFlags = 0
+  };
+
+  for(int i = 0; i < this->maxTextures; ++i)
+  {
+    status = ID3D11Device_CreateTexture2D(this->device, &texDesc, NULL,
+        &this->texture[i].tex);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to create texture", status);
+      return false;
+    }
+
+    status = ID3D11Device_CreateQuery(this->device, &queryDesc,
+        &this->texture[i].query);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to create the event query", status);
+      return false;
+    }
+  }
+
+  // map the texture simply to get the pitch and stride
+  D3D11_MAPPED_SUBRESOURCE mapping;
+  status = ID3D11DeviceContext_Map(this->deviceContext,
+      (ID3D11Resource *)this->texture[0].tex, 0, D3D11_MAP_READ, 0, &mapping);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to map the texture", status);
+    return false;
+  }
+  this->pitch  = mapping.RowPitch;
+  this->stride = mapping.RowPitch / 4;
+  ID3D11DeviceContext_Unmap(this->deviceContext,
+      (ID3D11Resource *)this->texture[0].tex, 0);
+  return true;
+}
+
+static bool wgc_init()
+{
+  assert(this);
+
+  this->stop        = false;
+  this->pointerSent = false;
+  this->texRIndex   = 0;
+  this->texWIndex   = 0;
+  atomic_store(&this->texReady, 0);
+  lgResetEvent(this->arrivedEvent);
+  lgResetEvent(this->frameEvent);
+
+  // the capture thread may already be in a multithreaded apartment
+  HRESULT status = RoInitialize(RO_INIT_MULTITHREADED);
+  this->roInit = SUCCEEDED(status);
+  if (FAILED(status) && status != RPC_E_CHANGED_MODE)
+  {
+    DEBUG_WINERROR("Failed to initialize the Windows Runtime", status);
+    return false;
+  }
+
+  if (!wgc_isSupported())
+  {
+    DEBUG_ERROR("Windows.Graphics.Capture is not supported");
+    goto fail;
+  }
+
+  if (!wgc_createDevice() || !wgc_createItem())
+    goto fail;
+
+  status = WGC_CALL(this->item, get_Size, &this->poolSize);
+  if (FAILED(status) || this->poolSize.Width <= 0 || this->poolSize.Height <= 0)
+  {
+    DEBUG_ERROR("The capture item has no size");
+    goto fail;
+  }
+
+  this->width  = this->poolSize.Width;
+  this->height = this->poolSize.Height;
+
+  IDirect3D11CaptureFramePoolStatics2 * statics;
+  if (!wgc_getFactory(L"Windows.Graphics.Capture.Direct3D11CaptureFramePool",
+        &IID_IDirect3D11CaptureFramePoolStatics2, (void **)&statics))
+    goto fail;
+
+  status = WGC_CALL(statics, CreateFreeThreaded, this->winrtDevice,
+      WGC_PIXEL_FORMAT_B8G8R8A8, POOL_BUFFERS, this->poolSize, &this->pool);
+  WGC_RELEASE(statics);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the frame pool", status);
+    goto fail;
+  }
+
+  status = WGC_CALL(this->pool, add_FrameArrived, &arrivedHandler,
+      &this->arrivedToken);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to add the frame handler", status);
+    goto fail;
+  }
+  this->arrivedAdded = true;
+
+  status = WGC_CALL(this->pool, CreateCaptureSession, this->item,
+      &this->session);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the capture session", status);
+    goto fail;
+  }
+
+  // cursor capture and the border can not be changed on older builds
+  IGraphicsCaptureSession2 * session2;
+  if (SUCCEEDED(WGC_CALL(this->session, QueryInterface,
+          &IID_IGraphicsCaptureSession2, (void **)&session2)))
+  {
+    WGC_CALL(session2, put_IsCursorCaptureEnabled, this->drawCursor);
+    WGC_RELEASE(session2);
+  }
+  else if (!this->drawCursor)
+    DEBUG_WARN("The cursor can not be hidden on this version of Windows");
+
+  IGraphicsCaptureSession3 * session3;
+  if (SUCCEEDED(WGC_CALL(this->session, QueryInterface,
+          &IID_IGraphicsCaptureSession3, (void **)&session3)))
+  {
+    WGC_CALL(session3, put_IsBorderRequired, false);
+    WGC_RELEASE(session3);
+  }
+
+  if (!wgc_createTextures())
+    goto fail;
+
+  status = WGC_CALL(this->session, StartCapture);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to start the capture", status);
+    goto fail;
+  }
+
+  DEBUG_INFO("Capture Size     : %u x %u", this->width, this->height);
+  DEBUG_INFO("Max Textures     : %d", this->maxTextures);
+  DEBUG_INFO("Cursor           : %s", this->drawCursor ? "in frame" : "hidden");
+
+  ++this->formatVer;
+  this->initialized = true;
+  return true;
+
+fail:
+  wgc_deinit();
+  return false;
+}
+
+static void wgc_stop()
+{
+  this->stop = true;
+  lgSignalEvent(this->arrivedEvent);
+  lgSignalEvent(this->frameEvent);
+}
+
+static void wgc_close(IInspectable * obj)
+{
+  IClosable * closable;
+  if (SUCCEEDED(IInspectable_QueryInterface(obj, &IID_IClosable,
+          (void **)&closable)))
+  {
+    WGC_CALL(closable, Close);
+    WGC_RELEASE(closable);
+  }
+}
+
+static bool wgc_deinit()
+{
+  assert(this);
+
+  // stop the session before the pool so no more frames arrive
+  if (this->session)
+  {
+    wgc_close((IInspectable *)this->session);
+    WGC_RELEASE(this->session);
+  }
+
+  if (this->pool)
+  {
+    if (this->arrivedAdded)
+      WGC_CALL(this->pool, remove_FrameArrived, this->arrivedToken);
+    wgc_close((IInspectable *)this->pool);
+    WGC_RELEASE(this->pool);
+  }
+  this->arrivedAdded = false;
+
+  for(int i = 0; i < this->maxTextures; ++i)
+  {
+    Texture * tex = &this->texture[i];
+    if (tex->map.pData)
+    {
+      ID3D11DeviceContext_Unmap(this->deviceContext, (ID3D11Resource *)tex->tex, 0);
+      tex->map.pData = NULL;
+    }
+
+    if (tex->tex)
+    {
+      ID3D11Texture2D_Release(tex->tex);
+      tex->tex = NULL;
+    }
+
+    if (tex->query)
+    {
+      ID3D11Query_Release(tex->query);
+      tex->query = NULL;
+    }
+
+    tex->state = TEXTURE_STATE_UNUSED;
+  }
+
+  zerocopy_free(&this->zeroCopy);
+
+  WGC_RELEASE(this->item);
+  WGC_RELEASE(this->winrtDevice);
+
+  if (this->adapter)
+  {
+    IDXGIAdapter1_Release(this->adapter);
+    this->adapter = NULL;
+  }
+
+  if (this->deviceContext)
+  {
+    ID3D11DeviceContext_Release(this->deviceContext);
+    this->deviceContext = NULL;
+    LG_LOCK_FREE(this->deviceContextLock);
+  }
+
+  if (this->device)
+  {
+    ID3D11Device_Release(this->device);
+    this->device = NULL;
+  }
+
+  if (this->roInit)
+  {
+    RoUninitialize();
+    this->roInit = false;
+  }
+
+  this->initialized = false;
+  return true;
+}
+
+static void wgc_free()
+{
+  assert(this);
+
+  if (this->initialized)
+    wgc_deinit();
+
+  lgFreeEvent(this->arrivedEvent);
+  lgFreeEvent(this->frameEvent);
+  free(this->texture);
+
+  free(this);
+  this = NULL;
+}
+
+static size_t wgc_getMaxFrameSize()
+{
+  assert(this);
+  assert(this->initialized);
+
+  // the GPU writes whole aligned blocks
+  if (this->zeroCopy)
+    return ((size_t)this->height * this->pitch + ZEROCOPY_ALIGN - 1) &
+      ~(size_t)(ZEROCOPY_ALIGN - 1);
+
+  return (size_t)this->height * this->pitch;
+}
+
+static bool wgc_getFrameTexture(IDirect3D11CaptureFrame * frame,
+    ID3D11Texture2D ** tex)
+{
+  IInspectable * surface;
+  HRESULT status = WGC_CALL(frame, get_Surface, &surface);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to get the frame surface", status);
+    return false;
+  }
+
+  IDirect3DDxgiInterfaceAccess * access;
+  status = IInspectable_QueryInterface(surface,
+      &IID_IDirect3DDxgiInterfaceAccess, (void **)&access);
+  IInspectable_Release(surface);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to query the DXGI interface access", status);
+    return false;
+  }
+
+  status = WGC_CALL(access, GetInterface, &IID_ID3D11Texture2D, (void **)tex);
+  WGC_RELEASE(access);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to get the frame texture", status);
+    return false;
+  }
+
+  return true;
+}
+
+static void wgc_releaseFrame(IDirect3D11CaptureFrame ** frame)
+{
+  // the buffer only returns to the pool once the frame is closed
+  wgc_close((IInspectable *)*frame);
+  WGC_RELEASE(*frame);
+}
+
+static CaptureResult wgc_capture()
+{
+  assert(this);
+  assert(this->initialized);
+
+  // the cursor is either in the frame or not captured at all
+  if (!this->pointerSent)
+  {
+    const CapturePointer pointer =
+    {
+      .positionUpdate = true,
+      .visible        = false
+    };
+    this->postPointerBufferFn(pointer);
+    this->pointerSent = true;
+  }
+
+  if (!lgWaitEvent(this->arrivedEvent, 1000) || this->stop)
+    return CAPTURE_RESULT_TIMEOUT;
+
+  // take the newest frame, any composed while we were busy are stale
+  IDirect3D11CaptureFrame * frame = NULL;
+  for(;;)
+  {
+    IDirect3D11CaptureFrame * next = NULL;
+    HRESULT status = WGC_CALL(this->pool, TryGetNextFrame, &next);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to get the next frame", status);
+      if (frame)
+        wgc_releaseFrame(&frame);
+      return CAPTURE_RESULT_ERROR;
+    }
+
+    if (!next)
+      break;
+
+    if (frame)
+      wgc_releaseFrame(&frame);
+    frame = next;
+  }
+
+  if (!frame)
+    return CAPTURE_RESULT_TIMEOUT;
+
+  // a resized window or mode change needs a new pool and textures
+  WGCSizeInt32 size;
+  if (SUCCEEDED(WGC_CALL(frame, get_ContentSize, &size)) &&
+      (size.Width  != this->poolSize.Width ||
+       size.Height != this->poolSize.Height))
+  {
+    wgc_releaseFrame(&frame);
+    DEBUG_INFO("Capture size changed to %d x %d", size.Width, size.Height);
+    return CAPTURE_RESULT_REINIT;
+  }
+
+  Texture * tex = &this->texture[this->texWIndex];
+  if (tex->state != TEXTURE_STATE_UNUSED)
+  {
+    // the client is behind, skip this frame
+    wgc_releaseFrame(&frame);
+    return CAPTURE_RESULT_TIMEOUT;
+  }
+
+  ID3D11Texture2D * src;
+  if (!wgc_getFrameTexture(frame, &src))
+  {
+    wgc_releaseFrame(&frame);
+    return CAPTURE_RESULT_ERROR;
+  }
+
+  // the time is in 100ns units of the performance counter, as is microtime
+  WGCTimeSpan time = { 0 };
+  WGC_CALL(frame, get_SystemRelativeTime, &time);
+  tex->presentTime = time.Duration / 10;
+
+  // the copy is queued so the frame can go back to the pool straight away
+  LOCKED(
+  {
+    ID3D11DeviceContext_CopyResource(this->deviceContext,
+        (ID3D11Resource *)tex->tex, (ID3D11Resource *)src);
+
+    if (this->zeroCopy)
+      zerocopy_signal(this->zeroCopy, this->deviceContext, this->texWIndex);
+    else
+      ID3D11DeviceContext_End(this->deviceContext,
+          (ID3D11Asynchronous *)tex->query);
+
+    ID3D11DeviceContext_Flush(this->deviceContext);
+  });
+
+  ID3D11Texture2D_Release(src);
+  wgc_releaseFrame(&frame);
+
+  tex->state = TEXTURE_STATE_PENDING_MAP;
+  if (++this->texWIndex == this->maxTextures)
+    this->texWIndex = 0;
+
+  atomic_fetch_add_explicit(&this->texReady, 1, memory_order_release);
+  lgSignalEvent(this->frameEvent);
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult wgc_waitTexture(Texture * tex)
+{
+  // queries must be polled through the context, this only holds the lock
+  // for a moment each time
+  for(int i = 0; ; ++i)
+  {
+    HRESULT status;
+    LOCKED({status = ID3D11DeviceContext_GetData(this->deviceContext,
+        (ID3D11Asynchronous *)tex->query, NULL, 0,
+        D3D11_ASYNC_GETDATA_DONOTFLUSH);});
+
+    if (status == S_OK)
+      return CAPTURE_RESULT_OK;
+
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to get the query data", status);
+      return CAPTURE_RESULT_ERROR;
+    }
+
+    if (i == 1000)
+      return CAPTURE_RESULT_TIMEOUT;
+
+    if (i < 100)
+      YieldProcessor();
+    else
+      nsleep(1000);
+  }
+}
+
+static CaptureResult wgc_waitFrame(CaptureFrame * frame)
+{
+  assert(this);
+  assert(this->initialized);
+
+  // NOTE: the event may be signaled when there are no frames available
+  if (atomic_load_explicit(&this->texReady, memory_order_acquire) == 0)
+  {
+    if (!lgWaitEvent(this->frameEvent, 1000))
+      return CAPTURE_RESULT_TIMEOUT;
+
+    if (atomic_load_explicit(&this->texReady, memory_order_acquire) == 0)
+      return CAPTURE_RESULT_TIMEOUT;
+  }
+
+  Texture * tex = &this->texture[this->texRIndex];
+
+  // with zero copy the GPU writes the frame in getFrame
+  if (!this->zeroCopy)
+  {
+    CaptureResult result = wgc_waitTexture(tex);
+    if (result != CAPTURE_RESULT_OK)
+      return result;
+
+    HRESULT status;
+    LOCKED({status = ID3D11DeviceContext_Map(this->deviceContext,
+        (ID3D11Resource *)tex->tex, 0, D3D11_MAP_READ, 0, &tex->map);});
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to map the texture", status);
+      return CAPTURE_RESULT_ERROR;
+    }
+  }
+
+  tex->state = TEXTURE_STATE_MAPPED;
+
+  frame->formatVer        = this->formatVer;
+  frame->width            = this->width;
+  frame->height           = this->height;
+  frame->screenWidth      = this->width;
+  frame->screenHeight     = this->height;
+  frame->pitch            = this->pitch;
+  frame->stride           = this->stride;
+  frame->format           = CAPTURE_FMT_BGRA;
+  frame->presentTime      = tex->presentTime;
+  frame->damageRectsCount = 0;
+
+  atomic_fetch_sub_explicit(&this->texReady, 1, memory_order_release);
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult wgc_getFrame(FrameBuffer * frame,
+    const FrameDamageRect * rects, unsigned int rectsCount)
+{
+  assert(this);
+  assert(this->initialized);
+
+  Texture * tex = &this->texture[this->texRIndex];
+
+  if (this->zeroCopy)
+  {
+    // the reader can only see the frame once the GPU copy has completed
+    if (!zerocopy_copy(this->zeroCopy, this->texRIndex,
+          framebuffer_get_write_data(frame), rects, rectsCount))
+      return CAPTURE_RESULT_ERROR;
+
+    framebuffer_set_write_ptr(frame, this->pitch * this->height);
+  }
+  else
+  {
+    if (rectsCount == 0)
+      framebuffer_write(frame, tex->map.pData, this->pitch * this->height);
+    else
+      framebuffer_write_rects(frame, tex->map.pData, this->pitch, this->height,
+          4, rects, rectsCount);
+
+    LOCKED({ID3D11DeviceContext_Unmap(this->deviceContext,
+        (ID3D11Resource *)tex->tex, 0);});
+    tex->map.pData = NULL;
+  }
+
+  tex->state = TEXTURE_STATE_UNUSED;
+  if (++this->texRIndex == this->maxTextures)
+    this->texRIndex = 0;
+
+  return CAPTURE_RESULT_OK;
+}
+
+static void wgc_wakeFrame()
+{
+  assert(this);
+  lgSignalEvent(this->frameEvent);
+}
+
+struct CaptureInterface Capture_WGC =
+{
+  .getName         = wgc_getName,
+  .initOptions     = wgc_initOptions,
+  .create          = wgc_create,
+  .init            = wgc_init,
+  .stop            = wgc_stop,
+  .deinit          = wgc_deinit,
+  .free            = wgc_free,
+  .getMaxFrameSize = wgc_getMaxFrameSize,
+  .capture         = wgc_capture,
+  .waitFrame       = wgc_waitFrame,
+  .getFrame        = wgc_getFrame,
+  .wakeFrame       = wgc_wakeFrame
+};
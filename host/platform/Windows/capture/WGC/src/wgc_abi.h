@@ -0,0 +1,334 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <windows.h>
+#include <inspectable.h>
+#include <roapi.h>
+#include <winstring.h>
+#include <dxgi.h>
+
+/*
+ * The Windows.Graphics.Capture ABI is only published as C++ and IDL, these
+ * are the parts of it used here declared for C. Every interface but the
+ * interop ones derives from IInspectable.
+ */
+
+typedef struct WGCSizeInt32
+{
+  INT32 Width;
+  INT32 Height;
+}
+WGCSizeInt32;
+
+typedef struct WGCTimeSpan
+{
+  INT64 Duration; // 100ns units
+}
+WGCTimeSpan;
+
+typedef struct WGCEventToken
+{
+  INT64 value;
+}
+WGCEventToken;
+
+// Windows.Graphics.DirectX.DirectXPixelFormat
+#define WGC_PIXEL_FORMAT_B8G8R8A8 87
+
+#define WGC_INSPECTABLE_METHODS(type) \
+  HRESULT (STDMETHODCALLTYPE *QueryInterface)(type * This, REFIID riid, \
+      void ** ppvObject); \
+  ULONG   (STDMETHODCALLTYPE *AddRef )(type * This); \
+  ULONG   (STDMETHODCALLTYPE *Release)(type * This); \
+  HRESULT (STDMETHODCALLTYPE *GetIids)(type * This, ULONG * iidCount, \
+      IID ** iids); \
+  HRESULT (STDMETHODCALLTYPE *GetRuntimeClassName)(type * This, \
+      HSTRING * className); \
+  HRESULT (STDMETHODCALLTYPE *GetTrustLevel)(type * This, \
+      TrustLevel * trustLevel);
+
+typedef struct IGraphicsCaptureItem         IGraphicsCaptureItem;
+typedef struct IGraphicsCaptureSession      IGraphicsCaptureSession;
+typedef struct IDirect3D11CaptureFrame      IDirect3D11CaptureFrame;
+typedef struct IDirect3D11CaptureFramePool  IDirect3D11CaptureFramePool;
+typedef struct IFramePoolArrivedHandler     IFramePoolArrivedHandler;
+
+/*** IGraphicsCaptureItemInterop ***/
+DEFINE_GUID(IID_IGraphicsCaptureItemInterop, 0x3628e81b, 0x3cac, 0x4c60, 0xb7,0xf4,0x23,0xce,0x0e,0x0c,0x33,0x56);
+
+typedef struct IGraphicsCaptureItemInterop IGraphicsCaptureItemInterop;
+typedef struct IGraphicsCaptureItemInteropVtbl
+{
+  HRESULT (STDMETHODCALLTYPE *QueryInterface)(IGraphicsCaptureItemInterop * This,
+      REFIID riid, void ** ppvObject);
+  ULONG   (STDMETHODCALLTYPE *AddRef )(IGraphicsCaptureItemInterop * This);
+  ULONG   (STDMETHODCALLTYPE *Release)(IGraphicsCaptureItemInterop * This);
+
+  HRESULT (STDMETHODCALLTYPE *CreateForWindow)(IGraphicsCaptureItemInterop * This,
+      HWND window, REFIID riid, void ** result);
+  HRESULT (STDMETHODCALLTYPE *CreateForMonitor)(IGraphicsCaptureItemInterop * This,
+      HMONITOR monitor, REFIID riid, void ** result);
+}
+IGraphicsCaptureItemInteropVtbl;
+
+struct IGraphicsCaptureItemInterop
+{
+  const IGraphicsCaptureItemInteropVtbl * lpVtbl;
+};
+
+/*** IGraphicsCaptureItem ***/
+DEFINE_GUID(IID_IGraphicsCaptureItem, 0x79c3f95b, 0x31f7, 0x4ec2, 0xa4,0x64,0x63,0x2e,0xf5,0xd3,0x07,0x60);
+
+typedef struct IGraphicsCaptureItemVtbl
+{
+  WGC_INSPECTABLE_METHODS(IGraphicsCaptureItem)
+
+  HRESULT (STDMETHODCALLTYPE *get_DisplayName)(IGraphicsCaptureItem * This,
+      HSTRING * value);
+  HRESULT (STDMETHODCALLTYPE *get_Size)(IGraphicsCaptureItem * This,
+      WGCSizeInt32 * value);
+  HRESULT (STDMETHODCALLTYPE *add_Closed)(IGraphicsCaptureItem * This,
+      IUnknown * handler, WGCEventToken * token);
+  HRESULT (STDMETHODCALLTYPE *remove_Closed)(IGraphicsCaptureItem * This,
+      WGCEventToken token);
+}
+IGraphicsCaptureItemVtbl;
+
+struct IGraphicsCaptureItem
+{
+  const IGraphicsCaptureItemVtbl * lpVtbl;
+};
+
+/*** IGraphicsCaptureSession ***/
+DEFINE_GUID(IID_IGraphicsCaptureSession, 0x814e42a9, 0xf70f, 0x4ad7, 0x93,0x9b,0xfd,0xdc,0xc6,0xeb,0x88,0x0d);
+
+typedef struct IGraphicsCaptureSessionVtbl
+{
+  WGC_INSPECTABLE_METHODS(IGraphicsCaptureSession)
+
+  HRESULT (STDMETHODCALLTYPE *StartCapture)(IGraphicsCaptureSession * This);
+}
+IGraphicsCaptureSessionVtbl;
+
+struct IGraphicsCaptureSession
+{
+  const IGraphicsCaptureSessionVtbl * lpVtbl;
+};
+
+/*** IGraphicsCaptureSession2, Windows 10 2004 ***/
+DEFINE_GUID(IID_IGraphicsCaptureSession2, 0x2c39ae40, 0x7d2e, 0x5044, 0x80,0x4e,0x8b,0x67,0x99,0xd4,0xcf,0x9e);
+
+typedef struct IGraphicsCaptureSession2 IGraphicsCaptureSession2;
+typedef struct IGraphicsCaptureSession2Vtbl
+{
+  WGC_INSPECTABLE_METHODS(IGraphicsCaptureSession2)
+
+  HRESULT (STDMETHODCALLTYPE *get_IsCursorCaptureEnabled)(
+      IGraphicsCaptureSession2 * This, boolean * value);
+  HRESULT (STDMETHODCALLTYPE *put_IsCursorCaptureEnabled)(
+      IGraphicsCaptureSession2 * This, boolean value);
+}
+IGraphicsCaptureSession2Vtbl;
+
+struct IGraphicsCaptureSession2
+{
+  const IGraphicsCaptureSession2Vtbl * lpVtbl;
+};
+
+/*** IGraphicsCaptureSession3, Windows 11 ***/
+DEFINE_GUID(IID_IGraphicsCaptureSession3, 0xf2cdd966, 0x22ae, 0x5ea1, 0x95,0x96,0x3a,0x28,0x93,0x44,0xc3,0xbe);
+
+typedef struct IGraphicsCaptureSession3 IGraphicsCaptureSession3;
+typedef struct IGraphicsCaptureSession3Vtbl
+{
+  WGC_INSPECTABLE_METHODS(IGraphicsCaptureSession3)
+
+  HRESULT (STDMETHODCALLTYPE *get_IsBorderRequired)(
+      IGraphicsCaptureSession3 * This, boolean * value);
+  HRESULT (STDMETHODCALLTYPE *put_IsBorderRequired)(
+      IGraphicsCaptureSession3 * This, boolean value);
+}
+IGraphicsCaptureSession3Vtbl;
+
+struct IGraphicsCaptureSession3
+{
+  const IGraphicsCaptureSession3Vtbl * lpVtbl;
+};
+
+/*** IGraphicsCaptureSessionStatics ***/
+DEFINE_GUID(IID_IGraphicsCaptureSessionStatics, 0x2224a540, 0x5974, 0x49aa, 0xb2,0x32,0x08,0x82,0x53,0x6f,0x4c,0xb5);
+
+typedef struct IGraphicsCaptureSessionStatics IGraphicsCaptureSessionStatics;
+typedef struct IGraphicsCaptureSessionStaticsVtbl
+{
+  WGC_INSPECTABLE_METHODS(IGraphicsCaptureSessionStatics)
+
+  HRESULT (STDMETHODCALLTYPE *IsSupported)(
+      IGraphicsCaptureSessionStatics * This, boolean * result);
+}
+IGraphicsCaptureSessionStaticsVtbl;
+
+struct IGraphicsCaptureSessionStatics
+{
+  const IGraphicsCaptureSessionStaticsVtbl * lpVtbl;
+};
+
+/*** IDirect3D11CaptureFrame ***/
+DEFINE_GUID(IID_IDirect3D11CaptureFrame, 0xfa50c623, 0x38da, 0x4b32, 0xac,0xf3,0xfa,0x97,0x34,0xad,0x80,0x0e);
+
+typedef struct IDirect3D11CaptureFrameVtbl
+{
+  WGC_INSPECTABLE_METHODS(IDirect3D11CaptureFrame)
+
+  // the surface is an IDirect3DSurface, get the texture from it through
+  // IDirect3DDxgiInterfaceAccess
+  HRESULT (STDMETHODCALLTYPE *get_Surface)(IDirect3D11CaptureFrame * This,
+      IInspectable ** value);
+  HRESULT (STDMETHODCALLTYPE *get_SystemRelativeTime)(
+      IDirect3D11CaptureFrame * This, WGCTimeSpan * value);
+  HRESULT (STDMETHODCALLTYPE *get_ContentSize)(IDirect3D11CaptureFrame * This,
+      WGCSizeInt32 * value);
+}
+IDirect3D11CaptureFrameVtbl;
+
+struct IDirect3D11CaptureFrame
+{
+  const IDirect3D11CaptureFrameVtbl * lpVtbl;
+};
+
+/*** IDirect3D11CaptureFramePool ***/
+DEFINE_GUID(IID_IDirect3D11CaptureFramePool, 0x24eb6d22, 0x1975, 0x422e, 0x82,0xe7,0x78,0x0d,0xbd,0x8d,0xdf,0x24);
+
+typedef struct IDirect3D11CaptureFramePoolVtbl
+{
+  WGC_INSPECTABLE_METHODS(IDirect3D11CaptureFramePool)
+
+  HRESULT (STDMETHODCALLTYPE *Recreate)(IDirect3D11CaptureFramePool * This,
+      IInspectable * device, INT32 pixelFormat, INT32 numberOfBuffers,
+      WGCSizeInt32 size);
+  HRESULT (STDMETHODCALLTYPE *TryGetNextFrame)(
+      IDirect3D11CaptureFramePool * This, IDirect3D11CaptureFrame ** result);
+  HRESULT (STDMETHODCALLTYPE *add_FrameArrived)(
+      IDirect3D11CaptureFramePool * This, IFramePoolArrivedHandler * handler,
+      WGCEventToken * token);
+  HRESULT (STDMETHODCALLTYPE *remove_FrameArrived)(
+      IDirect3D11CaptureFramePool * This, WGCEventToken token);
+  HRESULT (STDMETHODCALLTYPE *CreateCaptureSession)(
+      IDirect3D11CaptureFramePool * This, IGraphicsCaptureItem * item,
+      IGraphicsCaptureSession ** result);
+  HRESULT (STDMETHODCALLTYPE *get_DispatcherQueue)(
+      IDirect3D11CaptureFramePool * This, IInspectable ** value);
+}
+IDirect3D11CaptureFramePoolVtbl;
+
+struct IDirect3D11CaptureFramePool
+{
+  const IDirect3D11CaptureFramePoolVtbl * lpVtbl;
+};
+
+/*** IDirect3D11CaptureFramePoolStatics2 ***/
+DEFINE_GUID(IID_IDirect3D11CaptureFramePoolStatics2, 0x589b103f, 0x6bbc, 0x5df5, 0xa9,0x91,0x02,0xe2,0x8b,0x3b,0x66,0xd5);
+
+typedef struct IDirect3D11CaptureFramePoolStatics2 IDirect3D11CaptureFramePoolStatics2;
+typedef struct IDirect3D11CaptureFramePoolStatics2Vtbl
+{
+  WGC_INSPECTABLE_METHODS(IDirect3D11CaptureFramePoolStatics2)
+
+  // frames arrive on a system thread rather than a dispatcher queue
+  HRESULT (STDMETHODCALLTYPE *CreateFreeThreaded)(
+      IDirect3D11CaptureFramePoolStatics2 * This, IInspectable * device,
+      INT32 pixelFormat, INT32 numberOfBuffers, WGCSizeInt32 size,
+      IDirect3D11CaptureFramePool ** result);
+}
+IDirect3D11CaptureFramePoolStatics2Vtbl;
+
+struct IDirect3D11CaptureFramePoolStatics2
+{
+  const IDirect3D11CaptureFramePoolStatics2Vtbl * lpVtbl;
+};
+
+/*** TypedEventHandler<Direct3D11CaptureFramePool, IInspectable> ***/
+DEFINE_GUID(IID_IFramePoolArrivedHandler, 0x51a947f7, 0x79cf, 0x5a3e, 0xa3,0xa5,0x12,0x89,0xcf,0xa6,0xdf,0xe8);
+
+typedef struct IFramePoolArrivedHandlerVtbl
+{
+  HRESULT (STDMETHODCALLTYPE *QueryInterface)(IFramePoolArrivedHandler * This,
+      REFIID riid, void ** ppvObject);
+  ULONG   (STDMETHODCALLTYPE *AddRef )(IFramePoolArrivedHandler * This);
+  ULONG   (STDMETHODCALLTYPE *Release)(IFramePoolArrivedHandler * This);
+
+  HRESULT (STDMETHODCALLTYPE *Invoke)(IFramePoolArrivedHandler * This,
+      IDirect3D11CaptureFramePool * sender, IInspectable * args);
+}
+IFramePoolArrivedHandlerVtbl;
+
+struct IFramePoolArrivedHandler
+{
+  const IFramePoolArrivedHandlerVtbl * lpVtbl;
+};
+
+/*** IDirect3DDxgiInterfaceAccess ***/
+DEFINE_GUID(IID_IDirect3DDxgiInterfaceAccess, 0xa9b3d012, 0x3df2, 0x4ee3, 0xb8,0xd1,0x86,0x95,0xf4,0x57,0xd3,0xc1);
+
+typedef struct IDirect3DDxgiInterfaceAccess IDirect3DDxgiInterfaceAccess;
+typedef struct IDirect3DDxgiInterfaceAccessVtbl
+{
+  HRESULT (STDMETHODCALLTYPE *QueryInterface)(IDirect3DDxgiInterfaceAccess * This,
+      REFIID riid, void ** ppvObject);
+  ULONG   (STDMETHODCALLTYPE *AddRef )(IDirect3DDxgiInterfaceAccess * This);
+  ULONG   (STDMETHODCALLTYPE *Release)(IDirect3DDxgiInterfaceAccess * This);
+
+  HRESULT (STDMETHODCALLTYPE *GetInterface)(IDirect3DDxgiInterfaceAccess * This,
+      REFIID riid, void ** ppvObject);
+}
+IDirect3DDxgiInterfaceAccessVtbl;
+
+struct IDirect3DDxgiInterfaceAccess
+{
+  const IDirect3DDxgiInterfaceAccessVtbl * lpVtbl;
+};
+
+/*** IClosable ***/
+DEFINE_GUID(IID_IClosable, 0x30d5a829, 0x7fa4, 0x4026, 0x83,0xbb,0xd7,0x5b,0xae,0x4e,0xa9,0x9e);
+
+typedef struct IClosable IClosable;
+typedef struct IClosableVtbl
+{
+  WGC_INSPECTABLE_METHODS(IClosable)
+
+  HRESULT (STDMETHODCALLTYPE *Close)(IClosable * This);
+}
+IClosableVtbl;
+
+struct IClosable
+{
+  const IClosableVtbl * lpVtbl;
+};
+
+// exported by d3d11.dll but not declared by mingw, wraps the DXGI device as
+// the IDirect3DDevice the frame pool takes
+typedef HRESULT (WINAPI *PCreateDirect3D11DeviceFromDXGIDevice)(
+    IDXGIDevice * dxgiDevice, IInspectable ** graphicsDevice);
+
+// the calls are made through the vtables as there are no COBJMACROS for these
+#define WGC_CALL(obj, method, ...) ((obj)->lpVtbl->method((obj), ##__VA_ARGS__))
+#define WGC_RELEASE(obj) \
+  do { if (obj) { (obj)->lpVtbl->Release(obj); (obj) = NULL; } } while(0)
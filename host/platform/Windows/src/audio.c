@@ -0,0 +1,269 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#define COBJMACROS
+
+#include "interface/platform.h"
+#include "common/debug.h"
+#include "common/windebug.h"
+#include "common/thread.h"
+#include "common/time.h"
+
+#include <windows.h>
+#include <initguid.h>
+#include <mmdeviceapi.h>
+#include <audioclient.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the shared mode buffer, loopback packets are read as soon as they arrive
+#define AUDIO_BUFFER_TIME (20 * 10000)
+
+static struct
+{
+  AudioDataFn dataFn;
+  LGThread  * thread;
+  atomic_bool running;
+}
+audio = { 0 };
+
+// returns true if the capture should be restarted, such as when the default
+// device changes
+static bool audioCapture()
+{
+  IMMDeviceEnumerator * enumerator = NULL;
+  IMMDevice           * device     = NULL;
+  IAudioClient        * client     = NULL;
+  IAudioCaptureClient * capture    = NULL;
+  WAVEFORMATEX        * fmt        = NULL;
+  float               * conv       = NULL;
+  bool                  retry      = false;
+  HRESULT               hr;
+
+  hr = CoCreateInstance(&CLSID_MMDeviceEnumerator, NULL, CLSCTX_ALL,
+      &IID_IMMDeviceEnumerator, (void **)&enumerator);
+  if (FAILED(hr))
+  {
+    DEBUG_WINERROR("Failed to create the device enumerator", hr);
+    goto done;
+  }
+
+  // there may be no output until the guest has one
+  hr = IMMDeviceEnumerator_GetDefaultAudioEndpoint(enumerator, eRender,
+      eConsole, &device);
+  if (FAILED(hr))
+  {
+    retry = true;
+    goto done;
+  }
+
+  hr = IMMDevice_Activate(device, &IID_IAudioClient, CLSCTX_ALL, NULL,
+      (void **)&client);
+  if (FAILED(hr))
+  {
+    DEBUG_WINERROR("Failed to activate the audio client", hr);
+    retry = true;
+    goto done;
+  }
+
+  hr = IAudioClient_GetMixFormat(client, &fmt);
+  if (FAILED(hr))
+  {
+    DEBUG_WINERROR("GetMixFormat failed", hr);
+    goto done;
+  }
+
+  // the subformat GUIDs start with the format tag they stand for
+  WORD tag = fmt->wFormatTag;
+  if (tag == WAVE_FORMAT_EXTENSIBLE)
+    tag = ((WAVEFORMATEXTENSIBLE *)fmt)->SubFormat.Data1;
+
+  const bool isFloat = tag == WAVE_FORMAT_IEEE_FLOAT && fmt->wBitsPerSample == 32;
+  if (!(isFloat || (tag == WAVE_FORMAT_PCM && fmt->wBitsPerSample == 16)) ||
+      fmt->nChannels > KVMFR_AUDIO_MAX_CHANNELS)
+  {
+    DEBUG_ERROR("Unsupported mix format: tag 0x%x, %u bits, %u channels",
+        tag, fmt->wBitsPerSample, fmt->nChannels);
+    goto done;
+  }
+
+  hr = IAudioClient_Initialize(client, AUDCLNT_SHAREMODE_SHARED,
+      AUDCLNT_STREAMFLAGS_LOOPBACK, AUDIO_BUFFER_TIME, 0, fmt, NULL);
+  if (FAILED(hr))
+  {
+    DEBUG_WINERROR("Failed to initialize the loopback capture", hr);
+    goto done;
+  }
+
+  REFERENCE_TIME period;
+  if (FAILED(IAudioClient_GetDevicePeriod(client, &period, NULL)))
+    period = 100000;
+
+  hr = IAudioClient_GetService(client, &IID_IAudioCaptureClient,
+      (void **)&capture);
+  if (FAILED(hr))
+  {
+    DEBUG_WINERROR("Failed to get the capture client", hr);
+    goto done;
+  }
+
+  const uint32_t rate     = fmt->nSamplesPerSec;
+  const uint32_t channels = fmt->nChannels;
+  conv = malloc(KVMFR_AUDIO_MAX_FRAMES * channels * sizeof(float));
+  if (!conv)
+  {
+    DEBUG_ERROR("out of memory");
+    goto done;
+  }
+
+  hr = IAudioClient_Start(client);
+  if (FAILED(hr))
+  {
+    DEBUG_WINERROR("Failed to start the loopback capture", hr);
+    goto done;
+  }
+
+  DEBUG_INFO("Audio Capture     : %u Hz, %u channels, %s", rate, channels,
+      isFloat ? "float" : "16 bit");
+
+  while(atomic_load(&audio.running))
+  {
+    UINT32 packet;
+    hr = IAudioCaptureClient_GetNextPacketSize(capture, &packet);
+    if (FAILED(hr))
+      break;
+
+    // half a device period keeps the delay well under what WASAPI buffers
+    if (!packet)
+    {
+      nsleep(period * 50);
+      continue;
+    }
+
+    BYTE * data;
+    UINT32 frames;
+    DWORD  flags;
+    UINT64 qpcPos;
+    hr = IAudioCaptureClient_GetBuffer(capture, &data, &frames, &flags, NULL,
+        &qpcPos);
+    if (FAILED(hr))
+      break;
+
+    // the position is in 100ns units of the performance counter as is
+    // microtime
+    const uint64_t captureTime = qpcPos / 10;
+    for(UINT32 done = 0; done < frames;)
+    {
+      UINT32 n = frames - done;
+      if (n > KVMFR_AUDIO_MAX_FRAMES)
+        n = KVMFR_AUDIO_MAX_FRAMES;
+
+      const float * out = conv;
+      if (flags & AUDCLNT_BUFFERFLAGS_SILENT)
+        memset(conv, 0, n * channels * sizeof(float));
+      else if (isFloat)
+        out = (const float *)data + done * channels;
+      else
+      {
+        const int16_t * in = (const int16_t *)data + done * channels;
+        for(UINT32 i = 0; i < n * channels; ++i)
+          conv[i] = in[i] / 32768.0f;
+      }
+
+      audio.dataFn(rate, channels, out, n,
+          captureTime + (uint64_t)done * 1000000ULL / rate);
+      done += n;
+    }
+
+    IAudioCaptureClient_ReleaseBuffer(capture, frames);
+  }
+
+  if (FAILED(hr))
+  {
+    if (hr == AUDCLNT_E_DEVICE_INVALIDATED)
+    {
+      DEBUG_INFO("The audio device changed, restarting the capture");
+      retry = true;
+    }
+    else
+      DEBUG_WINERROR("The loopback capture failed", hr);
+  }
+
+  IAudioClient_Stop(client);
+
+done:
+  free(conv);
+  if (fmt)
+    CoTaskMemFree(fmt);
+  if (capture)
+    IAudioCaptureClient_Release(capture);
+  if (client)
+    IAudioClient_Release(client);
+  if (device)
+    IMMDevice_Release(device);
+  if (enumerator)
+    IMMDeviceEnumerator_Release(enumerator);
+  return retry;
+}
+
+static int audioThread(void * opaque)
+{
+  CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+  while(atomic_load(&audio.running))
+  {
+    if (!audioCapture())
+    {
+      DEBUG_WARN("The guest audio will not be captured");
+      break;
+    }
+
+    for(int i = 0; i < 10 && atomic_load(&audio.running); ++i)
+      Sleep(100);
+  }
+
+  CoUninitialize();
+  return 0;
+}
+
+bool os_audioInit(AudioDataFn dataFn)
+{
+  audio.dataFn = dataFn;
+  atomic_store(&audio.running, true);
+
+  if (!lgCreateThread("AudioThread", audioThread, NULL, &audio.thread))
+  {
+    DEBUG_ERROR("Failed to create the audio thread");
+    atomic_store(&audio.running, false);
+    return false;
+  }
+
+  return true;
+}
+
+void os_audioFree()
+{
+  if (!audio.thread)
+    return;
+
+  atomic_store(&audio.running, false);
+  lgJoinThread(audio.thread, NULL);
+  audio.thread = NULL;
+}
@@ -0,0 +1,420 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "interface/platform.h"
+#include "common/debug.h"
+#include "common/windebug.h"
+#include "common/thread.h"
+#include "common/event.h"
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WM_CLIPBOARD_SET (WM_USER + 1)
+
+struct ClipboardSet
+{
+  KVMFRClipboardType type;
+  const void       * data;
+  size_t             size;
+  bool               ok;
+};
+
+static struct
+{
+  ClipboardChangeFn changeFn;
+  LGThread        * thread;
+  LGEvent         * ready;
+  HWND              wnd;
+  bool              ok;
+  UINT              cfPNG, cfJPEG;
+}
+cb = { 0 };
+
+// another program may have the clipboard open for a moment
+static bool openClipboard()
+{
+  for(int i = 0; i < 10; ++i)
+  {
+    if (OpenClipboard(cb.wnd))
+      return true;
+    Sleep(10);
+  }
+
+  DEBUG_WINERROR("OpenClipboard failed", GetLastError());
+  return false;
+}
+
+static void * readText(HANDLE h, size_t * size)
+{
+  const wchar_t * wstr = GlobalLock(h);
+  if (!wstr)
+    return NULL;
+
+  char * str = NULL;
+  const int len = WideCharToMultiByte(CP_UTF8, 0, wstr, -1, NULL, 0, NULL, NULL);
+  if (len > 0 && (str = malloc(len)))
+  {
+    WideCharToMultiByte(CP_UTF8, 0, wstr, -1, str, len, NULL, NULL);
+
+    // the client expects unix line endings and no terminator
+    char * out = str;
+    for(const char * in = str; *in; ++in)
+      if (*in != '\r')
+        *out++ = *in;
+    *size = out - str;
+  }
+
+  GlobalUnlock(h);
+  return str;
+}
+
+static void * readBMP(HANDLE h, size_t * size)
+{
+  const BITMAPINFOHEADER * bi = GlobalLock(h);
+  if (!bi)
+    return NULL;
+
+  const size_t dibSize = GlobalSize(h);
+  size_t colors = bi->biClrUsed;
+  if (!colors && bi->biBitCount <= 8)
+    colors = 1 << bi->biBitCount;
+
+  size_t offset = sizeof(BITMAPFILEHEADER) + bi->biSize + colors * 4;
+  if (bi->biSize == sizeof(BITMAPINFOHEADER) && bi->biCompression == BI_BITFIELDS)
+    offset += 3 * sizeof(DWORD);
+
+  uint8_t * bmp = malloc(sizeof(BITMAPFILEHEADER) + dibSize);
+  if (bmp)
+  {
+    BITMAPFILEHEADER fh =
+    {
+      .bfType    = 0x4d42, // BM
+      .bfSize    = sizeof(BITMAPFILEHEADER) + dibSize,
+      .bfOffBits = offset
+    };
+    memcpy(bmp, &fh, sizeof(fh));
+    memcpy(bmp + sizeof(fh), bi, dibSize);
+    *size = sizeof(fh) + dibSize;
+  }
+
+  GlobalUnlock(h);
+  return bmp;
+}
+
+static void * readRaw(HANDLE h, size_t * size)
+{
+  const void * src = GlobalLock(h);
+  if (!src)
+    return NULL;
+
+  const size_t len = GlobalSize(h);
+  void * data = malloc(len);
+  if (data)
+  {
+    memcpy(data, src, len);
+    *size = len;
+  }
+
+  GlobalUnlock(h);
+  return data;
+}
+
+static void clipboardUpdate()
+{
+  // the change was made by os_clipboardSet
+  if (GetClipboardOwner() == cb.wnd)
+    return;
+
+  if (!openClipboard())
+    return;
+
+  KVMFRClipboardType type;
+  void * data = NULL;
+  size_t size = 0;
+  HANDLE h;
+
+  if (IsClipboardFormatAvailable(cb.cfPNG) && (h = GetClipboardData(cb.cfPNG)))
+  {
+    type = KVMFR_CLIPBOARD_PNG;
+    data = readRaw(h, &size);
+  }
+  else if (IsClipboardFormatAvailable(CF_DIB) && (h = GetClipboardData(CF_DIB)))
+  {
+    type = KVMFR_CLIPBOARD_BMP;
+    data = readBMP(h, &size);
+  }
+  else if (IsClipboardFormatAvailable(CF_UNICODETEXT) &&
+      (h = GetClipboardData(CF_UNICODETEXT)))
+  {
+    type = KVMFR_CLIPBOARD_TEXT;
+    data = readText(h, &size);
+  }
+  CloseClipboard();
+
+  // the clipboard is closed before the client is waited on
+  if (data)
+  {
+    cb.changeFn(type, data, size);
+    free(data);
+  }
+}
+
+static HGLOBAL toGlobal(const void * data, size_t size)
+{
+  HGLOBAL h = GlobalAlloc(GMEM_MOVEABLE, size);
+  if (!h)
+    return NULL;
+
+  memcpy(GlobalLock(h), data, size);
+  GlobalUnlock(h);
+  return h;
+}
+
+static HGLOBAL textToGlobal(const char * text, size_t size)
+{
+  // windows expects CRLF line endings and a terminator
+  char * crlf = malloc(size * 2 + 1);
+  if (!crlf)
+    return NULL;
+
+  size_t len = 0;
+  for(size_t i = 0; i < size; ++i)
+  {
+    if (text[i] == '\n' && (i == 0 || text[i - 1] != '\r'))
+      crlf[len++] = '\r';
+    crlf[len++] = text[i];
+  }
+  crlf[len++] = '\0';
+
+  HGLOBAL h = NULL;
+  const int wlen = MultiByteToWideChar(CP_UTF8, 0, crlf, len, NULL, 0);
+  if (wlen > 0 && (h = GlobalAlloc(GMEM_MOVEABLE, wlen * sizeof(wchar_t))))
+  {
+    MultiByteToWideChar(CP_UTF8, 0, crlf, len, GlobalLock(h), wlen);
+    GlobalUnlock(h);
+  }
+
+  free(crlf);
+  return h;
+}
+
+static bool clipboardSet(const struct ClipboardSet * set)
+{
+  UINT    format;
+  HGLOBAL h;
+  switch(set->type)
+  {
+    case KVMFR_CLIPBOARD_TEXT:
+      format = CF_UNICODETEXT;
+      h      = textToGlobal(set->data, set->size);
+      break;
+
+    case KVMFR_CLIPBOARD_PNG:
+      format = cb.cfPNG;
+      h      = toGlobal(set->data, set->size);
+      break;
+
+    case KVMFR_CLIPBOARD_BMP:
+      // windows wants the DIB without the file header
+      if (set->size <= sizeof(BITMAPFILEHEADER))
+        return false;
+      format = CF_DIB;
+      h      = toGlobal((const uint8_t *)set->data + sizeof(BITMAPFILEHEADER),
+          set->size - sizeof(BITMAPFILEHEADER));
+      break;
+
+    case KVMFR_CLIPBOARD_TIFF:
+      format = CF_TIFF;
+      h      = toGlobal(set->data, set->size);
+      break;
+
+    case KVMFR_CLIPBOARD_JPEG:
+      format = cb.cfJPEG;
+      h      = toGlobal(set->data, set->size);
+      break;
+
+    default:
+      return false;
+  }
+
+  if (!h)
+  {
+    DEBUG_ERROR("Failed to allocate the clipboard data");
+    return false;
+  }
+
+  if (!openClipboard())
+  {
+    GlobalFree(h);
+    return false;
+  }
+
+  // this window becomes the owner so the update it causes is not sent back
+  EmptyClipboard();
+  const bool ok = SetClipboardData(format, h) != NULL;
+  if (!ok)
+  {
+    DEBUG_WINERROR("SetClipboardData failed", GetLastError());
+    GlobalFree(h);
+  }
+  CloseClipboard();
+  return ok;
+}
+
+static LRESULT CALLBACK clipboardWndProc(HWND hwnd, UINT msg, WPARAM wParam,
+    LPARAM lParam)
+{
+  switch(msg)
+  {
+    case WM_CLIPBOARDUPDATE:
+      clipboardUpdate();
+      return 0;
+
+    case WM_CLIPBOARD_SET:
+    {
+      struct ClipboardSet * set = (struct ClipboardSet *)lParam;
+      set->ok = clipboardSet(set);
+      return 0;
+    }
+
+    case WM_DESTROY:
+      PostQuitMessage(0);
+      return 0;
+  }
+
+  return DefWindowProc(hwnd, msg, wParam, lParam);
+}
+
+// the listener needs a window, which needs a thread to pump its messages
+static int clipboardThread(void * opaque)
+{
+  WNDCLASSEX wx =
+  {
+    .cbSize        = sizeof(wx),
+    .lpfnWndProc   = clipboardWndProc,
+    .hInstance     = GetModuleHandle(NULL),
+    .lpszClassName = "LookingGlassClipboard"
+  };
+
+  if (!RegisterClassEx(&wx))
+  {
+    DEBUG_WINERROR("RegisterClassEx failed", GetLastError());
+    lgSignalEvent(cb.ready);
+    return 0;
+  }
+
+  cb.wnd = CreateWindowEx(0, wx.lpszClassName, NULL, 0, 0, 0, 0, 0,
+      HWND_MESSAGE, NULL, wx.hInstance, NULL);
+  if (!cb.wnd)
+  {
+    DEBUG_WINERROR("CreateWindowEx failed", GetLastError());
+    goto fail;
+  }
+
+  if (!AddClipboardFormatListener(cb.wnd))
+  {
+    DEBUG_WINERROR("AddClipboardFormatListener failed", GetLastError());
+    DestroyWindow(cb.wnd);
+    cb.wnd = NULL;
+    goto fail;
+  }
+
+  cb.ok = true;
+  lgSignalEvent(cb.ready);
+
+  MSG msg;
+  while(GetMessage(&msg, NULL, 0, 0) > 0)
+  {
+    TranslateMessage(&msg);
+    DispatchMessage(&msg);
+  }
+
+  RemoveClipboardFormatListener(cb.wnd);
+  cb.wnd = NULL;
+  UnregisterClass(wx.lpszClassName, wx.hInstance);
+  return 0;
+
+fail:
+  UnregisterClass(wx.lpszClassName, wx.hInstance);
+  lgSignalEvent(cb.ready);
+  return 0;
+}
+
+bool os_clipboardInit(ClipboardChangeFn changeFn)
+{
+  cb.changeFn = changeFn;
+  cb.ok       = false;
+  cb.cfPNG    = RegisterClipboardFormat("PNG");
+  cb.cfJPEG   = RegisterClipboardFormat("JFIF");
+
+  if (!(cb.ready = lgCreateEvent(false, 0)))
+  {
+    DEBUG_ERROR("Failed to create the clipboard ready event");
+    return false;
+  }
+
+  if (!lgCreateThread("ClipboardThread", clipboardThread, NULL, &cb.thread))
+  {
+    DEBUG_ERROR("Failed to create the clipboard thread");
+    lgFreeEvent(cb.ready);
+    cb.ready = NULL;
+    return false;
+  }
+
+  lgWaitEvent(cb.ready, TIMEOUT_INFINITE);
+  lgFreeEvent(cb.ready);
+  cb.ready = NULL;
+
+  if (!cb.ok)
+  {
+    lgJoinThread(cb.thread, NULL);
+    cb.thread = NULL;
+  }
+
+  return cb.ok;
+}
+
+void os_clipboardFree()
+{
+  if (!cb.thread)
+    return;
+
+  PostMessage(cb.wnd, WM_CLOSE, 0, 0);
+  lgJoinThread(cb.thread, NULL);
+  cb.thread = NULL;
+  cb.ok     = false;
+}
+
+bool os_clipboardSet(KVMFRClipboardType type, const void * data, size_t size)
+{
+  if (!cb.ok)
+    return false;
+
+  // the window owns the clipboard so it is set on its thread
+  struct ClipboardSet set =
+  {
+    .type = type,
+    .data = data,
+    .size = size
+  };
+  SendMessage(cb.wnd, WM_CLIPBOARD_SET, 0, (LPARAM)&set);
+  return set.ok;
+}
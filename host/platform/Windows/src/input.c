@@ -0,0 +1,158 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "interface/platform.h"
+#include "common/debug.h"
+#include "common/windebug.h"
+
+#include <windows.h>
+#include <string.h>
+
+#ifndef WHEEL_DELTA
+#define WHEEL_DELTA 120
+#endif
+
+static HDESK inputDesktop = NULL;
+
+bool os_inputInit()
+{
+  return true;
+}
+
+void os_inputFree()
+{
+  if (inputDesktop)
+  {
+    CloseDesktop(inputDesktop);
+    inputDesktop = NULL;
+  }
+}
+
+// the input goes to the desktop the thread is on, which is left behind when a
+// UAC prompt or the lock screen switches to the secure desktop
+static bool attachInputDesktop()
+{
+  HDESK desktop = OpenInputDesktop(0, FALSE, GENERIC_ALL);
+  if (!desktop)
+  {
+    DEBUG_WINERROR("OpenInputDesktop failed", GetLastError());
+    return false;
+  }
+
+  if (!SetThreadDesktop(desktop))
+  {
+    DEBUG_WINERROR("SetThreadDesktop failed", GetLastError());
+    CloseDesktop(desktop);
+    return false;
+  }
+
+  if (inputDesktop)
+    CloseDesktop(inputDesktop);
+  inputDesktop = desktop;
+  return true;
+}
+
+static bool toInput(const KVMFRInputEvent * event, INPUT * in)
+{
+  memset(in, 0, sizeof(*in));
+  switch(event->type)
+  {
+    case KVMFR_INPUT_KEY_DOWN:
+    case KVMFR_INPUT_KEY_UP:
+      in->type = INPUT_KEYBOARD;
+      if (event->type == KVMFR_INPUT_KEY_UP)
+        in->ki.dwFlags = KEYEVENTF_KEYUP;
+
+      // the client sends pause as ctrl+break, which has no scancode of its own
+      if (event->code == 0xe046)
+      {
+        in->ki.wVk = VK_PAUSE;
+        return true;
+      }
+
+      in->ki.wScan    = event->code & 0xff;
+      in->ki.dwFlags |= KEYEVENTF_SCANCODE;
+      if ((event->code & 0xff00) == 0xe000)
+        in->ki.dwFlags |= KEYEVENTF_EXTENDEDKEY;
+      return true;
+
+    case KVMFR_INPUT_MOUSE_PRESS:
+    case KVMFR_INPUT_MOUSE_RELEASE:
+    {
+      const bool down = event->type == KVMFR_INPUT_MOUSE_PRESS;
+      in->type = INPUT_MOUSE;
+      switch(event->code)
+      {
+        case 1: in->mi.dwFlags = down ? MOUSEEVENTF_LEFTDOWN   : MOUSEEVENTF_LEFTUP  ; break;
+        case 2: in->mi.dwFlags = down ? MOUSEEVENTF_MIDDLEDOWN : MOUSEEVENTF_MIDDLEUP; break;
+        case 3: in->mi.dwFlags = down ? MOUSEEVENTF_RIGHTDOWN  : MOUSEEVENTF_RIGHTUP ; break;
+
+        // the wheel is a press and release of a button, one step per press
+        case 4:
+        case 5:
+          if (!down)
+            return false;
+          in->mi.dwFlags   = MOUSEEVENTF_WHEEL;
+          in->mi.mouseData = event->code == 4 ? WHEEL_DELTA : -WHEEL_DELTA;
+          break;
+
+        case 6:
+        case 7:
+          in->mi.dwFlags   = down ? MOUSEEVENTF_XDOWN : MOUSEEVENTF_XUP;
+          in->mi.mouseData = event->code == 6 ? XBUTTON1 : XBUTTON2;
+          break;
+
+        default:
+          return false;
+      }
+      return true;
+    }
+
+    case KVMFR_INPUT_MOUSE_MOTION:
+      in->type       = INPUT_MOUSE;
+      in->mi.dwFlags = MOUSEEVENTF_MOVE;
+      in->mi.dx      = event->x;
+      in->mi.dy      = event->y;
+      return true;
+  }
+
+  return false;
+}
+
+bool os_inputEvent(const KVMFRInputEvent * event)
+{
+  INPUT in;
+  if (!toInput(event, &in))
+    return true;
+
+  if (SendInput(1, &in, sizeof(in)) == 1)
+    return true;
+
+  // retry once on the desktop that now has the input
+  if (!attachInputDesktop())
+    return false;
+
+  if (SendInput(1, &in, sizeof(in)) != 1)
+  {
+    DEBUG_WINERROR("SendInput failed", GetLastError());
+    return false;
+  }
+
+  return true;
+}
@@ -32,6 +32,10 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "common/locking.h"
 #include "common/thread.h"
 
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
 #define ID_MENU_SHOW_LOG 3000
 #define ID_MENU_EXIT     3001
 
@@ -51,7 +55,6 @@ struct AppState
 };
 
 static struct AppState app = {0};
-HWND MessageHWND;
 
 // undocumented API to adjust the system timer resolution (yes, its a nasty hack)
 typedef NTSTATUS (__stdcall *ZwSetTimerResolution_t)(ULONG RequestedResolution, BOOLEAN Set, PULONG ActualResolution);
@@ -254,9 +257,6 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
   if (_ChangeWindowMessageFilterEx)
     _ChangeWindowMessageFilterEx(app.messageWnd, app.trayRestartMsg, MSGFLT_ALLOW, NULL);
 
-  // set the global
-  MessageHWND = app.messageWnd;
-
   app.trayMenu = CreatePopupMenu();
   AppendMenu(app.trayMenu, MF_STRING   , ID_MENU_SHOW_LOG, "Log File Location");
   AppendMenu(app.trayMenu, MF_SEPARATOR, 0               , NULL               );
@@ -320,8 +320,18 @@ bool app_init()
   // always flush stderr
   setbuf(stderr, NULL);
 
-  // Increase the timer resolution
-  ZwSetTimerResolution = (ZwSetTimerResolution_t)GetProcAddress(GetModuleHandle("ntdll.dll"), "ZwSetTimerResolution");
+  // high resolution waitable timers make raising the system wide resolution
+  // unnecessary, only fall back to it on versions of Windows without them
+  HANDLE hrTimer = CreateWaitableTimerExW(NULL, NULL,
+      CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+  if (hrTimer)
+  {
+    CloseHandle(hrTimer);
+    DEBUG_INFO("Using high resolution waitable timers");
+  }
+  else
+    ZwSetTimerResolution = (ZwSetTimerResolution_t)GetProcAddress(GetModuleHandle("ntdll.dll"), "ZwSetTimerResolution");
+
   if (ZwSetTimerResolution)
   {
     ULONG actualResolution;
@@ -20,7 +20,6 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #define INSTANCE_MUTEX_NAME "Global\\6f1a5eec-af3f-4a65-99dd-ebe0e4ecea55"
 
 #include "interface/platform.h"
-#include "common/ivshmem.h"
 
 #include <stdio.h>
 #include <stdbool.h>
@@ -29,22 +28,34 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <inttypes.h>
 
 #include <windows.h>
+#include <setupapi.h>
 #include <winsvc.h>
 #include <psapi.h>
 #include <sddl.h>
 #include <userenv.h>
 #include <wtsapi32.h>
 
+#include "ivshmem.h"
+
 #define SVCNAME   "Looking Glass (host)"
 #define SVC_ERROR ((DWORD)0xC0020001L)
 
-struct Service
+// one host is run for each IVSHMEM device, each capturing the matching output
+#define MAX_INSTANCES 8
+
+struct Instance
 {
-  FILE * logFile;
   bool  running;
   DWORD processId;
 };
 
+struct Service
+{
+  FILE *          logFile;
+  int             count;
+  struct Instance instance[MAX_INSTANCES];
+};
+
 struct Service service = { 0 };
 
 void doLog(const char * fmt, ...)
@@ -191,6 +202,36 @@ err_proc:
   return NULL;
 }
 
+static int getDeviceCount()
+{
+  HDEVINFO devInfoSet = SetupDiGetClassDevs(NULL, NULL, NULL,
+      DIGCF_PRESENT | DIGCF_ALLCLASSES | DIGCF_DEVICEINTERFACE);
+  if (devInfoSet == INVALID_HANDLE_VALUE)
+    return 0;
+
+  SP_DEVICE_INTERFACE_DATA devInterfaceData =
+  {
+    .cbSize = sizeof(SP_DEVICE_INTERFACE_DATA)
+  };
+
+  int count = 0;
+  while(count < MAX_INSTANCES && SetupDiEnumDeviceInterfaces(devInfoSet, NULL,
+        &GUID_DEVINTERFACE_IVSHMEM, count, &devInterfaceData))
+    ++count;
+
+  SetupDiDestroyDeviceInfoList(devInfoSet);
+  return count;
+}
+
+// the first instance keeps the original name so older hosts are still seen
+static void getMutexName(int index, char * name, size_t size)
+{
+  if (index == 0)
+    snprintf(name, size, "%s", INSTANCE_MUTEX_NAME);
+  else
+    snprintf(name, size, "%s-%d", INSTANCE_MUTEX_NAME, index);
+}
+
 DWORD GetInteractiveSessionID()
 {
   PWTS_SESSION_INFO pSessionInfo;
@@ -214,8 +255,10 @@ DWORD GetInteractiveSessionID()
   return ret;
 }
 
-void Launch()
+void Launch(int index)
 {
+  struct Instance * inst = &service.instance[index];
+
   if (!enablePriv(SE_DEBUG_NAME))
     return;
 
@@ -282,7 +325,19 @@ void Launch()
     .lpDesktop   = "WinSta0\\Default"
   };
 
-  char * exe = strdup(os_getExecutable());
+  // the first instance uses the configured device and output, the others
+  // are pointed at their own device, output and log file
+  char tempPath[MAX_PATH+1];
+  GetTempPathA(sizeof(tempPath), tempPath);
+
+  const char * fmt = index == 0 ? "\"%s\"" :
+    "\"%s\" os:shmDevice=%d dxgi:outputIndex=%d "
+    "\"os:logFile=%slooking-glass-host-%d.txt\"";
+  int len = snprintf(NULL, 0, fmt, os_getExecutable(), index, index,
+      tempPath, index);
+  char * exe = malloc(len + 1);
+  sprintf(exe, fmt, os_getExecutable(), index, index, tempPath, index);
+
   if (!CreateProcessAsUserA(
       hToken,
       NULL,
@@ -297,14 +352,14 @@ void Launch()
       &pi
     ))
   {
-    service.running = false;
-    doLog("failed to launch\n");
+    inst->running = false;
+    doLog("failed to launch instance %d\n", index);
     winerr();
     goto fail_exe;
   }
 
-  service.processId = pi.dwProcessId;
-  service.running   = true;
+  inst->processId = pi.dwProcessId;
+  inst->running   = true;
 
 fail_exe:
   free(exe);
@@ -599,46 +654,54 @@ VOID WINAPI SvcMain(DWORD dwArgc, LPTSTR *lpszArgv)
 
   setupLogging();
 
-  /* check if the ivshmem device exists */
-  struct IVSHMEM shmDev = { 0 };
-  ivshmemOptionsInit();
-  if (!ivshmemInit(&shmDev))
+  /* check if any ivshmem devices exist */
+  service.count = getDeviceCount();
+  if (!service.count)
   {
     doLog("Unable to find the IVSHMEM device, terminating the service\n");
     goto shutdown;
   }
-  ivshmemFree(&shmDev);
+  doLog("Found %d IVSHMEM device(s)\n", service.count);
 
   ReportSvcStatus(SERVICE_RUNNING, NO_ERROR, 0);
   while(1)
   {
-    /* check if the app is running by trying to take the lock */
-    bool running = true;
-    HANDLE m = CreateMutex(NULL, FALSE, INSTANCE_MUTEX_NAME);
-    if (WaitForSingleObject(m, 0) == WAIT_OBJECT_0)
+    for(int i = 0; i < service.count; ++i)
     {
-      running = false;
-      service.running = false;
-      ReleaseMutex(m);
-    }
-    CloseHandle(m);
+      /* check if the app is running by trying to take the lock */
+      bool running = true;
+      char name[128];
+      getMutexName(i, name, sizeof(name));
+      HANDLE m = CreateMutex(NULL, FALSE, name);
+      if (WaitForSingleObject(m, 0) == WAIT_OBJECT_0)
+      {
+        running = false;
+        service.instance[i].running = false;
+        ReleaseMutex(m);
+      }
+      CloseHandle(m);
 
-    if (!running && GetInteractiveSessionID() != 0)
-    {
-      Launch();
-      /* avoid being overly agressive in restarting */
-      Sleep(1);
+      if (!running && GetInteractiveSessionID() != 0)
+      {
+        Launch(i);
+        /* avoid being overly agressive in restarting */
+        Sleep(1);
+      }
     }
 
     if (WaitForSingleObject(ghSvcStopEvent, 100) == WAIT_OBJECT_0)
       break;
   }
 
-  if (service.running)
+  for(int i = 0; i < service.count; ++i)
   {
-    doLog("Terminating the host application\n");
+    struct Instance * inst = &service.instance[i];
+    if (!inst->running)
+      continue;
+
+    doLog("Terminating the host application (%d)\n", i);
     HANDLE proc = OpenProcess(SYNCHRONIZE | PROCESS_TERMINATE, TRUE,
-        service.processId);
+        inst->processId);
     if (proc)
     {
       if (TerminateProcess(proc, 0))
@@ -688,8 +751,15 @@ bool HandleService(int argc, char * argv[])
   if (StartServiceCtrlDispatcher(DispatchTable))
     return true;
 
-  /* only allow one instance to run */
-  HANDLE m = CreateMutex(NULL, FALSE, INSTANCE_MUTEX_NAME);
+  /* only allow one instance to run per device */
+  int index = 0;
+  for(int i = 1; i < argc; ++i)
+    if (strncmp(argv[i], "os:shmDevice=", 13) == 0)
+      index = atoi(argv[i] + 13);
+
+  char name[128];
+  getMutexName(index, name, sizeof(name));
+  HANDLE m = CreateMutex(NULL, FALSE, name);
   if (WaitForSingleObject(m, 0) != WAIT_OBJECT_0)
   {
     CloseHandle(m);
@@ -23,43 +23,77 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "common/version.h"
 #include "common/debug.h"
 #include "common/option.h"
-#include "common/locking.h"
 #include "common/KVMFR.h"
+#include "common/damage.h"
 #include "common/crash.h"
 #include "common/thread.h"
+#include "common/event.h"
 #include "common/ivshmem.h"
 #include "common/sysinfo.h"
 #include "common/time.h"
+#include "common/trace.h"
 
 #include <lgmp/host.h>
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define CONFIG_FILE "looking-glass-host.ini"
-#define POINTER_SHAPE_BUFFERS 3
+#define POINTER_SHAPE_BUFFERS 4 // must be a power of two
+
+// the latest position posted by the capture interface, packed so it can be
+// replaced atomically, the pending bit is cleared by the pointer thread
+#define POINTER_POS_PENDING (1ULL << 63)
+#define POINTER_POS_VISIBLE (1ULL << 32)
 
 #define ALIGN_DN(x) ((uintptr_t)(x) & ~0x7F)
 #define ALIGN_UP(x) ALIGN_DN(x + 0x7F)
 
-static const struct LGMPQueueConfig FRAME_QUEUE_CONFIG =
+// the subTimeout is set from app:subTimeout
+static struct LGMPQueueConfig FRAME_QUEUE_CONFIG =
 {
   .queueID     = LGMP_Q_FRAME,
-  .numMessages = LGMP_Q_FRAME_LEN,
-  .subTimeout  = 1000
+  .numMessages = LGMP_Q_FRAME_LEN
+};
+
+static struct LGMPQueueConfig FRAME_AUX_QUEUE_CONFIG =
+{
+  .queueID     = LGMP_Q_FRAME_AUX,
+  .numMessages = LGMP_Q_FRAME_LEN
 };
 
-static const struct LGMPQueueConfig POINTER_QUEUE_CONFIG =
+static struct LGMPQueueConfig POINTER_QUEUE_CONFIG =
 {
   .queueID     = LGMP_Q_POINTER,
-  .numMessages = LGMP_Q_POINTER_LEN,
-  .subTimeout  = 1000
+  .numMessages = LGMP_Q_POINTER_LEN
+};
+
+static struct LGMPQueueConfig CLIPBOARD_QUEUE_CONFIG =
+{
+  .queueID     = LGMP_Q_CLIPBOARD,
+  .numMessages = LGMP_Q_CLIPBOARD_LEN
+};
+
+static struct LGMPQueueConfig AUDIO_QUEUE_CONFIG =
+{
+  .queueID     = LGMP_Q_AUDIO,
+  .numMessages = LGMP_Q_AUDIO_LEN
 };
 
 #define MAX_POINTER_SIZE (sizeof(KVMFRCursor) + (512 * 512 * 4))
+#define MAX_AUDIO_SIZE (sizeof(KVMFRAudio) + \
+    KVMFR_AUDIO_MAX_FRAMES * KVMFR_AUDIO_MAX_CHANNELS * sizeof(float))
+
+// frame data is aligned so the GPU can write it directly (D3D12 placed heaps)
+#define FRAME_DATA_ALIGN 0x10000
+
+// the most frame buffers to use when they are sized automatically, enough to
+// absorb a stall in the client without adding much latency
+#define FRAME_BUFFERS_AUTO 6
 
 enum AppState
 {
@@ -69,32 +103,231 @@ enum AppState
   APP_STATE_SHUTDOWN
 };
 
+// a shape held in the client cursor cache
+struct PointerCache
+{
+  uint64_t hash;
+  uint64_t lastUsed; // zero if the slot is empty
+};
+
 struct app
 {
   PLGMPHost     lgmp;
 
   PLGMPHostQueue pointerQueue;
+  LGThread     * pointerThread;
+  LGEvent      * pointerEvent;
+
+  // a single producer ring of the shapes posted by the capture interface,
+  // the last shape sent is kept for new clients so is not reused
   PLGMPMemory    pointerMemory[POINTER_SHAPE_BUFFERS];
-  LG_Lock        pointerLock;
+  CapturePointer pointerShapes[POINTER_SHAPE_BUFFERS];
+  atomic_uint    pointerWrite;
+  atomic_uint    pointerRead;
+
+  atomic_uint_least64_t pointerPos;
+  atomic_bool           pointerNewClient;
+  int                   pointerLastX, pointerLastY;
+
+  // owned by the pointer thread
   CapturePointer pointerInfo;
   PLGMPMemory    pointerShape;
   bool           pointerShapeValid;
-  unsigned int   pointerIndex;
+  uint64_t       pointerShapeHash;
+
+  struct PointerCache pointerCache[KVMFR_CURSOR_CACHE];
+  uint64_t            pointerCacheTick;
 
   size_t         maxFrameSize;
+  size_t         frameAlign;
+  unsigned int   frameBuffers; // the configured ring depth, zero for auto
+  unsigned int   frameCount;   // the number of buffers allocated
   PLGMPHostQueue frameQueue;
+  PLGMPHostQueue frameAuxQueue;
   PLGMPMemory    frameMemory[LGMP_Q_FRAME_LEN];
+  FrameDamage    frameDamage[LGMP_Q_FRAME_LEN];
   unsigned int   frameIndex;
+  uint32_t       frameSerial; // of the latest new frame
+  bool           tiledFrames;
+
+  // the number of frames posted to each frame queue, and the post number of
+  // each buffer's latest post, used to find the buffers no one is reading
+  uint64_t       framePosts, frameAuxPosts;
+  uint64_t       framePost[LGMP_Q_FRAME_LEN], frameAuxPost[LGMP_Q_FRAME_LEN];
 
+  struct IVSHMEM   * shmDev;
   CaptureInterface * iface;
 
+  volatile KVMFRRequest * request;
+  uint32_t                requestSerial;
+  unsigned int            requestFPS;
+  uint32_t                requestTypes;
+  uint32_t                requestPreferred;
+  uint32_t                traceSerial;
+  const char            * traceFile;
+
+  // the region to capture from the config and the one in use
+  CaptureRect             configCrop;
+  CaptureRect             requestCrop;
+
+  volatile KVMFRCursorPos * cursorPos;
+  volatile KVMFRStats     * stats;
+
+  // the clipboard is sent whole through one buffer each way
+  PLGMPHostQueue    clipboardQueue;
+  PLGMPMemory       clipboardMemory;
+  PLGMPMemory       clipboardRecvMemory;
+  size_t            clipboardSize;
+  bool              clipboardActive;
+  volatile KVMFRClipboardRequest * clipboardRequest;
+
+  // the audio blocks are used in turn, one per message of the queue
+  PLGMPHostQueue    audioQueue;
+  PLGMPMemory       audioMemory[LGMP_Q_AUDIO_LEN];
+  unsigned int      audioIndex;
+  uint32_t          audioSerial;
+  bool              audioActive;
+
+  // the input from the client, NULL if it is not injected
+  volatile KVMFRInput     * input;
+  LGThread                * inputThread;
+  unsigned int              inputInterval;
+
+  // the last clock calibration ping from the client
+  uint32_t                pingSerial;
+  uint64_t                pingClientTime;
+  uint64_t                pingHostTime;
+
+  // thread scheduling
+  bool     realtime;
+  uint64_t captureAffinity;
+  uint64_t frameAffinity;
+
+  // how long to keep retrying the capture device before giving up, in us
+  uint64_t captureRetryTime;
+
+  // signalled by the LGMP timer while there are subscribers, and on shutdown
+  LGEvent * wakeEvent;
+
+  // the microtime of the last frame or pointer update, the capture rate is
+  // backed off once nothing has changed for the idle timeout
+  atomic_uint_least64_t lastActivity;
+  uint64_t              idleTimeout;
+  uint64_t              idleInterval;
+
   enum AppState state;
   LGTimer  * lgmpTimer;
+  unsigned int lgmpInterval;
+
+  // set by the LGMP timer when it sees a new subscriber to a frame queue,
+  // the frame thread then sends the last frame whole
+  atomic_bool frameNewSubs;
+  atomic_bool frameAuxNewSubs;
   LGThread * frameThread;
 };
 
 static struct app app;
 
+static inline bool hasSubscribers()
+{
+  return
+    lgmpHostQueueHasSubs(app.pointerQueue ) ||
+    lgmpHostQueueHasSubs(app.frameQueue   ) ||
+    lgmpHostQueueHasSubs(app.frameAuxQueue);
+}
+
+static inline void markActivity()
+{
+  atomic_store_explicit(&app.lastActivity, microtime(), memory_order_relaxed);
+}
+
+// the client copies the data out of the buffer as soon as it gets it
+static void clipboardChanged(KVMFRClipboardType type, const void * data,
+    size_t size)
+{
+  if (!app.clipboardActive || !lgmpHostQueueHasSubs(app.clipboardQueue))
+    return;
+
+  if (size > app.clipboardSize - sizeof(KVMFRClipboard))
+  {
+    DEBUG_WARN("The clipboard is too large to send (%zu bytes)", size);
+    return;
+  }
+
+  for(int i = 0; lgmpHostQueuePending(app.clipboardQueue) > 0; ++i)
+  {
+    if (i == 100)
+    {
+      DEBUG_WARN("The client has not taken the last clipboard, dropping this one");
+      return;
+    }
+    nsleep(1000000);
+  }
+
+  KVMFRClipboard * cb = lgmpHostMemPtr(app.clipboardMemory);
+  cb->type = type;
+  cb->size = size;
+  memcpy(cb + 1, data, size);
+
+  LGMP_STATUS status;
+  if ((status = lgmpHostQueuePost(app.clipboardQueue, 0,
+          app.clipboardMemory)) != LGMP_OK)
+    DEBUG_ERROR("lgmpHostQueuePost Failed (Clipboard): %s",
+        lgmpStatusString(status));
+}
+
+// called for each packet of the loopback capture
+static void audioData(uint32_t sampleRate, uint32_t channels,
+    const float * data, uint32_t frames, uint64_t captureTime)
+{
+  if (!app.audioActive || !lgmpHostQueueHasSubs(app.audioQueue))
+    return;
+
+  // the block that would be reused may still be read, the serial tells the
+  // client a block was dropped
+  if (lgmpHostQueuePending(app.audioQueue) >= LGMP_Q_AUDIO_LEN - 1)
+  {
+    ++app.audioSerial;
+    return;
+  }
+
+  PLGMPMemory mem = app.audioMemory[app.audioIndex];
+  if (++app.audioIndex == LGMP_Q_AUDIO_LEN)
+    app.audioIndex = 0;
+
+  KVMFRAudio * block = lgmpHostMemPtr(mem);
+  block->sampleRate  = sampleRate;
+  block->channels    = channels;
+  block->frames      = frames;
+  block->serial      = app.audioSerial++;
+  block->captureTime = captureTime;
+  memcpy(block + 1, data, frames * channels * sizeof(float));
+
+  LGMP_STATUS status;
+  if ((status = lgmpHostQueuePost(app.audioQueue, 0, mem)) != LGMP_OK)
+    DEBUG_ERROR("lgmpHostQueuePost Failed (Audio): %s",
+        lgmpStatusString(status));
+}
+
+static void checkClipboard()
+{
+  volatile KVMFRClipboardRequest * req = app.clipboardRequest;
+  const uint32_t serial = req->serial;
+  if (serial == req->ackSerial)
+    return;
+
+  atomic_thread_fence(memory_order_acquire);
+  const uint32_t type = req->type;
+  const uint32_t size = req->size;
+  if (size > req->bufferSize)
+    DEBUG_WARN("Invalid clipboard size from the client: %u", size);
+  else if (!os_clipboardSet(type, lgmpHostMemPtr(app.clipboardRecvMemory), size))
+    DEBUG_WARN("Failed to set the clipboard");
+
+  atomic_thread_fence(memory_order_release);
+  req->ackSerial = serial;
+}
+
 static bool lgmpTimer(void * opaque)
 {
   LGMP_STATUS status;
@@ -102,34 +335,180 @@ static bool lgmpTimer(void * opaque)
   {
     DEBUG_ERROR("lgmpHostProcess Failed: %s", lgmpStatusString(status));
     app.state = APP_STATE_SHUTDOWN;
+    lgSignalEvent(app.wakeEvent);
     return false;
   }
 
+  // subscribers are only seen here so handle them now rather than when the
+  // capture next returns, which may be a second away on a static desktop
+  const bool newFrame = lgmpHostQueueNewSubs(app.frameQueue   ) > 0;
+  const bool newAux   = lgmpHostQueueNewSubs(app.frameAuxQueue) > 0;
+  if (newFrame || newAux)
+  {
+    if (newFrame)
+      atomic_store_explicit(&app.frameNewSubs, true, memory_order_relaxed);
+    if (newAux)
+      atomic_store_explicit(&app.frameAuxNewSubs, true, memory_order_relaxed);
+
+    if (app.state == APP_STATE_RUNNING && app.iface->wakeFrame)
+      app.iface->wakeFrame();
+  }
+
+  if (lgmpHostQueueNewSubs(app.pointerQueue) > 0)
+  {
+    markActivity();
+    atomic_store_explicit(&app.pointerNewClient, true, memory_order_relaxed);
+    lgSignalEvent(app.pointerEvent);
+  }
+
+  if (app.clipboardActive)
+    checkClipboard();
+
+  if (hasSubscribers())
+    lgSignalEvent(app.wakeEvent);
+
   return true;
 }
 
+// stamp the frame with the post time and echo the last ping from the client
+// so it can relate the host times to its own clock
+static void stampFrame(KVMFRFrame * fi)
+{
+  const uint32_t pingSerial = app.request->pingSerial;
+  if (pingSerial != app.pingSerial)
+  {
+    atomic_thread_fence(memory_order_acquire);
+    app.pingSerial     = pingSerial;
+    app.pingClientTime = app.request->pingTime;
+    app.pingHostTime   = microtime();
+  }
+
+  fi->pingSerial     = app.pingSerial;
+  fi->pingClientTime = app.pingClientTime;
+  fi->pingHostTime   = app.pingHostTime;
+  fi->postTime       = microtime();
+}
+
+// a buffer can be written only once every queue it was posted to is done with it
+static bool frameBufferBusy(unsigned int i)
+{
+  const unsigned int pending    = lgmpHostQueuePending(app.frameQueue   );
+  const unsigned int auxPending = lgmpHostQueuePending(app.frameAuxQueue);
+  return
+    app.framePost   [i] + pending    > app.framePosts ||
+    app.frameAuxPost[i] + auxPending > app.frameAuxPosts;
+}
+
+// returns the next buffer that can be written, or -1 if they are all in use
+static int nextFrameBuffer()
+{
+  for(unsigned int n = 1; n <= app.frameCount; ++n)
+  {
+    const unsigned int i = (app.frameIndex + n) % app.frameCount;
+    if (!frameBufferBusy(i))
+      return i;
+  }
+  return -1;
+}
+
+static LGMP_STATUS postFrameBuffer(PLGMPHostQueue queue, unsigned int i)
+{
+  LGMP_STATUS status = lgmpHostQueuePost(queue, 0, app.frameMemory[i]);
+  if (status != LGMP_OK)
+    return status;
+
+  if (queue == app.frameQueue)
+    app.framePost[i] = ++app.framePosts;
+  else
+    app.frameAuxPost[i] = ++app.frameAuxPosts;
+
+  ++app.stats->framesPosted;
+  return LGMP_OK;
+}
+
+// the frame data getFrame will write for the damage
+static uint64_t frameBytes(const CaptureFrame * frame, const FrameDamage * damage)
+{
+  // compressed frames are always sent whole
+  if (frame->format == CAPTURE_FMT_H264)
+    return frame->pitch;
+
+  uint64_t size = (uint64_t)frame->pitch * frame->height;
+  if (frame->format == CAPTURE_FMT_YUV420)
+    size = size * 3 / 2;
+
+  if (damage->full || !frame->width)
+    return size;
+
+  uint64_t area = 0;
+  for(unsigned int i = 0; i < damage->count; ++i)
+    area += (uint64_t)damage->rects[i].width * damage->rects[i].height;
+
+  return size * area / ((uint64_t)frame->width * frame->height);
+}
+
 static int frameThread(void * opaque)
 {
   DEBUG_INFO("Frame thread started");
 
+  if (app.realtime)
+    lgThreadSetPriority(LG_THREAD_PRIORITY_CAPTURE);
+  lgThreadSetAffinity(NULL, app.frameAffinity);
+
   bool         frameValid     = false;
   bool         repeatFrame    = false;
+  bool         repeatFrameAux = false;
   CaptureFrame frame          = { 0 };
-  const long   pageSize       = sysinfo_getPageSize();
+  unsigned int lastFormatVer  = 0;
+  uint64_t     captureTime    = 0;
+  uint32_t     probeSerial    = 0;
+
+  // the content of the frame buffers is unknown, they must be fully written
+  for(int i = 0; i < app.frameCount; ++i)
+    damage_set_full(&app.frameDamage[i]);
 
   while(app.state == APP_STATE_RUNNING)
   {
-    //wait until there is room in the queue
-    if(lgmpHostQueuePending(app.frameQueue) == LGMP_Q_FRAME_LEN)
+    // wait until a buffer is free, a consumer of the aux queue holds at most
+    // one so it can not stall the interactive client
+    const int nextIndex = nextFrameBuffer();
+    if (nextIndex < 0)
     {
-      usleep(1);
+      const uint64_t start = microtime();
+      nsleep(1000);
+      app.stats->bufferWaitTime += microtime() - start;
       continue;
     }
 
-    switch(app.iface->waitFrame(&frame))
+    // a probe is only answered by a frame captured after it was seen
+    const uint32_t probeSeen = app.request->probeSerial;
+
+    const uint64_t     waitStart = microtime();
+    const LGTraceScope waitTrace = lgTraceBegin("waitFrame");
+    const CaptureResult result = app.iface->waitFrame(&frame);
+    lgTraceEnd(waitTrace);
+    app.stats->waitTime  += microtime() - waitStart;
+    app.stats->updateTime = microtime();
+
+    if (app.iface->getStats)
+    {
+      CaptureStats cs;
+      app.iface->getStats(&cs);
+      app.stats->presentInterval = cs.presentInterval;
+      app.stats->presentHits     = cs.presentHits;
+      app.stats->presentMisses   = cs.presentMisses;
+    }
+
+    switch(result)
     {
       case CAPTURE_RESULT_OK:
-        repeatFrame = false;
+        repeatFrame    = false;
+        repeatFrameAux = false;
+        captureTime = microtime();
+        probeSerial = probeSeen;
+        ++app.stats->framesCaptured;
+        atomic_store_explicit(&app.lastActivity, captureTime,
+            memory_order_relaxed);
         break;
 
       case CAPTURE_RESULT_REINIT:
@@ -147,11 +526,15 @@ static int frameThread(void * opaque)
 
       case CAPTURE_RESULT_TIMEOUT:
       {
-        if (frameValid && lgmpHostQueueNewSubs(app.frameQueue) > 0)
+        if (frameValid)
         {
-          // resend the last frame
-          repeatFrame = true;
-          break;
+          // resend the last frame to the queues with new subscribers
+          repeatFrame    = atomic_exchange_explicit(&app.frameNewSubs, false,
+              memory_order_relaxed);
+          repeatFrameAux = atomic_exchange_explicit(&app.frameAuxNewSubs, false,
+              memory_order_relaxed);
+          if (repeatFrame || repeatFrameAux)
+            break;
         }
 
         continue;
@@ -161,17 +544,38 @@ static int frameThread(void * opaque)
     LGMP_STATUS status;
 
     // if we are repeating a frame just send the last frame again
-    if (repeatFrame)
+    if (repeatFrame || repeatFrameAux)
     {
-      if ((status = lgmpHostQueuePost(app.frameQueue, 0, app.frameMemory[app.frameIndex])) != LGMP_OK)
-        DEBUG_ERROR("%s", lgmpStatusString(status));
+      // new clients have no prior frame to apply the damage to
+      KVMFRFrame * fi = lgmpHostMemPtr(app.frameMemory[app.frameIndex]);
+      fi->damageRectsCount = 0;
+      stampFrame(fi);
+
+      bool posted = false;
+      if (repeatFrame)
+      {
+        if ((status = postFrameBuffer(app.frameQueue, app.frameIndex)) != LGMP_OK)
+          DEBUG_ERROR("%s", lgmpStatusString(status));
+        else
+          posted = true;
+      }
+
+      if (repeatFrameAux)
+      {
+        if ((status = postFrameBuffer(app.frameAuxQueue, app.frameIndex)) != LGMP_OK)
+          DEBUG_ERROR("%s", lgmpStatusString(status));
+        else
+          posted = true;
+      }
+
+      if (posted)
+        ivshmemRingDoorbell(app.shmDev, KVMFR_IRQ_FRAME);
       continue;
     }
 
-    // we increment the index first so that if we need to repeat a frame
-    // the index still points to the latest valid frame
-    if (++app.frameIndex == LGMP_Q_FRAME_LEN)
-      app.frameIndex = 0;
+    // we move the index first so that if we need to repeat a frame the index
+    // still points to the latest valid frame
+    app.frameIndex = nextIndex;
 
     KVMFRFrame * fi = lgmpHostMemPtr(app.frameMemory[app.frameIndex]);
     switch(frame.format)
@@ -181,31 +585,95 @@ static int frameThread(void * opaque)
       case CAPTURE_FMT_RGBA10 : fi->type = FRAME_TYPE_RGBA10 ; break;
       case CAPTURE_FMT_RGBA16F: fi->type = FRAME_TYPE_RGBA16F; break;
       case CAPTURE_FMT_YUV420 : fi->type = FRAME_TYPE_YUV420 ; break;
+      case CAPTURE_FMT_H264   : fi->type = FRAME_TYPE_H264   ; break;
       default:
         DEBUG_ERROR("Unsupported frame format %d, skipping frame", frame.format);
+        ++app.stats->framesDropped;
         continue;
     }
 
-    fi->formatVer = frame.formatVer;
-    fi->width     = frame.width;
-    fi->height    = frame.height;
-    fi->stride    = frame.stride;
-    fi->pitch     = frame.pitch;
-    fi->offset    = pageSize - FrameBufferStructSize;
-    frameValid    = true;
+    fi->formatVer    = frame.formatVer;
+    fi->width        = frame.width;
+    fi->height       = frame.height;
+    fi->screenWidth  = frame.screenWidth  ? frame.screenWidth  : frame.width;
+    fi->screenHeight = frame.screenHeight ? frame.screenHeight : frame.height;
+    fi->stride       = frame.stride;
+    fi->pitch        = frame.pitch;
+    fi->offset       = app.frameAlign - FrameBufferStructSize;
+    fi->presentTime  = frame.presentTime;
+    fi->captureTime  = captureTime;
+    fi->frameSerial  = ++app.frameSerial;
+    fi->probeSerial  = probeSerial;
+    frameValid       = true;
+
+    // a format change invalidates the contents of every buffer
+    if (frame.formatVer != lastFormatVer)
+    {
+      for(int i = 0; i < app.frameCount; ++i)
+        damage_set_full(&app.frameDamage[i]);
+      lastFormatVer = frame.formatVer;
+    }
+
+    // each buffer needs to be brought up to date with the changes made since
+    // it was last written, accumulate the new damage into all of them
+    for(int i = 0; i < app.frameCount; ++i)
+      damage_add(&app.frameDamage[i], frame.damageRects,
+          frame.damageRectsCount);
+
+    // the client gets the damage since the prior frame only, a new client has
+    // no prior frame so gets it whole, this buffer is complete either way
+    const bool newSubs =
+      atomic_exchange_explicit(&app.frameNewSubs   , false, memory_order_relaxed) |
+      atomic_exchange_explicit(&app.frameAuxNewSubs, false, memory_order_relaxed);
+    if (newSubs)
+      fi->damageRectsCount = 0;
+    else
+    {
+      fi->damageRectsCount = frame.damageRectsCount;
+      memcpy(fi->damageRects, frame.damageRects,
+          frame.damageRectsCount * sizeof(FrameDamageRect));
+    }
 
     // put the framebuffer on the border of the next page
     // this is to allow for aligned DMA transfers by the receiver
     FrameBuffer * fb = (FrameBuffer *)(((uint8_t*)fi) + fi->offset);
-    framebuffer_prepare(fb);
+    const size_t bpp = fi->type == FRAME_TYPE_RGBA16F ? 8 : 4;
+    FrameDamage * damage = &app.frameDamage[app.frameIndex];
+    if (app.tiledFrames &&
+        fi->type != FRAME_TYPE_YUV420 && fi->type != FRAME_TYPE_H264)
+      framebuffer_prepare_tiled(fb, fi->frameSerial, fi->width, fi->height,
+          bpp, fi->pitch, damage->rects, damage->full ? 0 : damage->count);
+    else
+      framebuffer_prepare(fb);
+    stampFrame(fi);
 
     /* we post and then get the frame, this is intentional! */
-    if ((status = lgmpHostQueuePost(app.frameQueue, 0, app.frameMemory[app.frameIndex])) != LGMP_OK)
+    if ((status = postFrameBuffer(app.frameQueue, app.frameIndex)) != LGMP_OK)
     {
       DEBUG_ERROR("%s", lgmpStatusString(status));
+      ++app.stats->framesDropped;
       continue;
     }
-    app.iface->getFrame(fb);
+
+    // consumers of the aux queue skip to the newest frame once they are done
+    // with the last one, so they never hold more than one buffer
+    if (lgmpHostQueueHasSubs(app.frameAuxQueue) &&
+        lgmpHostQueuePending(app.frameAuxQueue) == 0)
+    {
+      if ((status = postFrameBuffer(app.frameAuxQueue, app.frameIndex)) != LGMP_OK)
+        DEBUG_ERROR("%s", lgmpStatusString(status));
+    }
+    ivshmemRingDoorbell(app.shmDev, KVMFR_IRQ_FRAME);
+
+    const uint64_t     copyStart = microtime();
+    const LGTraceScope getTrace  = lgTraceBegin("getFrame");
+    app.iface->getFrame(fb, damage->rects, damage->full ? 0 : damage->count);
+    lgTraceEnd(getTrace);
+
+    app.stats->copyTime    += microtime() - copyStart;
+    app.stats->bytesCopied += frameBytes(&frame, damage);
+    app.stats->queuePending = lgmpHostQueuePending(app.frameQueue);
+    damage_reset(damage);
   }
   DEBUG_INFO("Frame thread stopped");
   return 0;
@@ -213,6 +681,10 @@ static int frameThread(void * opaque)
 
 bool startThreads()
 {
+  // the first frame is sent to every subscriber anyway
+  atomic_store(&app.frameNewSubs   , false);
+  atomic_store(&app.frameAuxNewSubs, false);
+
   app.state = APP_STATE_RUNNING;
   if (!lgCreateThread("FrameThread", frameThread, NULL, &app.frameThread))
   {
@@ -241,24 +713,100 @@ bool stopThreads()
   return ok;
 }
 
+// the capture device can be unavailable for a while, e.g. when the secure
+// desktop (UAC, login) is shown or the display is being reconfigured. Keep
+// the LGMP session and the frame memory alive so the clients stay subscribed
+// and keep trying until it comes back
+static bool captureRetryInit()
+{
+  if (!app.captureRetryTime)
+    return false;
+
+  DEBUG_WARN("Capture device unavailable, retrying with the session held open");
+  const uint64_t end = microtime() + app.captureRetryTime;
+  while(app.state != APP_STATE_SHUTDOWN && microtime() < end)
+  {
+    // no one to keep the session alive for
+    if (!hasSubscribers())
+      break;
+
+    nsleep(100000000);
+    if (app.iface->init())
+    {
+      DEBUG_INFO("Capture device recovered");
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// the buffers are allocated once the size of the first frame is known, the
+// shared memory is split evenly between them so later modes have headroom
+static bool allocFrameBuffers(size_t frameSize)
+{
+  const size_t avail = lgmpHostMemAvail(app.lgmp);
+  const size_t need  = (frameSize + app.frameAlign * 2 - 1) & ~(app.frameAlign - 1);
+
+  unsigned int count = app.frameBuffers;
+  if (!count)
+  {
+    count = avail / need;
+    if (count > FRAME_BUFFERS_AUTO)
+      count = FRAME_BUFFERS_AUTO;
+    if (count < 2)
+      count = 2;
+  }
+
+  app.maxFrameSize = avail / count;
+  app.maxFrameSize = app.maxFrameSize & ~(app.frameAlign - 1);
+  if (app.maxFrameSize < need)
+  {
+    DEBUG_ERROR("%u frame buffers of %u MiB do not fit in the %u MiB available",
+        count, (unsigned int)(need / 1048576LL), (unsigned int)(avail / 1048576LL));
+    return false;
+  }
+
+  for(int i = 0; i < count; ++i)
+  {
+    LGMP_STATUS status;
+    if ((status = lgmpHostMemAllocAligned(app.lgmp, app.maxFrameSize,
+            app.frameAlign, &app.frameMemory[i])) != LGMP_OK)
+    {
+      DEBUG_ERROR("lgmpHostMemAlloc Failed (Frame): %s", lgmpStatusString(status));
+      return false;
+    }
+  }
+
+  app.frameCount = count;
+  app.frameIndex = 0;
+  app.stats->frameBuffers = count;
+  DEBUG_INFO("Frame Buffers    : %u x %u MiB", count,
+      (unsigned int)(app.maxFrameSize / 1048576LL));
+  return true;
+}
+
 static bool captureStart()
 {
   if (app.state == APP_STATE_IDLE)
   {
-    if (!app.iface->init())
+    if (!app.iface->init() && !captureRetryInit())
     {
       DEBUG_ERROR("Initialize the capture device");
       return false;
     }
   }
 
-  const unsigned int maxFrameSize = app.iface->getMaxFrameSize();
-  if (maxFrameSize > app.maxFrameSize)
+  const size_t maxFrameSize = app.iface->getMaxFrameSize();
+  if (!app.frameCount && !allocFrameBuffers(maxFrameSize))
+    return false;
+
+  if (maxFrameSize > app.maxFrameSize - app.frameAlign)
   {
-    DEBUG_ERROR("Maximum frame size of %d bytes excceds maximum space available", maxFrameSize);
+    DEBUG_ERROR("Maximum frame size of %zu bytes excceds maximum space available", maxFrameSize);
     return false;
   }
-  DEBUG_INFO("Capture Size     : %u MiB (%u)", maxFrameSize / 1048576, maxFrameSize);
+  DEBUG_INFO("Capture Size     : %zu MiB (%zu)", maxFrameSize / 1048576, maxFrameSize);
 
   DEBUG_INFO("==== [ Capture  Start ] ====");
   return startThreads();
@@ -281,109 +829,448 @@ static bool captureStop()
 
 static bool captureRestart()
 {
-  return captureStop() && captureStart();
+  ++app.stats->reinits;
+  if (!app.iface->reinit)
+    return captureStop() && captureStart();
+
+  DEBUG_INFO("==== [ Capture Reinit ] ====");
+  if (!stopThreads())
+    return false;
+
+  if (!app.iface->reinit())
+  {
+    DEBUG_WARN("Fast reinit failed, performing a full restart");
+    if (!app.iface->deinit())
+    {
+      DEBUG_ERROR("Failed to deinitialize the capture device");
+      return false;
+    }
+
+    // the state is idle so this performs a full init
+    return captureStart();
+  }
+
+  // keep captureStart from initializing the interface again
+  app.state = APP_STATE_RUNNING;
+  return captureStart();
 }
 
 bool captureGetPointerBuffer(void ** data, uint32_t * size)
 {
-  PLGMPMemory mem = app.pointerMemory[app.pointerIndex];
+  // wait for the pointer thread to free a buffer, it is only ever busy for
+  // as long as it takes to post a message
+  const unsigned int w = atomic_load_explicit(&app.pointerWrite, memory_order_relaxed);
+  for(int i = 0; w - atomic_load_explicit(&app.pointerRead, memory_order_acquire) >=
+      POINTER_SHAPE_BUFFERS - 1; ++i)
+  {
+    if (i == 1000)
+      return false;
+    nsleep(100000);
+  }
+
+  PLGMPMemory mem = app.pointerMemory[w & (POINTER_SHAPE_BUFFERS - 1)];
   *data = ((uint8_t*)lgmpHostMemPtr(mem)) + sizeof(KVMFRCursor);
   *size = MAX_POINTER_SIZE - sizeof(KVMFRCursor);
   return true;
 }
 
-static void sendPointer(bool newClient)
+// position updates overwrite the last one in place as only the latest matters
+static void postPointerPos()
+{
+  volatile KVMFRCursorPos * pos = app.cursorPos;
+  const uint32_t serial = pos->serial;
+
+  pos->serial = serial + 1;
+  atomic_thread_fence(memory_order_release);
+  pos->x       = app.pointerInfo.x;
+  pos->y       = app.pointerInfo.y;
+  pos->visible = app.pointerInfo.visible;
+  atomic_thread_fence(memory_order_release);
+  pos->serial = serial + 2;
+}
+
+static uint64_t hashShape(const KVMFRCursor * cursor)
 {
-  PLGMPMemory mem;
-  if (app.pointerInfo.shapeUpdate || newClient)
+  // FNV-1a over 64bit words, the size and type are included as the same data
+  // can be a different shape
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  hash = (hash ^ cursor->type  ) * 0x100000001b3ULL;
+  hash = (hash ^ cursor->width ) * 0x100000001b3ULL;
+  hash = (hash ^ cursor->height) * 0x100000001b3ULL;
+  hash = (hash ^ cursor->pitch ) * 0x100000001b3ULL;
+
+  const uint8_t * data = (const uint8_t *)(cursor + 1);
+  const size_t    size = cursor->height * cursor->pitch;
+
+  size_t i = 0;
+  for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
   {
-    if (!newClient)
+    uint64_t v;
+    memcpy(&v, data + i, sizeof(v));
+    hash  = (hash ^ v) * 0x100000001b3ULL;
+    hash ^= hash >> 32;
+  }
+
+  for(; i < size; ++i)
+    hash = (hash ^ data[i]) * 0x100000001b3ULL;
+
+  return hash;
+}
+
+// find the client cache slot of the current shape, returns true if the clients
+// already have it, otherwise the least recently used slot is replaced
+static bool pointerCacheLookup(uint32_t * cacheID)
+{
+  const uint64_t tick = ++app.pointerCacheTick;
+  unsigned int   slot = 0;
+
+  for(unsigned int i = 0; i < KVMFR_CURSOR_CACHE; ++i)
+  {
+    struct PointerCache * c = &app.pointerCache[i];
+    if (c->lastUsed && c->hash == app.pointerShapeHash)
     {
-      // swap the latest shape buffer out of rotation
-      PLGMPMemory tmp  = app.pointerShape;
-      app.pointerShape = app.pointerMemory[app.pointerIndex];
-      app.pointerMemory[app.pointerIndex] = tmp;
+      c->lastUsed = tick;
+      *cacheID    = i;
+      return true;
     }
 
-    // use the last known shape buffer
-    mem = app.pointerShape;
+    if (c->lastUsed < app.pointerCache[slot].lastUsed)
+      slot = i;
   }
-  else
-    mem = app.pointerMemory[app.pointerIndex];
 
-  if (++app.pointerIndex == POINTER_SHAPE_BUFFERS)
-    app.pointerIndex = 0;
+  app.pointerCache[slot].hash     = app.pointerShapeHash;
+  app.pointerCache[slot].lastUsed = tick;
+  *cacheID = slot;
+  return false;
+}
 
-  uint32_t flags = 0;
-  KVMFRCursor *cursor = lgmpHostMemPtr(mem);
+// make the shape posted into the buffer the current shape
+static bool setPointerShape(unsigned int index)
+{
+  const CapturePointer * pointer = &app.pointerShapes[index];
+  PLGMPMemory            mem     = app.pointerMemory[index];
+  KVMFRCursor          * cursor  = lgmpHostMemPtr(mem);
+
+  cursor->hx     = pointer->hx;
+  cursor->hy     = pointer->hy;
+  cursor->width  = pointer->width;
+  cursor->height = pointer->height;
+  cursor->pitch  = pointer->pitch;
+  switch(pointer->format)
+  {
+    case CAPTURE_FMT_COLOR : cursor->type = CURSOR_TYPE_COLOR       ; break;
+    case CAPTURE_FMT_MONO  : cursor->type = CURSOR_TYPE_MONOCHROME  ; break;
+    case CAPTURE_FMT_MASKED: cursor->type = CURSOR_TYPE_MASKED_COLOR; break;
 
-  if (app.pointerInfo.positionUpdate || newClient)
+    default:
+      DEBUG_ERROR("Invalid pointer type");
+      return false;
+  }
+
+  app.pointerShape      = mem;
+  app.pointerShapeValid = true;
+  app.pointerShapeHash  = hashShape(cursor);
+  return true;
+}
+
+static void sendPointerShape(bool newClient)
+{
+  // the position and visibility may have changed with the shape
+  postPointerPos();
+
+  if (!app.pointerShapeValid)
   {
-    flags |= CURSOR_FLAG_POSITION;
-    cursor->x = app.pointerInfo.x;
-    cursor->y = app.pointerInfo.y;
+    ivshmemRingDoorbell(app.shmDev, KVMFR_IRQ_POINTER);
+    return;
   }
 
-  if (app.pointerInfo.visible)
-    flags |= CURSOR_FLAG_VISIBLE;
+  // a new client has an empty cache, start again so every shape it is sent
+  // a reference to has been sent in full after it subscribed
+  if (newClient)
+    memset(app.pointerCache, 0, sizeof(app.pointerCache));
+
+  KVMFRCursor * cursor = lgmpHostMemPtr(app.pointerShape);
+  uint32_t flags = CURSOR_FLAG_SHAPE;
+  if (pointerCacheLookup(&cursor->cacheID))
+    flags |= CURSOR_FLAG_CACHED;
 
-  if (app.pointerInfo.shapeUpdate)
+  // shape changes must not be lost, wait for room in the queue
+  LGMP_STATUS status;
+  while ((status = lgmpHostQueuePost(app.pointerQueue, flags, app.pointerShape)) != LGMP_OK)
   {
-    cursor->hx     = app.pointerInfo.hx;
-    cursor->hy     = app.pointerInfo.hy;
-    cursor->width  = app.pointerInfo.width;
-    cursor->height = app.pointerInfo.height;
-    cursor->pitch  = app.pointerInfo.pitch;
-    switch(app.pointerInfo.format)
+    if (status == LGMP_ERR_QUEUE_FULL)
     {
-      case CAPTURE_FMT_COLOR : cursor->type = CURSOR_TYPE_COLOR       ; break;
-      case CAPTURE_FMT_MONO  : cursor->type = CURSOR_TYPE_MONOCHROME  ; break;
-      case CAPTURE_FMT_MASKED: cursor->type = CURSOR_TYPE_MASKED_COLOR; break;
+      nsleep(1000);
+      continue;
+    }
 
-      default:
-        DEBUG_ERROR("Invalid pointer type");
-        return;
+    DEBUG_ERROR("lgmpHostQueuePost Failed (Pointer): %s", lgmpStatusString(status));
+    return;
+  }
+
+  ivshmemRingDoorbell(app.shmDev, KVMFR_IRQ_POINTER);
+}
+
+static int inputThread(void * opaque)
+{
+  volatile KVMFRInput * in = app.input;
+
+  DEBUG_INFO("Input thread started");
+  if (app.realtime)
+    lgThreadSetPriority(LG_THREAD_PRIORITY_CAPTURE);
+
+  // anything left from a prior client is stale
+  in->tail = in->head;
+
+  while(app.state != APP_STATE_SHUTDOWN)
+  {
+    ++in->hostSerial;
+
+    uint32_t       tail = in->tail;
+    const uint32_t head = in->head;
+    atomic_thread_fence(memory_order_acquire);
+
+    if (head - tail > KVMFR_INPUT_LEN)
+    {
+      DEBUG_WARN("Invalid input ring head, discarding the input");
+      tail = head;
+    }
+
+    for(; tail != head; ++tail)
+    {
+      const KVMFRInputEvent e = in->events[tail % KVMFR_INPUT_LEN];
+      if (!os_inputEvent(&e))
+        DEBUG_WARN("Failed to inject the input event (type %u)", e.type);
     }
 
-    app.pointerShapeValid = true;
+    atomic_thread_fence(memory_order_release);
+    in->tail = tail;
+
+    // the client only sends input while it is subscribed, the serial must
+    // still advance well within KVMFR_INPUT_TIMEOUT
+    nsleep(hasSubscribers() ? app.inputInterval * 1000ULL : 10 * 1000000ULL);
   }
 
-  if ((app.pointerInfo.shapeUpdate || newClient) && app.pointerShapeValid)
-    flags |= CURSOR_FLAG_SHAPE;
+  DEBUG_INFO("Input thread stopped");
+  return 0;
+}
 
-  LGMP_STATUS status;
-  while ((status = lgmpHostQueuePost(app.pointerQueue, flags, mem)) != LGMP_OK)
+static int pointerThread(void * opaque)
+{
+  DEBUG_INFO("Pointer thread started");
+
+  if (app.realtime)
+    lgThreadSetPriority(LG_THREAD_PRIORITY_CAPTURE);
+
+  while(app.state != APP_STATE_SHUTDOWN)
   {
-    if (status == LGMP_ERR_QUEUE_FULL)
+    // signalled on shutdown too
+    lgWaitEvent(app.pointerEvent, TIMEOUT_INFINITE);
+
+    const uint64_t pos = atomic_fetch_and_explicit(&app.pointerPos,
+        ~POINTER_POS_PENDING, memory_order_acquire);
+
+    bool posUpdate = false;
+    if (pos & POINTER_POS_PENDING)
     {
-      usleep(1);
-      continue;
+      app.pointerInfo.x       = (int16_t)(pos >> 16);
+      app.pointerInfo.y       = (int16_t)pos;
+      app.pointerInfo.visible = pos & POINTER_POS_VISIBLE;
+      posUpdate = true;
     }
 
-    DEBUG_ERROR("lgmpHostQueuePost Failed (Pointer): %s", lgmpStatusString(status));
-    break;
+    // send the new shapes in the order they were posted
+    unsigned int r = atomic_load_explicit(&app.pointerRead, memory_order_relaxed);
+    while(r != atomic_load_explicit(&app.pointerWrite, memory_order_acquire))
+    {
+      if (setPointerShape(r & (POINTER_SHAPE_BUFFERS - 1)))
+      {
+        sendPointerShape(false);
+        posUpdate = false;
+      }
+      atomic_store_explicit(&app.pointerRead, ++r, memory_order_release);
+    }
+
+    if (atomic_exchange_explicit(&app.pointerNewClient, false,
+          memory_order_relaxed))
+    {
+      sendPointerShape(true);
+      posUpdate = false;
+    }
+
+    if (posUpdate)
+    {
+      postPointerPos();
+      ivshmemRingDoorbell(app.shmDev, KVMFR_IRQ_POINTER);
+    }
   }
+
+  DEBUG_INFO("Pointer thread stopped");
+  return 0;
 }
 
+// called by the capture interface, this must only be called from one thread
 void capturePostPointerBuffer(CapturePointer pointer)
 {
-  LG_LOCK(app.pointerLock);
+  markActivity();
 
-  int x = app.pointerInfo.x;
-  int y = app.pointerInfo.y;
+  if (pointer.positionUpdate)
+  {
+    app.pointerLastX = pointer.x;
+    app.pointerLastY = pointer.y;
+  }
 
-  memcpy(&app.pointerInfo, &pointer, sizeof(CapturePointer));
+  uint64_t pos = POINTER_POS_PENDING |
+    ((uint64_t)(uint16_t)app.pointerLastX << 16) |
+    ((uint64_t)(uint16_t)app.pointerLastY);
+  if (pointer.visible)
+    pos |= POINTER_POS_VISIBLE;
+  atomic_store_explicit(&app.pointerPos, pos, memory_order_release);
 
-  /* if there was not a position update, restore the x & y */
-  if (!pointer.positionUpdate)
+  if (pointer.shapeUpdate)
   {
-    app.pointerInfo.x = x;
-    app.pointerInfo.y = y;
+    const unsigned int w = atomic_load_explicit(&app.pointerWrite, memory_order_relaxed);
+    if (w - atomic_load_explicit(&app.pointerRead, memory_order_acquire) >=
+        POINTER_SHAPE_BUFFERS - 1)
+      DEBUG_WARN("No pointer buffer was free, the shape was dropped");
+    else
+    {
+      app.pointerShapes[w & (POINTER_SHAPE_BUFFERS - 1)] = pointer;
+      atomic_store_explicit(&app.pointerWrite, w + 1, memory_order_release);
+    }
   }
 
-  sendPointer(false);
+  lgSignalEvent(app.pointerEvent);
+}
 
-  LG_UNLOCK(app.pointerLock);
+static CaptureFormat frameTypeToFormat(FrameType type)
+{
+  switch(type)
+  {
+    case FRAME_TYPE_BGRA   : return CAPTURE_FMT_BGRA   ;
+    case FRAME_TYPE_RGBA   : return CAPTURE_FMT_RGBA   ;
+    case FRAME_TYPE_RGBA10 : return CAPTURE_FMT_RGBA10 ;
+    case FRAME_TYPE_RGBA16F: return CAPTURE_FMT_RGBA16F;
+    case FRAME_TYPE_YUV420 : return CAPTURE_FMT_YUV420 ;
+    case FRAME_TYPE_H264   : return CAPTURE_FMT_H264   ;
+    default:
+      return CAPTURE_FMT_MAX;
+  }
+}
+
+static void checkRequest()
+{
+  const uint32_t serial = app.request->serial;
+  if (serial == app.requestSerial)
+    return;
+
+  app.requestSerial = serial;
+  atomic_thread_fence(memory_order_acquire);
+
+  const unsigned int width  = app.request->targetWidth;
+  const unsigned int height = app.request->targetHeight;
+  if (app.iface->setTargetSize)
+  {
+    DEBUG_INFO("Client target size: %ux%u", width, height);
+    app.iface->setTargetSize(width, height);
+  }
+
+  const unsigned int maxFPS = app.request->maxFPS;
+  if (maxFPS != app.requestFPS && app.iface->setFrameRate)
+  {
+    if (maxFPS)
+      DEBUG_INFO("Client frame rate limit: %u", maxFPS);
+    else
+      DEBUG_INFO("Client frame rate limit: none");
+    app.requestFPS = maxFPS;
+    app.iface->setFrameRate(maxFPS);
+  }
+
+  const uint32_t types     = app.request->frameTypes;
+  const uint32_t preferred = app.request->preferredType;
+  if ((types != app.requestTypes || preferred != app.requestPreferred) &&
+      app.iface->setFormats)
+  {
+    unsigned int  formats = 0;
+    CaptureFormat pref    = CAPTURE_FMT_MAX;
+    for(FrameType t = FRAME_TYPE_INVALID + 1; t < FRAME_TYPE_MAX; ++t)
+    {
+      const CaptureFormat fmt = frameTypeToFormat(t);
+      if (types & (1U << t))
+        formats |= 1U << fmt;
+      if (preferred == t)
+        pref = fmt;
+    }
+
+    DEBUG_INFO("Client formats: 0x%x, preferred: %s", types,
+        preferred > FRAME_TYPE_INVALID && preferred < FRAME_TYPE_MAX ?
+        FrameTypeStr[preferred] : "none");
+    app.requestTypes     = types;
+    app.requestPreferred = preferred;
+    app.iface->setFormats(formats, pref);
+  }
+
+  // the client's region replaces the configured one while it has one set
+  CaptureRect crop = app.configCrop;
+  if (app.request->cropWidth && app.request->cropHeight)
+    crop = (CaptureRect)
+    {
+      .x      = app.request->cropX,
+      .y      = app.request->cropY,
+      .width  = app.request->cropWidth,
+      .height = app.request->cropHeight
+    };
+
+  if (memcmp(&crop, &app.requestCrop, sizeof(crop)) != 0 && app.iface->setCrop)
+  {
+    if (crop.width && crop.height)
+      DEBUG_INFO("Capture region: %ux%u at %u,%u",
+          crop.width, crop.height, crop.x, crop.y);
+    else
+      DEBUG_INFO("Capture region: full desktop");
+    app.requestCrop = crop;
+    app.iface->setCrop(crop);
+  }
+
+  const uint32_t traceSerial = app.request->traceSerial;
+  if (traceSerial != app.traceSerial)
+  {
+    app.traceSerial = traceSerial;
+    if (app.traceFile)
+      lgTraceDump(app.traceFile);
+    else
+      DEBUG_INFO("The client asked for a trace but app:traceFile is not set");
+  }
+}
+
+// the frame is written into the IVSHMEM device, keep its writers on its node
+static void placeOnNode(struct IVSHMEM * dev, uint64_t * affinity,
+    const char * thread)
+{
+  const uint64_t cpus = sysinfo_getNodeCPUs(ivshmemGetNode(dev));
+  if (!cpus)
+    return;
+
+  if (!*affinity)
+  {
+    if (option_get_bool("app", "numaPin"))
+      *affinity = cpus;
+    return;
+  }
+
+  if (!(*affinity & cpus))
+    DEBUG_WARN("The %s thread affinity has no CPUs on the NUMA node of the "
+        "IVSHMEM device (0x%" PRIx64 ")", thread, cpus);
+}
+
+static bool parseCrop(const char * str, CaptureRect * crop)
+{
+  memset(crop, 0, sizeof(*crop));
+  if (!str || !*str)
+    return true;
+
+  return sscanf(str, "%u,%u,%u,%u",
+      &crop->x, &crop->y, &crop->width, &crop->height) == 4;
 }
 
 // this is called from the platform specific startup routine
@@ -394,6 +1281,152 @@ int app_main(int argc, char * argv[])
 
   ivshmemOptionsInit();
 
+  struct Option options[] =
+  {
+    {
+      .module         = "app",
+      .name           = "writeChunk",
+      .description    = "How many KiB of the frame to copy between progress updates to the client",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 128
+    },
+    {
+      .module         = "app",
+      .name           = "traceFile",
+      .description    = "Record a trace of the capture path and write it here when the client asks for it",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = NULL
+    },
+    {
+      .module         = "app",
+      .name           = "crop",
+      .description    = "The region of the desktop to capture as x,y,width,height (empty for all of it)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = NULL
+    },
+    {
+      .module         = "app",
+      .name           = "frameBuffers",
+      .description    = "How many frames to buffer for the client (0 for auto, otherwise 2 to 8)",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 0
+    },
+    {
+      .module         = "app",
+      .name           = "writeThreads",
+      .description    = "How many threads to split each frame copy across (0 or 1 to disable)",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 0
+    },
+    {
+      .module         = "app",
+      .name           = "tiledFrames",
+      .description    = "Write packed frames as tiles that complete in any order so the client can take each as it is done, rewriting only the damaged tiles",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "app",
+      .name           = "writeAffinity",
+      .description    = "Hex mask of the CPUs to pin the frame copy threads to (0 for any)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = "0"
+    },
+    {
+      .module         = "app",
+      .name           = "idleTimeout",
+      .description    = "Seconds without any change before the capture rate is reduced (0 to disable)",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 10
+    },
+    {
+      .module         = "app",
+      .name           = "idleInterval",
+      .description    = "Milliseconds between captures while idle",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 50
+    },
+    {
+      .module         = "app",
+      .name           = "lgmpInterval",
+      .description    = "Milliseconds between LGMP updates, which is how long a new client may wait to be seen",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 10
+    },
+    {
+      .module         = "app",
+      .name           = "subTimeout",
+      .description    = "Milliseconds a client may hold a message before it is presumed dead and dropped",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 500
+    },
+    {
+      .module         = "app",
+      .name           = "clipboardSize",
+      .description    = "MiB of shared memory for the clipboard each way, it is taken from the frame buffers and larger clipboards are not synced (0 to use SPICE)",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 8
+    },
+    {
+      .module         = "app",
+      .name           = "audio",
+      .description    = "Capture what the guest plays and send it to the client through the shared memory",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {
+      .module         = "app",
+      .name           = "input",
+      .description    = "Inject the keyboard and mouse input the client sends through the shared memory, the client uses SPICE without it",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {
+      .module         = "app",
+      .name           = "inputInterval",
+      .description    = "Microseconds between checks for input from the client",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 500
+    },
+    {
+      .module         = "app",
+      .name           = "captureRetry",
+      .description    = "How many seconds to keep retrying a lost capture device before restarting (0 to disable)",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 30
+    },
+    {
+      .module         = "app",
+      .name           = "realtime",
+      .description    = "Use real-time scheduling for the capture, frame and pointer threads (MMCSS on Windows)",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {
+      .module         = "app",
+      .name           = "captureAffinity",
+      .description    = "Hex mask of the CPUs to pin the capture thread to (0 for any)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = "0"
+    },
+    {
+      .module         = "app",
+      .name           = "frameAffinity",
+      .description    = "Hex mask of the CPUs to pin the frame thread to (0 for any)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = "0"
+    },
+    {
+      .module         = "app",
+      .name           = "numaPin",
+      .description    = "Pin the capture and frame threads to the NUMA node of the IVSHMEM device if their affinity is not set",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {0}
+  };
+  option_register(options);
+
   // register capture interface options
   for(int i = 0; CaptureInterfaces[i]; ++i)
     if (CaptureInterfaces[i]->initOptions)
@@ -435,6 +1468,73 @@ int app_main(int argc, char * argv[])
   if (!app_init())
     return -1;
 
+  framebuffer_set_write_chunk(option_get_int("app", "writeChunk") * 1024);
+  app.tiledFrames = option_get_bool("app", "tiledFrames");
+  if (!framebuffer_set_write_threads(option_get_int("app", "writeThreads"),
+        strtoull(option_get_string("app", "writeAffinity"), NULL, 16)))
+    DEBUG_WARN("Failed to start the frame write threads, using a single thread");
+
+  const int frameBuffers = option_get_int("app", "frameBuffers");
+  if (frameBuffers < 0 || frameBuffers == 1 || frameBuffers > LGMP_Q_FRAME_LEN)
+  {
+    DEBUG_ERROR("app:frameBuffers must be 0 or between 2 and %d", LGMP_Q_FRAME_LEN);
+    return -1;
+  }
+  app.frameBuffers = frameBuffers;
+
+  if (!parseCrop(option_get_string("app", "crop"), &app.configCrop))
+  {
+    DEBUG_ERROR("app:crop must be in the form x,y,width,height");
+    return -1;
+  }
+  app.requestCrop = app.configCrop;
+
+  app.traceFile = option_get_string("app", "traceFile");
+  if (app.traceFile)
+    lgTraceInit("Looking Glass Host", 1);
+
+  app.realtime        = option_get_bool("app", "realtime");
+  app.captureAffinity = strtoull(option_get_string("app", "captureAffinity"), NULL, 16);
+  app.frameAffinity   = strtoull(option_get_string("app", "frameAffinity"  ), NULL, 16);
+
+  const int lgmpInterval = option_get_int("app", "lgmpInterval");
+  const int subTimeout   = option_get_int("app", "subTimeout"  );
+  if (lgmpInterval < 1 || subTimeout < lgmpInterval * 2)
+  {
+    DEBUG_ERROR("app:lgmpInterval must be at least 1 and app:subTimeout at least twice it");
+    return -1;
+  }
+  app.lgmpInterval = lgmpInterval;
+  FRAME_QUEUE_CONFIG.subTimeout     = subTimeout;
+  FRAME_AUX_QUEUE_CONFIG.subTimeout = subTimeout;
+  POINTER_QUEUE_CONFIG.subTimeout   = subTimeout;
+  CLIPBOARD_QUEUE_CONFIG.subTimeout = subTimeout;
+  AUDIO_QUEUE_CONFIG.subTimeout     = subTimeout;
+
+  const int inputInterval = option_get_int("app", "inputInterval");
+  if (inputInterval < 1)
+  {
+    DEBUG_ERROR("app:inputInterval must be at least 1");
+    return -1;
+  }
+  app.inputInterval = inputInterval;
+
+  const int clipboardSize = option_get_int("app", "clipboardSize");
+  if (clipboardSize < 0 || clipboardSize > 1024)
+  {
+    DEBUG_ERROR("app:clipboardSize must be between 0 and 1024");
+    return -1;
+  }
+  app.clipboardSize = clipboardSize * 1048576ULL;
+
+  const int captureRetry = option_get_int("app", "captureRetry");
+  app.captureRetryTime = captureRetry > 0 ? captureRetry * 1000000ULL : 0;
+
+  const int idleTimeout  = option_get_int("app", "idleTimeout" );
+  const int idleInterval = option_get_int("app", "idleInterval");
+  app.idleTimeout  = idleTimeout  > 0 ? idleTimeout  * 1000000ULL : 0;
+  app.idleInterval = idleInterval > 0 ? idleInterval * 1000000ULL : 0;
+
   DEBUG_INFO("Looking Glass Host (%s)", BUILD_VERSION);
 
   struct IVSHMEM shmDev = { 0 };
@@ -449,6 +1549,10 @@ int app_main(int argc, char * argv[])
     DEBUG_ERROR("Failed to open the IVSHMEM device");
     return -1;
   }
+  app.shmDev = &shmDev;
+
+  placeOnNode(&shmDev, &app.captureAffinity, "capture");
+  placeOnNode(&shmDev, &app.frameAffinity  , "frame"  );
 
   int exitcode  = 0;
   DEBUG_INFO("IVSHMEM Size     : %u MiB", shmDev.size / 1048576);
@@ -456,14 +1560,65 @@ int app_main(int argc, char * argv[])
   DEBUG_INFO("Max Pointer Size : %u KiB", (unsigned int)MAX_POINTER_SIZE / 1024);
   DEBUG_INFO("KVMFR Version    : %u", KVMFR_VERSION);
 
+  // the request area sits after the LGMP heap where the client can write it
+  const size_t requestOffset = shmDev.size - KVMFR_REQUEST_SIZE;
+  app.request       = (volatile KVMFRRequest *)((uint8_t *)shmDev.mem + requestOffset);
+  app.requestSerial = 0;
+  app.requestFPS    = 0;
+  app.requestTypes     = 0;
+  app.requestPreferred = FRAME_TYPE_INVALID;
+  app.traceSerial      = 0;
+  app.pingSerial    = 0;
+  memset((void *)app.request, 0, KVMFR_REQUEST_SIZE);
+
+  const size_t cursorPosOffset = requestOffset + KVMFR_CURSOR_POS_OFFSET;
+  app.cursorPos = (volatile KVMFRCursorPos *)((uint8_t *)shmDev.mem + cursorPosOffset);
+
+  // the KVMFR header is fixed before anything is allocated from the LGMP heap
+  // so the stats live in the reserved area where their offset is known
+  const size_t statsOffset = requestOffset + KVMFR_STATS_OFFSET;
+  app.stats = (volatile KVMFRStats *)((uint8_t *)shmDev.mem + statsOffset);
+  app.stats->version = KVMFR_STATS_VERSION;
+  app.stats->size    = sizeof(KVMFRStats);
+
+  // the client is only told of the input ring if the input can be injected
+  size_t inputOffset = 0;
+  if (option_get_bool("app", "input"))
+  {
+    if (os_inputInit())
+    {
+      inputOffset = requestOffset + KVMFR_INPUT_OFFSET;
+      app.input   = (volatile KVMFRInput *)((uint8_t *)shmDev.mem + inputOffset);
+    }
+    else
+      DEBUG_WARN("Input can not be injected, the client will use SPICE");
+  }
+
+  // the buffers are only given to the client once they are allocated
+  size_t clipboardOffset = 0;
+  if (app.clipboardSize)
+  {
+    clipboardOffset = requestOffset + KVMFR_CLIPBOARD_OFFSET;
+    app.clipboardRequest = (volatile KVMFRClipboardRequest *)
+      ((uint8_t *)shmDev.mem + clipboardOffset);
+  }
+
   KVMFR udata = {
-    .magic   = KVMFR_MAGIC,
-    .version = KVMFR_VERSION,
+    .magic           = KVMFR_MAGIC,
+    .version         = KVMFR_VERSION,
+    .requestOffset   = requestOffset,
+    .cursorPosOffset = cursorPosOffset,
+    .statsOffset     = statsOffset,
+    .inputOffset     = inputOffset,
+    .clipboardOffset = clipboardOffset,
+    .flags           =
+      ivshmemCanRing(&shmDev, KVMFR_IRQ_FRAME  ) &&
+      ivshmemCanRing(&shmDev, KVMFR_IRQ_POINTER) ? KVMFR_FLAG_DOORBELL : 0
   };
   strncpy(udata.hostver, BUILD_VERSION, sizeof(udata.hostver));
 
   LGMP_STATUS status;
-  if ((status = lgmpHostInit(shmDev.mem, shmDev.size, &app.lgmp,
+  if ((status = lgmpHostInit(shmDev.mem, requestOffset, &app.lgmp,
           sizeof(udata), (uint8_t *)&udata)) != LGMP_OK)
   {
     DEBUG_ERROR("lgmpHostInit Failed: %s", lgmpStatusString(status));
@@ -476,6 +1631,12 @@ int app_main(int argc, char * argv[])
     goto fail;
   }
 
+  if ((status = lgmpHostQueueNew(app.lgmp, FRAME_AUX_QUEUE_CONFIG, &app.frameAuxQueue)) != LGMP_OK)
+  {
+    DEBUG_ERROR("lgmpHostQueueNew Failed (Frame Aux): %s", lgmpStatusString(status));
+    goto fail;
+  }
+
   if ((status = lgmpHostQueueNew(app.lgmp, POINTER_QUEUE_CONFIG, &app.pointerQueue)) != LGMP_OK)
   {
     DEBUG_ERROR("lgmpHostQueueNew Failed (Pointer): %s", lgmpStatusString(status));
@@ -492,28 +1653,73 @@ int app_main(int argc, char * argv[])
     memset(lgmpHostMemPtr(app.pointerMemory[i]), 0, MAX_POINTER_SIZE);
   }
 
-  app.pointerShapeValid = false;
-  if ((status = lgmpHostMemAlloc(app.lgmp, MAX_POINTER_SIZE, &app.pointerShape)) != LGMP_OK)
+  // nothing is posted until clipboardActive is set
+  if (app.clipboardRequest && !os_clipboardInit(clipboardChanged))
   {
-    DEBUG_ERROR("lgmpHostMemAlloc Failed (Pointer Shape): %s", lgmpStatusString(status));
-    goto fail;
+    DEBUG_WARN("The clipboard can not be synced, the client will use SPICE");
+    app.clipboardRequest = NULL;
   }
 
-  const long sz = sysinfo_getPageSize();
-  app.maxFrameSize = lgmpHostMemAvail(app.lgmp);
-  app.maxFrameSize = (app.maxFrameSize - (sz - 1)) & ~(sz - 1);
-  app.maxFrameSize /= LGMP_Q_FRAME_LEN;
-  DEBUG_INFO("Max Frame Size   : %u MiB", (unsigned int)(app.maxFrameSize / 1048576LL));
-
-  for(int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  if (app.clipboardRequest)
   {
-    if ((status = lgmpHostMemAllocAligned(app.lgmp, app.maxFrameSize, sz, &app.frameMemory[i])) != LGMP_OK)
+    if ((status = lgmpHostQueueNew(app.lgmp, CLIPBOARD_QUEUE_CONFIG,
+            &app.clipboardQueue)) != LGMP_OK ||
+        (status = lgmpHostMemAlloc(app.lgmp, app.clipboardSize,
+            &app.clipboardMemory)) != LGMP_OK ||
+        (status = lgmpHostMemAlloc(app.lgmp, app.clipboardSize,
+            &app.clipboardRecvMemory)) != LGMP_OK)
     {
-      DEBUG_ERROR("lgmpHostMemAlloc Failed (Frame): %s", lgmpStatusString(status));
-      goto fail;
+      DEBUG_WARN("Failed to setup the clipboard, the client will use SPICE: %s",
+          lgmpStatusString(status));
+      os_clipboardFree();
+      lgmpHostMemFree(&app.clipboardMemory);
+      lgmpHostMemFree(&app.clipboardRecvMemory);
+      app.clipboardRequest = NULL;
+    }
+    else
+    {
+      app.clipboardRequest->bufferOffset =
+        (uint8_t *)lgmpHostMemPtr(app.clipboardRecvMemory) -
+        (uint8_t *)shmDev.mem;
+      atomic_thread_fence(memory_order_release);
+      app.clipboardRequest->bufferSize = app.clipboardSize;
+      app.clipboardActive = true;
+      DEBUG_INFO("Clipboard Memory : %u MiB each way",
+          (unsigned int)(app.clipboardSize / 1048576));
     }
   }
 
+  if (option_get_bool("app", "audio"))
+  {
+    status = lgmpHostQueueNew(app.lgmp, AUDIO_QUEUE_CONFIG, &app.audioQueue);
+    for(int i = 0; status == LGMP_OK && i < LGMP_Q_AUDIO_LEN; ++i)
+      status = lgmpHostMemAlloc(app.lgmp, MAX_AUDIO_SIZE, &app.audioMemory[i]);
+
+    if (status != LGMP_OK)
+      DEBUG_WARN("Failed to setup the audio, it will not be captured: %s",
+          lgmpStatusString(status));
+    else if (!os_audioInit(audioData))
+      DEBUG_WARN("The audio can not be captured");
+    else
+      app.audioActive = true;
+
+    if (!app.audioActive)
+      for(int i = 0; i < LGMP_Q_AUDIO_LEN; ++i)
+        lgmpHostMemFree(&app.audioMemory[i]);
+  }
+
+  app.pointerShapeValid = false;
+  atomic_init(&app.pointerWrite    , 0);
+  atomic_init(&app.pointerRead     , 0);
+  atomic_init(&app.pointerPos      , 0);
+  atomic_init(&app.pointerNewClient, false);
+
+  const long sz = sysinfo_getPageSize();
+  app.frameAlign   = sz > FRAME_DATA_ALIGN ? sz : FRAME_DATA_ALIGN;
+  app.frameCount   = 0;
+  DEBUG_INFO("Frame Memory     : %u MiB",
+      (unsigned int)(lgmpHostMemAvail(app.lgmp) / 1048576LL));
+
   CaptureInterface * iface = NULL;
   for(int i = 0; CaptureInterfaces[i]; ++i)
   {
@@ -526,6 +1732,9 @@ int app_main(int argc, char * argv[])
       continue;
     }
 
+    if (iface->setCrop)
+      iface->setCrop(app.configCrop);
+
     if (iface->init())
       break;
 
@@ -545,18 +1754,45 @@ int app_main(int argc, char * argv[])
   app.state = APP_STATE_RUNNING;
   app.iface = iface;
 
-  LG_LOCK_INIT(app.pointerLock);
+  if (!(app.pointerEvent = lgCreateEvent(true, 0)))
+  {
+    DEBUG_ERROR("Failed to create the pointer event");
+    goto fail;
+  }
+
+  if (!(app.wakeEvent = lgCreateEvent(true, 0)))
+  {
+    DEBUG_ERROR("Failed to create the wake event");
+    goto fail;
+  }
+
+  if (!lgCreateThread("PointerThread", pointerThread, NULL, &app.pointerThread))
+  {
+    DEBUG_ERROR("Failed to create the pointer thread");
+    goto fail;
+  }
+
+  if (app.input &&
+      !lgCreateThread("InputThread", inputThread, NULL, &app.inputThread))
+  {
+    DEBUG_ERROR("Failed to create the input thread");
+    goto fail;
+  }
 
-  if (!lgCreateTimer(100, lgmpTimer, NULL, &app.lgmpTimer))
+  if (!lgCreateTimer(app.lgmpInterval, lgmpTimer, NULL, &app.lgmpTimer))
   {
     DEBUG_ERROR("Failed to create the LGMP timer");
     goto fail;
   }
 
+  // this thread drives the capture interface
+  if (app.realtime)
+    lgThreadSetPriority(LG_THREAD_PRIORITY_CAPTURE);
+  lgThreadSetAffinity(NULL, app.captureAffinity);
+
   while(app.state != APP_STATE_SHUTDOWN)
   {
-    if(lgmpHostQueueHasSubs(app.pointerQueue) ||
-        lgmpHostQueueHasSubs(app.frameQueue))
+    if (hasSubscribers())
     {
       if (!captureStart())
       {
@@ -566,14 +1802,34 @@ int app_main(int argc, char * argv[])
     }
     else
     {
-      usleep(100000);
+      // the LGMP timer signals once it sees a subscriber
+      lgWaitEvent(app.wakeEvent, 1000);
       continue;
     }
 
-    while(app.state != APP_STATE_SHUTDOWN && (
-          lgmpHostQueueHasSubs(app.pointerQueue) ||
-          lgmpHostQueueHasSubs(app.frameQueue)))
+    bool idle = false;
+    markActivity();
+
+    while(app.state != APP_STATE_SHUTDOWN && hasSubscribers())
     {
+      // back off while nothing is changing, the first frame or pointer update
+      // brings the capture back to the full rate
+      if (app.idleTimeout && microtime() - atomic_load_explicit(
+            &app.lastActivity, memory_order_relaxed) > app.idleTimeout)
+      {
+        if (!idle)
+        {
+          DEBUG_INFO("Nothing has changed, reducing the capture rate");
+          idle = true;
+        }
+        nsleep(app.idleInterval);
+      }
+      else if (idle)
+      {
+        DEBUG_INFO("Resuming the full capture rate");
+        idle = false;
+      }
+
       if (app.state == APP_STATE_RESTART)
       {
         if (!captureRestart())
@@ -584,14 +1840,13 @@ int app_main(int argc, char * argv[])
         app.state = APP_STATE_RUNNING;
       }
 
-      if (lgmpHostQueueNewSubs(app.pointerQueue) > 0)
-      {
-        LG_LOCK(app.pointerLock);
-        sendPointer(true);
-        LG_UNLOCK(app.pointerLock);
-      }
+      checkRequest();
+
+      const LGTraceScope captureTrace = lgTraceBegin("capture");
+      const CaptureResult result = iface->capture();
+      lgTraceEnd(captureTrace);
 
-      switch(iface->capture())
+      switch(result)
       {
         case CAPTURE_RESULT_OK:
           break;
@@ -620,25 +1875,74 @@ finish:
 
 exit:
   lgTimerDestroy(app.lgmpTimer);
-  LG_LOCK_FREE(app.pointerLock);
 
   iface->deinit();
   iface->free();
 fail:
+  app.state = APP_STATE_SHUTDOWN;
+  if (app.pointerThread)
+  {
+    lgSignalEvent(app.pointerEvent);
+    lgJoinThread(app.pointerThread, NULL);
+    app.pointerThread = NULL;
+  }
+
+  if (app.inputThread)
+  {
+    lgJoinThread(app.inputThread, NULL);
+    app.inputThread = NULL;
+  }
+
+  if (app.input)
+  {
+    os_inputFree();
+    app.input = NULL;
+  }
 
-  for(int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  if (app.clipboardActive)
+  {
+    app.clipboardActive = false;
+    os_clipboardFree();
+  }
+  lgmpHostMemFree(&app.clipboardMemory);
+  lgmpHostMemFree(&app.clipboardRecvMemory);
+  app.clipboardRequest = NULL;
+
+  if (app.audioActive)
+  {
+    app.audioActive = false;
+    os_audioFree();
+  }
+  for(int i = 0; i < LGMP_Q_AUDIO_LEN; ++i)
+    lgmpHostMemFree(&app.audioMemory[i]);
+
+  if (app.pointerEvent)
+  {
+    lgFreeEvent(app.pointerEvent);
+    app.pointerEvent = NULL;
+  }
+
+  if (app.wakeEvent)
+  {
+    lgFreeEvent(app.wakeEvent);
+    app.wakeEvent = NULL;
+  }
+
+  for(int i = 0; i < app.frameCount; ++i)
     lgmpHostMemFree(&app.frameMemory[i]);
-  for(int i = 0; i < LGMP_Q_POINTER_LEN; ++i)
+  for(int i = 0; i < POINTER_SHAPE_BUFFERS; ++i)
     lgmpHostMemFree(&app.pointerMemory[i]);
-  lgmpHostMemFree(&app.pointerShape);
   lgmpHostFree(&app.lgmp);
 
   ivshmemClose(&shmDev);
   ivshmemFree(&shmDev);
+  framebuffer_set_write_threads(0, 0);
   return exitcode;
 }
 
 void app_quit()
 {
   app.state = APP_STATE_SHUTDOWN;
+  if (app.wakeEvent)
+    lgSignalEvent(app.wakeEvent);
 }
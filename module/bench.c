@@ -0,0 +1,640 @@
+/*
+KVMFR IVSHMEM DMA Buffer Driver - Benchmark
+Copyright (C) 2017-2020 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Measures the costs that decide how the kvmfr memory is mapped: the mmap
+ * and first touch of the device and of DMA-BUFs, the sequential bandwidth
+ * for the current cache_mode, and with KVMFR_BENCH_EGL the import of a
+ * DMA-BUF into a GPU texture. Results are medians over the iterations.
+ *
+ * The write tests overwrite the shared memory, do not use -w while a host
+ * or client is using the device.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+
+#ifdef KVMFR_BENCH_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+#endif
+
+#include "kvmfr.h"
+
+#define CACHE_MODE_PARAM "/sys/module/kvmfr/parameters/cache_mode"
+#define PAGE_SIZE_4K     4096
+
+static const char * cacheModeStr[] = { "cached", "wc", "uncached" };
+
+static struct
+{
+  const char   * device;
+  size_t         size;
+  int            iterations;
+  bool           allModes;
+  bool           perCPU;
+  bool           write;
+  bool           egl;
+  FILE         * csv;
+
+  int            fd;
+  size_t         devSize;
+  int            mode;
+  int            cpu; // -1 if not pinned
+  void         * buffer;
+}
+bench =
+{
+  .device     = "/dev/kvmfr0",
+  .size       = 256 * 1024 * 1024,
+  .iterations = 10,
+  .cpu        = -1
+};
+
+static inline uint64_t nanotime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compareDouble(const void * a, const void * b)
+{
+  const double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double median(double * values, int count)
+{
+  qsort(values, count, sizeof(*values), compareDouble);
+  return count & 1 ? values[count / 2] :
+    (values[count / 2 - 1] + values[count / 2]) / 2.0;
+}
+
+static void report(const char * test, size_t size, double value,
+    const char * unit)
+{
+  char cpu[16] = "any";
+  if (bench.cpu >= 0)
+    snprintf(cpu, sizeof(cpu), "%d", bench.cpu);
+
+  printf("%-20s %-8s cpu %-4s %8zu KiB %12.3f %s\n", test,
+      cacheModeStr[bench.mode], cpu, size / 1024, value, unit);
+
+  if (bench.csv)
+    fprintf(bench.csv, "%s,%s,%s,%zu,%.3f,%s\n", test,
+        cacheModeStr[bench.mode], cpu, size, value, unit);
+}
+
+static int readCacheMode(void)
+{
+  FILE * fp = fopen(CACHE_MODE_PARAM, "r");
+  int mode = 0;
+  if (!fp)
+    return 0;
+
+  if (fscanf(fp, "%d", &mode) != 1 || mode < 0 || mode > 2)
+    mode = 0;
+  fclose(fp);
+  return mode;
+}
+
+// the mode applies to mappings made after it is set
+static bool setCacheMode(int mode)
+{
+  FILE * fp = fopen(CACHE_MODE_PARAM, "w");
+  if (!fp)
+  {
+    perror("open " CACHE_MODE_PARAM);
+    return false;
+  }
+
+  const bool ok = fprintf(fp, "%d\n", mode) > 0;
+  if (fclose(fp) != 0 || !ok)
+  {
+    perror("write " CACHE_MODE_PARAM);
+    return false;
+  }
+
+  bench.mode = readCacheMode();
+  return bench.mode == mode;
+}
+
+static void * mapFd(int fd, size_t size, uint64_t * ns)
+{
+  const uint64_t start = nanotime();
+  void * mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (ns)
+    *ns = nanotime() - start;
+
+  if (mem == MAP_FAILED)
+  {
+    perror("mmap");
+    return NULL;
+  }
+  return mem;
+}
+
+// read a byte from every page the first time it is touched
+static uint64_t touchPages(const volatile uint8_t * mem, size_t size)
+{
+  uint8_t sink = 0;
+  const uint64_t start = nanotime();
+  for(size_t i = 0; i < size; i += PAGE_SIZE_4K)
+    sink += mem[i];
+  const uint64_t ns = nanotime() - start;
+
+  (void)sink;
+  return ns;
+}
+
+static bool testMapping(const char * name, int fd, size_t size)
+{
+  double mapTimes[bench.iterations], touchTimes[bench.iterations];
+  for(int i = 0; i < bench.iterations; ++i)
+  {
+    uint64_t mapNs;
+    void * mem = mapFd(fd, size, &mapNs);
+    if (!mem)
+      return false;
+
+    const uint64_t touchNs = touchPages(mem, size);
+    munmap(mem, size);
+
+    mapTimes  [i] = mapNs / 1000.0;
+    touchTimes[i] = (double)touchNs / (size / PAGE_SIZE_4K);
+  }
+
+  char test[32];
+  snprintf(test, sizeof(test), "%s_mmap", name);
+  report(test, size, median(mapTimes, bench.iterations), "us");
+  snprintf(test, sizeof(test), "%s_first_touch", name);
+  report(test, size, median(touchTimes, bench.iterations), "ns/page");
+  return true;
+}
+
+// 64-bit loads with no stores so only the read side is measured
+static uint64_t sumRead(const uint64_t * src, size_t size)
+{
+  uint64_t a = 0, b = 0, c = 0, d = 0;
+  for(size_t i = 0; i < size / 8; i += 4)
+  {
+    a += src[i    ];
+    b += src[i + 1];
+    c += src[i + 2];
+    d += src[i + 3];
+  }
+  return a + b + c + d;
+}
+
+static void testBandwidth(void * mem, size_t size, bool writes)
+{
+  double sum[bench.iterations], copy[bench.iterations], set[bench.iterations];
+  volatile uint64_t sink = 0;
+
+  for(int i = 0; i < bench.iterations; ++i)
+  {
+    uint64_t start = nanotime();
+    sink += sumRead(mem, size);
+    sum[i] = (double)size / (nanotime() - start);
+
+    start = nanotime();
+    memcpy(bench.buffer, mem, size);
+    copy[i] = (double)size / (nanotime() - start);
+
+    if (writes)
+    {
+      start = nanotime();
+      memset(mem, i, size);
+      set[i] = (double)size / (nanotime() - start);
+    }
+  }
+
+  // bytes per ns is GB/s
+  report("read_sum" , size, median(sum , bench.iterations), "GB/s");
+  report("read_copy", size, median(copy, bench.iterations), "GB/s");
+  if (writes)
+    report("write_set", size, median(set, bench.iterations), "GB/s");
+}
+
+static int createDMABuf(size_t size)
+{
+  struct kvmfr_dmabuf_create create =
+  {
+    .flags  = KVMFR_DMABUF_FLAG_CLOEXEC,
+    .offset = 0x0,
+    .size   = size,
+  };
+  int fd = ioctl(bench.fd, KVMFR_DMABUF_CREATE, &create);
+  if (fd < 0)
+    perror("ioctl KVMFR_DMABUF_CREATE");
+  return fd;
+}
+
+static bool testDMABuf(size_t size)
+{
+  double times[bench.iterations];
+  for(int i = 0; i < bench.iterations; ++i)
+  {
+    const uint64_t start = nanotime();
+    int fd = createDMABuf(size);
+    if (fd < 0)
+      return false;
+    close(fd);
+    times[i] = (nanotime() - start) / 1000.0;
+  }
+  report("dmabuf_create", size, median(times, bench.iterations), "us");
+
+  int fd = createDMABuf(size);
+  if (fd < 0)
+    return false;
+
+  const bool ret = testMapping("dmabuf", fd, size);
+  close(fd);
+  return ret;
+}
+
+#ifdef KVMFR_BENCH_EGL
+#define DRM_FORMAT_ARGB8888 0x34325241 // 'AR24'
+
+#define IMPORT_WIDTH  1920
+#define IMPORT_HEIGHT 1080
+
+static EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+static EGLContext eglContext = EGL_NO_CONTEXT;
+static PFNEGLCREATEIMAGEKHRPROC             eglCreateImageKHR;
+static PFNEGLDESTROYIMAGEKHRPROC            eglDestroyImageKHR;
+static PFNGLEGLIMAGETARGETTEXTURE2DOESPROC  glEGLImageTargetTexture2DOES;
+
+static bool initEGL(void)
+{
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (!getPlatformDisplay)
+  {
+    fprintf(stderr, "eglGetPlatformDisplayEXT is not available\n");
+    return false;
+  }
+
+  // no window system is needed to import and sample a texture
+  eglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+      EGL_DEFAULT_DISPLAY, NULL);
+  if (eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, NULL, NULL))
+  {
+    fprintf(stderr, "Failed to initialize the surfaceless EGL display\n");
+    return false;
+  }
+
+  const char * exts = eglQueryString(eglDisplay, EGL_EXTENSIONS);
+  if (!strstr(exts, "EGL_EXT_image_dma_buf_import") ||
+      !strstr(exts, "EGL_KHR_surfaceless_context"))
+  {
+    fprintf(stderr, "EGL_EXT_image_dma_buf_import and "
+        "EGL_KHR_surfaceless_context are required\n");
+    return false;
+  }
+
+  const EGLint attr[] =
+  {
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+    EGL_NONE
+  };
+
+  EGLConfig config;
+  EGLint    count;
+  if (!eglBindAPI(EGL_OPENGL_ES_API) ||
+      !eglChooseConfig(eglDisplay, attr, &config, 1, &count) || count != 1)
+  {
+    fprintf(stderr, "Failed to choose an EGL config\n");
+    return false;
+  }
+
+  const EGLint ctxattr[] =
+  {
+    EGL_CONTEXT_CLIENT_VERSION, 2,
+    EGL_NONE
+  };
+
+  eglContext = eglCreateContext(eglDisplay, config, EGL_NO_CONTEXT, ctxattr);
+  if (eglContext == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglContext))
+  {
+    fprintf(stderr, "Failed to create the EGL context (0x%x)\n", eglGetError());
+    return false;
+  }
+
+  eglCreateImageKHR  = (PFNEGLCREATEIMAGEKHRPROC )eglGetProcAddress("eglCreateImageKHR" );
+  eglDestroyImageKHR = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
+  glEGLImageTargetTexture2DOES = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)
+    eglGetProcAddress("glEGLImageTargetTexture2DOES");
+  if (!eglCreateImageKHR || !eglDestroyImageKHR || !glEGLImageTargetTexture2DOES)
+  {
+    fprintf(stderr, "The EGL image functions are not available\n");
+    return false;
+  }
+
+  printf("GPU: %s\n", glGetString(GL_RENDERER));
+  return true;
+}
+
+static void freeEGL(void)
+{
+  if (eglDisplay == EGL_NO_DISPLAY)
+    return;
+
+  eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  if (eglContext != EGL_NO_CONTEXT)
+    eglDestroyContext(eglDisplay, eglContext);
+  eglTerminate(eglDisplay);
+  eglDisplay = EGL_NO_DISPLAY;
+}
+
+// the import of a frame sized DMA-BUF as the client does it, then the cost of
+// the GPU first reading from it
+static bool testEGLImport(void)
+{
+  const size_t size = (size_t)IMPORT_WIDTH * IMPORT_HEIGHT * 4;
+  if (size > bench.devSize)
+  {
+    fprintf(stderr, "The device is too small for the import test\n");
+    return false;
+  }
+
+  int fd = createDMABuf(size);
+  if (fd < 0)
+    return false;
+
+  GLuint fbo;
+  glGenFramebuffers(1, &fbo);
+
+  double importTimes[bench.iterations], readTimes[bench.iterations];
+  bool ret = true;
+  for(int i = 0; i < bench.iterations; ++i)
+  {
+    const EGLint attribs[] =
+    {
+      EGL_WIDTH                    , IMPORT_WIDTH,
+      EGL_HEIGHT                   , IMPORT_HEIGHT,
+      EGL_LINUX_DRM_FOURCC_EXT     , DRM_FORMAT_ARGB8888,
+      EGL_DMA_BUF_PLANE0_FD_EXT    , fd,
+      EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
+      EGL_DMA_BUF_PLANE0_PITCH_EXT , IMPORT_WIDTH * 4,
+      EGL_NONE                     , EGL_NONE
+    };
+
+    uint64_t start = nanotime();
+    EGLImageKHR image = eglCreateImageKHR(eglDisplay, EGL_NO_CONTEXT,
+        EGL_LINUX_DMA_BUF_EXT, (EGLClientBuffer)NULL, attribs);
+    if (image == EGL_NO_IMAGE_KHR)
+    {
+      fprintf(stderr, "eglCreateImageKHR failed (0x%x)\n", eglGetError());
+      ret = false;
+      break;
+    }
+
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+    glFinish();
+    importTimes[i] = (nanotime() - start) / 1000.0;
+
+    // reading a pixel back makes the GPU fetch from the buffer
+    uint8_t pixel[4];
+    start = nanotime();
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+        tex, 0);
+    glReadPixels(IMPORT_WIDTH / 2, IMPORT_HEIGHT / 2, 1, 1, GL_RGBA,
+        GL_UNSIGNED_BYTE, pixel);
+    readTimes[i] = (nanotime() - start) / 1000.0;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glDeleteTextures(1, &tex);
+    eglDestroyImageKHR(eglDisplay, image);
+  }
+
+  glDeleteFramebuffers(1, &fbo);
+  close(fd);
+
+  if (ret)
+  {
+    report("egl_import"    , size, median(importTimes, bench.iterations), "us");
+    report("egl_first_read", size, median(readTimes  , bench.iterations), "us");
+  }
+  return ret;
+}
+#endif
+
+static bool runMode(void)
+{
+  if (!testMapping("device", bench.fd, bench.size))
+    return false;
+
+  void * mem = mapFd(bench.fd, bench.size, NULL);
+  if (!mem)
+    return false;
+
+  if (bench.perCPU)
+  {
+    cpu_set_t all;
+    if (sched_getaffinity(0, sizeof(all), &all) != 0)
+    {
+      perror("sched_getaffinity");
+      munmap(mem, bench.size);
+      return false;
+    }
+
+    for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+      if (!CPU_ISSET(cpu, &all))
+        continue;
+
+      cpu_set_t one;
+      CPU_ZERO(&one);
+      CPU_SET(cpu, &one);
+      if (sched_setaffinity(0, sizeof(one), &one) != 0)
+        continue;
+
+      bench.cpu = cpu;
+      testBandwidth(mem, bench.size, bench.write);
+    }
+
+    sched_setaffinity(0, sizeof(all), &all);
+    bench.cpu = -1;
+  }
+  else
+    testBandwidth(mem, bench.size, bench.write);
+
+  munmap(mem, bench.size);
+
+  if (!testDMABuf(bench.size))
+    return false;
+
+#ifdef KVMFR_BENCH_EGL
+  if (bench.egl && !testEGLImport())
+    return false;
+#endif
+
+  return true;
+}
+
+static void printSystem(void)
+{
+  struct utsname uts;
+  if (uname(&uts) == 0)
+    printf("Kernel: %s %s\n", uts.release, uts.machine);
+
+  FILE * fp = fopen("/proc/cpuinfo", "r");
+  if (fp)
+  {
+    char line[256];
+    while(fgets(line, sizeof(line), fp))
+      if (strncmp(line, "model name", 10) == 0)
+      {
+        const char * name = strchr(line, ':');
+        if (name)
+          printf("CPU   :%s", name + 1);
+        break;
+      }
+    fclose(fp);
+  }
+
+  printf("Device: %s, %zu MiB, testing %zu MiB\n", bench.device,
+      bench.devSize / 1024 / 1024, bench.size / 1024 / 1024);
+}
+
+static void usage(const char * name)
+{
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "  -d <dev>   the kvmfr device (default /dev/kvmfr0)\n"
+    "  -s <MiB>   the size to test (default 256, limited to the device)\n"
+    "  -i <n>     iterations of each test (default 10)\n"
+    "  -m         test every cache_mode, needs write access to\n"
+    "             " CACHE_MODE_PARAM "\n"
+    "  -c         measure the bandwidth on each CPU\n"
+    "  -w         also measure writes, this overwrites the shared memory\n"
+#ifdef KVMFR_BENCH_EGL
+    "  -e         measure the import of a DMA-BUF into a GPU texture\n"
+#endif
+    "  -o <file>  write the results as CSV\n",
+    name);
+}
+
+int main(int argc, char * argv[])
+{
+  int opt;
+  while((opt = getopt(argc, argv, "d:s:i:mcweo:h")) != -1)
+    switch(opt)
+    {
+      case 'd': bench.device     = optarg; break;
+      case 's': bench.size       = strtoull(optarg, NULL, 10) * 1024 * 1024; break;
+      case 'i': bench.iterations = atoi(optarg); break;
+      case 'm': bench.allModes   = true; break;
+      case 'c': bench.perCPU     = true; break;
+      case 'w': bench.write      = true; break;
+#ifdef KVMFR_BENCH_EGL
+      case 'e': bench.egl        = true; break;
+#endif
+      case 'o':
+        if (!(bench.csv = fopen(optarg, "w")))
+        {
+          perror("fopen");
+          return -1;
+        }
+        fprintf(bench.csv, "test,cache_mode,cpu,bytes,value,unit\n");
+        break;
+
+      default:
+        usage(argv[0]);
+        return -1;
+    }
+
+  if (bench.iterations < 1 || bench.size == 0)
+  {
+    usage(argv[0]);
+    return -1;
+  }
+
+  bench.fd = open(bench.device, O_RDWR);
+  if (bench.fd < 0)
+  {
+    perror("open");
+    return -1;
+  }
+
+  bench.devSize = ioctl(bench.fd, KVMFR_DMABUF_GETSIZE, 0);
+  if (bench.size > bench.devSize)
+    bench.size = bench.devSize;
+  bench.size &= ~(size_t)(PAGE_SIZE_4K - 1);
+
+  bench.buffer = malloc(bench.size);
+  if (!bench.buffer)
+  {
+    fprintf(stderr, "Out of memory\n");
+    close(bench.fd);
+    return -1;
+  }
+  // fault the destination in so it is not part of the first copy
+  memset(bench.buffer, 0, bench.size);
+
+  bench.mode = readCacheMode();
+  printSystem();
+
+#ifdef KVMFR_BENCH_EGL
+  if (bench.egl && !initEGL())
+    bench.egl = false;
+#endif
+
+  int ret = 0;
+  if (bench.allModes)
+  {
+    const int restore = bench.mode;
+    for(int mode = 0; mode < 3 && ret == 0; ++mode)
+      if (!setCacheMode(mode) || !runMode())
+        ret = -1;
+    setCacheMode(restore);
+  }
+  else if (!runMode())
+    ret = -1;
+
+#ifdef KVMFR_BENCH_EGL
+  freeEGL();
+#endif
+
+  free(bench.buffer);
+  if (bench.csv)
+    fclose(bench.csv);
+  close(bench.fd);
+  return ret;
+}
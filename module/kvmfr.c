@@ -28,6 +28,13 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <linux/dma-buf.h>
 #include <linux/highmem.h>
 #include <linux/version.h>
+#include <linux/interrupt.h>
+#include <linux/eventfd.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
 
 #include <asm/io.h>
 
@@ -37,26 +44,66 @@ DEFINE_MUTEX(minor_lock);
 DEFINE_IDR(kvmfr_idr);
 
 #define KVMFR_UIO_NAME    "KVMFR"
-#define KVMFR_UIO_VER     "0.0.5"
+#define KVMFR_UIO_VER     "0.0.7"
 #define KVMFR_DEV_NAME    "kvmfr"
 #define KVMFR_MAX_DEVICES 10
+#define KVMFR_MAX_IRQS    8
+
+enum kvmfr_cache_mode
+{
+  KVMFR_CACHE_CACHED,
+  KVMFR_CACHE_WRITECOMBINED,
+  KVMFR_CACHE_UNCACHED
+};
+
+static int cache_mode = KVMFR_CACHE_CACHED;
+// read on each mmap so a change applies to the mappings made after it
+module_param(cache_mode, int, 0644);
+MODULE_PARM_DESC(cache_mode, "Caching of mmap'd memory (0 = cached, 1 = write combined, 2 = uncached)");
+
+/* devices backed by memory of the module instead of an ivshmem BAR, QEMU is
+ * given the device as the memory backend of its ivshmem device so a client
+ * on the same host can import the frames directly */
+static int static_size_mb[KVMFR_MAX_DEVICES];
+static int static_count;
+module_param_array(static_size_mb, int, &static_count, 0);
+MODULE_PARM_DESC(static_size_mb, "Comma separated sizes in MiB of the static devices to create, each a power of two");
+
+enum kvmfr_type
+{
+  KVMFR_TYPE_PCI,
+  KVMFR_TYPE_STATIC
+};
+
+struct kvmfr_dev;
 
 struct kvmfr_info
 {
-  int             major;
-  struct class  * pClass;
+  int                major;
+  struct class     * pClass;
+  int                staticCount;
+  struct kvmfr_dev * staticDevs[KVMFR_MAX_DEVICES];
 };
 
 static struct kvmfr_info *kvmfr;
 
+struct kvmfr_irq
+{
+  spinlock_t           lock;
+  struct eventfd_ctx * ctx;
+};
+
 struct kvmfr_dev
 {
+  enum kvmfr_type      type;
   unsigned long        size;
   int                  minor;
   dev_t                devNo;
   struct device      * pDev;
   struct dev_pagemap   pgmap;
   void               * addr;
+  int                  irqCount;
+  struct kvmfr_irq     irqs[KVMFR_MAX_IRQS];
 };
 
 struct kvmfrbuf
@@ -64,27 +111,90 @@ struct kvmfrbuf
   struct kvmfr_dev    * kdev;
   pgoff_t               pagecount;
   struct page        ** pages;
+
+  // the importers, their mappings are synced around CPU access
+  struct mutex          lock;
+  struct list_head      attachments;
+};
+
+struct kvmfrbuf_attachment
+{
+  struct device         * dev;
+  struct sg_table       * sg;
+  enum dma_data_direction direction;
+  struct list_head        list;
 };
 
-static vm_fault_t kvmfr_vm_fault(struct vm_fault *vmf)
+/* map the entire range up front as the memory is physically contiguous,
+ * faulting in a page at a time costs tens of thousands of faults on first
+ * touch of a large BAR */
+static int kvmfr_mmap_range(struct vm_area_struct * vma, unsigned long pfn,
+    unsigned long pagecount)
 {
-  struct vm_area_struct *vma = vmf->vma;
-  struct kvmfrbuf *kbuf = (struct kvmfrbuf *)vma->vm_private_data;
+  const unsigned long size = vma->vm_end - vma->vm_start;
 
-  vmf->page = kbuf->pages[vmf->pgoff];
-  get_page(vmf->page);
+  if ((vma->vm_flags & (VM_SHARED | VM_MAYSHARE)) == 0)
+    return -EINVAL;
+
+  if (vma->vm_pgoff >= pagecount ||
+      (size >> PAGE_SHIFT) > pagecount - vma->vm_pgoff)
+    return -EINVAL;
+
+  switch(cache_mode)
+  {
+    case KVMFR_CACHE_WRITECOMBINED:
+      vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+      break;
+
+    case KVMFR_CACHE_UNCACHED:
+      vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+      break;
+
+    default:
+      break;
+  }
+
+  return remap_pfn_range(vma, vma->vm_start, pfn + vma->vm_pgoff, size,
+      vma->vm_page_prot);
+}
+
+static int attach_kvmfrbuf(struct dma_buf * buf,
+    struct dma_buf_attachment * at)
+{
+  struct kvmfrbuf * kbuf = (struct kvmfrbuf *)buf->priv;
+  struct kvmfrbuf_attachment * a;
+
+  a = kzalloc(sizeof(*a), GFP_KERNEL);
+  if (!a)
+    return -ENOMEM;
+
+  a->dev = at->dev;
+  INIT_LIST_HEAD(&a->list);
+  at->priv = a;
+
+  mutex_lock(&kbuf->lock);
+  list_add(&a->list, &kbuf->attachments);
+  mutex_unlock(&kbuf->lock);
   return 0;
 }
 
-static const struct vm_operations_struct kvmfr_vm_ops =
+static void detach_kvmfrbuf(struct dma_buf * buf,
+    struct dma_buf_attachment * at)
 {
-  .fault = kvmfr_vm_fault
-};
+  struct kvmfrbuf * kbuf = (struct kvmfrbuf *)buf->priv;
+  struct kvmfrbuf_attachment * a = at->priv;
+
+  mutex_lock(&kbuf->lock);
+  list_del(&a->list);
+  mutex_unlock(&kbuf->lock);
+  kfree(a);
+}
 
 static struct sg_table * map_kvmfrbuf(struct dma_buf_attachment *at,
     enum dma_data_direction direction)
 {
   struct kvmfrbuf *kbuf = at->dmabuf->priv;
+  struct kvmfrbuf_attachment * a = at->priv;
   struct sg_table *sg;
   int ret;
 
@@ -103,6 +213,10 @@ static struct sg_table * map_kvmfrbuf(struct dma_buf_attachment *at,
     goto err;
   }
 
+  mutex_lock(&kbuf->lock);
+  a->sg        = sg;
+  a->direction = direction;
+  mutex_unlock(&kbuf->lock);
   return sg;
 
 err:
@@ -113,7 +227,14 @@ err:
 
 static void unmap_kvmfrbuf(struct dma_buf_attachment * at, struct sg_table * sg, enum dma_data_direction direction)
 {
-  dma_unmap_sg(at->dev, sg->sgl, sg->nents, direction);
+  struct kvmfrbuf * kbuf = at->dmabuf->priv;
+  struct kvmfrbuf_attachment * a = at->priv;
+
+  mutex_lock(&kbuf->lock);
+  a->sg = NULL;
+  mutex_unlock(&kbuf->lock);
+
+  dma_unmap_sg(at->dev, sg->sgl, sg->orig_nents, direction);
   sg_free_table(sg);
   kfree(sg);
 }
@@ -121,25 +242,73 @@ static void unmap_kvmfrbuf(struct dma_buf_attachment * at, struct sg_table * sg,
 static void release_kvmfrbuf(struct dma_buf * buf)
 {
   struct kvmfrbuf *kbuf = (struct kvmfrbuf *)buf->priv;
+  mutex_destroy(&kbuf->lock);
   kfree(kbuf->pages);
   kfree(kbuf);
 }
 
+/* DMA_BUF_IOCTL_SYNC, the dma-buf core has already waited on the fences in
+ * the reservation object that the importers attached, what is left is to
+ * make the CPU and each mapping of the importers agree, which is a no-op on
+ * coherent hardware but not behind an IOMMU with bounce buffers */
+static int begin_cpu_access_kvmfrbuf(struct dma_buf * buf,
+    enum dma_data_direction direction)
+{
+  struct kvmfrbuf * kbuf = (struct kvmfrbuf *)buf->priv;
+  struct kvmfrbuf_attachment * a;
+
+  mutex_lock(&kbuf->lock);
+  list_for_each_entry(a, &kbuf->attachments, list)
+    if (a->sg)
+      dma_sync_sg_for_cpu(a->dev, a->sg->sgl, a->sg->orig_nents,
+          a->direction);
+  mutex_unlock(&kbuf->lock);
+  return 0;
+}
+
+static int end_cpu_access_kvmfrbuf(struct dma_buf * buf,
+    enum dma_data_direction direction)
+{
+  struct kvmfrbuf * kbuf = (struct kvmfrbuf *)buf->priv;
+  struct kvmfrbuf_attachment * a;
+
+  mutex_lock(&kbuf->lock);
+  list_for_each_entry(a, &kbuf->attachments, list)
+    if (a->sg)
+      dma_sync_sg_for_device(a->dev, a->sg->sgl, a->sg->orig_nents,
+          a->direction);
+  mutex_unlock(&kbuf->lock);
+  return 0;
+}
+
 static int mmap_kvmfrbuf(struct dma_buf * buf, struct vm_area_struct * vma)
 {
-  if ((vma->vm_flags & (VM_SHARED | VM_MAYSHARE)) == 0)
+  struct kvmfrbuf * kbuf = (struct kvmfrbuf *)buf->priv;
+  if (!kbuf->pagecount)
     return -EINVAL;
-  vma->vm_ops          = &kvmfr_vm_ops;
-  vma->vm_private_data = buf->priv;
-  return 0;
+
+  // static memory is ordinary kernel memory, it is not contiguous and is
+  // always cached
+  if (kbuf->kdev->type == KVMFR_TYPE_STATIC)
+  {
+    if ((vma->vm_flags & (VM_SHARED | VM_MAYSHARE)) == 0)
+      return -EINVAL;
+    return vm_map_pages(vma, kbuf->pages, kbuf->pagecount);
+  }
+
+  return kvmfr_mmap_range(vma, page_to_pfn(kbuf->pages[0]), kbuf->pagecount);
 }
 
 static const struct dma_buf_ops kvmfrbuf_ops =
 {
-  .map_dma_buf   = map_kvmfrbuf,
-  .unmap_dma_buf = unmap_kvmfrbuf,
-  .release       = release_kvmfrbuf,
-  .mmap          = mmap_kvmfrbuf
+  .attach           = attach_kvmfrbuf,
+  .detach           = detach_kvmfrbuf,
+  .map_dma_buf      = map_kvmfrbuf,
+  .unmap_dma_buf    = unmap_kvmfrbuf,
+  .begin_cpu_access = begin_cpu_access_kvmfrbuf,
+  .end_cpu_access   = end_cpu_access_kvmfrbuf,
+  .release          = release_kvmfrbuf,
+  .mmap             = mmap_kvmfrbuf
 };
 
 inline static unsigned long get_min_align(void)
@@ -180,6 +349,8 @@ static long kvmfr_dmabuf_create(struct kvmfr_dev * kdev, struct file * filp, uns
 
   kbuf->kdev      = kdev;
   kbuf->pagecount = create.size >> PAGE_SHIFT;
+  mutex_init(&kbuf->lock);
+  INIT_LIST_HEAD(&kbuf->attachments);
   kbuf->pages     = kmalloc_array(kbuf->pagecount, sizeof(*kbuf->pages), GFP_KERNEL);
   if (!kbuf->pages)
   {
@@ -190,7 +361,8 @@ static long kvmfr_dmabuf_create(struct kvmfr_dev * kdev, struct file * filp, uns
   p = ((u8*)kdev->addr) + create.offset;
   for(i = 0; i < kbuf->pagecount; ++i)
   {
-    kbuf->pages[i] = virt_to_page(p);
+    kbuf->pages[i] = kdev->type == KVMFR_TYPE_STATIC ?
+      vmalloc_to_page(p) : virt_to_page(p);
     p += PAGE_SIZE;
   }
 
@@ -215,6 +387,111 @@ err:
   return ret;
 }
 
+static irqreturn_t kvmfr_irq_handler(int irq, void * opaque)
+{
+  struct kvmfr_irq * kirq = (struct kvmfr_irq *)opaque;
+  unsigned long flags;
+
+  spin_lock_irqsave(&kirq->lock, flags);
+  if (kirq->ctx)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
+    eventfd_signal(kirq->ctx, 1);
+#else
+    eventfd_signal(kirq->ctx);
+#endif
+  spin_unlock_irqrestore(&kirq->lock, flags);
+
+  return IRQ_HANDLED;
+}
+
+static void kvmfr_irq_setctx(struct kvmfr_irq * kirq, struct eventfd_ctx * ctx)
+{
+  struct eventfd_ctx * old;
+  unsigned long flags;
+
+  spin_lock_irqsave(&kirq->lock, flags);
+  old       = kirq->ctx;
+  kirq->ctx = ctx;
+  spin_unlock_irqrestore(&kirq->lock, flags);
+
+  if (old)
+    eventfd_ctx_put(old);
+}
+
+static long kvmfr_set_irqfd(struct kvmfr_dev * kdev, unsigned long arg)
+{
+  struct kvmfr_irqfd   irqfd;
+  struct eventfd_ctx * ctx = NULL;
+
+  if (copy_from_user(&irqfd, (void __user *)arg, sizeof(irqfd)))
+    return -EFAULT;
+
+  if (irqfd.vector >= kdev->irqCount)
+    return -EINVAL;
+
+  if (irqfd.fd >= 0)
+  {
+    ctx = eventfd_ctx_fdget(irqfd.fd);
+    if (IS_ERR(ctx))
+      return PTR_ERR(ctx);
+  }
+
+  kvmfr_irq_setctx(&kdev->irqs[irqfd.vector], ctx);
+  return 0;
+}
+
+static int kvmfr_irq_init(struct pci_dev * dev, struct kvmfr_dev * kdev)
+{
+  int i, ret;
+
+  // ivshmem-plain has no interrupts, this is not an error
+  ret = pci_alloc_irq_vectors(dev, 1, KVMFR_MAX_IRQS, PCI_IRQ_MSIX);
+  if (ret < 0)
+  {
+    kdev->irqCount = 0;
+    return 0;
+  }
+
+  kdev->irqCount = ret;
+  for(i = 0; i < kdev->irqCount; ++i)
+  {
+    spin_lock_init(&kdev->irqs[i].lock);
+    kdev->irqs[i].ctx = NULL;
+
+    ret = request_irq(pci_irq_vector(dev, i), kvmfr_irq_handler, 0,
+        KVMFR_DEV_NAME, &kdev->irqs[i]);
+    if (ret)
+      goto err;
+  }
+
+  printk("kvmfr: %d doorbell vectors\n", kdev->irqCount);
+  return 0;
+
+err:
+  while(--i >= 0)
+    free_irq(pci_irq_vector(dev, i), &kdev->irqs[i]);
+  pci_free_irq_vectors(dev);
+  kdev->irqCount = 0;
+  return ret;
+}
+
+static void kvmfr_irq_free(struct pci_dev * dev, struct kvmfr_dev * kdev)
+{
+  int i;
+
+  if (!kdev->irqCount)
+    return;
+
+  for(i = 0; i < kdev->irqCount; ++i)
+  {
+    free_irq(pci_irq_vector(dev, i), &kdev->irqs[i]);
+    kvmfr_irq_setctx(&kdev->irqs[i], NULL);
+  }
+
+  pci_free_irq_vectors(dev);
+  kdev->irqCount = 0;
+}
+
 static long device_ioctl(struct file * filp, unsigned int ioctl, unsigned long arg)
 {
   struct kvmfr_dev * kdev;
@@ -234,6 +511,14 @@ static long device_ioctl(struct file * filp, unsigned int ioctl, unsigned long a
       ret = kdev->size;
       break;
 
+    case KVMFR_GET_IRQ_COUNT:
+      ret = kdev->irqCount;
+      break;
+
+    case KVMFR_SET_IRQFD:
+      ret = kvmfr_set_irqfd(kdev, arg);
+      break;
+
     default:
       return -ENOTTY;
   }
@@ -241,10 +526,30 @@ static long device_ioctl(struct file * filp, unsigned int ioctl, unsigned long a
   return ret;
 }
 
+static int device_mmap(struct file * filp, struct vm_area_struct * vma)
+{
+  struct kvmfr_dev * kdev;
+
+  kdev = (struct kvmfr_dev *)idr_find(&kvmfr_idr, iminor(filp->f_inode));
+  if (!kdev)
+    return -EINVAL;
+
+  if (kdev->type == KVMFR_TYPE_STATIC)
+  {
+    if ((vma->vm_flags & (VM_SHARED | VM_MAYSHARE)) == 0)
+      return -EINVAL;
+    return remap_vmalloc_range(vma, kdev->addr, vma->vm_pgoff);
+  }
+
+  return kvmfr_mmap_range(vma, page_to_pfn(virt_to_page(kdev->addr)),
+      kdev->size >> PAGE_SHIFT);
+}
+
 static struct file_operations fops =
 {
   .owner          = THIS_MODULE,
-  .unlocked_ioctl = device_ioctl
+  .unlocked_ioctl = device_ioctl,
+  .mmap           = device_mmap
 };
 
 static int kvmfr_pci_probe(struct pci_dev *dev, const struct pci_device_id *id)
@@ -273,7 +578,7 @@ static int kvmfr_pci_probe(struct pci_dev *dev, const struct pci_device_id *id)
   mutex_unlock(&minor_lock);
 
   kdev->devNo = MKDEV(kvmfr->major, kdev->minor);
-  kdev->pDev  = device_create(kvmfr->pClass, NULL, kdev->devNo, NULL, KVMFR_DEV_NAME "%d", kdev->minor);
+  kdev->pDev  = device_create(kvmfr->pClass, &dev->dev, kdev->devNo, NULL, KVMFR_DEV_NAME "%d", kdev->minor);
   if (IS_ERR(kdev->pDev))
     goto out_unminor;
 
@@ -296,9 +601,14 @@ static int kvmfr_pci_probe(struct pci_dev *dev, const struct pci_device_id *id)
   if (IS_ERR(kdev->addr))
     goto out_destroy;
 
+  if (kvmfr_irq_init(dev, kdev))
+    goto out_unmap;
+
   pci_set_drvdata(dev, kdev);
   return 0;
 
+out_unmap:
+  devm_memunmap_pages(&dev->dev, &kdev->pgmap);
 out_destroy:
   device_destroy(kvmfr->pClass, kdev->devNo);
 out_unminor:
@@ -318,6 +628,7 @@ static void kvmfr_pci_remove(struct pci_dev *dev)
 {
   struct kvmfr_dev *kdev = pci_get_drvdata(dev);
 
+  kvmfr_irq_free(dev, kdev);
   devm_memunmap_pages(&dev->dev, &kdev->pgmap);
   device_destroy(kvmfr->pClass, kdev->devNo);
 
@@ -331,6 +642,78 @@ static void kvmfr_pci_remove(struct pci_dev *dev)
   kfree(kdev);
 }
 
+static int kvmfr_static_create(int size_mb)
+{
+  struct kvmfr_dev *kdev;
+  int ret = -ENOMEM;
+
+  if (size_mb <= 0 || !is_power_of_2(size_mb))
+  {
+    printk("kvmfr: static device size of %d MiB is not a power of two\n", size_mb);
+    return -EINVAL;
+  }
+
+  kdev = kzalloc(sizeof(struct kvmfr_dev), GFP_KERNEL);
+  if (!kdev)
+    return -ENOMEM;
+
+  // vmalloc_user zeroes the memory and it is never swapped out
+  kdev->type = KVMFR_TYPE_STATIC;
+  kdev->size = (unsigned long)size_mb * 1024 * 1024;
+  kdev->addr = vmalloc_user(kdev->size);
+  if (!kdev->addr)
+    goto out_free;
+
+  mutex_lock(&minor_lock);
+  kdev->minor = idr_alloc(&kvmfr_idr, kdev, 0, KVMFR_MAX_DEVICES, GFP_KERNEL);
+  mutex_unlock(&minor_lock);
+  if (kdev->minor < 0)
+  {
+    ret = kdev->minor;
+    goto out_vfree;
+  }
+
+  kdev->devNo = MKDEV(kvmfr->major, kdev->minor);
+  kdev->pDev  = device_create(kvmfr->pClass, NULL, kdev->devNo, NULL, KVMFR_DEV_NAME "%d", kdev->minor);
+  if (IS_ERR(kdev->pDev))
+  {
+    ret = PTR_ERR(kdev->pDev);
+    goto out_unminor;
+  }
+
+  kvmfr->staticDevs[kvmfr->staticCount++] = kdev;
+  printk("kvmfr: created static device " KVMFR_DEV_NAME "%d of %d MiB\n", kdev->minor, size_mb);
+  return 0;
+
+out_unminor:
+  mutex_lock(&minor_lock);
+  idr_remove(&kvmfr_idr, kdev->minor);
+  mutex_unlock(&minor_lock);
+out_vfree:
+  vfree(kdev->addr);
+out_free:
+  kfree(kdev);
+  return ret;
+}
+
+static void kvmfr_static_free(struct kvmfr_dev * kdev)
+{
+  device_destroy(kvmfr->pClass, kdev->devNo);
+
+  mutex_lock(&minor_lock);
+  idr_remove(&kvmfr_idr, kdev->minor);
+  mutex_unlock(&minor_lock);
+
+  vfree(kdev->addr);
+  kfree(kdev);
+}
+
+static void kvmfr_static_free_all(void)
+{
+  while(kvmfr->staticCount > 0)
+    kvmfr_static_free(kvmfr->staticDevs[--kvmfr->staticCount]);
+}
+
 static struct pci_device_id kvmfr_pci_ids[] =
 {
   {
@@ -352,7 +735,7 @@ static struct pci_driver kvmfr_pci_driver =
 
 static int __init kvmfr_module_init(void)
 {
-  int ret;
+  int ret, i;
 
   kvmfr = kzalloc(sizeof(struct kvmfr_info), GFP_KERNEL);
   if (!kvmfr)
@@ -366,13 +749,20 @@ static int __init kvmfr_module_init(void)
   if (IS_ERR(kvmfr->pClass))
     goto out_unreg;
 
+  // the static devices come first so their numbers do not depend on the PCI
+  // devices that are present
+  for(i = 0; i < static_count; ++i)
+    if (kvmfr_static_create(static_size_mb[i]) < 0)
+      goto out_static_free;
+
   ret = pci_register_driver(&kvmfr_pci_driver);
   if (ret < 0)
-    goto out_class_destroy;
+    goto out_static_free;
 
   return 0;
 
-out_class_destroy:
+out_static_free:
+  kvmfr_static_free_all();
   class_destroy(kvmfr->pClass);
 out_unreg:
   unregister_chrdev(kvmfr->major, KVMFR_DEV_NAME);
@@ -386,6 +776,7 @@ out_free:
 static void __exit kvmfr_module_exit(void)
 {
   pci_unregister_driver(&kvmfr_pci_driver);
+  kvmfr_static_free_all();
   class_destroy(kvmfr->pClass);
   unregister_chrdev(kvmfr->major, KVMFR_DEV_NAME);
   kfree(kvmfr);
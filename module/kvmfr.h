@@ -12,7 +12,14 @@ struct kvmfr_dmabuf_create {
   __u64 size;
 };
 
+struct kvmfr_irqfd {
+  __u16 vector; // the doorbell vector
+  __s32 fd;     // the eventfd to signal, or -1 to unbind
+};
+
 #define KVMFR_DMABUF_GETSIZE _IO('u', 0x44)
 #define KVMFR_DMABUF_CREATE  _IOW('u', 0x42, struct kvmfr_dmabuf_create)
+#define KVMFR_GET_IRQ_COUNT  _IO('u', 0x45)
+#define KVMFR_SET_IRQFD      _IOW('u', 0x46, struct kvmfr_irqfd)
 
 #endif
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
 #include <sys/mman.h>
+#include <linux/dma-buf.h>
 
 #include "kvmfr.h"
 
@@ -43,7 +44,16 @@ int main()
     return -1;
   }
 
+  struct dma_buf_sync sync = { .flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW };
+  if (ioctl(dmaFd, DMA_BUF_IOCTL_SYNC, &sync) < 0)
+    perror("DMA_BUF_IOCTL_SYNC");
+
   memset(mem, 0xAA, create.size);
+
+  sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
+  if (ioctl(dmaFd, DMA_BUF_IOCTL_SYNC, &sync) < 0)
+    perror("DMA_BUF_IOCTL_SYNC");
+
   munmap(mem, create.size);
   close(fd);
   return 0;
@@ -1,7 +1,9 @@
 #define _GNU_SOURCE //needed for pthread_setname_np
 
 #include <obs/obs-module.h>
+#include <obs/obs-config.h>
 #include <obs/util/threading.h>
+#include <obs/util/platform.h>
 #include <obs/graphics/matrix4.h>
 
 #include <common/ivshmem.h>
@@ -13,6 +15,7 @@
 #include <unistd.h>
 #include <stdatomic.h>
 #include <GL/gl.h>
+#include <libdrm/drm_fourcc.h>
 
 typedef enum
 {
@@ -24,36 +27,100 @@ typedef enum
 }
 LGState;
 
+/* one more than the reader and the display can hold at once, so the reader
+ * always has a mapped texture to copy the next frame into */
+#define FRAME_TEXTURES 3
+
+/* the milliseconds the frame thread holds a DMA frame for the render, a
+ * source that is not shown is never drawn and releases them this way */
+#define DMA_HOLD_TIMEOUT 100
+
+typedef enum
+{
+  FRAME_FREE,     /* mapped, the reader may take it       */
+  FRAME_WRITING,  /* mapped, the reader is copying into it */
+  FRAME_READY,    /* mapped, holds the newest frame        */
+  FRAME_SHOWN,    /* unmapped, being rendered              */
+  FRAME_UNMAPPED  /* unmapped, could not be mapped again   */
+}
+FrameState;
+
+typedef struct
+{
+  gs_texture_t * texture;
+  uint8_t      * data;
+  uint32_t       linesize;
+  FrameState     state;
+}
+FrameTexture;
+
+/* a texture imported from the dma buffer of one of the frame queue buffers */
+typedef struct
+{
+  const KVMFRFrame * frame;
+  size_t             dataSize;
+  int                fd;
+  gs_texture_t     * texture;
+  uint32_t           hold;  /* the hold of the frame last published in it */
+}
+DMAFrame;
+
+/* a converted cursor shape, the host refers to them by KVMFRCursor.cacheID */
+typedef struct
+{
+  CursorType     type;
+  uint32_t       width, height;
+  uint32_t     * data;
+  size_t         dataSize;
+  bool           update;
+  gs_texture_t * texture;
+}
+CursorShape;
+
 typedef struct
 {
   obs_source_t    * context;
   LGState           state;
   char            * shmFile;
   uint32_t          formatVer;
+  bool              formatValid;
   uint32_t          width, height;
   FrameType         type;
   int               bpp;
+  enum gs_color_format gsFormat;
+  uint32_t          drmFormat;
+  bool              dmabuf, useDMA;
   struct IVSHMEM    shmDev;
   PLGMPClient       lgmp;
   PLGMPClientQueue  frameQueue, pointerQueue;
   gs_texture_t    * texture;
-  uint8_t         * texData;
-  uint32_t          linesize;
 
   pthread_t         frameThread, pointerThread;
-  os_sem_t        * frameSem;
+  pthread_mutex_t   frameLock;
+  FrameTexture      frames[FRAME_TEXTURES];
+  atomic_int        frameReady;
+  int               frameShown;
+  DMAFrame          dmaFrames[LGMP_Q_FRAME_LEN];
+  atomic_int        dmaReady;
+
+  /* the message of a DMA frame is held until it has been drawn as the host
+   * writes the next frame into the buffer once it is released */
+  atomic_uint       dmaHeld;
+  uint32_t          dmaHoldSerial;
+  uint32_t          dmaShown, dmaDrawn; /* graphics thread only */
 
   bool                 cursorMono;
   gs_texture_t       * cursorTex;
   struct gs_rect       cursorRect;
 
+  volatile KVMFRCursorPos * cursorPos;
+  uint32_t             cursorPosSerial;
   bool                 cursorVisible;
-  KVMFRCursor          cursor;
   os_sem_t           * cursorSem;
   atomic_uint          cursorVer;
   unsigned int         cursorCurVer;
-  uint32_t             cursorSize;
-  uint32_t           * cursorData;
+  CursorShape          cursorShapes[KVMFR_CURSOR_CACHE];
+  unsigned int         cursorCurrent;
 }
 LGPlugin;
 
@@ -68,13 +135,70 @@ static void * lgCreate(obs_data_t * settings, obs_source_t * context)
 {
   LGPlugin * this = bzalloc(sizeof(LGPlugin));
   this->context = context;
-  os_sem_init (&this->frameSem , 0);
+  pthread_mutex_init(&this->frameLock, NULL);
   os_sem_init (&this->cursorSem, 1);
+  atomic_store(&this->frameReady, -1);
+  this->frameShown = -1;
+  atomic_store(&this->dmaReady, -1);
+  atomic_store(&this->dmaHeld, 0);
+  for(int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+    this->dmaFrames[i].fd = -1;
   atomic_store(&this->cursorVer, 0);
   lgUpdate(this, settings);
   return this;
 }
 
+/* must be called inside the graphics context while holding frameLock */
+static void destroyFrameTextures(LGPlugin * this)
+{
+  for(int i = 0; i < FRAME_TEXTURES; ++i)
+  {
+    FrameTexture * f = &this->frames[i];
+    if (!f->texture)
+      continue;
+
+    if (f->state != FRAME_SHOWN && f->state != FRAME_UNMAPPED)
+      gs_texture_unmap(f->texture);
+
+    gs_texture_destroy(f->texture);
+    f->texture = NULL;
+    f->data    = NULL;
+  }
+
+  this->texture    = NULL;
+  this->frameShown = -1;
+  atomic_store(&this->frameReady, -1);
+}
+
+/* must be called inside the graphics context */
+static void destroyDMAFrames(LGPlugin * this)
+{
+  for(int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  {
+    DMAFrame * dma = &this->dmaFrames[i];
+    if (dma->texture)
+    {
+      if (this->texture == dma->texture)
+        this->texture = NULL;
+      gs_texture_destroy(dma->texture);
+      dma->texture = NULL;
+    }
+
+    if (dma->fd >= 0)
+    {
+      close(dma->fd);
+      dma->fd = -1;
+    }
+
+    dma->frame    = NULL;
+    dma->dataSize = 0;
+  }
+
+  atomic_store(&this->dmaReady, -1);
+  this->dmaShown = 0;
+  this->dmaDrawn = 0;
+}
+
 static void deinit(LGPlugin * this)
 {
   switch(this->state)
@@ -108,23 +232,26 @@ static void deinit(LGPlugin * this)
     this->shmFile = NULL;
   }
 
-  if (this->texture)
-  {
-    obs_enter_graphics();
-    gs_texture_destroy(this->texture);
-    gs_texture_unmap(this->texture);
-    obs_leave_graphics();
-    this->texture = NULL;
-  }
+  obs_enter_graphics();
+  pthread_mutex_lock(&this->frameLock);
+  destroyFrameTextures(this);
+  pthread_mutex_unlock(&this->frameLock);
+  destroyDMAFrames(this);
+  obs_leave_graphics();
+  this->formatValid = false;
 
-  if (this->cursorTex)
+  obs_enter_graphics();
+  for(int i = 0; i < KVMFR_CURSOR_CACHE; ++i)
   {
-    obs_enter_graphics();
-    gs_texture_destroy(this->cursorTex);
-    gs_texture_unmap(this->cursorTex);
-    obs_leave_graphics();
-    this->cursorTex = NULL;
+    CursorShape * shape = &this->cursorShapes[i];
+    if (shape->texture)
+      gs_texture_destroy(shape->texture);
+    bfree(shape->data);
+    memset(shape, 0, sizeof(*shape));
   }
+  obs_leave_graphics();
+  this->cursorTex     = NULL;
+  this->cursorCurrent = 0;
 
   this->state = STATE_STOPPED;
 }
@@ -133,7 +260,7 @@ static void lgDestroy(void * data)
 {
   LGPlugin * this = (LGPlugin *)data;
   deinit(this);
-  os_sem_destroy(this->frameSem );
+  pthread_mutex_destroy(&this->frameLock);
   os_sem_destroy(this->cursorSem);
   bfree(this);
 }
@@ -141,6 +268,7 @@ static void lgDestroy(void * data)
 static void lgGetDefaults(obs_data_t * defaults)
 {
   obs_data_set_default_string(defaults, "shmFile", "/dev/shm/looking-glass");
+  obs_data_set_default_bool  (defaults, "dmabuf" , true);
 }
 
 static obs_properties_t * lgGetProperties(void * data)
@@ -148,39 +276,335 @@ static obs_properties_t * lgGetProperties(void * data)
   obs_properties_t * props = obs_properties_create();
 
   obs_properties_add_text(props, "shmFile", obs_module_text("SHM File"), OBS_TEXT_DEFAULT);
+  obs_properties_add_bool(props, "dmabuf" , obs_module_text("Use DMA-BUF import (kvmfr only)"));
 
   return props;
 }
 
+static bool setupFrameTextures(LGPlugin * this, const KVMFRFrame * frame)
+{
+  enum gs_color_format format;
+  uint32_t drmFormat;
+  int bpp = 4;
+  switch(frame->type)
+  {
+    case FRAME_TYPE_BGRA:
+      format    = GS_BGRA;
+      drmFormat = DRM_FORMAT_ARGB8888;
+      break;
+
+    case FRAME_TYPE_RGBA:
+      format    = GS_RGBA;
+      drmFormat = DRM_FORMAT_ABGR8888;
+      break;
+
+    case FRAME_TYPE_RGBA10:
+      format    = GS_R10G10B10A2;
+      drmFormat = DRM_FORMAT_BGRA1010102;
+      break;
+
+    case FRAME_TYPE_RGBA16F:
+      bpp       = 8;
+      format    = GS_RGBA16F;
+      drmFormat = DRM_FORMAT_ABGR16161616F;
+      break;
+
+    default:
+      printf("invalid type %d\n", frame->type);
+      return false;
+  }
+
+  /* the render runs inside the graphics context, so holding it here keeps
+   * the textures from being destroyed while they are drawn */
+  obs_enter_graphics();
+  pthread_mutex_lock(&this->frameLock);
+  destroyFrameTextures(this);
+  destroyDMAFrames(this);
+
+  /* imported frames need no copy textures */
+  bool ok = true;
+  for(int i = 0; i < FRAME_TEXTURES && !this->useDMA; ++i)
+  {
+    FrameTexture * f = &this->frames[i];
+    f->texture = gs_texture_create(
+        frame->width, frame->height, format, 1, NULL, GS_DYNAMIC);
+
+    if (!f->texture)
+    {
+      printf("create texture failed\n");
+      ok = false;
+      break;
+    }
+
+    if (!gs_texture_map(f->texture, &f->data, &f->linesize))
+    {
+      printf("map texture failed\n");
+      f->state = FRAME_UNMAPPED;
+      ok = false;
+      break;
+    }
+
+    f->state = FRAME_FREE;
+  }
+
+  if (!ok)
+    destroyFrameTextures(this);
+
+  pthread_mutex_unlock(&this->frameLock);
+  obs_leave_graphics();
+
+  if (!ok)
+    return false;
+
+  this->formatVer = frame->formatVer;
+  this->width     = frame->width;
+  this->height    = frame->height;
+  this->type      = frame->type;
+  this->bpp       = bpp;
+  this->gsFormat  = format;
+  this->drmFormat = drmFormat;
+  this->formatValid = true;
+  return true;
+}
+
+/* find or import the dma buffer of the frame, the buffers are reused by the
+ * host so each one is only imported once */
+static DMAFrame * getDMAFrame(LGPlugin * this, const LGMPMessage * msg)
+{
+  const KVMFRFrame * frame = (const KVMFRFrame *)msg->mem;
+  const size_t dataSize = (size_t)frame->height * frame->pitch;
+
+  DMAFrame * dma = NULL;
+  for(int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+    if (this->dmaFrames[i].frame == frame)
+    {
+      dma = &this->dmaFrames[i];
+      if (dma->texture && dma->dataSize >= dataSize)
+        return dma;
+      break;
+    }
+
+  if (!dma)
+    for(int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+      if (!this->dmaFrames[i].frame)
+      {
+        dma = &this->dmaFrames[i];
+        break;
+      }
+
+  if (!dma)
+  {
+    printf("Too many dma buffers\n");
+    return NULL;
+  }
+
+  obs_enter_graphics();
+  if (dma->texture)
+  {
+    if (this->texture == dma->texture)
+      this->texture = NULL;
+    gs_texture_destroy(dma->texture);
+    dma->texture = NULL;
+  }
+  obs_leave_graphics();
+
+  if (dma->fd >= 0)
+    close(dma->fd);
+
+  const uintptr_t pos    = (uintptr_t)msg->mem - (uintptr_t)this->shmDev.mem;
+  const uintptr_t offset = (uintptr_t)frame->offset + FrameBufferStructSize;
+
+  dma->frame    = frame;
+  dma->dataSize = dataSize;
+  dma->fd       = ivshmemGetDMABuf(&this->shmDev, pos + offset, dataSize);
+  if (dma->fd < 0)
+  {
+    printf("Failed to get the DMA buffer for the frame\n");
+    return NULL;
+  }
+
+#if LIBOBS_API_MAJOR_VER >= 27
+  const uint32_t stride      = frame->pitch;
+  const uint32_t planeOffset = 0;
+
+  obs_enter_graphics();
+  dma->texture = gs_texture_create_from_dmabuf(frame->width, frame->height,
+      this->drmFormat, this->gsFormat, 1, &dma->fd, &stride, &planeOffset,
+      NULL);
+  obs_leave_graphics();
+#endif
+
+  if (!dma->texture)
+  {
+    printf("Failed to import the DMA buffer\n");
+    return NULL;
+  }
+
+  return dma;
+}
+
+static FrameTexture * acquireFrame(LGPlugin * this)
+{
+  FrameTexture * f = NULL;
+  pthread_mutex_lock(&this->frameLock);
+  for(int i = 0; i < FRAME_TEXTURES; ++i)
+    if (this->frames[i].state == FRAME_FREE)
+    {
+      f = &this->frames[i];
+      break;
+    }
+
+  /* only if a texture failed to map again, overwrite the unshown frame */
+  const int ready = atomic_load(&this->frameReady);
+  if (!f && ready >= 0)
+  {
+    f = &this->frames[ready];
+    atomic_store(&this->frameReady, -1);
+  }
+
+  if (f)
+    f->state = FRAME_WRITING;
+  pthread_mutex_unlock(&this->frameLock);
+  return f;
+}
+
+static void publishFrame(LGPlugin * this, FrameTexture * f)
+{
+  pthread_mutex_lock(&this->frameLock);
+
+  /* an unshown older frame is dropped in favour of this one */
+  const int ready = atomic_load(&this->frameReady);
+  if (ready >= 0)
+    this->frames[ready].state = FRAME_FREE;
+
+  f->state = FRAME_READY;
+  atomic_store(&this->frameReady, (int)(f - this->frames));
+  pthread_mutex_unlock(&this->frameLock);
+}
+
+/* wait for the render to draw the held frame, or for the timeout */
+static void waitDMARelease(LGPlugin * this, uint32_t hold)
+{
+  const uint64_t timeout = os_gettime_ns() + DMA_HOLD_TIMEOUT * 1000000ULL;
+  while(atomic_load(&this->dmaHeld) == hold &&
+      this->state == STATE_RUNNING && os_gettime_ns() < timeout)
+    usleep(1000);
+
+  atomic_compare_exchange_strong(&this->dmaHeld, &hold, 0);
+}
+
 static void * frameThread(void * data)
 {
   LGPlugin * this = (LGPlugin *)data;
 
-  if (lgmpClientSubscribe(this->lgmp, LGMP_Q_FRAME, &this->frameQueue) != LGMP_OK)
+  if (lgmpClientSubscribe(this->lgmp, LGMP_Q_FRAME_AUX, &this->frameQueue) != LGMP_OK)
   {
     this->state = STATE_STOPPING;
     return NULL;
   }
 
   this->state = STATE_RUNNING;
-  os_sem_post(this->frameSem);
 
   while(this->state == STATE_RUNNING)
   {
     LGMP_STATUS status;
+    LGMPMessage msg;
 
-    os_sem_wait(this->frameSem);
     if ((status = lgmpClientAdvanceToLast(this->frameQueue)) != LGMP_OK)
     {
       if (status != LGMP_ERR_QUEUE_EMPTY)
       {
-        os_sem_post(this->frameSem);
         printf("lgmpClientAdvanceToLast: %s\n", lgmpStatusString(status));
         break;
       }
     }
-    os_sem_post(this->frameSem);
-    usleep(1000);
+
+    if ((status = lgmpClientProcess(this->frameQueue, &msg)) != LGMP_OK)
+    {
+      if (status != LGMP_ERR_QUEUE_EMPTY)
+      {
+        printf("lgmpClientProcess: %s\n", lgmpStatusString(status));
+        break;
+      }
+
+      usleep(1000);
+      continue;
+    }
+
+    KVMFRFrame  * frame = (KVMFRFrame *)msg.mem;
+    FrameBuffer * fb    = (FrameBuffer *)(((uint8_t*)frame) + frame->offset);
+    if (!this->formatValid || this->formatVer != frame->formatVer)
+      if (!setupFrameTextures(this, frame))
+      {
+        lgmpClientMessageDone(this->frameQueue);
+        continue;
+      }
+
+    if (this->useDMA)
+    {
+      DMAFrame * dma = getDMAFrame(this, &msg);
+      if (dma)
+      {
+        /* the texture is of the live buffer, wait for the host to finish
+         * writing it before it is shown and drop it if it never does */
+        if (!framebuffer_wait(fb, dma->dataSize))
+        {
+          lgmpClientMessageDone(this->frameQueue);
+          continue;
+        }
+
+        /* zero is never a hold so it can mean nothing is held */
+        if (++this->dmaHoldSerial == 0)
+          ++this->dmaHoldSerial;
+        const uint32_t hold = this->dmaHoldSerial;
+
+        dma->hold = hold;
+        atomic_store(&this->dmaHeld, hold);
+        atomic_store(&this->dmaReady, (int)(dma - this->dmaFrames));
+
+        waitDMARelease(this, hold);
+        lgmpClientMessageDone(this->frameQueue);
+        continue;
+      }
+
+      printf("Falling back to copying the frames\n");
+      this->useDMA = false;
+      if (!setupFrameTextures(this, frame))
+      {
+        lgmpClientMessageDone(this->frameQueue);
+        continue;
+      }
+    }
+
+    FrameTexture * f = acquireFrame(this);
+    if (!f)
+    {
+      lgmpClientMessageDone(this->frameQueue);
+      continue;
+    }
+
+    const bool complete = framebuffer_read(
+        fb,
+        f->data,          // dst
+        f->linesize,      // dstpitch
+        frame->height,    // height
+        frame->width,     // width
+        this->bpp,        // bpp
+        frame->pitch      // linepitch
+    );
+
+    lgmpClientMessageDone(this->frameQueue);
+
+    /* the host never finished the frame, drop it */
+    if (!complete)
+    {
+      pthread_mutex_lock(&this->frameLock);
+      f->state = FRAME_FREE;
+      pthread_mutex_unlock(&this->frameLock);
+      continue;
+    }
+
+    publishFrame(this, f);
   }
 
   lgmpClientUnsubscribe(&this->frameQueue);
@@ -188,14 +612,90 @@ static void * frameThread(void * data)
   return NULL;
 }
 
-inline static void allocCursorData(LGPlugin * this, const unsigned int size)
+/* convert the shape into tightly packed 32bpp rows for the texture */
+static bool setCursorShape(CursorShape * shape, const KVMFRCursor * cursor)
+{
+  const uint8_t * const data = (const uint8_t *)(cursor + 1);
+  const size_t size = (size_t)cursor->width * cursor->height * sizeof(uint32_t);
+
+  if (shape->dataSize < size)
+  {
+    bfree(shape->data);
+    shape->data     = bmalloc(size);
+    shape->dataSize = size;
+  }
+
+  switch(cursor->type)
+  {
+    case CURSOR_TYPE_MASKED_COLOR:
+      for(int y = 0; y < cursor->height; ++y)
+      {
+        const uint32_t * s = (const uint32_t *)(data + cursor->pitch * y);
+        uint32_t       * d = shape->data + cursor->width * y;
+        for(int x = 0; x < cursor->width; ++x)
+          d[x] = (s[x] & ~0xFF000000) | (s[x] & 0xFF000000 ? 0x0 : 0xFF000000);
+      }
+      break;
+
+    case CURSOR_TYPE_COLOR:
+      for(int y = 0; y < cursor->height; ++y)
+        memcpy(shape->data + cursor->width * y, data + cursor->pitch * y,
+            cursor->width * sizeof(uint32_t));
+      break;
+
+    case CURSOR_TYPE_MONOCHROME:
+    {
+      const int hheight = cursor->height / 2;
+      uint32_t * d = shape->data;
+      for(int y = 0; y < hheight; ++y)
+        for(int x = 0; x < cursor->width; ++x)
+        {
+          const uint8_t  * srcAnd  = data   + (cursor->pitch * y) + (x / 8);
+          const uint8_t  * srcXor  = srcAnd + cursor->pitch * hheight;
+          const uint8_t    mask    = 0x80 >> (x % 8);
+          const uint32_t   andMask = (*srcAnd & mask) ? 0xFFFFFFFF : 0xFF000000;
+          const uint32_t   xorMask = (*srcXor & mask) ? 0x00FFFFFF : 0x00000000;
+
+          d[y * cursor->width + x                          ] = andMask;
+          d[y * cursor->width + x + cursor->width * hheight] = xorMask;
+        }
+      break;
+    }
+
+    default:
+      printf("Invalid cursor type\n");
+      return false;
+  }
+
+  shape->type   = cursor->type;
+  shape->width  = cursor->width;
+  shape->height = cursor->height;
+  shape->update = true;
+  return true;
+}
+
+/* must be called inside the graphics context, the texture is only recreated
+ * if the shape no longer fits it */
+static void updateCursorTexture(CursorShape * shape)
 {
-  if (this->cursorSize >= size)
+  const enum gs_color_format format =
+    shape->type == CURSOR_TYPE_MONOCHROME ? GS_RGBA : GS_BGRA;
+
+  if (shape->texture &&
+      gs_texture_get_width       (shape->texture) == shape->width  &&
+      gs_texture_get_height      (shape->texture) == shape->height &&
+      gs_texture_get_color_format(shape->texture) == format)
+  {
+    gs_texture_set_image(shape->texture, (const uint8_t *)shape->data,
+        shape->width * sizeof(uint32_t), false);
     return;
+  }
 
-  bfree(this->cursorData);
-  this->cursorSize = size;
-  this->cursorData = bmalloc(size);
+  if (shape->texture)
+    gs_texture_destroy(shape->texture);
+
+  shape->texture = gs_texture_create(shape->width, shape->height, format, 1,
+      (const uint8_t **)&shape->data, GS_DYNAMIC);
 }
 
 static void * pointerThread(void * data)
@@ -226,98 +726,73 @@ static void * pointerThread(void * data)
     }
 
     const KVMFRCursor * const cursor = (const KVMFRCursor * const)msg.mem;
-    this->cursorVisible =
-      msg.udata & CURSOR_FLAG_VISIBLE;
-
     if (msg.udata & CURSOR_FLAG_SHAPE)
     {
-      os_sem_wait(this->cursorSem);
-      const uint8_t * const data = (const uint8_t * const)(cursor + 1);
-      unsigned int dataSize = 0;
-
-      switch(cursor->type)
+      if (cursor->cacheID >= KVMFR_CURSOR_CACHE)
       {
-        case CURSOR_TYPE_MASKED_COLOR:
-        {
-          dataSize = cursor->height * cursor->pitch;
-          allocCursorData(this, dataSize);
-
-          const uint32_t * s = (const uint32_t *)data;
-          uint32_t * d       = this->cursorData;
-          for(int i = 0; i < dataSize; ++i, ++s, ++d)
-            *d = (*s & ~0xFF000000) | (*s & 0xFF000000 ? 0x0 : 0xFF000000);
-          break;
-        }
-
-        case CURSOR_TYPE_COLOR:
-        {
-          dataSize = cursor->height * cursor->pitch;
-          allocCursorData(this, dataSize);
-          memcpy(this->cursorData, data, dataSize);
-          break;
-        }
+        printf("Invalid cursor cache ID\n");
+        lgmpClientMessageDone(this->pointerQueue);
+        continue;
+      }
 
-        case CURSOR_TYPE_MONOCHROME:
-        {
-          dataSize = cursor->height * sizeof(uint32_t);
-          allocCursorData(this, dataSize);
-
-          const int hheight = cursor->height / 2;
-          uint32_t * d = this->cursorData;
-          for(int y = 0; y < hheight; ++y)
-            for(int x = 0; x < cursor->width; ++x)
-            {
-              const uint8_t  * srcAnd  = data   + (cursor->pitch * y) + (x / 8);
-              const uint8_t  * srcXor  = srcAnd + cursor->pitch * hheight;
-              const uint8_t    mask    = 0x80 >> (x % 8);
-              const uint32_t   andMask = (*srcAnd & mask) ? 0xFFFFFFFF : 0xFF000000;
-              const uint32_t   xorMask = (*srcXor & mask) ? 0x00FFFFFF : 0x00000000;
-
-              d[y * cursor->width + x                          ] = andMask;
-              d[y * cursor->width + x + cursor->width * hheight] = xorMask;
-            }
-
-          break;
-        }
+      os_sem_wait(this->cursorSem);
 
-        default:
-          printf("Invalid cursor type\n");
-          break;
+      /* a cached shape was sent before, only the slot to show has changed */
+      CursorShape * shape = &this->cursorShapes[cursor->cacheID];
+      if ((msg.udata & CURSOR_FLAG_CACHED) || setCursorShape(shape, cursor))
+      {
+        this->cursorCurrent = cursor->cacheID;
+        atomic_fetch_add_explicit(&this->cursorVer, 1, memory_order_relaxed);
       }
 
-      this->cursor.type   = cursor->type;
-      this->cursor.width  = cursor->width;
-      this->cursor.height = cursor->height;
-
-      atomic_fetch_add_explicit(&this->cursorVer, 1, memory_order_relaxed);
       os_sem_post(this->cursorSem);
     }
 
-    if (msg.udata & CURSOR_FLAG_POSITION)
-    {
-      this->cursor.x = cursor->x;
-      this->cursor.y = cursor->y;
-    }
-
     lgmpClientMessageDone(this->pointerQueue);
   }
 
   lgmpClientUnsubscribe(&this->pointerQueue);
 
-  bfree(this->cursorData);
-  this->cursorData = NULL;
-  this->cursorSize = 0;
-
   this->state = STATE_STOPPING;
   return NULL;
 }
 
+static void readCursorPos(LGPlugin * this)
+{
+  volatile KVMFRCursorPos * pos = this->cursorPos;
+  for(;;)
+  {
+    const uint32_t serial = pos->serial;
+    if (serial == this->cursorPosSerial)
+      return;
+
+    if (serial & 1)
+      continue;
+
+    atomic_thread_fence(memory_order_acquire);
+    const int  x       = pos->x;
+    const int  y       = pos->y;
+    const bool visible = pos->visible;
+    atomic_thread_fence(memory_order_acquire);
+
+    if (pos->serial != serial)
+      continue;
+
+    this->cursorPosSerial = serial;
+    this->cursorRect.x    = x;
+    this->cursorRect.y    = y;
+    this->cursorVisible   = visible;
+    return;
+  }
+}
+
 static void lgUpdate(void * data, obs_data_t * settings)
 {
   LGPlugin * this = (LGPlugin *)data;
 
   deinit(this);
   this->shmFile = bstrdup(obs_data_get_string(settings, "shmFile"));
+  this->dmabuf  = obs_data_get_bool(settings, "dmabuf");
   if (!ivshmemOpenDev(&this->shmDev, this->shmFile))
     return;
 
@@ -346,6 +821,20 @@ static void lgUpdate(void * data, obs_data_t * settings)
     return;
   }
 
+  if (udata->cursorPosOffset + sizeof(KVMFRCursorPos) > this->shmDev.size)
+  {
+    printf("Invalid host cursor position offset\n");
+    return;
+  }
+
+  this->cursorPos = (volatile KVMFRCursorPos *)
+    ((uint8_t *)this->shmDev.mem + udata->cursorPosOffset);
+  this->cursorPosSerial = 0;
+
+  this->useDMA = this->dmabuf && ivshmemHasDMA(&this->shmDev);
+  if (this->useDMA)
+    printf("Using DMA buffer support\n");
+
   this->state = STATE_STARTING;
   pthread_create(&this->frameThread, NULL, frameThread, this);
   pthread_setname_np(this->frameThread, "LGFrameThread");
@@ -360,176 +849,91 @@ static void lgVideoTick(void * data, float seconds)
   if (this->state != STATE_RUNNING)
     return;
 
-  LGMP_STATUS status;
-  LGMPMessage msg;
+  readCursorPos(this);
 
-  os_sem_wait(this->frameSem);
-  if (this->state != STATE_RUNNING)
+  /* the last render drew the held frame and OBS has since finished that
+   * frame, so the host may write over the buffer again */
+  if (this->dmaDrawn)
   {
-    os_sem_post(this->frameSem);
-    return;
+    uint32_t hold = this->dmaDrawn;
+    atomic_compare_exchange_strong(&this->dmaHeld, &hold, 0);
+    this->dmaDrawn = 0;
   }
 
-  this->cursorRect.x = this->cursor.x;
-  this->cursorRect.y = this->cursor.y;
-
   /* update the cursor texture */
   unsigned int cursorVer = atomic_load(&this->cursorVer);
   if (cursorVer != this->cursorCurVer)
   {
     os_sem_wait(this->cursorSem);
-    obs_enter_graphics();
 
-    if (this->cursorTex)
+    CursorShape * shape = &this->cursorShapes[this->cursorCurrent];
+    if (shape->update)
     {
-      gs_texture_destroy(this->cursorTex);
-      this->cursorTex = NULL;
-    }
-
-    switch(this->cursor.type)
-    {
-      case CURSOR_TYPE_MASKED_COLOR:
-        /* fallthrough */
-
-      case CURSOR_TYPE_COLOR:
-        this->cursorMono  = false;
-        this->cursorTex   =
-          gs_texture_create(
-              this->cursor.width,
-              this->cursor.height,
-              GS_BGRA,
-              1,
-              (const uint8_t **)&this->cursorData,
-              GS_DYNAMIC);
-        break;
-
-      case CURSOR_TYPE_MONOCHROME:
-        this->cursorMono = true;
-        this->cursorTex  =
-          gs_texture_create(
-              this->cursor.width,
-              this->cursor.height,
-              GS_RGBA,
-              1,
-              (const uint8_t **)&this->cursorData,
-              GS_DYNAMIC);
-        break;
-
-      default:
-        break;
+      obs_enter_graphics();
+      updateCursorTexture(shape);
+      obs_leave_graphics();
+      shape->update = false;
     }
 
-    obs_leave_graphics();
-
+    /* the position is applied as a translation when rendering, so only a
+     * shape change touches the texture */
+    this->cursorTex     = shape->texture;
+    this->cursorMono    = shape->type == CURSOR_TYPE_MONOCHROME;
     this->cursorCurVer  = cursorVer;
-    this->cursorRect.cx = this->cursor.width;
-    this->cursorRect.cy = this->cursor.height;
+    this->cursorRect.cx = shape->width;
+    this->cursorRect.cy = shape->height;
 
     os_sem_post(this->cursorSem);
   }
 
-
-  if ((status = lgmpClientAdvanceToLast(this->frameQueue)) != LGMP_OK)
+  /* the frame thread has already copied the frame, all that is left is to
+   * unmap it for upload and hand the last shown texture back to the reader */
+  if (atomic_load(&this->dmaReady) >= 0)
   {
-    if (status != LGMP_ERR_QUEUE_EMPTY)
-    {
-      os_sem_post(this->frameSem);
-      printf("lgmpClientAdvanceToLast: %s\n", lgmpStatusString(status));
-      return;
-    }
-  }
-
-  if ((status = lgmpClientProcess(this->frameQueue, &msg)) != LGMP_OK)
-  {
-    if (status == LGMP_ERR_QUEUE_EMPTY)
+    /* the imported textures are only destroyed inside the graphics context */
+    obs_enter_graphics();
+    const int dma = atomic_exchange(&this->dmaReady, -1);
+    if (dma >= 0)
     {
-      os_sem_post(this->frameSem);
-      return;
+      this->texture  = this->dmaFrames[dma].texture;
+      this->dmaShown = this->dmaFrames[dma].hold;
     }
-
-    printf("lgmpClientProcess: %s\n", lgmpStatusString(status));
-    this->state = STATE_STOPPING;
-    os_sem_post(this->frameSem);
+    obs_leave_graphics();
     return;
   }
 
-  KVMFRFrame * frame = (KVMFRFrame *)msg.mem;
-  if (!this->texture || this->formatVer != frame->formatVer)
-  {
-    this->formatVer = frame->formatVer;
-    this->width     = frame->width;
-    this->height    = frame->height;
-    this->type      = frame->type;
-
-    obs_enter_graphics();
-    if (this->texture)
-    {
-      gs_texture_unmap(this->texture);
-      gs_texture_destroy(this->texture);
-      this->texture = NULL;
-    }
+  if (atomic_load(&this->frameReady) < 0)
+    return;
 
-    enum gs_color_format format;
-    this->bpp = 4;
-    switch(this->type)
-    {
-      case FRAME_TYPE_BGRA   : format = GS_BGRA       ; break;
-      case FRAME_TYPE_RGBA   : format = GS_RGBA       ; break;
-      case FRAME_TYPE_RGBA10 : format = GS_R10G10B10A2; break;
+  obs_enter_graphics();
+  pthread_mutex_lock(&this->frameLock);
 
-      case FRAME_TYPE_RGBA16F:
-        this->bpp = 8;
-        format    = GS_RGBA16F;
-        break;
-
-      default:
-        printf("invalid type %d\n", this->type);
-        os_sem_post(this->frameSem);
-        obs_leave_graphics();
-        return;
-    }
-
-    this->texture = gs_texture_create(
-        this->width, this->height, format, 1, NULL, GS_DYNAMIC);
+  const int ready = atomic_load(&this->frameReady);
+  if (ready >= 0)
+  {
+    FrameTexture * next = &this->frames[ready];
+    gs_texture_unmap(next->texture);
+    next->state = FRAME_SHOWN;
 
-    if (!this->texture)
+    if (this->frameShown >= 0)
     {
-      printf("create texture failed\n");
-      os_sem_post(this->frameSem);
-      obs_leave_graphics();
-      return;
+      FrameTexture * prev = &this->frames[this->frameShown];
+      if (gs_texture_map(prev->texture, &prev->data, &prev->linesize))
+        prev->state = FRAME_FREE;
+      else
+      {
+        printf("map texture failed\n");
+        prev->state = FRAME_UNMAPPED;
+      }
     }
 
-    gs_texture_map(this->texture, &this->texData, &this->linesize);
-    obs_leave_graphics();
+    this->frameShown = ready;
+    this->texture    = next->texture;
+    atomic_store(&this->frameReady, -1);
   }
 
-  if (this->texture)
-  {
-    FrameBuffer * fb = (FrameBuffer *)(((uint8_t*)frame) + frame->offset);
-    framebuffer_read(
-        fb,
-        this->texData,    // dst
-        this->linesize,   // dstpitch
-        frame->height,    // height
-        frame->width,     // width
-        this->bpp,        // bpp
-        frame->pitch      // linepitch
-    );
-
-    lgmpClientMessageDone(this->frameQueue);
-    os_sem_post(this->frameSem);
-
-    obs_enter_graphics();
-    gs_texture_unmap(this->texture);
-    gs_texture_map(this->texture, &this->texData, &this->linesize);
-    obs_leave_graphics();
-  }
-  else
-  {
-    lgmpClientMessageDone(this->frameQueue);
-    os_sem_post(this->frameSem);
-  }
+  pthread_mutex_unlock(&this->frameLock);
+  obs_leave_graphics();
 }
 
 static void lgVideoRender(void * data, gs_effect_t * effect)
@@ -546,6 +950,14 @@ static void lgVideoRender(void * data, gs_effect_t * effect)
   while (gs_effect_loop(effect, "Draw"))
     gs_draw_sprite(this->texture, 0, 0, 0);
 
+  /* release the held frame on the next tick once this draw is submitted */
+  if (this->dmaShown)
+  {
+    gs_flush();
+    this->dmaDrawn = this->dmaShown;
+    this->dmaShown = 0;
+  }
+
   if (this->cursorVisible && this->cursorTex)
   {
     struct matrix4 m4;
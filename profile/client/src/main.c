@@ -21,32 +21,63 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "common/option.h"
 #include "common/crash.h"
 #include "common/KVMFR.h"
+#include "common/KVMFRRecord.h"
 #include "common/locking.h"
 #include "common/stringutils.h"
 #include "common/ivshmem.h"
+#include "common/framebuffer.h"
+#include "common/tilecodec.h"
+#include "common/histogram.h"
+#include "common/time.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h>
 #include <sys/mman.h>
 #include <pwd.h>
 #include <string.h>
 #include <time.h>
+#include <inttypes.h>
 
 #include <lgmp/client.h>
 
-#define min(a,b) ({ __typeof__ (a) _a = (a); __typeof__ (b) _b = (b); _a < _b ? _a : _b; })
-#define max(a,b) ({ __typeof__ (a) _a = (a); __typeof__ (b) _b = (b); _a > _b ? _a : _b; })
+#define CLOCK_WINDOW 16 // pings to keep the best clock sample for
 
 struct state
 {
-  bool           running;
-  struct IVSHMEM shmDev;
+  volatile bool          running;
+  struct IVSHMEM         shmDev;
+  volatile KVMFRRequest * request;
+  volatile KVMFRStats   * stats;
 };
 
 struct state state;
 
+static bool optSinkValidate(struct Option * opt, const char ** error)
+{
+  if (strcmp(opt->value.x_string, "none"  ) == 0 ||
+      strcmp(opt->value.x_string, "memory") == 0)
+    return true;
+
+  *error = "Invalid sink, must be one of: none, memory";
+  return false;
+}
+
+static bool optPayloadValidate(struct Option * opt, const char ** error)
+{
+  if (strcmp(opt->value.x_string, "none"  ) == 0 ||
+      strcmp(opt->value.x_string, "full"  ) == 0 ||
+      strcmp(opt->value.x_string, "damage") == 0 ||
+      strcmp(opt->value.x_string, "tiles" ) == 0)
+    return true;
+
+  *error = "Invalid payload, must be one of: none, full, damage, tiles";
+  return false;
+}
+
 static struct Option options[] =
 {
   {
@@ -57,6 +88,57 @@ static struct Option options[] =
     .type           = OPTION_TYPE_STRING,
     .value.x_string = NULL
   },
+  {
+    .module         = "profile",
+    .name           = "duration",
+    .description    = "Seconds to measure for (0 = until interrupted)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 30
+  },
+  {
+    .module         = "profile",
+    .name           = "warmup",
+    .description    = "Seconds to discard at the start before measuring",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 2
+  },
+  {
+    .module         = "profile",
+    .name           = "sink",
+    .description    = "Where the frame data goes (none = wait for it only, memory = framebuffer_read into a buffer)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "memory",
+    .validator      = optSinkValidate
+  },
+  {
+    .module         = "profile",
+    .name           = "csv",
+    .description    = "Write the timings of every frame to this CSV file",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "profile",
+    .name           = "json",
+    .description    = "Write the summary to this JSON file",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "profile",
+    .name           = "record",
+    .description    = "Record the frame and cursor streams to this file for replay",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "profile",
+    .name           = "recordPayload",
+    .description    = "The frame data to record (none, full = every frame, damage = only the damaged rects, tiles = the damaged rects losslessly coded)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "damage",
+    .validator      = optPayloadValidate
+  },
   {0}
 };
 
@@ -104,6 +186,592 @@ static bool config_load(int argc, char * argv[])
   return true;
 }
 
+// a measurement in microseconds
+struct Stat
+{
+  Histogram hist;
+  uint64_t  min, total;
+};
+
+struct Results
+{
+  uint64_t    start, end;
+  uint64_t    frames, bytes;
+  uint64_t    formatChanges;
+  uint64_t    posted, dropped;
+  bool        haveStats;
+  struct Stat interval; // time between frames arriving
+  struct Stat copy;     // time for the sink to take the whole frame
+  struct Stat latency;  // host post to the frame being complete here
+};
+
+struct ClockSync
+{
+  uint32_t     serial;
+  bool         valid;
+  int64_t      offset; // the host microtime minus ours
+  int64_t      rtt;
+  unsigned int age;
+};
+
+static void signalHandler(int sig)
+{
+  state.running = false;
+}
+
+static void stat_add(struct Stat * s, uint64_t value)
+{
+  if (!s->hist.count || value < s->min)
+    s->min = value;
+  s->total += value;
+  histogram_add(&s->hist, value);
+}
+
+static void sendPing(void)
+{
+  if (!state.request)
+    return;
+
+  state.request->pingTime = microtime();
+  atomic_thread_fence(memory_order_release);
+  ++state.request->pingSerial;
+}
+
+// see updateClock in the client, the post time is echoed with the ping
+static void updateClock(struct ClockSync * clock, const KVMFRFrame * frame,
+    const uint64_t recvTime)
+{
+  if (!frame->pingSerial || frame->pingSerial == clock->serial)
+    return;
+  clock->serial = frame->pingSerial;
+
+  const int64_t t0  = frame->pingClientTime;
+  const int64_t t1  = frame->pingHostTime;
+  const int64_t t2  = frame->postTime;
+  const int64_t t3  = recvTime;
+  const int64_t rtt = (t3 - t0) - (t2 - t1);
+  if (rtt < 0)
+    return;
+
+  if (clock->valid && rtt > clock->rtt && ++clock->age < CLOCK_WINDOW)
+    return;
+
+  clock->offset = ((t1 - t0) + (t2 - t3)) / 2;
+  clock->rtt    = rtt;
+  clock->age    = 0;
+  clock->valid  = true;
+}
+
+// the frame data as rows of pitch bytes, zero if the type is unknown
+static size_t frameRows(const KVMFRFrame * frame)
+{
+  switch(frame->type)
+  {
+    case FRAME_TYPE_BGRA:
+    case FRAME_TYPE_RGBA:
+    case FRAME_TYPE_RGBA10:
+    case FRAME_TYPE_RGBA16F:
+      return frame->height;
+
+    // the chroma planes follow the luma with half the pitch
+    case FRAME_TYPE_YUV420:
+      return frame->height + frame->height / 2;
+
+    // the pitch is the size of the access unit
+    case FRAME_TYPE_H264:
+      return 1;
+
+    default:
+      return 0;
+  }
+}
+
+// a cursor shape kept so a cached shape can be recorded in full
+struct RecordShape
+{
+  KVMFRRecordCursor info;
+  uint8_t         * data;
+  size_t            size;
+};
+
+struct Recorder
+{
+  FILE                    * fp;
+  uint64_t                  start;
+  KVMFRRecordPayload        payload;
+  bool                      needFull;
+  uint32_t                  formatVer;
+  uint64_t                  frames, bytes;
+
+  PLGMPClientQueue          pointerQueue;
+  volatile KVMFRCursorPos * cursorPos;
+  uint32_t                  cursorSerial;
+  struct RecordShape        shapes[KVMFR_CURSOR_CACHE];
+
+  uint8_t                 * coded;
+  size_t                    codedSize;
+};
+
+static void recordClose(struct Recorder * rec)
+{
+  for(int i = 0; i < KVMFR_CURSOR_CACHE; ++i)
+    free(rec->shapes[i].data);
+  free(rec->coded);
+
+  if (rec->pointerQueue)
+    lgmpClientUnsubscribe(&rec->pointerQueue);
+
+  if (rec->fp)
+  {
+    fclose(rec->fp);
+    DEBUG_INFO("Recorded %" PRIu64 " frames, %" PRIu64 " bytes of frame data",
+        rec->frames, rec->bytes);
+  }
+
+  memset(rec, 0, sizeof(*rec));
+}
+
+static bool recordWrite(struct Recorder * rec, const void * data, size_t size)
+{
+  if (fwrite(data, 1, size, rec->fp) == size)
+    return true;
+
+  DEBUG_ERROR("Failed to write the recording, recording stopped");
+  fclose(rec->fp);
+  rec->fp = NULL;
+  return false;
+}
+
+// write the record header, the caller then writes size bytes of body
+static bool recordBegin(struct Recorder * rec, KVMFRRecordType type,
+    size_t size)
+{
+  const KVMFRRecord r =
+  {
+    .type = type,
+    .size = kvmfrRecordSize(sizeof(KVMFRRecord) + size),
+    .time = microtime() - rec->start
+  };
+  return recordWrite(rec, &r, sizeof(r));
+}
+
+static bool recordEnd(struct Recorder * rec, size_t size)
+{
+  static const uint8_t pad[KVMFR_RECORD_ALIGN] = { 0 };
+  const size_t total = sizeof(KVMFRRecord) + size;
+  return recordWrite(rec, pad, kvmfrRecordSize(total) - total);
+}
+
+static bool recordOpen(struct Recorder * rec, PLGMPClient lgmp,
+    const KVMFR * udata, const char * path, const char * payload)
+{
+  memset(rec, 0, sizeof(*rec));
+  if (!(rec->fp = fopen(path, "wb")))
+  {
+    DEBUG_ERROR("Failed to open the recording: %s", path);
+    return false;
+  }
+
+  if (strcmp(payload, "none") == 0)
+    rec->payload = KVMFR_PAYLOAD_NONE;
+  else if (strcmp(payload, "full") == 0)
+    rec->payload = KVMFR_PAYLOAD_FULL;
+  else if (strcmp(payload, "tiles") == 0)
+    rec->payload = KVMFR_PAYLOAD_TILES;
+  else
+    rec->payload = KVMFR_PAYLOAD_DAMAGE;
+
+  rec->start    = microtime();
+  rec->needFull = true;
+
+  KVMFRRecordHeader hdr =
+  {
+    .version      = KVMFR_RECORD_VERSION,
+    .kvmfrVersion = udata->version,
+    .startTime    = rec->start
+  };
+  memcpy(hdr.magic  , KVMFR_RECORD_MAGIC, sizeof(hdr.magic));
+  memcpy(hdr.hostver, udata->hostver    , sizeof(hdr.hostver));
+  if (!recordWrite(rec, &hdr, sizeof(hdr)))
+    return false;
+
+  if (udata->cursorPosOffset + sizeof(KVMFRCursorPos) <= state.shmDev.size)
+    rec->cursorPos = (volatile KVMFRCursorPos *)
+      ((uint8_t *)state.shmDev.mem + udata->cursorPosOffset);
+
+  LGMP_STATUS status;
+  if ((status = lgmpClientSubscribe(lgmp, LGMP_Q_POINTER, &rec->pointerQueue))
+      != LGMP_OK)
+  {
+    DEBUG_WARN("lgmpClientSubscribe: %s, the cursor will not be recorded",
+        lgmpStatusString(status));
+    rec->pointerQueue = NULL;
+  }
+
+  DEBUG_INFO("Recording to: %s, payload: %s", path, payload);
+  return true;
+}
+
+static void recordShape(struct Recorder * rec, const struct RecordShape * shape)
+{
+  const size_t size = sizeof(shape->info) + shape->size;
+  if (recordBegin(rec, KVMFR_RECORD_CURSOR_SHAPE, size) &&
+      recordWrite(rec, &shape->info, sizeof(shape->info)) &&
+      recordWrite(rec, shape->data, shape->size))
+    recordEnd(rec, size);
+}
+
+// record the cursor shapes and the latest position, see readCursorPos in the
+// client for the position
+static void recordPointer(struct Recorder * rec)
+{
+  LGMPMessage msg;
+  while(rec->fp && rec->pointerQueue &&
+      lgmpClientProcess(rec->pointerQueue, &msg) == LGMP_OK)
+  {
+    const KVMFRCursor * cursor = (const KVMFRCursor *)msg.mem;
+    if (!(msg.udata & CURSOR_FLAG_SHAPE) || cursor->cacheID >= KVMFR_CURSOR_CACHE)
+    {
+      lgmpClientMessageDone(rec->pointerQueue);
+      continue;
+    }
+
+    struct RecordShape * shape = &rec->shapes[cursor->cacheID];
+    if (!(msg.udata & CURSOR_FLAG_CACHED))
+    {
+      const size_t size = (size_t)cursor->height * cursor->pitch;
+      if (size > msg.size - sizeof(*cursor))
+      {
+        DEBUG_WARN("Invalid cursor shape size, skipping");
+        lgmpClientMessageDone(rec->pointerQueue);
+        continue;
+      }
+
+      if (size > shape->size)
+      {
+        free(shape->data);
+        if (!(shape->data = malloc(size)))
+        {
+          DEBUG_ERROR("Out of memory");
+          shape->size = 0;
+          lgmpClientMessageDone(rec->pointerQueue);
+          continue;
+        }
+      }
+
+      shape->info = (KVMFRRecordCursor)
+      {
+        .type   = cursor->type,
+        .hx     = cursor->hx,
+        .hy     = cursor->hy,
+        .width  = cursor->width,
+        .height = cursor->height,
+        .pitch  = cursor->pitch
+      };
+      shape->size = size;
+      memcpy(shape->data, cursor + 1, size);
+    }
+    lgmpClientMessageDone(rec->pointerQueue);
+
+    if (shape->data)
+      recordShape(rec, shape);
+  }
+
+  volatile KVMFRCursorPos * pos = rec->cursorPos;
+  if (!rec->fp || !pos)
+    return;
+
+  KVMFRCursorPos copy;
+  copy.serial = pos->serial;
+  if (copy.serial == rec->cursorSerial || (copy.serial & 1))
+    return;
+
+  atomic_thread_fence(memory_order_acquire);
+  copy.x       = pos->x;
+  copy.y       = pos->y;
+  copy.visible = pos->visible;
+  atomic_thread_fence(memory_order_acquire);
+  if (pos->serial != copy.serial)
+    return;
+
+  rec->cursorSerial = copy.serial;
+  if (recordBegin(rec, KVMFR_RECORD_CURSOR_POS, sizeof(copy)) &&
+      recordWrite(rec, &copy, sizeof(copy)))
+    recordEnd(rec, sizeof(copy));
+}
+
+static unsigned int frameBpp(const KVMFRFrame * frame)
+{
+  switch(frame->type)
+  {
+    case FRAME_TYPE_BGRA:
+    case FRAME_TYPE_RGBA:
+    case FRAME_TYPE_RGBA10:
+      return 4;
+
+    case FRAME_TYPE_RGBA16F:
+      return 8;
+
+    default:
+      return 0;
+  }
+}
+
+// code the tiles of the rects into rec->coded, returns the size or zero on
+// failure
+static size_t recordCodeTiles(struct Recorder * rec, const KVMFRFrame * frame,
+    const uint8_t * data, const FrameDamageRect * rects, uint32_t count)
+{
+  const unsigned int tiles = tilecodec_count(rects, count, frame->width,
+      frame->height);
+  const size_t need = tiles * (sizeof(TileHeader) +
+      tilecodec_maxSize(TILECODEC_SIZE, TILECODEC_SIZE));
+  if (need > rec->codedSize)
+  {
+    free(rec->coded);
+    if (!(rec->coded = malloc(need)))
+    {
+      DEBUG_ERROR("Out of memory, recording stopped");
+      rec->codedSize = 0;
+      fclose(rec->fp);
+      rec->fp = NULL;
+      return 0;
+    }
+    rec->codedSize = need;
+  }
+
+  size_t size = 0;
+  for(unsigned int i = 0; i < tiles; ++i)
+  {
+    const FrameDamageRect r = tilecodec_tile(rects, count, frame->width,
+        frame->height, i);
+    TileHeader hdr =
+    {
+      .x      = r.x,
+      .y      = r.y,
+      .width  = r.width,
+      .height = r.height
+    };
+
+    hdr.size = tilecodec_encode(data + (size_t)r.y * frame->pitch +
+        (size_t)r.x * 4, frame->pitch, r.width, r.height,
+        rec->coded + size + sizeof(hdr));
+    memcpy(rec->coded + size, &hdr, sizeof(hdr));
+    size += sizeof(hdr) + hdr.size;
+  }
+
+  return size;
+}
+
+// the damage only holds from the frame before, if a frame was missed or the
+// format changed the whole frame is stored
+static void recordFrame(struct Recorder * rec, const KVMFRFrame * frame,
+    const uint8_t * data, size_t dataSize)
+{
+  if (!rec->fp)
+    return;
+
+  const unsigned int bpp = frameBpp(frame);
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+  uint32_t count = frame->damageRectsCount;
+  if (count > KVMFR_MAX_DAMAGE_RECTS)
+    count = 0;
+
+  // keep the rects inside the frame so the replay can trust them
+  uint32_t valid = 0;
+  size_t   damageSize = 0;
+  for(uint32_t i = 0; i < count; ++i)
+  {
+    FrameDamageRect r = frame->damageRects[i];
+    if (r.x >= frame->width || r.y >= frame->height)
+      continue;
+    if (r.width  > frame->width  - r.x) r.width  = frame->width  - r.x;
+    if (r.height > frame->height - r.y) r.height = frame->height - r.y;
+    if (!r.width || !r.height)
+      continue;
+    rects[valid++] = r;
+    damageSize += (size_t)r.width * r.height * bpp;
+  }
+
+  // if every rect was outside of the frame treat it as a full update
+  count = valid;
+
+  // the codec only takes 32 bit pixels
+  KVMFRRecordPayload payload = rec->payload;
+  if (payload == KVMFR_PAYLOAD_TILES && bpp != 4)
+    payload = KVMFR_PAYLOAD_DAMAGE;
+
+  const bool full = rec->needFull || !bpp || !count ||
+    frame->formatVer != rec->formatVer || damageSize >= dataSize;
+  if (payload == KVMFR_PAYLOAD_DAMAGE && full)
+    payload = KVMFR_PAYLOAD_FULL;
+
+  // no rects codes the whole frame
+  if (payload == KVMFR_PAYLOAD_TILES && full)
+    count = 0;
+
+  size_t payloadSize =
+    payload == KVMFR_PAYLOAD_FULL   ? dataSize   :
+    payload == KVMFR_PAYLOAD_DAMAGE ? damageSize : 0;
+
+  if (payload == KVMFR_PAYLOAD_TILES &&
+      !(payloadSize = recordCodeTiles(rec, frame, data, rects, count)))
+    return;
+
+  const KVMFRRecordFrame info =
+  {
+    .formatVer        = frame->formatVer,
+    .type             = frame->type,
+    .width            = frame->width,
+    .height           = frame->height,
+    .screenWidth      = frame->screenWidth,
+    .screenHeight     = frame->screenHeight,
+    .stride           = frame->stride,
+    .pitch            = frame->pitch,
+    .dataSize         = dataSize,
+    .payload          = payload,
+    .bpp              = bpp,
+    .damageRectsCount = count
+  };
+
+  const size_t size = sizeof(info) + info.damageRectsCount * sizeof(*rects) +
+    payloadSize;
+  if (!recordBegin(rec, KVMFR_RECORD_FRAME, size) ||
+      !recordWrite(rec, &info, sizeof(info)) ||
+      !recordWrite(rec, rects, info.damageRectsCount * sizeof(*rects)))
+    return;
+
+  if (payload == KVMFR_PAYLOAD_FULL)
+  {
+    if (!recordWrite(rec, data, dataSize))
+      return;
+  }
+  else if (payload == KVMFR_PAYLOAD_TILES)
+  {
+    if (!recordWrite(rec, rec->coded, payloadSize))
+      return;
+  }
+  else if (payload == KVMFR_PAYLOAD_DAMAGE)
+    for(uint32_t i = 0; i < count; ++i)
+    {
+      const FrameDamageRect * r = &rects[i];
+      const uint8_t * src = data + (size_t)r->y * frame->pitch +
+        (size_t)r->x * bpp;
+      for(uint32_t y = 0; y < r->height; ++y, src += frame->pitch)
+        if (!recordWrite(rec, src, (size_t)r->width * bpp))
+          return;
+    }
+
+  if (!recordEnd(rec, size))
+    return;
+
+  rec->needFull  = false;
+  rec->formatVer = frame->formatVer;
+  ++rec->frames;
+  rec->bytes += payloadSize;
+}
+
+static void readHostStats(uint64_t * posted, uint64_t * dropped)
+{
+  *posted  = state.stats->framesPosted;
+  *dropped = state.stats->framesDropped;
+}
+
+static void printStat(const char * name, const struct Stat * s)
+{
+  if (!s->hist.count)
+  {
+    DEBUG_INFO("%-10s: no samples", name);
+    return;
+  }
+
+  DEBUG_INFO("%-10s: min %7" PRIu64 " p50 %7" PRIu64 " p90 %7" PRIu64
+      " p99 %7" PRIu64 " p99.9 %7" PRIu64 " max %7" PRIu64 " mean %9.1f us",
+      name, s->min,
+      histogram_percentile(&s->hist, 50.0),
+      histogram_percentile(&s->hist, 90.0),
+      histogram_percentile(&s->hist, 99.0),
+      histogram_percentile(&s->hist, 99.9),
+      s->hist.max,
+      (double)s->total / s->hist.count);
+}
+
+static void writeStat(FILE * fp, const char * name, const struct Stat * s,
+    bool last)
+{
+  if (!s->hist.count)
+  {
+    fprintf(fp, "  \"%s\": null%s\n", name, last ? "" : ",");
+    return;
+  }
+
+  fprintf(fp,
+      "  \"%s\": {\"count\": %" PRIu64 ", \"min\": %" PRIu64
+      ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64
+      ", \"p99_9\": %" PRIu64 ", \"max\": %" PRIu64 ", \"mean\": %.1f}%s\n",
+      name, s->hist.count, s->min,
+      histogram_percentile(&s->hist, 50.0),
+      histogram_percentile(&s->hist, 90.0),
+      histogram_percentile(&s->hist, 99.0),
+      histogram_percentile(&s->hist, 99.9),
+      s->hist.max,
+      (double)s->total / s->hist.count,
+      last ? "" : ",");
+}
+
+static void report(const struct Results * r, const char * hostver,
+    const char * sink)
+{
+  const double seconds    = (r->end - r->start) / 1e6;
+  const double fps        = seconds > 0.0 ? r->frames / seconds : 0.0;
+  const double throughput = r->copy.total ?
+    (double)r->bytes / r->copy.total : 0.0; // bytes per us is MB/s
+
+  DEBUG_INFO("Measured %" PRIu64 " frames over %.2f s (%.2f fps), sink: %s",
+      r->frames, seconds, fps, sink);
+  printStat("interval", &r->interval);
+  printStat("copy"    , &r->copy    );
+  printStat("latency" , &r->latency );
+  DEBUG_INFO("Copy throughput: %.1f MB/s", throughput);
+  if (r->haveStats)
+    DEBUG_INFO("Host posted: %" PRIu64 ", dropped: %" PRIu64,
+        r->posted, r->dropped);
+
+  const char * path = option_get_string("profile", "json");
+  if (!path)
+    return;
+
+  FILE * fp = fopen(path, "w");
+  if (!fp)
+  {
+    DEBUG_ERROR("Failed to open the JSON file: %s", path);
+    return;
+  }
+
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"version\": \"%s\",\n", BUILD_VERSION);
+  fprintf(fp, "  \"host\": \"%s\",\n", hostver);
+  fprintf(fp, "  \"sink\": \"%s\",\n", sink);
+  fprintf(fp, "  \"seconds\": %.3f,\n", seconds);
+  fprintf(fp, "  \"frames\": %" PRIu64 ",\n", r->frames);
+  fprintf(fp, "  \"fps\": %.3f,\n", fps);
+  fprintf(fp, "  \"format_changes\": %" PRIu64 ",\n", r->formatChanges);
+  fprintf(fp, "  \"bytes\": %" PRIu64 ",\n", r->bytes);
+  fprintf(fp, "  \"copy_mbps\": %.1f,\n", throughput);
+  if (r->haveStats)
+    fprintf(fp, "  \"host_posted\": %" PRIu64 ",\n"
+        "  \"host_dropped\": %" PRIu64 ",\n", r->posted, r->dropped);
+  else
+    fprintf(fp, "  \"host_posted\": null,\n  \"host_dropped\": null,\n");
+  writeStat(fp, "interval_us", &r->interval, false);
+  writeStat(fp, "copy_us"    , &r->copy    , false);
+  writeStat(fp, "latency_us" , &r->latency , true );
+  fprintf(fp, "}\n");
+  fclose(fp);
+
+  DEBUG_INFO("Summary written to: %s", path);
+}
+
 static int run()
 {
   PLGMPClient      lgmp;
@@ -113,13 +781,38 @@ static int run()
   KVMFR *udata;
 
   LGMP_STATUS status;
-  if ((status = lgmpClientInit(state.shmDev.mem, state.shmDev.size, &lgmp,
-          &udataSize, (uint8_t **)&udata)) != LGMP_OK)
+  if ((status = lgmpClientInit(state.shmDev.mem, state.shmDev.size, &lgmp))
+      != LGMP_OK)
   {
     DEBUG_ERROR("lgmpClientInit: %s", lgmpStatusString(status));
     return -1;
   }
 
+  // allow the host to update the timestamp before checking for a session
+  usleep(200000);
+
+  while(state.running)
+  {
+    if ((status = lgmpClientSessionInit(lgmp, &udataSize, (uint8_t **)&udata))
+        == LGMP_OK)
+      break;
+
+    if (status != LGMP_ERR_INVALID_SESSION && status != LGMP_ERR_INVALID_MAGIC)
+    {
+      DEBUG_ERROR("lgmpClientSessionInit: %s", lgmpStatusString(status));
+      lgmpClientFree(&lgmp);
+      return -1;
+    }
+
+    usleep(100000);
+  }
+
+  if (!state.running)
+  {
+    lgmpClientFree(&lgmp);
+    return 0;
+  }
+
   if (udataSize != sizeof(KVMFR) ||
       memcmp(udata->magic, KVMFR_MAGIC, sizeof(udata->magic)) != 0 ||
       udata->version != KVMFR_VERSION)
@@ -128,31 +821,127 @@ static int run()
     DEBUG_ERROR("The host application is not compatible with this client");
     DEBUG_ERROR("Expected KVMFR version %d", KVMFR_VERSION);
     DEBUG_BREAK();
+    lgmpClientFree(&lgmp);
     return -1;
   }
 
-  if ((status = lgmpClientSubscribe(lgmp, LGMP_Q_FRAME, &frameQueue) != LGMP_OK))
+  char hostver[sizeof(udata->hostver) + 1];
+  memcpy(hostver, udata->hostver, sizeof(udata->hostver));
+  hostver[sizeof(udata->hostver)] = '\0';
+  DEBUG_INFO("Host version: %s", hostver);
+
+  // only the ping is written, the requests of a real client are left alone
+  if (udata->requestOffset + sizeof(KVMFRRequest) <= state.shmDev.size)
+    state.request = (volatile KVMFRRequest *)
+      ((uint8_t *)state.shmDev.mem + udata->requestOffset);
+  else
+    DEBUG_WARN("Invalid host request offset, latency will not be measured");
+
+  if (udata->statsOffset + sizeof(KVMFRStats) <= state.shmDev.size)
+  {
+    state.stats = (volatile KVMFRStats *)
+      ((uint8_t *)state.shmDev.mem + udata->statsOffset);
+    if (state.stats->version != KVMFR_STATS_VERSION ||
+        state.stats->size < sizeof(KVMFRStats))
+      state.stats = NULL;
+  }
+
+  if (!state.stats)
+    DEBUG_WARN("The host stats are unavailable, drops will not be counted");
+
+  if ((status = lgmpClientSubscribe(lgmp, LGMP_Q_FRAME, &frameQueue)) != LGMP_OK)
   {
     DEBUG_ERROR("lgmpClientSubscribe: %s", lgmpStatusString(status));
+    lgmpClientFree(&lgmp);
     return -1;
   }
 
-  struct perf
+  const char * sink     = option_get_string("profile", "sink");
+  const bool   copy     = strcmp(sink, "memory") == 0;
+  const int    duration = option_get_int("profile", "duration");
+  const int    warmup   = option_get_int("profile", "warmup");
+
+  FILE * csv = NULL;
+  const char * csvPath = option_get_string("profile", "csv");
+  if (csvPath)
   {
-    uint64_t min, max, ttl;
-    unsigned int count;
-  };
+    if (!(csv = fopen(csvPath, "w")))
+    {
+      DEBUG_ERROR("Failed to open the CSV file: %s", csvPath);
+      lgmpClientUnsubscribe(&frameQueue);
+      lgmpClientFree(&lgmp);
+      return -1;
+    }
+    fprintf(csv, "frame,time_us,type,width,height,bytes,interval_us,copy_us,"
+        "latency_us\n");
+  }
 
-  unsigned int frameCount    = 0;
-  uint64_t     lastFrameTime = 0;
-  struct perf  p1  = {};
-  struct perf  p5  = {};
-  struct perf  p10 = {};
-  struct perf  p30 = {};
+  // recording adds the cost of writing the file to each frame
+  struct Recorder rec = { 0 };
+  const char * recPath = option_get_string("profile", "record");
+  if (recPath && !recordOpen(&rec, lgmp, udata, recPath,
+        option_get_string("profile", "recordPayload")))
+  {
+    recordClose(&rec);
+    if (csv)
+      fclose(csv);
+    lgmpClientUnsubscribe(&frameQueue);
+    lgmpClientFree(&lgmp);
+    return -1;
+  }
+
+  struct Results * r = calloc(1, sizeof(*r));
+  if (!r)
+  {
+    DEBUG_ERROR("Out of memory");
+    recordClose(&rec);
+    if (csv)
+      fclose(csv);
+    lgmpClientUnsubscribe(&frameQueue);
+    lgmpClientFree(&lgmp);
+    return -1;
+  }
+
+  struct ClockSync clock     = { 0 };
+  uint8_t        * buffer    = NULL;
+  size_t           bufferSize = 0;
+  uint32_t         formatVer = 0;
+  uint64_t         lastRecv  = 0;
+  uint64_t         nextPing  = 0;
+  uint64_t         lastPrint = 0;
+  uint64_t         printFrames = 0;
+  bool             measuring = false;
+  int              ret       = 0;
+
+  const uint64_t begin      = microtime();
+  const uint64_t measureAt  = begin + (uint64_t)warmup * 1000000ULL;
+
+  DEBUG_INFO("Warming up for %d s, then measuring for %d s", warmup, duration);
 
-  // start accepting frames
   while(state.running)
   {
+    uint64_t now = microtime();
+    if (!measuring && now >= measureAt)
+    {
+      measuring = true;
+      r->start  = now;
+      lastPrint = now;
+      if (state.stats)
+        readHostStats(&r->posted, &r->dropped);
+    }
+
+    if (measuring && duration > 0 &&
+        now - r->start >= (uint64_t)duration * 1000000ULL)
+      break;
+
+    if (now >= nextPing)
+    {
+      sendPing();
+      nextPing = now + 1000000;
+    }
+
+    recordPointer(&rec);
+
     LGMPMessage msg;
     if ((status = lgmpClientProcess(frameQueue, &msg)) != LGMP_OK)
     {
@@ -160,53 +949,139 @@ static int run()
         continue;
 
       DEBUG_ERROR("lgmpClientProcess: %s", lgmpStatusString(status));
-      return -1;
+      ret = -1;
+      break;
+    }
+
+    const uint64_t     recvTime = microtime();
+    const KVMFRFrame * frame    = (const KVMFRFrame *)msg.mem;
+    const FrameBuffer* fb       =
+      (const FrameBuffer *)(((const uint8_t *)frame) + frame->offset);
+
+    updateClock(&clock, frame, recvTime);
+
+    const size_t rows = frameRows(frame);
+    const size_t size = rows * frame->pitch;
+    if (!rows)
+    {
+      DEBUG_WARN("Unsupported frame type %d, skipping", frame->type);
+      lgmpClientMessageDone(frameQueue);
+      continue;
+    }
+
+    if (frame->formatVer != formatVer)
+    {
+      formatVer = frame->formatVer;
+      if (measuring)
+        ++r->formatChanges;
+      DEBUG_INFO("Format: %s %ux%u pitch %u", FrameTypeStr[frame->type],
+          frame->width, frame->height, frame->pitch);
+    }
+
+    if (copy && size > bufferSize)
+    {
+      free(buffer);
+      buffer     = malloc(size);
+      bufferSize = size;
+      if (!buffer)
+      {
+        DEBUG_ERROR("Failed to allocate the sink buffer");
+        lgmpClientMessageDone(frameQueue);
+        ret = -1;
+        break;
+      }
     }
 
+    const bool ok = copy ?
+      framebuffer_read(fb, buffer, frame->pitch, rows, frame->pitch, 1,
+          frame->pitch) :
+      framebuffer_wait(fb, size);
+    const uint64_t doneTime = microtime();
+
+    // the frame header is only valid until the message is done with
+    if (ok)
+      recordFrame(&rec, frame, copy ? buffer : framebuffer_get_data(fb), size);
     lgmpClientMessageDone(frameQueue);
 
-    uint64_t frameTime = nanotime();
-    uint64_t diff = frameTime - lastFrameTime;
+    if (!ok)
+    {
+      DEBUG_WARN("Timed out waiting for the frame data");
+      rec.needFull = true;
+      lastRecv = 0;
+      continue;
+    }
 
-    if (frameCount++ == 0)
+    if (!measuring)
     {
-      lastFrameTime = frameTime;
-      p1.min = p5.min = p10.min = p30.min = diff;
+      lastRecv = recvTime;
       continue;
     }
 
-    ++p1 .count;
-    ++p5 .count;
-    ++p10.count;
-    ++p30.count;
+    const uint64_t interval = lastRecv ? recvTime - lastRecv : 0;
+    const uint64_t copyTime = doneTime - recvTime;
+    int64_t latency = -1;
+    if (clock.valid)
+      latency = (int64_t)doneTime + clock.offset - (int64_t)frame->postTime;
 
-#define UPDATE(p, interval) \
-    if (p.ttl + diff >= (1e9 * interval)) \
-    { \
-      fprintf(stdout, "%02d, min:%9lu ns (%5.2f ms) max:%9lu ns (%5.2f ms) avg:%9lu ns (%5.2f ms)\n", \
-          interval, \
-          p.min          , ((float)p.min / 1e6f), \
-          p.max          , ((float)p.max / 1e6f), \
-          p.ttl / p.count, (((float)p.ttl / p.count) / 1e6f)\
-      ); \
-      p.min = p.max = p.ttl = diff; p.count = 1; \
-    } \
-    else \
-    { \
-      p.min = min(p.min, diff); \
-      p.max = max(p.max, diff); \
-      p.ttl += diff; \
+    ++r->frames;
+    r->bytes += size;
+    if (lastRecv)
+      stat_add(&r->interval, interval);
+    stat_add(&r->copy, copyTime);
+    if (latency >= 0)
+      stat_add(&r->latency, latency);
+
+    if (csv)
+    {
+      fprintf(csv, "%" PRIu64 ",%" PRIu64 ",%s,%u,%u,%zu,", r->frames,
+          recvTime - r->start, FrameTypeStr[frame->type], frame->width,
+          frame->height, size);
+      if (lastRecv)
+        fprintf(csv, "%" PRIu64, interval);
+      fprintf(csv, ",%" PRIu64 ",", copyTime);
+      if (latency >= 0)
+        fprintf(csv, "%" PRId64, latency);
+      fputc('\n', csv);
     }
 
-    UPDATE(p1 , 1 );
-    UPDATE(p5 , 5 );
-    UPDATE(p10, 10);
-    UPDATE(p30, 30);
+    lastRecv = recvTime;
 
-    lastFrameTime = frameTime;
+    if (doneTime - lastPrint >= 1000000)
+    {
+      const double secs = (doneTime - lastPrint) / 1e6;
+      fprintf(stdout, "%6.1f fps, %" PRIu64 " frames\n",
+          (r->frames - printFrames) / secs, r->frames);
+      lastPrint   = doneTime;
+      printFrames = r->frames;
+    }
   }
 
-  return 0;
+  r->end = microtime();
+  if (measuring)
+  {
+    if (state.stats)
+    {
+      uint64_t posted, dropped;
+      readHostStats(&posted, &dropped);
+      r->posted    = posted  - r->posted;
+      r->dropped   = dropped - r->dropped;
+      r->haveStats = true;
+    }
+
+    report(r, hostver, sink);
+  }
+  else
+    DEBUG_WARN("Stopped before the warmup finished, nothing was measured");
+
+  recordClose(&rec);
+  free(r);
+  free(buffer);
+  if (csv)
+    fclose(csv);
+
+  lgmpClientUnsubscribe(&frameQueue);
+  lgmpClientFree(&lgmp);
+  return ret;
 }
 
 int main(int argc, char * argv[])
@@ -227,6 +1102,8 @@ int main(int argc, char * argv[])
 
   // init the global state vars
   state.running = true;
+  signal(SIGINT , signalHandler);
+  signal(SIGTERM, signalHandler);
 
   int ret = -1;
   if (ivshmemOpen(&state.shmDev))
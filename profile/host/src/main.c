@@ -0,0 +1,659 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Host
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "interface/capture.h"
+#include "dynamic/capture.h"
+#include "common/debug.h"
+#include "common/version.h"
+#include "common/option.h"
+#include "common/KVMFR.h"
+#include "common/locking.h"
+#include "common/ivshmem.h"
+#include "common/framebuffer.h"
+#include "common/histogram.h"
+#include "common/thread.h"
+#include "common/time.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#define MAX_POINTER_SIZE (512 * 512 * 4)
+
+// the frame data is put on a page boundary as the host does
+#define FRAME_DATA_ALIGN 4096
+
+// a measurement in microseconds
+struct Stat
+{
+  Histogram hist;
+  uint64_t  min, total;
+};
+
+struct Results
+{
+  uint64_t    start, end;
+  uint64_t    frames, bytes;
+  uint64_t    timeouts, reinits, formatChanges, shapes;
+  struct Stat acquire;  // capture(), where the backend takes the frame
+  struct Stat ready;    // capture() returning to waitFrame, the copy and map
+  struct Stat interval; // between frames being ready
+  struct Stat write;    // getFrame, the framebuffer_write into the target
+  struct Stat pointer;  // a shape buffer being taken until it is posted
+};
+
+struct state
+{
+  volatile bool      running;
+  CaptureInterface * iface;
+
+  struct IVSHMEM     shmDev;
+  uint8_t          * mem;
+  FrameBuffer      * fb;
+  size_t             fbSize;
+
+  LGThread         * frameThread;
+  volatile bool      frameRunning;
+  atomic_bool        restart;
+  atomic_bool        measuring;
+  _Atomic(uint64_t)  captureDone;
+
+  LG_Lock            pointerLock;
+  uint8_t          * pointerData;
+  _Atomic(uint64_t)  pointerStart;
+
+  struct Results     r;
+};
+
+struct state state;
+
+static bool optTargetValidate(struct Option * opt, const char ** error)
+{
+  if (strcmp(opt->value.x_string, "ram"    ) == 0 ||
+      strcmp(opt->value.x_string, "ivshmem") == 0)
+    return true;
+
+  *error = "Invalid target, must be one of: ram, ivshmem";
+  return false;
+}
+
+static struct Option options[] =
+{
+  {
+    .module         = "app",
+    .name           = "configFile",
+    .description    = "A file to read additional configuration from",
+    .shortopt       = 'C',
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "profile",
+    .name           = "capture",
+    .description    = "The capture interface to profile, the first that starts if not set",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "profile",
+    .name           = "duration",
+    .description    = "Seconds to measure for (0 = until interrupted)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 30
+  },
+  {
+    .module         = "profile",
+    .name           = "warmup",
+    .description    = "Seconds to discard at the start before measuring",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 2
+  },
+  {
+    .module         = "profile",
+    .name           = "target",
+    .description    = "Where the frames are written (ram = a buffer in memory, ivshmem = the shared memory, which is overwritten)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "ram",
+    .validator      = optTargetValidate
+  },
+  {
+    .module         = "profile",
+    .name           = "writeChunk",
+    .description    = "How many KiB of the frame to copy between progress updates, as app:writeChunk of the host",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 128
+  },
+  {
+    .module         = "profile",
+    .name           = "writeThreads",
+    .description    = "The threads to write each frame with, as app:writeThreads of the host",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 0
+  },
+  {
+    .module         = "profile",
+    .name           = "json",
+    .description    = "Write the summary to this JSON file",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {0}
+};
+
+static bool config_load(int argc, char * argv[])
+{
+  if (!option_parse(argc, argv))
+    return false;
+
+  // if a file was specified to also load, do it
+  const char * configFile = option_get_string("app", "configFile");
+  if (configFile)
+  {
+    DEBUG_INFO("Loading config from: %s", configFile);
+    if (!option_load(configFile))
+      return false;
+  }
+
+  if (!option_validate())
+    return false;
+
+  return true;
+}
+
+static void signalHandler(int sig)
+{
+  state.running = false;
+}
+
+static void stat_add(struct Stat * s, uint64_t value)
+{
+  if (!s->hist.count || value < s->min)
+    s->min = value;
+  s->total += value;
+  histogram_add(&s->hist, value);
+}
+
+static inline bool measuring()
+{
+  return atomic_load_explicit(&state.measuring, memory_order_relaxed);
+}
+
+// the pointer shape is fetched into the buffer between these two calls
+static bool getPointerBuffer(void ** data, uint32_t * size)
+{
+  atomic_store_explicit(&state.pointerStart, microtime(), memory_order_relaxed);
+  *data = state.pointerData;
+  *size = MAX_POINTER_SIZE;
+  return true;
+}
+
+static void postPointerBuffer(CapturePointer pointer)
+{
+  if (!pointer.shapeUpdate)
+    return;
+
+  const uint64_t start = atomic_exchange_explicit(&state.pointerStart, 0,
+      memory_order_relaxed);
+  if (!start || !measuring())
+    return;
+
+  LG_LOCK(state.pointerLock);
+  stat_add(&state.r.pointer, microtime() - start);
+  ++state.r.shapes;
+  LG_UNLOCK(state.pointerLock);
+}
+
+static uint64_t frameBytes(const CaptureFrame * frame)
+{
+  // compressed frames are always sent whole
+  if (frame->format == CAPTURE_FMT_H264)
+    return frame->pitch;
+
+  uint64_t size = (uint64_t)frame->pitch * frame->height;
+  if (frame->format == CAPTURE_FMT_YUV420)
+    size = size * 3 / 2;
+  return size;
+}
+
+// the frames are written whole so every frame costs the same to write
+static int frameThread(void * opaque)
+{
+  uint64_t     lastReady = 0;
+  unsigned int formatVer = 0;
+  bool         haveFormat = false;
+
+  while(state.frameRunning)
+  {
+    CaptureFrame frame;
+    const CaptureResult result = state.iface->waitFrame(&frame);
+    const uint64_t readyTime = microtime();
+
+    switch(result)
+    {
+      case CAPTURE_RESULT_OK:
+        break;
+
+      case CAPTURE_RESULT_TIMEOUT:
+        continue;
+
+      case CAPTURE_RESULT_REINIT:
+        atomic_store(&state.restart, true);
+        return 0;
+
+      case CAPTURE_RESULT_ERROR:
+        DEBUG_ERROR("Failed to get the frame");
+        state.running = false;
+        return 0;
+    }
+
+    const uint64_t size = frameBytes(&frame);
+    if (size > state.fbSize)
+    {
+      DEBUG_ERROR("The frame of %" PRIu64 " bytes is larger than the target",
+          size);
+      state.running = false;
+      return 0;
+    }
+
+    framebuffer_prepare(state.fb);
+    state.iface->getFrame(state.fb, NULL, 0);
+    const uint64_t writeTime = microtime() - readyTime;
+
+    if (!measuring())
+    {
+      lastReady = 0;
+      continue;
+    }
+
+    const uint64_t captureDone = atomic_exchange_explicit(&state.captureDone,
+        0, memory_order_relaxed);
+    if (captureDone && captureDone <= readyTime)
+      stat_add(&state.r.ready, readyTime - captureDone);
+
+    if (lastReady)
+      stat_add(&state.r.interval, readyTime - lastReady);
+    lastReady = readyTime;
+
+    if (haveFormat && frame.formatVer != formatVer)
+      ++state.r.formatChanges;
+    formatVer  = frame.formatVer;
+    haveFormat = true;
+
+    stat_add(&state.r.write, writeTime);
+    state.r.bytes += size;
+    ++state.r.frames;
+  }
+
+  return 0;
+}
+
+static bool startFrameThread()
+{
+  state.frameRunning = true;
+  if (!lgCreateThread("FrameThread", frameThread, NULL, &state.frameThread))
+  {
+    DEBUG_ERROR("Failed to create the frame thread");
+    return false;
+  }
+  return true;
+}
+
+static void stopFrameThread()
+{
+  if (!state.frameThread)
+    return;
+
+  state.frameRunning = false;
+  if (state.iface->wakeFrame)
+    state.iface->wakeFrame();
+  lgJoinThread(state.frameThread, NULL);
+  state.frameThread = NULL;
+}
+
+// the frame data follows the FrameBuffer header on a page boundary
+static bool allocTarget(size_t maxFrameSize)
+{
+  const size_t align = FRAME_DATA_ALIGN;
+  const size_t size  = align + maxFrameSize;
+  uint8_t * base;
+
+  if (strcmp(option_get_string("profile", "target"), "ivshmem") == 0)
+  {
+    if (!ivshmemOpen(&state.shmDev))
+      return false;
+
+    if (state.shmDev.size < size)
+    {
+      DEBUG_ERROR("The shared memory is too small, %u MiB is needed",
+          (unsigned int)(size / 1048576 + 1));
+      return false;
+    }
+
+    DEBUG_WARN("The shared memory is overwritten, no host may be using it");
+    base = state.shmDev.mem;
+  }
+  else
+  {
+    state.mem = malloc(size + align);
+    if (!state.mem)
+    {
+      DEBUG_ERROR("out of memory");
+      return false;
+    }
+    base = (uint8_t *)(((uintptr_t)state.mem + align - 1) & ~(uintptr_t)(align - 1));
+  }
+
+  state.fb     = (FrameBuffer *)(base + align - FrameBufferStructSize);
+  state.fbSize = maxFrameSize;
+  return true;
+}
+
+static bool selectCapture()
+{
+  const char * name = option_get_string("profile", "capture");
+
+  for(int i = 0; CaptureInterfaces[i]; ++i)
+  {
+    CaptureInterface * iface = CaptureInterfaces[i];
+    if (name && strcasecmp(iface->getName(), name) != 0)
+      continue;
+
+    DEBUG_INFO("Trying           : %s", iface->getName());
+    if (!iface->create(getPointerBuffer, postPointerBuffer))
+      continue;
+
+    if (iface->init())
+    {
+      DEBUG_INFO("Using            : %s", iface->getName());
+      state.iface = iface;
+      return true;
+    }
+
+    iface->free();
+  }
+
+  if (name)
+    DEBUG_ERROR("The %s capture interface is not available", name);
+  else
+    DEBUG_ERROR("Failed to find a supported capture interface");
+  return false;
+}
+
+static bool restartCapture()
+{
+  stopFrameThread();
+  if (measuring())
+    ++state.r.reinits;
+
+  if (!state.iface->reinit || !state.iface->reinit())
+  {
+    if (!state.iface->deinit())
+    {
+      DEBUG_ERROR("Failed to deinitialize the capture interface");
+      return false;
+    }
+
+    if (!state.iface->init())
+    {
+      DEBUG_ERROR("Failed to reinitialize the capture interface");
+      return false;
+    }
+  }
+
+  if (state.iface->getMaxFrameSize() > state.fbSize)
+  {
+    DEBUG_ERROR("The frames are now larger than the target");
+    return false;
+  }
+
+  atomic_store(&state.restart, false);
+  return startFrameThread();
+}
+
+static void printStat(const char * name, const struct Stat * s)
+{
+  if (!s->hist.count)
+  {
+    DEBUG_INFO("%-10s: no samples", name);
+    return;
+  }
+
+  DEBUG_INFO("%-10s: min %7" PRIu64 " p50 %7" PRIu64 " p90 %7" PRIu64
+      " p99 %7" PRIu64 " p99.9 %7" PRIu64 " max %7" PRIu64 " mean %9.1f us",
+      name, s->min,
+      histogram_percentile(&s->hist, 50.0),
+      histogram_percentile(&s->hist, 90.0),
+      histogram_percentile(&s->hist, 99.0),
+      histogram_percentile(&s->hist, 99.9),
+      s->hist.max,
+      (double)s->total / s->hist.count);
+}
+
+static void writeStat(FILE * fp, const char * name, const struct Stat * s,
+    bool last)
+{
+  if (!s->hist.count)
+  {
+    fprintf(fp, "  \"%s\": null%s\n", name, last ? "" : ",");
+    return;
+  }
+
+  fprintf(fp,
+      "  \"%s\": {\"count\": %" PRIu64 ", \"min\": %" PRIu64
+      ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64
+      ", \"p99_9\": %" PRIu64 ", \"max\": %" PRIu64 ", \"mean\": %.1f}%s\n",
+      name, s->hist.count, s->min,
+      histogram_percentile(&s->hist, 50.0),
+      histogram_percentile(&s->hist, 90.0),
+      histogram_percentile(&s->hist, 99.0),
+      histogram_percentile(&s->hist, 99.9),
+      s->hist.max,
+      (double)s->total / s->hist.count,
+      last ? "" : ",");
+}
+
+static void report(const struct Results * r)
+{
+  const char * capture    = state.iface->getName();
+  const char * target     = option_get_string("profile", "target");
+  const double seconds    = (r->end - r->start) / 1e6;
+  const double fps        = seconds > 0.0 ? r->frames / seconds : 0.0;
+  const double throughput = r->write.total ?
+    (double)r->bytes / r->write.total : 0.0; // bytes per us is MB/s
+
+  DEBUG_INFO("Measured %" PRIu64 " frames over %.2f s (%.2f fps), capture: %s, "
+      "target: %s", r->frames, seconds, fps, capture, target);
+  printStat("acquire" , &r->acquire );
+  printStat("ready"   , &r->ready   );
+  printStat("interval", &r->interval);
+  printStat("write"   , &r->write   );
+  printStat("pointer" , &r->pointer );
+  DEBUG_INFO("Write throughput: %.1f MB/s", throughput);
+  DEBUG_INFO("Timeouts: %" PRIu64 ", reinits: %" PRIu64 ", format changes: %"
+      PRIu64 ", shapes: %" PRIu64,
+      r->timeouts, r->reinits, r->formatChanges, r->shapes);
+
+  const char * path = option_get_string("profile", "json");
+  if (!path)
+    return;
+
+  FILE * fp = fopen(path, "w");
+  if (!fp)
+  {
+    DEBUG_ERROR("Failed to open the JSON file: %s", path);
+    return;
+  }
+
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"version\": \"%s\",\n", BUILD_VERSION);
+  fprintf(fp, "  \"capture\": \"%s\",\n", capture);
+  fprintf(fp, "  \"target\": \"%s\",\n", target);
+  fprintf(fp, "  \"seconds\": %.3f,\n", seconds);
+  fprintf(fp, "  \"frames\": %" PRIu64 ",\n", r->frames);
+  fprintf(fp, "  \"fps\": %.3f,\n", fps);
+  fprintf(fp, "  \"timeouts\": %" PRIu64 ",\n", r->timeouts);
+  fprintf(fp, "  \"reinits\": %" PRIu64 ",\n", r->reinits);
+  fprintf(fp, "  \"format_changes\": %" PRIu64 ",\n", r->formatChanges);
+  fprintf(fp, "  \"shapes\": %" PRIu64 ",\n", r->shapes);
+  fprintf(fp, "  \"bytes\": %" PRIu64 ",\n", r->bytes);
+  fprintf(fp, "  \"write_mbps\": %.1f,\n", throughput);
+  writeStat(fp, "acquire_us" , &r->acquire , false);
+  writeStat(fp, "ready_us"   , &r->ready   , false);
+  writeStat(fp, "interval_us", &r->interval, false);
+  writeStat(fp, "write_us"   , &r->write   , false);
+  writeStat(fp, "pointer_us" , &r->pointer , true );
+  fprintf(fp, "}\n");
+  fclose(fp);
+
+  DEBUG_INFO("Summary written to: %s", path);
+}
+
+static int run()
+{
+  if (!selectCapture())
+    return -1;
+
+  int ret = -1;
+  const uint64_t maxFrameSize = state.iface->getMaxFrameSize();
+  DEBUG_INFO("Max Frame Size   : %" PRIu64 " MiB", maxFrameSize / 1048576);
+  if (!allocTarget(maxFrameSize))
+    goto out;
+
+  if (!startFrameThread())
+    goto out;
+
+  const uint64_t warmup   = option_get_int("profile", "warmup"  ) * 1000000ULL;
+  const uint64_t duration = option_get_int("profile", "duration") * 1000000ULL;
+  const uint64_t begin    = microtime();
+  DEBUG_INFO("Warming up for %" PRIu64 " s", warmup / 1000000);
+
+  while(state.running)
+  {
+    uint64_t now = microtime();
+    if (!measuring() && now >= begin + warmup)
+    {
+      DEBUG_INFO("Measuring");
+      state.r.start = now;
+      atomic_store(&state.measuring, true);
+    }
+
+    if (measuring() && duration && now >= state.r.start + duration)
+      break;
+
+    if (atomic_load(&state.restart) && !restartCapture())
+      goto stop;
+
+    const CaptureResult result = state.iface->capture();
+    const uint64_t done = microtime();
+
+    switch(result)
+    {
+      case CAPTURE_RESULT_OK:
+        if (measuring())
+        {
+          stat_add(&state.r.acquire, done - now);
+          atomic_store_explicit(&state.captureDone, done,
+              memory_order_relaxed);
+        }
+        break;
+
+      case CAPTURE_RESULT_TIMEOUT:
+        if (measuring())
+          ++state.r.timeouts;
+        break;
+
+      case CAPTURE_RESULT_REINIT:
+        atomic_store(&state.restart, true);
+        break;
+
+      case CAPTURE_RESULT_ERROR:
+        DEBUG_ERROR("Capture interface reported a fatal error");
+        goto stop;
+    }
+  }
+
+  state.r.end = microtime();
+  ret = 0;
+
+stop:
+  state.iface->stop();
+  stopFrameThread();
+
+  if (ret == 0)
+  {
+    if (measuring())
+      report(&state.r);
+    else
+      DEBUG_WARN("Stopped before the warmup was over, nothing was measured");
+  }
+
+out:
+  state.iface->deinit();
+  state.iface->free();
+  return ret;
+}
+
+int main(int argc, char * argv[])
+{
+  DEBUG_INFO("Looking Glass Host Capture Profiler (%s)", BUILD_VERSION);
+
+  option_register(options);
+  ivshmemOptionsInit();
+
+  for(int i = 0; CaptureInterfaces[i]; ++i)
+    if (CaptureInterfaces[i]->initOptions)
+      CaptureInterfaces[i]->initOptions();
+
+  if (!config_load(argc, argv))
+  {
+    option_free();
+    return -1;
+  }
+
+  framebuffer_set_write_chunk(option_get_int("profile", "writeChunk") * 1024);
+  if (!framebuffer_set_write_threads(option_get_int("profile", "writeThreads"), 0))
+    DEBUG_WARN("Failed to start the frame write threads, using a single thread");
+
+  state.pointerData = malloc(MAX_POINTER_SIZE);
+  if (!state.pointerData)
+  {
+    DEBUG_ERROR("out of memory");
+    option_free();
+    return -1;
+  }
+
+  LG_LOCK_INIT(state.pointerLock);
+  state.running = true;
+  signal(SIGINT , signalHandler);
+  signal(SIGTERM, signalHandler);
+
+  const int ret = run();
+
+  framebuffer_set_write_threads(0, 0);
+  if (state.shmDev.mem)
+    ivshmemClose(&state.shmDev);
+  free(state.mem);
+  free(state.pointerData);
+  option_free();
+  return ret;
+}
@@ -0,0 +1,54 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include "common/framebuffer.h"
+#include "common/tilecodec.h"
+
+typedef struct TileEncoder TileEncoder;
+
+/**
+ * Create an encoder that codes the tiles of a frame on threads workers and
+ * the caller
+ */
+bool tileenc_new(TileEncoder ** enc, int threads);
+void tileenc_free(TileEncoder ** enc);
+
+/**
+ * Start coding the tiles of the rects of the frame, each is coded once the
+ * host has written it. Returns the number of tiles, zero if out of memory
+ */
+unsigned int tileenc_start(TileEncoder * enc, const FrameBuffer * fb,
+    size_t pitch, const FrameDamageRect * rects, unsigned int count,
+    unsigned int width, unsigned int height);
+
+/**
+ * Wait for the tile at index to be coded, the caller codes tiles while it
+ * waits. The data is valid until the next tileenc_start
+ */
+const TileHeader * tileenc_get(TileEncoder * enc, unsigned int index,
+    const uint8_t ** data);
+
+/**
+ * Wait for the workers to be done with the frame, this must be called before
+ * the frame is released. Returns false if the frame was not all written
+ */
+bool tileenc_finish(TileEncoder * enc);
@@ -0,0 +1,255 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "encoder.h"
+#include "common/debug.h"
+#include "common/event.h"
+#include "common/thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+struct TileJob
+{
+  TileHeader  hdr;
+  size_t      end; // the frame data needed for the tile
+  atomic_bool done;
+};
+
+struct TileWorker
+{
+  TileEncoder * enc;
+  LGThread    * thread;
+  LGEvent     * start;
+};
+
+struct TileEncoder
+{
+  int                 threads;
+  struct TileWorker * workers;
+  volatile bool       running;
+  LGEvent           * doneEvent;
+
+  // the frame being coded
+  const FrameBuffer * fb;
+  const uint8_t     * data;
+  size_t              pitch;
+  unsigned int        count;
+  atomic_uint         next;
+  atomic_int          active;
+  atomic_bool         timedOut;
+
+  struct TileJob    * jobs;
+  unsigned int        jobsSize;
+  uint8_t           * buffer;
+};
+
+// every tile has room for the largest a tile can code to
+#define SLOT_SIZE tilecodec_maxSize(TILECODEC_SIZE, TILECODEC_SIZE)
+
+static void codeTile(TileEncoder * enc, unsigned int index)
+{
+  struct TileJob * job = &enc->jobs[index];
+  if (!framebuffer_wait(enc->fb, job->end))
+    atomic_store(&enc->timedOut, true);
+
+  job->hdr.size = tilecodec_encode(
+      enc->data + (size_t)job->hdr.y * enc->pitch + (size_t)job->hdr.x * 4,
+      enc->pitch, job->hdr.width, job->hdr.height,
+      enc->buffer + (size_t)index * SLOT_SIZE);
+
+  atomic_store_explicit(&job->done, true, memory_order_release);
+  lgSignalEvent(enc->doneEvent);
+}
+
+static inline bool claimTile(TileEncoder * enc, unsigned int * index)
+{
+  *index = atomic_fetch_add(&enc->next, 1);
+  return *index < enc->count;
+}
+
+static int workerThread(void * opaque)
+{
+  struct TileWorker * worker = (struct TileWorker *)opaque;
+  TileEncoder       * enc    = worker->enc;
+
+  while(lgWaitEvent(worker->start, TIMEOUT_INFINITE) && enc->running)
+  {
+    unsigned int index;
+    while(claimTile(enc, &index))
+      codeTile(enc, index);
+
+    if (atomic_fetch_sub(&enc->active, 1) == 1)
+      lgSignalEvent(enc->doneEvent);
+  }
+
+  return 0;
+}
+
+bool tileenc_new(TileEncoder ** out, int threads)
+{
+  TileEncoder * enc = (TileEncoder *)calloc(1, sizeof(*enc));
+  if (!enc)
+  {
+    DEBUG_ERROR("Out of memory");
+    return false;
+  }
+
+  *out         = enc;
+  enc->running = true;
+  if (!(enc->doneEvent = lgCreateEvent(true, 0)))
+  {
+    DEBUG_ERROR("Failed to create the encoder event");
+    tileenc_free(out);
+    return false;
+  }
+
+  if (threads > 0 &&
+      !(enc->workers = (struct TileWorker *)calloc(threads, sizeof(*enc->workers))))
+  {
+    DEBUG_ERROR("Out of memory");
+    tileenc_free(out);
+    return false;
+  }
+
+  for(int i = 0; i < threads; ++i)
+  {
+    struct TileWorker * worker = &enc->workers[i];
+    worker->enc = enc;
+    if (!(worker->start = lgCreateEvent(true, 0)) ||
+        !lgCreateThread("tileEncoder", workerThread, worker, &worker->thread))
+    {
+      DEBUG_ERROR("Failed to create the encoder thread");
+      if (worker->start)
+        lgFreeEvent(worker->start);
+      tileenc_free(out);
+      return false;
+    }
+    ++enc->threads;
+  }
+
+  return true;
+}
+
+void tileenc_free(TileEncoder ** enc)
+{
+  if (!*enc)
+    return;
+
+  TileEncoder * e = *enc;
+  e->running = false;
+  for(int i = 0; i < e->threads; ++i)
+  {
+    lgSignalEvent(e->workers[i].start);
+    lgJoinThread(e->workers[i].thread, NULL);
+    lgFreeEvent(e->workers[i].start);
+  }
+
+  if (e->doneEvent)
+    lgFreeEvent(e->doneEvent);
+
+  free(e->workers);
+  free(e->jobs);
+  free(e->buffer);
+  free(e);
+  *enc = NULL;
+}
+
+unsigned int tileenc_start(TileEncoder * enc, const FrameBuffer * fb,
+    size_t pitch, const FrameDamageRect * rects, unsigned int count,
+    unsigned int width, unsigned int height)
+{
+  const unsigned int tiles = tilecodec_count(rects, count, width, height);
+  if (tiles > enc->jobsSize)
+  {
+    free(enc->jobs);
+    free(enc->buffer);
+    enc->jobs   = (struct TileJob *)malloc(tiles * sizeof(*enc->jobs));
+    enc->buffer = (uint8_t *)malloc(tiles * SLOT_SIZE);
+    if (!enc->jobs || !enc->buffer)
+    {
+      DEBUG_ERROR("Out of memory");
+      free(enc->jobs);
+      free(enc->buffer);
+      enc->jobs     = NULL;
+      enc->buffer   = NULL;
+      enc->jobsSize = 0;
+      return 0;
+    }
+    enc->jobsSize = tiles;
+  }
+
+  for(unsigned int i = 0; i < tiles; ++i)
+  {
+    const FrameDamageRect r = tilecodec_tile(rects, count, width, height, i);
+    struct TileJob * job = &enc->jobs[i];
+    job->hdr = (TileHeader)
+    {
+      .x      = r.x,
+      .y      = r.y,
+      .width  = r.width,
+      .height = r.height
+    };
+    job->end = (size_t)(r.y + r.height - 1) * pitch + (size_t)(r.x + r.width) * 4;
+    atomic_store_explicit(&job->done, false, memory_order_relaxed);
+  }
+
+  enc->fb    = fb;
+  enc->data  = framebuffer_get_data(fb);
+  enc->pitch = pitch;
+  enc->count = tiles;
+  atomic_store(&enc->next    , 0);
+  atomic_store(&enc->timedOut, false);
+  atomic_store(&enc->active  , enc->threads);
+
+  for(int i = 0; i < enc->threads; ++i)
+    lgSignalEvent(enc->workers[i].start);
+
+  return tiles;
+}
+
+const TileHeader * tileenc_get(TileEncoder * enc, unsigned int index,
+    const uint8_t ** data)
+{
+  struct TileJob * job = &enc->jobs[index];
+  while(!atomic_load_explicit(&job->done, memory_order_acquire))
+  {
+    unsigned int next;
+    if (claimTile(enc, &next))
+      codeTile(enc, next);
+    else
+      lgWaitEvent(enc->doneEvent, 1);
+  }
+
+  *data = enc->buffer + (size_t)index * SLOT_SIZE;
+  return &job->hdr;
+}
+
+bool tileenc_finish(TileEncoder * enc)
+{
+  unsigned int index;
+  while(claimTile(enc, &index))
+    codeTile(enc, index);
+
+  while(atomic_load(&enc->active) > 0)
+    lgWaitEvent(enc->doneEvent, 1);
+
+  return !atomic_load(&enc->timedOut);
+}
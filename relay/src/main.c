@@ -0,0 +1,1099 @@
+/*
+Looking Glass - KVM FrameRelay (KVMFR) Client
+Copyright (C) 2017-2019 Geoffrey McRae <geoff@hostfission.com>
+https://looking-glass.hostfission.com
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "common/debug.h"
+#include "common/option.h"
+#include "common/crash.h"
+#include "common/KVMFR.h"
+#include "common/KVMFRRelay.h"
+#include "common/stringutils.h"
+#include "common/ivshmem.h"
+#include "common/framebuffer.h"
+#include "encoder.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pwd.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+
+#include <lgmp/client.h>
+
+/*
+ * Relays the frames and cursor of a local host to the Relay capture of a
+ * remote host over TCP, the clients of the remote host then see the desktop
+ * of this one.
+ *
+ * The frame data is sent straight out of the shared memory as the host
+ * writes it, each part is sent as soon as framebuffer_wait says it is there
+ * so the network transfer overlaps the host's copy. With relay:zeroCopy the
+ * kernel sends from the shared memory pages without copying them, the frame
+ * is then held until the kernel is done with it.
+ *
+ * With relay:compress the damage is split into tiles that are coded on the
+ * encoder threads as the host writes them, and sent in order as each is
+ * done.
+ */
+
+// the most rows sent in one FRAME_DATA message for a damage payload
+#define RELAY_IOV 64
+
+struct state
+{
+  volatile bool  running;
+  struct IVSHMEM shmDev;
+  size_t         chunk;
+  unsigned int   pollInterval;
+  bool           aux;
+  bool           zeroCopy;
+  TileEncoder  * encoder;
+};
+
+struct state state;
+
+// a cursor shape kept so a cached shape can be sent in full
+struct RelayShape
+{
+  KVMFRRecordCursor info;
+  uint8_t         * data;
+  size_t            size;
+};
+
+struct Conn
+{
+  int                       fd;
+  bool                      zeroCopy;
+  uint32_t                  zcSent, zcDone;
+
+  PLGMPClientQueue          frameQueue;
+  PLGMPClientQueue          pointerQueue;
+  volatile KVMFRCursorPos * cursorPos;
+  uint32_t                  cursorSerial;
+  struct RelayShape         shapes[KVMFR_CURSOR_CACHE];
+
+  bool                      helloSent;
+  bool                      needFull;
+  bool                      serialValid;
+  uint32_t                  frameSerial;
+  uint32_t                  formatVer;
+  uint64_t                  frames, bytes;
+};
+
+enum ServeResult
+{
+  SERVE_DISCONNECTED,
+  SERVE_RESTART,
+  SERVE_ERROR
+};
+
+static bool optQueueValidate(struct Option * opt, const char ** error)
+{
+  if (strcmp(opt->value.x_string, "frame") == 0 ||
+      strcmp(opt->value.x_string, "aux"  ) == 0)
+    return true;
+
+  *error = "Invalid queue, must be one of: frame, aux";
+  return false;
+}
+
+static bool optChunkValidate(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_int >= 4 && opt->value.x_int <= 65536)
+    return true;
+
+  *error = "The chunk size must be between 4 and 65536 KiB";
+  return false;
+}
+
+static struct Option options[] =
+{
+  {
+    .module         = "app",
+    .name           = "configFile",
+    .description    = "A file to read additional configuration from",
+    .shortopt       = 'C',
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "relay",
+    .name           = "listen",
+    .description    = "The address to accept the remote host on",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "127.0.0.1"
+  },
+  {
+    .module         = "relay",
+    .name           = "port",
+    .description    = "The port to accept the remote host on",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = KVMFR_RELAY_PORT
+  },
+  {
+    .module         = "relay",
+    .name           = "queue",
+    .description    = "The frames to send (frame = with damage, holds back a slow local client; aux = every frame whole, never holds back a local client)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "frame",
+    .validator      = optQueueValidate
+  },
+  {
+    .module         = "relay",
+    .name           = "chunk",
+    .description    = "The KiB of frame data to send at a time",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 256,
+    .validator      = optChunkValidate
+  },
+  {
+    .module         = "relay",
+    .name           = "zeroCopy",
+    .description    = "Send the frame data from the shared memory without the kernel copying it (MSG_ZEROCOPY)",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false
+  },
+  {
+    .module         = "relay",
+    .name           = "compress",
+    .description    = "Code the 32 bit frames with the lossless tile codec",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = true
+  },
+  {
+    .module         = "relay",
+    .name           = "threads",
+    .description    = "The threads to code the tiles on as well as the relay thread",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 2
+  },
+  {
+    .module         = "relay",
+    .name           = "pollInterval",
+    .description    = "How long to sleep in microseconds when there are no updates",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 1000
+  },
+  {0}
+};
+
+static bool config_load(int argc, char * argv[])
+{
+  // load any global options first
+  struct stat st;
+  if (stat("/etc/looking-glass-relay.ini", &st) >= 0)
+  {
+    DEBUG_INFO("Loading config from: /etc/looking-glass-relay.ini");
+    if (!option_load("/etc/looking-glass-relay.ini"))
+      return false;
+  }
+
+  // load user's local options
+  struct passwd * pw = getpwuid(getuid());
+  char * localFile;
+  alloc_sprintf(&localFile, "%s/.looking-glass-relay.ini", pw->pw_dir);
+  if (stat(localFile, &st) >= 0)
+  {
+    DEBUG_INFO("Loading config from: %s", localFile);
+    if (!option_load(localFile))
+    {
+      free(localFile);
+      return false;
+    }
+  }
+  free(localFile);
+
+  if (!option_parse(argc, argv))
+    return false;
+
+  // if a file was specified to also load, do it
+  const char * configFile = option_get_string("app", "configFile");
+  if (configFile)
+  {
+    DEBUG_INFO("Loading config from: %s", configFile);
+    if (!option_load(configFile))
+      return false;
+  }
+
+  if (!option_validate())
+    return false;
+
+  return true;
+}
+
+static void signalHandler(int sig)
+{
+  state.running = false;
+}
+
+// the frame data as rows of pitch bytes, zero if the type is unknown
+static size_t frameRows(const KVMFRFrame * frame)
+{
+  switch(frame->type)
+  {
+    case FRAME_TYPE_BGRA:
+    case FRAME_TYPE_RGBA:
+    case FRAME_TYPE_RGBA10:
+    case FRAME_TYPE_RGBA16F:
+      return frame->height;
+
+    // the chroma planes follow the luma with half the pitch
+    case FRAME_TYPE_YUV420:
+      return frame->height + frame->height / 2;
+
+    // the pitch is the size of the access unit
+    case FRAME_TYPE_H264:
+      return 1;
+
+    default:
+      return 0;
+  }
+}
+
+static unsigned int frameBpp(const KVMFRFrame * frame)
+{
+  switch(frame->type)
+  {
+    case FRAME_TYPE_BGRA:
+    case FRAME_TYPE_RGBA:
+    case FRAME_TYPE_RGBA10:
+      return 4;
+
+    case FRAME_TYPE_RGBA16F:
+      return 8;
+
+    default:
+      return 0;
+  }
+}
+
+// wait for the kernel to finish with the pages of the zero copy sends, it
+// reports the sends it is done with as ranges on the error queue
+static bool connReapZeroCopy(struct Conn * conn)
+{
+  while(conn->zcDone != conn->zcSent)
+  {
+    struct pollfd pfd = { .fd = conn->fd };
+    const int ret = poll(&pfd, 1, 1000);
+    if (ret < 0 && errno != EINTR)
+    {
+      DEBUG_ERROR("poll failed: %s", strerror(errno));
+      return false;
+    }
+
+    if (!state.running)
+      return false;
+
+    if (ret <= 0)
+      continue;
+
+    char control[128];
+    struct msghdr mh =
+    {
+      .msg_control    = control,
+      .msg_controllen = sizeof(control)
+    };
+
+    if (recvmsg(conn->fd, &mh, MSG_ERRQUEUE) < 0)
+    {
+      if (errno == EAGAIN || errno == EINTR)
+        continue;
+
+      DEBUG_ERROR("Lost the remote host: %s", strerror(errno));
+      return false;
+    }
+
+    for(struct cmsghdr * cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm))
+    {
+      if (!(cm->cmsg_level == SOL_IP   && cm->cmsg_type == IP_RECVERR  ) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+        continue;
+
+      const struct sock_extended_err * ee =
+        (const struct sock_extended_err *)CMSG_DATA(cm);
+      if (ee->ee_origin == SO_EE_ORIGIN_ZEROCOPY && ee->ee_errno == 0)
+        conn->zcDone = ee->ee_data + 1;
+    }
+  }
+
+  return true;
+}
+
+// send all of iov, it is modified to track the progress
+static bool connSend(struct Conn * conn, struct iovec * iov, int count,
+    bool zeroCopy)
+{
+  zeroCopy = zeroCopy && conn->zeroCopy;
+
+  struct msghdr mh =
+  {
+    .msg_iov    = iov,
+    .msg_iovlen = count
+  };
+
+  while(mh.msg_iovlen)
+  {
+    ssize_t sent = sendmsg(conn->fd, &mh,
+        MSG_NOSIGNAL | (zeroCopy ? MSG_ZEROCOPY : 0));
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      // the kernel limits the pages that can be pinned at once
+      if (errno == ENOBUFS && zeroCopy)
+      {
+        if (!connReapZeroCopy(conn))
+          return false;
+        continue;
+      }
+
+      DEBUG_ERROR("Lost the remote host: %s", strerror(errno));
+      return false;
+    }
+
+    if (zeroCopy)
+      ++conn->zcSent;
+
+    while(mh.msg_iovlen && (size_t)sent >= mh.msg_iov->iov_len)
+    {
+      sent -= mh.msg_iov->iov_len;
+      ++mh.msg_iov;
+      --mh.msg_iovlen;
+    }
+
+    if (sent)
+    {
+      mh.msg_iov->iov_base  = (uint8_t *)mh.msg_iov->iov_base + sent;
+      mh.msg_iov->iov_len  -= sent;
+    }
+  }
+
+  return true;
+}
+
+static bool sendMsg(struct Conn * conn, KVMFRRelayType type,
+    const void * data, size_t size)
+{
+  KVMFRRelayMsg hdr = { .type = type, .size = size };
+  struct iovec iov[] =
+  {
+    { .iov_base = &hdr        , .iov_len = sizeof(hdr) },
+    { .iov_base = (void *)data, .iov_len = size        }
+  };
+  return connSend(conn, iov, size ? 2 : 1, false);
+}
+
+static bool sendShape(struct Conn * conn, const struct RelayShape * shape)
+{
+  KVMFRRelayMsg hdr =
+  {
+    .type = KVMFR_RELAY_CURSOR_SHAPE,
+    .size = sizeof(shape->info) + shape->size
+  };
+
+  struct iovec iov[] =
+  {
+    { .iov_base = &hdr                , .iov_len = sizeof(hdr)         },
+    { .iov_base = (void *)&shape->info, .iov_len = sizeof(shape->info) },
+    { .iov_base = shape->data         , .iov_len = shape->size         }
+  };
+  return connSend(conn, iov, 3, false);
+}
+
+// send the cursor shapes and the latest position, see readCursorPos in the
+// client for the position
+static bool sendPointer(struct Conn * conn)
+{
+  LGMPMessage msg;
+  while(conn->pointerQueue &&
+      lgmpClientProcess(conn->pointerQueue, &msg) == LGMP_OK)
+  {
+    const KVMFRCursor * cursor = (const KVMFRCursor *)msg.mem;
+    if (!(msg.udata & CURSOR_FLAG_SHAPE) || cursor->cacheID >= KVMFR_CURSOR_CACHE)
+    {
+      lgmpClientMessageDone(conn->pointerQueue);
+      continue;
+    }
+
+    struct RelayShape * shape = &conn->shapes[cursor->cacheID];
+    if (!(msg.udata & CURSOR_FLAG_CACHED))
+    {
+      const size_t size = (size_t)cursor->height * cursor->pitch;
+      if (size > msg.size - sizeof(*cursor))
+      {
+        DEBUG_WARN("Invalid cursor shape size, skipping");
+        lgmpClientMessageDone(conn->pointerQueue);
+        continue;
+      }
+
+      if (size > shape->size)
+      {
+        free(shape->data);
+        if (!(shape->data = malloc(size)))
+        {
+          DEBUG_ERROR("Out of memory");
+          shape->size = 0;
+          lgmpClientMessageDone(conn->pointerQueue);
+          continue;
+        }
+      }
+
+      shape->info = (KVMFRRecordCursor)
+      {
+        .type   = cursor->type,
+        .hx     = cursor->hx,
+        .hy     = cursor->hy,
+        .width  = cursor->width,
+        .height = cursor->height,
+        .pitch  = cursor->pitch
+      };
+      shape->size = size;
+      memcpy(shape->data, cursor + 1, size);
+    }
+    lgmpClientMessageDone(conn->pointerQueue);
+
+    if (shape->data && !sendShape(conn, shape))
+      return false;
+  }
+
+  volatile KVMFRCursorPos * pos = conn->cursorPos;
+  if (!pos)
+    return true;
+
+  KVMFRCursorPos copy;
+  copy.serial = pos->serial;
+  if (copy.serial == conn->cursorSerial || (copy.serial & 1))
+    return true;
+
+  atomic_thread_fence(memory_order_acquire);
+  copy.x       = pos->x;
+  copy.y       = pos->y;
+  copy.visible = pos->visible;
+  atomic_thread_fence(memory_order_acquire);
+  if (pos->serial != copy.serial)
+    return true;
+
+  conn->cursorSerial = copy.serial;
+  return sendMsg(conn, KVMFR_RELAY_CURSOR_POS, &copy, sizeof(copy));
+}
+
+// send the parts of the frame in iov once the host has written up to end,
+// iov[0] is left for the message header. Coded tiles have no fb to wait for
+static bool sendData(struct Conn * conn, const FrameBuffer * fb,
+    struct iovec * iov, int count, size_t size, size_t end)
+{
+  if (fb && !framebuffer_wait(fb, end))
+  {
+    // the stream must stay in step so what is there is sent, the next frame
+    // then replaces all of it
+    DEBUG_WARN("Timed out waiting for the frame data");
+    conn->needFull = true;
+  }
+
+  KVMFRRelayMsg hdr = { .type = KVMFR_RELAY_FRAME_DATA, .size = size };
+  iov[0] = (struct iovec){ .iov_base = &hdr, .iov_len = sizeof(hdr) };
+
+  // the kernel reads zero copy sends later, the header on the stack must be
+  // copied by a send of its own
+  if (conn->zeroCopy)
+  {
+    if (!connSend(conn, iov, 1, false) ||
+        !connSend(conn, iov + 1, count - 1, true))
+      return false;
+  }
+  else if (!connSend(conn, iov, count, false))
+    return false;
+
+  // keep the cursor moving while a large frame goes out
+  return sendPointer(conn);
+}
+
+// send the coded tiles in order as they are done, the encoder threads wait
+// for the host to write each tile
+static bool sendTiles(struct Conn * conn, unsigned int tiles, size_t * coded)
+{
+  struct iovec iov[RELAY_IOV + 1];
+  int    n    = 1;
+  size_t size = 0;
+
+  *coded = 0;
+  for(unsigned int i = 0; i < tiles; ++i)
+  {
+    const uint8_t    * data;
+    const TileHeader * hdr = tileenc_get(state.encoder, i, &data);
+    iov[n++] = (struct iovec){ .iov_base = (void *)hdr , .iov_len = sizeof(*hdr) };
+    iov[n++] = (struct iovec){ .iov_base = (void *)data, .iov_len = hdr->size    };
+    size    += sizeof(*hdr) + hdr->size;
+
+    if (n >= RELAY_IOV || size >= state.chunk || i == tiles - 1)
+    {
+      if (!sendData(conn, NULL, iov, n, size, 0))
+        return false;
+      *coded += size;
+      n       = 1;
+      size    = 0;
+    }
+  }
+
+  return true;
+}
+
+// the damage only holds from the frame before, if a frame was missed or the
+// format changed the whole frame is sent
+static bool sendFrame(struct Conn * conn, const KVMFRFrame * frame,
+    const FrameBuffer * fb, size_t dataSize)
+{
+  const unsigned int bpp = frameBpp(frame);
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+  uint32_t count = frame->damageRectsCount;
+  if (count > KVMFR_MAX_DAMAGE_RECTS || state.aux)
+    count = 0;
+
+  // keep the rects inside the frame so the remote host can trust them
+  uint32_t valid = 0;
+  size_t   damageSize = 0;
+  for(uint32_t i = 0; i < count; ++i)
+  {
+    FrameDamageRect r = frame->damageRects[i];
+    if (r.x >= frame->width || r.y >= frame->height)
+      continue;
+    if (r.width  > frame->width  - r.x) r.width  = frame->width  - r.x;
+    if (r.height > frame->height - r.y) r.height = frame->height - r.y;
+    if (!r.width || !r.height)
+      continue;
+    rects[valid++] = r;
+    damageSize += (size_t)r.width * r.height * bpp;
+  }
+
+  // if every rect was outside of the frame treat it as a full update
+  count = valid;
+
+  KVMFRRecordPayload payload = KVMFR_PAYLOAD_DAMAGE;
+  if (conn->needFull || !bpp || !count || frame->formatVer != conn->formatVer ||
+      damageSize >= dataSize)
+  {
+    payload = KVMFR_PAYLOAD_FULL;
+    count   = 0;
+  }
+
+  // the codec only takes 32 bit pixels, no rects is the whole frame
+  unsigned int tiles = 0;
+  if (state.encoder && bpp == 4 &&
+      (tiles = tileenc_start(state.encoder, fb, frame->pitch, rects, count,
+          frame->width, frame->height)))
+    payload = KVMFR_PAYLOAD_TILES;
+
+  KVMFRRecordFrame info =
+  {
+    .formatVer        = frame->formatVer,
+    .type             = frame->type,
+    .width            = frame->width,
+    .height           = frame->height,
+    .screenWidth      = frame->screenWidth,
+    .screenHeight     = frame->screenHeight,
+    .stride           = frame->stride,
+    .pitch            = frame->pitch,
+    .dataSize         = dataSize,
+    .payload          = payload,
+    .bpp              = bpp,
+    .damageRectsCount = count
+  };
+
+  KVMFRRelayMsg hdr =
+  {
+    .type = KVMFR_RELAY_FRAME,
+    .size = sizeof(info) + count * sizeof(*rects)
+  };
+
+  struct iovec iov[RELAY_IOV + 1] =
+  {
+    { .iov_base = &hdr  , .iov_len = sizeof(hdr)            },
+    { .iov_base = &info , .iov_len = sizeof(info)           },
+    { .iov_base = rects , .iov_len = count * sizeof(*rects) }
+  };
+  if (!connSend(conn, iov, count ? 3 : 2, false))
+  {
+    if (tiles)
+      tileenc_finish(state.encoder);
+    return false;
+  }
+
+  conn->needFull  = false;
+  conn->formatVer = frame->formatVer;
+
+  const uint8_t * data = framebuffer_get_data(fb);
+  size_t sent = payload == KVMFR_PAYLOAD_FULL ? dataSize : damageSize;
+  if (payload == KVMFR_PAYLOAD_TILES)
+  {
+    const bool ok = sendTiles(conn, tiles, &sent);
+
+    // the workers must be done with the frame before it is released
+    if (!tileenc_finish(state.encoder))
+    {
+      DEBUG_WARN("Timed out waiting for the frame data");
+      conn->needFull = true;
+    }
+
+    if (!ok)
+      return false;
+  }
+  else if (payload == KVMFR_PAYLOAD_FULL)
+  {
+    for(size_t offset = 0; offset < dataSize; offset += state.chunk)
+    {
+      const size_t len = dataSize - offset < state.chunk ?
+        dataSize - offset : state.chunk;
+      iov[1] = (struct iovec)
+      {
+        .iov_base = (void *)(data + offset),
+        .iov_len  = len
+      };
+      if (!sendData(conn, fb, iov, 2, len, offset + len))
+        return false;
+    }
+  }
+  else
+  {
+    // the rows of each rect in order, batched so each message is a chunk
+    int    n    = 1;
+    size_t size = 0;
+    size_t end  = 0;
+    for(uint32_t i = 0; i < count; ++i)
+    {
+      const FrameDamageRect * r   = &rects[i];
+      const size_t            len = (size_t)r->width * bpp;
+      size_t offset = (size_t)r->y * frame->pitch + (size_t)r->x * bpp;
+      for(uint32_t y = 0; y < r->height; ++y, offset += frame->pitch)
+      {
+        iov[n++] = (struct iovec)
+        {
+          .iov_base = (void *)(data + offset),
+          .iov_len  = len
+        };
+        size += len;
+        if (offset + len > end)
+          end = offset + len;
+
+        if (n == RELAY_IOV + 1 || size >= state.chunk)
+        {
+          if (!sendData(conn, fb, iov, n, size, end))
+            return false;
+          n    = 1;
+          size = 0;
+        }
+      }
+    }
+
+    if (n > 1 && !sendData(conn, fb, iov, n, size, end))
+      return false;
+  }
+
+  ++conn->frames;
+  conn->bytes += sent;
+  return true;
+}
+
+// the remote host never sends anything, this is only to notice it has gone
+static bool connAlive(struct Conn * conn)
+{
+  struct pollfd pfd = { .fd = conn->fd, .events = POLLIN | POLLRDHUP };
+  if (poll(&pfd, 1, 0) <= 0)
+    return true;
+
+  if (pfd.revents & (POLLHUP | POLLRDHUP))
+  {
+    DEBUG_INFO("The remote host disconnected");
+    return false;
+  }
+
+  char discard[256];
+  if ((pfd.revents & POLLIN) && recv(conn->fd, discard, sizeof(discard),
+        MSG_DONTWAIT) == 0)
+  {
+    DEBUG_INFO("The remote host disconnected");
+    return false;
+  }
+
+  return true;
+}
+
+static bool sendHello(struct Conn * conn, const KVMFR * udata,
+    const LGMPMessage * msg)
+{
+  const KVMFRFrame * frame = (const KVMFRFrame *)msg->mem;
+
+  // the remote host can not know how large a later mode will be, give it
+  // the room every frame buffer here has
+  KVMFRRelayHello hello =
+  {
+    .version      = KVMFR_RELAY_VERSION,
+    .kvmfrVersion = udata->version,
+    .maxFrameSize = msg->size - frame->offset - FrameBufferStructSize
+  };
+  memcpy(hello.magic  , KVMFR_RELAY_MAGIC, sizeof(hello.magic  ));
+  memcpy(hello.hostver, udata->hostver   , sizeof(hello.hostver));
+
+  if (!sendMsg(conn, KVMFR_RELAY_HELLO, &hello, sizeof(hello)))
+    return false;
+
+  DEBUG_INFO("Max Frame Size   : %u MiB", hello.maxFrameSize / 1048576);
+  conn->helloSent = true;
+  return true;
+}
+
+static enum ServeResult serve(PLGMPClient lgmp, const KVMFR * udata, int fd)
+{
+  struct Conn conn =
+  {
+    .fd       = fd,
+    .zeroCopy = state.zeroCopy,
+    .needFull = true
+  };
+
+  if (conn.zeroCopy)
+  {
+    const int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0)
+    {
+      DEBUG_WARN("SO_ZEROCOPY is not supported, the frames will be copied");
+      conn.zeroCopy = false;
+    }
+  }
+
+  // subscribe only while a remote host is connected so the host can sleep
+  LGMP_STATUS status;
+  if ((status = lgmpClientSubscribe(lgmp,
+          state.aux ? LGMP_Q_FRAME_AUX : LGMP_Q_FRAME, &conn.frameQueue))
+      != LGMP_OK)
+  {
+    DEBUG_ERROR("lgmpClientSubscribe: %s", lgmpStatusString(status));
+    return SERVE_ERROR;
+  }
+
+  if ((status = lgmpClientSubscribe(lgmp, LGMP_Q_POINTER, &conn.pointerQueue))
+      != LGMP_OK)
+  {
+    DEBUG_WARN("lgmpClientSubscribe: %s, the cursor will not be relayed",
+        lgmpStatusString(status));
+    conn.pointerQueue = NULL;
+  }
+
+  if (udata->cursorPosOffset + sizeof(KVMFRCursorPos) <= state.shmDev.size)
+    conn.cursorPos = (volatile KVMFRCursorPos *)
+      ((uint8_t *)state.shmDev.mem + udata->cursorPosOffset);
+
+  enum ServeResult ret = SERVE_DISCONNECTED;
+  while(state.running)
+  {
+    // the remote host needs the frame size before it can take anything
+    if (conn.helloSent && !sendPointer(&conn))
+      break;
+
+    // frames on the aux queue have no damage to keep in step with
+    if (state.aux)
+      lgmpClientAdvanceToLast(conn.frameQueue);
+
+    LGMPMessage msg;
+    if ((status = lgmpClientProcess(conn.frameQueue, &msg)) != LGMP_OK)
+    {
+      if (status == LGMP_ERR_QUEUE_EMPTY)
+      {
+        if (!connAlive(&conn))
+          break;
+
+        usleep(state.pollInterval);
+        continue;
+      }
+
+      if (status == LGMP_ERR_INVALID_SESSION)
+        ret = SERVE_RESTART;
+      else
+      {
+        DEBUG_ERROR("lgmpClientProcess: %s", lgmpStatusString(status));
+        ret = SERVE_ERROR;
+      }
+      break;
+    }
+
+    const KVMFRFrame  * frame = (const KVMFRFrame *)msg.mem;
+    const FrameBuffer * fb    =
+      (const FrameBuffer *)(((const uint8_t *)frame) + frame->offset);
+
+    const size_t rows = frameRows(frame);
+    if (!rows)
+    {
+      DEBUG_WARN("Unsupported frame type %d, skipping", frame->type);
+      lgmpClientMessageDone(conn.frameQueue);
+      continue;
+    }
+
+    // a repeat is for new clients, the remote host already has the frame
+    if (conn.serialValid && frame->frameSerial == conn.frameSerial &&
+        !conn.needFull)
+    {
+      lgmpClientMessageDone(conn.frameQueue);
+      continue;
+    }
+
+    // a gap in the serials is damage that was never seen
+    if (!conn.serialValid || frame->frameSerial != conn.frameSerial + 1)
+      conn.needFull = true;
+    conn.frameSerial = frame->frameSerial;
+    conn.serialValid = true;
+
+    bool ok = conn.helloSent || sendHello(&conn, udata, &msg);
+    if (ok)
+      ok = sendFrame(&conn, frame, fb, rows * frame->pitch);
+
+    // the kernel may still be sending from the frame buffer
+    if (ok && conn.zcSent != conn.zcDone)
+      ok = connReapZeroCopy(&conn);
+
+    lgmpClientMessageDone(conn.frameQueue);
+    if (!ok)
+      break;
+  }
+
+  DEBUG_INFO("Relayed %" PRIu64 " frames, %" PRIu64 " bytes of frame data",
+      conn.frames, conn.bytes);
+
+  for(int i = 0; i < KVMFR_CURSOR_CACHE; ++i)
+    free(conn.shapes[i].data);
+
+  if (conn.pointerQueue)
+    lgmpClientUnsubscribe(&conn.pointerQueue);
+  lgmpClientUnsubscribe(&conn.frameQueue);
+  return ret;
+}
+
+static int openListen()
+{
+  const char * host = option_get_string("relay", "listen");
+  char port[16];
+  snprintf(port, sizeof(port), "%d", option_get_int("relay", "port"));
+
+  struct addrinfo hints =
+  {
+    .ai_family   = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+    .ai_flags    = AI_PASSIVE
+  };
+
+  struct addrinfo * res;
+  int err;
+  if ((err = getaddrinfo(host, port, &hints, &res)) != 0)
+  {
+    DEBUG_ERROR("Failed to resolve %s: %s", host, gai_strerror(err));
+    return -1;
+  }
+
+  int fd = -1;
+  for(struct addrinfo * ai = res; ai; ai = ai->ai_next)
+  {
+    if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+      continue;
+
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 1) == 0)
+      break;
+
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd < 0)
+  {
+    DEBUG_ERROR("Failed to listen on %s:%s: %s", host, port, strerror(errno));
+    return -1;
+  }
+
+  DEBUG_INFO("Listening on %s:%s", host, port);
+  return fd;
+}
+
+// returns 1 if the host restarted and the session must be opened again
+static int run(int listenFd)
+{
+  PLGMPClient lgmp;
+  uint32_t    udataSize;
+  KVMFR     * udata;
+
+  LGMP_STATUS status;
+  if ((status = lgmpClientInit(state.shmDev.mem, state.shmDev.size, &lgmp))
+      != LGMP_OK)
+  {
+    DEBUG_ERROR("lgmpClientInit: %s", lgmpStatusString(status));
+    return -1;
+  }
+
+  // allow the host to update the timestamp before checking for a session
+  usleep(200000);
+
+  while(state.running)
+  {
+    if ((status = lgmpClientSessionInit(lgmp, &udataSize, (uint8_t **)&udata))
+        == LGMP_OK)
+      break;
+
+    if (status != LGMP_ERR_INVALID_SESSION && status != LGMP_ERR_INVALID_MAGIC)
+    {
+      DEBUG_ERROR("lgmpClientSessionInit: %s", lgmpStatusString(status));
+      lgmpClientFree(&lgmp);
+      return -1;
+    }
+
+    usleep(100000);
+  }
+
+  if (!state.running)
+  {
+    lgmpClientFree(&lgmp);
+    return 0;
+  }
+
+  if (udataSize != sizeof(KVMFR) ||
+      memcmp(udata->magic, KVMFR_MAGIC, sizeof(udata->magic)) != 0 ||
+      udata->version != KVMFR_VERSION)
+  {
+    DEBUG_BREAK();
+    DEBUG_ERROR("The host application is not compatible with this relay");
+    DEBUG_ERROR("Expected KVMFR version %d", KVMFR_VERSION);
+    DEBUG_BREAK();
+    lgmpClientFree(&lgmp);
+    return -1;
+  }
+
+  char hostver[sizeof(udata->hostver) + 1];
+  memcpy(hostver, udata->hostver, sizeof(udata->hostver));
+  hostver[sizeof(udata->hostver)] = '\0';
+  DEBUG_INFO("Host version: %s", hostver);
+
+  int ret = 0;
+  while(state.running)
+  {
+    if (!lgmpClientSessionValid(lgmp))
+    {
+      DEBUG_INFO("The host restarted");
+      ret = 1;
+      break;
+    }
+
+    struct pollfd pfd = { .fd = listenFd, .events = POLLIN };
+    if (poll(&pfd, 1, 1000) <= 0)
+      continue;
+
+    struct sockaddr_storage addr;
+    socklen_t addrLen = sizeof(addr);
+    const int fd = accept(listenFd, (struct sockaddr *)&addr, &addrLen);
+    if (fd < 0)
+      continue;
+
+    char name[NI_MAXHOST], port[NI_MAXSERV];
+    if (getnameinfo((struct sockaddr *)&addr, addrLen, name, sizeof(name),
+          port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+      strcpy(name, "unknown");
+    DEBUG_INFO("Remote host connected: %s", name);
+
+    // the cursor and small updates must not wait for more data
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    const enum ServeResult result = serve(lgmp, udata, fd);
+    close(fd);
+
+    if (result == SERVE_RESTART)
+    {
+      DEBUG_INFO("The host restarted");
+      ret = 1;
+      break;
+    }
+
+    if (result == SERVE_ERROR)
+    {
+      ret = -1;
+      break;
+    }
+  }
+
+  lgmpClientFree(&lgmp);
+  return ret;
+}
+
+int main(int argc, char * argv[])
+{
+  DEBUG_INFO("Looking Glass (" BUILD_VERSION ") - Relay");
+
+  if (!installCrashHandler("/proc/self/exe"))
+    DEBUG_WARN("Failed to install the crash handler");
+
+  option_register(options);
+  ivshmemOptionsInit();
+
+  if (!config_load(argc, argv))
+  {
+    option_free();
+    return -1;
+  }
+
+  // init the global state vars
+  state.running      = true;
+  state.chunk        = (size_t)option_get_int("relay", "chunk") * 1024;
+  state.pollInterval = option_get_int("relay", "pollInterval");
+  state.aux          = strcmp(option_get_string("relay", "queue"), "aux") == 0;
+  state.zeroCopy     = option_get_bool("relay", "zeroCopy");
+  signal(SIGINT , signalHandler);
+  signal(SIGTERM, signalHandler);
+
+  if (option_get_bool("relay", "compress") &&
+      !tileenc_new(&state.encoder, option_get_int("relay", "threads")))
+  {
+    option_free();
+    return -1;
+  }
+
+  int ret = -1;
+  const int listenFd = openListen();
+  if (listenFd >= 0 && ivshmemOpen(&state.shmDev))
+  {
+    while((ret = run(listenFd)) == 1 && state.running) {}
+    if (ret == 1)
+      ret = 0;
+  }
+
+  if (listenFd >= 0)
+    close(listenFd);
+  ivshmemClose(&state.shmDev);
+  tileenc_free(&state.encoder);
+  option_free();
+  return ret;
+}